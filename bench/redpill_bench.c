@@ -0,0 +1,295 @@
+/**
+ * Benchmark of override_symbol() & memory helpers (built as a separate redpill_bench.ko with "make bench")
+ *
+ * The module runs all benchmarks when loaded, prints results to the kernel log and stays loaded doing nothing (unload
+ * it with rmmod). It overrides rp_bench_target(), a dummy function exported by this module, and calls it from kthreads
+ * pinned to different CPUs. Every multi-threaded benchmark is repeated for 1, 2, 4... threads up to "threads" param
+ * (default: all online CPUs) to show how the cost scales with cores contending for the same symbol:
+ *   direct    calling the target without any override (the baseline)
+ *   detour    calling the target overridden with override_symbol_detour(); the shim calls the original through the
+ *             relocated prologue stub
+ *   classic   calling the target overridden with override_symbol(); the shim calls the original by unpatching and
+ *             repatching the code every time. This one is ALWAYS single-threaded: with more CPUs one of them could
+ *             execute the trampoline while another one is rewriting it (this is the reason detours exist).
+ *   toggle    __disable_symbol_override() + __enable_symbol_override() pairs while nothing executes the target, i.e.
+ *             the cost of the lock & the write window (contended when more threads do it at once)
+ *   tlb       set_mem_addr_rw() + set_mem_addr_ro() pairs on a private page; the latter flushes the TLB on all CPUs,
+ *             so it's single-threaded and only shows how the cost of the shootdown grows with the number of CPUs
+ *
+ * Results are reported as an average ns per operation over all threads and the same for the slowest thread (the
+ * difference between the two is the contention/unfairness).
+ */
+#include "../common.h"
+#include "../internal/override/override_symbol.h" //override_symbol(), call_overridden_symbol()
+#include "../internal/helper/memory_helper.h" //set_mem_addr_rw(), set_mem_addr_ro()
+#include <linux/moduleparam.h> //module_param_named()
+#include <linux/kthread.h> //kthread_create(), kthread_bind(), kthread_stop()
+#include <linux/completion.h> //struct completion, init_completion(), wait_for_completion()
+#include <linux/atomic.h> //atomic_t
+#include <linux/percpu.h> //DEFINE_PER_CPU, this_cpu_inc()
+#include <linux/ktime.h> //ktime_get(), ktime_to_ns()
+#include <linux/math64.h> //div64_u64()
+#include <linux/cpumask.h> //for_each_online_cpu(), num_online_cpus()
+
+#define BENCH_TARGET_NAME "rp_bench_target"
+#define BENCH_MAX_THREADS 64
+
+static unsigned int threads_max = 0;
+module_param_named(threads, threads_max, uint, 0000);
+MODULE_PARM_DESC(threads, "Max number of benchmark threads (0 = all online CPUs)");
+
+static unsigned int iterations = 1000000;
+module_param_named(iterations, iterations, uint, 0000);
+MODULE_PARM_DESC(iterations, "Number of operations per thread (divided by 100 for toggle & tlb)");
+
+typedef void (bench_fn)(unsigned int count);
+
+struct bench_thread {
+    struct task_struct *task;
+    bench_fn *fn;
+    u64 ns;
+};
+
+static struct override_symbol_inst *bench_ovs = NULL;
+static DEFINE_PER_CPU(unsigned long, target_hits);
+static DEFINE_PER_CPU(unsigned long, shim_hits);
+static char tlb_page[PAGE_SIZE] __aligned(PAGE_SIZE); //nothing else lives on this page, so it can be made R/O safely
+
+static struct bench_thread threads[BENCH_MAX_THREADS];
+static atomic_t threads_ready;
+static atomic_t threads_running;
+static bool threads_go;
+static DECLARE_COMPLETION(threads_done);
+
+/**
+ * The dummy function being overridden
+ *
+ * It must be long enough to fit the trampoline and its prologue must be relocatable for the detour - NOPs guarantee
+ * both regardless of what the compiler does with the rest.
+ */
+noinline int rp_bench_target(int val)
+{
+    asm volatile(".rept 16\n\tnop\n\t.endr");
+    this_cpu_inc(target_hits);
+    return val + 1;
+}
+EXPORT_SYMBOL(rp_bench_target);
+
+static int (*volatile call_target)(int) = rp_bench_target; //volatile so that calls cannot be inlined or elided
+
+static int rp_bench_shim(int val)
+{
+    int out;
+    this_cpu_inc(shim_hits);
+    call_overridden_symbol(out, bench_ovs, val);
+    return out;
+}
+
+static unsigned long sum_hits(unsigned long __percpu *hits)
+{
+    unsigned long sum = 0;
+    int cpu;
+    for_each_possible_cpu(cpu)
+        sum += *per_cpu_ptr(hits, cpu);
+
+    return sum;
+}
+
+static void reset_hits(void)
+{
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        *per_cpu_ptr(&target_hits, cpu) = 0;
+        *per_cpu_ptr(&shim_hits, cpu) = 0;
+    }
+}
+
+/******************************************************* Workloads ****************************************************/
+static void bench_calls(unsigned int count)
+{
+    int val = 0;
+    for (unsigned int i = 0; i < count; ++i)
+        val = call_target(val);
+}
+
+static void bench_toggle(unsigned int count)
+{
+    for (unsigned int i = 0; i < count; ++i) {
+        __disable_symbol_override(bench_ovs);
+        __enable_symbol_override(bench_ovs);
+    }
+}
+
+static void bench_tlb(unsigned int count)
+{
+    for (unsigned int i = 0; i < count; ++i) {
+        set_mem_addr_rw((unsigned long)tlb_page, PAGE_SIZE);
+        set_mem_addr_ro((unsigned long)tlb_page, PAGE_SIZE);
+    }
+
+    set_mem_addr_rw((unsigned long)tlb_page, PAGE_SIZE); //it's a .bss page - leave it as it was
+}
+
+/******************************************************** Runner ******************************************************/
+static int bench_thread_fn(void *data)
+{
+    struct bench_thread *thread = data;
+    unsigned int count = thread->fn == bench_calls ? iterations : max(iterations / 100, 1U);
+
+    //All threads start at once so that they really contend with each other
+    atomic_inc(&threads_ready);
+    while (!ACCESS_ONCE(threads_go))
+        cond_resched(); //one of the threads shares the CPU with the runner which still needs to start others
+
+    ktime_t start = ktime_get();
+    thread->fn(count);
+    thread->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    if (atomic_dec_and_test(&threads_running))
+        complete(&threads_done);
+
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+    }
+
+    return 0;
+}
+
+/**
+ * Runs a workload on "num" threads bound to different CPUs and prints its results
+ *
+ * @return 0 on success, -E on error
+ */
+static int run_bench(const char *name, bench_fn *fn, unsigned int num)
+{
+    unsigned int started = 0;
+    int cpu, out = 0;
+
+    memset(threads, 0, sizeof(threads));
+    atomic_set(&threads_ready, 0);
+    atomic_set(&threads_running, num);
+    ACCESS_ONCE(threads_go) = false;
+    init_completion(&threads_done); //reinit_completion() doesn't exist before v3.13
+
+    for_each_online_cpu(cpu) {
+        if (started == num)
+            break;
+
+        struct bench_thread *thread = &threads[started];
+        thread->fn = fn;
+        thread->task = kthread_create(bench_thread_fn, thread, "rp_bench/%d", cpu);
+        if (IS_ERR(thread->task)) {
+            out = PTR_ERR(thread->task);
+            pr_loc_err("Failed to start benchmark thread on CPU%d - error=%d", cpu, out);
+            thread->task = NULL;
+            break;
+        }
+
+        kthread_bind(thread->task, cpu);
+        wake_up_process(thread->task);
+        ++started;
+    }
+
+    if (out == 0) {
+        while (atomic_read(&threads_ready) < num)
+            schedule();
+
+        ACCESS_ONCE(threads_go) = true;
+        wait_for_completion(&threads_done);
+    } else {
+        ACCESS_ONCE(threads_go) = true; //let the ones already started finish; nobody will wait for the completion
+    }
+
+    u64 total_ns = 0, slowest_ns = 0;
+    for (unsigned int i = 0; i < started; ++i) {
+        kthread_stop(threads[i].task);
+        total_ns += threads[i].ns;
+        slowest_ns = max(slowest_ns, threads[i].ns);
+    }
+
+    if (out != 0)
+        return out;
+
+    //Reported in 1/100 of ns per op
+    u64 ops = fn == bench_calls ? iterations : max(iterations / 100, 1U);
+    u64 avg = div64_u64(total_ns * 100, ops * num);
+    u64 slowest = div64_u64(slowest_ns * 100, ops);
+    pr_loc_inf("%-8s threads=%-3u %8llu.%02llu ns/op (slowest thread %llu.%02llu ns/op)", name, num, avg / 100,
+               avg % 100, slowest / 100, slowest % 100);
+
+    return 0;
+}
+
+/**
+ * Runs a workload for 1, 2, 4... threads up to max_threads
+ */
+static int run_bench_scaling(const char *name, bench_fn *fn, unsigned int max_threads)
+{
+    int out;
+    for (unsigned int num = 1; ; num = min(num * 2, max_threads)) {
+        if ((out = run_bench(name, fn, num)) != 0)
+            return out;
+
+        if (num == max_threads)
+            return 0;
+    }
+}
+
+static int __init init_(void)
+{
+    int out;
+    unsigned int max_threads = threads_max ? threads_max : num_online_cpus();
+    max_threads = clamp(max_threads, 1U, min_t(unsigned int, num_online_cpus(), BENCH_MAX_THREADS));
+
+    pr_loc_inf("Running override_symbol() benchmark with up to %u threads, %u iterations", max_threads, iterations);
+
+    if ((out = run_bench_scaling("direct", bench_calls, max_threads)) != 0)
+        return out;
+
+    reset_hits();
+    bench_ovs = override_symbol_detour(BENCH_TARGET_NAME, rp_bench_shim);
+    if (IS_ERR(bench_ovs)) {
+        out = PTR_ERR(bench_ovs);
+        pr_loc_err("Failed to override %s() with detour - error=%d", BENCH_TARGET_NAME, out);
+        bench_ovs = NULL;
+        return out;
+    }
+
+    if (!__get_detour_ptr(bench_ovs))
+        pr_loc_wrn("%s() couldn't use detour - \"detour\" results are for the classic override", BENCH_TARGET_NAME);
+
+    out = run_bench_scaling("detour", bench_calls, max_threads);
+    restore_symbol(bench_ovs);
+    bench_ovs = NULL;
+    if (out != 0)
+        return out;
+    if (sum_hits(&shim_hits) != sum_hits(&target_hits))
+        pr_loc_wrn("Detour lost calls: shim=%lu target=%lu", sum_hits(&shim_hits), sum_hits(&target_hits));
+
+    reset_hits();
+    override_symbol_or_exit_int(bench_ovs, BENCH_TARGET_NAME, rp_bench_shim);
+    if ((out = run_bench("classic", bench_calls, 1)) == 0)
+        out = run_bench_scaling("toggle", bench_toggle, max_threads);
+    restore_symbol(bench_ovs);
+    bench_ovs = NULL;
+    if (out != 0)
+        return out;
+
+    if ((out = run_bench("tlb", bench_tlb, 1)) != 0)
+        return out;
+
+    pr_loc_inf("Benchmark finished (on %u online CPUs) - you can unload the module now", num_online_cpus());
+    return 0;
+}
+module_init(init_);
+
+static void __exit cleanup_(void)
+{
+}
+module_exit(cleanup_);
+
+MODULE_AUTHOR("TTG");
+MODULE_LICENSE("GPL");
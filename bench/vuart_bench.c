@@ -0,0 +1,316 @@
+/**
+ * Throughput & latency benchmark of the virtual UART (built as redpill_vuart_bench.ko with "make bench-vuart")
+ *
+ * The module adds a vUART on "line" (default ttyS1) when loaded and is driven from the userspace by tools/vuart_bench
+ * through <debugfs>/redpill/vuart_bench. The vIRQ backend is chosen at build time with VUART_BACKEND=tasklet (default),
+ * thread (VUART_USE_VIRQ_THREAD) or timer (VUART_USE_TIMER_FALLBACK), so that every one of them can be measured.
+ *
+ * Data in both directions is sent as packets of a fixed size starting with a little-endian 64-bit CLOCK_MONOTONIC
+ * timestamp (in ns) of when the packet was sent. Latency of a packet is measured when its last byte arrives.
+ * Commands written to the control file:
+ *   tx <threshold> <packet_size>   (re)sets the TX callback with a given threshold & resets TX stats; userspace then
+ *                                  writes packets to the tty and the callback measures them
+ *   rx <packet_size> <packets>     injects packets with vuart_inject_rx() from a kthread (as fast as the FIFO drains);
+ *                                  the userspace reads them from the tty and measures the latency itself
+ * Reading the file returns results as "key=value" lines, so that they can be merged with the userspace ones.
+ */
+#include "../common.h"
+#include "../internal/uart/virtual_uart.h" //vuart_add_device(), vuart_set_tx_callback(), vuart_inject_rx()
+#include "../internal/helper/debugfs_helper.h" //get_rp_debugfs_dir(), put_rp_debugfs_dir()
+#include <linux/moduleparam.h> //module_param_named()
+#include <linux/kthread.h> //kthread_run()
+#include <linux/ktime.h> //ktime_get(), ktime_to_ns()
+#include <linux/delay.h> //usleep_range()
+#include <linux/math64.h> //div64_u64()
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+#include <linux/uaccess.h> //copy_from_user()
+
+#if defined(VUART_USE_TIMER_FALLBACK)
+#define VUART_BENCH_BACKEND "timer"
+#elif defined(VUART_USE_VIRQ_THREAD)
+#define VUART_BENCH_BACKEND "thread"
+#else
+#define VUART_BENCH_BACKEND "tasklet"
+#endif
+
+#define VUART_BENCH_FILE "vuart_bench"
+#define VUART_BENCH_TS_LEN sizeof(u64)
+#define VUART_BENCH_MAX_PACKET 4096
+#define VUART_BENCH_CMD_MAX 64
+
+static int line = 1;
+module_param_named(line, line, int, 0000);
+MODULE_PARM_DESC(line, "ttyS# to replace with vUART");
+
+static unsigned int fifo_depth = 0;
+module_param_named(fifo_depth, fifo_depth, uint, 0000);
+MODULE_PARM_DESC(fifo_depth, "vUART FIFO depth (0 = VUART_FIFO_LEN)");
+
+struct lat_stats {
+    u64 count;
+    u64 sum_ns;
+    u64 min_ns;
+    u64 max_ns;
+};
+
+//TX side is updated only from the callback (=with vdev lock held)
+static struct {
+    int threshold;
+    unsigned int packet_size;
+    unsigned int pos; //position in the current packet
+    u64 ts; //timestamp of the current packet being assembled
+    u64 bytes;
+    u64 callbacks;
+    u64 callbacks_by_reason[VUART_FLUSH_FULL + 1];
+    ktime_t first;
+    ktime_t last;
+    struct lat_stats lat;
+} tx;
+
+static struct {
+    unsigned int packet_size;
+    unsigned int packets;
+    u64 bytes;
+    u64 retries; //vuart_inject_rx() couldn't take anything
+    u64 ns;
+    struct task_struct *task;
+    bool done;
+} rx;
+
+static char tx_buffer[VUART_FIFO_LEN];
+static char rx_packet[VUART_BENCH_MAX_PACKET]; //only used by the RX thread (there's at most one)
+static DEFINE_MUTEX(cmd_lock);
+static struct dentry *bench_file = NULL;
+
+static inline void lat_record(struct lat_stats *lat, u64 ns)
+{
+    if (!lat->count || ns < lat->min_ns)
+        lat->min_ns = ns;
+    if (ns > lat->max_ns)
+        lat->max_ns = ns;
+    lat->sum_ns += ns;
+    ++lat->count;
+}
+
+/******************************************************** TX side *****************************************************/
+static void bench_tx_callback(int cb_line, const char *buffer, unsigned int len, vuart_flush_reason reason)
+{
+    ktime_t now = ktime_get();
+
+    if (!tx.bytes)
+        tx.first = now;
+    tx.last = now;
+    tx.bytes += len;
+    ++tx.callbacks;
+    ++tx.callbacks_by_reason[reason];
+
+    for (unsigned int i = 0; i < len; ++i, ++tx.pos) {
+        if (tx.pos == tx.packet_size) {
+            tx.pos = 0;
+            tx.ts = 0;
+        }
+
+        if (tx.pos < VUART_BENCH_TS_LEN)
+            tx.ts |= (u64)(unsigned char)buffer[i] << (8 * tx.pos);
+
+        if (tx.pos == tx.packet_size - 1)
+            lat_record(&tx.lat, ktime_to_ns(now) - tx.ts);
+    }
+}
+
+static int start_tx(int threshold, unsigned int packet_size)
+{
+    int out = vuart_set_tx_callback(line, NULL, NULL, 0); //stats are touched by the callback
+    if (out != 0)
+        return out;
+
+    memset(&tx, 0, sizeof(tx));
+    tx.threshold = threshold;
+    tx.packet_size = packet_size;
+
+    return vuart_set_tx_callback(line, bench_tx_callback, tx_buffer, threshold);
+}
+
+/******************************************************** RX side *****************************************************/
+static int rx_thread(void *data)
+{
+    char *packet = rx_packet;
+    for (unsigned int i = 0; i < rx.packet_size; ++i)
+        packet[i] = (char)i;
+
+    ktime_t start = ktime_get();
+    for (unsigned int p = 0; p < rx.packets && !kthread_should_stop(); ++p) {
+        u64 ts = ktime_to_ns(ktime_get());
+        for (unsigned int b = 0; b < VUART_BENCH_TS_LEN; ++b)
+            packet[b] = (char)(ts >> (8 * b));
+
+        unsigned int off = 0;
+        while (off < rx.packet_size && !kthread_should_stop()) {
+            int put = vuart_inject_rx(line, packet + off, min(rx.packet_size - off, fifo_depth));
+            if (unlikely(put < 0)) {
+                pr_loc_err("Failed to inject RX data - error=%d", put);
+                goto out_done;
+            }
+
+            if (put == 0) {
+                ++rx.retries;
+                usleep_range(10, 20); //FIFO full - let the 8250 driver pick the data up
+                continue;
+            }
+
+            off += put;
+            rx.bytes += put;
+        }
+    }
+
+    out_done:
+    rx.ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    ACCESS_ONCE(rx.done) = true;
+
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+    }
+
+    return 0;
+}
+
+static void stop_rx(void)
+{
+    if (!rx.task)
+        return;
+
+    kthread_stop(rx.task);
+    rx.task = NULL;
+}
+
+static int start_rx(unsigned int packet_size, unsigned int packets)
+{
+    stop_rx();
+    memset(&rx, 0, sizeof(rx));
+    rx.packet_size = packet_size;
+    rx.packets = packets;
+
+    rx.task = kthread_run(rx_thread, NULL, "rp_vuart_bench");
+    if (IS_ERR(rx.task)) {
+        int out = PTR_ERR(rx.task);
+        rx.task = NULL;
+        return out;
+    }
+
+    return 0;
+}
+
+/******************************************************** Control *****************************************************/
+static int vuart_bench_show(struct seq_file *m, void *v)
+{
+    u64 tx_ns = tx.bytes ? ktime_to_ns(ktime_sub(tx.last, tx.first)) : 0;
+
+    seq_printf(m, "backend=%s\nline=%d\nfifo_depth=%u\n", VUART_BENCH_BACKEND, line, fifo_depth);
+    seq_printf(m, "tx_threshold=%d\ntx_packet_size=%u\ntx_bytes=%llu\ntx_ns=%llu\ntx_callbacks=%llu\n",
+               tx.threshold, tx.packet_size, tx.bytes, tx_ns, tx.callbacks);
+    seq_printf(m, "tx_callbacks_threshold=%llu\ntx_callbacks_idle=%llu\ntx_callbacks_full=%llu\n",
+               tx.callbacks_by_reason[VUART_FLUSH_THRESHOLD], tx.callbacks_by_reason[VUART_FLUSH_IDLE],
+               tx.callbacks_by_reason[VUART_FLUSH_FULL]);
+    seq_printf(m, "tx_packets=%llu\ntx_lat_ns_min=%llu\ntx_lat_ns_avg=%llu\ntx_lat_ns_max=%llu\n", tx.lat.count,
+               tx.lat.min_ns, tx.lat.count ? div64_u64(tx.lat.sum_ns, tx.lat.count) : 0, tx.lat.max_ns);
+    seq_printf(m, "rx_packet_size=%u\nrx_packets=%u\nrx_bytes=%llu\nrx_ns=%llu\nrx_retries=%llu\nrx_done=%d\n",
+               rx.packet_size, rx.packets, rx.bytes, rx.ns, rx.retries, ACCESS_ONCE(rx.done) ? 1 : 0);
+
+    return 0;
+}
+
+static int vuart_bench_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, vuart_bench_show, NULL);
+}
+
+static ssize_t vuart_bench_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
+{
+    char cmd[VUART_BENCH_CMD_MAX];
+    unsigned int arg1, arg2;
+    int out;
+
+    if (unlikely(len >= sizeof(cmd)))
+        return -EINVAL;
+
+    if (copy_from_user(cmd, buf, len))
+        return -EFAULT;
+    cmd[len] = '\0';
+
+    mutex_lock(&cmd_lock);
+    if (sscanf(cmd, "tx %u %u", &arg1, &arg2) == 2 && arg2 >= VUART_BENCH_TS_LEN && arg2 <= VUART_BENCH_MAX_PACKET) {
+        out = start_tx(arg1, arg2);
+    } else if (sscanf(cmd, "rx %u %u", &arg1, &arg2) == 2 && arg1 >= VUART_BENCH_TS_LEN &&
+               arg1 <= VUART_BENCH_MAX_PACKET) {
+        out = start_rx(arg1, arg2);
+    } else {
+        pr_loc_err("Invalid %s command \"%s\" - expected \"tx <threshold> <packet_size>\" or "
+                   "\"rx <packet_size> <packets>\" (packet size %zu-%d)", VUART_BENCH_FILE, strim(cmd),
+                   VUART_BENCH_TS_LEN, VUART_BENCH_MAX_PACKET);
+        out = -EINVAL;
+    }
+    mutex_unlock(&cmd_lock);
+
+    return out == 0 ? len : out;
+}
+
+static const struct file_operations vuart_bench_fops = {
+    .owner = THIS_MODULE,
+    .open = vuart_bench_open,
+    .read = seq_read,
+    .write = vuart_bench_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int __init init_(void)
+{
+    int out;
+
+    if (!fifo_depth)
+        fifo_depth = VUART_FIFO_LEN;
+
+    struct dentry *dir = get_rp_debugfs_dir();
+    if (!dir) {
+        pr_loc_err("debugfs is required for the vUART benchmark");
+        return -ENODEV;
+    }
+
+    if ((out = vuart_set_fifo_depth(line, fifo_depth)) != 0 || (out = vuart_add_device(line)) != 0)
+        goto error_put;
+
+    bench_file = debugfs_create_file(VUART_BENCH_FILE, 0600, dir, NULL, &vuart_bench_fops);
+    if (IS_ERR_OR_NULL(bench_file)) {
+        pr_loc_err("Failed to create debugfs file %s", VUART_BENCH_FILE);
+        bench_file = NULL;
+        out = -ENOMEM;
+        goto error_remove;
+    }
+
+    pr_loc_inf("vUART benchmark (%s backend) ready on ttyS%d with %u byte FIFO", VUART_BENCH_BACKEND, line,
+               fifo_depth);
+    return 0;
+
+    error_remove:
+    vuart_remove_device(line);
+    error_put:
+    put_rp_debugfs_dir();
+    return out;
+}
+module_init(init_);
+
+static void __exit cleanup_(void)
+{
+    debugfs_remove(bench_file);
+    stop_rx();
+    vuart_remove_device(line);
+    put_rp_debugfs_dir();
+}
+module_exit(cleanup_);
+
+MODULE_AUTHOR("TTG");
+MODULE_LICENSE("GPL");
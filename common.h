@@ -14,7 +14,8 @@
 //Print A LOT of vUART debug messages
 //#define VUART_DEBUG_LOG
 
-//Enabled printing of all ioctl() calls (hooked or not)
+//Enabled printing of all ioctl() calls (hooked or not) from the start; it can also be switched on at runtime with
+// "smart_ioctl" debug key (see internal/helper/debug_keys.h)
 //#define DBG_SMART_PRINT_ALL_IOCTL
 
 //Normally GetHwCapability calls (checking what hardware supports) are responded internally. Setting this DBG adds log
@@ -23,7 +24,7 @@
 // proxied to the original GetHwCapability
 //#define DBG_HWCAP
 
-//Debug all hardware monitoring features (shim/bios/bios_hwmon_shim.c)
+//Debug all hardware monitoring features (shim/bios/bios_hwmon_shim.c) from the start; same as "hwmon" debug key
 //#define DBG_HWMON
 /**********************************************************************************************************************/
 
@@ -0,0 +1,163 @@
+/**
+ * Thin replacement of kernel APIs used by pure-logic units, so that they can be built in the userspace (see "host-lib"
+ * target in the Makefile)
+ *
+ * Units which are meant to be built on the host include this header instead of common.h & kernel headers when
+ * __KERNEL__ is not defined. Only what these units really use is provided here - if a unit needs more than types,
+ * string & number parsing functions and logging it most likely isn't "pure logic".
+ */
+#ifndef REDPILL_HOST_KERNEL_H
+#define REDPILL_HOST_KERNEL_H
+
+#ifdef __KERNEL__
+#error "compat/host/host_kernel.h cannot be used in the kernel - include common.h instead"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE //strchrnul(), strsep()
+#endif
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/types.h> //ssize_t
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define noinline __attribute__((noinline))
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+#define __init
+#define __initconst
+#define __initdata
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2*!!(condition)]))
+#define strlen_static(param) (sizeof(param)-1) //common.h
+
+#define pr_loc_crt(fmt, ...) fprintf(stderr, "CRT: " fmt "\n", ##__VA_ARGS__)
+#define pr_loc_err(fmt, ...) fprintf(stderr, "ERR: " fmt "\n", ##__VA_ARGS__)
+#define pr_loc_inf(fmt, ...) fprintf(stderr, "INF: " fmt "\n", ##__VA_ARGS__)
+#define pr_loc_wrn(fmt, ...) fprintf(stderr, "WRN: " fmt "\n", ##__VA_ARGS__)
+#define pr_loc_dbg(fmt, ...) do { } while(0)
+#define pr_loc_bug(fmt, ...) fprintf(stderr, "BUG: " fmt "\n", ##__VA_ARGS__)
+
+#define ATA_SECT_SIZE 512 //linux/ata.h
+
+//lib/kstrtox.c: the whole string (except a single trailing newline) must be a number, without leading whitespace
+static inline int kstrtoull(const char *s, unsigned int base, unsigned long long *res)
+{
+    if (*s == '+')
+        ++s;
+    if (!isalnum((unsigned char)*s)) //strtoull() would accept whitespace & another sign
+        return -EINVAL;
+
+    char *end;
+    errno = 0;
+    unsigned long long val = strtoull(s, &end, base);
+    if (errno == ERANGE)
+        return -ERANGE;
+    if (end == s || (*end != '\0' && !(*end == '\n' && end[1] == '\0')))
+        return -EINVAL;
+
+    *res = val;
+    return 0;
+}
+
+static inline int kstrtoll(const char *s, unsigned int base, long long *res)
+{
+    unsigned long long val;
+    int out;
+
+    if (*s == '-') {
+        if ((out = kstrtoull(s + 1, base, &val)) != 0)
+            return out;
+        if (val > (unsigned long long)LLONG_MAX + 1)
+            return -ERANGE;
+        *res = (long long)(0ULL - val);
+        return 0;
+    }
+
+    if ((out = kstrtoull(s, base, &val)) != 0)
+        return out;
+    if (val > LLONG_MAX)
+        return -ERANGE;
+    *res = (long long)val;
+    return 0;
+}
+
+static inline int kstrtouint(const char *s, unsigned int base, unsigned int *res)
+{
+    unsigned long long val;
+    int out = kstrtoull(s, base, &val);
+    if (out != 0)
+        return out;
+    if (val > UINT_MAX)
+        return -ERANGE;
+
+    *res = (unsigned int)val;
+    return 0;
+}
+
+#define simple_strtol(cp, endp, base) strtol((cp), (endp), (base))
+
+//lib/string.c: always NULL-terminates; returns -E2BIG if the source was truncated
+static inline ssize_t strscpy(char *dest, const char *src, size_t count)
+{
+    if (count == 0)
+        return -E2BIG;
+
+    size_t len = strnlen(src, count);
+    if (len == count) {
+        memcpy(dest, src, count - 1);
+        dest[count - 1] = '\0';
+        return -E2BIG;
+    }
+
+    memcpy(dest, src, len + 1);
+    return len;
+}
+
+//lib/hexdump.c
+static inline int hex_to_bin(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    ch = tolower((unsigned char)ch);
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    return -1;
+}
+
+static inline int hex2bin(u8 *dst, const char *src, size_t count)
+{
+    while (count--) {
+        int hi = hex_to_bin(*src++);
+        if (hi < 0)
+            return -EINVAL;
+        int lo = hex_to_bin(*src++);
+        if (lo < 0)
+            return -EINVAL;
+
+        *dst++ = (hi << 4) | lo;
+    }
+
+    return 0;
+}
+
+#endif //REDPILL_HOST_KERNEL_H
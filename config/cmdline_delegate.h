@@ -3,6 +3,10 @@
 
 #include "runtime_config.h"
 #include "cmdline_opts.h"
+#include <linux/jhash.h> //jhash()
+
+//Hash of cmdline token keys stored in struct cmdline_token (lookups of tokens must use the same one)
+#define cmdline_token_hash(key, len) jhash((key), (len), 0)
 
 /**
  * Provides an easy access to kernel cmdline
@@ -23,6 +27,7 @@ long get_kernel_cmdline(char *cmdline_out, unsigned long maxlen);
  * Extracts & processes parameters from kernel cmdline
  *
  * Note: it's not guaranteed that the config will be valid. Check runtime_config.h.
+ * This function is __init - it can only be called while the module is loading (get_kernel_cmdline() can be used later).
  *
  * @param config pointer to save configuration
  */
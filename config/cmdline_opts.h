@@ -16,6 +16,22 @@
 #define CMDLINE_CT_MFG "mfg" //VID & PID override will use force-reinstall VID/PID combo
 #define CMDLINE_CT_MFG "mfg" //VID & PID override will use force-reinstall VID/PID combo
 #define CMDLINE_CT_DOM_SZMAX "dom_szmax=" //Max size of SATA device (MiB) to be considered a DOM (usually you should NOT use this)
+//Boot device candidate (can be repeated, in the order of priority); replaces vid/pid/dom_szmax/synoboot_satadom:
+// usb:<vid>:<pid>[:<serial>], satadom:<max MiB>[:<serial>] or satadisk:<max MiB>[:<serial>] (vid & pid are hex)
+#define CMDLINE_CT_BOOT_DEV "boot_dev="
+#  define CMDLINE_CT_BOOT_DEV_USB "usb:"
+#  define CMDLINE_CT_BOOT_DEV_SATADOM "satadom:"
+#  define CMDLINE_CT_BOOT_DEV_SATADISK "satadisk:"
+//Disks to present to DSM as SATA SSDs (e.g. to make them eligible for SSD cache), comma-separated list of selectors:
+// nonrot (disks reporting they're SSDs), host:<SCSI host driver>, model:<SCSI model prefix> or serial:<unit serial>
+// Only the SSD (nonrot) flag is per disk: the SATA port type is set in the host template of the disk's driver, so a
+// disk matched by ANY selector moves every disk behind every HBA of its driver to SATA ports as well
+#define CMDLINE_CT_SSD_CACHE "ssd_cache="
+#  define CMDLINE_CT_SSD_CACHE_SEP ','
+#  define CMDLINE_CT_SSD_CACHE_NONROT "nonrot"
+#  define CMDLINE_CT_SSD_CACHE_HOST "host:"
+#  define CMDLINE_CT_SSD_CACHE_MODEL "model:"
+#  define CMDLINE_CT_SSD_CACHE_SERIAL "serial:"
 
 //Standard Linux cmdline tokens
 #define CMDLINE_KT_ELEVATOR  "elevator=" //Sets I/O scheduler (we use it to load RP LKM earlier than normally possible)
@@ -0,0 +1,437 @@
+#include "cmdline_parser.h"
+#ifdef __KERNEL__
+#include "../common.h" //commonly used headers in this module
+#endif
+
+/**
+ * Extracts device model (syno_hw_version=<string>) from kernel cmd line
+ *
+ * @param config config to save model to
+ * @param value value of the currently processed token
+ */
+static void __init extract_hw(struct runtime_config *config, const char *value)
+{
+    if (strscpy((char *)config->hw, value, sizeof(syno_hw)) < 0)
+        pr_loc_wrn("HW version truncated to %zu", sizeof(syno_hw)-1);
+
+    pr_loc_dbg("HW version set to: %s", (char *)config->hw);
+}
+
+/**
+ * Extracts serial number (sn=<string>) from kernel cmd line
+ *
+ * @param config config to save s/n to
+ * @param value value of the currently processed token
+ */
+static void __init extract_sn(struct runtime_config *config, const char *value)
+{
+    if(strscpy((char *)config->sn, value, sizeof(serial_no)) < 0)
+        pr_loc_wrn("S/N truncated to %zu", sizeof(serial_no)-1);
+
+    pr_loc_dbg("S/N set to: %s", (char *)config->sn);
+}
+
+static void __init extract_boot_media_type(struct runtime_config *config, const char *value)
+{
+    switch (value[0]) {
+        case CMDLINE_KT_SATADOM_NATIVE:
+            config->boot_media.type = BOOT_MEDIA_SATA_DOM;
+            pr_loc_dbg("Boot media SATADOM (native) requested");
+            break;
+
+        case CMDLINE_KT_SATADOM_FAKE:
+            config->boot_media.type = BOOT_MEDIA_SATA_DISK;
+            pr_loc_dbg("Boot media SATADISK (fake) requested");
+            break;
+
+        case CMDLINE_KT_SATADOM_DISABLED:
+            //There's no point to set that option but it's not an error
+            pr_loc_wrn("SATA-based boot media disabled (default will be used, %s0 is a noop)", CMDLINE_KT_SATADOM);
+            break;
+
+        default:
+            pr_loc_err("Option \"%s%c\" is invalid (value should be 0/1/2)", CMDLINE_KT_SATADOM, value[0]);
+    }
+}
+
+/**
+ * Parses VID/PID override value
+ *
+ * @param id pointer to save VID/PID
+ * @param name name of the option (for messages)
+ * @param value value of the currently processed token
+ */
+static void __init extract_device_id(device_id *id, const char *name, const char *value)
+{
+    long long numeric_param;
+    int tmp_call_res = kstrtoll(value, 0, &numeric_param);
+    if (unlikely(tmp_call_res != 0)) {
+        pr_loc_err("Call to %s() failed => %d", "kstrtoll", tmp_call_res);
+        return;
+    }
+
+    if (unlikely(numeric_param > VID_PID_MAX)) {
+        pr_loc_err("Cmdline %s is invalid (value larger than %d)", name, VID_PID_MAX);
+        return;
+    }
+
+    if (unlikely(*id) != 0)
+        pr_loc_wrn(
+                "%.3s was already set to 0x%04x by a previous instance of %s - it will be changed now to 0x%04x",
+                name, *id, name, (unsigned int)numeric_param);
+
+    *id = (unsigned int)numeric_param;
+    pr_loc_dbg("%.3s override: 0x%04x", name, *id);
+}
+
+/**
+ * Extracts VID override (vid=<uint>) from kernel cmd line
+ */
+static void __init extract_vid(struct runtime_config *config, const char *value)
+{
+    extract_device_id(&config->boot_media.vid, CMDLINE_CT_VID, value);
+}
+
+/**
+ * Extracts PID override (pid=<uint>) from kernel cmd line
+ */
+static void __init extract_pid(struct runtime_config *config, const char *value)
+{
+    extract_device_id(&config->boot_media.pid, CMDLINE_CT_PID, value);
+}
+
+/**
+ * Extracts MFG mode enable switch (mfg<noval>) from kernel cmd line
+ */
+static void __init extract_mfg(struct runtime_config *config, const char *value)
+{
+    config->boot_media.mfg_mode = true;
+    pr_loc_dbg("MFG boot requested");
+}
+
+/**
+ * Extracts maximum size of SATA DOM (dom_szmax=<number of MiB>) from kernel cmd line
+ */
+static void __init extract_dom_max_size(struct runtime_config *config, const char *value)
+{
+    long size_mib = simple_strtol(value, NULL, 10);
+    if (size_mib <= 0) {
+        pr_loc_err("Invalid maximum size of SATA DoM (\"%s%ld\")", CMDLINE_CT_DOM_SZMAX, size_mib);
+        return;
+    }
+
+    config->boot_media.dom_size_mib = size_mib;
+    pr_loc_dbg("Set maximum SATA DoM to %ld", size_mib);
+}
+
+/**
+ * Extracts a boot device candidate (boot_dev=<type>:<params>[:<serial>], see CMDLINE_CT_BOOT_DEV) from kernel cmd line
+ *
+ * Candidates are added in the order they appear on the cmd line.
+ */
+static void __init extract_boot_dev(struct runtime_config *config, const char *value)
+{
+    struct boot_media *boot = &config->boot_media;
+    if (unlikely(boot->candidates_num >= MAX_BOOT_CANDIDATES)) {
+        pr_loc_err("Too many boot device candidates (max %d) - \"%s%s\" ignored", MAX_BOOT_CANDIDATES,
+                   CMDLINE_CT_BOOT_DEV, value);
+        return;
+    }
+
+    struct boot_media_candidate cand = { 0 };
+    const char *params;
+    int consumed = 0;
+    if (strncmp(value, CMDLINE_CT_BOOT_DEV_USB, strlen_static(CMDLINE_CT_BOOT_DEV_USB)) == 0) {
+        cand.type = BOOT_MEDIA_USB;
+        params = value + strlen_static(CMDLINE_CT_BOOT_DEV_USB);
+
+        unsigned int vid, pid;
+        if (sscanf(params, "%x:%x%n", &vid, &pid, &consumed) != 2 || vid > VID_PID_MAX || pid > VID_PID_MAX) {
+            pr_loc_err("Boot device \"%s%s\" is invalid (expected %s<vid>:<pid>[:<serial>])", CMDLINE_CT_BOOT_DEV,
+                       value, CMDLINE_CT_BOOT_DEV_USB);
+            return;
+        }
+        cand.vid = vid;
+        cand.pid = pid;
+    } else {
+        if (strncmp(value, CMDLINE_CT_BOOT_DEV_SATADOM, strlen_static(CMDLINE_CT_BOOT_DEV_SATADOM)) == 0) {
+            cand.type = BOOT_MEDIA_SATA_DOM;
+            params = value + strlen_static(CMDLINE_CT_BOOT_DEV_SATADOM);
+        } else if (strncmp(value, CMDLINE_CT_BOOT_DEV_SATADISK, strlen_static(CMDLINE_CT_BOOT_DEV_SATADISK)) == 0) {
+            cand.type = BOOT_MEDIA_SATA_DISK;
+            params = value + strlen_static(CMDLINE_CT_BOOT_DEV_SATADISK);
+        } else {
+            pr_loc_err("Boot device \"%s%s\" has unknown type (expected %s, %s or %s)", CMDLINE_CT_BOOT_DEV, value,
+                       CMDLINE_CT_BOOT_DEV_USB, CMDLINE_CT_BOOT_DEV_SATADOM, CMDLINE_CT_BOOT_DEV_SATADISK);
+            return;
+        }
+
+        if (sscanf(params, "%lu%n", &cand.dom_size_mib, &consumed) != 1 || cand.dom_size_mib == 0) {
+            pr_loc_err("Boot device \"%s%s\" is invalid (expected <type>:<max MiB>[:<serial>])", CMDLINE_CT_BOOT_DEV,
+                       value);
+            return;
+        }
+    }
+
+    params += consumed;
+    if (*params == ':') {
+        if (strscpy(cand.serial, params + 1, sizeof(cand.serial)) < 0)
+            pr_loc_wrn("Boot device serial truncated to %zu", sizeof(cand.serial) - 1);
+    } else if (*params != '\0') {
+        pr_loc_err("Boot device \"%s%s\" has garbage after parameters", CMDLINE_CT_BOOT_DEV, value);
+        return;
+    }
+
+    boot->candidates[boot->candidates_num++] = cand;
+    pr_loc_dbg("Added boot device candidate #%u: type=%d vid=0x%04x pid=0x%04x max_mib=%lu serial=\"%s\"",
+               boot->candidates_num, cand.type, cand.vid, cand.pid, cand.dom_size_mib, cand.serial);
+}
+
+/**
+ * Parses a single "<type>[:<value>]" selector (see CMDLINE_CT_SSD_CACHE) which is "len" chars long
+ *
+ * @return true if it's valid, false otherwise
+ */
+static bool __init parse_ssd_cache_selector(struct ssd_cache_selector *sel, const char *str, size_t len)
+{
+    if (len == strlen_static(CMDLINE_CT_SSD_CACHE_NONROT) && strncmp(str, CMDLINE_CT_SSD_CACHE_NONROT, len) == 0) {
+        sel->type = SSD_CACHE_SEL_NONROT;
+        sel->value[0] = '\0';
+        return true;
+    }
+
+    size_t prefix_len;
+    if (strncmp(str, CMDLINE_CT_SSD_CACHE_HOST, (prefix_len = strlen_static(CMDLINE_CT_SSD_CACHE_HOST))) == 0)
+        sel->type = SSD_CACHE_SEL_HOST;
+    else if (strncmp(str, CMDLINE_CT_SSD_CACHE_MODEL, (prefix_len = strlen_static(CMDLINE_CT_SSD_CACHE_MODEL))) == 0)
+        sel->type = SSD_CACHE_SEL_MODEL;
+    else if (strncmp(str, CMDLINE_CT_SSD_CACHE_SERIAL, (prefix_len = strlen_static(CMDLINE_CT_SSD_CACHE_SERIAL))) == 0)
+        sel->type = SSD_CACHE_SEL_SERIAL;
+    else
+        return false;
+
+    //prefixes don't contain the separator, so a prefix match cannot span past the selector
+    if (len <= prefix_len || len - prefix_len > SSD_CACHE_SELECTOR_MAX_LENGTH)
+        return false;
+
+    memcpy(sel->value, str + prefix_len, len - prefix_len);
+    sel->value[len - prefix_len] = '\0';
+    return true;
+}
+
+/**
+ * Extracts disks to present as SSDs (ssd_cache=<selector>[,<selector>...], see CMDLINE_CT_SSD_CACHE) from kernel cmd
+ * line
+ */
+static void __init extract_ssd_cache(struct runtime_config *config, const char *value)
+{
+    struct ssd_cache_policy *policy = &config->ssd_cache;
+    const char *sel = value;
+
+    while (*sel) {
+        const char *end = strchrnul(sel, CMDLINE_CT_SSD_CACHE_SEP);
+        size_t len = end - sel;
+
+        if (len == 0) {
+            //empty selector, e.g. "a,,b" - nothing to do
+        } else if (unlikely(policy->selectors_num >= MAX_SSD_CACHE_SELECTORS)) {
+            pr_loc_err("Too many SSD cache selectors (max %d) - \"%s\" ignored", MAX_SSD_CACHE_SELECTORS, sel);
+            return;
+        } else if (parse_ssd_cache_selector(&policy->selectors[policy->selectors_num], sel, len)) {
+            pr_loc_dbg("Added SSD cache selector #%u: type=%d value=\"%s\"", policy->selectors_num + 1,
+                       policy->selectors[policy->selectors_num].type, policy->selectors[policy->selectors_num].value);
+            ++policy->selectors_num;
+        } else {
+            pr_loc_err("SSD cache selector \"%.*s\" is invalid (expected %s, %s<driver>, %s<prefix> or %s<serial> "
+                       "up to %d chars)", (int)len, sel, CMDLINE_CT_SSD_CACHE_NONROT, CMDLINE_CT_SSD_CACHE_HOST,
+                       CMDLINE_CT_SSD_CACHE_MODEL, CMDLINE_CT_SSD_CACHE_SERIAL, SSD_CACHE_SELECTOR_MAX_LENGTH);
+        }
+
+        sel = *end ? end + 1 : end;
+    }
+}
+
+/**
+ * Extracts MFG mode enable switch (syno_port_thaw=<1|0>) from kernel cmd line
+ */
+static void __init extract_port_thaw(struct runtime_config *config, const char *value)
+{
+    if (value[0] == '0') {
+        config->port_thaw = false;
+    } else if (value[0] == '1') {
+        config->port_thaw = true;
+    } else {
+        pr_loc_err("Option \"%s%s\" is invalid (value should be 0 or 1)", CMDLINE_KT_THAW, value);
+        return;
+    }
+
+    pr_loc_dbg("Port thaw set to: %d", config->port_thaw ? 1 : 0);
+}
+
+/**
+ * Extracts number of expected network interfaces (netif_num=<number>) from kernel cmd line
+ */
+static void __init extract_netif_num(struct runtime_config *config, const char *value)
+{
+    short num = value[0] - 48; //ASCII: 0=48 and 9=57
+
+    if (num == 0) {
+        pr_loc_wrn("You specified no network interfaces (\"%s0\")", CMDLINE_KT_NETIF_NUM);
+        return;
+    }
+
+    if (num < 1 || num > 9) {
+        pr_loc_err("Invalid number of network interfaces set (\"%s%d\")", CMDLINE_KT_NETIF_NUM, num);
+        return;
+    }
+
+    config->netif_num = num;
+    pr_loc_dbg("Declared network ifaces # as %d", num);
+}
+
+/**
+ * Extracts network interfaces MAC addresses (mac1...mac4=<MAC>)
+ *
+ * Note: macs=<mac1,mac2,macN> is not implemented (see extract_netif_macs_list())
+ */
+static void __init extract_netif_mac(struct runtime_config *config, const char *value)
+{
+    if (config->macs_num >= MAX_NET_IFACES) {
+        pr_loc_err("You set more than MAC addresses! Only first %d will be honored.", MAX_NET_IFACES);
+        return;
+    }
+
+    size_t mac_len = strlen(value);
+    if (mac_len != MAC_ADDR_LEN || hex2bin(config->macs[config->macs_num], value, MAC_ADDR_BYTES) != 0) {
+        pr_loc_err("MAC address \"%s\" is invalid (expected %d hex characters, found %zu) - ignoring", value,
+                   MAC_ADDR_LEN, mac_len);
+        return;
+    }
+
+    pr_loc_dbg("Set MAC #%d: %pM", config->macs_num + 1, config->macs[config->macs_num]);
+    config->macs_num++;
+}
+
+static void __init extract_netif_macs_list(struct runtime_config *config, const char *value)
+{
+    //TODO: implement macs=
+    pr_loc_err("\"%s\" is not implemented, use %s...%s instead >>>%s%s<<<", CMDLINE_KT_MACS, CMDLINE_KT_MAC1,
+               CMDLINE_KT_MAC4, CMDLINE_KT_MACS, value);
+}
+
+/**
+ * All options recognized in the cmdline
+ *
+ * Keys of options with a value end with "=" (which is a part of the key), keys without it are switches which must
+ * match the whole token. To add a new option simply add it here - lookups go through cmdline_opts_index.
+ *
+ * The cmdline is parsed only once from init_(), so all extractors & lookup structures live in init sections and are
+ * freed by the kernel once the module is loaded. get_kernel_cmdline() & its cache (cmdline_delegate.c) stay resident as
+ * they're used later.
+ */
+struct cmdline_opt {
+    const char *key;
+    void (*extract)(struct runtime_config *config, const char *value);
+};
+
+static const struct cmdline_opt cmdline_opts[] __initconst = {
+    { CMDLINE_KT_HW, extract_hw },
+    { CMDLINE_KT_SN, extract_sn },
+    { CMDLINE_KT_SATADOM, extract_boot_media_type },
+    { CMDLINE_CT_VID, extract_vid },
+    { CMDLINE_CT_PID, extract_pid },
+    { CMDLINE_CT_DOM_SZMAX, extract_dom_max_size },
+    { CMDLINE_CT_BOOT_DEV, extract_boot_dev },
+    { CMDLINE_CT_SSD_CACHE, extract_ssd_cache },
+    { CMDLINE_CT_MFG, extract_mfg },
+    { CMDLINE_KT_THAW, extract_port_thaw },
+    { CMDLINE_KT_NETIF_NUM, extract_netif_num },
+    { CMDLINE_KT_MACS, extract_netif_macs_list },
+    { CMDLINE_KT_MAC1, extract_netif_mac },
+    { CMDLINE_KT_MAC2, extract_netif_mac },
+    { CMDLINE_KT_MAC3, extract_netif_mac },
+    { CMDLINE_KT_MAC4, extract_netif_mac },
+};
+
+//Open-addressed index of cmdline_opts by the hash of the key; it stores option index + 1 (0 = empty slot)
+#define CMDLINE_OPTS_INDEX_BITS 6
+#define CMDLINE_OPTS_INDEX_SIZE (1 << CMDLINE_OPTS_INDEX_BITS)
+static u8 cmdline_opts_index[CMDLINE_OPTS_INDEX_SIZE] __initdata = { 0 };
+
+/**
+ * FNV-1a of the key folded to the index size; collisions are resolved by linear probing in the (sparse) index
+ */
+static __always_inline u32 hash_cmdline_key(const char *key, size_t len)
+{
+    u32 hash = 2166136261U;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (u8)key[i];
+        hash *= 16777619U;
+    }
+
+    return hash & (CMDLINE_OPTS_INDEX_SIZE - 1);
+}
+
+static void __init build_cmdline_opts_index(void)
+{
+    if (cmdline_opts_index[hash_cmdline_key(cmdline_opts[0].key, strlen(cmdline_opts[0].key))] != 0)
+        return; //already built
+
+    BUILD_BUG_ON(ARRAY_SIZE(cmdline_opts) >= CMDLINE_OPTS_INDEX_SIZE / 2); //keep the index sparse
+    for (int i = 0; i < ARRAY_SIZE(cmdline_opts); i++) {
+        u32 slot = hash_cmdline_key(cmdline_opts[i].key, strlen(cmdline_opts[i].key));
+        while (cmdline_opts_index[slot] != 0)
+            slot = (slot + 1) & (CMDLINE_OPTS_INDEX_SIZE - 1);
+
+        cmdline_opts_index[slot] = i + 1;
+    }
+}
+
+/**
+ * Finds option matching a cmdline token
+ *
+ * @param token e.g. "sn=1234" or "mfg"
+ * @param value_out pointer to the value (the part after "=", or the end of the token for switches)
+ * @return option or NULL if the token isn't recognized
+ */
+static const struct cmdline_opt * __init find_cmdline_opt(const char *token, const char **value_out)
+{
+    const char *eq = strchr(token, '=');
+    size_t key_len = eq ? (eq - token + 1) : strlen(token); //keys of options with values contain the "="
+
+    for (u32 slot = hash_cmdline_key(token, key_len); cmdline_opts_index[slot] != 0;
+         slot = (slot + 1) & (CMDLINE_OPTS_INDEX_SIZE - 1)) {
+        const struct cmdline_opt *opt = &cmdline_opts[cmdline_opts_index[slot] - 1];
+        if (strncmp(opt->key, token, key_len) == 0 && opt->key[key_len] == '\0') {
+            *value_out = token + key_len;
+            return opt;
+        }
+    }
+
+    return NULL;
+}
+
+/************************************************* End of extractors **************************************************/
+
+unsigned int __init parse_cmdline_tokens(struct runtime_config *config, char *cmdline)
+{
+    unsigned int param_counter = 0;
+    char *single_param_chunk; //Pointer to the beginning of the cmdline token
+    build_cmdline_opts_index();
+
+    while ((single_param_chunk = strsep(&cmdline, CMDLINE_SEP)) != NULL ) {
+        if (unlikely(single_param_chunk[0] == '\0')) //Skip empty params (e.g. last one)
+            continue;
+        pr_loc_dbg("Param #%d: |%s|", param_counter, single_param_chunk);
+        param_counter++;
+
+        const char *value;
+        const struct cmdline_opt *opt = find_cmdline_opt(single_param_chunk, &value);
+        if (opt)
+            opt->extract(config, value);
+        else
+            pr_loc_dbg("Option \"%s\" not recognized - ignoring", single_param_chunk);
+    }
+
+    return param_counter;
+}
@@ -0,0 +1,26 @@
+/**
+ * Parser of kernel cmdline tokens into the runtime config (see cmdline_opts.h for tokens recognized)
+ *
+ * It doesn't depend on any kernel state and is also built in the userspace (see compat/host/host_kernel.h and the
+ * "host-lib" Makefile target), so it can be fuzzed on a dev host. In the kernel it's used by cmdline_delegate.c, which
+ * obtains the cmdline & populates everything which isn't parsed from it (e.g. the cmdline blacklist).
+ */
+#ifndef REDPILL_CMDLINE_PARSER_H
+#define REDPILL_CMDLINE_PARSER_H
+
+#include "runtime_config.h"
+#include "cmdline_opts.h"
+
+/**
+ * Splits the cmdline into tokens and extracts values of all options recognized into the config
+ *
+ * Invalid values are reported & ignored; tokens which aren't recognized are skipped. This function is __init - in the
+ * kernel it can only be called while the module is loading.
+ *
+ * @param config config to save values to
+ * @param cmdline NULL-terminated cmdline; it's modified in place (separators are replaced with NULL bytes)
+ * @return number of tokens found
+ */
+unsigned int parse_cmdline_tokens(struct runtime_config *config, char *cmdline);
+
+#endif //REDPILL_CMDLINE_PARSER_H
@@ -0,0 +1,324 @@
+#include "platform_desc.h"
+#include "platform_types.h" //struct hw_config, HWMON_*
+#include "runtime_config.h" //MODEL_MAX_LENGTH
+#include "../common.h"
+#include "../shim/pci_shim.h" //pci_shim_device_type
+
+#define DESC_FIELD_SEP ";"
+#define DESC_LIST_SEP ","
+#define DESC_PCI_MF_SUFFIX "/mf"
+
+struct desc_name {
+    const char *name;
+    int id;
+};
+
+static const struct desc_name pci_type_names[] = {
+    { "mv9235", VPD_MARVELL_88SE9235 },
+    { "mv9215", VPD_MARVELL_88SE9215 },
+    { "i211", VPD_INTEL_I211 },
+    { "cpu_ahci", VPD_INTEL_CPU_AHCI_CTRL },
+    { "cpu_pcie_pa", VPD_INTEL_CPU_PCIE_PA },
+    { "cpu_pcie_pb", VPD_INTEL_CPU_PCIE_PB },
+    { "cpu_xhci", VPD_INTEL_CPU_USB_XHCI },
+    { "cpu_i2c", VPD_INTEL_CPU_I2C },
+    { "cpu_hsuart", VPD_INTEL_CPU_HSUART },
+    { "cpu_spi", VPD_INTEL_CPU_SPI },
+    { "cpu_smbus", VPD_INTEL_CPU_SMBUS },
+};
+
+static const struct desc_name thermal_names[] = {
+    { "remote1", HWMON_SYS_TZONE_REMOTE1_ID },
+    { "remote2", HWMON_SYS_TZONE_REMOTE2_ID },
+    { "local", HWMON_SYS_TZONE_LOCAL_ID },
+    { "system", HWMON_SYS_TZONE_SYSTEM_ID },
+    { "adt1_loc", HWMON_SYS_TZONE_ADT1_LOC_ID },
+    { "adt2_loc", HWMON_SYS_TZONE_ADT2_LOC_ID },
+};
+
+static const struct desc_name voltage_names[] = {
+    { "vcc", HWMON_SYS_VSENS_VCC_ID },
+    { "vpp", HWMON_SYS_VSENS_VPP_ID },
+    { "v33", HWMON_SYS_VSENS_V33_ID },
+    { "v5", HWMON_SYS_VSENS_V5_ID },
+    { "v12", HWMON_SYS_VSENS_V12_ID },
+    { "adt1_v33", HWMON_SYS_VSENS_ADT1_V33_ID },
+    { "adt2_v33", HWMON_SYS_VSENS_ADT2_V33_ID },
+};
+
+static const struct desc_name fan_names[] = {
+    { "fan1", HWMON_SYS_FAN1_ID },
+    { "fan2", HWMON_SYS_FAN2_ID },
+    { "fan3", HWMON_SYS_FAN3_ID },
+    { "fan4", HWMON_SYS_FAN4_ID },
+};
+
+static const struct desc_name hdd_bp_names[] = {
+    { "detect", HWMON_SYS_HDD_BP_DETECT_ID },
+    { "enable", HWMON_SYS_HDD_BP_ENABLE_ID },
+};
+
+static const struct desc_name psu_names[] = {
+    { "pwr_in", HWMON_PSU_PWR_IN_ID },
+    { "pwr_out", HWMON_PSU_PWR_OUT_ID },
+#if RP_MODULE_TARGET_VER == 6
+    { "temp", HWMON_PSU_TEMP_ID },
+#elif RP_MODULE_TARGET_VER == 7
+    { "temp1", HWMON_PSU_TEMP1_ID },
+    { "temp2", HWMON_PSU_TEMP2_ID },
+    { "temp3", HWMON_PSU_TEMP3_ID },
+    { "fan_volt", HWMON_PSU_FAN_VOLT },
+#endif
+    { "fan_rpm", HWMON_PSU_FAN_RPM_ID },
+    { "status", HWMON_PSU_STATUS_ID },
+};
+
+static const struct desc_name current_names[] = {
+    { "adc", HWMON_SYS_CURR_ADC_ID },
+};
+
+/**
+ * @return id of the name or -ENOENT if it's not on the list
+ */
+static int find_desc_name(const struct desc_name *names, unsigned int names_num, const char *name)
+{
+    for (unsigned int i = 0; i < names_num; ++i) {
+        if (strcmp(names[i].name, name) == 0)
+            return names[i].id;
+    }
+
+    return -ENOENT;
+}
+
+static int parse_flags(struct hw_config *hw, char *value)
+{
+    char *flag;
+    while ((flag = strsep(&value, DESC_LIST_SEP)) != NULL) {
+        if (strcmp(flag, "emulate_rtc") == 0)
+            hw->emulate_rtc = true;
+        else if (strcmp(flag, "swap_serial") == 0)
+            hw->swap_serial = true;
+        else if (strcmp(flag, "reinit_ttyS0") == 0)
+            hw->reinit_ttyS0 = true;
+        else if (strcmp(flag, "fix_disk_led_ctrl") == 0)
+            hw->fix_disk_led_ctrl = true;
+        else if (strcmp(flag, "cpu_temp") == 0)
+            hw->has_cpu_temp = true;
+        else if (flag[0] != '\0') {
+            pr_loc_err("Unknown platform flag \"%s\"", flag);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Parses a single "<type>@<bus>:<dev>.<fn>[/mf]" entry
+ */
+static int parse_pci_stub(struct vpci_device_stub *stub, char *entry)
+{
+    char *addr = strchr(entry, '@');
+    if (!addr) {
+        pr_loc_err("PCI stub \"%s\" has no address", entry);
+        return -EINVAL;
+    }
+    *addr++ = '\0';
+
+    int type = find_desc_name(pci_type_names, ARRAY_SIZE(pci_type_names), entry);
+    if (type < 0) {
+        pr_loc_err("Unknown PCI stub type \"%s\"", entry);
+        return -EINVAL;
+    }
+
+    size_t addr_len = strlen(addr);
+    if (addr_len > strlen_static(DESC_PCI_MF_SUFFIX) &&
+        strcmp(addr + addr_len - strlen_static(DESC_PCI_MF_SUFFIX), DESC_PCI_MF_SUFFIX) == 0) {
+        stub->multifunction = true;
+        addr[addr_len - strlen_static(DESC_PCI_MF_SUFFIX)] = '\0';
+    }
+
+    unsigned int bus, dev, fn;
+    char tail;
+    if (sscanf(addr, "%x:%x.%x%c", &bus, &dev, &fn, &tail) != 3 || bus > 0xFF || dev > 0x1F || fn > 0x07) {
+        pr_loc_err("PCI stub address \"%s\" is invalid (expected <bus>:<dev>.<fn>)", addr);
+        return -EINVAL;
+    }
+
+    stub->type = type;
+    stub->bus = bus;
+    stub->dev = dev;
+    stub->fn = fn;
+
+    return 0;
+}
+
+static int parse_pci_stubs(struct hw_config *hw, char *value)
+{
+    char *entry;
+    unsigned int count = 0;
+    while ((entry = strsep(&value, DESC_LIST_SEP)) != NULL) {
+        if (entry[0] == '\0')
+            continue;
+
+        if (count >= MAX_VPCI_DEVS) {
+            pr_loc_err("Too many PCI stubs (max %d)", MAX_VPCI_DEVS);
+            return -E2BIG;
+        }
+
+        int out = parse_pci_stub(&hw->pci_stubs[count++], entry);
+        if (out != 0)
+            return out;
+    }
+
+    return 0; //the remaining stubs are zeroed, i.e. __VPD_TERMINATOR__
+}
+
+/**
+ * Parses a list of names into ids; unused ids are left as 0, which is the NULL_ID of every hwmon type
+ *
+ * @return number of ids or -E on error
+ */
+static int parse_id_list(int *ids, unsigned int max_ids, const struct desc_name *names, unsigned int names_num,
+                         const char *key, char *value)
+{
+    char *name;
+    unsigned int count = 0;
+    while ((name = strsep(&value, DESC_LIST_SEP)) != NULL) {
+        if (name[0] == '\0')
+            continue;
+
+        if (count >= max_ids) {
+            pr_loc_err("Too many \"%s\" entries (max %u)", key, max_ids);
+            return -E2BIG;
+        }
+
+        int id = find_desc_name(names, names_num, name);
+        if (id < 0) {
+            pr_loc_err("Unknown \"%s\" entry \"%s\"", key, name);
+            return -EINVAL;
+        }
+
+        ids[count++] = id;
+    }
+
+    return count;
+}
+
+//Parses a list into one of the hwmon arrays (which are arrays of different enums)
+#define parse_hwmon_list(arr, names, key, value) ({                                                             \
+        int __ids[ARRAY_SIZE(arr)] = { 0 };                                                                     \
+        int __out = parse_id_list(__ids, ARRAY_SIZE(arr), names, ARRAY_SIZE(names), key, value);                \
+        for (int __i = 0; __out >= 0 && __i < ARRAY_SIZE(arr); ++__i)                                           \
+            (arr)[__i] = __ids[__i];                                                                            \
+        __out < 0 ? __out : 0;                                                                                  \
+    })
+
+static int parse_desc_field(struct hw_config *hw, const char *key, char *value)
+{
+    if (strcmp(key, "name") == 0) {
+        if (hw->name) {
+            pr_loc_err("Platform name specified more than once");
+            return -EINVAL;
+        }
+
+        if (value[0] == '\0' || strlen(value) > MODEL_MAX_LENGTH) {
+            pr_loc_err("Platform name \"%s\" is invalid (expected 1-%d characters)", value, MODEL_MAX_LENGTH);
+            return -EINVAL;
+        }
+
+        hw->name = kstrdup(value, GFP_KERNEL);
+        if (unlikely(!hw->name))
+            kalloc_error_int(hw->name, strsize(value));
+
+        return 0;
+    }
+
+    if (strcmp(key, "leds") == 0) {
+        if (hw->led_map) {
+            pr_loc_err("Platform LEDs specified more than once");
+            return -EINVAL;
+        }
+
+        hw->led_map = kstrdup(value, GFP_KERNEL);
+        if (unlikely(!hw->led_map))
+            kalloc_error_int(hw->led_map, strsize(value));
+
+        return 0; //it's validated when the mfgBIOS is shimmed
+    }
+
+    if (strcmp(key, "flags") == 0)
+        return parse_flags(hw, value);
+    if (strcmp(key, "pci") == 0)
+        return parse_pci_stubs(hw, value);
+    if (strcmp(key, "thermal") == 0)
+        return parse_hwmon_list(hw->hwmon.sys_thermal, thermal_names, key, value);
+    if (strcmp(key, "voltage") == 0)
+        return parse_hwmon_list(hw->hwmon.sys_voltage, voltage_names, key, value);
+    if (strcmp(key, "fan") == 0)
+        return parse_hwmon_list(hw->hwmon.sys_fan_speed_rpm, fan_names, key, value);
+    if (strcmp(key, "hdd_bp") == 0)
+        return parse_hwmon_list(hw->hwmon.hdd_backplane, hdd_bp_names, key, value);
+    if (strcmp(key, "psu") == 0)
+        return parse_hwmon_list(hw->hwmon.psu_status, psu_names, key, value);
+    if (strcmp(key, "current") == 0)
+        return parse_hwmon_list(hw->hwmon.sys_current, current_names, key, value);
+
+    pr_loc_err("Unknown platform description field \"%s\"", key);
+    return -EINVAL;
+}
+
+struct hw_config *parse_platform_desc(const char *desc)
+{
+    int out = 0;
+    struct hw_config *hw;
+    char *desc_copy, *cursor, *field;
+
+    kzalloc_or_exit_ptr(hw, sizeof(struct hw_config));
+    desc_copy = cursor = kstrdup(desc, GFP_KERNEL);
+    if (unlikely(!desc_copy)) {
+        kfree(hw);
+        kalloc_error_ptr(desc_copy, strsize(desc));
+    }
+
+    while ((field = strsep(&cursor, DESC_FIELD_SEP)) != NULL) {
+        if (field[0] == '\0')
+            continue;
+
+        char *value = strchr(field, '=');
+        if (!value) {
+            pr_loc_err("Platform description field \"%s\" has no value", field);
+            out = -EINVAL;
+            goto out_free;
+        }
+        *value++ = '\0';
+
+        if ((out = parse_desc_field(hw, field, value)) != 0)
+            goto out_free;
+    }
+
+    if (!hw->name) {
+        pr_loc_err("Platform description has no name");
+        out = -EINVAL;
+        goto out_free;
+    }
+
+    pr_loc_dbg("Parsed runtime platform description for \"%s\"", hw->name);
+    kfree(desc_copy);
+    return hw;
+
+    out_free:
+    kfree(desc_copy);
+    free_platform_desc(hw);
+    return ERR_PTR(out);
+}
+
+void free_platform_desc(struct hw_config *hw)
+{
+    if (!hw)
+        return;
+
+    kfree(hw->name);
+    kfree(hw->led_map);
+    kfree(hw);
+}
@@ -0,0 +1,43 @@
+/**
+ * Parser of runtime platform descriptions
+ *
+ * Platforms are normally compiled into the module (see platforms.h). A loader can also pass a platform at load time
+ * (see the "platform" module parameter in runtime_config.c), so that adding a model or changing its PCI stubs/hwmon
+ * doesn't need a rebuild for every kernel. The description is parsed once into the same struct hw_config.
+ *
+ * The format is a list of "key=value" fields separated with ";". Lists within values are separated with ",":
+ *   name=<model>                    required, matched against syno_hw_version= (e.g. "name=DS918+")
+ *   flags=<flag>,...                any of: emulate_rtc, swap_serial, reinit_ttyS0, fix_disk_led_ctrl, cpu_temp
+ *   pci=<type>@<bus>:<dev>.<fn>,... PCI stubs in the order they should be added; "/mf" suffix marks multifunction
+ *                                   devices. Types: mv9235, mv9215, i211, cpu_ahci, cpu_pcie_pa, cpu_pcie_pb,
+ *                                   cpu_xhci, cpu_i2c, cpu_hsuart, cpu_spi, cpu_smbus; numbers are hex
+ *   thermal=<zone>,...              remote1, remote2, local, system, adt1_loc, adt2_loc
+ *   voltage=<sensor>,...            vcc, vpp, v33, v5, v12, adt1_v33, adt2_v33
+ *   fan=<fan>,...                   fan1, fan2, fan3, fan4
+ *   hdd_bp=<sensor>,...             detect, enable
+ *   psu=<sensor>,...                pwr_in, pwr_out, temp (v6) or temp1, temp2, temp3, fan_volt (v7), fan_rpm, status
+ *   current=<sensor>,...            adc
+ *   leds=<led>=<target>,...         LEDs driven by the mfgBIOS mapped to GPIOs or LED triggers (format described in
+ *                                   shim/bios/led_backend.h), e.g. leds=power=gpio:12:low,disk1=trigger:disk1
+ * All fields except the name are optional; omitted flags are false and omitted lists are empty. Example:
+ *   name=DS918+;flags=emulate_rtc,reinit_ttyS0,fix_disk_led_ctrl,cpu_temp;pci=mv9215@01:00.0,cpu_spi@00:19.2/mf,
+ *   cpu_spi@00:19.0/mf;hdd_bp=detect,enable
+ */
+#ifndef REDPILL_PLATFORM_DESC_H
+#define REDPILL_PLATFORM_DESC_H
+
+struct hw_config;
+
+/**
+ * Parses a platform description (see file header for the format)
+ *
+ * @return newly allocated config (free it with free_platform_desc()) or ERR_PTR(-E) on error
+ */
+struct hw_config *parse_platform_desc(const char *desc);
+
+/**
+ * Frees config returned by parse_platform_desc()
+ */
+void free_platform_desc(struct hw_config *hw);
+
+#endif //REDPILL_PLATFORM_DESC_H
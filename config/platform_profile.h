@@ -0,0 +1,47 @@
+/**
+ * Compile-time platform profiles (selected with "PLATFORM=" in the Makefile)
+ *
+ * By default the module supports all platforms from platforms.h (and runtime descriptions, see platform_desc.h) and
+ * decides what to shim based on struct hw_config flags. A module built for a single platform (e.g. "make dev-v7
+ * PLATFORM=918p") has these flags turned into constants, so that branches depending on them are folded by the compiler,
+ * and shims which the platform never uses aren't built at all (the Makefile drops their files):
+ *   3615xs   DS3615xs; no RTC proxy
+ *   918p     DS918+; no UART swapper
+ * Runtime platform descriptions are still accepted in a profile build, but only for the same model and with the same
+ * flags (see validate_platform_profile()), as the code for other combinations is simply not there.
+ *
+ * Flag values here MUST be kept in sync with platforms.h.
+ */
+#ifndef REDPILL_PLATFORM_PROFILE_H
+#define REDPILL_PLATFORM_PROFILE_H
+
+#if defined(RP_PLATFORM_DS3615XS)
+#define RP_PLATFORM_PROFILE "DS3615xs"
+#define RP_PLATFORM_EMULATE_RTC false
+#define RP_PLATFORM_SWAP_SERIAL true
+#define RP_PLATFORM_REINIT_TTYS0 false
+#define RP_PLATFORM_FIX_DISK_LED_CTRL false
+#define RP_PLATFORM_NO_RTC_PROXY //shim/bios/rtc_proxy.c is not built
+
+#elif defined(RP_PLATFORM_DS918P)
+#define RP_PLATFORM_PROFILE "DS918+"
+#define RP_PLATFORM_EMULATE_RTC true
+#define RP_PLATFORM_SWAP_SERIAL false
+#define RP_PLATFORM_REINIT_TTYS0 true
+#define RP_PLATFORM_FIX_DISK_LED_CTRL true
+#define RP_PLATFORM_NO_UART_SWAPPER //internal/uart/uart_swapper.c is not built
+#endif
+
+#ifdef RP_PLATFORM_PROFILE
+#define platform_emulate_rtc(hw) RP_PLATFORM_EMULATE_RTC
+#define platform_swap_serial(hw) RP_PLATFORM_SWAP_SERIAL
+#define platform_reinit_ttyS0(hw) RP_PLATFORM_REINIT_TTYS0
+#define platform_fix_disk_led_ctrl(hw) RP_PLATFORM_FIX_DISK_LED_CTRL
+#else
+#define platform_emulate_rtc(hw) ((hw)->emulate_rtc)
+#define platform_swap_serial(hw) ((hw)->swap_serial)
+#define platform_reinit_ttyS0(hw) ((hw)->reinit_ttyS0)
+#define platform_fix_disk_led_ctrl(hw) ((hw)->fix_disk_led_ctrl)
+#endif //RP_PLATFORM_PROFILE
+
+#endif //REDPILL_PLATFORM_PROFILE_H
@@ -85,16 +85,21 @@ enum hwmon_sys_current_id {
 };
 #define HWMON_SYS_CURRENT_IDS 1 //number of current sensors minus the fake NULL_ID
 
+//Members aren't const so that runtime platform descriptions can be parsed into it (see platform_desc.h). Compiled-in
+// platforms are declared as a const array anyway.
 struct hw_config {
     const char *name; //the longest so far is "RR36015xs+++" (12+1)
 
-    const struct vpci_device_stub pci_stubs[MAX_VPCI_DEVS];
+    struct vpci_device_stub pci_stubs[MAX_VPCI_DEVS];
 
     //All custom flags
-    const bool emulate_rtc:1;
-    const bool swap_serial:1; //Whether ttyS0 and ttyS1 are swapped (reverses CONFIG_SYNO_X86_SERIAL_PORT_SWAP)
-    const bool reinit_ttyS0:1; //Should the ttyS0 be forcefully re-initialized after module loads
-    const bool fix_disk_led_ctrl:1; //Disabled libata-scsi bespoke disk led control (which often crashes some v4 platforms)
+    bool emulate_rtc:1;
+    bool swap_serial:1; //Whether ttyS0 and ttyS1 are swapped (reverses CONFIG_SYNO_X86_SERIAL_PORT_SWAP)
+    bool reinit_ttyS0:1; //Should the ttyS0 be forcefully re-initialized after module loads
+    bool fix_disk_led_ctrl:1; //Disabled libata-scsi bespoke disk led control (which often crashes some v4 platforms)
+
+    //Mapping of mfgBIOS-controlled LEDs to real GPIOs/LED triggers (NULL = none), see shim/bios/led_backend.h
+    const char *led_map;
 
     //See SYNO_HWMON_SUPPORT_ID in include/linux/synobios.h GPLed sources - it defines which ones are possible
     //These define which parts of ACPI HWMON should be emulated
@@ -103,8 +108,8 @@ struct hw_config {
     //Supported hwmon sensors; order of sensors within type IS IMPORTANT to be accurate with a real hardware. The number
     // of sensors is derived from the enums defining their types. Internally the absolute maximum number is determined
     // by MAX_SENSOR_NUM defined in include/linux/synobios.h
-    const bool has_cpu_temp:1; //GetHwCapability(id = CAPABILITY_CPU_TEMP)
-    const struct hw_config_hwmon {
+    bool has_cpu_temp:1; //GetHwCapability(id = CAPABILITY_CPU_TEMP)
+    struct hw_config_hwmon {
         enum hwmon_sys_thermal_zone_id sys_thermal[HWMON_SYS_THERMAL_ZONE_IDS]; //GetHwCapability(id = CAPABILITY_THERMAL)
         enum hwmon_sys_voltage_sensor_id sys_voltage[HWMON_SYS_VOLTAGE_SENSOR_IDS];
         enum hwmon_sys_fan_rpm_id sys_fan_speed_rpm[HWMON_SYS_FAN_RPM_IDS]; //GetHwCapability(id = CAPABILITY_FAN_RPM_RPT)
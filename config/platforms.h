@@ -1,13 +1,20 @@
 /*
  * DO NOT include this file anywhere besides runtime_config.c - its format is meant to be internal to the configuration
- * parsing.
+ * parsing. The only exception is the self-test module (selftest/redpill_selftest.c), which creates stubs of all
+ * platforms.
  */
 #ifndef REDPILLLKM_PLATFORMS_H
 #define REDPILLLKM_PLATFORMS_H
 
 #include "../shim/pci_shim.h"
 #include "platform_types.h"
-const struct hw_config supported_platforms[] = {
+#include "platform_profile.h" //RP_PLATFORM_*
+#include <linux/init.h> //__initconst
+
+//Profile builds (see platform_profile.h) contain only their own platform. The table is needed only to select the
+// platform during init (runtime_config.c keeps a copy of the selected one), so it's freed after the module is loaded.
+static const struct hw_config supported_platforms[] __initconst = {
+#if !defined(RP_PLATFORM_PROFILE) || defined(RP_PLATFORM_DS3615XS)
     {
         .name = "DS3615xs",
         .pci_stubs = {
@@ -32,6 +39,8 @@ const struct hw_config supported_platforms[] = {
             .sys_current = { HWMON_SYS_CURR_NULL_ID },
         }
     },
+#endif
+#if !defined(RP_PLATFORM_PROFILE) || defined(RP_PLATFORM_DS918P)
     {
             .name = "DS918+",
             .pci_stubs = {
@@ -65,6 +74,7 @@ const struct hw_config supported_platforms[] = {
                 .sys_current = { HWMON_SYS_CURR_NULL_ID },
             }
     },
+#endif
 };
 
 #endif //REDPILLLKM_PLATFORMS_H
\ No newline at end of file
@@ -1,8 +1,20 @@
 #include "runtime_config.h"
 #include "platforms.h"
+#include "platform_desc.h" //parse_platform_desc()
+#include "platform_profile.h" //RP_PLATFORM_*
 #include "../common.h"
 #include "cmdline_delegate.h"
 #include "uart_defs.h"
+#include <linux/moduleparam.h> //module_param_named()
+
+//Runtime platform description passed by the loader (see platform_desc.h for the format). It takes precedence over the
+// compiled-in platform with the same name. The permission is 0 so that it's not exposed in sysfs.
+static char *platform_desc = NULL;
+module_param_named(platform, platform_desc, charp, 0000);
+static struct hw_config *runtime_platform = NULL;
+//Resident copy of the selected compiled-in platform - supported_platforms[] is __initconst and gone after init_()
+static struct hw_config compiled_platform;
+static bool boot_candidates_explicit = false; //whether boot_media.candidates came from CMDLINE_CT_BOOT_DEV
 
 struct runtime_config current_config = {
     .hw = { '\0' },
@@ -14,14 +26,17 @@ struct runtime_config current_config = {
         .pid = VID_PID_EMPTY,
         .dom_size_mib = 1024, //usually the image will be used with ESXi and thus it will be ~100MB anyway
     },
+    .ssd_cache = { .selectors_num = 0 },
     .port_thaw = true,
     .netif_num = 0,
-    .macs = { '\0' },
-    .cmdline_blacklist = { '\0' },
+    .macs_num = 0,
+    .macs = { { 0 } },
+    .cmdline_blacklist_num = 0,
+    .cmdline_blacklist = { { 0 } },
     .hw_config = NULL,
 };
 
-static inline bool validate_sn(const serial_no *sn) {
+static inline bool __init validate_sn(const serial_no *sn) {
     if (*sn[0] == '\0') {
         pr_loc_err("Serial number is empty");
         return false;
@@ -95,7 +110,7 @@ static __always_inline bool validate_boot_dev_sata_disk(const struct boot_media
     return true;
 }
 
-static inline bool validate_boot_dev(const struct boot_media *boot)
+static inline bool __init validate_boot_dev_legacy(const struct boot_media *boot)
 {
     switch (boot->type) {
         case BOOT_MEDIA_USB:
@@ -112,21 +127,83 @@ static inline bool validate_boot_dev(const struct boot_media *boot)
     }
 }
 
-static inline bool validate_nets(const unsigned short if_num, mac_address * const macs[MAX_NET_IFACES])
+/**
+ * Validates candidates specified explicitly using CMDLINE_CT_BOOT_DEV
+ */
+static inline bool __init validate_boot_candidates(const struct boot_media *boot)
 {
-    size_t mac_len;
-    unsigned short macs_num = 0;
-    for (; macs_num < MAX_NET_IFACES; macs_num++) {
-        if (!macs[macs_num])
-            break; //You cannot have gaps in macs array
+    bool valid = true;
+    for (unsigned int i = 0; i < boot->candidates_num; ++i) {
+        const struct boot_media_candidate *cand = &boot->candidates[i];
+        switch (cand->type) {
+            case BOOT_MEDIA_USB:
+                if (cand->vid == VID_PID_EMPTY && cand->pid != VID_PID_EMPTY) {
+                    pr_loc_err("Boot device candidate #%u has PID but no VID", i + 1);
+                    valid = false;
+                }
+                break;
+            case BOOT_MEDIA_SATA_DOM:
+#ifndef NATIVE_SATA_DOM_SUPPORTED
+                pr_loc_err("Boot device candidate #%u is a native SATA DoM but the kernel doesn't support it", i + 1);
+                valid = false;
+#endif
+                if (boot->mfg_mode) {
+                    pr_loc_err("Boot device candidate #%u is a native SATA DoM which cannot be combined with %s",
+                               i + 1, CMDLINE_CT_MFG);
+                    valid = false;
+                }
+                break;
+            case BOOT_MEDIA_SATA_DISK:
+                break;
+            default:
+                pr_loc_bug("Boot device candidate #%u has unknown type %d", i + 1, cand->type);
+                valid = false;
+        }
+    }
+
+    return valid;
+}
 
-        mac_len = strlen(*macs[macs_num]);
-        if (mac_len != MAC_ADDR_LEN) {
-            pr_loc_err("MAC address \"%s\" is invalid (expected %d characters, found %zu)", *macs[macs_num], MAC_ADDR_LEN,
-                       mac_len);
-        } //else if validate if the MAC is actually semi-valid
+static inline bool __init validate_boot_dev(const struct boot_media *boot)
+{
+    if (boot->candidates_num == 0) {
+        pr_loc_bug("No boot device candidates - %s wasn't called?", "populate_boot_candidates");
+        return false;
     }
 
+    //Legacy options were converted to a single candidate and are validated with all their caveats
+    return boot_candidates_explicit ? validate_boot_candidates(boot) : validate_boot_dev_legacy(boot);
+}
+
+/**
+ * Derives a single boot device candidate from legacy options if no candidates were specified with CMDLINE_CT_BOOT_DEV
+ *
+ * If candidates were specified the legacy boot type is set to the type of the highest priority one, so that code
+ * which doesn't care about all candidates (e.g. logging) sees something sensible.
+ */
+static void __init populate_boot_candidates(struct boot_media *boot)
+{
+    if (boot->candidates_num > 0) {
+        boot_candidates_explicit = true;
+        if (boot->vid != VID_PID_EMPTY || boot->pid != VID_PID_EMPTY || boot->type != BOOT_MEDIA_USB)
+            pr_loc_wrn("Using %s - %s, %s and %s values will be ignored", CMDLINE_CT_BOOT_DEV, CMDLINE_CT_VID,
+                       CMDLINE_CT_PID, CMDLINE_KT_SATADOM);
+
+        boot->type = boot->candidates[0].type;
+        return;
+    }
+
+    struct boot_media_candidate *cand = &boot->candidates[boot->candidates_num++];
+    cand->type = boot->type;
+    cand->vid = boot->vid;
+    cand->pid = boot->pid;
+    cand->dom_size_mib = boot->dom_size_mib;
+    cand->serial[0] = '\0';
+}
+
+//MACs are parsed (and invalid ones rejected) as they're extracted from the cmdline, so only their number is checked
+static inline bool __init validate_nets(const unsigned short if_num, const unsigned short macs_num)
+{
     bool valid = true;
     if (if_num == 0) {
         pr_loc_err("Number of defined interfaces (\"%s\") is not specified or empty", CMDLINE_KT_NETIF_NUM);
@@ -147,6 +224,29 @@ static inline bool validate_nets(const unsigned short if_num, mac_address * cons
     return valid;
 }
 
+/**
+ * Checks whether the platform matches the one the module was built for (if any, see platform_profile.h)
+ */
+static inline bool __init validate_platform_profile(const struct hw_config *hw)
+{
+#ifdef RP_PLATFORM_PROFILE
+    if (unlikely(strcmp(hw->name, RP_PLATFORM_PROFILE) != 0)) {
+        pr_loc_err("This module was built only for \"%s\" but the platform is \"%s\"", RP_PLATFORM_PROFILE, hw->name);
+        return false;
+    }
+
+    if (unlikely(hw->emulate_rtc != RP_PLATFORM_EMULATE_RTC || hw->swap_serial != RP_PLATFORM_SWAP_SERIAL ||
+                 hw->reinit_ttyS0 != RP_PLATFORM_REINIT_TTYS0 ||
+                 hw->fix_disk_led_ctrl != RP_PLATFORM_FIX_DISK_LED_CTRL)) {
+        pr_loc_err("Platform \"%s\" flags differ from the ones this module was built with - use a build without "
+                   "PLATFORM= to change them", hw->name);
+        return false;
+    }
+#endif
+
+    return true;
+}
+
 /**
  * This function validates consistency of the currently loaded platform config with the current environment
  *
@@ -155,8 +255,11 @@ static inline bool validate_nets(const unsigned short if_num, mac_address * cons
  * (but partially too) but the match between platform config chosen vs. kernel currently attempting to run that
  * platform.
  */
-static inline bool validate_platform_config(const struct hw_config *hw)
+static inline bool __init validate_platform_config(const struct hw_config *hw)
 {
+    if (!validate_platform_profile(hw))
+        return false;
+
 #ifdef UART_BUG_SWAPPED
     const bool kernel_serial_swapped = true;
 #else
@@ -172,7 +275,7 @@ static inline bool validate_platform_config(const struct hw_config *hw)
     return true;
 }
 
-static int populate_hw_config(struct runtime_config *config)
+static int __init populate_hw_config(struct runtime_config *config)
 {
     //We cannot run with empty model or model which didn't match
     if (config->hw[0] == '\0') {
@@ -180,12 +283,34 @@ static int populate_hw_config(struct runtime_config *config)
         return -ENOENT;
     }
 
+    if (platform_desc && platform_desc[0] != '\0') {
+        runtime_platform = parse_platform_desc(platform_desc);
+        if (IS_ERR(runtime_platform)) {
+            int out = PTR_ERR(runtime_platform);
+            runtime_platform = NULL;
+            pr_loc_crt("The runtime platform description is invalid - error=%d", out);
+            return out;
+        }
+
+        if (strcmp(runtime_platform->name, (char *)config->hw) == 0) {
+            pr_loc_inf("Using runtime platform definition for \"%s\"", config->hw);
+            config->hw_config = runtime_platform;
+            return 0;
+        }
+
+        pr_loc_wrn("Runtime platform definition is for \"%s\" but the model is \"%s\" - ignoring it",
+                   runtime_platform->name, config->hw);
+        free_platform_desc(runtime_platform);
+        runtime_platform = NULL;
+    }
+
     for (int i = 0; i < ARRAY_SIZE(supported_platforms); i++) {
         if (strcmp(supported_platforms[i].name, (char *)config->hw) != 0)
             continue;
 
         pr_loc_dbg("Found platform definition for \"%s\"", config->hw);
-        config->hw_config = &supported_platforms[i];
+        compiled_platform = supported_platforms[i];
+        config->hw_config = &compiled_platform;
         return 0;
     }
 
@@ -193,14 +318,14 @@ static int populate_hw_config(struct runtime_config *config)
     return -EINVAL;
 }
 
-static bool validate_runtime_config(const struct runtime_config *config)
+static bool __init validate_runtime_config(const struct runtime_config *config)
 {
     pr_loc_dbg("Validating runtime config...");
     bool valid = true;
 
     valid &= validate_sn(&config->sn);
     valid &= validate_boot_dev(&config->boot_media);
-    valid &= validate_nets(config->netif_num, config->macs);
+    valid &= validate_nets(config->netif_num, config->macs_num);
     valid &= validate_platform_config(config->hw_config);
 
     if (valid) {
@@ -212,10 +337,11 @@ static bool validate_runtime_config(const struct runtime_config *config)
     }
 }
 
-int populate_runtime_config(struct runtime_config *config)
+int __init populate_runtime_config(struct runtime_config *config)
 {
     int out = 0;
 
+    populate_boot_candidates(&config->boot_media);
     if ((out = populate_hw_config(config)) != 0 || (out = validate_runtime_config(config)) != 0) {
         pr_loc_err("Failed to populate runtime config!");
         return out;
@@ -228,18 +354,11 @@ int populate_runtime_config(struct runtime_config *config)
 
 void free_runtime_config(struct runtime_config *config)
 {
-    for (int i = 0; i < MAX_NET_IFACES; i++) {
-        if (config->macs[i]) {
-            pr_loc_dbg("Free MAC%d @ %p", i, config->macs[i]);
-            kfree(config->macs[i]);
-        }
-    }
-
-    for (int i = 0; i < MAX_BLACKLISTED_CMDLINE_TOKENS; i++) {
-        if (config->cmdline_blacklist[i]) {
-            pr_loc_dbg("Free cmdline blacklist entry %d @ %p", i, config->cmdline_blacklist[i]);
-            kfree(config->cmdline_blacklist[i]);
-        }
+    if (runtime_platform) {
+        if (config->hw_config == runtime_platform)
+            config->hw_config = NULL;
+        free_platform_desc(runtime_platform);
+        runtime_platform = NULL;
     }
 
     pr_loc_inf("Runtime config freed");
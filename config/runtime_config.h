@@ -1,13 +1,18 @@
 #ifndef REDPILLLKM_RUNTIME_CONFIG_H
 #define REDPILLLKM_RUNTIME_CONFIG_H
 
+#ifdef __KERNEL__
 #include "uart_defs.h" //UART config values
 #include <linux/types.h> //bool
+#else
+#include "../compat/host/host_kernel.h" //the config is also populated by the host build of cmdline_parser.c
+#endif
 
 //These below are currently known runtime limitations
 #define MAX_NET_IFACES 8
-#define MAC_ADDR_LEN 12
-#define MAX_BLACKLISTED_CMDLINE_TOKENS 10
+#define MAC_ADDR_LEN 12 //as passed in the cmdline (hex digits without separators)
+#define MAC_ADDR_BYTES 6
+#define MAX_BLACKLISTED_CMDLINE_TOKENS 12
 
 #ifdef CONFIG_SYNO_BOOT_SATA_DOM
 #define NATIVE_SATA_DOM_SUPPORTED //whether SCSI sd.c driver supports native SATA DOM
@@ -20,11 +25,26 @@
 #define VID_PID_EMPTY 0x0000
 #define VID_PID_MAX   0xFFFF
 
+#define MAX_BOOT_CANDIDATES 4
+#define BOOT_SERIAL_MAX_LENGTH 32 //USB iSerial strings can be longer, but no sane boot device uses longer ones
+#define MAX_SSD_CACHE_SELECTORS 8
+#define SSD_CACHE_SELECTOR_MAX_LENGTH 40 //the longest thing matched is a unit serial (model is only 16 chars)
+
 typedef unsigned short device_id;
 typedef char syno_hw[MODEL_MAX_LENGTH + 1];
-typedef char mac_address[MAC_ADDR_LEN + 1];
+typedef u8 mac_address[MAC_ADDR_BYTES]; //binary, parsed from MAC_ADDR_LEN hex digits
 typedef char serial_no[SN_MAX_LENGTH + 1];
-typedef char cmdline_token[];
+
+/**
+ * Key of a blacklisted cmdline token (e.g. "vid=") with its length & hash precomputed
+ *
+ * Keys are interned CMDLINE_* string literals - nothing here is allocated nor freed.
+ */
+struct cmdline_token {
+    const char *key;
+    u16 len;
+    u32 hash; //cmdline_token_hash() of the key
+};
 
 enum boot_media_type {
     BOOT_MEDIA_USB,
@@ -32,6 +52,17 @@ enum boot_media_type {
     BOOT_MEDIA_SATA_DISK,
 };
 
+/**
+ * A single device which can become the boot device, see struct boot_media
+ */
+struct boot_media_candidate {
+    enum boot_media_type type;
+    device_id vid; //USB only; VID_PID_EMPTY matches any device
+    device_id pid; //USB only; VID_PID_EMPTY matches any device
+    unsigned long dom_size_mib; //SATA only; max size of the device
+    char serial[BOOT_SERIAL_MAX_LENGTH + 1]; //USB iSerial or SCSI unit serial; empty matches any device
+};
+
 struct boot_media {
     enum boot_media_type type; //                                 Default: BOOT_MEDIA_USB <valid>
 
@@ -42,17 +73,54 @@ struct boot_media {
 
     //SATA only options
     unsigned long dom_size_mib; //Max size of SATA DOM            Default: 1024 <valid, READ native_sata_boot_shim.c!!!>
+
+    //Ordered list of devices which can become the boot device. Every device appearing is checked against it once and
+    // the first candidate it matches decides (the list order is the priority); the first device matching any of them
+    // becomes the boot device. When "boot_dev=" isn't used this contains a single candidate derived from the options
+    // above, so shims should only use the list.
+    struct boot_media_candidate candidates[MAX_BOOT_CANDIDATES];
+    unsigned int candidates_num;
+};
+
+enum ssd_cache_selector_type {
+    SSD_CACHE_SEL_NONROT, //disks reporting themselves as non-rotational (VPD Block Device Characteristics)
+    SSD_CACHE_SEL_HOST, //disks connected to a SCSI host driver with a given name (e.g. "virtio_scsi")
+    SSD_CACHE_SEL_MODEL, //disks with SCSI model starting with a given string
+    SSD_CACHE_SEL_SERIAL, //disk with a given unit serial
+};
+
+/**
+ * A single rule selecting disks which should be presented as SATA SSDs, see struct ssd_cache_policy
+ */
+struct ssd_cache_selector {
+    enum ssd_cache_selector_type type;
+    char value[SSD_CACHE_SELECTOR_MAX_LENGTH + 1]; //empty for SSD_CACHE_SEL_NONROT
+};
+
+/**
+ * Fast disks which DSM should see as SATA SSDs (which is what DSM requires for SSD cache)
+ *
+ * Disks matching any of the selectors are moved to a SATA port (like those on VirtIO/SAS ports are anyway) and are
+ * marked as non-rotational, see sata_port_shim.c.
+ */
+struct ssd_cache_policy {
+    struct ssd_cache_selector selectors[MAX_SSD_CACHE_SELECTORS];
+    unsigned int selectors_num; //                                Default: 0 <valid, no disks are selected>
 };
 
 struct hw_config;
+//All fields are fixed-size & stored inline - the only allocation the config may own is a runtime hw_config
 struct runtime_config {
     syno_hw hw; //used to determine quirks.                                Default: empty <invalid>
     serial_no sn; //Used to validate it and warn the user.                 Default: empty <invalid>
     struct boot_media boot_media;
+    struct ssd_cache_policy ssd_cache;
     bool port_thaw; //Currently unknown.                                   Default: true  <valid>
     unsigned short netif_num; //Number of eth interfaces.                  Default: 0     <invalid>
-    mac_address *macs[MAX_NET_IFACES]; //MAC addresses of eth interfaces.  Default: []    <invalid>
-    cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS];//    Default: []
+    unsigned short macs_num; //Number of valid MACs in macs (no gaps).     Default: 0     <invalid>
+    mac_address macs[MAX_NET_IFACES]; //MAC addresses of eth interfaces.   Default: []
+    unsigned short cmdline_blacklist_num; //                               Default: 0
+    struct cmdline_token cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS];
     const struct hw_config *hw_config;
 };
 extern struct runtime_config current_config;
@@ -63,6 +131,7 @@ extern struct runtime_config current_config;
  * Warning: if this function returns false YOU MUST NOT trust the config structure. Other code WILL break as it assumes
  * the config is valid (e.g. doesn't have null ptrs which this function generates).
  * Also, after you call this function you should call free_runtime_config() to clear up memory reservations.
+ * This function is __init - it can only be called while the module is loading.
  */
 int populate_runtime_config(struct runtime_config *config);
 
@@ -1,135 +1,261 @@
 #include "debug_execve.h"
 #include "../common.h"
-#include <linux/sched.h> //task_struct
-#include <asm/uaccess.h> //get_user
-#include <linux/compat.h> //compat_uptr_t
+#include <linux/sched.h> //current, TASK_COMM_LEN, local_clock()
+#include <asm/uaccess.h> //get_user(), strncpy_from_user()
 #include <linux/binfmts.h> //MAX_ARG_STRINGS
+#include <linux/jhash.h> //jhash()
+#include "../internal/helper/debugfs_helper.h" //RP_DEBUGFS_ENABLED, get_rp_debugfs_dir()
+#include "../internal/helper/user_args_helper.h" //struct user_arg_ptr, get_user_arg_ptr()
+#ifdef RP_DEBUGFS_ENABLED
+#include <linux/percpu.h> //alloc_percpu(), per_cpu_ptr()
+#include <linux/seqlock.h> //seqcount_t
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+#endif
 
-/*
- * Struct copied 1:1 from:
- *
- *  linux/fs/exec.c
- *
- *  Copyright (C) 1991, 1992  Linus Torvalds
+#define EXECVE_TRACE_RECORDS 64 //per CPU; must be a power of 2
+#define EXECVE_TRACE_FILENAME_LEN 48
+#define EXECVE_TRACE_ARGV_LEN 96
+#define EXECVE_TRACE_FILE "execve_trace"
+
+struct execve_trace_record {
+    unsigned int idx; //position in the ring it was written at, used to detect records overwritten while being read
+    pid_t pid;
+    u64 ts; //local_clock() of the CPU which recorded it
+    u32 filename_hash; //jhash() of the full filename, as the copy below may be truncated
+    u16 argc;
+    bool truncated; //argv didn't fit
+    char comm[TASK_COMM_LEN];
+    char filename[EXECVE_TRACE_FILENAME_LEN];
+    char argv[EXECVE_TRACE_ARGV_LEN]; //args separated by spaces
+};
+
+/**
+ * Copies argv separated by spaces into the record, stopping when it's full (but still counting all args)
  */
-struct user_arg_ptr {
-#ifdef CONFIG_COMPAT
-    bool is_compat;
-#endif
-    union {
-        const char __user *const __user *native;
-#ifdef CONFIG_COMPAT
-        const compat_uptr_t __user *compat;
-#endif
-    } ptr;
+static void copy_args(struct execve_trace_record *rec, const char __user *const __user *argv)
+{
+    struct user_arg_ptr argv_up = { .ptr.native = argv };
+    char *dst = rec->argv;
+    size_t space = sizeof(rec->argv);
+
+    rec->argc = 0;
+    rec->truncated = false;
+    rec->argv[0] = '\0';
+    if (!argv)
+        return;
+
+    for (int i = 0; i < MAX_ARG_STRINGS; ++i) {
+        const char __user *p = get_user_arg_ptr(argv_up, i);
+        if (!p)
+            break;
+
+        if (IS_ERR(p)) {
+            rec->truncated = true;
+            break;
+        }
+
+        ++rec->argc;
+        if (rec->truncated)
+            continue;
+
+        if (i > 0) {
+            if (space < 2) {
+                rec->truncated = true;
+                continue;
+            }
+            *dst++ = ' ';
+            --space;
+        }
+
+        long len = strncpy_from_user(dst, p, space);
+        if (len < 0) {
+            *dst = '\0';
+            rec->truncated = true;
+        } else if ((size_t)len >= space) {
+            dst[space - 1] = '\0';
+            rec->truncated = true;
+        } else {
+            dst += len;
+            space -= len;
+        }
+    }
+}
+
+#ifdef RP_DEBUGFS_ENABLED
+struct execve_trace_ring {
+    unsigned int head; //next position to write at; only ever written by the owning CPU
+    seqcount_t seq[EXECVE_TRACE_RECORDS];
+    struct execve_trace_record records[EXECVE_TRACE_RECORDS];
 };
 
-/*
- * Function copied 1:1 from:
- *
- *  linux/fs/exec.c
+static struct execve_trace_ring __percpu *trace_rings = NULL;
+static struct dentry *trace_file = NULL;
+
+/**
+ * Stores the record in the ring of the current CPU
  *
- *  Copyright (C) 1991, 1992  Linus Torvalds
+ * There's exactly one writer per ring as execve() is never called from an atomic context and the preemption is disabled
+ * here. Readers on other CPUs use per-record seqcounts to skip records being overwritten.
  */
-static const char __user *get_user_arg_ptr(struct user_arg_ptr argv, int nr)
+static void store_record(const struct execve_trace_record *rec)
 {
-    const char __user *native;
+    preempt_disable();
+    struct execve_trace_ring __percpu *rings = ACCESS_ONCE(trace_rings);
+    if (unlikely(!rings)) {
+        preempt_enable();
+        return;
+    }
 
-#ifdef CONFIG_COMPAT
-    if (unlikely(argv.is_compat)) {
-        compat_uptr_t compat;
+    struct execve_trace_ring *ring = this_cpu_ptr(rings);
+    unsigned int idx = ring->head;
+    unsigned int slot = idx & (EXECVE_TRACE_RECORDS - 1);
 
-        if (get_user(compat, argv.ptr.compat + nr))
-            return ERR_PTR(-EFAULT);
+    write_seqcount_begin(&ring->seq[slot]);
+    ring->records[slot] = *rec;
+    ring->records[slot].idx = idx;
+    ring->records[slot].ts = local_clock();
+    write_seqcount_end(&ring->seq[slot]);
 
-        return compat_ptr(compat);
-    }
-#endif
+    smp_wmb(); //record must be visible before the head moves past it
+    ACCESS_ONCE(ring->head) = idx + 1;
+    preempt_enable();
+}
+#else //RP_DEBUGFS_ENABLED
+static void store_record(const struct execve_trace_record *rec)
+{
+    pr_loc_dbg("execve: %s[%d]=>%s#%08x {%s%s} argc=%u", rec->comm, rec->pid, rec->filename, rec->filename_hash,
+               rec->argv, rec->truncated ? "..." : "", rec->argc);
+}
+#endif //RP_DEBUGFS_ENABLED
+
+void RPDBG_trace_execve_call(const char *filename, const char __user *const __user *argv)
+{
+    struct execve_trace_record rec;
 
-    if (get_user(native, argv.ptr.native + nr))
-        return ERR_PTR(-EFAULT);
+    rec.pid = current->pid;
+    memcpy(rec.comm, current->comm, sizeof(rec.comm));
+    rec.filename_hash = jhash(filename, strlen(filename), 0);
+    strlcpy(rec.filename, filename, sizeof(rec.filename));
+    copy_args(&rec, argv); //this can fault & sleep, so it must be done before taking a slot in the ring
 
-    return native;
+    store_record(&rec);
 }
 
-/*
- * Modified for simplicity from count() in:
- *
- *  linux/fs/exec.c
+#ifdef RP_DEBUGFS_ENABLED
+/**
+ * Copies a record from a ring of any CPU
  *
- *  Copyright (C) 1991, 1992  Linus Torvalds
+ * @return true if the record was copied, false if it was overwritten (or was being overwritten) in the meantime
  */
-static int count_args(struct user_arg_ptr argv)
+static bool read_record(struct execve_trace_ring *ring, unsigned int idx, struct execve_trace_record *rec)
 {
-    if (argv.ptr.native == NULL)
-        return 0;
+    unsigned int slot = idx & (EXECVE_TRACE_RECORDS - 1);
+    unsigned int seq = read_seqcount_begin(&ring->seq[slot]);
+    *rec = ring->records[slot];
 
-    int i = 0;
-
-    for (;;) {
-        const char __user *p = get_user_arg_ptr(argv, i);
+    return !read_seqcount_retry(&ring->seq[slot], seq) && rec->idx == idx;
+}
 
-        if (!p)
-            break;
+static int execve_trace_show(struct seq_file *m, void *v)
+{
+    struct execve_trace_record rec;
+    unsigned long dropped = 0;
+    int cpu;
 
-        if (IS_ERR(p) || i >= MAX_ARG_STRINGS)
-            return -EFAULT;
+    seq_printf(m, "%-17s %4s %-16s %7s %-8s %5s  %s\n", "ts", "cpu", "comm", "pid", "hash", "argc", "filename {argv}");
+    for_each_possible_cpu(cpu) {
+        struct execve_trace_ring *ring = per_cpu_ptr(trace_rings, cpu);
+        unsigned int head = ACCESS_ONCE(ring->head);
+        smp_rmb(); //pairs with store_record()
+        unsigned int idx = head > EXECVE_TRACE_RECORDS ? head - EXECVE_TRACE_RECORDS : 0;
+        dropped += idx;
 
-        ++i;
+        for (; idx != head; ++idx) {
+            if (!read_record(ring, idx, &rec)) {
+                ++dropped;
+                continue;
+            }
 
-        if (fatal_signal_pending(current))
-            return -ERESTARTNOHAND;
-        cond_resched();
+            u64 ts = rec.ts;
+            unsigned long ts_ns = do_div(ts, NSEC_PER_SEC);
+            seq_printf(m, "%10llu.%06lu %4d %-16.*s %7d %08x %5u  %.*s {%.*s%s}\n", ts, ts_ns / NSEC_PER_USEC, cpu,
+                       TASK_COMM_LEN, rec.comm, rec.pid, rec.filename_hash, rec.argc, EXECVE_TRACE_FILENAME_LEN,
+                       rec.filename, EXECVE_TRACE_ARGV_LEN, rec.argv, rec.truncated ? "..." : "");
+        }
     }
 
-    return i;
+    seq_printf(m, "(%lu records dropped)\n", dropped);
+    return 0;
 }
 
-static void inline fixup_arg_str(char *arg_ptr, int cur_argc, const char *what)
+static int execve_trace_open(struct inode *inode, struct file *file)
 {
-    pr_loc_wrn("Failed to copy %d arg - %s failed", cur_argc, what);
-    memcpy(arg_ptr, "..?\0", 4);
+    return single_open(file, execve_trace_show, NULL);
 }
 
-void RPDBG_print_execve_call(const char *filename, const char __user *const __user *argv)
+static const struct file_operations execve_trace_fops = {
+    .owner = THIS_MODULE,
+    .open = execve_trace_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+void RPDBG_register_execve_trace(void)
 {
-    struct task_struct *caller = get_cpu_var(current_task);
+    if (unlikely(trace_rings)) {
+        pr_loc_bug("execve() trace is already registered");
+        return;
+    }
 
-    struct user_arg_ptr argv_up = { .ptr.native = argv };
-    int argc = count_args(argv_up);
+    struct dentry *dir = get_rp_debugfs_dir();
+    if (!dir)
+        return; //nobody could read the trace anyway
 
-    char *arg_str = kzalloc(MAX_ARG_STRLEN, GFP_KERNEL);
-    if (unlikely(!arg_str)) {
-        pr_loc_crt("kzalloc failed");
+    struct execve_trace_ring __percpu *rings = alloc_percpu(struct execve_trace_ring);
+    if (unlikely(!rings)) {
+        pr_loc_crt("alloc_percpu failed for %zu bytes - execve() trace will not be available",
+                   sizeof(struct execve_trace_ring));
+        put_rp_debugfs_dir();
         return;
     }
 
-    char *arg_ptr = &arg_str[0];
-    for (int i = 0; i < argc; i++) {
-        const char __user *p = get_user_arg_ptr(argv_up, i);
-        if (IS_ERR(p)) {
-            fixup_arg_str(arg_ptr, i, "get_user_arg_ptr");
-            goto out_free;
-        }
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        struct execve_trace_ring *ring = per_cpu_ptr(rings, cpu);
+        for (int i = 0; i < EXECVE_TRACE_RECORDS; ++i)
+            seqcount_init(&ring->seq[i]);
+    }
 
-        int len = strnlen_user(p, MAX_ARG_STRLEN); //includes nullbyte
-        if (!len) {
-            fixup_arg_str(arg_ptr, i, "strnlen_user");
-            goto out_free;
-        }
-        --len; //we want to copy without nullbyte as we handle it ourselves while attaching to arg_ptr
+    trace_file = debugfs_create_file(EXECVE_TRACE_FILE, 0400, dir, NULL, &execve_trace_fops);
+    if (IS_ERR_OR_NULL(trace_file)) {
+        pr_loc_wrn("Failed to create debugfs file for execve() trace - it will not be available");
+        trace_file = NULL;
+        free_percpu(rings);
+        put_rp_debugfs_dir();
+        return;
+    }
 
-        if (copy_from_user(arg_ptr, p, len)) {
-            fixup_arg_str(arg_ptr, i, "copy_from_user");
-            goto out_free;
-         }
+    ACCESS_ONCE(trace_rings) = rings;
+    pr_loc_inf("execve() trace available in debugfs at %s", EXECVE_TRACE_FILE);
+}
 
-        arg_ptr += len;
-        *arg_ptr = (i + 1 == argc) ? '\0' : ' '; //separate by spaces UNLESS it's the last argument
-        ++arg_ptr;
-    }
+void RPDBG_unregister_execve_trace(void)
+{
+    if (!trace_rings)
+        return;
 
-    out_free:
-    pr_loc_dbg("execve@cpu%d: %s[%d]=>%s[%d] {%s}", caller->on_cpu, caller->comm, caller->pid, filename, argc, arg_str);
-    kfree(arg_str);
-}
\ No newline at end of file
+    debugfs_remove(trace_file); //it cannot be open as it pins the module
+    trace_file = NULL;
+
+    struct execve_trace_ring __percpu *rings = trace_rings;
+    ACCESS_ONCE(trace_rings) = NULL;
+    synchronize_sched(); //writers access rings with preemption disabled
+    free_percpu(rings);
+    put_rp_debugfs_dir();
+}
+#else //RP_DEBUGFS_ENABLED
+void RPDBG_register_execve_trace(void) { }
+void RPDBG_unregister_execve_trace(void) { }
+#endif //RP_DEBUGFS_ENABLED
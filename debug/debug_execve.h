@@ -1,6 +1,29 @@
 #ifndef REDPILL_DEBUG_EXECVE_H
 #define REDPILL_DEBUG_EXECVE_H
 
-void RPDBG_print_execve_call(const char *filename, const char *const *argv);
+/**
+ * Trace of execve() calls for debugging (enabled with DBG_EXECVE)
+ *
+ * Every call is recorded as a small binary record (timestamp, pid, comm, hash of the full filename and truncated
+ * filename & argv) in a per-CPU ring of EXECVE_TRACE_RECORDS entries. Writers never take locks nor wait for anything
+ * but copying argv from the userspace, so tracing doesn't slow down exec to the console speed. The rings are read in
+ * <debugfs>/redpill/execve_trace (oldest first per CPU; records overwritten before being read are counted as dropped).
+ * When debugfs isn't available in the current stealth mode every record is printed to the kernel log instead.
+ */
+
+/**
+ * Records an execve() call; must be called from the process context of the caller (argv is read from its memory)
+ */
+void RPDBG_trace_execve_call(const char *filename, const char __user *const __user *argv);
+
+/**
+ * Allocates trace rings & creates the debugfs file (noop if debugfs isn't available)
+ */
+void RPDBG_register_execve_trace(void);
+
+/**
+ * Frees everything allocated by RPDBG_register_execve_trace(); it's safe to call it when the trace wasn't registered
+ */
+void RPDBG_unregister_execve_trace(void);
 
 #endif //REDPILL_DEBUG_EXECVE_H
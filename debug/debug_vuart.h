@@ -60,7 +60,8 @@
                dri(d,msr,UART_MSR_DCD));
 
 #else //VUART_DEBUG_LOG disabled \/
-#define uart_prdbg(f, ...) { /* noop */ }
+#include "../internal/helper/debug_keys.h" //pr_loc_dbg_on()
+#define uart_prdbg(f, ...) pr_loc_dbg_on(VUART, f, ##__VA_ARGS__) //can be switched on at runtime (w/o register dumps)
 #define reg_read(rN) { /* noop */ }
 #define reg_write(rN) { /* noop */ }
 #define reg_read_dump(d, rF, rN) { /* noop */ }
@@ -0,0 +1,229 @@
+#include "debug_vuart_trace.h"
+
+#ifdef VUART_TRACE_ENABLED
+#include "../common.h"
+#include "../internal/helper/debugfs_helper.h" //get_rp_debugfs_dir(), put_rp_debugfs_dir()
+#include <linux/percpu.h> //alloc_percpu(), per_cpu_ptr(), this_cpu_ptr()
+#include <linux/vmalloc.h> //vmalloc(), vfree()
+#include <linux/timex.h> //get_cycles()
+#include <asm/tsc.h> //tsc_khz
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/fs.h> //simple_read_from_buffer()
+
+#define VUART_TRACE_RECORDS 8192 //per CPU (128KB each); must be a power of 2
+#define VUART_TRACE_FILE "vuart_trace"
+
+struct vuart_trace_ring {
+    unsigned long head; //next position to write at; only ever written by the owning CPU with IRQs disabled
+    unsigned long base; //first position to dump; moved by a reset (only used by readers)
+    struct vuart_trace_record *records;
+};
+
+struct vuart_trace_dump {
+    size_t len;
+    char data[];
+};
+
+static struct vuart_trace_ring __percpu *trace_rings = NULL;
+static struct dentry *trace_file = NULL;
+
+void __vuart_trace_record(u8 line, vuart_trace_op op, u8 offset, u8 value, u8 iir_before, u8 lsr_before, u8 iir_after,
+                          u8 lsr_after)
+{
+    unsigned long flags;
+
+    //Accesses can happen from any context (e.g. a lockless read interrupted by a console write) - this makes the CPU
+    // the only writer of its ring
+    local_irq_save(flags);
+    struct vuart_trace_ring __percpu *rings = ACCESS_ONCE(trace_rings);
+    if (unlikely(!rings)) {
+        local_irq_restore(flags);
+        return;
+    }
+
+    struct vuart_trace_ring *ring = this_cpu_ptr(rings);
+    struct vuart_trace_record *rec = &ring->records[ring->head & (VUART_TRACE_RECORDS - 1)];
+    rec->tsc = get_cycles();
+    rec->line = line;
+    rec->op = op;
+    rec->offset = offset;
+    rec->value = value;
+    rec->iir_before = iir_before;
+    rec->lsr_before = lsr_before;
+    rec->iir_after = iir_after;
+    rec->lsr_after = lsr_after;
+
+    smp_wmb(); //record must be visible before the head moves past it
+    ACCESS_ONCE(ring->head) = ring->head + 1;
+    local_irq_restore(flags);
+}
+
+/**
+ * Copies records of a single CPU ring into the dump
+ *
+ * Writers don't wait for readers, so records which could've been overwritten while copying are dropped afterwards.
+ *
+ * @return pointer right after the data appended
+ */
+static char *dump_ring(struct vuart_trace_ring *ring, int cpu, char *pos)
+{
+    struct vuart_trace_chunk *chunk = (struct vuart_trace_chunk *)pos;
+    struct vuart_trace_record *out = (struct vuart_trace_record *)(chunk + 1);
+
+    unsigned long head = ACCESS_ONCE(ring->head);
+    smp_rmb(); //pairs with __vuart_trace_record()
+    unsigned long base = ACCESS_ONCE(ring->base);
+    unsigned long start = head - base > VUART_TRACE_RECORDS ? head - VUART_TRACE_RECORDS : base;
+
+    for (unsigned long idx = start; idx != head; ++idx)
+        out[idx - start] = ring->records[idx & (VUART_TRACE_RECORDS - 1)];
+
+    //Records which were more than the ring size behind the head at any point could've been overwritten while copying
+    smp_rmb();
+    unsigned long now = ACCESS_ONCE(ring->head);
+    unsigned long first = now - start > VUART_TRACE_RECORDS ? now - VUART_TRACE_RECORDS : start;
+    unsigned long torn = min(first - start, head - start);
+    if (torn)
+        memmove(out, out + torn, sizeof(*out) * (head - start - torn));
+
+    chunk->cpu = cpu;
+    chunk->records = head - start - torn;
+    chunk->dropped = start - base + torn;
+
+    return (char *)(out + chunk->records);
+}
+
+static int vuart_trace_open(struct inode *inode, struct file *file)
+{
+    size_t size = sizeof(struct vuart_trace_header) +
+                  num_possible_cpus() * (sizeof(struct vuart_trace_chunk) +
+                                         sizeof(struct vuart_trace_record) * VUART_TRACE_RECORDS);
+    struct vuart_trace_dump *dump = vmalloc(sizeof(*dump) + size);
+    if (unlikely(!dump)) {
+        pr_loc_crt("vmalloc failed for %zu bytes of vUART trace", size);
+        return -ENOMEM;
+    }
+
+    struct vuart_trace_header *hdr = (struct vuart_trace_header *)dump->data;
+    memcpy(hdr->magic, VUART_TRACE_MAGIC, sizeof(hdr->magic));
+    hdr->version = VUART_TRACE_VERSION;
+    hdr->record_size = sizeof(struct vuart_trace_record);
+    hdr->tsc_khz = tsc_khz;
+    hdr->chunks = 0;
+
+    char *pos = (char *)(hdr + 1);
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        pos = dump_ring(per_cpu_ptr(trace_rings, cpu), cpu, pos);
+        ++hdr->chunks;
+    }
+
+    dump->len = pos - dump->data;
+    file->private_data = dump;
+
+    return nonseekable_open(inode, file);
+}
+
+static ssize_t vuart_trace_read(struct file *file, char __user *buf, size_t len, loff_t *ppos)
+{
+    struct vuart_trace_dump *dump = file->private_data;
+    return simple_read_from_buffer(buf, len, ppos, dump->data, dump->len);
+}
+
+static ssize_t vuart_trace_reset(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
+{
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        struct vuart_trace_ring *ring = per_cpu_ptr(trace_rings, cpu);
+        ACCESS_ONCE(ring->base) = ACCESS_ONCE(ring->head);
+    }
+
+    pr_loc_dbg("vUART trace reset");
+    return len;
+}
+
+static int vuart_trace_release(struct inode *inode, struct file *file)
+{
+    vfree(file->private_data);
+    return 0;
+}
+
+static const struct file_operations vuart_trace_fops = {
+    .owner = THIS_MODULE,
+    .open = vuart_trace_open,
+    .read = vuart_trace_read,
+    .write = vuart_trace_reset,
+    .llseek = no_llseek,
+    .release = vuart_trace_release,
+};
+
+static void free_trace_rings(struct vuart_trace_ring __percpu *rings)
+{
+    int cpu;
+    for_each_possible_cpu(cpu)
+        vfree(per_cpu_ptr(rings, cpu)->records);
+
+    free_percpu(rings);
+}
+
+int register_vuart_trace(void)
+{
+    if (unlikely(trace_rings)) {
+        pr_loc_bug("vUART trace is already registered");
+        return -EALREADY;
+    }
+
+    struct dentry *dir = get_rp_debugfs_dir();
+    if (!dir)
+        return 0; //nobody could read the trace anyway
+
+    int cpu;
+    struct vuart_trace_ring __percpu *rings = alloc_percpu(struct vuart_trace_ring);
+    if (unlikely(!rings))
+        goto error_nomem;
+
+    for_each_possible_cpu(cpu) {
+        struct vuart_trace_ring *ring = per_cpu_ptr(rings, cpu);
+        ring->records = vmalloc(sizeof(struct vuart_trace_record) * VUART_TRACE_RECORDS);
+        if (unlikely(!ring->records))
+            goto error_nomem;
+    }
+
+    trace_file = debugfs_create_file(VUART_TRACE_FILE, 0600, dir, NULL, &vuart_trace_fops);
+    if (IS_ERR_OR_NULL(trace_file)) {
+        pr_loc_wrn("Failed to create debugfs file for vUART trace - it will not be available");
+        trace_file = NULL;
+        free_trace_rings(rings);
+        put_rp_debugfs_dir();
+        return 0;
+    }
+
+    ACCESS_ONCE(trace_rings) = rings;
+    pr_loc_inf("vUART trace available in debugfs at %s", VUART_TRACE_FILE);
+    return 0;
+
+    error_nomem:
+    pr_loc_crt("Failed to allocate vUART trace rings");
+    if (rings)
+        free_trace_rings(rings);
+    put_rp_debugfs_dir();
+    return -ENOMEM;
+}
+
+int unregister_vuart_trace(void)
+{
+    if (!trace_rings)
+        return 0; //it's not an error as debugfs may not be available
+
+    debugfs_remove(trace_file); //it cannot be open as it pins the module
+    trace_file = NULL;
+
+    struct vuart_trace_ring __percpu *rings = trace_rings;
+    ACCESS_ONCE(trace_rings) = NULL;
+    synchronize_sched(); //writers access rings with IRQs disabled
+    free_trace_rings(rings);
+    put_rp_debugfs_dir();
+
+    return 0;
+}
+#endif //VUART_TRACE_ENABLED
@@ -0,0 +1,101 @@
+#ifndef REDPILL_DEBUG_VUART_TRACE_H
+#define REDPILL_DEBUG_VUART_TRACE_H
+
+/**
+ * Binary trace of vUART register accesses (enabled with DBG_VUART_TRACE)
+ *
+ * Unlike VUART_DEBUG_LOG (see debug_vuart.h), which prints every access and changes timing so much that races simply
+ * disappear, this only stores a 16 byte record per access in a per-CPU ring of VUART_TRACE_RECORDS entries. Recording
+ * takes no locks and costs a TSC read and a few stores, so console & PMU traffic can be profiled as it really is.
+ *
+ * The trace is read from <debugfs>/redpill/vuart_trace as a binary dump (a snapshot taken when the file is opened).
+ * Writing anything to the file discards everything recorded so far. All integers are little-endian:
+ *   struct vuart_trace_header                 once
+ *   { struct vuart_trace_chunk                once per possible CPU...
+ *     struct vuart_trace_record[records] }    ...followed by its records, oldest first (merge CPUs by tsc)
+ * The dump can be decoded with e.g. Python's struct module using formats "<4sHHII", "<IIQ" and "<QBBBBBBBB".
+ */
+#include <linux/types.h> //u8, u16, u32, u64
+#include "../internal/helper/debugfs_helper.h" //RP_DEBUGFS_ENABLED
+
+#if defined(VUART_TRACE) && defined(RP_DEBUGFS_ENABLED)
+#define VUART_TRACE_ENABLED
+#endif
+
+#define VUART_TRACE_MAGIC "RPVT"
+#define VUART_TRACE_VERSION 1
+
+typedef enum {
+    VUART_TRACE_READ = 0, //read done with vdev lock held
+    VUART_TRACE_READ_LOCKLESS, //read served by try_lockless_read() (registers cannot change, so before == after)
+    VUART_TRACE_WRITE,
+} vuart_trace_op;
+
+struct vuart_trace_header {
+    char magic[4]; //VUART_TRACE_MAGIC, not terminated
+    u16 version; //VUART_TRACE_VERSION
+    u16 record_size; //sizeof(struct vuart_trace_record)
+    u32 tsc_khz; //to convert tsc to time
+    u32 chunks; //number of struct vuart_trace_chunk following
+} __packed;
+
+struct vuart_trace_chunk {
+    u32 cpu;
+    u32 records; //number of records following
+    u64 dropped; //records overwritten before they could be dumped
+} __packed;
+
+struct vuart_trace_record {
+    u64 tsc; //get_cycles() when the access finished
+    u8 line; //ttyS#
+    u8 op; //vuart_trace_op
+    u8 offset; //register (UART_* from serial_reg.h)
+    u8 value; //written or returned value
+    u8 iir_before;
+    u8 lsr_before;
+    u8 iir_after;
+    u8 lsr_after;
+} __packed;
+
+#ifdef VUART_TRACE_ENABLED
+/**
+ * Captures registers before the access (call with vdev lock held)
+ *
+ * @param var prefix of variables to declare for storing registers
+ */
+#define vuart_trace_begin(vdev, var) u8 var##_iir = (vdev)->iir, var##_lsr = (vdev)->lsr
+
+/**
+ * Records an access started with vuart_trace_begin() (call with vdev lock held, after IIR was recomputed)
+ */
+#define vuart_trace_end(vdev, var, op, offset, value) \
+    __vuart_trace_record((vdev)->line, op, offset, value, var##_iir, var##_lsr, (vdev)->iir, (vdev)->lsr)
+
+/**
+ * Records a lockless read (registers are read without consistency, it's only informative)
+ */
+#define vuart_trace_lockless(vdev, offset, value)                                                                     \
+    __vuart_trace_record((vdev)->line, VUART_TRACE_READ_LOCKLESS, offset, value, ACCESS_ONCE((vdev)->iir),           \
+                         ACCESS_ONCE((vdev)->lsr), ACCESS_ONCE((vdev)->iir), ACCESS_ONCE((vdev)->lsr))
+
+/**
+ * Allocates trace rings & creates debugfs entry for the trace
+ *
+ * @return 0 on success, -E on error
+ */
+int register_vuart_trace(void);
+int unregister_vuart_trace(void);
+
+//[internal] do not use directly, use macros above
+void __vuart_trace_record(u8 line, vuart_trace_op op, u8 offset, u8 value, u8 iir_before, u8 lsr_before, u8 iir_after,
+                          u8 lsr_after);
+
+#else //VUART_TRACE_ENABLED
+#define vuart_trace_begin(vdev, var)
+#define vuart_trace_end(vdev, var, op, offset, value)
+#define vuart_trace_lockless(vdev, offset, value)
+static inline int register_vuart_trace(void) { return 0; }
+static inline int unregister_vuart_trace(void) { return 0; }
+#endif //VUART_TRACE_ENABLED
+
+#endif //REDPILL_DEBUG_VUART_TRACE_H
@@ -0,0 +1,235 @@
+/**
+ * Timing trace of the module initialization
+ *
+ * Every registration (module init steps in redpill_main.c and every shim via shim_reg_in()/shim_reg_ok()) opens and
+ * closes an entry recording when it started (relative to the first entry, i.e. module init) and how long it took.
+ * Additionally every entry gets cycles spent in TLB flushes and kallsyms lookups while it was open (see
+ * boot_trace_cost_id). Costs are accounted from global counters, so with entries open in parallel (e.g. deferred init
+ * steps) they're attributed to all of them, and nested entries are included in their parents.
+ *
+ * The table is printed to the kernel log when the init finishes and is available in <debugfs>/redpill/boot_trace.
+ * Entries which were opened but never closed (e.g. a shim which failed to register) are shown without a duration.
+ * Only the first BOOT_TRACE_MAX_ENTRIES entries are kept - shims registered much later (e.g. when mfgBIOS loads) will
+ * usually still fit. The whole subsystem compiles out when the stealth mode doesn't allow it.
+ */
+#include "boot_trace.h"
+
+#ifdef BOOT_TRACE_ENABLED
+#include "../common.h"
+#include <linux/atomic.h> //atomic64_t, atomic64_add(), atomic64_read()
+#include <linux/ktime.h> //ktime_get(), ktime_sub(), ktime_to_us()
+#include <linux/sched.h> //current
+#include <linux/spinlock.h> //DEFINE_SPINLOCK, spin_lock_irqsave()
+#include "helper/debugfs_helper.h" //get_rp_debugfs_dir(), put_rp_debugfs_dir()
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+
+#define BOOT_TRACE_MAX_ENTRIES 64
+#define BOOT_TRACE_FILE "boot_trace"
+#define BOOT_TRACE_ROW_FMT "%-40.*s %10lld %10lld %14llu %14llu %6d"
+#define BOOT_TRACE_HDR_FMT "%-40s %10s %10s %14s %14s %6s"
+
+struct boot_trace_entry {
+    const char *name;
+    const struct task_struct *task; //only compared, never dereferenced
+    ktime_t start;
+    ktime_t end; //zero while the entry is open
+    u64 cost[BOOT_TRACE_COST_MAX]; //value of totals at start while open, difference after the entry is closed
+    int result;
+};
+
+static const char *cost_names[BOOT_TRACE_COST_MAX] = {
+    [BOOT_TRACE_TLB_FLUSH] = "tlb_cycles",
+    [BOOT_TRACE_KALLSYMS] = "kallsyms_cycles",
+};
+
+static struct boot_trace_entry entries[BOOT_TRACE_MAX_ENTRIES];
+static unsigned int entries_num = 0;
+static bool entries_overflow = false;
+static atomic64_t cost_totals[BOOT_TRACE_COST_MAX];
+static DEFINE_SPINLOCK(trace_lock); //entries may be opened & closed by deferred init steps in parallel
+static struct dentry *trace_file = NULL;
+
+void __boot_trace_account(boot_trace_cost_id id, cycles_t cycles)
+{
+    atomic64_add(cycles, &cost_totals[id]);
+}
+
+void boot_trace_begin(const char *name)
+{
+    unsigned long flags;
+    ktime_t now = ktime_get();
+
+    spin_lock_irqsave(&trace_lock, flags);
+    if (unlikely(entries_num >= BOOT_TRACE_MAX_ENTRIES)) {
+        if (!entries_overflow)
+            pr_loc_wrn("Boot trace is full - %s and all subsequent entries will not be traced", name);
+        entries_overflow = true;
+        spin_unlock_irqrestore(&trace_lock, flags);
+        return;
+    }
+
+    struct boot_trace_entry *entry = &entries[entries_num++];
+    entry->name = name;
+    entry->task = current;
+    entry->start = now;
+    entry->end = ktime_set(0, 0);
+    entry->result = 0;
+    for (int i = 0; i < BOOT_TRACE_COST_MAX; ++i)
+        entry->cost[i] = atomic64_read(&cost_totals[i]);
+    spin_unlock_irqrestore(&trace_lock, flags);
+}
+
+void boot_trace_end(const char *name, int result)
+{
+    unsigned long flags;
+    ktime_t now = ktime_get();
+
+    spin_lock_irqsave(&trace_lock, flags);
+    for (int i = entries_num - 1; i >= 0; --i) {
+        struct boot_trace_entry *entry = &entries[i];
+        //compared by pointer first as names are usually literals (the same one is used for begin & end)
+        if (ktime_to_ns(entry->end) != 0 || entry->task != current ||
+            (entry->name != name && strcmp(entry->name, name) != 0))
+            continue;
+
+        entry->end = now;
+        entry->result = result;
+        for (int c = 0; c < BOOT_TRACE_COST_MAX; ++c)
+            entry->cost[c] = atomic64_read(&cost_totals[c]) - entry->cost[c];
+        break;
+    }
+    spin_unlock_irqrestore(&trace_lock, flags);
+}
+
+/**
+ * Copies entries to be printed without holding the lock (they're small & printing may sleep)
+ *
+ * @return number of entries copied
+ */
+static unsigned int snapshot_entries(struct boot_trace_entry *snapshot)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&trace_lock, flags);
+    unsigned int num = entries_num;
+    memcpy(snapshot, entries, sizeof(struct boot_trace_entry) * num);
+    spin_unlock_irqrestore(&trace_lock, flags);
+
+    return num;
+}
+
+//Arguments for BOOT_TRACE_ROW_FMT: name (up to the first "("), start & duration in us, costs, result
+#define boot_trace_row_args(entry, epoch)                                                                     \
+    (int)strcspn((entry)->name, "("), (entry)->name, ktime_to_us(ktime_sub((entry)->start, epoch)),           \
+    ktime_to_ns((entry)->end) ? ktime_to_us(ktime_sub((entry)->end, (entry)->start)) : -1LL,                  \
+    ktime_to_ns((entry)->end) ? (entry)->cost[BOOT_TRACE_TLB_FLUSH] : 0ULL,                                   \
+    ktime_to_ns((entry)->end) ? (entry)->cost[BOOT_TRACE_KALLSYMS] : 0ULL, (entry)->result
+
+void boot_trace_dump(void)
+{
+    struct boot_trace_entry *snapshot = kmalloc(sizeof(entries), GFP_KERNEL); //too big for the stack
+    if (unlikely(!snapshot)) {
+        pr_loc_wrn("Failed to allocate %zu bytes to dump boot trace", sizeof(entries));
+        return;
+    }
+
+    unsigned int num = snapshot_entries(snapshot);
+
+    pr_loc_dbg(BOOT_TRACE_HDR_FMT, "step", "start_us", "took_us", cost_names[BOOT_TRACE_TLB_FLUSH],
+               cost_names[BOOT_TRACE_KALLSYMS], "result");
+    for (unsigned int i = 0; i < num; ++i)
+        pr_loc_dbg(BOOT_TRACE_ROW_FMT, boot_trace_row_args(&snapshot[i], snapshot[0].start));
+
+    kfree(snapshot);
+}
+
+unsigned int boot_trace_get_samples(struct boot_trace_sample *samples, unsigned int max)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&trace_lock, flags);
+    unsigned int num = min(max, entries_num);
+    for (unsigned int i = 0; i < num; ++i) {
+        const struct boot_trace_entry *entry = &entries[i];
+        bool closed = ktime_to_ns(entry->end) != 0;
+
+        samples[i].name = entry->name;
+        samples[i].name_len = strcspn(entry->name, "(");
+        samples[i].start_us = ktime_to_us(ktime_sub(entry->start, entries[0].start));
+        samples[i].took_us = closed ? ktime_to_us(ktime_sub(entry->end, entry->start)) : -1;
+        for (int c = 0; c < BOOT_TRACE_COST_MAX; ++c)
+            samples[i].cost[c] = closed ? entry->cost[c] : 0;
+        samples[i].result = entry->result;
+    }
+    spin_unlock_irqrestore(&trace_lock, flags);
+
+    return num;
+}
+
+static int boot_trace_show(struct seq_file *m, void *v)
+{
+    struct boot_trace_entry *snapshot;
+    kmalloc_or_exit_int(snapshot, sizeof(entries));
+    unsigned int num = snapshot_entries(snapshot);
+
+    seq_printf(m, BOOT_TRACE_HDR_FMT "\n", "step", "start_us", "took_us", cost_names[BOOT_TRACE_TLB_FLUSH],
+               cost_names[BOOT_TRACE_KALLSYMS], "result");
+    for (unsigned int i = 0; i < num; ++i)
+        seq_printf(m, BOOT_TRACE_ROW_FMT "\n", boot_trace_row_args(&snapshot[i], snapshot[0].start));
+
+    if (entries_overflow)
+        seq_printf(m, "(trace is full - later entries were dropped)\n");
+
+    kfree(snapshot);
+    return 0;
+}
+
+static int boot_trace_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, boot_trace_show, NULL);
+}
+
+static const struct file_operations boot_trace_fops = {
+    .owner = THIS_MODULE,
+    .open = boot_trace_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int register_boot_trace(void)
+{
+    if (unlikely(trace_file)) {
+        pr_loc_bug("Boot trace is already registered");
+        return -EALREADY;
+    }
+
+    struct dentry *dir = get_rp_debugfs_dir();
+    if (!dir)
+        return 0; //debugfs not available - the trace will still be dumped to the log
+
+    trace_file = debugfs_create_file(BOOT_TRACE_FILE, 0400, dir, NULL, &boot_trace_fops);
+    if (IS_ERR_OR_NULL(trace_file)) {
+        pr_loc_wrn("Failed to create debugfs file for boot trace - it will only be available in the log");
+        trace_file = NULL;
+        put_rp_debugfs_dir();
+        return 0;
+    }
+
+    pr_loc_inf("Boot trace available in debugfs at %s", BOOT_TRACE_FILE);
+    return 0;
+}
+
+int unregister_boot_trace(void)
+{
+    if (!trace_file)
+        return 0; //it's not an error as debugfs may not be available
+
+    debugfs_remove(trace_file);
+    trace_file = NULL;
+    put_rp_debugfs_dir();
+
+    return 0;
+}
+#endif //BOOT_TRACE_ENABLED
@@ -0,0 +1,117 @@
+#ifndef REDPILL_BOOT_TRACE_H
+#define REDPILL_BOOT_TRACE_H
+
+#include "helper/debugfs_helper.h" //RP_DEBUGFS_ENABLED
+
+//Same as hook stats: the trace is exposed via debugfs and there's no point in collecting it if it's not available
+#ifdef RP_DEBUGFS_ENABLED
+#define BOOT_TRACE_ENABLED
+#endif
+
+/**
+ * Costs accounted to every open trace entry; when adding one here remember to add its name in boot_trace.c
+ */
+typedef enum {
+    BOOT_TRACE_TLB_FLUSH = 0, //internal/helper/memory_helper.c: global & ranged TLB flushes
+    BOOT_TRACE_KALLSYMS, //internal/call_protected.c: kallsyms lookups & walks
+    BOOT_TRACE_COST_MAX
+} boot_trace_cost_id;
+
+#ifdef BOOT_TRACE_ENABLED
+#include <linux/timex.h> //get_cycles(), cycles_t
+
+/**
+ * Opens a trace entry for the current task
+ *
+ * @param name static string; it's printed up to the first "(" so that a stringified call can be used as-is
+ */
+void boot_trace_begin(const char *name);
+
+/**
+ * Closes the most recent entry opened by boot_trace_begin() with the same name in the current task
+ */
+void boot_trace_end(const char *name, int result);
+
+/**
+ * Traces an expression returning int (usually a register_*() call) under its own text as the name
+ */
+#define boot_trace_step(expr) ({                                       \
+    boot_trace_begin(#expr);                                           \
+    int __bt_out = (expr);                                             \
+    boot_trace_end(#expr, __bt_out);                                   \
+    __bt_out;                                                          \
+})
+
+/**
+ * Measures an expression returning void and accounts its cycles as a given cost
+ */
+#define boot_trace_cost_void(id, expr) do {                            \
+    cycles_t __bt_start = get_cycles();                                \
+    (expr);                                                            \
+    __boot_trace_account(id, get_cycles() - __bt_start);               \
+} while(0)
+
+/**
+ * Same as boot_trace_cost_void() but returns the value of the expression
+ */
+#define boot_trace_cost(id, expr) ({                                   \
+    cycles_t __bt_start = get_cycles();                                \
+    typeof(expr) __bt_out = (expr);                                    \
+    __boot_trace_account(id, get_cycles() - __bt_start);               \
+    __bt_out;                                                          \
+})
+
+/**
+ * Prints the whole trace table to the kernel log (at debug level)
+ */
+void boot_trace_dump(void);
+
+/**
+ * A single trace entry as seen from outside of the trace, see boot_trace_get_samples()
+ */
+struct boot_trace_sample {
+    const char *name; //NOT terminated after name_len (which stops at the first "(")
+    unsigned int name_len;
+    s64 start_us; //relative to the first entry
+    s64 took_us; //-1 while the entry is open
+    u64 cost[BOOT_TRACE_COST_MAX]; //cycles; 0 while the entry is open
+    int result;
+};
+
+/**
+ * Copies the trace without any formatting (e.g. for telemetry)
+ *
+ * @param samples array to fill
+ * @param max size of the array; entries past it are skipped
+ *
+ * @return number of samples filled
+ */
+unsigned int boot_trace_get_samples(struct boot_trace_sample *samples, unsigned int max);
+
+/**
+ * Creates debugfs entry exposing the trace table
+ *
+ * Entries are recorded regardless of whether the file exists (the trace starts before debugfs is set up).
+ *
+ * @return 0 on success, -E on error
+ */
+int register_boot_trace(void);
+int unregister_boot_trace(void);
+
+//[internal] do not use directly, use macros above
+void __boot_trace_account(boot_trace_cost_id id, cycles_t cycles);
+
+#else //BOOT_TRACE_ENABLED
+#define boot_trace_begin(name)
+#define boot_trace_end(name, result)
+#define boot_trace_step(expr) (expr)
+#define boot_trace_cost_void(id, expr) (expr)
+#define boot_trace_cost(id, expr) (expr)
+#define boot_trace_dump()
+struct boot_trace_sample;
+static inline unsigned int boot_trace_get_samples(struct boot_trace_sample *samples, unsigned int max) { return 0; }
+static inline int register_boot_trace(void) { return 0; }
+static inline int unregister_boot_trace(void) { return 0; }
+#endif //BOOT_TRACE_ENABLED
+
+#endif //REDPILL_BOOT_TRACE_H
@@ -1,8 +1,10 @@
 #include "call_protected.h"
 #include "../common.h"
 #include <linux/errno.h> //common exit codes
-#include <linux/kallsyms.h> //kallsyms_lookup_name()
+#include <linux/kallsyms.h> //kallsyms_lookup_name(), kallsyms_on_each_symbol()
 #include <linux/module.h> //symbol_get()/put
+#include <linux/bitmap.h> //DECLARE_BITMAP, set_bit(), test_bit()
+#include "boot_trace.h" //boot_trace_cost(), boot_trace_cost_void()
 
 //This will eventually stop working (since Linux >=5.7.0 has the kallsyms_lookup_name() removed)
 //Workaround will be needed: https://github.com/xcellerator/linux_kernel_hacking/issues/3
@@ -19,7 +21,8 @@
   return_type _##org_function_name(call_args)                                                     \
   {                                                                                               \
       if (unlikely(org_function_name##__addr == 0)) {                                             \
-          org_function_name##__addr = kallsyms_lookup_name(#org_function_name);                   \
+          org_function_name##__addr = boot_trace_cost(BOOT_TRACE_KALLSYMS,                        \
+                                                      kallsyms_lookup_name(#org_function_name));  \
           if (org_function_name##__addr == 0) {                                                   \
               pr_loc_bug("Failed to fetch %s() syscall address", #org_function_name);             \
               return fail_return;                                                                 \
@@ -33,27 +36,30 @@
 //This macro should be used to export symbols which aren't normally EXPORT_SYMBOL/EXPORT_SYMBOL_GPL in the kernel but
 // they exist within the kernel and are defined as __init. These symbol can only be called when the system is still
 // booting (i.e. before init user-space binary was called). After that calling such functions is a lottery - the memory
-// of them is freed by free_initmem() [called in main.c:kernel_init()]. That's why we skip any caching kere as these are
-// called mostly as a one-off during boot process when this module was loaded as a I/O scheduler.
+// of them is freed by free_initmem() [called in main.c:kernel_init()]. That's why every call checks the system state
+// (the address itself is cached as it doesn't change - it's the code behind it which may disappear).
 //All re-exported function will have _ prefix (e.g. foo() becomes _foo())
 #define DEFINE_UNEXPORTED_INIT_SHIM(return_type, org_function_name, call_args, call_vars, fail_return) \
   extern asmlinkage return_type org_function_name(call_args);                                          \
   typedef typeof(org_function_name) *org_function_name##__ret;                                         \
+  static unsigned long org_function_name##__addr = 0;                                                  \
   return_type _##org_function_name(call_args)                                                          \
   {                                                                                                    \
-      unsigned long org_function_name##__addr = 0;                                                     \
       if (unlikely(!is_system_booting())) {                                                            \
           pr_loc_bug("Attempted to call %s() when the system is already booted (state=%d)",            \
                      #org_function_name, system_state);                                                \
           return fail_return;                                                                          \
       }                                                                                                \
                                                                                                        \
-      org_function_name##__addr = kallsyms_lookup_name(#org_function_name);                            \
-      if (org_function_name##__addr == 0) {                                                            \
-          pr_loc_bug("Failed to fetch %s() syscall address", #org_function_name);                      \
-          return fail_return;                                                                          \
+      if (unlikely(org_function_name##__addr == 0)) {                                                  \
+          org_function_name##__addr = boot_trace_cost(BOOT_TRACE_KALLSYMS,                             \
+                                                      kallsyms_lookup_name(#org_function_name));       \
+          if (org_function_name##__addr == 0) {                                                        \
+              pr_loc_bug("Failed to fetch %s() syscall address", #org_function_name);                  \
+              return fail_return;                                                                      \
+          }                                                                                            \
+          pr_loc_dbg("Got addr %lx for %s", org_function_name##__addr, #org_function_name);            \
       }                                                                                                \
-      pr_loc_dbg("Got addr %lx for %s", org_function_name##__addr, #org_function_name);                \
                                                                                                        \
       return ((org_function_name##__ret)org_function_name##__addr)(call_vars);                         \
   }
@@ -82,6 +88,7 @@
 
 DEFINE_UNEXPORTED_SHIM(int, cmdline_proc_show, CP_LIST(struct seq_file *m, void *v), CP_LIST(m, v), -EFAULT);
 DEFINE_UNEXPORTED_SHIM(void, flush_tlb_all, CP_LIST(void), CP_LIST(), __VOID_RETURN__);
+DEFINE_UNEXPORTED_SHIM(void, flush_tlb_kernel_range, CP_LIST(unsigned long start, unsigned long end), CP_LIST(start, end), __VOID_RETURN__);
 
 //See header file for detailed explanation what's going on here as it's more complex than a single commit
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
@@ -102,12 +109,171 @@ DEFINE_UNEXPORTED_SHIM(struct filename *, getname, CP_LIST(const char __user *na
 #endif
 
 DEFINE_UNEXPORTED_SHIM(int, scsi_scan_host_selected, CP_LIST(struct Scsi_Host *shost, unsigned int channel, unsigned int id, u64 lun, int rescan), CP_LIST(shost, channel, id, lun, rescan), -EIO);
-DEFINE_UNEXPORTED_SHIM(int, ida_pre_get, CP_LIST(struct ida *ida, gfp_t gfp_mask), CP_LIST(ida, gfp_mask), -EINVAL);
 
 DEFINE_UNEXPORTED_SHIM(int, early_serial_setup, CP_LIST(struct uart_port *port), port, -EIO);
 DEFINE_UNEXPORTED_SHIM(int, serial8250_find_port, CP_LIST(struct uart_port *p), CP_LIST(p), -EIO);
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+DEFINE_UNEXPORTED_SHIM(void, insn_init, CP_LIST(struct insn *insn, const void *kaddr, int x86_64), CP_LIST(insn, kaddr, x86_64), __VOID_RETURN__);
+#else
+DEFINE_UNEXPORTED_SHIM(void, insn_init, CP_LIST(struct insn *insn, const void *kaddr, int buf_len, int x86_64), CP_LIST(insn, kaddr, buf_len, x86_64), __VOID_RETURN__);
+#endif
+DEFINE_UNEXPORTED_SHIM(void, insn_get_length, CP_LIST(struct insn *insn), CP_LIST(insn), __VOID_RETURN__);
+DEFINE_UNEXPORTED_SHIM(void *, module_alloc, CP_LIST(unsigned long size), CP_LIST(size), NULL);
+
 DEFINE_UNEXPORTED_INIT_SHIM(int, elevator_setup, CP_LIST(char *str), CP_LIST(str), -EINVAL);
 
 DEFINE_DYNAMIC_SHIM(void, usb_register_notify, CP_LIST(struct notifier_block *nb), CP_LIST(nb), __VOID_RETURN__);
 DEFINE_DYNAMIC_SHIM(void, usb_unregister_notify, CP_LIST(struct notifier_block *nb), CP_LIST(nb), __VOID_RETURN__);
+
+//******************************************* One-shot symbols resolution ********************************************//
+/*
+ * Every kallsyms_lookup_name() is a linear scan of the whole kernel symbol table (100k+ entries). Instead of doing that
+ * separately (and lazily, sometimes on a hot path) for every shim above and every symbol the override engine needs, we
+ * walk the table *once* during init and fill all addresses at the same time. Lazy lookups above remain as a fallback.
+ * Only symbols of the core kernel are cached: a module owning a symbol (e.g. mfgBIOS with GetHwCapability) can be
+ * unloaded & loaded again at a different address, so such symbols are always looked up when they're needed.
+ */
+#define DEFINE_SYMBOL_SLOT(name) static unsigned long name##__addr = 0
+#define CP_SYMBOL(name) { #name, &name##__addr, false }
+#define CP_SYMBOL_OPTIONAL(name) { #name, &name##__addr, true }
+
+struct cp_symbol {
+    const char *name;
+    unsigned long *addr;
+    bool optional; //it's not an error if it doesn't exist (e.g. platform-specific)
+};
+
+//Symbols which are not shims but are looked up by name by the override engine & syscall table search
+DEFINE_SYMBOL_SLOT(sys_call_table);
+DEFINE_SYMBOL_SLOT(sys_close);
+DEFINE_SYMBOL_SLOT(sys_open);
+DEFINE_SYMBOL_SLOT(sys_read);
+DEFINE_SYMBOL_SLOT(sys_write);
+DEFINE_SYMBOL_SLOT(__end_rodata);
+DEFINE_SYMBOL_SLOT(_edata);
+DEFINE_SYMBOL_SLOT(SyS_execve);
+DEFINE_SYMBOL_SLOT(driver_register);
+DEFINE_SYMBOL_SLOT(uart_match_port);
+DEFINE_SYMBOL_SLOT(sd_ioctl);
+DEFINE_SYMBOL_SLOT(apply_relocate_add);
+DEFINE_SYMBOL_SLOT(GetHwCapability);
+DEFINE_SYMBOL_SLOT(funcSYNOSATADiskLedCtrl);
+DEFINE_SYMBOL_SLOT(syno_ahci_disk_led_enable);
+DEFINE_SYMBOL_SLOT(syno_ahci_disk_led_enable_by_port);
+DEFINE_SYMBOL_SLOT(cmdline_proc_fops);
+
+static struct cp_symbol cp_symbols[] = {
+    CP_SYMBOL(cmdline_proc_show),
+    CP_SYMBOL(flush_tlb_all),
+    CP_SYMBOL(flush_tlb_kernel_range),
+    CP_SYMBOL(do_execve),
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+#ifndef CONFIG_AUDITSYSCALL
+    CP_SYMBOL(final_putname),
+#else
+    CP_SYMBOL(putname),
+#endif
+#else
+    CP_SYMBOL(getname),
+#endif
+    CP_SYMBOL(scsi_scan_host_selected),
+    CP_SYMBOL(early_serial_setup),
+    CP_SYMBOL(serial8250_find_port),
+    CP_SYMBOL(insn_init),
+    CP_SYMBOL(insn_get_length),
+    CP_SYMBOL(module_alloc),
+    CP_SYMBOL_OPTIONAL(elevator_setup), //__init - it's gone if we're loaded after boot
+
+    CP_SYMBOL_OPTIONAL(sys_call_table), //not always present in kallsyms - there's a fallback memory search
+    CP_SYMBOL(sys_close),
+    CP_SYMBOL(sys_open),
+    CP_SYMBOL(sys_read),
+    CP_SYMBOL(sys_write),
+    CP_SYMBOL_OPTIONAL(__end_rodata), //bounds sys_call_table search; data symbols need CONFIG_KALLSYMS_ALL
+    CP_SYMBOL_OPTIONAL(_edata),
+    CP_SYMBOL(SyS_execve),
+    CP_SYMBOL(driver_register),
+    CP_SYMBOL(uart_match_port),
+    CP_SYMBOL(sd_ioctl),
+    CP_SYMBOL(apply_relocate_add),
+    CP_SYMBOL_OPTIONAL(GetHwCapability), //comes from mfgBIOS - may not be loaded yet
+    CP_SYMBOL_OPTIONAL(funcSYNOSATADiskLedCtrl), //platform-specific
+    CP_SYMBOL_OPTIONAL(syno_ahci_disk_led_enable), //platform-specific
+    CP_SYMBOL_OPTIONAL(syno_ahci_disk_led_enable_by_port), //platform-specific
+    CP_SYMBOL_OPTIONAL(cmdline_proc_fops), //data symbol (CONFIG_KALLSYMS_ALL) - sanitize_cmdline falls back to override
+};
+
+static bool cp_symbols_resolved = false;
+
+struct cp_resolve_state {
+    DECLARE_BITMAP(first_chars, 256); //cheap prefilter: most of the kernel symbols can be rejected without a strcmp()
+    unsigned int remaining;
+};
+
+static int cp_resolve_symbol_cb(void *data, const char *name, struct module *mod, unsigned long addr)
+{
+    struct cp_resolve_state *state = data;
+
+    if (mod || !test_bit((unsigned char)name[0], state->first_chars))
+        return 0;
+
+    for (int i = 0; i < ARRAY_SIZE(cp_symbols); ++i) {
+        //kallsyms_lookup_name() returns the first match, so we do the same (core kernel is walked before modules)
+        if (*cp_symbols[i].addr != 0 || strcmp(cp_symbols[i].name, name) != 0)
+            continue;
+
+        *cp_symbols[i].addr = addr;
+        return --state->remaining == 0 ? 1 : 0; //non-zero value stops the walk
+    }
+
+    return 0;
+}
+
+int resolve_protected_symbols(void)
+{
+    struct cp_resolve_state state = { .remaining = 0 };
+    bitmap_zero(state.first_chars, 256);
+
+    for (int i = 0; i < ARRAY_SIZE(cp_symbols); ++i) {
+        if (*cp_symbols[i].addr != 0) //already resolved by a lazy shim call
+            continue;
+
+        set_bit((unsigned char)cp_symbols[i].name[0], state.first_chars);
+        ++state.remaining;
+    }
+
+    if (state.remaining)
+        boot_trace_cost_void(BOOT_TRACE_KALLSYMS, kallsyms_on_each_symbol(cp_resolve_symbol_cb, &state));
+    cp_symbols_resolved = true;
+
+    int missing = 0;
+    for (int i = 0; i < ARRAY_SIZE(cp_symbols); ++i) {
+        if (*cp_symbols[i].addr != 0)
+            continue;
+
+        if (cp_symbols[i].optional) {
+            pr_loc_dbg("Optional symbol %s is not available", cp_symbols[i].name);
+        } else {
+            pr_loc_err("Symbol %s cannot be found in kallsyms", cp_symbols[i].name);
+            ++missing;
+        }
+    }
+
+    pr_loc_dbg("Resolved %zu symbols in one pass (%d required missing)", ARRAY_SIZE(cp_symbols) - state.remaining,
+               missing);
+    return missing ? -ENOENT : 0;
+}
+
+unsigned long lookup_protected_symbol(const char *name)
+{
+    if (likely(cp_symbols_resolved)) {
+        for (int i = 0; i < ARRAY_SIZE(cp_symbols); ++i) {
+            if (strcmp(cp_symbols[i].name, name) == 0 && *cp_symbols[i].addr != 0)
+                return *cp_symbols[i].addr;
+        }
+    }
+
+    //Not known upfront, not resolved yet, not in the core kernel, or it wasn't there during init
+    return boot_trace_cost(BOOT_TRACE_KALLSYMS, kallsyms_lookup_name(name));
+}
@@ -11,6 +11,23 @@
 
 // ************************** Exports of normally protected functions ************************** //
 
+/**
+ * Resolves addresses of all protected symbols we know we will need using a single pass over kallsyms
+ *
+ * This should be called as early as possible during init. Shims & lookup_protected_symbol() work without it (they
+ * fall back to kallsyms_lookup_name()) but each such lookup is a linear scan of the kernel symbols table.
+ *
+ * @return 0 if all required symbols were found, -ENOENT if any is missing (all of them are logged)
+ */
+int resolve_protected_symbols(void);
+
+/**
+ * Gets address of a kernel symbol (exported or not), using cache from resolve_protected_symbols() when possible
+ *
+ * @return address or 0 if not found
+ */
+unsigned long lookup_protected_symbol(const char *name);
+
 //A usual macros to make defining them easier & consistent with .c implementation
 #define CP_LIST(...) __VA_ARGS__ //used to pass a list of arguments as a single argument
 #define CP_DECLARE_SHIM(return_type, org_function_name, call_args) return_type _##org_function_name(call_args);
@@ -18,6 +35,7 @@
 struct seq_file;
 CP_DECLARE_SHIM(int, cmdline_proc_show, CP_LIST(struct seq_file *m, void *v)); //extracts kernel cmdline
 CP_DECLARE_SHIM(void, flush_tlb_all, CP_LIST(void)); //used to flush caches in memory.c operations
+CP_DECLARE_SHIM(void, flush_tlb_kernel_range, CP_LIST(unsigned long start, unsigned long end)); //targeted version
 
 /* Thanks Jeff... https://groups.google.com/g/kernel-meetup-bangalore/c/rvQccTl_3kc/m/BJCnnXGCAgAJ
  * In case the link disappears: Jeff Layton from RedHat decided to just nuke the getname() API after 7 years of it being
@@ -65,12 +83,21 @@ struct Scsi_Host;
 CP_DECLARE_SHIM(int, scsi_scan_host_selected,
                 CP_LIST(struct Scsi_Host *shost, unsigned int channel, unsigned int id, u64 lun, int rescan));
 
-struct ida;
-CP_DECLARE_SHIM(int, ida_pre_get, CP_LIST(struct ida *ida, gfp_t gfp_mask));
-
 //Used for fixing I/O scheduler if module was loaded using elevator= and broke it
 CP_DECLARE_SHIM(int, elevator_setup, CP_LIST(char *str));
 
+//Used by override_symbol detour mode to decode & relocate function prologues into executable stubs. The decoder is
+// compiled-in with CONFIG_INSTRUCTION_DECODER (kprobes/perf need it) but never exported. Since v3.19 insn_init() takes
+// the buffer length, see https://github.com/torvalds/linux/commit/6ba48ff46f764414f979d2eacb23c4e6296bcc95
+struct insn;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+CP_DECLARE_SHIM(void, insn_init, CP_LIST(struct insn *insn, const void *kaddr, int x86_64));
+#else
+CP_DECLARE_SHIM(void, insn_init, CP_LIST(struct insn *insn, const void *kaddr, int buf_len, int x86_64));
+#endif
+CP_DECLARE_SHIM(void, insn_get_length, CP_LIST(struct insn *insn));
+CP_DECLARE_SHIM(void *, module_alloc, CP_LIST(unsigned long size)); //returns RWX memory within +-2GB of kernel .text
+
 struct notifier_block;
 CP_DECLARE_SHIM(void, usb_register_notify, CP_LIST(struct notifier_block *nb));
 CP_DECLARE_SHIM(void, usb_unregister_notify, CP_LIST(struct notifier_block *nb));
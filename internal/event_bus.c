@@ -0,0 +1,341 @@
+/**
+ * Internal event bus - see header file for the overview
+ *
+ * Every source (modules, USB) has its own list of subscribers, sorted by priority and protected by a rwsem: events are
+ * delivered with the rwsem held for reading (so events from different sources or CPUs don't serialize on each other),
+ * while (un)subscribing takes it for writing, which waits for deliveries in progress.
+ */
+#include "event_bus.h"
+#include "../common.h"
+#include "notifier_base.h" //notifier_*()
+#include "helper/symbol_helper.h" //kernel_has_symbol()
+#include "call_protected.h" //_usb_register_notify(), _usb_unregister_notify()
+#include <linux/module.h> //register_module_notifier(), struct module, MODULE_STATE_*
+#include <linux/usb.h> //struct usb_device, USB_DEVICE_*
+#include <linux/rwsem.h> //DECLARE_RWSEM, down_*(), up_*()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_*()
+#include <linux/bitmap.h> //DECLARE_BITMAP, bitmap_zero()
+
+#define NOTIFIER_NAME "internal event bus"
+#define USBCORE_MOD_NAME "usbcore"
+#define USB_CLASSES 256 //bInterfaceClass/bDeviceClass are u8
+
+enum rp_event_source {
+    RP_EVT_SRC_MODULE = 0,
+    RP_EVT_SRC_USB,
+    RP_EVT_SOURCES
+};
+
+struct rp_event_source_list {
+    struct rw_semaphore lock;
+    struct list_head subs;
+    unsigned long kinds; //all kinds of this source
+    unsigned int subs_num;
+};
+
+static struct rp_event_source_list sources[RP_EVT_SOURCES] = {
+    [RP_EVT_SRC_MODULE] = {
+        .lock = __RWSEM_INITIALIZER(sources[RP_EVT_SRC_MODULE].lock),
+        .subs = LIST_HEAD_INIT(sources[RP_EVT_SRC_MODULE].subs),
+        .kinds = RP_EVT_MODULE_ALL,
+    },
+    [RP_EVT_SRC_USB] = {
+        .lock = __RWSEM_INITIALIZER(sources[RP_EVT_SRC_USB].lock),
+        .subs = LIST_HEAD_INIT(sources[RP_EVT_SRC_USB].subs),
+        .kinds = RP_EVT_USB_DEV_ALL,
+    },
+};
+
+static bool bus_registered = false;
+static DEFINE_MUTEX(usb_notify_lock); //protects usb_notify_registered & usbcore_live
+static bool usb_notify_registered = false;
+static bool usbcore_live = false; //whether USB notifier can be registered
+
+/********************************************************* USB ********************************************************/
+/**
+ * Collects classes of the device & all interfaces of all its configurations
+ *
+ * Configurations are already parsed when the device is announced, before any interface driver gets the device.
+ */
+static void get_usb_dev_classes(const struct usb_device *device, unsigned long *classes)
+{
+    bitmap_zero(classes, USB_CLASSES);
+    set_bit(device->descriptor.bDeviceClass, classes);
+
+    if (!device->config)
+        return;
+
+    for (int cfg = 0; cfg < device->descriptor.bNumConfigurations; ++cfg) {
+        const struct usb_host_config *config = &device->config[cfg];
+        for (int intf = 0; intf < config->desc.bNumInterfaces; ++intf) {
+            if (config->intf_cache[intf] && config->intf_cache[intf]->num_altsetting > 0)
+                set_bit(config->intf_cache[intf]->altsetting[0].desc.bInterfaceClass, classes);
+        }
+    }
+}
+
+static int usb_notifier_handler(struct notifier_block *self, unsigned long action, void *data)
+{
+    rp_event_kind kind;
+    switch (action) {
+        case USB_DEVICE_ADD:
+            kind = RP_EVT_USB_DEV_ADD;
+            break;
+        case USB_DEVICE_REMOVE:
+            kind = RP_EVT_USB_DEV_REMOVE;
+            break;
+        default: //buses
+            return NOTIFY_DONE;
+    }
+
+    DECLARE_BITMAP(classes, USB_CLASSES);
+    get_usb_dev_classes(data, classes);
+
+    int out = NOTIFY_DONE;
+    rp_event_sub *sub;
+    down_read(&sources[RP_EVT_SRC_USB].lock);
+    list_for_each_entry(sub, &sources[RP_EVT_SRC_USB].subs, node[RP_EVT_SRC_USB]) {
+        if (!(sub->kinds & RP_EVT_MASK(kind)) ||
+            (sub->usb_class != RP_EVT_ANY_USB_CLASS && !test_bit(sub->usb_class, classes)))
+            continue;
+
+        out = sub->fn(sub, kind, data);
+        if (out & NOTIFY_STOP_MASK)
+            break;
+    }
+    up_read(&sources[RP_EVT_SRC_USB].lock);
+
+    return out;
+}
+
+static struct notifier_block usb_notifier_block = {
+    .notifier_call = usb_notifier_handler,
+    .priority = INT_MIN,
+};
+
+/**
+ * Registers or unregisters USB notifier depending on whether usbcore is loaded & anyone is interested
+ *
+ * It MUST NOT be called from within the USB notifier.
+ */
+static void arm_usb_notifier(void)
+{
+    mutex_lock(&usb_notify_lock);
+    bool needed = usbcore_live && bus_registered && ACCESS_ONCE(sources[RP_EVT_SRC_USB].subs_num) > 0;
+
+    //This has to use dynamic calling to avoid being dependent on usbcore (since we need to load before usbcore)
+    if (needed && !usb_notify_registered) {
+        _usb_register_notify(&usb_notifier_block); //has no return value
+        usb_notify_registered = true;
+        pr_loc_dbg("Registered USB device notifier");
+    } else if (!needed && usb_notify_registered) {
+        _usb_unregister_notify(&usb_notifier_block); //has no return value
+        usb_notify_registered = false;
+        pr_loc_dbg("Unregistered USB device notifier");
+    }
+    mutex_unlock(&usb_notify_lock);
+}
+
+/**
+ * Tracks usbcore, as the USB notifier can only exist while it's live
+ */
+static void handle_usbcore_event(rp_event_kind kind)
+{
+    if (kind == RP_EVT_MODULE_GOING) {
+        mutex_lock(&usb_notify_lock);
+        usbcore_live = false;
+        usb_notify_registered = false; //the chain goes away with the module
+        mutex_unlock(&usb_notify_lock);
+        pr_loc_wrn("%s module unloaded - this should not happen normally", USBCORE_MOD_NAME);
+        return;
+    }
+
+    //This may need to be changed to MODULE_STATE_COMING if MODULE_STATE_LIVE is too late for device notification
+    if (kind != RP_EVT_MODULE_LIVE)
+        return;
+
+    pr_loc_dbg("%s loaded - USB events can be delivered now", USBCORE_MOD_NAME);
+    mutex_lock(&usb_notify_lock);
+    usbcore_live = true;
+    mutex_unlock(&usb_notify_lock);
+    arm_usb_notifier();
+}
+
+/******************************************************* Modules ******************************************************/
+static bool has_name_suffix(const char *name, const char *suffix)
+{
+    size_t name_len = strlen(name), suffix_len = strlen(suffix);
+    return name_len >= suffix_len && strcmp(name + name_len - suffix_len, suffix) == 0;
+}
+
+static int module_notifier_handler(struct notifier_block *self, unsigned long state, void *data)
+{
+    struct module *mod = data;
+    rp_event_kind kind;
+    switch (state) {
+        case MODULE_STATE_COMING:
+            kind = RP_EVT_MODULE_COMING;
+            break;
+        case MODULE_STATE_LIVE:
+            kind = RP_EVT_MODULE_LIVE;
+            break;
+        case MODULE_STATE_GOING:
+            kind = RP_EVT_MODULE_GOING;
+            break;
+        default:
+            return NOTIFY_DONE;
+    }
+
+    //usbcore state must be known before subscribers watching usbcore get the event, as they may subscribe to USB
+    if (strcmp(mod->name, USBCORE_MOD_NAME) == 0)
+        handle_usbcore_event(kind);
+
+    int out = NOTIFY_DONE;
+    rp_event_sub *sub;
+    down_read(&sources[RP_EVT_SRC_MODULE].lock);
+    list_for_each_entry(sub, &sources[RP_EVT_SRC_MODULE].subs, node[RP_EVT_SRC_MODULE]) {
+        if (!(sub->kinds & RP_EVT_MASK(kind)) || (sub->module_name && strcmp(sub->module_name, mod->name) != 0) ||
+            (sub->module_suffix && !has_name_suffix(mod->name, sub->module_suffix)))
+            continue;
+
+        out = sub->fn(sub, kind, data);
+        if (out & NOTIFY_STOP_MASK)
+            break;
+    }
+    up_read(&sources[RP_EVT_SRC_MODULE].lock);
+
+    return out;
+}
+
+static struct notifier_block module_notifier_block = {
+    .notifier_call = module_notifier_handler,
+};
+
+/****************************************************** Public API ****************************************************/
+int subscribe_rp_events(rp_event_sub *sub)
+{
+    if (unlikely(!sub->fn || !sub->kinds || (sub->kinds & ~(RP_EVT_MASK(RP_EVT_KINDS) - 1)))) {
+        pr_loc_bug("Invalid subscription of %pF to %s (kinds=%lx)", sub->fn, NOTIFIER_NAME, sub->kinds);
+        return -EINVAL;
+    }
+
+    if (unlikely(sub->usb_class != RP_EVT_ANY_USB_CLASS && (sub->usb_class < 0 || sub->usb_class >= USB_CLASSES))) {
+        pr_loc_bug("Invalid USB class %d in subscription of %pF", sub->usb_class, sub->fn);
+        return -EINVAL;
+    }
+
+    for (int src = 0; src < RP_EVT_SOURCES; ++src) {
+        struct rp_event_source_list *list = &sources[src];
+        INIT_LIST_HEAD(&sub->node[src]); //so that unsubscribe_rp_events() can tell which lists it's on
+        if (!(sub->kinds & list->kinds))
+            continue;
+
+        down_write(&list->lock);
+        struct list_head *pos = &list->subs; //insert before the first one with a lower priority
+        rp_event_sub *cur;
+        list_for_each_entry(cur, &list->subs, node[src]) {
+            if (cur->priority < sub->priority) {
+                pos = &cur->node[src];
+                break;
+            }
+        }
+        list_add_tail(&sub->node[src], pos);
+        ++list->subs_num;
+        up_write(&list->lock);
+    }
+
+    pr_loc_dbg("%pF (priority=%d) subscribed to %s events (kinds=%lx)", sub->fn, sub->priority, NOTIFIER_NAME,
+               sub->kinds);
+
+    if (sub->kinds & RP_EVT_USB_DEV_ALL)
+        arm_usb_notifier();
+
+    return 0;
+}
+
+int unsubscribe_rp_events(rp_event_sub *sub)
+{
+    bool found = false;
+    for (int src = 0; src < RP_EVT_SOURCES; ++src) {
+        struct rp_event_source_list *list = &sources[src];
+        if (!(sub->kinds & list->kinds) || !sub->node[src].next || list_empty(&sub->node[src]))
+            continue; //never subscribed (zeroed) or already unsubscribed
+
+        down_write(&list->lock); //waits for the callback if it's running
+        list_del_init(&sub->node[src]);
+        --list->subs_num;
+        up_write(&list->lock);
+        found = true;
+    }
+
+    if (unlikely(!found)) {
+        pr_loc_bug("%pF is not subscribed to %s events", sub->fn, NOTIFIER_NAME);
+        return -ENOENT;
+    }
+
+    pr_loc_dbg("%pF (priority=%d) unsubscribed from %s events", sub->fn, sub->priority, NOTIFIER_NAME);
+
+    if (sub->kinds & RP_EVT_USB_DEV_ALL)
+        arm_usb_notifier();
+
+    return 0;
+}
+
+int register_event_bus(void)
+{
+    notifier_reg_in();
+
+    if (unlikely(bus_registered)) {
+        pr_loc_bug("%s is already registered", NOTIFIER_NAME);
+        return -EEXIST;
+    }
+
+    int out = register_module_notifier(&module_notifier_block);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to register module notifier - error=%d", out); //Currently it's impossible to happen
+        return out;
+    }
+
+    //usbcore may be loaded already (e.g. when debugging) - this is FINE for debugging but IS NOT FINE for production
+    //We're using kernel_has_symbol() to not acquire module mutex needed for module checks
+    if (kernel_has_symbol("usb_register_notify")) {
+        pr_loc_wrn("%s module is already loaded (did you load this module too late?)", USBCORE_MOD_NAME);
+        mutex_lock(&usb_notify_lock);
+        usbcore_live = true;
+        mutex_unlock(&usb_notify_lock);
+    }
+
+    bus_registered = true;
+    arm_usb_notifier(); //in case something subscribed before the bus was registered
+
+    notifier_reg_ok();
+    return 0;
+}
+
+int unregister_event_bus(void)
+{
+    notifier_ureg_in();
+
+    if (unlikely(!bus_registered)) {
+        pr_loc_bug("%s is not registered", NOTIFIER_NAME);
+        return -ENOENT;
+    }
+
+    int out = unregister_module_notifier(&module_notifier_block);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to unregister module notifier - error=%d", out);
+        return out;
+    }
+
+    bus_registered = false;
+    arm_usb_notifier(); //not registered bus means it's not needed anymore
+
+    for (int src = 0; src < RP_EVT_SOURCES; ++src) {
+        if (unlikely(ACCESS_ONCE(sources[src].subs_num) > 0))
+            pr_loc_bug("%s unregistered with %u subscriber(s) of source %d left", NOTIFIER_NAME,
+                       sources[src].subs_num, src);
+    }
+
+    notifier_ureg_ok();
+    return 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * Internal event bus delivering kernel module & USB device events to subscribers within the LKM
+ *
+ * Instead of every shim registering its own module notifier (called for every module loaded) and USB notifier (called
+ * for every USB device) and then filtering events by itself, the bus registers a single notifier of each kind and
+ * dispatches every event only to subscribers which asked for that kind of event and whose filter matches:
+ *   - module events (RP_EVT_MODULE_*) can be limited to a single module by name, or to modules by a name suffix
+ *   - USB events (RP_EVT_USB_DEV_*) can be limited to devices with an interface of a given USB class
+ * Subscribers which don't match never get called. Classes of a USB device are collected once per event, regardless of
+ * the number of subscribers.
+ *
+ * The USB notifier lives in usbcore, which usually loads after us. The bus watches for usbcore itself and registers
+ * the USB notifier only while usbcore is live AND someone is subscribed to USB events, so that with no USB subscribers
+ * USB hotplug costs nothing.
+ *
+ * SCSI disk events are NOT delivered by the bus - see scsi_notifier.h. These are already pre-filtered to disks, and
+ * they have veto semantics & an asynchronous delivery class which don't map to other events.
+ *
+ * Subscribers are called in a process context, in order of their priority (higher first), and may sleep. As with
+ * notifier chains, a callback MUST NOT (un)subscribe anything from within the callback - use a work for that.
+ */
+#ifndef REDPILL_EVENT_BUS_H
+#define REDPILL_EVENT_BUS_H
+
+#include <linux/list.h> //struct list_head
+#include <linux/bitops.h> //BIT()
+#include <linux/notifier.h> //NOTIFY_*
+
+typedef enum {
+    RP_EVT_MODULE_COMING = 0, //data => struct module *
+    RP_EVT_MODULE_LIVE,
+    RP_EVT_MODULE_GOING,
+    RP_EVT_USB_DEV_ADD, //data => struct usb_device *
+    RP_EVT_USB_DEV_REMOVE,
+    RP_EVT_KINDS
+} rp_event_kind;
+
+#define RP_EVT_MASK(kind) BIT(kind)
+#define RP_EVT_MODULE_ALL \
+    (RP_EVT_MASK(RP_EVT_MODULE_COMING) | RP_EVT_MASK(RP_EVT_MODULE_LIVE) | RP_EVT_MASK(RP_EVT_MODULE_GOING))
+#define RP_EVT_USB_DEV_ALL (RP_EVT_MASK(RP_EVT_USB_DEV_ADD) | RP_EVT_MASK(RP_EVT_USB_DEV_REMOVE))
+
+#define RP_EVT_ANY_USB_CLASS -1
+
+typedef struct rp_event_sub rp_event_sub;
+
+/**
+ * A single subscription; it should be statically allocated by the subscriber (like a struct notifier_block)
+ *
+ * Fields below "private" are managed by the bus and must be left zeroed.
+ */
+struct rp_event_sub {
+    /**
+     * @return NOTIFY_* constant; NOTIFY_STOP/NOTIFY_BAD stop delivery to subscribers with lower priority
+     */
+    int (*fn)(const rp_event_sub *sub, rp_event_kind kind, void *data);
+    unsigned long kinds; //RP_EVT_MASK() of kinds to deliver
+    const char *module_name; //module events: only for this module (NULL = all modules)
+    const char *module_suffix; //module events: only for modules with names ending with this (NULL = all modules)
+    int usb_class; //USB events: only for devices with an interface of this USB_CLASS_* (RP_EVT_ANY_USB_CLASS = all)
+    int priority; //higher is called first
+
+    //private
+    struct list_head node[2]; //one per source (modules & USB)
+};
+
+/**
+ * Subscribes to events
+ *
+ * @return 0 on success, -E on error
+ */
+int subscribe_rp_events(rp_event_sub *sub);
+
+/**
+ * Reverses subscribe_rp_events(); once it returns the callback is guaranteed to not be running
+ *
+ * @return 0 on success, -E on error
+ */
+int unsubscribe_rp_events(rp_event_sub *sub);
+
+int register_event_bus(void);
+int unregister_event_bus(void);
+
+#endif //REDPILL_EVENT_BUS_H
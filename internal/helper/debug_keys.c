@@ -0,0 +1,200 @@
+/**
+ * Runtime switches for verbose debug logs placed in hot paths
+ *
+ * Such logs used to be selected at compile time (or always compiled in as pr_loc_dbg()), so looking at a misbehaving
+ * box meant shipping a "dev" build to it. Every site using pr_loc_dbg_on() is compiled into all but the full stealth
+ * builds as a static key (jump label): when the key is off the site costs a single NOP. Keys are switched on at load
+ * with "dbg_keys" module parameter or at any time with <debugfs>/redpill/debug_keys (see debug_keys.h).
+ *
+ * Be careful with "vuart" if the kernel console lives on a vUART line: printing from inside the vUART recurses into it.
+ */
+#include "debug_keys.h"
+
+#ifdef RP_DBG_KEYS_ENABLED
+#include "../../common.h"
+#include "debugfs_helper.h" //get_rp_debugfs_dir(), put_rp_debugfs_dir()
+#include <linux/moduleparam.h> //module_param_named()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock()
+#include <linux/uaccess.h> //copy_from_user()
+#ifdef RP_DEBUGFS_ENABLED
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+#endif
+
+#define DEBUG_KEYS_FILE "debug_keys"
+#define DEBUG_KEYS_SEP ","
+#define DEBUG_KEYS_MAX_SPEC 128
+
+struct static_key rp_dbg_keys[RP_DBG_KEY_MAX] = {
+    [0 ... RP_DBG_KEY_MAX-1] = STATIC_KEY_INIT_FALSE
+};
+
+static const char *key_names[RP_DBG_KEY_MAX] = {
+    [RP_DBG_PCI] = "pci",
+    [RP_DBG_VUART] = "vuart",
+    [RP_DBG_SMART_IOCTL] = "smart_ioctl",
+    [RP_DBG_HWMON] = "hwmon",
+    [RP_DBG_OVS_LOCK] = "ovs_lock",
+};
+
+static char *dbg_keys_param = NULL;
+module_param_named(dbg_keys, dbg_keys_param, charp, 0000);
+MODULE_PARM_DESC(dbg_keys, "Comma-separated list of debug logs to switch on, see internal/helper/debug_keys.h");
+
+static bool keys_state[RP_DBG_KEY_MAX]; //static_key_count() isn't available on older kernels
+static DEFINE_MUTEX(keys_lock);
+
+static void set_key(rp_dbg_key_id id, bool on)
+{
+    if (keys_state[id] == on)
+        return;
+
+    if (on)
+        static_key_slow_inc(&rp_dbg_keys[id]);
+    else
+        static_key_slow_dec(&rp_dbg_keys[id]);
+
+    keys_state[id] = on;
+    pr_loc_inf("Debug log \"%s\" switched %s", key_names[id], on ? "on" : "off");
+}
+
+/**
+ * Applies a comma-separated list of "[+|-]<name>" entries
+ *
+ * @param spec list to apply; it's modified in the process
+ * @return 0 on success, -EINVAL if any of the names is unknown (all valid ones are still applied)
+ */
+static int apply_keys_spec(char *spec)
+{
+    int out = 0;
+    char *entry;
+
+    mutex_lock(&keys_lock);
+    while ((entry = strsep(&spec, DEBUG_KEYS_SEP)) != NULL) {
+        entry = strim(entry);
+        if (entry[0] == '\0')
+            continue;
+
+        bool on = entry[0] != '-';
+        if (entry[0] == '-' || entry[0] == '+')
+            ++entry;
+
+        int id;
+        for (id = 0; id < RP_DBG_KEY_MAX; ++id) {
+            if (strcmp(key_names[id], entry) == 0)
+                break;
+        }
+
+        if (id == RP_DBG_KEY_MAX) {
+            pr_loc_err("Unknown debug log \"%s\"", entry);
+            out = -EINVAL;
+            continue;
+        }
+
+        set_key(id, on);
+    }
+    mutex_unlock(&keys_lock);
+
+    return out;
+}
+
+#ifdef RP_DEBUGFS_ENABLED
+static struct dentry *keys_file = NULL;
+
+static int debug_keys_show(struct seq_file *m, void *v)
+{
+    mutex_lock(&keys_lock);
+    for (int i = 0; i < RP_DBG_KEY_MAX; ++i)
+        seq_printf(m, "%-12s %s\n", key_names[i], keys_state[i] ? "on" : "off");
+    mutex_unlock(&keys_lock);
+
+    return 0;
+}
+
+static int debug_keys_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, debug_keys_show, NULL);
+}
+
+static ssize_t debug_keys_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
+{
+    char spec[DEBUG_KEYS_MAX_SPEC];
+    if (unlikely(len >= sizeof(spec)))
+        return -EINVAL;
+
+    if (copy_from_user(spec, buf, len))
+        return -EFAULT;
+    spec[len] = '\0';
+
+    int out = apply_keys_spec(spec);
+    return out == 0 ? len : out;
+}
+
+static const struct file_operations debug_keys_fops = {
+    .owner = THIS_MODULE,
+    .open = debug_keys_open,
+    .read = seq_read,
+    .write = debug_keys_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void register_debug_keys_file(void)
+{
+    struct dentry *dir = get_rp_debugfs_dir();
+    if (!dir)
+        return; //debugfs not available - keys can still be set with the module param
+
+    keys_file = debugfs_create_file(DEBUG_KEYS_FILE, 0600, dir, NULL, &debug_keys_fops);
+    if (IS_ERR_OR_NULL(keys_file)) {
+        pr_loc_wrn("Failed to create debugfs file for debug keys - they can only be set at load time");
+        keys_file = NULL;
+        put_rp_debugfs_dir();
+    }
+}
+
+static void unregister_debug_keys_file(void)
+{
+    if (!keys_file)
+        return;
+
+    debugfs_remove(keys_file);
+    keys_file = NULL;
+    put_rp_debugfs_dir();
+}
+#else
+static inline void register_debug_keys_file(void) { }
+static inline void unregister_debug_keys_file(void) { }
+#endif //RP_DEBUGFS_ENABLED
+
+int register_debug_keys(void)
+{
+#ifdef DBG_SMART_PRINT_ALL_IOCTL
+    set_key(RP_DBG_SMART_IOCTL, true);
+#endif
+#ifdef DBG_HWMON
+    set_key(RP_DBG_HWMON, true);
+#endif
+
+    if (dbg_keys_param) {
+        char spec[DEBUG_KEYS_MAX_SPEC];
+        strlcpy(spec, dbg_keys_param, sizeof(spec));
+        apply_keys_spec(spec); //a typo in a debug option shouldn't prevent the module from loading
+    }
+
+    register_debug_keys_file();
+    return 0;
+}
+
+int unregister_debug_keys(void)
+{
+    unregister_debug_keys_file();
+
+    mutex_lock(&keys_lock);
+    for (int i = 0; i < RP_DBG_KEY_MAX; ++i)
+        set_key(i, false);
+    mutex_unlock(&keys_lock);
+
+    return 0;
+}
+#endif //RP_DBG_KEYS_ENABLED
@@ -0,0 +1,61 @@
+#ifndef REDPILL_DEBUG_KEYS_H
+#define REDPILL_DEBUG_KEYS_H
+
+#include "../stealth.h" //STEALTH_MODE
+
+/**
+ * Verbose debug logs in hot paths which can be switched on at runtime; when adding one here remember to add its name
+ * in debug_keys.c
+ */
+typedef enum {
+    RP_DBG_PCI = 0, //internal/virtual_pci.c: every vPCI config space access
+    RP_DBG_VUART, //internal/uart: vUART state changes (uart_prdbg(), see debug/debug_vuart.h)
+    RP_DBG_SMART_IOCTL, //shim/storage/smart_shim.c: every ioctl() handled (default on with DBG_SMART_PRINT_ALL_IOCTL)
+    RP_DBG_HWMON, //shim/bios/bios_hwmon_shim.c: every mfgBIOS sensor call (default on with DBG_HWMON)
+    RP_DBG_OVS_LOCK, //internal/override/override_symbol.c: taking & releasing override locks
+    RP_DBG_KEY_MAX
+} rp_dbg_key_id;
+
+//Logs are removed entirely in the full stealth mode - there's nothing to switch on then
+#if STEALTH_MODE < STEALTH_MODE_FULL
+#define RP_DBG_KEYS_ENABLED
+#include <linux/jump_label.h> //struct static_key, static_key_false()
+
+extern struct static_key rp_dbg_keys[RP_DBG_KEY_MAX];
+
+/**
+ * Checks whether a given debug log is switched on (e.g. rp_dbg_key_on(SMART_IOCTL))
+ *
+ * When it's off (the default) this is a single NOP in the code, patched into a jump when the key is switched on.
+ */
+#define rp_dbg_key_on(key) static_key_false(&rp_dbg_keys[RP_DBG_ ## key])
+
+/**
+ * Prints a debug message when a given debug log is switched on, regardless of whether pr_loc_dbg() is compiled in
+ */
+#define pr_loc_dbg_on(key, fmt, ...) do { if (rp_dbg_key_on(key)) { _pr_loc_dbg(fmt, ##__VA_ARGS__); } } while(0)
+
+/**
+ * Switches on debug logs listed in "dbg_keys" module parameter & exposes <debugfs>/redpill/debug_keys (if available)
+ *
+ * The parameter (and the debugfs file) takes comma-separated names of keys (see debug_keys.c), each optionally prefixed
+ * with "-" to switch it off or "+" to switch it on (the default), e.g. "dbg_keys=smart_ioctl,hwmon". Reading the file
+ * lists all keys with their state.
+ *
+ * @return 0 on success, -E on error
+ */
+int register_debug_keys(void);
+
+/**
+ * Switches all debug logs off and removes the debugfs file
+ */
+int unregister_debug_keys(void);
+
+#else //RP_DBG_KEYS_ENABLED
+#define rp_dbg_key_on(key) false
+#define pr_loc_dbg_on(key, fmt, ...)
+static inline int register_debug_keys(void) { return 0; }
+static inline int unregister_debug_keys(void) { return 0; }
+#endif //RP_DBG_KEYS_ENABLED
+
+#endif //REDPILL_DEBUG_KEYS_H
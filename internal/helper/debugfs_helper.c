@@ -0,0 +1,55 @@
+#include "debugfs_helper.h"
+
+#ifdef RP_DEBUGFS_ENABLED
+#include "../../common.h"
+#include <linux/debugfs.h> //debugfs_create_dir(), debugfs_remove_recursive()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock(), mutex_unlock()
+
+#define RP_DEBUGFS_DIR "redpill"
+
+static DEFINE_MUTEX(rp_debugfs_lock);
+static struct dentry *rp_debugfs_dir = NULL;
+static unsigned int rp_debugfs_users = 0;
+
+struct dentry *get_rp_debugfs_dir(void)
+{
+    struct dentry *out = NULL;
+
+    mutex_lock(&rp_debugfs_lock);
+    if (!rp_debugfs_dir) {
+        rp_debugfs_dir = debugfs_create_dir(RP_DEBUGFS_DIR, NULL);
+        if (IS_ERR_OR_NULL(rp_debugfs_dir)) {
+            //debugfs may not be compiled-in - it's not critical for the module to work
+            pr_loc_wrn("Failed to create debugfs dir %s - debug entries will not be available", RP_DEBUGFS_DIR);
+            rp_debugfs_dir = NULL;
+            goto out_unlock;
+        }
+        pr_loc_dbg("Created debugfs dir %s", RP_DEBUGFS_DIR);
+    }
+
+    ++rp_debugfs_users;
+    out = rp_debugfs_dir;
+
+    out_unlock:
+    mutex_unlock(&rp_debugfs_lock);
+    return out;
+}
+
+void put_rp_debugfs_dir(void)
+{
+    mutex_lock(&rp_debugfs_lock);
+    if (unlikely(!rp_debugfs_users)) {
+        pr_loc_bug("Called %s() without any users of debugfs dir", __FUNCTION__);
+        goto out_unlock;
+    }
+
+    if (--rp_debugfs_users == 0) {
+        debugfs_remove_recursive(rp_debugfs_dir);
+        rp_debugfs_dir = NULL;
+        pr_loc_dbg("Removed debugfs dir %s", RP_DEBUGFS_DIR);
+    }
+
+    out_unlock:
+    mutex_unlock(&rp_debugfs_lock);
+}
+#endif //RP_DEBUGFS_ENABLED
@@ -0,0 +1,28 @@
+#ifndef REDPILL_DEBUGFS_HELPER_H
+#define REDPILL_DEBUGFS_HELPER_H
+
+#include "../stealth.h" //STEALTH_MODE
+
+//Anything in debugfs is a dead giveaway that the module is loaded - it's only available in the least stealthy modes
+#if STEALTH_MODE < STEALTH_MODE_NORMAL
+#define RP_DEBUGFS_ENABLED
+
+struct dentry;
+
+/**
+ * Gets (creating if needed) the debugfs directory shared by all submodules of this module
+ *
+ * Every successful call must be followed by put_rp_debugfs_dir() when the submodule doesn't need the dir anymore. The
+ * directory is removed (recursively!) when the last user puts it.
+ *
+ * @return dentry of the directory or NULL if debugfs is not available (it's not an error, just skip creating files)
+ */
+struct dentry *get_rp_debugfs_dir(void);
+
+/**
+ * Releases reference taken by get_rp_debugfs_dir()
+ */
+void put_rp_debugfs_dir(void);
+#endif //STEALTH_MODE < STEALTH_MODE_NORMAL
+
+#endif //REDPILL_DEBUGFS_HELPER_H
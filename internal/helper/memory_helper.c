@@ -1,44 +1,200 @@
 /**
  * TODO: look into ovrride_symbol to check if there's any docs
+ *
+ * PATCH SESSIONS
+ * Every set_mem_addr_ro() normally ends with a TLB invalidation on all CPUs (which IPIs them). When many places are
+ * unprotected in a row (e.g. during module init) this is wasteful. A patch session changes that for the task which
+ * opened it:
+ *  - set_mem_addr_rw() works as usual but records the page(s) as well
+ *  - set_mem_addr_ro() only records the page(s) to be protected
+ *  - commit_mem_patch_session() protects every recorded page (once per distinct page) and flushes the TLB once; if no
+ *    page was recorded (e.g. all patches were done with WITH_MEM_WRITE_WINDOW()) nothing is flushed at all
+ * Other tasks are not affected by a session opened by someone else and behave as usual.
+ *
+ * TLB INVALIDATION
+ * Outside of a session set_mem_addr_rw() invalidates only the local CPU (upgrading permissions doesn't need a
+ * shootdown - if another CPU has a stale R/O entry the write will land in spurious_fault() which fixes it) and
+ * set_mem_addr_ro() invalidates only the pages which were changed (instead of flushing whole TLBs on all CPUs). Code
+ * which only needs to write a few bytes should use WITH_MEM_WRITE_WINDOW() which doesn't touch PTEs at all.
  */
 #include "memory_helper.h"
 #include "../../common.h"
-#include "../call_protected.h" //_flush_tlb_all()
+#include "../call_protected.h" //_flush_tlb_all(), _flush_tlb_kernel_range()
+#include "../boot_trace.h" //boot_trace_cost_void()
+#include <linux/sched.h> //current
+#include <linux/mutex.h> //DEFINE_MUTEX()
+#include <linux/irqflags.h> //local_irq_save(), local_irq_restore()
+#include <asm/special_insns.h> //read_cr0(), write_cr0()
+#include <asm/processor-flags.h> //X86_CR0_WP
 #include <asm/cacheflush.h> //PAGE_ALIGN
 #include <asm/page_types.h> //PAGE_SIZE
 #include <asm/pgtable_types.h> //_PAGE_RW
+#include <asm/tlbflush.h> //__flush_tlb_one()
 
-#define PAGE_ALIGN_BOTTOM(addr) (PAGE_ALIGN(addr) - PAGE_SIZE) //aligns the memory address to bottom of the page boundary
+#define PAGE_ALIGN_BOTTOM(addr) ((addr) & PAGE_MASK) //aligns the memory address to bottom of the page boundary
 #define NUM_PAGES_BETWEEN(low, high) (((PAGE_ALIGN_BOTTOM(high) - PAGE_ALIGN_BOTTOM(low)) / PAGE_SIZE) + 1)
+#define MAX_SESSION_PAGES 32 //if more distinct pages are touched in a session it will be partially committed earlier
 
-void set_mem_addr_rw(const unsigned long vaddr, unsigned long len)
-{
-    unsigned long addr = PAGE_ALIGN_BOTTOM(vaddr);
-    pr_loc_dbg("Disabling memory protection for page(s) at %p+%lu/%u (<<%p)", (void *) vaddr, len,
-               (unsigned int) NUM_PAGES_BETWEEN(vaddr, vaddr + len), (void *) addr);
+static DEFINE_MUTEX(session_lock); //protects opening & closing sessions; pages are only touched by the owner
+static struct task_struct *session_owner = NULL;
+static unsigned long session_pages[MAX_SESSION_PAGES];
+static unsigned int session_pages_num = 0;
 
+/**
+ * Sets or clears R/W bit on all pages spanning vaddr+len (w/o flushing anything)
+ */
+static void set_mem_pages_rw_bit(const unsigned long vaddr, unsigned long len, bool rw)
+{
     //theoretically this should use set_pte_atomic() but we're touching pages that will not be modified by anything else
     unsigned int level;
-    for(; addr <= vaddr; addr += PAGE_SIZE) {
+    for (unsigned long addr = PAGE_ALIGN_BOTTOM(vaddr); addr <= PAGE_ALIGN_BOTTOM(vaddr + len - 1);
+         addr += PAGE_SIZE) {
         pte_t *pte = lookup_address(addr, &level);
-        pte->pte |= _PAGE_RW;
+        if (rw)
+            pte->pte |= _PAGE_RW;
+        else
+            pte->pte &= ~_PAGE_RW;
     }
+}
+
+/**
+ * Invalidates TLB entries for all pages spanning vaddr+len on the current CPU only
+ */
+static void flush_mem_pages_local(const unsigned long vaddr, unsigned long len)
+{
+    for (unsigned long addr = PAGE_ALIGN_BOTTOM(vaddr); addr <= PAGE_ALIGN_BOTTOM(vaddr + len - 1);
+         addr += PAGE_SIZE)
+        __flush_tlb_one(addr);
+}
+
+static inline bool in_patch_session(void)
+{
+    //Only the owner can set the owner to itself, so it doesn't need the lock to see itself there
+    return unlikely(ACCESS_ONCE(session_owner) == current);
+}
+
+/**
+ * Protects all pages recorded in the session & flushes TLB once
+ */
+static void flush_session_pages(void)
+{
+    if (!session_pages_num)
+        return; //nothing was unprotected - no reason to IPI every CPU
+
+    pr_loc_dbg("Protecting %u page(s) recorded in patch session", session_pages_num);
+    for (unsigned int i = 0; i < session_pages_num; ++i)
+        set_mem_pages_rw_bit(session_pages[i], 1, false);
+
+    session_pages_num = 0;
+    boot_trace_cost_void(BOOT_TRACE_TLB_FLUSH, _flush_tlb_all());
+}
+
+/**
+ * Adds all pages spanning vaddr+len to the list of pages to be protected at the end of the session
+ */
+static void record_session_pages(const unsigned long vaddr, unsigned long len)
+{
+    for (unsigned long addr = PAGE_ALIGN_BOTTOM(vaddr); addr <= PAGE_ALIGN_BOTTOM(vaddr + len - 1);
+         addr += PAGE_SIZE) {
+        unsigned int i;
+        for (i = 0; i < session_pages_num; ++i) {
+            if (session_pages[i] == addr)
+                break;
+        }
+
+        if (i < session_pages_num)
+            continue; //already on the list
+
+        if (unlikely(session_pages_num >= MAX_SESSION_PAGES)) {
+            pr_loc_wrn("Patch session exceeded %d pages - committing partially", MAX_SESSION_PAGES);
+            flush_session_pages();
+            //it's fine to protect everything here: a caller which still needs R/W will call set_mem_addr_rw() again
+        }
 
-    _flush_tlb_all();
+        session_pages[session_pages_num++] = addr;
+    }
+}
+
+void set_mem_addr_rw(const unsigned long vaddr, unsigned long len)
+{
+    pr_loc_dbg("Disabling memory protection for page(s) at %p+%lu/%u (<<%p)", (void *) vaddr, len,
+               (unsigned int) NUM_PAGES_BETWEEN(vaddr, vaddr + len), (void *) PAGE_ALIGN_BOTTOM(vaddr));
+
+    if (in_patch_session())
+        record_session_pages(vaddr, len); //even if the caller never calls set_mem_addr_ro() it's protected on commit
+
+    //Upgrading permissions doesn't need a shootdown: stale R/O entries on other CPUs are fixed by spurious_fault()
+    set_mem_pages_rw_bit(vaddr, len, true);
+    flush_mem_pages_local(vaddr, len);
 }
 
 void set_mem_addr_ro(const unsigned long vaddr, unsigned long len)
 {
-    unsigned long addr = PAGE_ALIGN_BOTTOM(vaddr);
     pr_loc_dbg("Enabling memory protection for page(s) at %p+%lu/%u (<<%p)", (void *) vaddr, len,
-               (unsigned int) NUM_PAGES_BETWEEN(vaddr, vaddr + len), (void *) addr);
+               (unsigned int) NUM_PAGES_BETWEEN(vaddr, vaddr + len), (void *) PAGE_ALIGN_BOTTOM(vaddr));
 
-    //theoretically this should use set_pte_atomic() but we're touching pages that will not be modified by anything else
-    unsigned int level;
-    for(; addr <= vaddr; addr += PAGE_SIZE) {
-        pte_t *pte = lookup_address(addr, &level);
-        pte->pte &= ~_PAGE_RW;
+    if (in_patch_session()) {
+        record_session_pages(vaddr, len); //will be protected on commit
+        return;
     }
 
-    _flush_tlb_all();
-}
\ No newline at end of file
+    set_mem_pages_rw_bit(vaddr, len, false);
+    boot_trace_cost_void(BOOT_TRACE_TLB_FLUSH,
+                         _flush_tlb_kernel_range(PAGE_ALIGN_BOTTOM(vaddr),
+                                                 PAGE_ALIGN_BOTTOM(vaddr + len - 1) + PAGE_SIZE));
+}
+
+unsigned long mem_write_window_open(void)
+{
+    unsigned long flags;
+
+    //Interrupts MUST be disabled: CR0 is per-CPU and we cannot be migrated (or let anything else run) with WP cleared
+    local_irq_save(flags);
+    write_cr0(read_cr0() & ~X86_CR0_WP);
+
+    return flags;
+}
+
+void mem_write_window_close(unsigned long flags)
+{
+    write_cr0(read_cr0() | X86_CR0_WP);
+    local_irq_restore(flags);
+}
+
+int begin_mem_patch_session(void)
+{
+    mutex_lock(&session_lock);
+    if (unlikely(session_owner)) {
+        pr_loc_bug("Patch session is already opened by %s[%d]", session_owner->comm, session_owner->pid);
+        mutex_unlock(&session_lock);
+        return -EBUSY;
+    }
+
+    session_pages_num = 0;
+    ACCESS_ONCE(session_owner) = current;
+    mutex_unlock(&session_lock);
+    pr_loc_dbg("Opened memory patch session");
+
+    return 0;
+}
+
+int commit_mem_patch_session(void)
+{
+    if (unlikely(!in_patch_session())) {
+        pr_loc_bug("Attempted to commit patch session not owned by the current task");
+        return -EPERM;
+    }
+
+    flush_session_pages();
+    mutex_lock(&session_lock);
+    ACCESS_ONCE(session_owner) = NULL;
+    mutex_unlock(&session_lock);
+    pr_loc_dbg("Committed memory patch session");
+
+    return 0;
+}
+
+bool mem_patch_session_active(void)
+{
+    return in_patch_session();
+}
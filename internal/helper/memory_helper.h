@@ -1,6 +1,8 @@
 #ifndef REDPILL_MEMORY_HELPER_H
 #define REDPILL_MEMORY_HELPER_H
 
+#include <linux/types.h> //bool
+
 #define WITH_MEM_UNLOCKED(vaddr, size, code)           \
     do {                                               \
         set_mem_addr_rw((unsigned long)(vaddr), size); \
@@ -8,6 +10,20 @@
         set_mem_addr_ro((unsigned long)(vaddr), size); \
     } while(0)
 
+/**
+ * Executes code with write-protection of all kernel memory disabled on the current CPU only
+ *
+ * This is the cheapest way of writing a few bytes to r/o memory (e.g. .text or .rodata): no PTEs are touched and thus
+ * no TLB invalidation is needed on any CPU. The code is executed with interrupts disabled - keep it SHORT and do not
+ * sleep inside.
+ */
+#define WITH_MEM_WRITE_WINDOW(code)                               \
+    do {                                                          \
+        unsigned long __mem_ww_flags = mem_write_window_open();   \
+        ({code});                                                 \
+        mem_write_window_close(__mem_ww_flags);                   \
+    } while(0)
+
 /**
  * Disables write-protection for the memory where symbol resides
  *
@@ -24,14 +40,48 @@
  * function is removed in newer kernels.
  * The easiest way is to just lookup the page table entry for a given address, modify the R/W attribute directly and
  * dump CPU caches. This will work as there's no middle-man to mess with our request.
+ * Only the TLB of the local CPU is invalidated here (permissions upgrade doesn't require a shootdown).
+ *
+ * If you just need to write a few bytes use WITH_MEM_WRITE_WINDOW() instead.
  */
 void set_mem_addr_rw(const unsigned long vaddr, unsigned long len);
 
 /**
  * Reverses set_mem_rw()
  *
- * See set_mem_rw() for details
+ * See set_mem_rw() for details. Only TLB entries of the affected pages are invalidated.
  */
 void set_mem_addr_ro(const unsigned long vaddr, unsigned long len);
 
+/**
+ * [internal] Opens/closes CPU-local write window - use WITH_MEM_WRITE_WINDOW() instead
+ */
+unsigned long mem_write_window_open(void);
+void mem_write_window_close(unsigned long flags);
+
+/**
+ * Opens a batched patching session for the current task
+ *
+ * Until commit_mem_patch_session() is called set_mem_addr_ro() calls from this task will be deferred and all pages
+ * made R/W by set_mem_addr_rw() will be protected on commit. This is meant to be used around code which does a lot of
+ * patching in a row (e.g. module init registering many overrides). Everything else works as before (e.g. overrides are
+ * installed immediately), only protection restoring is delayed. Patches done with WITH_MEM_WRITE_WINDOW() don't touch
+ * PTEs and thus aren't a part of the session.
+ *
+ * @return 0 on success, -EBUSY if another session is already opened
+ */
+int begin_mem_patch_session(void);
+
+/**
+ * Protects all pages touched during the session (once per distinct page) and flushes the TLB once (if there's any)
+ *
+ * @return 0 on success, -EPERM if there's no session opened by the current task
+ */
+int commit_mem_patch_session(void);
+
+/**
+ * Checks if the current task is within a patch session (i.e. set_mem_addr_ro() will not take an immediate effect)
+ */
+bool mem_patch_session_active(void);
+
 #endif //REDPILL_MEMORY_HELPER_H
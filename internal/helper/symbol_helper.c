@@ -1,6 +1,6 @@
 #include "symbol_helper.h"
 #include <linux/module.h> //__symbol_get(), __symbol_put()
-#include <linux/kallsyms.h> //kallsyms_lookup_name
+#include "../call_protected.h" //lookup_protected_symbol()
 
 bool kernel_has_symbol(const char *name) {
     if (__symbol_get(name)) { //search for public symbols
@@ -9,5 +9,5 @@ bool kernel_has_symbol(const char *name) {
         return true;
     }
 
-    return kallsyms_lookup_name(name) != 0;
+    return lookup_protected_symbol(name) != 0;
 }
\ No newline at end of file
@@ -0,0 +1,210 @@
+/**
+ * Runtime control of numeric knobs of running subsystems - see header file for the protocol
+ *
+ * Every write is parsed & validated in full before anything is touched, and all values are applied under a single
+ * mutex. This makes a multi-knob write atomic with respect to other writes & reads of the file. Code using the values
+ * reads each of them with ACCESS_ONCE(), so it may see a write half-applied across different knobs (but never a torn
+ * value). Nothing of this is on a hot path - the lock is only taken by the file and by (un)registration.
+ */
+#include "tunables.h"
+
+#ifdef RP_DEBUGFS_ENABLED
+#include "../../common.h"
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock()
+#include <linux/uaccess.h> //copy_from_user()
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+
+#define TUNABLES_FILE "tunables"
+#define TUNABLES_SEP "\t\n ,"
+#define TUNABLES_MAX_SPEC 256
+#define TUNABLES_MAX_BATCH 16 //max number of pairs in a single write
+
+static LIST_HEAD(tunables);
+static DEFINE_MUTEX(tunables_lock); //protects the list & serializes changes
+static struct dentry *tunables_file = NULL;
+
+static struct rp_tunable *find_tunable(const char *name)
+{
+    struct rp_tunable *tun;
+    list_for_each_entry(tun, &tunables, node) {
+        if (strcmp(tun->name, name) == 0)
+            return tun;
+    }
+
+    return NULL;
+}
+
+int register_rp_tunable(struct rp_tunable *tun)
+{
+    if (unlikely(!tun->name || !tun->value || tun->min > tun->max)) {
+        pr_loc_bug("Invalid tunable %s", tun->name ? tun->name : "<null>");
+        return -EINVAL;
+    }
+
+    mutex_lock(&tunables_lock);
+    if (unlikely(find_tunable(tun->name))) {
+        mutex_unlock(&tunables_lock);
+        pr_loc_bug("Tunable %s is already registered", tun->name);
+        return -EEXIST;
+    }
+
+    unsigned int value = clamp(*tun->value, tun->min, tun->max);
+    if (value != *tun->value) {
+        pr_loc_wrn("Value %u of %s is outside of <%u, %u> - using %u", *tun->value, tun->name, tun->min, tun->max,
+                   value);
+        ACCESS_ONCE(*tun->value) = value;
+    }
+
+    list_add_tail(&tun->node, &tunables);
+    mutex_unlock(&tunables_lock);
+
+    return 0;
+}
+
+void unregister_rp_tunable(struct rp_tunable *tun)
+{
+    if (!tun->node.next) //never registered
+        return;
+
+    mutex_lock(&tunables_lock);
+    list_del(&tun->node);
+    mutex_unlock(&tunables_lock);
+    tun->node.next = NULL;
+}
+
+/**
+ * Parses & validates a whole spec, then applies it
+ *
+ * @param spec list of "<name>=<value>" pairs; it's modified in the process
+ * @return 0 on success, -E on error (nothing is changed then)
+ */
+static int apply_tunables_spec(char *spec)
+{
+    struct rp_tunable *batch_tun[TUNABLES_MAX_BATCH];
+    unsigned int batch_val[TUNABLES_MAX_BATCH];
+    unsigned int batch_num = 0;
+    int out = 0;
+    char *entry;
+
+    mutex_lock(&tunables_lock);
+    while ((entry = strsep(&spec, TUNABLES_SEP)) != NULL) {
+        if (entry[0] == '\0')
+            continue;
+
+        char *value = strchr(entry, '=');
+        if (!value) {
+            pr_loc_err("Tunable \"%s\" has no value", entry);
+            out = -EINVAL;
+            goto out_unlock;
+        }
+        *value++ = '\0';
+
+        struct rp_tunable *tun = find_tunable(entry);
+        if (!tun) {
+            pr_loc_err("Unknown tunable \"%s\" (or its subsystem isn't running)", entry);
+            out = -ENOENT;
+            goto out_unlock;
+        }
+
+        unsigned int val;
+        if (kstrtouint(value, 10, &val) != 0 || val < tun->min || val > tun->max) {
+            pr_loc_err("Invalid value \"%s\" for %s - expected <%u, %u>", value, tun->name, tun->min, tun->max);
+            out = -ERANGE;
+            goto out_unlock;
+        }
+
+        if (batch_num >= TUNABLES_MAX_BATCH) {
+            pr_loc_err("Too many tunables in a single write - only %d are supported", TUNABLES_MAX_BATCH);
+            out = -E2BIG;
+            goto out_unlock;
+        }
+
+        batch_tun[batch_num] = tun;
+        batch_val[batch_num++] = val;
+    }
+
+    for (int i = 0; i < batch_num; ++i) {
+        struct rp_tunable *tun = batch_tun[i];
+        if (*tun->value == batch_val[i])
+            continue;
+
+        pr_loc_inf("Changing %s from %u to %u", tun->name, *tun->value, batch_val[i]);
+        ACCESS_ONCE(*tun->value) = batch_val[i];
+        if (tun->apply)
+            tun->apply(tun);
+    }
+
+    out_unlock:
+    mutex_unlock(&tunables_lock);
+    return out;
+}
+
+static int tunables_show(struct seq_file *m, void *v)
+{
+    struct rp_tunable *tun;
+
+    mutex_lock(&tunables_lock);
+    list_for_each_entry(tun, &tunables, node)
+        seq_printf(m, "%-16s %-10u <%u, %u>\n", tun->name, *tun->value, tun->min, tun->max);
+    mutex_unlock(&tunables_lock);
+
+    return 0;
+}
+
+static int tunables_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, tunables_show, NULL);
+}
+
+static ssize_t tunables_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
+{
+    char spec[TUNABLES_MAX_SPEC];
+    if (unlikely(len >= sizeof(spec)))
+        return -EINVAL;
+
+    if (copy_from_user(spec, buf, len))
+        return -EFAULT;
+    spec[len] = '\0';
+
+    int out = apply_tunables_spec(spec);
+    return out == 0 ? len : out;
+}
+
+static const struct file_operations tunables_fops = {
+    .owner = THIS_MODULE,
+    .open = tunables_open,
+    .read = seq_read,
+    .write = tunables_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int register_tunables(void)
+{
+    struct dentry *dir = get_rp_debugfs_dir();
+    if (!dir)
+        return 0; //debugfs not available - knobs can still be set with module params
+
+    tunables_file = debugfs_create_file(TUNABLES_FILE, 0600, dir, NULL, &tunables_fops);
+    if (IS_ERR_OR_NULL(tunables_file)) {
+        pr_loc_wrn("Failed to create debugfs file for tunables - they can only be set at load time");
+        tunables_file = NULL;
+        put_rp_debugfs_dir();
+    }
+
+    return 0;
+}
+
+int unregister_tunables(void)
+{
+    if (!tunables_file)
+        return 0;
+
+    debugfs_remove(tunables_file);
+    tunables_file = NULL;
+    put_rp_debugfs_dir();
+
+    return 0;
+}
+#endif //RP_DEBUGFS_ENABLED
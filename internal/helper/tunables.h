@@ -0,0 +1,67 @@
+#ifndef REDPILL_TUNABLES_H
+#define REDPILL_TUNABLES_H
+
+#include "debugfs_helper.h" //RP_DEBUGFS_ENABLED
+#include <linux/list.h> //struct list_head
+
+/**
+ * Numeric knob which can be changed at runtime through <debugfs>/redpill/tunables
+ *
+ * Knobs are registered by subsystems while they're running (so only ones which make sense for the current platform &
+ * config are ever listed) and they're usually backed by the same variable as the module parameter setting them at
+ * load. Reading the file lists all registered knobs with their value & allowed range. Writing takes whitespace- or
+ * comma-separated "<name>=<value>" pairs, e.g. "hwmon_poll_ms=5000 fan_ctl_ms=1000". A write is applied as a whole: if
+ * any pair is invalid (unknown name, value out of range) nothing is changed.
+ *
+ * Values are stored with ACCESS_ONCE() so that code reading them in hot paths needs no locking. Should a subsystem
+ * need to react to a change (e.g. reschedule a worker) it sets the apply callback.
+ *
+ * In stealth builds without debugfs there's no way to reach the knobs, so (un)registration is a noop.
+ */
+struct rp_tunable {
+    const char *name;
+    unsigned int *value;
+    unsigned int min;
+    unsigned int max;
+    /**
+     * Called after the value was changed; all writes to the file are serialized and unregistration waits for it
+     */
+    void (*apply)(const struct rp_tunable *tun);
+
+    //private
+    struct list_head node;
+};
+
+#ifdef RP_DEBUGFS_ENABLED
+/**
+ * Makes the knob available for runtime changes; it should be statically allocated
+ *
+ * The value is clamped to the allowed range at registration (with a warning), so that values set with module
+ * parameters are subjected to the same rules.
+ *
+ * @return 0 on success, -E on error
+ */
+int register_rp_tunable(struct rp_tunable *tun);
+
+/**
+ * Reverses register_rp_tunable(); once it returns the apply callback is guaranteed to not be running
+ *
+ * It's safe to call it for a knob which was never registered (as long as the struct was zeroed).
+ */
+void unregister_rp_tunable(struct rp_tunable *tun);
+
+/**
+ * Exposes <debugfs>/redpill/tunables; knobs can be (un)registered regardless of whether this was called
+ *
+ * @return 0 on success, -E on error
+ */
+int register_tunables(void);
+int unregister_tunables(void);
+#else //RP_DEBUGFS_ENABLED
+static inline int register_rp_tunable(struct rp_tunable *tun) { return 0; }
+static inline void unregister_rp_tunable(struct rp_tunable *tun) { }
+static inline int register_tunables(void) { return 0; }
+static inline int unregister_tunables(void) { return 0; }
+#endif //RP_DEBUGFS_ENABLED
+
+#endif //REDPILL_TUNABLES_H
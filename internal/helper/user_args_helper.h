@@ -0,0 +1,57 @@
+#ifndef REDPILL_USER_ARGS_HELPER_H
+#define REDPILL_USER_ARGS_HELPER_H
+
+#include <linux/compat.h> //compat_uptr_t, compat_ptr()
+#include <linux/err.h> //ERR_PTR()
+#include <asm/uaccess.h> //get_user()
+
+/*
+ * Struct copied 1:1 from:
+ *
+ *  linux/fs/exec.c
+ *
+ *  Copyright (C) 1991, 1992  Linus Torvalds
+ */
+struct user_arg_ptr {
+#ifdef CONFIG_COMPAT
+    bool is_compat;
+#endif
+    union {
+        const char __user *const __user *native;
+#ifdef CONFIG_COMPAT
+        const compat_uptr_t __user *compat;
+#endif
+    } ptr;
+};
+
+/*
+ * Function copied 1:1 from:
+ *
+ *  linux/fs/exec.c
+ *
+ *  Copyright (C) 1991, 1992  Linus Torvalds
+ *
+ * Returns a userspace pointer to nr-th element of argv/envp: NULL at the end of the list or ERR_PTR(-EFAULT)
+ */
+static inline const char __user *get_user_arg_ptr(struct user_arg_ptr argv, int nr)
+{
+    const char __user *native;
+
+#ifdef CONFIG_COMPAT
+    if (unlikely(argv.is_compat)) {
+        compat_uptr_t compat;
+
+        if (get_user(compat, argv.ptr.compat + nr))
+            return ERR_PTR(-EFAULT);
+
+        return compat_ptr(compat);
+    }
+#endif
+
+    if (get_user(native, argv.ptr.native + nr))
+        return ERR_PTR(-EFAULT);
+
+    return native;
+}
+
+#endif //REDPILL_USER_ARGS_HELPER_H
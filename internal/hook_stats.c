@@ -0,0 +1,178 @@
+/**
+ * Lightweight instrumentation for hooks installed by this module
+ *
+ * Every instrumented hook (see hook_stats_id) records the number of hits and the number of CPU cycles spent. Counters
+ * are kept per-CPU and updated using this_cpu_*() operations, so recording is a handful of instruction without any
+ * locks or shared cache lines. Cycles are additionally bucketed by log2 to give an idea about the latency distribution
+ * (bucket N contains calls which took [2^N, 2^(N+1)) cycles; bucket 0 also contains 0-cycle hits). Hooks which call the
+ * original implementation measure only their own part of it, see struct hook_stats_span.
+ *
+ * The data is aggregated only when the debugfs file (<debugfs>/redpill/hook_stats) is read. The whole subsystem
+ * compiles out when the stealth mode doesn't allow it (see HOOK_STATS_ENABLED).
+ */
+#include "hook_stats.h"
+
+#ifdef HOOK_STATS_ENABLED
+#include "../common.h"
+#include <linux/percpu.h> //DEFINE_PER_CPU, this_cpu_*(), per_cpu_ptr()
+#include <linux/cpumask.h> //for_each_possible_cpu()
+#include "helper/debugfs_helper.h" //get_rp_debugfs_dir(), put_rp_debugfs_dir()
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+#include <linux/log2.h> //ilog2()
+#include <linux/math64.h> //div64_u64()
+
+#define HOOK_STATS_BUCKETS 32 //anything above 2^31 cycles lands in the last bucket
+#define HOOK_STATS_FILE "hook_stats"
+
+struct hook_stats_cpu {
+    u64 hits[HOOK_STATS_MAX];
+    u64 cycles[HOOK_STATS_MAX];
+    u64 skipped[HOOK_STATS_MAX]; //spans which couldn't be measured (not counted in hits)
+    u32 buckets[HOOK_STATS_MAX][HOOK_STATS_BUCKETS];
+};
+
+static const char *hook_names[HOOK_STATS_MAX] = {
+    [HOOK_STATS_SD_IOCTL] = "sd_ioctl_smart_shim",
+    [HOOK_STATS_EXECVE] = "execve",
+    [HOOK_STATS_DRIVER_REGISTER] = "driver_register_shim",
+    [HOOK_STATS_SD_PROBE] = "sd_probe_shim",
+    [HOOK_STATS_VUART_READ] = "serial_remote_read",
+    [HOOK_STATS_VUART_WRITE] = "serial_remote_write",
+    [HOOK_STATS_VPCI_READ_CFG] = "pci_read_cfg",
+    [HOOK_STATS_MFGBIOS_VTABLE] = "mfgbios_vtable_null",
+};
+
+static DEFINE_PER_CPU(struct hook_stats_cpu, hook_stats);
+static struct dentry *stats_file = NULL;
+
+void __hook_stats_record(hook_stats_id id, cycles_t cycles)
+{
+    unsigned int bucket = cycles ? ilog2(cycles) : 0;
+    if (unlikely(bucket >= HOOK_STATS_BUCKETS))
+        bucket = HOOK_STATS_BUCKETS - 1;
+
+    this_cpu_inc(hook_stats.hits[id]);
+    this_cpu_add(hook_stats.cycles[id], cycles);
+    this_cpu_inc(hook_stats.buckets[id][bucket]);
+}
+
+void __hook_stats_record_span(hook_stats_id id, const struct hook_stats_span *span)
+{
+    cycles_t total = get_cycles() - span->start;
+    if (unlikely(raw_smp_processor_id() != span->cpu || span->excluded > total)) {
+        this_cpu_inc(hook_stats.skipped[id]);
+        return;
+    }
+
+    __hook_stats_record(id, total - span->excluded);
+}
+
+void hook_stats_get(hook_stats_id id, u64 *hits, u64 *cycles)
+{
+    int cpu;
+
+    *hits = *cycles = 0;
+    for_each_possible_cpu(cpu) {
+        struct hook_stats_cpu *stats = per_cpu_ptr(&hook_stats, cpu);
+        *hits += ACCESS_ONCE(stats->hits[id]);
+        *cycles += ACCESS_ONCE(stats->cycles[id]);
+    }
+}
+
+const char *hook_stats_name(hook_stats_id id)
+{
+    return hook_names[id];
+}
+
+static int hook_stats_show(struct seq_file *m, void *v)
+{
+    u64 hits, cycles, skipped;
+    u64 buckets[HOOK_STATS_BUCKETS];
+    int cpu;
+
+    seq_printf(m, "%-24s %12s %16s %10s %8s  %s\n", "hook", "hits", "cycles", "avg", "skipped", "log2(cycles):calls");
+    for (int id = 0; id < HOOK_STATS_MAX; ++id) {
+        hits = cycles = skipped = 0;
+        memset(buckets, 0, sizeof(buckets));
+
+        for_each_possible_cpu(cpu) {
+            struct hook_stats_cpu *stats = per_cpu_ptr(&hook_stats, cpu);
+            hits += stats->hits[id];
+            cycles += stats->cycles[id];
+            skipped += stats->skipped[id];
+            for (int b = 0; b < HOOK_STATS_BUCKETS; ++b)
+                buckets[b] += stats->buckets[id][b];
+        }
+
+        seq_printf(m, "%-24s %12llu %16llu %10llu %8llu ", hook_names[id], hits, cycles,
+                   hits ? div64_u64(cycles, hits) : 0, skipped);
+        for (int b = 0; b < HOOK_STATS_BUCKETS; ++b) {
+            if (buckets[b])
+                seq_printf(m, " %d:%llu", b, buckets[b]);
+        }
+        seq_putc(m, '\n');
+    }
+
+    return 0;
+}
+
+static int hook_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hook_stats_show, NULL);
+}
+
+static ssize_t hook_stats_reset(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
+{
+    int cpu;
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(&hook_stats, cpu), 0, sizeof(struct hook_stats_cpu));
+
+    pr_loc_dbg("Hook stats reset");
+    return len;
+}
+
+static const struct file_operations hook_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = hook_stats_open,
+    .read = seq_read,
+    .write = hook_stats_reset,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int register_hook_stats(void)
+{
+    if (unlikely(stats_file)) {
+        pr_loc_bug("Hook stats are already registered");
+        return -EALREADY;
+    }
+
+    struct dentry *dir = get_rp_debugfs_dir();
+    if (!dir)
+        return 0; //debugfs not available - it's not critical for the module to work
+
+    stats_file = debugfs_create_file(HOOK_STATS_FILE, 0600, dir, NULL, &hook_stats_fops);
+    if (IS_ERR_OR_NULL(stats_file)) {
+        pr_loc_wrn("Failed to create debugfs file for hook stats - they will not be available");
+        stats_file = NULL;
+        put_rp_debugfs_dir();
+        return 0;
+    }
+
+    pr_loc_inf("Hook stats available in debugfs at %s", HOOK_STATS_FILE);
+    return 0;
+}
+
+int unregister_hook_stats(void)
+{
+    if (!stats_file)
+        return 0; //it's not an error as debugfs may not be available
+
+    debugfs_remove(stats_file);
+    stats_file = NULL;
+    put_rp_debugfs_dir();
+
+    return 0;
+}
+#endif //HOOK_STATS_ENABLED
@@ -0,0 +1,160 @@
+#ifndef REDPILL_HOOK_STATS_H
+#define REDPILL_HOOK_STATS_H
+
+#include "helper/debugfs_helper.h" //RP_DEBUGFS_ENABLED
+#include <linux/types.h> //u64
+
+//Stats are exposed via debugfs - there's no point in gathering them if it's not available
+#ifdef RP_DEBUGFS_ENABLED
+#define HOOK_STATS_ENABLED
+#endif
+
+/**
+ * List of all instrumented hooks; when adding one here remember to add its name in hook_stats.c
+ */
+typedef enum {
+    HOOK_STATS_SD_IOCTL = 0, //shim/storage/smart_shim.c:sd_ioctl_smart_shim() (w/o the original)
+    HOOK_STATS_EXECVE, //internal/intercept_execve.c:execve() shim (w/o the actual original execution)
+    HOOK_STATS_DRIVER_REGISTER, //internal/intercept_driver_register.c:driver_register_shim() (w/o the original)
+    HOOK_STATS_SD_PROBE, //internal/scsi/scsi_notifier.c:sd_probe_shim() (w/o the original)
+    HOOK_STATS_VUART_READ, //internal/uart/virtual_uart.c:serial_remote_read()
+    HOOK_STATS_VUART_WRITE, //internal/uart/virtual_uart.c:serial_remote_write()
+    HOOK_STATS_VPCI_READ_CFG, //internal/virtual_pci.c:pci_read_cfg()
+    HOOK_STATS_MFGBIOS_VTABLE, //shim/bios/bios_shims_collection.c:*_null_zero_int() (hits only)
+    HOOK_STATS_MAX
+} hook_stats_id;
+
+#ifdef HOOK_STATS_ENABLED
+#include <linux/timex.h> //get_cycles(), cycles_t
+#include <linux/smp.h> //raw_smp_processor_id()
+
+/**
+ * Measured section of a hook which calls the original implementation - time spent in it is NOT accounted to the hook
+ *
+ * Spans may sleep (e.g. the original sd_probe() does). Cycles of different CPUs aren't guaranteed to be comparable, so
+ * a span which didn't start & end (along with all its exclusions) on the same CPU is not measured - it's only counted
+ * as skipped.
+ */
+struct hook_stats_span {
+    cycles_t start;
+    cycles_t excluded;
+    int cpu; //-1 if the span migrated
+};
+
+/**
+ * Marks the beginning of a measured hook section
+ *
+ * @param var name of a variable to declare for storing start time
+ */
+#define hook_stats_begin(var) cycles_t var = get_cycles()
+
+/**
+ * Marks the end of a measured hook section started with hook_stats_begin()
+ */
+#define hook_stats_end(id, var) __hook_stats_record(id, get_cycles() - (var))
+
+/**
+ * Measures execution of an expression (usually a call to the real hook implementation) and returns its value
+ */
+#define hook_stats_measure(id, expr) ({                               \
+    cycles_t __hs_start = get_cycles();                                \
+    typeof(expr) __hs_out = (expr);                                    \
+    __hook_stats_record(id, get_cycles() - __hs_start);                \
+    __hs_out;                                                          \
+})
+
+/**
+ * Same as hook_stats_measure() but for expressions returning void
+ */
+#define hook_stats_measure_void(id, expr) do {                        \
+    cycles_t __hs_start = get_cycles();                                \
+    (expr);                                                            \
+    __hook_stats_record(id, get_cycles() - __hs_start);                \
+} while(0)
+
+/**
+ * Counts a hook hit without measuring its time
+ */
+#define hook_stats_hit(id) __hook_stats_record(id, 0)
+
+/**
+ * Marks the beginning of a measured span of a hook (see struct hook_stats_span)
+ */
+#define hook_stats_span_begin(span) do {                             \
+    (span)->excluded = 0;                                              \
+    (span)->cpu = raw_smp_processor_id();                              \
+    (span)->start = get_cycles();                                      \
+} while(0)
+
+/**
+ * Executes an expression (usually a call to the original) within a span without accounting its time & returns its value
+ */
+#define hook_stats_exclude(span, expr) ({                            \
+    cycles_t __hs_start = __hook_stats_exclude_begin(span);            \
+    typeof(expr) __hs_out = (expr);                                    \
+    __hook_stats_exclude_end(span, __hs_start);                        \
+    __hs_out;                                                          \
+})
+
+/**
+ * Marks the end of a span started with hook_stats_span_begin()
+ */
+#define hook_stats_span_end(id, span) __hook_stats_record_span(id, span)
+
+/**
+ * Creates debugfs entry exposing per-hook statistics
+ *
+ * Reading the file prints hits, total & average cycles, skipped (unmeasured) spans and a log2 histogram of cycles per
+ * call for every hook. Writing anything to it resets all counters.
+ *
+ * @return 0 on success, -E on error
+ */
+int register_hook_stats(void);
+int unregister_hook_stats(void);
+
+/**
+ * Sums counters of a single hook from all CPUs (e.g. for telemetry)
+ */
+void hook_stats_get(hook_stats_id id, u64 *hits, u64 *cycles);
+
+/**
+ * @return static name of a hook, as printed in debugfs
+ */
+const char *hook_stats_name(hook_stats_id id);
+
+//[internal] do not use directly, use macros above
+void __hook_stats_record(hook_stats_id id, cycles_t cycles);
+void __hook_stats_record_span(hook_stats_id id, const struct hook_stats_span *span);
+
+static inline cycles_t __hook_stats_exclude_begin(struct hook_stats_span *span)
+{
+    if (unlikely(raw_smp_processor_id() != span->cpu))
+        span->cpu = -1;
+
+    return get_cycles();
+}
+
+static inline void __hook_stats_exclude_end(struct hook_stats_span *span, cycles_t start)
+{
+    span->excluded += get_cycles() - start;
+    if (unlikely(raw_smp_processor_id() != span->cpu))
+        span->cpu = -1;
+}
+
+#else //HOOK_STATS_ENABLED
+struct hook_stats_span { };
+#define hook_stats_begin(var)
+#define hook_stats_end(id, var)
+#define hook_stats_measure(id, expr) (expr)
+#define hook_stats_measure_void(id, expr) (expr)
+#define hook_stats_hit(id)
+#define hook_stats_span_begin(span)
+#define hook_stats_exclude(span, expr) (expr)
+#define hook_stats_span_end(id, span)
+static inline int register_hook_stats(void) { return 0; }
+static inline int unregister_hook_stats(void) { return 0; }
+static inline void hook_stats_get(hook_stats_id id, u64 *hits, u64 *cycles) { *hits = *cycles = 0; }
+static inline const char *hook_stats_name(hook_stats_id id) { return ""; }
+#endif //HOOK_STATS_ENABLED
+
+#endif //REDPILL_HOOK_STATS_H
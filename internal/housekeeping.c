@@ -0,0 +1,124 @@
+/**
+ * Housekeeping CPUs policy - see header file for the overview
+ *
+ * Unbound workqueues are confined using workqueue attrs, which is what the kernel uses for its own unbound pools. The
+ * API to apply them was exported to modules only until v5.2 - on newer kernels workqueues stay unconfined (and works
+ * aimed at system workqueues stay there), while kthreads are still confined.
+ */
+#include "housekeeping.h"
+#include "../common.h"
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION()
+#include <linux/moduleparam.h> //module_param_named()
+#include <linux/cpumask.h> //struct cpumask, cpulist_parse(), cpumask_*()
+#include <linux/sched.h> //set_cpus_allowed_ptr()
+#include <linux/workqueue.h> //alloc_workqueue(), apply_workqueue_attrs()
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+#define HK_WQ_ATTRS_SUPPORTED
+#endif
+
+#define HK_SHARED_WQ_NAME "rp_hk"
+
+//The permission is 0 so that these are not exposed in sysfs
+static char *hk_cpus = NULL;
+module_param_named(hk_cpus, hk_cpus, charp, 0000);
+
+static struct cpumask hk_mask;
+static bool hk_enabled = false;
+static struct workqueue_struct *hk_wq = NULL; //shared one replacing system workqueues; NULL if it couldn't be confined
+
+void housekeeping_affine_task(struct task_struct *task)
+{
+    if (!hk_enabled)
+        return;
+
+    int out = set_cpus_allowed_ptr(task, &hk_mask);
+    if (unlikely(out != 0))
+        pr_loc_wrn("Failed to confine %s to housekeeping CPUs - error=%d", task->comm, out);
+}
+
+/**
+ * @return 0 on success, -E on error
+ */
+static int confine_wq(struct workqueue_struct *wq, const char *name)
+{
+#ifdef HK_WQ_ATTRS_SUPPORTED
+    struct workqueue_attrs *attrs = alloc_workqueue_attrs(GFP_KERNEL);
+    if (unlikely(!attrs)) {
+        pr_loc_crt("kernel memory alloc failure - tried to allocate workqueue attrs for %s", name);
+        return -ENOMEM;
+    }
+
+    cpumask_copy(attrs->cpumask, &hk_mask);
+    int out = apply_workqueue_attrs(wq, attrs);
+    free_workqueue_attrs(attrs);
+    if (out != 0)
+        pr_loc_wrn("Failed to confine %s workqueue to housekeeping CPUs - error=%d", name, out);
+
+    return out;
+#else
+    pr_loc_wrn("Workqueue %s cannot be confined to housekeeping CPUs on this kernel", name);
+    return -EOPNOTSUPP;
+#endif
+}
+
+struct workqueue_struct *alloc_housekeeping_wq(const char *name, int max_active)
+{
+    struct workqueue_struct *wq = alloc_workqueue("%s", WQ_UNBOUND, max_active, name);
+    if (unlikely(!wq))
+        return NULL;
+
+    if (hk_enabled)
+        confine_wq(wq, name); //not fatal - the work will just run anywhere
+
+    return wq;
+}
+
+struct workqueue_struct *housekeeping_wq(struct workqueue_struct *def)
+{
+    return hk_wq ? hk_wq : def;
+}
+
+int register_housekeeping(void)
+{
+    if (!hk_cpus || hk_cpus[0] == '\0') {
+        pr_loc_dbg("No housekeeping CPUs configured - threads & works will run anywhere");
+        return 0;
+    }
+
+    int out = cpulist_parse(hk_cpus, &hk_mask);
+    if (out != 0) {
+        pr_loc_err("Invalid housekeeping CPUs list \"%s\" - error=%d", hk_cpus, out);
+        return 0;
+    }
+
+    if (!cpumask_intersects(&hk_mask, cpu_online_mask)) {
+        pr_loc_err("None of housekeeping CPUs \"%s\" is online - ignoring the list", hk_cpus);
+        return 0;
+    }
+
+    hk_enabled = true;
+
+    //Works of this module are rare & short, but on a shared system workqueue they'd run on the CPU which queued them
+    hk_wq = alloc_workqueue(HK_SHARED_WQ_NAME, WQ_UNBOUND, 0);
+    if (unlikely(!hk_wq)) {
+        pr_loc_wrn("Failed to allocate housekeeping workqueue - works will use system workqueues");
+    } else if (confine_wq(hk_wq, HK_SHARED_WQ_NAME) != 0) {
+        destroy_workqueue(hk_wq);
+        hk_wq = NULL;
+    }
+
+    pr_loc_inf("Threads & works will run on housekeeping CPUs %s", hk_cpus);
+    return 0;
+}
+
+int unregister_housekeeping(void)
+{
+    if (hk_wq) {
+        destroy_workqueue(hk_wq); //drains it
+        hk_wq = NULL;
+    }
+    hk_enabled = false;
+
+    return 0;
+}
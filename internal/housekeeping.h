@@ -0,0 +1,63 @@
+/**
+ * Placement of module-owned threads & deferred work on housekeeping CPUs
+ *
+ * By default threads & works of this module run wherever the scheduler (or the CPU which queued them) decides, which
+ * may be a core isolated for storage/network IRQs. When "hk_cpus" module parameter is set (a CPU list, e.g. "0-1" or
+ * "0,2") all of them are confined to these CPUs instead:
+ *   - kthreads (vIRQ, virtio RX) pass through housekeeping_affine_task()
+ *   - workqueues owned by the module are allocated with alloc_housekeeping_wq()
+ *   - works which would be queued on a shared system workqueue go to housekeeping_wq() instead
+ * Without the parameter all of the above behave exactly as before.
+ *
+ * Not everything can be moved: vIRQ tasklets & hrtimers (see vuart_virtual_irq.c) run on the CPU which scheduled them,
+ * i.e. the one the application wrote to the port from. Use the "thread" vIRQ backend when this matters.
+ *
+ * The policy is fixed at load - moving work which is already queued around at runtime isn't worth the complexity.
+ */
+#ifndef REDPILL_HOUSEKEEPING_H
+#define REDPILL_HOUSEKEEPING_H
+
+#include <linux/types.h> //bool
+
+struct task_struct;
+struct workqueue_struct;
+
+/**
+ * Confines a task (usually a freshly created kthread, before it's woken up) to housekeeping CPUs; noop if not set
+ */
+void housekeeping_affine_task(struct task_struct *task);
+
+/**
+ * Allocates an unbound workqueue whose workers run only on housekeeping CPUs (a regular unbound one if not set)
+ *
+ * Use max_active of 1 with a single work item instead of an ordered workqueue: ordered ones cannot be confined.
+ *
+ * @return workqueue (to be freed with destroy_workqueue()) or NULL on error
+ */
+struct workqueue_struct *alloc_housekeeping_wq(const char *name, int max_active);
+
+/**
+ * Picks a workqueue for a work which would normally go to a given system workqueue
+ *
+ * Every queueing of a given work item must go through the same call, e.g. if a work is queued with
+ * queue_delayed_work(housekeeping_wq(system_long_wq), ...) then mod_delayed_work() must use the same.
+ *
+ * @param def system workqueue to use without housekeeping CPUs (system_wq, system_long_wq...)
+ */
+struct workqueue_struct *housekeeping_wq(struct workqueue_struct *def);
+
+/**
+ * Parses the "hk_cpus" parameter; it must be called before any of the functions above
+ *
+ * An invalid list isn't fatal: it's ignored (with an error logged) and nothing is confined.
+ *
+ * @return 0 on success, -E on error
+ */
+int register_housekeeping(void);
+
+/**
+ * Frees the shared workqueue; it must be called after all users stopped queueing work
+ */
+int unregister_housekeeping(void);
+
+#endif //REDPILL_HOUSEKEEPING_H
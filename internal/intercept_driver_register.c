@@ -1,49 +1,79 @@
+/*
+ * Watches for drivers being registered in the system
+ *
+ * There are two modes of operation:
+ *  - driver_register() override (watch_driver_register()): the global driver_register() is replaced with a shim which
+ *    sees every driver being registered. This is the only mode which allows for intercepting the registration itself
+ *    (see DWATCH_NOTIFY_ABORT_*) and it works regardless of whether the driver has any devices to bind to. However,
+ *    every driver registered in the system passes through the shim.
+ *  - bus notifier (watch_driver_bus()): a notifier is registered on a specific bus and the callback is triggered when
+ *    the watched driver binds to its first device (DWATCH_STATE_COMING just before probe, DWATCH_STATE_LIVE after a
+ *    successful probe). Nothing is overridden and drivers which aren't watched never enter our code. The registration
+ *    itself cannot be aborted and drivers without devices will never trigger the callback.
+ */
 #include "intercept_driver_register.h"
 #include "../common.h"
 #include "override/override_symbol.h"
+#include "hook_stats.h" //hook_stats_span_begin(), hook_stats_exclude()
+#include "housekeeping.h" //housekeeping_wq()
 #include <linux/platform_device.h> //platform_bus_type
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_add(), hash_for_each_possible()
+#include <linux/jhash.h> //jhash()
+#include <linux/notifier.h> //struct notifier_block, NOTIFY_*
+#include <linux/workqueue.h> //INIT_WORK(), queue_work(), cancel_work_sync()
+#include <linux/list.h> //LIST_HEAD, list_add(), list_del()
+#include <linux/mutex.h> //DEFINE_MUTEX
 
 #define MAX_WATCHERS 5 //can be increased as-needed
+#define WATCHERS_HASH_BITS 3 //8 buckets - there's a handful of watchers at most
 #define WATCH_FUNCTION "driver_register"
 
 struct driver_watcher_instance {
+    struct hlist_node node;
+    u32 hash;
     watch_dr_callback *cb;
     bool notify_coming:1;
     bool notify_live:1;
+
+    //Only used in bus notifier mode
+    struct bus_type *bus; //NULL for driver_register() override mode
+    struct list_head bus_node; //on bus_watchers until freed
+    struct notifier_block nb;
+    struct work_struct release_work; //used to unwatch from outside of the notifier chain
+    unsigned long bus_state; //BUS_WATCH_* bits
+
     char name[];
 };
 
+#define BUS_WATCH_COMING_FIRED 0 //DWATCH_STATE_COMING was already delivered
+#define BUS_WATCH_LIVE_FIRED 1  //DWATCH_STATE_LIVE was already delivered
+#define BUS_WATCH_DONE 2 //callback returned DWATCH_NOTIFY_DONE - no more events will be delivered
+
 static override_symbol_inst *ov_driver_register = NULL;
-static driver_watcher_instance *watchers[MAX_WATCHERS] = { NULL };
+static DEFINE_HASHTABLE(watchers, WATCHERS_HASH_BITS); //indexed by name hash so that unwatched drivers cost one miss
+static unsigned int watchers_count = 0;
+//Bus watchers stay here until freed - also those which returned DWATCH_NOTIFY_DONE and were forgotten by their owners
+static LIST_HEAD(bus_watchers);
+static DEFINE_MUTEX(bus_watchers_lock);
 
-/**
- * Finds a registered watcher based on the driver name
- *
- * @return pointer to the spot on the list containing driver_watcher_instance or NULL if not found
- */
-static driver_watcher_instance **match_watcher(const char *name)
+static inline u32 watcher_name_hash(const char *name)
 {
-    for (int i=0; i < MAX_WATCHERS; ++i) {
-        if (!watchers[i])
-            continue; //there could be "holes" due to unwatch calls
-
-        if(strcmp(name, watchers[i]->name) == 0)
-            return &watchers[i];
-    }
-
-    return NULL;
+    return jhash(name, strlen(name), 0);
 }
 
 /**
- * Finds an empty spot in the watchers list
+ * Finds a registered watcher based on the driver name
  *
- * @return pointer to the spot on the list which is empty or NULL if not found
+ * @return driver_watcher_instance or NULL if not found
  */
-static driver_watcher_instance **watcher_list_spot(void)
+static driver_watcher_instance *match_watcher(const char *name)
 {
-    for (int i=0; i < MAX_WATCHERS; ++i) {
-        if (!watchers[i])
-            return &watchers[i];
+    driver_watcher_instance *watcher;
+    u32 hash = watcher_name_hash(name);
+
+    hash_for_each_possible(watchers, watcher, node, hash) {
+        if (watcher->hash == hash && strcmp(name, watcher->name) == 0)
+            return watcher;
     }
 
     return NULL;
@@ -52,14 +82,9 @@ static driver_watcher_instance **watcher_list_spot(void)
 /**
  * Checks if there any watchers registered (to determine if it makes sense to still shim the driver_register())
  */
-static bool has_any_watchers(void)
+static inline bool has_any_watchers(void)
 {
-    for (int i=0; i < MAX_WATCHERS; ++i) {
-        if (watchers[i])
-            return true;
-    }
-
-    return false;
+    return watchers_count > 0;
 }
 
 /**
@@ -83,35 +108,35 @@ static int call_original_driver_register(struct device_driver *drv)
 /**
  * Replacement for driver_register(), executing registered hooks
  */
-static int driver_register_shim(struct device_driver *drv)
+static int __driver_register_shim(struct device_driver *drv, struct hook_stats_span *hs)
 {
-    driver_watcher_instance **watcher_lptr = match_watcher(drv->name);
+    driver_watcher_instance *watcher = match_watcher(drv->name);
     int driver_load_result;
     bool driver_register_fulfilled = false;
 
-    if (unlikely(!watcher_lptr)) {
+    if (likely(!watcher)) {
         pr_loc_dbg("%s() interception active - no handler observing \"%s\" found, calling original %s()",
                    WATCH_FUNCTION, drv->name, WATCH_FUNCTION);
-        return call_original_driver_register(drv);
+        return hook_stats_exclude(hs, call_original_driver_register(drv));
     }
 
-    pr_loc_dbg("%s() interception active - calling handler %pF<%p> for \"%s\"", WATCH_FUNCTION, (*watcher_lptr)->cb,
-               (*watcher_lptr)->cb, drv->name);
+    pr_loc_dbg("%s() interception active - calling handler %pF<%p> for \"%s\"", WATCH_FUNCTION, watcher->cb,
+               watcher->cb, drv->name);
 
-    if ((*watcher_lptr)->notify_coming) {
+    if (watcher->notify_coming) {
         pr_loc_dbg("Calling for DWATCH_STATE_COMING");
-        switch ((*watcher_lptr)->cb(drv, DWATCH_STATE_COMING)) {
+        switch (watcher->cb(drv, DWATCH_STATE_COMING)) {
             //CONTINUE and DONE cannot use fall-through as we cannot unregister watcher before calling it (as if this is the
             // last watcher the whole override will be stopped
             case DWATCH_NOTIFY_CONTINUE:
                 pr_loc_dbg("Calling original %s() & leaving watcher active", WATCH_FUNCTION);
-                driver_load_result = call_original_driver_register(drv);
+                driver_load_result = hook_stats_exclude(hs, call_original_driver_register(drv));
                 driver_register_fulfilled = true;
                 break;
             case DWATCH_NOTIFY_DONE:
                 pr_loc_dbg("Calling original %s() & removing watcher", WATCH_FUNCTION);
-                driver_load_result = call_original_driver_register(drv);
-                unwatch_driver_register(*watcher_lptr); //regardless of the call result we unregister
+                driver_load_result = hook_stats_exclude(hs, call_original_driver_register(drv));
+                unwatch_driver_register(watcher); //regardless of the call result we unregister
                 return driver_load_result; //we return here as the watcher doesn't want to be bothered anymore
             case DWATCH_NOTIFY_ABORT_OK:
                 pr_loc_dbg("Faking OK return of %s() per callback request", WATCH_FUNCTION);
@@ -125,27 +150,40 @@ static int driver_register_shim(struct device_driver *drv)
                 break;
             default: //This should never happen if the callback is correct
                 pr_loc_bug("%s callback %pF<%p> returned invalid status value during DWATCH_STATE_COMING",
-                           WATCH_FUNCTION, (*watcher_lptr)->cb, (*watcher_lptr)->cb);
+                           WATCH_FUNCTION, watcher->cb, watcher->cb);
         }
     }
 
     if (!driver_register_fulfilled)
-        driver_load_result = call_original_driver_register(drv);
+        driver_load_result = hook_stats_exclude(hs, call_original_driver_register(drv));
 
     if (driver_load_result != 0) {
         pr_loc_err("%s driver failed to load - not triggering STATE_LIVE callbacks", drv->name);
         return driver_load_result;
     }
 
-    if ((*watcher_lptr)->notify_live) {
+    if (watcher->notify_live) {
         pr_loc_dbg("Calling for DWATCH_STATE_LIVE");
-        if ((*watcher_lptr)->cb(drv, DWATCH_STATE_LIVE) == DWATCH_NOTIFY_DONE)
-            unwatch_driver_register(*watcher_lptr);
+        if (watcher->cb(drv, DWATCH_STATE_LIVE) == DWATCH_NOTIFY_DONE)
+            unwatch_driver_register(watcher);
     }
 
     return driver_load_result;
 }
 
+/**
+ * Instrumented entrypoint for __driver_register_shim(); the original driver_register() isn't accounted to it
+ */
+static int driver_register_shim(struct device_driver *drv)
+{
+    struct hook_stats_span hs;
+    hook_stats_span_begin(&hs);
+    int out = __driver_register_shim(drv, &hs);
+    hook_stats_span_end(HOOK_STATS_DRIVER_REGISTER, &hs);
+
+    return out;
+}
+
 /**
  * Enables override of driver_register() to watch for new drivers registration
  *
@@ -159,7 +197,7 @@ static int start_watching(void)
     }
 
     pr_loc_dbg("Starting intercept of %s()", WATCH_FUNCTION);
-    ov_driver_register = override_symbol(WATCH_FUNCTION, driver_register_shim);
+    ov_driver_register = override_symbol_detour(WATCH_FUNCTION, driver_register_shim);
     if (unlikely(IS_ERR(ov_driver_register))) {
         pr_loc_err("Failed to intercept %s() - error=%ld", WATCH_FUNCTION, PTR_ERR(ov_driver_register));
         ov_driver_register = NULL;
@@ -193,27 +231,171 @@ static int stop_watching(void)
     return 0;
 }
 
+/**
+ * Unregisters bus watcher notifier after callback requested unwatching (DWATCH_NOTIFY_DONE)
+ *
+ * Notifier cannot be unregistered from within the notifier chain itself (it holds the chain lock) so it's deferred here.
+ * The watcher itself isn't freed here: its owner forgets it, and it's freed by unregister_driver_watchers(), which
+ * first waits for this work (it must not run after the watcher or the module are gone).
+ */
+static void bus_watcher_release_work(struct work_struct *work)
+{
+    driver_watcher_instance *watcher = container_of(work, driver_watcher_instance, release_work);
+
+    bus_unregister_notifier(watcher->bus, &watcher->nb);
+    pr_loc_dbg("Removed %pF<%p> bus subscriber for \"%s\" driver", watcher->cb, watcher->cb, watcher->name);
+}
+
+/**
+ * Stops bus watcher & frees it; it must be already removed from the bus_watchers list
+ */
+static void free_bus_watcher(driver_watcher_instance *watcher)
+{
+    set_bit(BUS_WATCH_DONE, &watcher->bus_state); //release work cannot be queued anymore
+    //This waits for notifier calls in progress; it's harmless (-ENOENT) if the release work already unregistered it
+    bus_unregister_notifier(watcher->bus, &watcher->nb);
+    cancel_work_sync(&watcher->release_work);
+    pr_loc_dbg("Freed %pF<%p> bus subscriber for \"%s\" driver", watcher->cb, watcher->cb, watcher->name);
+    kfree(watcher);
+}
+
+/**
+ * Delivers a single event to bus watcher callback (at most once per state)
+ */
+static void bus_watcher_deliver(driver_watcher_instance *watcher, struct device_driver *drv,
+                                driver_watch_notify_state state, int fired_bit)
+{
+    if (test_and_set_bit(fired_bit, &watcher->bus_state))
+        return;
+
+    pr_loc_dbg("Bus notifier for \"%s\" - calling handler %pF<%p> (state=%d)", watcher->name, watcher->cb,
+               watcher->cb, state);
+    switch (watcher->cb(drv, state)) {
+        case DWATCH_NOTIFY_CONTINUE:
+            break;
+        case DWATCH_NOTIFY_DONE:
+            if (!test_and_set_bit(BUS_WATCH_DONE, &watcher->bus_state))
+                queue_work(housekeeping_wq(system_wq), &watcher->release_work);
+            break;
+        case DWATCH_NOTIFY_ABORT_OK:
+        case DWATCH_NOTIFY_ABORT_BUSY:
+            pr_loc_bug("%s callback %pF<%p> requested abort - this is not supported in bus notifier mode",
+                       watcher->name, watcher->cb, watcher->cb);
+            break;
+        default: //This should never happen if the callback is correct
+            pr_loc_bug("%s callback %pF<%p> returned invalid status value", watcher->name, watcher->cb, watcher->cb);
+    }
+}
+
+static int bus_watcher_notify(struct notifier_block *nb, unsigned long action, void *data)
+{
+    driver_watcher_instance *watcher = container_of(nb, driver_watcher_instance, nb);
+    struct device *dev = data;
+
+    if (test_bit(BUS_WATCH_DONE, &watcher->bus_state) || !dev->driver || strcmp(dev->driver->name, watcher->name) != 0)
+        return NOTIFY_DONE;
+
+    if (action == BUS_NOTIFY_BIND_DRIVER && watcher->notify_coming)
+        bus_watcher_deliver(watcher, dev->driver, DWATCH_STATE_COMING, BUS_WATCH_COMING_FIRED);
+    else if (action == BUS_NOTIFY_BOUND_DRIVER && watcher->notify_live)
+        bus_watcher_deliver(watcher, dev->driver, DWATCH_STATE_LIVE, BUS_WATCH_LIVE_FIRED);
+
+    return NOTIFY_DONE;
+}
+
+driver_watcher_instance *watch_driver_bus(const char *name, struct bus_type *bus, watch_dr_callback *cb,
+                                          int event_mask)
+{
+    if (unlikely(!bus)) {
+        pr_loc_bug("Bus must be specified for %s", __FUNCTION__);
+        return ERR_PTR(-EINVAL);
+    }
+
+    driver_watcher_instance *watcher;
+    kzalloc_or_exit_ptr(watcher, sizeof(driver_watcher_instance) + strsize(name));
+    strcpy(watcher->name, name);
+    watcher->cb = cb;
+    watcher->notify_coming = ((event_mask & DWATCH_STATE_COMING) == DWATCH_STATE_COMING);
+    watcher->notify_live = ((event_mask & DWATCH_STATE_LIVE) == DWATCH_STATE_LIVE);
+    watcher->bus = bus;
+    watcher->nb.notifier_call = bus_watcher_notify;
+    INIT_WORK(&watcher->release_work, bus_watcher_release_work);
+
+    int out = bus_register_notifier(bus, &watcher->nb);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to register bus notifier for \"%s\" driver - error=%d", name, out);
+        kfree(watcher);
+        return ERR_PTR(out);
+    }
+
+    mutex_lock(&bus_watchers_lock);
+    list_add(&watcher->bus_node, &bus_watchers);
+    mutex_unlock(&bus_watchers_lock);
+
+    pr_loc_dbg("Registered bus %s watcher for \"%s\" driver (coming=%d, live=%d)", bus->name, name,
+               watcher->notify_coming ? 1 : 0, watcher->notify_live ? 1 : 0);
+
+    return watcher;
+}
+
+/**
+ * Undoes what watch_driver_bus() did
+ */
+static int unwatch_driver_bus(driver_watcher_instance *instance)
+{
+    driver_watcher_instance *watcher;
+    bool found = false;
+
+    //The instance is looked up by its address only - a double-unwatch must not touch freed memory
+    mutex_lock(&bus_watchers_lock);
+    list_for_each_entry(watcher, &bus_watchers, bus_node) {
+        if (watcher == instance) {
+            list_del(&watcher->bus_node);
+            found = true;
+            break;
+        }
+    }
+    mutex_unlock(&bus_watchers_lock);
+
+    if (unlikely(!found)) {
+        pr_loc_bug("Bus watcher %p couldn't be found in the bus watchers list", instance);
+        return -ENOENT;
+    }
+
+    //Release was already scheduled (or even executed) after callback returned DWATCH_NOTIFY_DONE
+    int out = 0;
+    if (unlikely(test_bit(BUS_WATCH_DONE, &instance->bus_state))) {
+        pr_loc_bug("Bus watcher %p for %s is already unwatched", instance, instance->name);
+        out = -ENOENT;
+    }
+
+    free_bus_watcher(instance);
+    return out;
+}
+
 driver_watcher_instance *watch_driver_register(const char *name, watch_dr_callback *cb, int event_mask)
 {
-    driver_watcher_instance **watcher_lptr = match_watcher(name);
-    if (unlikely(watcher_lptr)) {
-        pr_loc_err("Watcher for %s already exists (callback=%pF<%p>)", name, (*watcher_lptr)->cb, (*watcher_lptr)->cb);
+    driver_watcher_instance *watcher = match_watcher(name);
+    if (unlikely(watcher)) {
+        pr_loc_err("Watcher for %s already exists (callback=%pF<%p>)", name, watcher->cb, watcher->cb);
         return ERR_PTR(-EEXIST);
     }
 
-    watcher_lptr = watcher_list_spot();
-    if (unlikely(!watcher_lptr)) {
+    if (unlikely(watchers_count >= MAX_WATCHERS)) {
         pr_loc_bug("There are no free spots for a new watcher");
         return ERR_PTR(-ENOSPC);
     }
 
-    kmalloc_or_exit_ptr(*watcher_lptr, sizeof(driver_watcher_instance) + strsize(name));
-    strcpy((*watcher_lptr)->name, name);
-    (*watcher_lptr)->cb = cb;
-    (*watcher_lptr)->notify_coming = ((event_mask & DWATCH_STATE_COMING) == DWATCH_STATE_COMING);
-    (*watcher_lptr)->notify_live = ((event_mask & DWATCH_STATE_LIVE) == DWATCH_STATE_LIVE);
+    kzalloc_or_exit_ptr(watcher, sizeof(driver_watcher_instance) + strsize(name));
+    strcpy(watcher->name, name);
+    watcher->hash = watcher_name_hash(name);
+    watcher->cb = cb;
+    watcher->notify_coming = ((event_mask & DWATCH_STATE_COMING) == DWATCH_STATE_COMING);
+    watcher->notify_live = ((event_mask & DWATCH_STATE_LIVE) == DWATCH_STATE_LIVE);
+    hash_add(watchers, &watcher->node, watcher->hash);
+    ++watchers_count;
     pr_loc_dbg("Registered %s() watcher for \"%s\" driver (coming=%d, live=%d)", WATCH_FUNCTION, name,
-               (*watcher_lptr)->notify_coming ? 1 : 0, (*watcher_lptr)->notify_live ? 1 : 0);
+               watcher->notify_coming ? 1 : 0, watcher->notify_live ? 1 : 0);
 
     if (!ov_driver_register) {
         pr_loc_dbg("Registered the first driver_register watcher - starting watching");
@@ -222,29 +404,32 @@ driver_watcher_instance *watch_driver_register(const char *name, watch_dr_callba
             return ERR_PTR(out);
     }
 
-    return *watcher_lptr;
+    return watcher;
 }
 
 int unwatch_driver_register(driver_watcher_instance *instance)
 {
-    driver_watcher_instance **matched_lptr = match_watcher(instance->name);
-    if (unlikely(!matched_lptr)) {
+    if (instance->bus)
+        return unwatch_driver_bus(instance);
+
+    driver_watcher_instance *matched = match_watcher(instance->name);
+    if (unlikely(!matched)) {
         //This means it could be a double-unwatch situation and this will prevent a double-kfree (but the lack of crash
         // is not guaranteed as match_watcher() already touched the memory)
         pr_loc_bug("Watcher %p for %s couldn't be found in the watchers list", instance, instance->name);
         return -ENOENT;
     }
 
-    if (unlikely(*matched_lptr != instance)) {
-        pr_loc_bug("Watcher %p for %s was found but the instance on the list %p (@%p) isn't the same (?!)", instance,
-                   instance->name, *matched_lptr, matched_lptr);
+    if (unlikely(matched != instance)) {
+        pr_loc_bug("Watcher %p for %s was found but the instance on the list %p isn't the same (?!)", instance,
+                   instance->name, matched);
         return -EINVAL;
     }
 
-    pr_loc_dbg("Removed %pF<%p> subscriber for \"%s\" driver", (*matched_lptr)->cb, (*matched_lptr)->cb,
-               (*matched_lptr)->name);
-    kfree(*matched_lptr);
-    *matched_lptr = NULL;
+    pr_loc_dbg("Removed %pF<%p> subscriber for \"%s\" driver", matched->cb, matched->cb, matched->name);
+    hash_del(&matched->node);
+    --watchers_count;
+    kfree(matched);
 
     if (!has_any_watchers()) {
         pr_loc_dbg("Removed last %s() subscriber - unshimming %s()", WATCH_FUNCTION, WATCH_FUNCTION);
@@ -256,6 +441,27 @@ int unwatch_driver_register(driver_watcher_instance *instance)
     return 0;
 }
 
+int unregister_driver_watchers(void)
+{
+    driver_watcher_instance *watcher;
+
+    mutex_lock(&bus_watchers_lock);
+    while (!list_empty(&bus_watchers)) {
+        watcher = list_first_entry(&bus_watchers, driver_watcher_instance, bus_node);
+        list_del(&watcher->bus_node);
+        mutex_unlock(&bus_watchers_lock); //free_bus_watcher() sleeps
+
+        if (unlikely(!test_bit(BUS_WATCH_DONE, &watcher->bus_state)))
+            pr_loc_wrn("Bus watcher for \"%s\" was never unwatched - removing it", watcher->name);
+        free_bus_watcher(watcher);
+
+        mutex_lock(&bus_watchers_lock);
+    }
+    mutex_unlock(&bus_watchers_lock);
+
+    return 0;
+}
+
 int is_driver_registered(const char *name, struct bus_type *bus)
 {
     if (!bus)
@@ -39,12 +39,40 @@ typedef driver_watch_notify_result (watch_dr_callback)(struct device_driver *drv
 driver_watcher_instance *watch_driver_register(const char *name, watch_dr_callback *cb, int event_mask);
 
 /**
- * Undoes what watch_driver_register() did
+ * Start watching for a driver binding to devices on a given bus (bus notifier mode)
+ *
+ * Unlike watch_driver_register() this doesn't override anything - drivers which aren't watched never enter our code.
+ * DWATCH_STATE_COMING is delivered right before the watched driver is probed for its first device and
+ * DWATCH_STATE_LIVE after it was bound successfully. Each state is delivered at most once. Callbacks cannot abort the
+ * registration (DWATCH_NOTIFY_ABORT_* are ignored) and drivers without any devices on the bus will never trigger them.
+ *
+ * @param name Name of the driver you want to observe
+ * @param bus Bus on which the driver binds to devices
+ * @param cb Callback called on an event
+ * @param event_mask ORed driver_watch_notify_state flags to when the callback is called
+ *
+ * @return watcher instance on success, ERR_PTR(-E) on error
+ */
+driver_watcher_instance *watch_driver_bus(const char *name, struct bus_type *bus, watch_dr_callback *cb,
+                                          int event_mask);
+
+/**
+ * Undoes what watch_driver_register() or watch_driver_bus() did
  *
  * @return 0 on success, -E on error
  */
 int unwatch_driver_register(driver_watcher_instance *instance);
 
+/**
+ * Frees all bus watchers which are left, including ones which unwatched themselves (DWATCH_NOTIFY_DONE)
+ *
+ * Such watchers cannot be freed from the notifier chain & their owners forget them, so they're kept until this is
+ * called. It waits for their deferred release as well - it must be called on unload, after all owners unwatched.
+ *
+ * @return 0 on success, -E on error
+ */
+int unregister_driver_watchers(void);
+
 /**
  * Checks if a given driver exists
  *
@@ -1,9 +1,25 @@
 /*
  * Submodule used to hook the execve() syscall, used by the userland to execute binaries.
  *
- * This submodule can currently block calls to specific binaries and fake a successful return of the execution. In the
- * future, if needed, an option to fake certain response and/or execute a different binary instead can be easily added
- * here.
+ * This submodule can currently block calls to specific binaries and fake their result without executing them: the
+ * process calling execve() writes a canned stdout (if any) and exits with a configured code (0 by default). Callers
+ * waiting for the child thus get an instant & deterministic answer instead of something they may keep retrying. In the
+ * future, if needed, an option to execute a different binary instead can be easily added here. The list of blocked
+ * binaries can be changed at any time (it's RCU-protected) - in non-stealth builds it is also exposed via debugfs.
+ *
+ * Binaries are matched by the filename passed to execve() AND by the identity (device & inode) of the file the
+ * filename of a rule resolves to. The latter catches symlinks, bind mounts and different spellings of the same path
+ * (e.g. "./" or relative ones). Only absolute filenames can be resolved (relative ones depend on the cwd of the
+ * caller) and files which don't exist yet obviously cannot be either. Filenames are matched in the syscall shim, before
+ * the file is even opened. Identities are matched by a binary format handler placed in front of all others: by then
+ * do_execve() has opened the file, so its identity is a hash lookup away and no path is walked again. A call blocked
+ * there hands its result to the shim waiting for it (see struct execve_waiter) and fails, so that the shim finishes it
+ * like one blocked by its name. Rules are re-resolved in the background whenever mounts change (the wait queue
+ * /proc/mounts pollers sleep on is used as a notification).
+ *
+ * Rules may also depend on args (e.g. block "synoupgrade --check" but not "synoupgrade --help"), see struct
+ * execve_rule. Their patterns are compiled when added and args of a call are only copied when a rule with patterns
+ * matched its file, so such rules cost nothing for calls of other binaries.
  *
  * execve() is a rather special syscall. This submodule utilized override_symbool.c:override_syscall() to do the actual
  * ground work of replacing the call. However some syscalls (execve, fork, etc.) use ASM stubs with a non-GCC call
@@ -22,79 +38,1224 @@
 #include "../common.h"
 #include <linux/limits.h>
 #include <linux/fs.h> //struct filename
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_add(), hash_for_each_possible()
+#include <linux/jhash.h> //jhash()
+#include <linux/bitmap.h> //DECLARE_BITMAP, test_bit(), set_bit()
+#include <linux/rcupdate.h> //rcu_read_lock(), kfree_rcu()
+#include <linux/mutex.h> //DEFINE_MUTEX
+#include <linux/seq_file.h> //seq_printf(), single_open()
+#include <linux/debugfs.h> //debugfs_create_file()
+#include <linux/uaccess.h> //copy_from_user()
+#include <linux/file.h> //fget(), fput()
+#include <linux/string_helpers.h> //string_unescape_inplace()
+#include <linux/namei.h> //kern_path(), LOOKUP_FOLLOW
+#include <linux/path.h> //struct path, path_put()
+#include <linux/workqueue.h> //DECLARE_WORK, queue_work()
+#include <linux/jiffies.h> //msecs_to_jiffies()
+#include <linux/binfmts.h> //struct linux_binprm, insert_binfmt(), unregister_binfmt()
+#include <linux/mm.h> //get_user_pages(), put_page()
+#include <linux/highmem.h> //kmap(), kunmap()
+#include <linux/poll.h> //poll_table, init_poll_funcptr()
+#include <linux/wait.h> //init_waitqueue_func_entry(), add_wait_queue()
+#include <linux/spinlock.h> //DEFINE_SPINLOCK
+#include <linux/list.h> //LIST_HEAD, list_add(), list_del()
+#include "helper/debugfs_helper.h" //RP_DEBUGFS_ENABLED, get_rp_debugfs_dir()
+#include "helper/user_args_helper.h" //struct user_arg_ptr, get_user_arg_ptr()
 #include "override/override_syscall.h" //SYSCALL_SHIM_DEFINE3, override_symbol
 #include "call_protected.h" //do_execve(), getname(), putname()
+#include "hook_stats.h" //hook_stats_begin(), hook_stats_end()
+#include "housekeeping.h" //housekeeping_wq()
+#include "rp_trace.h" //rp_trace()
 
 #ifdef RPDBG_EXECVE
 #include "../debug/debug_execve.h"
 #endif
 
-#define MAX_INTERCEPTED_FILES 10
+#define BLOCKED_HASH_BITS 4 //16 buckets - we're expecting a handful of entries but there's no hard limit
+#define BLOCKED_LEN_BITS 128 //lengths which can be prefiltered using a bitmap; longer ones share the last bit
+#define BLOCKED_INODE_HASH_BITS 4
+#define BLOCKED_REVALIDATE_MS 10000 //how often rules are re-resolved while mounts cannot be watched
+#define BLOCKED_EXECVE_ERR (-ECANCELED) //returned by the binary format handler for calls blocked by identity
+#define MOUNTS_WATCH_FILE "/proc/1/mounts"
+#define CANNED_STDOUT_MAX PAGE_SIZE
+#define CANNED_STDOUT_FD 1
 
-static char * intercepted_filenames[MAX_INTERCEPTED_FILES] = { NULL };
+struct blocked_execve_entry;
 
-int add_blocked_execve_filename(const char *filename)
+/**
+ * Identity of a file a blocked filename resolved to
+ */
+struct blocked_inode_entry {
+    struct hlist_node node;
+    struct rcu_head rcu;
+    dev_t dev;
+    unsigned long ino;
+    struct blocked_execve_entry *execve;
+};
+
+/**
+ * Single argv pattern of a rule, compiled once when the rule is added
+ */
+struct execve_arg_pattern {
+    const char *str; //stored after the entry's filename (NOT NUL-terminated)
+    u16 len;
+    bool prefix; //"str*": any arg starting with str matches
+};
+
+/**
+ * Single rule for a binary; the length & hash are computed once when added so that execve() path can reject quickly
+ *
+ * There may be many entries for the same filename, differing by their argv patterns.
+ */
+struct blocked_execve_entry {
+    struct hlist_node node;
+    struct rcu_head rcu;
+    u32 hash;
+    size_t len;
+    u64 seq; //order in which rules were added; breaks ties between equally specific ones
+    enum execve_rule_action action;
+    int exit_code; //exit code of the process instead of running the binary
+    size_t stdout_len;
+    char *stdout_data; //canned stdout (stored after the filename) or NULL if none
+    unsigned int argc; //number of argv patterns; 0 means any args
+    struct execve_arg_pattern argv[EXECVE_RULE_MAX_ARGS];
+    struct blocked_inode_entry *inode; //NULL if the filename couldn't be resolved (accessed with blocked_files_lock)
+    char filename[];
+};
+
+/**
+ * Result of a blocked execve() copied out of the RCU-protected entry
+ */
+struct execve_result {
+    int exit_code;
+    size_t stdout_len;
+    char *stdout_data; //must be kfree()d
+};
+
+/**
+ * File being executed, as far as rules are concerned
+ */
+struct execve_target {
+    const char *filename;
+    size_t len;
+    u32 hash;
+    bool by_name; //whether any rule may match the filename (passed the prefilter)
+    bool by_inode; //whether dev & ino are valid
+    dev_t dev;
+    unsigned long ino;
+};
+
+/**
+ * Args (after argv[0]) of the execve() call being checked
+ *
+ * They're copied from the userspace lazily: only when a rule with argv patterns matched the file and only as many as
+ * the most specific such rule needs.
+ */
+struct execve_args {
+    unsigned int argc; //number of args copied
+    u16 lens[EXECVE_RULE_MAX_ARGS]; //EXECVE_RULE_ARG_MAX+1 means "longer than any pattern"
+    char (*args)[EXECVE_RULE_ARG_MAX + 1]; //not NUL-terminated
+};
+
+/*
+ * The list of blocked files is read locklessly under RCU from the execve() path. Writers (add/remove) are serialized
+ * using blocked_files_lock. The prefilter (blocked_lens & blocked_max_len) may be stale for a moment for a reader
+ * racing with a writer - this is fine as it's only used to skip the hash lookup.
+ */
+static DEFINE_HASHTABLE(blocked_files, BLOCKED_HASH_BITS);
+static DEFINE_MUTEX(blocked_files_lock);
+static DECLARE_BITMAP(blocked_lens, BLOCKED_LEN_BITS); //bit N is set if there's any entry with length N
+static size_t blocked_max_len = 0; //0 means there's nothing to block
+static DEFINE_HASHTABLE(blocked_inodes, BLOCKED_INODE_HASH_BITS); //same rules as blocked_files
+static unsigned int blocked_inodes_num = 0;
+static u64 rules_seq = 0; //accessed with blocked_files_lock
+
+static inline unsigned int len_bit(size_t len)
+{
+    return likely(len < BLOCKED_LEN_BITS) ? len : BLOCKED_LEN_BITS - 1;
+}
+
+/**
+ * Checks if two entries are the same rule (same filename & argv patterns)
+ */
+static bool is_same_rule(const struct blocked_execve_entry *a, const struct blocked_execve_entry *b)
+{
+    if (a->hash != b->hash || a->len != b->len || a->argc != b->argc || memcmp(a->filename, b->filename, a->len) != 0)
+        return false;
+
+    for (unsigned int i = 0; i < a->argc; ++i) {
+        if (a->argv[i].len != b->argv[i].len || a->argv[i].prefix != b->argv[i].prefix ||
+            memcmp(a->argv[i].str, b->argv[i].str, a->argv[i].len) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Finds an existing entry for the same rule as the one given
+ *
+ * You MUST hold blocked_files_lock while calling this function
+ *
+ * @return entry or NULL if not found
+ */
+static struct blocked_execve_entry *find_same_rule(const struct blocked_execve_entry *rule)
 {
-    if (unlikely(strlen(filename) > PATH_MAX))
-        return -ENAMETOOLONG;
+    struct blocked_execve_entry *entry;
+
+    hash_for_each_possible(blocked_files, entry, node, rule->hash) {
+        if (is_same_rule(entry, rule))
+            return entry;
+    }
 
-    unsigned int idx = 0;
-    while (likely(intercepted_filenames[idx])) { //Find free spot
-        if (unlikely(strcmp(filename, intercepted_filenames[idx]) == 0)) { //Does it exist already?
-            pr_loc_bug("File %s was already added at %d", filename, idx);
-            return -EEXIST;
+    return NULL;
+}
+
+/**
+ * Checks if args of the call match all argv patterns of a rule
+ */
+static bool rule_args_match(const struct blocked_execve_entry *entry, const struct execve_args *args)
+{
+    if (entry->argc > args->argc)
+        return false;
+
+    for (unsigned int i = 0; i < entry->argc; ++i) {
+        const struct execve_arg_pattern *pattern = &entry->argv[i];
+        if (pattern->prefix ? args->lens[i] < pattern->len : args->lens[i] != pattern->len)
+            return false;
+        if (memcmp(args->args[i], pattern->str, pattern->len) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Considers a rule whose file matched as the decision for the call
+ *
+ * The most specific rule (with most argv patterns) wins; among equally specific ones the one added first does.
+ *
+ * @param args args of the call or NULL if they weren't copied yet - rules with patterns are only counted then
+ * @param need_args max number of args needed by rules which were skipped due to the missing args
+ */
+static __always_inline void consider_rule(struct blocked_execve_entry *entry, const struct execve_args *args,
+                                          struct blocked_execve_entry **best, unsigned int *need_args)
+{
+    if (entry->argc) {
+        if (!args) {
+            *need_args = max(*need_args, entry->argc);
+            return;
         }
 
-        if(unlikely(++idx >= MAX_INTERCEPTED_FILES)) { //Are we out of indexes?
-            pr_loc_bug("Tried to add %d intercepted filename (max=%d)", idx, MAX_INTERCEPTED_FILES);
-            return -ENOMEM;
+        if (!rule_args_match(entry, args))
+            return;
+    }
+
+    if (!*best || entry->argc > (*best)->argc || (entry->argc == (*best)->argc && entry->seq < (*best)->seq))
+        *best = entry;
+}
+
+/**
+ * Finds the rule deciding about the execve() call
+ *
+ * You MUST hold rcu_read_lock() while calling this function
+ *
+ * @param args see consider_rule()
+ * @param need_args see consider_rule(); when it's not 0 the returned rule isn't final
+ *
+ * @return entry or NULL if no rule matched
+ */
+static struct blocked_execve_entry *decide_execve(const struct execve_target *target, const struct execve_args *args,
+                                                  unsigned int *need_args)
+{
+    struct blocked_execve_entry *entry, *best = NULL;
+    *need_args = 0;
+
+    if (target->by_name) {
+        hash_for_each_possible_rcu(blocked_files, entry, node, target->hash) {
+            if (entry->hash == target->hash && entry->len == target->len &&
+                memcmp(entry->filename, target->filename, target->len) == 0)
+                consider_rule(entry, args, &best, need_args);
+        }
+    }
+
+    if (target->by_inode) {
+        struct blocked_inode_entry *inode;
+        hash_for_each_possible_rcu(blocked_inodes, inode, node, target->ino ^ target->dev) {
+            if (inode->ino == target->ino && inode->dev == target->dev)
+                consider_rule(inode->execve, args, &best, need_args);
         }
     }
 
-    kmalloc_or_exit_int(intercepted_filenames[idx], strsize(filename));
-    strcpy(intercepted_filenames[idx], filename); //Size checked above
+    return best;
+}
 
-    pr_loc_inf("Filename %s will be blocked from execution", filename);
+/**
+ * Where args of the execve() call being checked can be copied from: the userspace (in the syscall shim) or the new
+ * stack prepared by do_execve() (in the binary format handler)
+ */
+struct execve_args_src {
+    const char __user *const __user *argv;
+    struct linux_binprm *bprm;
+};
+
+static bool alloc_execve_args(struct execve_args *args, unsigned int num)
+{
+    args->args = kmalloc(num * sizeof(*args->args), GFP_KERNEL);
+    if (unlikely(!args->args)) {
+        pr_loc_crt("kernel memory alloc failure - tried to allocate %zu bytes for execve() args",
+                   num * sizeof(*args->args));
+        return false;
+    }
+
+    return true;
+}
+
+static void copy_user_execve_args(struct execve_args *args, const char __user *const __user *uargv, unsigned int num)
+{
+    struct user_arg_ptr argv = { .ptr.native = uargv };
+
+    if (!uargv || !alloc_execve_args(args, num))
+        return;
+
+    for (unsigned int i = 0; i < num; ++i) {
+        const char __user *arg = get_user_arg_ptr(argv, i + 1); //argv[0] is the program name
+        if (IS_ERR_OR_NULL(arg))
+            break;
+
+        long len = strncpy_from_user(args->args[i], arg, EXECVE_RULE_ARG_MAX + 1);
+        if (len < 0)
+            break;
+
+        args->lens[i] = len;
+        args->argc = i + 1;
+    }
+}
+
+/**
+ * Gets a page of the new stack of a program being loaded; it isn't mapped in the current mm (yet)
+ *
+ * @return page (which must be put_page()d) or NULL on error
+ */
+static struct page *get_bprm_page(struct linux_binprm *bprm, unsigned long pos)
+{
+    struct page *page;
+    long out;
+
+    down_read(&bprm->mm->mmap_sem);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,6,0)
+    out = get_user_pages(current, bprm->mm, pos, 1, 0, 1, &page, NULL);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,9,0)
+    out = get_user_pages_remote(current, bprm->mm, pos, 1, 0, 1, &page, NULL);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+    out = get_user_pages_remote(current, bprm->mm, pos, 1, FOLL_FORCE, &page, NULL);
+#else
+    out = get_user_pages_remote(current, bprm->mm, pos, 1, FOLL_FORCE, &page, NULL, NULL);
+#endif
+    up_read(&bprm->mm->mmap_sem);
+
+    return out == 1 ? page : NULL;
+}
+
+/**
+ * Copies args from the new stack of a program being loaded: do_execve() placed argv strings one after another starting
+ * at bprm->p
+ */
+static void copy_bprm_execve_args(struct execve_args *args, struct linux_binprm *bprm, unsigned int num)
+{
+    if (bprm->argc < 2)
+        return;
+
+    num = min(num, (unsigned int)bprm->argc - 1);
+    if (!alloc_execve_args(args, num))
+        return;
+
+    struct page *page = NULL;
+    char *kaddr = NULL;
+    unsigned long pos = bprm->p;
+    unsigned int arg = 0; //argv[0] is the program name - it's skipped like in copy_user_execve_args()
+    u16 len = 0;
+    while (arg <= num) {
+        if (!page || (pos & ~PAGE_MASK) == 0) {
+            if (page) {
+                kunmap(page);
+                put_page(page);
+            }
+
+            page = get_bprm_page(bprm, pos);
+            if (unlikely(!page))
+                return;
+            kaddr = kmap(page);
+        }
+
+        char chr = kaddr[pos++ & ~PAGE_MASK];
+        if (chr == '\0') {
+            if (arg) {
+                args->lens[arg - 1] = len;
+                args->argc = arg;
+            }
+            ++arg;
+            len = 0;
+        } else if (arg && len <= EXECVE_RULE_ARG_MAX) {
+            args->args[arg - 1][len++] = chr;
+        }
+    }
+
+    kunmap(page);
+    put_page(page);
+}
+
+/**
+ * Copies up to "num" args (after argv[0]) of the execve() call; this may sleep
+ *
+ * Args longer than any pattern are truncated to EXECVE_RULE_ARG_MAX+1 bytes (which makes them unequal to any pattern
+ * while still allowing prefix matching). Copying stops at the first invalid/missing arg.
+ */
+static void copy_execve_args(struct execve_args *args, const struct execve_args_src *src, unsigned int num)
+{
+    args->argc = 0;
+    if (src->bprm)
+        copy_bprm_execve_args(args, src->bprm, num);
+    else
+        copy_user_execve_args(args, src->argv, num);
+}
+
+/**
+ * Resolves a filename (following symlinks, relative to the cwd) to the identity of the file
+ *
+ * @return 0 on success, -E on error (e.g. -ENOENT)
+ */
+static int resolve_execve_inode(const char *filename, dev_t *dev, unsigned long *ino)
+{
+    struct path path;
+    int out = kern_path(filename, LOOKUP_FOLLOW, &path);
+    if (out != 0)
+        return out;
+
+    *dev = path.dentry->d_inode->i_sb->s_dev;
+    *ino = path.dentry->d_inode->i_ino;
+    path_put(&path);
+
+    return 0;
+}
+
+/**
+ * (Re)resolves the identity of a blocked entry, replacing the old one if it changed
+ *
+ * You MUST hold blocked_files_lock while calling this function
+ */
+static void resolve_blocked_entry(struct blocked_execve_entry *entry)
+{
+    struct blocked_inode_entry *old = entry->inode;
+    dev_t dev;
+    unsigned long ino;
+
+    if (entry->filename[0] != '/' || resolve_execve_inode(entry->filename, &dev, &ino) != 0) {
+        if (!old)
+            return;
+
+        pr_loc_dbg("Blocked file %s no longer resolves to %u:%lu", entry->filename, old->dev, old->ino);
+        entry->inode = NULL;
+    } else if (old && old->dev == dev && old->ino == ino) {
+        return;
+    } else {
+        //Readers may be traversing the old node - a new one is added instead of rehashing the old one
+        struct blocked_inode_entry *new = kmalloc(sizeof(struct blocked_inode_entry), GFP_KERNEL);
+        if (unlikely(!new)) {
+            pr_loc_crt("kernel memory alloc failure - tried to allocate %zu bytes for %s identity",
+                       sizeof(struct blocked_inode_entry), entry->filename);
+        } else {
+            new->dev = dev;
+            new->ino = ino;
+            new->execve = entry;
+            hash_add_rcu(blocked_inodes, &new->node, ino ^ dev);
+            ACCESS_ONCE(blocked_inodes_num) = blocked_inodes_num + 1;
+            pr_loc_dbg("Blocked file %s resolved to %u:%lu", entry->filename, dev, ino);
+        }
+        entry->inode = new;
+    }
+
+    if (old) {
+        hash_del_rcu(&old->node);
+        ACCESS_ONCE(blocked_inodes_num) = blocked_inodes_num - 1;
+        kfree_rcu(old, rcu);
+    }
+}
+
+/**
+ * Drops the identity of a blocked entry (e.g. before the entry is removed)
+ *
+ * You MUST hold blocked_files_lock while calling this function
+ */
+static void unresolve_blocked_entry(struct blocked_execve_entry *entry)
+{
+    if (!entry->inode)
+        return;
+
+    hash_del_rcu(&entry->inode->node);
+    ACCESS_ONCE(blocked_inodes_num) = blocked_inodes_num - 1;
+    kfree_rcu(entry->inode, rcu);
+    entry->inode = NULL;
+}
+
+static void revalidate_blocked_inodes(struct work_struct *work)
+{
+    struct blocked_execve_entry *entry;
+    int bkt;
+
+    mutex_lock(&blocked_files_lock);
+    hash_for_each(blocked_files, bkt, entry, node)
+        resolve_blocked_entry(entry);
+    mutex_unlock(&blocked_files_lock);
+}
+static DECLARE_WORK(revalidate_work, revalidate_blocked_inodes);
+
+/*
+ * Modules cannot subscribe to mount changes directly. However, every change to a mount namespace wakes up the wait
+ * queue which pollers of its /proc/mounts sleep on. Our own entry is placed on that queue (by polling the file once
+ * with a custom poll_table) and every wakeup queues the revalidation. If /proc isn't available (yet) rules are instead
+ * re-resolved every BLOCKED_REVALIDATE_MS until the watch can be armed.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0)
+typedef wait_queue_t wait_queue_entry_t;
+#endif
+static struct file *mounts_file = NULL;
+static wait_queue_head_t *mounts_wqh = NULL;
+static wait_queue_entry_t mounts_wait;
+static poll_table mounts_pt;
+
+static int on_mounts_changed(wait_queue_entry_t *wait, unsigned mode, int sync, void *key)
+{
+    queue_work(housekeeping_wq(system_wq), &revalidate_work); //called with the queue lock held - cannot resolve here
+    return 0;
+}
+
+static void mounts_poll_qproc(struct file *file, wait_queue_head_t *wqh, poll_table *pt)
+{
+    if (mounts_wqh) //mounts file uses a single queue; this is just in case
+        return;
+
+    mounts_wqh = wqh;
+    add_wait_queue(wqh, &mounts_wait);
+}
+
+/**
+ * Arms the mount changes watch
+ *
+ * @return 0 on success, -E on error (e.g. -ENOENT if /proc isn't mounted)
+ */
+static int watch_mounts(void)
+{
+    struct file *file = filp_open(MOUNTS_WATCH_FILE, O_RDONLY, 0);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+    init_waitqueue_func_entry(&mounts_wait, on_mounts_changed);
+    init_poll_funcptr(&mounts_pt, mounts_poll_qproc);
+    if (file->f_op->poll)
+        file->f_op->poll(file, &mounts_pt);
+
+    if (!mounts_wqh) {
+        filp_close(file, NULL);
+        return -EOPNOTSUPP;
+    }
+
+    mounts_file = file;
+    pr_loc_dbg("Watching mount changes via %s", MOUNTS_WATCH_FILE);
     return 0;
 }
 
+static void unwatch_mounts(void)
+{
+    if (!mounts_file)
+        return;
+
+    remove_wait_queue(mounts_wqh, &mounts_wait);
+    filp_close(mounts_file, NULL);
+    mounts_wqh = NULL;
+    mounts_file = NULL;
+}
+
+static void rewatch_mounts(struct work_struct *work);
+static DECLARE_DELAYED_WORK(rewatch_work, rewatch_mounts);
+static void rewatch_mounts(struct work_struct *work)
+{
+    revalidate_blocked_inodes(NULL);
+    if (watch_mounts() != 0)
+        queue_delayed_work(housekeeping_wq(system_wq), &rewatch_work, msecs_to_jiffies(BLOCKED_REVALIDATE_MS));
+}
+
+/**
+ * Decides about the execve() call and gets its canned result if it's blocked
+ *
+ * @return true if the call is blocked, false otherwise
+ */
+static bool decide_execve_result(const struct execve_target *target, const struct execve_args_src *src,
+                                 struct execve_result *result)
+{
+    struct execve_args args = { 0 };
+    unsigned int need_args;
+    rcu_read_lock();
+    struct blocked_execve_entry *entry = decide_execve(target, NULL, &need_args);
+    if (need_args) {
+        //Copying args may sleep. Rules may change in the meantime, but with args present every rule is decided on
+        // (a rule added in between needing more args than copied simply doesn't match this one call).
+        rcu_read_unlock();
+        copy_execve_args(&args, src, need_args);
+        rcu_read_lock();
+        entry = decide_execve(target, &args, &need_args);
+    }
+
+    bool blocked = entry && entry->action == EXECVE_RULE_BLOCK;
+    if (blocked) {
+        result->exit_code = entry->exit_code;
+        //writing it may sleep so it must be copied out of the RCU section; it's rare, so GFP_ATOMIC isn't a problem
+        result->stdout_data = entry->stdout_data ? kmemdup(entry->stdout_data, entry->stdout_len, GFP_ATOMIC) : NULL;
+        result->stdout_len = result->stdout_data ? entry->stdout_len : 0;
+    }
+    rcu_read_unlock();
+    kfree(args.args);
+
+    return blocked;
+}
+
+/**
+ * Fills the filename part of the target
+ *
+ * @return whether any rule may match the filename
+ */
+static __always_inline bool target_by_name(struct execve_target *target, const char *filename, size_t max_len)
+{
+    target->filename = filename;
+    target->len = strnlen(filename, max_len + 1);
+    target->by_name = target->len <= max_len && test_bit(len_bit(target->len), blocked_lens);
+    if (target->by_name)
+        target->hash = jhash(filename, target->len, 0);
+
+    return target->by_name;
+}
+
+/**
+ * Checks if the execve() call is blocked by its filename and gets its canned result
+ *
+ * This is the hot path. For the vast majority of calls it will exit after reading at most blocked_max_len+1 bytes and
+ * a single bit test, without computing any hash or taking any locks. Args are only copied from the userspace when some
+ * rule with argv patterns matched the file. Identities are checked later, see execve_blocker_load_binary().
+ */
+static bool is_execve_blocked(const char *filename, const char __user *const __user *argv,
+                              struct execve_result *result)
+{
+    size_t max_len = ACCESS_ONCE(blocked_max_len);
+    if (likely(!max_len))
+        return false;
+
+    struct execve_target target = { 0 };
+    if (likely(!target_by_name(&target, filename, max_len)))
+        return false;
+
+    struct execve_args_src src = { .argv = argv };
+    return decide_execve_result(&target, &src, result);
+}
+
+/*
+ * Calls going through the shim wait for a possible result of the binary format handler here. A waiter lives on the
+ * stack of the shim & is keyed by its task, so the handler fills the result of exactly the call it blocked. Calls made
+ * outside of the shim (e.g. usermode helpers) have no waiter: they're blocked with a plain BLOCKED_EXECVE_ERR.
+ */
+struct execve_waiter {
+    struct list_head node;
+    struct task_struct *task;
+    bool blocked;
+    struct execve_result result;
+};
+static LIST_HEAD(execve_waiters);
+static DEFINE_SPINLOCK(execve_waiters_lock);
+
+static void add_execve_waiter(struct execve_waiter *waiter)
+{
+    waiter->task = current;
+    waiter->blocked = false;
+    spin_lock(&execve_waiters_lock);
+    list_add(&waiter->node, &execve_waiters);
+    spin_unlock(&execve_waiters_lock);
+}
+
+static void remove_execve_waiter(struct execve_waiter *waiter)
+{
+    spin_lock(&execve_waiters_lock);
+    list_del(&waiter->node);
+    spin_unlock(&execve_waiters_lock);
+}
+
+/**
+ * Passes the result of a call blocked by the binary format handler to the shim waiting for it (if any)
+ *
+ * @return true if the result was taken by a waiter, false if it was dropped
+ */
+static bool fill_execve_waiter(struct execve_result *result)
+{
+    struct execve_waiter *waiter;
+    bool found = false;
+
+    //Only the current task can touch its waiter (it's on its stack and it's inside do_execve() now) - the lock only
+    // protects the list itself
+    spin_lock(&execve_waiters_lock);
+    list_for_each_entry(waiter, &execve_waiters, node) {
+        if (waiter->task == current) {
+            found = true;
+            break;
+        }
+    }
+    spin_unlock(&execve_waiters_lock);
+
+    if (!found) {
+        kfree(result->stdout_data);
+        return false;
+    }
+
+    if (unlikely(waiter->blocked))
+        kfree(waiter->result.stdout_data); //a format retried after e.g. a module was loaded for it
+
+    waiter->result = *result;
+    waiter->blocked = true;
+    return true;
+}
+
+/**
+ * Checks if any rule resolved to the identity of the target
+ *
+ * You MUST hold rcu_read_lock() while calling this function
+ */
+static bool is_inode_ruled(const struct execve_target *target)
+{
+    struct blocked_inode_entry *inode;
+
+    hash_for_each_possible_rcu(blocked_inodes, inode, node, target->ino ^ target->dev) {
+        if (inode->ino == target->ino && inode->dev == target->dev)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Binary format handler matching the file being executed by its identity
+ *
+ * It's placed in front of all other formats, so it sees every program before it's loaded, with its file already open.
+ * It never loads anything: calls which aren't blocked get -ENOEXEC and the kernel goes on to the next format. Only the
+ * file execve() was called with is matched - not interpreters of scripts & such loaded on its behalf.
+ */
+static int execve_blocker_load_binary(struct linux_binprm *bprm)
+{
+    if (likely(!ACCESS_ONCE(blocked_inodes_num)) || bprm->interp != bprm->filename)
+        return -ENOEXEC;
+
+    struct inode *inode = file_inode(bprm->file);
+    struct execve_target target = { .by_inode = true, .dev = inode->i_sb->s_dev, .ino = inode->i_ino };
+    rcu_read_lock();
+    bool ruled = is_inode_ruled(&target);
+    rcu_read_unlock();
+    if (likely(!ruled))
+        return -ENOEXEC;
+
+    //Filename rules must be decided on too, as a more specific one may override a rule for the identity
+    size_t max_len = ACCESS_ONCE(blocked_max_len);
+    if (max_len)
+        target_by_name(&target, bprm->filename, max_len);
+
+    struct execve_args_src src = { .bprm = bprm };
+    struct execve_result result;
+    if (!decide_execve_result(&target, &src, &result))
+        return -ENOEXEC;
+
+    rp_trace(execve, bprm->filename, true, result.exit_code);
+    pr_loc_inf("Blocked %s from running by its identity (exit code %d)", bprm->filename, result.exit_code);
+    if (!fill_execve_waiter(&result))
+        pr_loc_dbg("%s was executed outside of execve() - its result cannot be faked", bprm->filename);
+
+    return BLOCKED_EXECVE_ERR;
+}
+
+static struct linux_binfmt execve_blocker_fmt = {
+    .module = THIS_MODULE,
+    .load_binary = execve_blocker_load_binary,
+};
+
+/**
+ * Rebuilds length prefilter from scratch (used after removing entries)
+ *
+ * You MUST hold blocked_files_lock while calling this function
+ */
+static void rebuild_blocked_prefilter(void)
+{
+    struct blocked_execve_entry *entry;
+    size_t max_len = 0;
+    int bkt;
+
+    bitmap_zero(blocked_lens, BLOCKED_LEN_BITS);
+    hash_for_each(blocked_files, bkt, entry, node) {
+        set_bit(len_bit(entry->len), blocked_lens);
+        if (entry->len > max_len)
+            max_len = entry->len;
+    }
+
+    ACCESS_ONCE(blocked_max_len) = max_len;
+}
+
+/**
+ * Compiles a rule into a new (not yet added) entry
+ *
+ * @return entry or ERR_PTR(-E) on error
+ */
+static struct blocked_execve_entry *compile_execve_rule(const struct execve_rule *rule)
+{
+    size_t len = strlen(rule->filename);
+    if (unlikely(len > PATH_MAX))
+        return ERR_PTR(-ENAMETOOLONG);
+
+    bool block = rule->action == EXECVE_RULE_BLOCK;
+    size_t stdout_len = block && rule->stdout_data ? strlen(rule->stdout_data) : 0;
+    if (unlikely(stdout_len > CANNED_STDOUT_MAX))
+        return ERR_PTR(-E2BIG);
+
+    if (unlikely((block && (rule->exit_code < 0 || rule->exit_code > 255)) ||
+                 (!block && rule->action != EXECVE_RULE_ALLOW)))
+        return ERR_PTR(-EINVAL);
+
+    unsigned int argc = 0;
+    size_t patterns_len = 0;
+    for (; rule->argv && rule->argv[argc]; ++argc) {
+        size_t pattern_len = strlen(rule->argv[argc]);
+        if (pattern_len && rule->argv[argc][pattern_len - 1] == '*')
+            --pattern_len; //the "*" of "prefix*" isn't stored
+        if (unlikely(argc == EXECVE_RULE_MAX_ARGS || pattern_len > EXECVE_RULE_ARG_MAX))
+            return ERR_PTR(-E2BIG);
+
+        patterns_len += pattern_len;
+    }
+
+    struct blocked_execve_entry *entry;
+    kmalloc_or_exit_ptr(entry, sizeof(struct blocked_execve_entry) + strlen_to_size(len) + stdout_len + patterns_len);
+    memcpy(entry->filename, rule->filename, strlen_to_size(len)); //Size checked above
+    entry->len = len;
+    entry->hash = jhash(rule->filename, len, 0);
+    entry->action = rule->action;
+    entry->exit_code = block ? rule->exit_code : 0;
+    entry->stdout_len = stdout_len;
+    entry->stdout_data = stdout_len ? &entry->filename[strlen_to_size(len)] : NULL;
+    if (stdout_len)
+        memcpy(entry->stdout_data, rule->stdout_data, stdout_len);
+
+    char *cursor = &entry->filename[strlen_to_size(len) + stdout_len];
+    entry->argc = argc;
+    for (unsigned int i = 0; i < argc; ++i) {
+        struct execve_arg_pattern *pattern = &entry->argv[i];
+        size_t pattern_len = strlen(rule->argv[i]);
+        pattern->prefix = pattern_len && rule->argv[i][pattern_len - 1] == '*';
+        pattern->len = pattern->prefix ? pattern_len - 1 : pattern_len; //Size checked above
+        pattern->str = cursor;
+        memcpy(cursor, rule->argv[i], pattern->len);
+        cursor += pattern->len;
+    }
+
+    entry->inode = NULL;
+
+    return entry;
+}
+
+int add_execve_rule(const struct execve_rule *rule)
+{
+    struct blocked_execve_entry *entry = compile_execve_rule(rule);
+    if (IS_ERR(entry))
+        return PTR_ERR(entry);
+
+    mutex_lock(&blocked_files_lock);
+    if (unlikely(find_same_rule(entry))) { //Does it exist already?
+        mutex_unlock(&blocked_files_lock);
+        pr_loc_bug("Rule for %s with %u argv patterns was already added", rule->filename, entry->argc);
+        kfree(entry);
+        return -EEXIST;
+    }
+
+    entry->seq = rules_seq++;
+
+    //Prefilter must be updated before the entry is visible so that readers never miss it
+    set_bit(len_bit(entry->len), blocked_lens);
+    if (entry->len > blocked_max_len)
+        ACCESS_ONCE(blocked_max_len) = entry->len;
+    hash_add_rcu(blocked_files, &entry->node, entry->hash);
+    resolve_blocked_entry(entry);
+    mutex_unlock(&blocked_files_lock);
+
+    if (entry->action == EXECVE_RULE_ALLOW)
+        pr_loc_inf("Filename %s will be allowed to execute with %u argv patterns", rule->filename, entry->argc);
+    else
+        pr_loc_inf("Filename %s will be blocked from execution with %u argv patterns (exit code %d, %zu bytes of "
+                   "stdout)", rule->filename, entry->argc, entry->exit_code, entry->stdout_len);
+    return 0;
+}
+
+int remove_execve_rule(const struct execve_rule *rule)
+{
+    struct blocked_execve_entry *wanted = compile_execve_rule(rule);
+    if (IS_ERR(wanted))
+        return PTR_ERR(wanted);
+
+    mutex_lock(&blocked_files_lock);
+    struct blocked_execve_entry *entry = find_same_rule(wanted);
+    if (unlikely(!entry)) {
+        mutex_unlock(&blocked_files_lock);
+        pr_loc_dbg("File %s has no rule with %u given argv patterns - cannot remove", rule->filename, wanted->argc);
+        kfree(wanted);
+        return -ENOENT;
+    }
+
+    hash_del_rcu(&entry->node);
+    unresolve_blocked_entry(entry);
+    rebuild_blocked_prefilter();
+    mutex_unlock(&blocked_files_lock);
+
+    kfree_rcu(entry, rcu);
+    pr_loc_inf("Rule for %s with %u argv patterns removed", rule->filename, wanted->argc);
+    kfree(wanted);
+    return 0;
+}
+
+int add_substituted_execve_filename(const char *filename, int exit_code, const char *stdout_data)
+{
+    struct execve_rule rule = {
+        .filename = filename,
+        .action = EXECVE_RULE_BLOCK,
+        .exit_code = exit_code,
+        .stdout_data = stdout_data,
+    };
+
+    return add_execve_rule(&rule);
+}
+
+int add_blocked_execve_filename(const char *filename)
+{
+    return add_substituted_execve_filename(filename, 0, NULL);
+}
+
+int remove_blocked_execve_filename(const char *filename)
+{
+    struct execve_rule rule = { .filename = filename, .action = EXECVE_RULE_BLOCK };
+
+    return remove_execve_rule(&rule);
+}
+
+/**
+ * Removes all blocked entries
+ */
+static void clear_blocked_execve_filenames(void)
+{
+    struct blocked_execve_entry *entry;
+    struct hlist_node *tmp;
+    int bkt;
+
+    mutex_lock(&blocked_files_lock);
+    ACCESS_ONCE(blocked_max_len) = 0;
+    hash_for_each_safe(blocked_files, bkt, tmp, entry, node) {
+        hash_del_rcu(&entry->node);
+        unresolve_blocked_entry(entry);
+        kfree_rcu(entry, rcu);
+    }
+    bitmap_zero(blocked_lens, BLOCKED_LEN_BITS);
+    mutex_unlock(&blocked_files_lock);
+}
+
+#ifdef RP_DEBUGFS_ENABLED
+/**
+ * Control interface for the list of blocked files in debugfs (<debugfs>/redpill/execve_blocklist)
+ *
+ * Reading lists all current rules (with identities they resolved to). Writing "+/path/to/file" adds an entry,
+ * "-/path/to/file [<pattern>...]" removes one. Writing "=/path/to/file <exit code> [<stdout>]" adds an entry with a
+ * canned result; the stdout may contain C escapes (e.g. "\n"). Writing "~/path/to/file <allow|exit code> <pattern>..."
+ * adds a rule with argv patterns (see struct execve_rule).
+ */
+#define BLOCKLIST_CTRL_FILE "execve_blocklist"
+#define BLOCKLIST_RULE_ALLOW "allow"
+static struct dentry *blocklist_ctrl_file = NULL;
+
+static int blocklist_ctrl_show(struct seq_file *m, void *v)
+{
+    struct blocked_execve_entry *entry;
+    int bkt;
+
+    mutex_lock(&blocked_files_lock); //identities are only stable under the lock
+    hash_for_each(blocked_files, bkt, entry, node) {
+        seq_puts(m, entry->filename);
+        for (unsigned int i = 0; i < entry->argc; ++i)
+            seq_printf(m, " %.*s%s", entry->argv[i].len, entry->argv[i].str, entry->argv[i].prefix ? "*" : "");
+
+        if (entry->action == EXECVE_RULE_ALLOW)
+            seq_puts(m, " -> " BLOCKLIST_RULE_ALLOW);
+        else
+            seq_printf(m, " -> exit=%d stdout=%zu", entry->exit_code, entry->stdout_len);
+
+        if (entry->inode)
+            seq_printf(m, " dev=%u:%u ino=%lu", MAJOR(entry->inode->dev), MINOR(entry->inode->dev), entry->inode->ino);
+        seq_putc(m, '\n');
+    }
+    mutex_unlock(&blocked_files_lock);
+
+    return 0;
+}
+
+static int blocklist_ctrl_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, blocklist_ctrl_show, NULL);
+}
+
+/**
+ * Parses "<path> <exit code> [<stdout>]" and adds it as a substituted entry
+ */
+static int add_substituted_from_cmd(char *cmd)
+{
+    char *cursor = cmd;
+    char *path = strsep(&cursor, " ");
+    char *code = strsep(&cursor, " ");
+    int exit_code;
+
+    if (!code || kstrtoint(code, 10, &exit_code) != 0) {
+        pr_loc_err("Invalid %s substitution \"%s\" - expected =<path> <exit code> [<stdout>]", BLOCKLIST_CTRL_FILE,
+                   cmd);
+        return -EINVAL;
+    }
+
+    if (cursor)
+        string_unescape_inplace(cursor, UNESCAPE_ANY);
+
+    return add_substituted_execve_filename(path, exit_code, cursor);
+}
+
+/**
+ * Splits space-separated patterns into a NULL-terminated list
+ *
+ * @return 0 on success, -E2BIG if there are more than EXECVE_RULE_MAX_ARGS
+ */
+static int split_patterns_from_cmd(char *cursor, const char **argv)
+{
+    unsigned int argc = 0;
+    char *pattern;
+
+    while ((pattern = strsep(&cursor, " ")) != NULL) {
+        if (pattern[0] == '\0')
+            continue;
+
+        if (argc == EXECVE_RULE_MAX_ARGS)
+            return -E2BIG;
+
+        argv[argc++] = pattern;
+    }
+    argv[argc] = NULL;
+
+    return 0;
+}
+
+/**
+ * Parses "<path> <allow|exit code> [<pattern>...]" (add) or "<path> [<pattern>...]" (remove) and applies it
+ */
+static int rule_from_cmd(char *cmd, bool add)
+{
+    const char *argv[EXECVE_RULE_MAX_ARGS + 1];
+    struct execve_rule rule = { .argv = argv, .action = EXECVE_RULE_BLOCK };
+    char *cursor = cmd;
+    char *action = NULL;
+
+    rule.filename = strsep(&cursor, " ");
+    if (add) {
+        action = strsep(&cursor, " ");
+        if (action && strcmp(action, BLOCKLIST_RULE_ALLOW) == 0) {
+            rule.action = EXECVE_RULE_ALLOW;
+        } else if (!action || kstrtoint(action, 10, &rule.exit_code) != 0) {
+            pr_loc_err("Invalid %s rule \"%s\" - expected ~<path> <%s|exit code> [<pattern>...]", BLOCKLIST_CTRL_FILE,
+                       cmd, BLOCKLIST_RULE_ALLOW);
+            return -EINVAL;
+        }
+    }
+
+    int out = split_patterns_from_cmd(cursor, argv);
+    if (out != 0) {
+        pr_loc_err("Too many patterns in %s rule for %s (max %d)", BLOCKLIST_CTRL_FILE, rule.filename,
+                   EXECVE_RULE_MAX_ARGS);
+        return out;
+    }
+
+    return add ? add_execve_rule(&rule) : remove_execve_rule(&rule);
+}
+
+static ssize_t blocklist_ctrl_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
+{
+    if (unlikely(len < 2 || len > PATH_MAX))
+        return -EINVAL;
+
+    char *cmd;
+    kmalloc_or_exit_int(cmd, strlen_to_size(len));
+    if (copy_from_user(cmd, buf, len)) {
+        kfree(cmd);
+        return -EFAULT;
+    }
+    cmd[len] = '\0';
+    strim(cmd);
+
+    int out;
+    switch (cmd[0]) {
+        case '+':
+            out = add_blocked_execve_filename(&cmd[1]);
+            break;
+        case '-':
+            out = rule_from_cmd(&cmd[1], false);
+            break;
+        case '=':
+            out = add_substituted_from_cmd(&cmd[1]);
+            break;
+        case '~':
+            out = rule_from_cmd(&cmd[1], true);
+            break;
+        default:
+            pr_loc_err("Invalid %s command \"%s\" - expected +<path>, -<path> [<pattern>...], =<path> <exit code> "
+                       "[<stdout>] or ~<path> <%s|exit code> [<pattern>...]", BLOCKLIST_CTRL_FILE, cmd,
+                       BLOCKLIST_RULE_ALLOW);
+            out = -EINVAL;
+    }
+
+    kfree(cmd);
+    return out == 0 ? len : out;
+}
+
+static const struct file_operations blocklist_ctrl_fops = {
+    .owner = THIS_MODULE,
+    .open = blocklist_ctrl_open,
+    .read = seq_read,
+    .write = blocklist_ctrl_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void register_blocklist_ctrl(void)
+{
+    struct dentry *dir = get_rp_debugfs_dir();
+    if (!dir)
+        return;
+
+    blocklist_ctrl_file = debugfs_create_file(BLOCKLIST_CTRL_FILE, 0600, dir, NULL, &blocklist_ctrl_fops);
+    if (IS_ERR_OR_NULL(blocklist_ctrl_file)) {
+        pr_loc_wrn("Failed to create debugfs file %s - runtime control will not be available", BLOCKLIST_CTRL_FILE);
+        blocklist_ctrl_file = NULL;
+        put_rp_debugfs_dir();
+    }
+}
+
+static void unregister_blocklist_ctrl(void)
+{
+    if (!blocklist_ctrl_file)
+        return;
+
+    debugfs_remove(blocklist_ctrl_file);
+    blocklist_ctrl_file = NULL;
+    put_rp_debugfs_dir();
+}
+#else
+static inline void register_blocklist_ctrl(void) { }
+static inline void unregister_blocklist_ctrl(void) { }
+#endif //RP_DEBUGFS_ENABLED
+
+/**
+ * Hands over the (already copied) filename to the real execve() implementation
+ *
+ * Depending on the version of the kernel do_execve() accepts bare filename (old) or the full struct filename (newer)
+ * Additionally in older kernels we need to take care of the path lifetime and put it back (it's automatic in newer)
+ * See: https://github.com/torvalds/linux/commit/c4ad8f98bef77c7356aa6a9ad9188a6acc6b849d
+ */
+static __always_inline int do_execve_path(struct filename *path, const char __user *const __user *argv,
+                                          const char __user *const __user *envp)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+    int out = _do_execve(path->name, argv, envp);
+    _putname(path);
+    return out;
+#else
+    return _do_execve(path, argv, envp);
+#endif
+}
+
+/**
+ * Writes canned stdout of a blocked binary to the stdout of the current process (if it has any)
+ */
+static void write_canned_stdout(const char *data, size_t len)
+{
+    struct file *out = fget(CANNED_STDOUT_FD);
+    if (!out)
+        return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+    loff_t pos = out->f_pos;
+    kernel_write(out, data, len, &pos);
+#else
+    kernel_write(out, data, len, out->f_pos);
+#endif
+    fput(out);
+}
+
+/**
+ * Finishes a blocked execve() call as if the binary ran & finished instantly; this function does NOT return
+ */
+static void __noreturn finish_blocked_execve(struct execve_result *result)
+{
+    if (result->stdout_data) {
+        write_canned_stdout(result->stdout_data, result->stdout_len);
+        kfree(result->stdout_data);
+    }
+
+    //We cannot just return 0 here - execve() *does NOT* return on success, but replaces the current process ctx.
+    // Exiting with the canned code is what the parent would see if the binary ran & finished instantly.
+    do_exit((result->exit_code & 0xff) << 8);
+}
+
 SYSCALL_SHIM_DEFINE3(execve,
                      const char __user *, filename,
                      const char __user *const __user *, argv,
                      const char __user *const __user *, envp)
 {
+    hook_stats_begin(hs_start);
+
+    //getname() cannot be skipped: do_execve() needs a kernel copy of the name either way (and consumes it on newer
+    // kernels), so peeking at the user string first would only add a second copy. What we can do is to make sure that
+    // the copy is the *only* thing done for names which cannot match (see is_execve_blocked() prefilter).
     struct filename *path = _getname(filename);
 
     //this is essentially what do_execve() (or SYSCALL_DEFINE3 on older kernels) will do if the getname ptr is invalid
     if (IS_ERR(path))
         return PTR_ERR(path);
 
-    const char *pathname = path->name;
 #ifdef RPDBG_EXECVE
-    RPDBG_print_execve_call(pathname, argv);
+    RPDBG_trace_execve_call(path->name, argv);
 #endif
 
-    for (int i = 0; i < MAX_INTERCEPTED_FILES; i++) {
-        if (!intercepted_filenames[i])
-            break;
-
-        if (unlikely(strcmp(pathname, intercepted_filenames[i]) == 0)) {
-            pr_loc_inf("Blocked %s from running", pathname);
-            //We cannot just return 0 here - execve() *does NOT* return on success, but replaces the current process ctx
-            do_exit(0);
-        }
+    struct execve_result result;
+    bool blocked = is_execve_blocked(path->name, argv, &result);
+    rp_trace(execve, path->name, blocked, blocked ? result.exit_code : 0);
+    if (unlikely(blocked)) {
+        pr_loc_inf("Blocked %s from running (exit code %d)", path->name, result.exit_code);
+        hook_stats_end(HOOK_STATS_EXECVE, hs_start);
+        finish_blocked_execve(&result);
     }
 
-//Depending on the version of the kernel do_execve() accepts bare filename (old) or the full struct filename (newer)
-//Additionally in older kernels we need to take care of the path lifetime and put it back (it's automatic in newer)
-//See: https://github.com/torvalds/linux/commit/c4ad8f98bef77c7356aa6a9ad9188a6acc6b849d
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
-    int out = _do_execve(pathname, argv, envp);
-    _putname(path);
+    hook_stats_end(HOOK_STATS_EXECVE, hs_start);
+    if (likely(!ACCESS_ONCE(blocked_inodes_num)))
+        return do_execve_path(path, argv, envp);
+
+    //If the first identity rule is added only after the check above, a call blocked by it has no waiter & just fails
+    struct execve_waiter waiter;
+    add_execve_waiter(&waiter);
+    int out = do_execve_path(path, argv, envp);
+    remove_execve_waiter(&waiter);
+    if (unlikely(waiter.blocked)) //blocked by the identity in execve_blocker_load_binary()
+        finish_blocked_execve(&waiter.result);
+
     return out;
-#else
-    return _do_execve(path, argv, envp);
-#endif
 }
 
 static override_symbol_inst *sys_execve_ovs = NULL;
@@ -108,6 +1269,16 @@ int register_execve_interceptor()
     }
 
     override_symbol_or_exit_int(sys_execve_ovs, "SyS_execve", SyS_execve_shim);
+    insert_binfmt(&execve_blocker_fmt);
+    if (watch_mounts() != 0) {
+        pr_loc_wrn("Cannot watch mount changes via %s - rules will be re-resolved every %dms until it's possible",
+                   MOUNTS_WATCH_FILE, BLOCKED_REVALIDATE_MS);
+        queue_delayed_work(housekeeping_wq(system_wq), &rewatch_work, msecs_to_jiffies(BLOCKED_REVALIDATE_MS));
+    }
+    register_blocklist_ctrl();
+#ifdef RPDBG_EXECVE
+    RPDBG_register_execve_trace();
+#endif
 
     pr_loc_inf("execve() interceptor registered");
     return 0;
@@ -126,14 +1297,16 @@ int unregister_execve_interceptor()
     if (out != 0)
         return out;
     sys_execve_ovs = NULL;
+    unregister_binfmt(&execve_blocker_fmt);
 
-    //Free all strings duplicated in add_blocked_execve_filename()
-    unsigned int idx = 0;
-    while (idx < MAX_INTERCEPTED_FILES-1 && intercepted_filenames[idx]) {
-        kfree(intercepted_filenames[idx]);
-        intercepted_filenames[idx] = NULL;
-        idx++;
-    }
+    unregister_blocklist_ctrl();
+#ifdef RPDBG_EXECVE
+    RPDBG_unregister_execve_trace();
+#endif
+    cancel_delayed_work_sync(&rewatch_work);
+    unwatch_mounts();
+    cancel_work_sync(&revalidate_work);
+    clear_blocked_execve_filenames(); //Free all entries created in add_blocked_execve_filename()
 
     pr_loc_inf("execve() interceptor unregistered");
     return 0;
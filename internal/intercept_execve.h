@@ -1,8 +1,77 @@
 #ifndef REDPILL_INTERCEPT_EXECVE_H
 #define REDPILL_INTERCEPT_EXECVE_H
 
-//There's no remove_ as this requires rearranging the list etc and is not needed for now
+/**
+ * Blocks execution of a given binary (matched as passed to execve() and by the identity of the file it resolves to)
+ *
+ * Can be called at any time, also while the interceptor is active.
+ *
+ * @return 0 on success, -EEXIST if already blocked, -E on other errors
+ */
 int add_blocked_execve_filename(const char * filename);
+
+/**
+ * Blocks execution of a given binary like add_blocked_execve_filename() but with a canned result
+ *
+ * Instead of running the binary the calling process writes stdout_data to its stdout and exits with exit_code, so
+ * that its parent gets an instant & deterministic answer.
+ *
+ * @param exit_code 0-255
+ * @param stdout_data canned stdout (up to a page) or NULL for none
+ *
+ * @return 0 on success, -EEXIST if already blocked, -E on other errors
+ */
+int add_substituted_execve_filename(const char *filename, int exit_code, const char *stdout_data);
+
+/**
+ * Reverses what add_blocked_execve_filename() or add_substituted_execve_filename() did (rules with argv patterns for
+ * the same filename are left intact)
+ *
+ * @return 0 on success, -ENOENT if not blocked
+ */
+int remove_blocked_execve_filename(const char * filename);
+
+#define EXECVE_RULE_MAX_ARGS 8 //max number of argv patterns in a single rule
+#define EXECVE_RULE_ARG_MAX 128 //max length of a single argv pattern (without the trailing "*")
+
+enum execve_rule_action {
+    EXECVE_RULE_BLOCK, //don't run the binary; exit with exit_code after writing stdout_data
+    EXECVE_RULE_ALLOW, //run the binary normally (e.g. to exempt some invocations of an otherwise blocked one)
+};
+
+/**
+ * Rule deciding about execve() calls of a binary depending on their args
+ *
+ * The filename is matched like in add_blocked_execve_filename(). Patterns are matched in order against argv[1],
+ * argv[2]... (any further args are ignored); each of them is either an exact string, a "prefix*" or "*" (any arg, but
+ * it has to be present). When many rules match a call the one with most patterns wins, then the one added first.
+ */
+struct execve_rule {
+    const char *filename;
+    const char *const *argv; //NULL-terminated list of patterns; NULL or empty matches any args
+    enum execve_rule_action action;
+    int exit_code; //EXECVE_RULE_BLOCK only: 0-255
+    const char *stdout_data; //EXECVE_RULE_BLOCK only: canned stdout (up to a page) or NULL for none
+};
+
+/**
+ * Adds a rule for execve() calls; see struct execve_rule
+ *
+ * Patterns are compiled when the rule is added - calls of binaries without any rule never look at their args, and args
+ * are copied only as far as the most specific rule for the binary needs.
+ *
+ * @return 0 on success, -EEXIST if a rule with the same filename & patterns exists, -E2BIG if patterns are too many
+ *         or too long, -E on other errors
+ */
+int add_execve_rule(const struct execve_rule *rule);
+
+/**
+ * Removes a rule added with add_execve_rule() (matched by the filename & patterns; the action is ignored)
+ *
+ * @return 0 on success, -ENOENT if there's no such rule
+ */
+int remove_execve_rule(const struct execve_rule *rule);
+
 int register_execve_interceptor(void);
 int unregister_execve_interceptor(void);
 
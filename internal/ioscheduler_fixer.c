@@ -5,13 +5,77 @@
  * remove the module file the system will constantly try to load now non-existing module "elevator-iosched". By
  * resetting the "chosen_elevator" using the same function called by "elevator=" handler we can pretend no custom
  * I/O scheduler was ever set (so that the system uses default one and stops complaining)
+ *
+ * PER-DISK PROFILES
+ * The default elevator & queue parameters are the same for all disks (and on these kernels the elevator is usually
+ * cfq). This is a poor choice for disks which aren't spinning rust: cfq idles waiting for more requests from the same
+ * process, which on virtual disks (where the hypervisor has its own scheduler) and SSDs roughly halves random IOPS. DSM
+ * tunes some of the queue parameters from the userspace, but too late (after the first mount) or not at all.
+ * Therefore, once a disk is probed, a tuning profile is chosen for it based on what it is (see disk_profiles[]):
+ *   - virtual disks (paravirtual HBA like VirtIO/PVSCSI/Hyper-V, or a well-known emulated model): noop - the host
+ *     reorders requests anyway, so doing that in the guest is pure overhead; large requests & deep queues
+ *   - SATA SSDs & HDDs: full NCQ depth; deadline & completions on the submitting CPU for SSDs, default elevator & a
+ *     large read-ahead for HDDs (NAS workloads are mostly sequential)
+ *   - other non-rotational disks: deadline - no seek penalty to optimize for, but reads still shouldn't starve
+ *   - USB disks & everything else (e.g. SAS HDDs): left as they are
+ * Queue parameters are set through the same sysfs handlers the userspace would use (so they're validated & locked by
+ * the kernel itself); the queue depth is changed using the SCSI host driver directly.
  */
 #include "ioscheduler_fixer.h"
 #include "../common.h"
 #include "call_protected.h" //is_system_booting(), elevator_setup()
+#include "scsi/scsi_notifier.h" //subscribe_scsi_disk_events_async()
+#include "scsi/scsi_toolbox.h" //for_each_scsi_disk(), is_sata_disk(), scsi_store_queue_attr(), scsi_sd_probe_domain
 #include <linux/kernel.h> //system_state
+#include <linux/blkdev.h> //blk_queue_nonrot(), elevator_change(), queue_max_hw_sectors()
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION()
+#include <linux/async.h> //async_synchronize_full_domain()
+#include <scsi/scsi_device.h> //struct scsi_device
+#include <scsi/scsi_host.h> //struct Scsi_Host
 
 #define SHIM_NAME "I/O scheduler fixer"
+#define ELEVATOR_NOOP "noop"
+#define ELEVATOR_DEADLINE "deadline"
+
+enum disk_profile_id {
+    DISK_PROFILE_NONE = -1,
+    DISK_PROFILE_VIRTUAL = 0,
+    DISK_PROFILE_SATA_HDD,
+    DISK_PROFILE_SATA_SSD,
+    DISK_PROFILE_SSD,
+};
+
+/**
+ * Tuning applied to a disk; 0/NULL fields are left as they are
+ */
+struct disk_profile {
+    const char *name;
+    const char *elevator;
+    int queue_depth;
+    unsigned int max_sectors_kb; //capped by what the hardware supports
+    unsigned int read_ahead_kb;
+    unsigned int nr_requests;
+    unsigned int rq_affinity; //1: complete on the submitting CPU group, 2: on the submitting CPU itself
+};
+
+static const struct disk_profile disk_profiles[] = {
+    [DISK_PROFILE_VIRTUAL] = { .name = "virtual", .elevator = ELEVATOR_NOOP, .max_sectors_kb = 1024,
+                               .read_ahead_kb = 512, .nr_requests = 512, .rq_affinity = 2 },
+    [DISK_PROFILE_SATA_HDD] = { .name = "sata_hdd", .queue_depth = 31, .read_ahead_kb = 2048, .nr_requests = 256,
+                                .rq_affinity = 1 },
+    [DISK_PROFILE_SATA_SSD] = { .name = "sata_ssd", .elevator = ELEVATOR_DEADLINE, .queue_depth = 31,
+                                .read_ahead_kb = 256, .nr_requests = 256, .rq_affinity = 2 },
+    [DISK_PROFILE_SSD] = { .name = "ssd", .elevator = ELEVATOR_DEADLINE },
+};
+
+//SCSI host drivers (proc_name) of paravirtual HBAs
+static const char *const virtual_hosts[] = { "virtio_scsi", "vmw_pvscsi", "storvsc", "xen-scsifront" };
+//SCSI vendors of disks emulated by hypervisors (behind emulated AHCI/LSI/etc.)
+static const char *const virtual_vendors[] = { "QEMU", "VMware", "VBOX", "Msft" };
+//SCSI host drivers of USB disks; they're never tuned
+static const char *const usb_hosts[] = { "usb-storage", "uas" };
+
+static bool policy_registered = false;
 
 int reset_elevator(void)
 {
@@ -23,4 +87,137 @@ int reset_elevator(void)
 
     pr_loc_dbg("Resetting I/O scheduler to default");
     return _elevator_setup("") == 1 ? 0 : -EINVAL;
-}
\ No newline at end of file
+}
+
+static bool str_in_list(const char *str, const char *const *list, size_t num, bool prefix)
+{
+    for (size_t i = 0; i < num; ++i) {
+        if (prefix ? strncmp(str, list[i], strlen(list[i])) == 0 : strcmp(str, list[i]) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Picks a tuning profile for a disk according to the policy (see file header)
+ */
+static enum disk_profile_id choose_disk_profile(struct scsi_device *sdp)
+{
+    const char *host = sdp->host->hostt->proc_name ? sdp->host->hostt->proc_name : "";
+
+    if (str_in_list(host, usb_hosts, ARRAY_SIZE(usb_hosts), false))
+        return DISK_PROFILE_NONE;
+
+    //vendor is not NUL-terminated (it's a pointer into INQUIRY data), hence the prefix comparison
+    if (str_in_list(host, virtual_hosts, ARRAY_SIZE(virtual_hosts), false) ||
+        (sdp->vendor && str_in_list(sdp->vendor, virtual_vendors, ARRAY_SIZE(virtual_vendors), true)))
+        return DISK_PROFILE_VIRTUAL;
+
+    bool nonrot = blk_queue_nonrot(sdp->request_queue);
+    if (is_sata_disk(&sdp->sdev_gendev))
+        return nonrot ? DISK_PROFILE_SATA_SSD : DISK_PROFILE_SATA_HDD;
+
+    return nonrot ? DISK_PROFILE_SSD : DISK_PROFILE_NONE;
+}
+
+static void tune_queue_attr(struct scsi_device *sdp, const char *name, unsigned int value)
+{
+    if (!value)
+        return;
+
+    int out = scsi_store_queue_attr(sdp, name, value);
+    if (out != 0)
+        pr_loc_wrn("Failed to set %s of SCSI disk %s to %u - error=%d", name, dev_name(&sdp->sdev_gendev), value, out);
+}
+
+static void tune_queue_depth(struct scsi_device *sdp, int depth)
+{
+    struct scsi_host_template *hostt = sdp->host->hostt;
+    if (!depth || !hostt->change_queue_depth || depth == sdp->queue_depth)
+        return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+    int out = hostt->change_queue_depth(sdp, depth);
+#else
+    int out = hostt->change_queue_depth(sdp, depth, SCSI_QDEPTH_DEFAULT);
+#endif
+    if (out < 0)
+        pr_loc_wrn("Failed to set queue depth of SCSI disk %s to %d - error=%d", dev_name(&sdp->sdev_gendev), depth,
+                   out);
+}
+
+static int apply_disk_profile(struct scsi_device *sdp)
+{
+    enum disk_profile_id id = choose_disk_profile(sdp);
+    if (id == DISK_PROFILE_NONE) {
+        pr_loc_dbg("Leaving SCSI disk %s untuned", dev_name(&sdp->sdev_gendev));
+        return 0;
+    }
+
+    const struct disk_profile *profile = &disk_profiles[id];
+    struct request_queue *q = sdp->request_queue;
+    if (profile->elevator) {
+        int out = elevator_change(q, profile->elevator);
+        if (out != 0) //e.g. blk-mq queues have no elevator on these kernels; the default one still works
+            pr_loc_wrn("Failed to set I/O scheduler of SCSI disk %s to %s - error=%d", dev_name(&sdp->sdev_gendev),
+                       profile->elevator, out);
+    }
+
+    tune_queue_depth(sdp, profile->queue_depth);
+    tune_queue_attr(sdp, "max_sectors_kb", min(profile->max_sectors_kb, queue_max_hw_sectors(q) >> 1));
+    tune_queue_attr(sdp, "read_ahead_kb", profile->read_ahead_kb);
+    tune_queue_attr(sdp, "nr_requests", profile->nr_requests);
+    tune_queue_attr(sdp, "rq_affinity", profile->rq_affinity);
+
+    pr_loc_inf("SCSI disk %s tuned with \"%s\" profile", dev_name(&sdp->sdev_gendev), profile->name);
+    return 0;
+}
+
+static int on_scsi_disk_probed(struct notifier_block *self, unsigned long state, void *data)
+{
+    if (state != SCSI_EVT_DEV_PROBED_OK)
+        return NOTIFY_DONE;
+
+    //sd_probe() only schedules the revalidation (which reads the rotational flag) - it has to finish first. This runs
+    // asynchronously, so waiting here doesn't delay any probe.
+    async_synchronize_full_domain(&scsi_sd_probe_domain);
+    apply_disk_profile(data);
+
+    return NOTIFY_OK;
+}
+
+static struct notifier_block scsi_disk_probed_nb = {
+    .notifier_call = on_scsi_disk_probed,
+};
+
+int register_ioscheduler_policy(void)
+{
+    if (policy_registered) {
+        pr_loc_bug("I/O scheduler policy is already registered");
+        return -EALREADY;
+    }
+
+    int out = subscribe_scsi_disk_events_async(&scsi_disk_probed_nb);
+    if (out != 0) {
+        pr_loc_wrn("Failed to register for async SCSI disks notifications - error=%d", out);
+        return 0; //disks will simply use the default elevator
+    }
+
+    if ((out = for_each_scsi_disk(apply_disk_profile)) != 0 && out != -ENXIO)
+        pr_loc_wrn("Failed to enumerate current SCSI disks - error=%d", out);
+
+    policy_registered = true;
+    pr_loc_dbg("I/O scheduler policy registered");
+    return 0;
+}
+
+int unregister_ioscheduler_policy(void)
+{
+    if (!policy_registered)
+        return 0; //its registration failure isn't fatal so this isn't a bug either
+
+    unsubscribe_scsi_disk_events_async(&scsi_disk_probed_nb);
+    policy_registered = false;
+    return 0;
+}
@@ -3,4 +3,15 @@
 
 int reset_elevator(void);
 
+/**
+ * Starts tuning (I/O scheduler & queue parameters) of every disk probed (and already present) based on its type
+ *
+ * See the file header of ioscheduler_fixer.c for the profiles. Disks already tuned are left as they are when this is
+ * unregistered.
+ *
+ * @return 0 on success (failing to subscribe for disks isn't fatal), -E on error
+ */
+int register_ioscheduler_policy(void);
+int unregister_ioscheduler_policy(void);
+
 #endif //REDPILL_IOSCHEDULER_FIXER_H
@@ -15,6 +15,8 @@
  * 5. Generate jump code ASM containing the address of new symbol specified by the caller
  * 6. Mark the memory page from [4] r/o again
  * 7. [optional] Process is fully reversible
+ * Steps 2, 4 & 6 are nowadays done by clearing CR0.WP on the local CPU for the duration of the memcpy (see
+ * WITH_MEM_WRITE_WINDOW()) - this avoids touching PTEs and thus any TLB invalidation (which IPIs all CPUs).
  *
  * SYSCALL SPECIAL CASE
  * There's also a variant made for syscalls specifically. It differs by the fact that override_symbol() makes
@@ -79,6 +81,49 @@
  * implementation. The kernel uses breakpoints for more safety and to detect possible interactions between different
  * subsystems utilizing breakpoints. This isn't our concern here.
  *
+ * DETOUR MODE
+ * For symbols which are overridden for the whole lifetime of the module and whose original is called constantly (e.g.
+ * driver_register()) the unpatch-call-repatch cycle above is still costly: two PTE flips, TLB flushes and a spinlock
+ * for every call, serializing all CPUs calling the function. The override_symbol_detour() goes the route described as
+ * "in theory" above for a limited (and checked) set of cases:
+ * 1. Decode instructions (using the kernel's insn decoder) from the start of the original until we cover at least the
+ *    size of the trampoline
+ * 2. Copy these instructions to an executable stub allocated with module_alloc() (so that it's within +-2GB of the
+ *    kernel & modules and every rel32 can be fixed up)
+ * 3. Fix-up rel32 CALL/JMP/Jcc and RIP-relative displacements to point to the same targets from the new place
+ * 4. Append an absolute JMP back to the first not-copied instruction of the original
+ * 5. Install the trampoline as usual
+ * Prologues with short (rel8) jumps, which cannot be fixed-up, are refused and such override falls back to the
+ * classic mode. The only remaining trap is a backward jump from the function body into the first few bytes - it's the
+ * caller's responsibility to choose symbols for which it's not a problem (it practically never is for a prologue).
+ * Calling the original is then just an indirect call to the stub: no locks, no text modifications and any number of
+ * CPUs can execute it at the same time. The flip side is that nothing tracks who's inside the stub, so it's freed only
+ * after an RCU-tasks (or, without preemption, RCU-sched) grace period - on preemptible kernels without RCU-tasks it's
+ * never freed (see put_overridden_symbol()).
+ *
+ * ATOMIC (SHORT) TRAMPOLINES
+ * The MOVQ+JMP trampoline is 12 bytes long and is written with a memcpy() - another CPU executing the prologue at the
+ * same time may see half of it, so every change is made under the OVS lock (which doesn't protect the other CPU
+ * anyway). When the new function is within +-2GB of the original (which is the case for module & kernel text) a 5 byte
+ * "JMP rel32" is used instead. If these 5 bytes don't cross an 8-byte boundary (functions are usually 16-byte aligned)
+ * the whole qword containing them is swapped with a single LOCK CMPXCHG: other CPUs see either the old or the new
+ * code, never a mix, and enabling/disabling needs no lock. The cmpxchg also detects someone else modifying these bytes
+ * in the meantime (-EBUSY). The kernel's text_poke_bp() doesn't exist in v3.10 (and isn't exported anyway), so it's
+ * not used.
+ *
+ * FTRACE MODE
+ * Kernels built with CONFIG_DYNAMIC_FTRACE_WITH_REGS (and -mfentry) have a patchable "CALL __fentry__" as the first
+ * instruction of every traceable function. The override_symbol_ftrace() doesn't write anything over the prologue but
+ * registers an ftrace_ops filtered to the symbol, whose handler rewrites the saved IP to the new function:
+ * 1. ftrace_set_filter_ip() + register_ftrace_function() - ftrace does the (SMP-safe) text patching of the call site
+ * 2. The handler sets regs->ip = new_sym_ptr while the override is enabled; the replacement then runs with the original
+ *    arguments and returns directly to the original caller
+ * 3. The original is called just past its call site (org_sym_ptr + MCOUNT_INSN_SIZE), so it doesn't hit the handler
+ *    again - like with a detour it's a plain indirect call
+ * Enabling/disabling such override only flips a flag checked by the handler. This mode coexists with other ftrace
+ * users and kprobes (which raw trampolines break). Syno kernels usually don't have it enabled - in such case, or if the
+ * symbol isn't traceable, the override falls back to the detour mode transparently.
+ *
  * References:
  *  - https://www.cs.uaf.edu/2016/fall/cs301/lecture/09_28_machinecode.html
  *  - http://www.watson.org/%7Erobert/2007woot/2007usenixwoot-exploitingconcurrency.pdf
@@ -89,9 +134,20 @@
 
 #include "override_symbol.h"
 #include "../../common.h"
-#include "../helper/memory_helper.h" //set_mem_addr_ro(), set_mem_addr_rw()
-#include <linux/kallsyms.h> //kallsyms_lookup_name()
+#include "../helper/memory_helper.h" //WITH_MEM_WRITE_WINDOW()
+#include "../helper/debug_keys.h" //pr_loc_dbg_on()
+#include "../rp_trace.h" //rp_trace()
+#include "../call_protected.h" //_insn_init(), _insn_get_length(), _module_alloc(), lookup_protected_symbol()
 #include <linux/string.h> //memcpy()
+#include <linux/vmalloc.h> //vfree()
+#include <linux/rcupdate.h> //synchronize_sched(), synchronize_rcu_tasks()
+#include <linux/atomic.h> //cmpxchg64()
+#include <asm/insn.h> //struct insn, X86_MODRM_MOD(), X86_MODRM_RM(), insn_offset_*()
+
+#if defined(CONFIG_DYNAMIC_FTRACE_WITH_REGS) && defined(CC_USING_FENTRY) //see "FTRACE MODE" above
+#define OVS_FTRACE_SUPPORTED
+#include <linux/ftrace.h> //struct ftrace_ops, register_ftrace_function(), ftrace_set_filter_ip(), MCOUNT_INSN_SIZE
+#endif
 
 #define JUMP_ADDR_POS 2 //JUMP starts at [2] in the jump template below
 #define OVERRIDE_JUMP_SIZE 1 + 1 + 8 + 1 + 1 //MOVQ + %rax + $vaddr + JMP + *%rax
@@ -100,13 +156,26 @@ static const unsigned char jump_tpl[OVERRIDE_JUMP_SIZE] =
     "\xff\xe0" /* JMP *%rax */
 ;
 
+#define SHORT_JUMP_SIZE 1 + 4 //JMP rel32
+#define SHORT_JUMP_OPCODE 0xe9
+
+#define DETOUR_MAX_INSN_SIZE 16 //MAX_INSN_SIZE is 16 in the decoder (architecturally it's 15)
+#define DETOUR_JUMP_BACK_ADDR_POS 6 //JUMP starts at [6] in the jump back template below
+#define DETOUR_JUMP_BACK_SIZE 6 + 8 //JMP *0(%rip) + $vaddr
+#define DETOUR_STUB_SIZE (OVERRIDE_JUMP_SIZE - 1 + DETOUR_MAX_INSN_SIZE + DETOUR_JUMP_BACK_SIZE)
+static const unsigned char detour_jump_back_tpl[DETOUR_JUMP_BACK_SIZE] =
+    "\xff\x25\x00\x00\x00\x00" /* JMP *0(%rip) - doesn't clobber any registers */
+    "\x00\x00\x00\x00\x00\x00\x00\x00" /* 64-bit-vaddr */
+;
+
 #define WITH_OVS_LOCK(__sym, code)                                                               \
     do {                                                                                         \
-        pr_loc_dbg("Obtaining lock for <%pF/%p>", (__sym)->org_sym_ptr, (__sym)->org_sym_ptr);   \
+        pr_loc_dbg_on(OVS_LOCK, "Obtaining lock for <%pF/%p>", (__sym)->org_sym_ptr,              \
+                      (__sym)->org_sym_ptr);                                                     \
         spin_lock_irqsave(&(__sym)->lock, (__sym)->lock_irq);                                    \
         ({code});                                                                                \
         spin_unlock_irqrestore(&(__sym)->lock, (__sym)->lock_irq);                               \
-        pr_loc_dbg("Released lock for <%p>", (__sym)->org_sym_ptr);                              \
+        pr_loc_dbg_on(OVS_LOCK, "Released lock for <%p>", (__sym)->org_sym_ptr);                 \
     } while(0)
 
 struct override_symbol_inst {
@@ -116,33 +185,56 @@ struct override_symbol_inst {
     char trampoline[OVERRIDE_JUMP_SIZE];
     spinlock_t lock;
     unsigned long lock_irq;
-    bool installed:1; //whether the symbol is currently overrode (=has trampoline installed)
+    bool installed; //whether the symbol is currently overrode (=has trampoline installed); accessed without the lock
     bool has_trampoline:1; //does this structure contain a valid trampoline code already?
-    bool mem_protected:1; //is the trampoline installation site memory-protected?
+    bool atomic:1; //trampoline is a JMP rel32 within a single qword, swapped with cmpxchg (see ATOMIC TRAMPOLINES)
+    u8 jump_size; //number of bytes of the original overwritten by the trampoline
+    u64 org_qword; //[atomic only] the original qword containing the first jump_size bytes
+    u64 tramp_qword; //[atomic only] org_qword with the trampoline pasted in
+    bool ftrace:1; //override is done by the ftrace handler (no trampoline is ever written)
+    void *detour; //stub with relocated prologue of the original or the original past its ftrace call site (ftrace
+                  // mode); NULL if classic mode is used
+#ifdef OVS_FTRACE_SUPPORTED
+    struct ftrace_ops fops;
+#endif
     char name[];
 };
 
-/**
- * Wrapper for set_mem_addr_rw() which works with symbols
- */
-static void __always_inline set_symbol_rw(struct override_symbol_inst *sym)
-{
-    set_mem_addr_rw((unsigned long)sym->org_sym_ptr, OVERRIDE_JUMP_SIZE);
-    sym->mem_protected = false;
-}
-
-/**
- * Wrapper for set_mem_addr_ro() which works with symbols
- */
-static void __always_inline set_symbol_ro(struct override_symbol_inst *sym)
-{
-    set_mem_addr_ro((unsigned long)sym->org_sym_ptr, OVERRIDE_JUMP_SIZE);
-    sym->mem_protected = true;
-}
+//How the override is done & how the original is called (see the top of the file)
+enum ovs_mode {
+    OVS_MODE_CLASSIC,
+    OVS_MODE_DETOUR,
+    OVS_MODE_FTRACE,
+};
 
 void put_overridden_symbol(struct override_symbol_inst *sym)
 {
     pr_loc_dbg("Freeing OVS for %s", sym->name);
+
+#ifdef OVS_FTRACE_SUPPORTED
+    if (sym->ftrace) {
+        unregister_ftrace_function(&sym->fops); //it waits for handlers running on other CPUs
+        ftrace_set_filter_ip(&sym->fops, (unsigned long)sym->org_sym_ptr, 1, 0);
+        sym->detour = NULL; //it points into the original - there's nothing to free
+    }
+#endif
+
+    if (sym->detour) {
+        //Some task may still be executing the stub (it's called without any locks) - wait for all of them to leave it
+#if defined(CONFIG_TASKS_RCU)
+        //On preemptible kernels a task can be preempted inside the stub; RCU-tasks waits for a voluntary context switch
+        // of every task, which cannot happen inside the stub
+        synchronize_rcu_tasks();
+        vfree(sym->detour);
+#elif defined(CONFIG_PREEMPT)
+        //A task preempted inside the stub may resume at any time & there's no way to wait for it - the stub must stay
+        pr_loc_dbg("Leaking detour stub of %s() at %p (preemptible kernel without RCU-tasks)", sym->name, sym->detour);
+#else
+        synchronize_sched(); //without preemption a task can leave the stub only by running to its end
+        vfree(sym->detour);
+#endif
+    }
+
     kfree(sym);
 }
 
@@ -160,10 +252,13 @@ static struct override_symbol_inst* get_ov_symbol_instance(const char *symbol_na
     spin_lock_init(&sym->lock);
     sym->installed = false;
     sym->has_trampoline = false;
-    sym->mem_protected = true;
+    sym->atomic = false;
+    sym->jump_size = OVERRIDE_JUMP_SIZE;
+    sym->ftrace = false;
+    sym->detour = NULL;
     strcpy(sym->name, symbol_name);
 
-    sym->org_sym_ptr = (void *)kallsyms_lookup_name(sym->name);
+    sym->org_sym_ptr = (void *)lookup_protected_symbol(sym->name);
     if (unlikely(sym->org_sym_ptr == 0)) { //header file: "Lookup the address for a symbol. Returns 0 if not found."
         pr_loc_err("Failed to locate vaddr for %s()", sym->name);
         put_overridden_symbol(sym);
@@ -174,6 +269,36 @@ static struct override_symbol_inst* get_ov_symbol_instance(const char *symbol_na
     return sym;
 }
 
+/**
+ * Generates atomic JMP rel32 trampoline if the new symbol is reachable and the jump fits in a single aligned qword
+ *
+ * @return true if generated, false if the long trampoline must be used
+ */
+static bool prepare_atomic_trampoline(struct override_symbol_inst *sym)
+{
+    unsigned long org = (unsigned long)sym->org_sym_ptr;
+    long rel = (long)sym->new_sym_ptr - (long)(org + SHORT_JUMP_SIZE);
+    unsigned int qword_pos = org & (sizeof(u64) - 1);
+
+    if (rel != (s32)rel || qword_pos + SHORT_JUMP_SIZE > sizeof(u64))
+        return false;
+
+    sym->trampoline[0] = SHORT_JUMP_OPCODE;
+    *(s32 *)&sym->trampoline[1] = (s32)rel;
+    memcpy(sym->org_sym_code, sym->org_sym_ptr, SHORT_JUMP_SIZE);
+
+    sym->org_qword = ACCESS_ONCE(*(u64 *)(org - qword_pos));
+    sym->tramp_qword = sym->org_qword;
+    memcpy((u8 *)&sym->tramp_qword + qword_pos, sym->trampoline, SHORT_JUMP_SIZE);
+
+    sym->atomic = true;
+    sym->jump_size = SHORT_JUMP_SIZE;
+    pr_loc_dbg("Generated atomic trampoline to %pF<%p> for %s<%p>", sym->new_sym_ptr, sym->new_sym_ptr, sym->name,
+               sym->org_sym_ptr);
+
+    return true;
+}
+
 /**
  * Generates trampoline code to jump from old symbol to the new symbol location and saves the original code
  */
@@ -181,6 +306,11 @@ static inline void prepare_trampoline(struct override_symbol_inst *sym)
 {
     pr_loc_dbg("Generating trampoline");
 
+    if (prepare_atomic_trampoline(sym)) {
+        sym->has_trampoline = true;
+        return;
+    }
+
     //First generate jump/trampoline to new_sym_ptr
     memcpy(sym->trampoline, jump_tpl, OVERRIDE_JUMP_SIZE); //copy "empty" trampoline
     *(long *)&sym->trampoline[JUMP_ADDR_POS] = (long)sym->new_sym_ptr; //paste new addr into trampoline
@@ -192,7 +322,208 @@ static inline void prepare_trampoline(struct override_symbol_inst *sym)
 }
 
 /**
- * Enables (previously disabled) symbol override, disabling memory barriers if needed & leaving them disabled upon exit
+ * Checks if a decoded instruction uses a relative operand which cannot be fixed-up when moved (rel8 jumps & loops)
+ */
+static inline bool insn_is_short_rel_jump(struct insn *insn)
+{
+    unsigned char op = insn->opcode.bytes[0];
+
+    return op == 0xeb /* JMP rel8 */ || (op >= 0x70 && op <= 0x7f) /* Jcc rel8 */ ||
+           (op >= 0xe0 && op <= 0xe3) /* LOOP*, JCXZ rel8 */;
+}
+
+/**
+ * Checks if a decoded instruction has a rel32 immediate (CALL, JMP, Jcc)
+ */
+static inline bool insn_is_rel32_branch(struct insn *insn)
+{
+    unsigned char op = insn->opcode.bytes[0];
+
+    return op == 0xe8 /* CALL rel32 */ || op == 0xe9 /* JMP rel32 */ ||
+           (op == 0x0f && (insn->opcode.bytes[1] & 0xf0) == 0x80) /* Jcc rel32 */;
+}
+
+/**
+ * Checks if a decoded instruction uses RIP-relative addressing in its ModRM
+ */
+static inline bool insn_is_rip_relative(struct insn *insn)
+{
+    return insn->modrm.nbytes && X86_MODRM_MOD(insn->modrm.value) == 0 && X86_MODRM_RM(insn->modrm.value) == 5;
+}
+
+/**
+ * Rewrites a 32-bit relative field of an instruction copied from org_insn to new_insn so it points to the same target
+ *
+ * @return 0 on success, -ERANGE if the new place is too far away to reach the target
+ */
+static int fixup_rel32(unsigned char *new_insn, const unsigned char *org_insn, unsigned int len, unsigned int offset)
+{
+    s32 org_rel = *(s32 *)(org_insn + offset);
+    long target = (long)(org_insn + len) + org_rel;
+    long new_rel = target - (long)(new_insn + len);
+
+    if (unlikely(new_rel != (s32)new_rel)) {
+        pr_loc_err("Relative target %p is out of reach from detour at %p", (void *)target, new_insn);
+        return -ERANGE;
+    }
+
+    *(s32 *)(new_insn + offset) = (s32)new_rel;
+    return 0;
+}
+
+/**
+ * Copies (and relocates) instructions of the original function which will be overwritten by the trampoline into stub
+ *
+ * @return number of bytes copied (>=min_len) on success, -E on error
+ */
+static int relocate_prologue(const unsigned char *org, unsigned char *stub, unsigned int min_len)
+{
+    struct insn insn;
+    int pos = 0;
+    int out;
+
+    while (pos < min_len) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+        _insn_init(&insn, org + pos, 1);
+#else
+        _insn_init(&insn, org + pos, DETOUR_MAX_INSN_SIZE, 1);
+#endif
+        _insn_get_length(&insn);
+
+        if (unlikely(!insn.length || insn.length > DETOUR_MAX_INSN_SIZE)) {
+            pr_loc_err("Failed to decode instruction at %p", org + pos);
+            return -EILSEQ;
+        }
+
+        if (insn_is_short_rel_jump(&insn)) {
+            pr_loc_dbg("Instruction at %p is a short relative jump - it cannot be relocated", org + pos);
+            return -EOPNOTSUPP;
+        }
+
+        memcpy(stub + pos, org + pos, insn.length);
+
+        if (insn_is_rel32_branch(&insn))
+            out = fixup_rel32(stub + pos, org + pos, insn.length, insn_offset_immediate(&insn));
+        else if (insn_is_rip_relative(&insn))
+            out = fixup_rel32(stub + pos, org + pos, insn.length, insn_offset_displacement(&insn));
+        else
+            out = 0;
+
+        if (unlikely(out != 0))
+            return out;
+
+        pos += insn.length;
+    }
+
+    return pos;
+}
+
+/**
+ * Builds executable detour stub which can be called in place of the original symbol after trampoline is installed
+ *
+ * This MUST be called after the trampoline is generated (its size is needed) but before it is written as it reads the
+ * original code.
+ *
+ * @return 0 on success, -E on error (the sym is left without a detour then)
+ */
+static int prepare_detour(struct override_symbol_inst *sym)
+{
+    unsigned char *stub = _module_alloc(DETOUR_STUB_SIZE);
+    if (unlikely(!stub)) {
+        pr_loc_err("Failed to allocate executable memory for %s() detour", sym->name);
+        return -ENOMEM;
+    }
+
+    int len = relocate_prologue(sym->org_sym_ptr, stub, sym->jump_size);
+    if (unlikely(len < 0)) {
+        vfree(stub);
+        return len;
+    }
+
+    memcpy(stub + len, detour_jump_back_tpl, DETOUR_JUMP_BACK_SIZE);
+    *(long *)&stub[len + DETOUR_JUMP_BACK_ADDR_POS] = (long)sym->org_sym_ptr + len;
+    sym->detour = stub;
+
+    pr_loc_dbg("Generated detour for %s<%p> at %p (relocated %d bytes)", sym->name, sym->org_sym_ptr, stub, len);
+    return 0;
+}
+
+#ifdef OVS_FTRACE_SUPPORTED
+/**
+ * ftrace handler redirecting calls of the original symbol to the new one (see "FTRACE MODE" above)
+ */
+static void notrace ftrace_redirect(unsigned long ip, unsigned long parent_ip, struct ftrace_ops *ops,
+                                    struct pt_regs *regs)
+{
+    struct override_symbol_inst *sym = container_of(ops, struct override_symbol_inst, fops);
+
+    if (likely(ACCESS_ONCE(sym->installed)))
+        regs->ip = (unsigned long)sym->new_sym_ptr;
+}
+#endif
+
+/**
+ * Registers ftrace handler for the original symbol; the override stays disabled until __enable_symbol_override()
+ *
+ * @return 0 on success, -E on error (the sym is left in non-ftrace mode then)
+ */
+static int prepare_ftrace(struct override_symbol_inst *sym)
+{
+#ifdef OVS_FTRACE_SUPPORTED
+    int out;
+    memset(&sym->fops, 0, sizeof(sym->fops));
+    sym->fops.func = ftrace_redirect;
+    sym->fops.flags = FTRACE_OPS_FL_SAVE_REGS;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+    sym->fops.flags |= FTRACE_OPS_FL_IPMODIFY; //only one IP-modifying user per function is allowed
+#endif
+
+    if ((out = ftrace_set_filter_ip(&sym->fops, (unsigned long)sym->org_sym_ptr, 0, 0)) != 0) {
+        pr_loc_dbg("%s<%p> is not traceable - error=%d", sym->name, sym->org_sym_ptr, out);
+        return out;
+    }
+
+    if ((out = register_ftrace_function(&sym->fops)) != 0) {
+        pr_loc_err("Failed to register ftrace handler for %s() - error=%d", sym->name, out);
+        ftrace_set_filter_ip(&sym->fops, (unsigned long)sym->org_sym_ptr, 1, 0);
+        return out;
+    }
+
+    sym->ftrace = true;
+    sym->detour = (char *)sym->org_sym_ptr + MCOUNT_INSN_SIZE;
+    pr_loc_dbg("Registered ftrace handler for %s<%p>", sym->name, sym->org_sym_ptr);
+
+    return 0;
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
+/**
+ * Swaps the original & the atomic trampoline qwords (see ATOMIC TRAMPOLINES above)
+ *
+ * @return 0 on success, -EBUSY if the code was modified by someone else
+ */
+static int swap_atomic_trampoline(struct override_symbol_inst *sym, bool install)
+{
+    u64 *qword = (u64 *)((unsigned long)sym->org_sym_ptr & ~(sizeof(u64) - 1));
+    u64 from = install ? sym->org_qword : sym->tramp_qword;
+    u64 to = install ? sym->tramp_qword : sym->org_qword;
+    u64 prev;
+
+    WITH_MEM_WRITE_WINDOW(prev = cmpxchg64(qword, from, to););
+    if (unlikely(prev != from && prev != to)) { //prev == to means another CPU did the same swap already
+        pr_loc_err("Code of %s<%p> was modified by someone else - refusing to %s the override", sym->name,
+                   sym->org_sym_ptr, install ? "enable" : "disable");
+        return -EBUSY;
+    }
+
+    ACCESS_ONCE(sym->installed) = install;
+    return 0;
+}
+
+/**
+ * Enables (previously disabled) symbol override
  *
  * Warning: this function is exported only to make universal call original macros working. You should NOT use it outside
  * of this submodule
@@ -201,21 +532,18 @@ static inline void prepare_trampoline(struct override_symbol_inst *sym)
  */
 int __enable_symbol_override(struct override_symbol_inst *sym)
 {
-    if (sym->mem_protected)
-        set_symbol_rw(sym);
+    if (sym->atomic)
+        return swap_atomic_trampoline(sym, true);
 
     WITH_OVS_LOCK(sym,
          if (likely(!sym->installed)) {
-            if (!sym->has_trampoline)
-                prepare_trampoline(sym);
+            if (!sym->ftrace) { //in ftrace mode the handler only checks the flag
+                if (!sym->has_trampoline)
+                    prepare_trampoline(sym);
 
-            //after we got the lock need to re-check the memory protection - this shouldn't be changed within spinlock
-            //since it generates a warning... but sometimes we have no choice
-            if (sym->mem_protected)
-                set_symbol_rw(sym);
-
-            pr_loc_dbg("Writing trampoline code to <%p>", sym->org_sym_ptr);
-            memcpy(sym->org_sym_ptr, sym->trampoline, OVERRIDE_JUMP_SIZE);
+                pr_loc_dbg("Writing trampoline code to <%p>", sym->org_sym_ptr);
+                WITH_MEM_WRITE_WINDOW(memcpy(sym->org_sym_ptr, sym->trampoline, sym->jump_size););
+            }
             sym->installed = true;
         }
     );
@@ -224,7 +552,7 @@ int __enable_symbol_override(struct override_symbol_inst *sym)
 }
 
 /**
- * Disables (previously enables) symbol override, disabling memory barriers if needed & leaving them disabled upon exit
+ * Disables (previously enables) symbol override
  *
  * Warning: this function is exported only to make universal call original macros working. You should NOT use it outside
  * of this submodule
@@ -233,18 +561,15 @@ int __enable_symbol_override(struct override_symbol_inst *sym)
  */
 int __disable_symbol_override(struct override_symbol_inst *sym)
 {
-    if (sym->mem_protected)
-        set_symbol_rw(sym);
+    if (sym->atomic)
+        return swap_atomic_trampoline(sym, false);
 
     WITH_OVS_LOCK(sym,
         if (likely(sym->installed)) {
-            //after we got the lock need to re-check the memory protection - this shouldn't be changed within spinlock
-            //since it generates a warning... but sometimes we have no choice
-            if (sym->mem_protected)
-                set_symbol_rw(sym);
-
-            pr_loc_dbg("Writing original code to <%p>", sym->org_sym_ptr);
-            memcpy(sym->org_sym_ptr, sym->org_sym_code, OVERRIDE_JUMP_SIZE);
+            if (!sym->ftrace) {
+                pr_loc_dbg("Writing original code to <%p>", sym->org_sym_ptr);
+                WITH_MEM_WRITE_WINDOW(memcpy(sym->org_sym_ptr, sym->org_sym_code, sym->jump_size););
+            }
             sym->installed = false;
         }
     );
@@ -252,21 +577,34 @@ int __disable_symbol_override(struct override_symbol_inst *sym)
     return 0;
 }
 
-struct override_symbol_inst* __must_check override_symbol(const char *name, const void *new_sym_ptr)
+/**
+ * Common part of override_symbol(), override_symbol_detour() and override_symbol_ftrace()
+ */
+static struct override_symbol_inst* __override_symbol(const char *name, const void *new_sym_ptr, enum ovs_mode mode)
 {
-    pr_loc_dbg("Overriding %s() with %pf()<%p>", name, new_sym_ptr, new_sym_ptr);
-
     int out;
     struct override_symbol_inst *sym = get_ov_symbol_instance(name, new_sym_ptr);
     if (unlikely(IS_ERR(sym)))
         return sym;
 
+    if (mode == OVS_MODE_FTRACE && (out = prepare_ftrace(sym)) != 0) {
+        pr_loc_wrn("Cannot use ftrace for %s() (error=%d) - falling back to detour", sym->name, out);
+        mode = OVS_MODE_DETOUR;
+    }
+
+    if (!sym->ftrace)
+        prepare_trampoline(sym); //the detour needs to know its size
+
+    if (mode == OVS_MODE_DETOUR && (out = prepare_detour(sym)) != 0)
+        pr_loc_wrn("Cannot use detour for %s() (error=%d) - falling back to classic override", sym->name, out);
+
     if ((out = __enable_symbol_override(sym)) != 0)
         goto error_out;
 
-    set_symbol_ro(sym); //by design standard override leaves the memory protected
-
-    pr_loc_dbg("Successfully overrode %s() with trampoline to %pF<%p>", sym->name, sym->new_sym_ptr, sym->new_sym_ptr);
+    pr_loc_dbg("Successfully overrode %s() with %s to %pF<%p>", sym->name, sym->ftrace ? "ftrace" : "trampoline",
+               sym->new_sym_ptr, sym->new_sym_ptr);
+    rp_trace(override_install, sym->name, sym->ftrace ? "ftrace" : (sym->detour ? "detour" : "trampoline"),
+             sym->org_sym_ptr, sym->new_sym_ptr);
     return sym;
 
     error_out:
@@ -274,21 +612,42 @@ struct override_symbol_inst* __must_check override_symbol(const char *name, cons
     return ERR_PTR(out);
 }
 
+struct override_symbol_inst* __must_check override_symbol(const char *name, const void *new_sym_ptr)
+{
+    pr_loc_dbg("Overriding %s() with %pf()<%p>", name, new_sym_ptr, new_sym_ptr);
+
+    return __override_symbol(name, new_sym_ptr, OVS_MODE_CLASSIC);
+}
+
+struct override_symbol_inst* __must_check override_symbol_detour(const char *name, const void *new_sym_ptr)
+{
+    pr_loc_dbg("Overriding %s() with %pf()<%p> using detour", name, new_sym_ptr, new_sym_ptr);
+
+    return __override_symbol(name, new_sym_ptr, OVS_MODE_DETOUR);
+}
+
+struct override_symbol_inst* __must_check override_symbol_ftrace(const char *name, const void *new_sym_ptr)
+{
+    pr_loc_dbg("Overriding %s() with %pf()<%p> using ftrace", name, new_sym_ptr, new_sym_ptr);
+
+    return __override_symbol(name, new_sym_ptr, OVS_MODE_FTRACE);
+}
+
 int restore_symbol(struct override_symbol_inst *sym)
 {
     pr_loc_dbg("Restoring %s<%p> to original code", sym->name, sym->org_sym_ptr);
 
-    int out;
-    if ((out = __disable_symbol_override(sym)) != 0)
-        goto out_free;
-
-    set_symbol_ro(sym); //by design restore leaves the memory protected
+    int out = __disable_symbol_override(sym);
+    rp_trace(override_restore, sym->name, sym->org_sym_ptr, out);
+    if (unlikely(out != 0)) {
+        //The trampoline to our code may still be installed, so call_overridden_symbol() can still use the stub
+        pr_loc_err("Failed to restore original code of %s - error %d (leaking its override)", sym->name, out);
+        return out;
+    }
 
     pr_loc_dbg("Successfully restored original code of %s", sym->name);
-
-    out_free:
     put_overridden_symbol(sym);
-    return out;
+    return 0;
 }
 
 /**
@@ -299,10 +658,19 @@ __always_inline void * __get_org_ptr(struct override_symbol_inst *sym)
     return sym->org_sym_ptr;
 }
 
+/**
+ * Returns pointer to the detour stub (or NULL if the override doesn't use detour). This is a function made to avoid
+ * exposing internals of the struct to header.
+ */
+__always_inline void * __get_detour_ptr(struct override_symbol_inst *sym)
+{
+    return sym->detour;
+}
+
 /**
  * Checks if override is enabled. This is a function made to avoid exposing internals of the struct to header.
  */
 __always_inline bool symbol_is_overridden(struct override_symbol_inst *sym)
 {
-    return likely(sym) && sym->installed;
+    return likely(sym) && ACCESS_ONCE(sym->installed);
 }
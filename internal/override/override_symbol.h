@@ -10,23 +10,33 @@ typedef struct override_symbol_inst override_symbol_inst;
 /**
  * Calls the original symbol, returning nothing, that was previously overridden
  *
+ * If the symbol was overridden using override_symbol_detour() the original is called directly through the relocated
+ * prologue stub (no text patching, no locking, safe to call from many CPUs at once). The same goes for
+ * override_symbol_ftrace() which calls the original past its ftrace call site. Otherwise the trampoline is temporarily
+ * removed for the duration of the call.
+ *
  * @param sym pointer to a override_symbol_inst
  * @param ... any arguments to the original function
  *
  * @return 0 if the execution succeeded, -E if it didn't
  */
 #define call_overridden_symbol_void(sym, ...) ({              \
-    int __ret;                                                \
-    bool __was_installed = symbol_is_overridden(sym);         \
+    int __ret = 0;                                            \
     _Pragma("GCC diagnostic push")                            \
     _Pragma("GCC diagnostic ignored \"-Wstrict-prototypes\"") \
+    void (*__detour)() = __get_detour_ptr(sym);               \
     void (*__ptr)() = __get_org_ptr(sym);                     \
     _Pragma("GCC diagnostic pop")                             \
-    __ret = __disable_symbol_override(sym);                   \
-    if (likely(__ret == 0)) {                                 \
-        __ptr(__VA_ARGS__);                                   \
-        if (likely(__was_installed)) {                        \
-        __ret = __enable_symbol_override(sym);                \
+    if (likely(__detour)) {                                   \
+        __detour(__VA_ARGS__);                                \
+    } else {                                                  \
+        bool __was_installed = symbol_is_overridden(sym);     \
+        __ret = __disable_symbol_override(sym);               \
+        if (likely(__ret == 0)) {                             \
+            __ptr(__VA_ARGS__);                               \
+            if (likely(__was_installed)) {                    \
+                __ret = __enable_symbol_override(sym);        \
+            }                                                 \
         }                                                     \
     }                                                         \
     __ret;                                                    \
@@ -35,6 +45,8 @@ typedef struct override_symbol_inst override_symbol_inst;
 /**
  * Calls the original symbol, returning a value, that was previously overridden
  *
+ * See call_overridden_symbol_void() for details regarding detour vs. classic overrides.
+ *
  * @param out_var name of the variable where original function return value should be placed
  * @param sym pointer to a override_symbol_inst
  * @param ... any arguments to the original function
@@ -42,17 +54,22 @@ typedef struct override_symbol_inst override_symbol_inst;
  * @return 0 if the execution succeeded, -E if it didn't
  */
 #define call_overridden_symbol(out_var, sym, ...) ({          \
-    int __ret;                                                \
-    bool __was_installed = symbol_is_overridden(sym);         \
+    int __ret = 0;                                            \
     _Pragma("GCC diagnostic push")                            \
     _Pragma("GCC diagnostic ignored \"-Wstrict-prototypes\"") \
+    typeof (out_var) (*__detour)() = __get_detour_ptr(sym);   \
     typeof (out_var) (*__ptr)() = __get_org_ptr(sym);         \
     _Pragma("GCC diagnostic pop")                             \
-    __ret = __disable_symbol_override(sym);                   \
-    if (likely(__ret == 0)) {                                 \
-        out_var = __ptr(__VA_ARGS__);                         \
-        if (likely(__was_installed)) {                        \
-            __ret = __enable_symbol_override(sym);            \
+    if (likely(__detour)) {                                   \
+        out_var = __detour(__VA_ARGS__);                      \
+    } else {                                                  \
+        bool __was_installed = symbol_is_overridden(sym);     \
+        __ret = __disable_symbol_override(sym);               \
+        if (likely(__ret == 0)) {                             \
+            out_var = __ptr(__VA_ARGS__);                     \
+            if (likely(__was_installed)) {                    \
+                __ret = __enable_symbol_override(sym);        \
+            }                                                 \
         }                                                     \
     }                                                         \
     __ret;                                                    \
@@ -96,10 +113,40 @@ typedef struct override_symbol_inst override_symbol_inst;
  */
 struct override_symbol_inst* __must_check override_symbol(const char *name, const void *new_sym_ptr);
 
+/**
+ * Overrides a kernel symbol like override_symbol() but also builds a detour stub to call the original
+ *
+ * The detour stub contains original instructions overwritten by the trampoline (relocated to work from a new place)
+ * followed by a jump back to the rest of the original function. This makes call_overridden_symbol() a simple indirect
+ * call instead of a full unpatch-call-repatch cycle. You should use it for symbols which are overridden for long and
+ * whose original is called often (e.g. driver_register()).
+ * If the prologue of the symbol cannot be safely relocated (e.g. it contains short relative jumps) the override falls
+ * back to the classic mode transparently - call_overridden_symbol() works in both cases.
+ *
+ * Warning: the detour doesn't protect against the original code jumping backwards into its own first bytes (see
+ * "CALLING THE ORIGINAL CODE PROBLEM" in the .c file). Use it only for functions you've looked at.
+ *
+ * @return Instance of override_symbol_inst struct pointer on success, ERR_PTR(-E) on error
+ */
+struct override_symbol_inst* __must_check override_symbol_detour(const char *name, const void *new_sym_ptr);
+
+/**
+ * Overrides a kernel symbol like override_symbol() but using ftrace instead of writing a trampoline over its prologue
+ *
+ * The ftrace handler redirects calls of the symbol to the new one and call_overridden_symbol() calls the original just
+ * past its ftrace call site. Nothing ever touches the text besides ftrace itself, so it's SMP-safe and doesn't conflict
+ * with other ftrace/kprobes users. It requires a kernel with CONFIG_DYNAMIC_FTRACE_WITH_REGS and a traceable symbol -
+ * otherwise the override falls back to override_symbol_detour() transparently.
+ *
+ * @return Instance of override_symbol_inst struct pointer on success, ERR_PTR(-E) on error
+ */
+struct override_symbol_inst* __must_check override_symbol_ftrace(const char *name, const void *new_sym_ptr);
+
 /**
  * Restores symbol overridden by override_symbol()
  *
- * For details see override_symbol() docblock
+ * For details see override_symbol() docblock. The instance is freed only on success; on failure our code may still be
+ * reachable through it, so it's deliberately leaked (and must not be used nor freed by the caller anymore).
  *
  * @return 0 on success, -E on error
  */
@@ -129,5 +176,6 @@ bool symbol_is_overridden(struct override_symbol_inst *sym);
 int __enable_symbol_override(override_symbol_inst *sym);
 int __disable_symbol_override(override_symbol_inst *sym);
 void * __get_org_ptr(struct override_symbol_inst *sym);
+void * __get_detour_ptr(struct override_symbol_inst *sym);
 
 #endif //REDPILLLKM_OVERRIDE_KFUNC_H
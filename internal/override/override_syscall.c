@@ -1,6 +1,9 @@
 #include "override_syscall.h"
 #include "../../common.h"
-#include "../helper/memory_helper.h" //set_mem_addr_ro(), set_mem_addr_rw()
+#include "../helper/memory_helper.h" //WITH_MEM_WRITE_WINDOW()
+#include "../call_protected.h" //lookup_protected_symbol()
+#include <linux/vmalloc.h> //vmap(), vunmap()
+#include <linux/mm.h> //virt_to_page()
 #include <asm/asm-offsets.h> //__NR_syscall_max & NR_syscalls
 #include <asm/unistd.h> //syscalls numbers (e.g. __NR_read)
 
@@ -23,9 +26,39 @@ static void print_syscall_table(unsigned int from, unsigned to)
     }
 }
 
+//The table lives in .rodata, i.e. above the .text where syscall handlers are. Sizes of both are usually in the range of
+// 10-20MB so if we cannot get the end of .rodata we give up after that many bytes instead of scanning until we fault.
+#define SYSCALL_TABLE_MAX_SCAN (64 * 1024 * 1024)
+
+/**
+ * Determines the end (exclusive) of the memory range which may contain sys_call_table
+ */
+static unsigned long get_sys_call_table_search_end(unsigned long start)
+{
+    unsigned long end = lookup_protected_symbol("__end_rodata");
+    if (end > start) {
+        pr_loc_dbg("sys_call_table search will be bound by __end_rodata @ %p", (void *)end);
+        return end;
+    }
+
+    end = lookup_protected_symbol("_edata");
+    if (end > start) {
+        pr_loc_dbg("sys_call_table search will be bound by _edata @ %p", (void *)end);
+        return end;
+    }
+
+    pr_loc_wrn("Failed to find end of kernel .rodata - sys_call_table search will be limited to %d bytes",
+               SYSCALL_TABLE_MAX_SCAN);
+    return start + SYSCALL_TABLE_MAX_SCAN;
+}
+
 static int find_sys_call_table(void)
 {
-    syscall_table_ptr = (unsigned long *)kallsyms_lookup_name("sys_call_table");
+    static int last_error = 0; //the table doesn't move so there's no point in re-scanning after a failure
+    if (unlikely(last_error))
+        return last_error;
+
+    syscall_table_ptr = (unsigned long *)lookup_protected_symbol("sys_call_table");
     if (syscall_table_ptr != 0) {
         pr_loc_dbg("Found sys_call_table @ <%p> using kallsyms", syscall_table_ptr);
         return 0;
@@ -43,16 +76,17 @@ static int find_sys_call_table(void)
      a place of sys_call_table by verifying other 2-3 places to make sure other syscalls are where they should be
      The huge downside of this method is it is slow as potentially the amount of memory to search may be large.
     */
-    unsigned long sys_close_ptr = kallsyms_lookup_name("sys_close");
-    unsigned long sys_open_ptr = kallsyms_lookup_name("sys_open");
-    unsigned long sys_read_ptr = kallsyms_lookup_name("sys_read");
-    unsigned long sys_write_ptr = kallsyms_lookup_name("sys_write");
+    unsigned long sys_close_ptr = lookup_protected_symbol("sys_close");
+    unsigned long sys_open_ptr = lookup_protected_symbol("sys_open");
+    unsigned long sys_read_ptr = lookup_protected_symbol("sys_read");
+    unsigned long sys_write_ptr = lookup_protected_symbol("sys_write");
     if (sys_close_ptr == 0 || sys_open_ptr == 0 || sys_read_ptr == 0 || sys_write_ptr == 0) {
         pr_loc_bug(
                 "One or more syscall handler addresses cannot be located: "
                 "sys_close<%p>, sys_open<%p>, sys_read<%p>, sys_write<%p>",
                 (void *)sys_close_ptr, (void *)sys_open_ptr, (void *)sys_read_ptr, (void *)sys_write_ptr);
-        return -EFAULT;
+        last_error = -EFAULT;
+        return last_error;
     }
 
     /*
@@ -65,15 +99,18 @@ static int find_sys_call_table(void)
       ffffffff860c7a80 T __x64_sys_read
       ffffffff860c7ba0 T __x64_sys_write
       ffffffff86e013a0 R sys_call_table    <= it's way below any of the syscalls but not too far (~13,892,336 bytes)
+     The table is in .rodata so we never need to look past its end.
     */
     unsigned long i = sys_close_ptr;
     if (sys_open_ptr < i) i = sys_open_ptr;
     if (sys_read_ptr < i) i = sys_read_ptr;
     if (sys_write_ptr < i) i = sys_write_ptr;
+    i = ALIGN(i, sizeof(void *)); //the table is an array of pointers so it must be aligned
+    unsigned long end = get_sys_call_table_search_end(i) - NR_syscalls * sizeof(void *); //whole table must fit
 
     //If everything goes well it should take ~1-2ms tops (which is slow in the kernel sense but it's not bad)
-    pr_loc_dbg("Scanning memory for sys_call_table starting at %p", (void *)i);
-    for (; i < ULONG_MAX; i += sizeof(void *)) {
+    pr_loc_dbg("Scanning memory for sys_call_table in %p-%p", (void *)i, (void *)end);
+    for (; i <= end; i += sizeof(void *)) {
         syscall_table_ptr = (unsigned long *)i;
 
         if (unlikely(
@@ -89,79 +126,280 @@ static int find_sys_call_table(void)
 
     pr_loc_bug("Failed to find sys call table");
     syscall_table_ptr = NULL;
-    return -EFAULT;
+    last_error = -EFAULT;
+    return last_error;
 }
 
-static unsigned long *overridden_syscall[NR_syscalls] = { NULL }; //@todo this should be alloced dynamically
-int override_syscall(unsigned int syscall_num, const void *new_sysc_ptr, void * *org_sysc_ptr)
+/*
+ * Writable alias of the sys_call_table
+ *
+ * Instead of flipping protection of the table for every write, the pages backing it are mapped a second time using a
+ * private RW mapping. The original (RO) mapping is never touched and all writes go through the alias. Every entry is
+ * swapped using a single xchg() so that a CPU executing a syscall always sees either the old or the new pointer.
+ * If the alias cannot be created we fall back to the write window (which is still correct, just slower).
+ */
+static unsigned long *syscall_table_rw = NULL;
+static unsigned int syscall_table_rw_pages = 0;
+
+static void map_sys_call_table_alias(void)
 {
-    pr_loc_dbg("Overriding syscall #%d with %pf()<%p>", syscall_num, new_sysc_ptr, new_sysc_ptr);
+    if (syscall_table_rw)
+        return;
+
+    unsigned long start = (unsigned long)syscall_table_ptr & PAGE_MASK;
+    unsigned long end = PAGE_ALIGN((unsigned long)syscall_table_ptr + NR_syscalls * sizeof(void *));
+    unsigned int nr_pages = (end - start) >> PAGE_SHIFT;
+
+    struct page **pages = kmalloc(nr_pages * sizeof(struct page *), GFP_KERNEL);
+    if (unlikely(!pages)) {
+        pr_loc_wrn("Failed to allocate pages list for sys_call_table alias - using write window instead");
+        return;
+    }
+
+    for (unsigned int i = 0; i < nr_pages; ++i)
+        pages[i] = virt_to_page(start + i * PAGE_SIZE); //kernel image addresses are handled by __pa() on x86_64
+
+    void *alias = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+    kfree(pages);
+    if (unlikely(!alias)) {
+        pr_loc_wrn("Failed to map sys_call_table alias - using write window instead");
+        return;
+    }
+
+    syscall_table_rw = (unsigned long *)((unsigned long)alias + ((unsigned long)syscall_table_ptr & ~PAGE_MASK));
+    syscall_table_rw_pages = nr_pages;
+    pr_loc_dbg("Mapped sys_call_table @ %p as RW alias @ %p (%u pages)", syscall_table_ptr, syscall_table_rw,
+               nr_pages);
+}
+
+static void unmap_sys_call_table_alias(void)
+{
+    if (!syscall_table_rw)
+        return;
 
-    int out = 0;
+    vunmap((void *)((unsigned long)syscall_table_rw & PAGE_MASK));
+    pr_loc_dbg("Unmapped sys_call_table RW alias @ %p (%u pages)", syscall_table_rw, syscall_table_rw_pages);
+    syscall_table_rw = NULL;
+    syscall_table_rw_pages = 0;
+}
+
+/**
+ * Atomically replaces a single entry in the sys_call_table
+ *
+ * @return previous value of the entry
+ */
+static __always_inline unsigned long swap_syscall_entry(unsigned int syscall_num, unsigned long new_ptr)
+{
+    if (likely(syscall_table_rw))
+        return xchg(&syscall_table_rw[syscall_num], new_ptr);
+
+    unsigned long old_ptr;
+    WITH_MEM_WRITE_WINDOW(old_ptr = xchg(&syscall_table_ptr[syscall_num], new_ptr););
+    return old_ptr;
+}
+
+static unsigned long *overridden_syscall[NR_syscalls] = { NULL }; //@todo this should be alloced dynamically
+static const void *replacement_syscall[NR_syscalls] = { NULL }; //needed for re-enabling of disabled overrides
+static unsigned int overridden_syscall_count = 0;
+
+/**
+ * Ensures the table is found & mapped for writing
+ */
+static int prepare_sys_call_table(void)
+{
     if (unlikely(!syscall_table_ptr)) {
-        out = find_sys_call_table();
+        int out = find_sys_call_table();
         if (unlikely(out != 0))
             return out;
     }
 
+    map_sys_call_table_alias();
+    return 0;
+}
+
+static int validate_syscall_num(unsigned int syscall_num)
+{
     if (unlikely(syscall_num > __NR_syscall_max)) {
         pr_loc_bug("Invalid syscall number: %d > %d", syscall_num, __NR_syscall_max);
         return -EINVAL;
     }
 
-    print_syscall_table(syscall_num-5, syscall_num+5);
+    return 0;
+}
 
+/**
+ * Saves the original syscall & the replacement (without touching the table)
+ */
+static void record_syscall_override(unsigned int syscall_num, const void *new_sysc_ptr, void * *org_sysc_ptr)
+{
     if (unlikely(overridden_syscall[syscall_num])) {
         pr_loc_bug("Syscall %d is already overridden - will be replaced (bug?)", syscall_num);
     } else {
         //Only save original-original entry (not the override one)
         overridden_syscall[syscall_num] = (unsigned long *)syscall_table_ptr[syscall_num];
+        ++overridden_syscall_count;
     }
 
     if (org_sysc_ptr != 0)
         *org_sysc_ptr = overridden_syscall[syscall_num];
 
-    set_mem_addr_rw((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
     pr_loc_dbg("syscall #%d originally %ps<%p> will now be %ps<%p> @ %d", syscall_num,
                (void *) overridden_syscall[syscall_num], (void *) overridden_syscall[syscall_num], new_sysc_ptr,
                new_sysc_ptr, smp_processor_id());
-    syscall_table_ptr[syscall_num] = (unsigned long) new_sysc_ptr;
-    set_mem_addr_ro((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
+    replacement_syscall[syscall_num] = new_sysc_ptr;
+}
 
-    print_syscall_table(syscall_num-5, syscall_num+5);
+/**
+ * Forgets the override saved by record_syscall_override() (without touching the table)
+ *
+ * @return original syscall pointer to put back into the table
+ */
+static unsigned long forget_syscall_override(unsigned int syscall_num)
+{
+    unsigned long org_ptr = (unsigned long)overridden_syscall[syscall_num];
+
+    pr_loc_dbg("Restoring syscall #%d from %ps<%p> to original %ps<%p>", syscall_num,
+               (void *) syscall_table_ptr[syscall_num], (void *) syscall_table_ptr[syscall_num],
+               (void *) org_ptr, (void *) org_ptr);
+    overridden_syscall[syscall_num] = NULL;
+    replacement_syscall[syscall_num] = NULL;
+    --overridden_syscall_count;
 
-    return out;
+    return org_ptr;
 }
 
-int restore_syscall(unsigned int syscall_num)
+/**
+ * Writes a set of entries to the table - using the alias if possible or in a single write window otherwise
+ */
+static void write_syscall_entries(const syscall_override *overrides, const unsigned long *values, unsigned int count)
 {
-    pr_loc_dbg("Restoring syscall #%d", syscall_num);
+    if (likely(syscall_table_rw)) {
+        for (unsigned int i = 0; i < count; ++i)
+            xchg(&syscall_table_rw[overrides[i].syscall_num], values[i]);
+        return;
+    }
+
+    WITH_MEM_WRITE_WINDOW(
+        for (unsigned int i = 0; i < count; ++i)
+            xchg(&syscall_table_ptr[overrides[i].syscall_num], values[i]);
+    );
+}
 
+static int validate_restore(unsigned int syscall_num)
+{
     if (unlikely(!syscall_table_ptr)) {
         pr_loc_bug("Syscall table not found in %s ?!", __FUNCTION__);
         return -EFAULT;
     }
 
-    if (unlikely(syscall_num > __NR_syscall_max)) {
-        pr_loc_bug("Invalid syscall number: %d > %d", syscall_num, __NR_syscall_max);
-        return -EINVAL;
-    }
+    int out = validate_syscall_num(syscall_num);
+    if (unlikely(out != 0))
+        return out;
 
     if (unlikely(overridden_syscall[syscall_num] == 0)) {
         pr_loc_bug("Syscall #%d cannot be restored - it was never overridden", syscall_num);
         return -EINVAL;
     }
 
+    return 0;
+}
+
+int override_syscall(unsigned int syscall_num, const void *new_sysc_ptr, void * *org_sysc_ptr)
+{
+    pr_loc_dbg("Overriding syscall #%d with %pf()<%p>", syscall_num, new_sysc_ptr, new_sysc_ptr);
+
+    int out;
+    if (unlikely((out = prepare_sys_call_table()) != 0) || unlikely((out = validate_syscall_num(syscall_num)) != 0))
+        return out;
+
+    print_syscall_table(syscall_num-5, syscall_num+5);
+    record_syscall_override(syscall_num, new_sysc_ptr, org_sysc_ptr);
+    swap_syscall_entry(syscall_num, (unsigned long)new_sysc_ptr);
     print_syscall_table(syscall_num-5, syscall_num+5);
 
-    set_mem_addr_rw((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
-    pr_loc_dbg("Restoring syscall #%d from %ps<%p> to original %ps<%p>", syscall_num,
-               (void *) syscall_table_ptr[syscall_num], (void *) syscall_table_ptr[syscall_num],
-               (void *) overridden_syscall[syscall_num], (void *) overridden_syscall[syscall_num]);
-    syscall_table_ptr[syscall_num] = (unsigned long)overridden_syscall[syscall_num];
-    set_mem_addr_rw((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
+    return 0;
+}
+
+int restore_syscall(unsigned int syscall_num)
+{
+    pr_loc_dbg("Restoring syscall #%d", syscall_num);
 
+    int out = validate_restore(syscall_num);
+    if (unlikely(out != 0))
+        return out;
+
+    print_syscall_table(syscall_num-5, syscall_num+5);
+    swap_syscall_entry(syscall_num, forget_syscall_override(syscall_num));
     print_syscall_table(syscall_num-5, syscall_num+5);
 
+    if (!overridden_syscall_count)
+        unmap_sys_call_table_alias();
+
+    return 0;
+}
+
+int override_syscalls(const syscall_override *overrides, unsigned int count)
+{
+    pr_loc_dbg("Overriding %u syscalls", count);
+
+    int out = prepare_sys_call_table();
+    if (unlikely(out != 0))
+        return out;
+
+    //Validate everything first so that we don't end up with a half-applied set
+    for (unsigned int i = 0; i < count; ++i) {
+        if (unlikely((out = validate_syscall_num(overrides[i].syscall_num)) != 0))
+            return out;
+    }
+
+    unsigned long *values;
+    kmalloc_or_exit_int(values, count * sizeof(unsigned long));
+    for (unsigned int i = 0; i < count; ++i) {
+        record_syscall_override(overrides[i].syscall_num, overrides[i].new_sysc_ptr, overrides[i].org_sysc_ptr);
+        values[i] = (unsigned long)overrides[i].new_sysc_ptr;
+    }
+
+    write_syscall_entries(overrides, values, count);
+    kfree(values);
+
+    return 0;
+}
+
+int restore_syscalls(const syscall_override *overrides, unsigned int count)
+{
+    pr_loc_dbg("Restoring %u syscalls", count);
+
+    int out;
+    for (unsigned int i = 0; i < count; ++i) {
+        if (unlikely((out = validate_restore(overrides[i].syscall_num)) != 0))
+            return out;
+    }
+
+    unsigned long *values;
+    kmalloc_or_exit_int(values, count * sizeof(unsigned long));
+    for (unsigned int i = 0; i < count; ++i)
+        values[i] = forget_syscall_override(overrides[i].syscall_num);
+
+    write_syscall_entries(overrides, values, count);
+    kfree(values);
+
+    if (!overridden_syscall_count)
+        unmap_sys_call_table_alias();
+
     return 0;
-}
\ No newline at end of file
+}
+
+int set_syscall_override_enabled(unsigned int syscall_num, bool enabled)
+{
+    int out = validate_restore(syscall_num);
+    if (unlikely(out != 0))
+        return out;
+
+    unsigned long target = enabled ? (unsigned long)replacement_syscall[syscall_num]
+                                   : (unsigned long)overridden_syscall[syscall_num];
+    unsigned long prev = swap_syscall_entry(syscall_num, target);
+    pr_loc_dbg("Syscall #%d override %s (%ps<%p> => %ps<%p>)", syscall_num, enabled ? "enabled" : "disabled",
+               (void *)prev, (void *)prev, (void *)target, (void *)target);
+
+    return 0;
+}
@@ -56,4 +56,43 @@ int override_syscall(unsigned int syscall_num, const void *new_sysc_ptr, void *
  */
 int restore_syscall(unsigned int syscall_num);
 
+/**
+ * Single entry for override_syscalls()/restore_syscalls()
+ */
+typedef struct syscall_override {
+    unsigned int syscall_num; //e.g. __NR_open
+    const void *new_sysc_ptr;
+    void * *org_sysc_ptr; //optional, see override_syscall()
+} syscall_override;
+
+/**
+ * Overrides a set of syscalls at once
+ *
+ * This is equivalent to calling override_syscall() for every entry, but the table protection isn't touched for every
+ * single one. All entries are validated before anything is written so either all or none are applied. Each entry is
+ * swapped atomically, but the set as a whole is not (i.e. a syscall may hit a partially-applied set for a moment).
+ *
+ * @return 0 on success, -E on error
+ */
+int override_syscalls(const syscall_override *overrides, unsigned int count);
+
+/**
+ * Restores a set of syscalls previously replaced by override_syscalls() (or override_syscall())
+ *
+ * Only syscall_num of every entry is used.
+ *
+ * @return 0 on success, -E on error
+ */
+int restore_syscalls(const syscall_override *overrides, unsigned int count);
+
+/**
+ * Temporarily disables (or re-enables) an override without forgetting it
+ *
+ * The syscall must be overridden already. This is cheap: the table is kept mapped writable (using a private alias) as
+ * long as any override exists, so this is a single atomic pointer swap.
+ *
+ * @return 0 on success, -E on error
+ */
+int set_syscall_override_enabled(unsigned int syscall_num, bool enabled);
+
 #endif //REDPILL_OVERRIDE_SYSCALL_H
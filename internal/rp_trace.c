@@ -0,0 +1,7 @@
+/**
+ * Instantiates tracepoints declared in rp_trace_events.h - see rp_trace.h
+ *
+ * CREATE_TRACE_POINTS must be defined before the events header is read for the first time in this file.
+ */
+#define CREATE_TRACE_POINTS
+#include "rp_trace.h"
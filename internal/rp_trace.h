@@ -0,0 +1,24 @@
+/**
+ * Kernel tracepoints of shims & emulation layers (events are defined in rp_trace_events.h)
+ *
+ * Call sites use rp_trace(<event>, <args>...) and not trace_<event>() directly: events are only compiled in when the
+ * kernel supports tracepoints and only in the least stealthy modes (they're listed in tracefs, which is as much of a
+ * giveaway as the debugfs dir). Otherwise rp_trace() is a noop which doesn't even evaluate its arguments, so they must
+ * be free of side effects.
+ */
+#ifndef REDPILL_RP_TRACE_H
+#define REDPILL_RP_TRACE_H
+
+#include "helper/debugfs_helper.h" //RP_DEBUGFS_ENABLED
+
+#if defined(RP_DEBUGFS_ENABLED) && defined(CONFIG_TRACEPOINTS)
+#define RP_TRACE_ENABLED
+#include <linux/pci.h> //PCI_SLOT(), PCI_FUNC() used by vpci_cfg
+#include "rp_trace_events.h"
+
+#define rp_trace(event, ...) trace_##event(__VA_ARGS__)
+#else
+#define rp_trace(event, ...) do { } while(0)
+#endif
+
+#endif //REDPILL_RP_TRACE_H
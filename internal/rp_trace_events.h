@@ -0,0 +1,186 @@
+/**
+ * Tracepoints of the module (TRACE_SYSTEM "redpill") - see rp_trace.h; do NOT include this file directly
+ *
+ * Events are meant for perf/trace-cmd/eBPF (e.g. "perf record -e redpill:*") and cost a single static branch when not
+ * enabled. Fields are kept to plain numbers & short strings so that they can be filtered on. Events are not an ABI:
+ * they can change along with the code they describe. Enum-typed fields (e.g. vuart_flush reason) are printed as ints.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM redpill
+
+#if !defined(REDPILL_RP_TRACE_EVENTS_H) || defined(TRACE_HEADER_MULTI_READ)
+#define REDPILL_RP_TRACE_EVENTS_H
+
+#include <linux/tracepoint.h>
+
+/******************************************************* Overrides ****************************************************/
+TRACE_EVENT(override_install,
+    TP_PROTO(const char *name, const char *mode, const void *org, const void *new),
+    TP_ARGS(name, mode, org, new),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __string(mode, mode)
+        __field(const void *, org)
+        __field(const void *, new)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __assign_str(mode, mode);
+        __entry->org = org;
+        __entry->new = new;
+    ),
+    TP_printk("%s<%p> => %pf<%p> mode=%s", __get_str(name), __entry->org, __entry->new, __entry->new,
+              __get_str(mode))
+);
+
+TRACE_EVENT(override_restore,
+    TP_PROTO(const char *name, const void *org, int result),
+    TP_ARGS(name, org, result),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(const void *, org)
+        __field(int, result)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->org = org;
+        __entry->result = result;
+    ),
+    TP_printk("%s<%p> result=%d", __get_str(name), __entry->org, __entry->result)
+);
+
+/******************************************************** execve ******************************************************/
+TRACE_EVENT(execve,
+    TP_PROTO(const char *filename, bool blocked, int exit_code),
+    TP_ARGS(filename, blocked, exit_code),
+    TP_STRUCT__entry(
+        __string(filename, filename)
+        __field(bool, blocked)
+        __field(int, exit_code)
+    ),
+    TP_fast_assign(
+        __assign_str(filename, filename);
+        __entry->blocked = blocked;
+        __entry->exit_code = exit_code;
+    ),
+    TP_printk("%s %s exit=%d", __get_str(filename), __entry->blocked ? "blocked" : "allowed", __entry->exit_code)
+);
+
+/********************************************************* SCSI *******************************************************/
+TRACE_EVENT(smart_ioctl,
+    TP_PROTO(const char *disk, unsigned int cmd, int result),
+    TP_ARGS(disk, cmd, result),
+    TP_STRUCT__entry(
+        __string(disk, disk)
+        __field(unsigned int, cmd)
+        __field(int, result)
+    ),
+    TP_fast_assign(
+        __assign_str(disk, disk);
+        __entry->cmd = cmd;
+        __entry->result = result;
+    ),
+    TP_printk("%s cmd=0x%x result=%d", __get_str(disk), __entry->cmd, __entry->result)
+);
+
+TRACE_EVENT(scsi_probe,
+    TP_PROTO(const char *dev, int event, int result),
+    TP_ARGS(dev, event, result),
+    TP_STRUCT__entry(
+        __string(dev, dev)
+        __field(int, event)
+        __field(int, result)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev);
+        __entry->event = event;
+        __entry->result = result;
+    ),
+    TP_printk("%s event=%d result=%d", __get_str(dev), __entry->event, __entry->result) //event is scsi_event
+);
+
+/********************************************************* vUART ******************************************************/
+TRACE_EVENT(vuart_flush,
+    TP_PROTO(int line, unsigned int len, int reason),
+    TP_ARGS(line, len, reason),
+    TP_STRUCT__entry(
+        __field(int, line)
+        __field(unsigned int, len)
+        __field(int, reason)
+    ),
+    TP_fast_assign(
+        __entry->line = line;
+        __entry->len = len;
+        __entry->reason = reason;
+    ),
+    TP_printk("ttyS%d len=%u reason=%d", __entry->line, __entry->len, __entry->reason) //reason is vuart_flush_reason
+);
+
+TRACE_EVENT(vuart_virq,
+    TP_PROTO(int line, unsigned int irq, u8 iir),
+    TP_ARGS(line, irq, iir),
+    TP_STRUCT__entry(
+        __field(int, line)
+        __field(unsigned int, irq)
+        __field(u8, iir)
+    ),
+    TP_fast_assign(
+        __entry->line = line;
+        __entry->irq = irq;
+        __entry->iir = iir;
+    ),
+    TP_printk("ttyS%d irq=%u iir=0x%02x", __entry->line, __entry->irq, __entry->iir)
+);
+
+/********************************************************* vPCI *******************************************************/
+TRACE_EVENT(vpci_cfg,
+    TP_PROTO(u8 bus, unsigned int devfn, int where, int size, u32 val, bool write, int result),
+    TP_ARGS(bus, devfn, where, size, val, write, result),
+    TP_STRUCT__entry(
+        __field(u8, bus)
+        __field(u8, devfn)
+        __field(u16, where)
+        __field(u8, size)
+        __field(bool, write)
+        __field(u32, val)
+        __field(int, result)
+    ),
+    TP_fast_assign(
+        __entry->bus = bus;
+        __entry->devfn = devfn;
+        __entry->where = where;
+        __entry->size = size;
+        __entry->write = write;
+        __entry->val = val;
+        __entry->result = result;
+    ),
+    TP_printk("%02x:%02x.%x %s where=0x%03x size=%u val=0x%08x result=%d", __entry->bus, PCI_SLOT(__entry->devfn),
+              PCI_FUNC(__entry->devfn), __entry->write ? "write" : "read", __entry->where, __entry->size,
+              __entry->val, __entry->result)
+);
+
+/******************************************************** mfgBIOS *****************************************************/
+TRACE_EVENT(mfgbios_call,
+    TP_PROTO(const char *entry, int arg0, int arg1),
+    TP_ARGS(entry, arg0, arg1),
+    TP_STRUCT__entry(
+        __string(entry, entry)
+        __field(int, arg0)
+        __field(int, arg1)
+    ),
+    TP_fast_assign(
+        __assign_str(entry, entry);
+        __entry->arg0 = arg0;
+        __entry->arg1 = arg1;
+    ),
+    TP_printk("%s(%d, %d)", __get_str(entry), __entry->arg0, __entry->arg1)
+);
+
+#endif //REDPILL_RP_TRACE_EVENTS_H
+
+//This has to be outside of the guard: define_trace.h re-includes this file (by name, see Makefile) to create events
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rp_trace_events
+#include <trace/define_trace.h>
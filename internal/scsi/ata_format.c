@@ -0,0 +1,46 @@
+#include "ata_format.h"
+#ifdef __KERNEL__
+#include "../../common.h"
+#include <linux/ata.h> //ATA_SECT_SIZE
+#endif
+
+void ata_calc_sector_checksum(u8 *buff)
+{
+    for (int i = 0; i < (ATA_SECT_SIZE-1); i++) {
+        buff[(ATA_SECT_SIZE-1)] += buff[i];
+    }
+
+    buff[(ATA_SECT_SIZE-1)] = 256 - buff[(ATA_SECT_SIZE-1)];
+}
+
+void ata_calc_integrity_word(u16 *word_buff)
+{
+    u8 *byte_buff = (u8 *)word_buff;
+
+    for (int i = 0; i < (ATA_SECT_SIZE-2); i++) {
+        byte_buff[(ATA_SECT_SIZE-2)] += byte_buff[i];
+    }
+
+    byte_buff[(ATA_SECT_SIZE-2)] = 256 - byte_buff[(ATA_SECT_SIZE-2)];
+    byte_buff[(ATA_SECT_SIZE-1)] = 0xa5;
+}
+
+void set_ata_string(u8 *dst, const char *src, u8 length)
+{
+    if (unlikely(length % 2 != 0)) {
+        pr_loc_bug("Length must be even but got %d", length);
+        --length;
+    }
+
+    memset(dst, 0x20, length); //fields in ATA/ATAPI are space-padded and not terminated by \0
+    for (u8 i = 0; i < length; i += 2)
+    {
+        if (src[i] == '\0')
+            break;
+
+        dst[i + 1] = src[i];
+        if (src[i + 1] == '\0') //odd-length string: the last char must be paired with padding and not the terminator
+            break;
+        dst[i] = src[i + 1];
+    }
+}
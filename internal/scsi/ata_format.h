@@ -0,0 +1,50 @@
+/**
+ * Pure helpers for formatting ATA/ATAPI data structures (checksums, strings)
+ *
+ * They don't depend on any kernel state and are also built in the userspace (see compat/host/host_kernel.h and the
+ * "host-lib" Makefile target), so they can be fuzzed and benchmarked on a dev host.
+ */
+#ifndef REDPILL_ATA_FORMAT_H
+#define REDPILL_ATA_FORMAT_H
+
+#ifdef __KERNEL__
+#include <linux/types.h> //u8, u16
+#else
+#include "../../compat/host/host_kernel.h"
+#endif
+
+/**
+ * Calculates a standard per-sector ATA checksum
+ *
+ * ATA/ATAPI-6 standard contains the same checksum references in many places. It's always saved in the last byte of a
+ * sector (index 511). It is described e.g. in "Table 5: SMART Attribute Entry Format". It's defined as "Two's
+ * complement checksum of preceding 511B[ytes]". Wikipedia has a great article about that as well.
+ *
+ * @param buff A single-sector sized buffer to compute & save checksum to
+ */
+void ata_calc_sector_checksum(u8 *buff);
+
+/**
+ * Calculates a standard per-worded structure ATA checksum
+ *
+ * In principal it's almost the same thing as ata_calc_sector_checksum() but with some constant added to be 16 bits.
+ * See "8.16.64 Word 255: Integrity word". Checksum is always saved in word 255.
+ *
+ * @param word_buff A 255-word (each 16 bits) sized buffer to compute & save checksum to
+ */
+void ata_calc_integrity_word(u16 *word_buff);
+
+/**
+ * ATA/ATAPI uses "strings" which are LE arranged 8 bit characters into 16 bit words padded with spaces to full length
+ *
+ * Example of 10 character ATA field:
+ *  =normal=> "TEST12"
+ *  =ATA====> "ETTS21    "
+ *
+ * @param dst buffer to copy the string to
+ * @param src standard NULL-byte terminated text
+ * @param length ATA field length; must be even
+ */
+void set_ata_string(u8 *dst, const char *src, u8 length);
+
+#endif //REDPILL_ATA_FORMAT_H
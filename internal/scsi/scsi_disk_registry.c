@@ -0,0 +1,168 @@
+#include "scsi_disk_registry.h"
+#include "../../common.h"
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_add(), hash_for_each_possible()
+#include <linux/hash.h> //hash_32(), hash_64()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_*()
+#include <scsi/scsi_device.h> //struct scsi_device
+#include <scsi/scsi_host.h> //struct Scsi_Host
+
+#define REGISTRY_HASH_BITS 6
+
+struct scsi_disk_entry {
+    struct scsi_device *sdp; //holds a reference to sdev_gendev
+    struct hlist_node node;
+};
+
+static DEFINE_HASHTABLE(registry, REGISTRY_HASH_BITS);
+static DEFINE_MUTEX(registry_lock); //probe & remove are in a process context and may run in parallel
+static unsigned int registry_count = 0;
+static bool registry_ready = false;
+
+static __always_inline u32 hctl_key(unsigned int host_no, unsigned int channel, unsigned int id, u64 lun)
+{
+    return hash_32(host_no ^ (channel << 8) ^ (id << 16), 32) ^ hash_64(lun, 32);
+}
+
+static __always_inline u32 sdp_key(const struct scsi_device *sdp)
+{
+    return hctl_key(sdp->host->host_no, sdp->channel, sdp->id, sdp->lun);
+}
+
+/**
+ * Finds entry for a given disk; must be called with registry_lock held
+ */
+static struct scsi_disk_entry *find_entry(const struct scsi_device *sdp)
+{
+    struct scsi_disk_entry *entry;
+    hash_for_each_possible(registry, entry, node, sdp_key(sdp)) {
+        if (entry->sdp == sdp)
+            return entry;
+    }
+
+    return NULL;
+}
+
+int scsi_disk_registry_add(struct scsi_device *sdp)
+{
+    struct scsi_disk_entry *entry;
+    kmalloc_or_exit_int(entry, sizeof(struct scsi_disk_entry));
+
+    mutex_lock(&registry_lock);
+    if (unlikely(find_entry(sdp))) { //e.g. probed while the registry was being seeded
+        mutex_unlock(&registry_lock);
+        kfree(entry);
+        return 0;
+    }
+
+    get_device(&sdp->sdev_gendev);
+    entry->sdp = sdp;
+    hash_add(registry, &entry->node, sdp_key(sdp));
+    ++registry_count;
+    mutex_unlock(&registry_lock);
+
+    pr_loc_dbg("Registered SCSI disk %s (%u disks known)", dev_name(&sdp->sdev_gendev), registry_count);
+    return 0;
+}
+
+void scsi_disk_registry_remove(struct scsi_device *sdp)
+{
+    mutex_lock(&registry_lock);
+    struct scsi_disk_entry *entry = find_entry(sdp);
+    if (likely(entry)) {
+        hash_del(&entry->node);
+        --registry_count;
+    }
+    mutex_unlock(&registry_lock);
+
+    if (unlikely(!entry))
+        return;
+
+    pr_loc_dbg("Unregistered SCSI disk %s", dev_name(&sdp->sdev_gendev));
+    put_device(&sdp->sdev_gendev);
+    kfree(entry);
+}
+
+void scsi_disk_registry_set_ready(bool ready)
+{
+    int bkt;
+    struct hlist_node *tmp;
+    struct scsi_disk_entry *entry;
+    HLIST_HEAD(removed);
+
+    mutex_lock(&registry_lock);
+    registry_ready = ready;
+    if (!ready) {
+        hash_for_each_safe(registry, bkt, tmp, entry, node) {
+            hash_del(&entry->node);
+            hlist_add_head(&entry->node, &removed);
+        }
+        registry_count = 0;
+    }
+    mutex_unlock(&registry_lock);
+
+    //references are dropped outside of the lock as the last put may call into the SCSI layer
+    hlist_for_each_entry_safe(entry, tmp, &removed, node) {
+        put_device(&entry->sdp->sdev_gendev);
+        kfree(entry);
+    }
+}
+
+bool scsi_disk_registry_is_ready(void)
+{
+    return ACCESS_ONCE(registry_ready);
+}
+
+struct scsi_device *scsi_disk_registry_find(unsigned int host_no, unsigned int channel, unsigned int id, u64 lun)
+{
+    struct scsi_disk_entry *entry;
+    struct scsi_device *found = NULL;
+
+    mutex_lock(&registry_lock);
+    hash_for_each_possible(registry, entry, node, hctl_key(host_no, channel, id, lun)) {
+        if (entry->sdp->host->host_no == host_no && entry->sdp->channel == channel && entry->sdp->id == id &&
+            entry->sdp->lun == lun) {
+            found = entry->sdp;
+            get_device(&found->sdev_gendev);
+            break;
+        }
+    }
+    mutex_unlock(&registry_lock);
+
+    return found;
+}
+
+int for_each_registered_scsi_disk(on_scsi_device_cb *cb)
+{
+    //The callback may remove the device (which calls scsi_disk_registry_remove()) so it cannot be called with the lock
+    // held. Instead, a snapshot of all disks (with their references taken) is made first.
+    struct scsi_device **snapshot = NULL;
+    unsigned int count, i = 0;
+    int bkt;
+    struct scsi_disk_entry *entry;
+
+    mutex_lock(&registry_lock);
+    count = registry_count;
+    if (likely(count)) {
+        snapshot = kmalloc(sizeof(struct scsi_device *) * count, GFP_KERNEL);
+        if (unlikely(!snapshot)) {
+            mutex_unlock(&registry_lock);
+            kalloc_error_int(snapshot, sizeof(struct scsi_device *) * count);
+        }
+
+        hash_for_each(registry, bkt, entry, node) {
+            get_device(&entry->sdp->sdev_gendev);
+            snapshot[i++] = entry->sdp;
+        }
+    }
+    mutex_unlock(&registry_lock);
+
+    int out = 0;
+    for (i = 0; i < count; ++i) {
+        if (out == 0)
+            out = cb(snapshot[i]);
+        put_device(&snapshot[i]->sdev_gendev);
+    }
+
+    kfree(snapshot);
+    return out;
+}
@@ -0,0 +1,59 @@
+/**
+ * Registry of SCSI disks bound to the sd driver, maintained by the SCSI notifier
+ *
+ * Walking the whole SCSI bus (hosts, targets, and all other non-disk devices) to find disks is wasteful when it's done
+ * by every shim. The SCSI notifier feeds this registry from sd_probe() and sd_remove() (and seeds it with disks probed
+ * before the notifier was registered), so that disks can be found without a bus walk. Until the registry is ready
+ * (i.e. sd_probe() is shimmed) it's empty and for_each_scsi_disk() falls back to the bus walk.
+ *
+ * Only disks which were successfully probed by sd are registered. Every registered disk holds a reference to its
+ * sdev_gendev.
+ */
+#ifndef REDPILL_SCSI_DISK_REGISTRY_H
+#define REDPILL_SCSI_DISK_REGISTRY_H
+
+#include "scsi_toolbox.h" //on_scsi_device_cb
+#include <linux/types.h> //bool, u64
+
+/**
+ * Adds a disk to the registry (noop if it's already there)
+ *
+ * @return 0 on success, -E on error
+ */
+int scsi_disk_registry_add(struct scsi_device *sdp);
+
+/**
+ * Removes a disk from the registry (noop if it's not there)
+ */
+void scsi_disk_registry_remove(struct scsi_device *sdp);
+
+/**
+ * Marks registry as (in)complete; once it's ready it's assumed to contain all disks bound to sd
+ *
+ * Marking it as not ready removes all disks.
+ */
+void scsi_disk_registry_set_ready(bool ready);
+
+/**
+ * Checks if for_each_registered_scsi_disk() can be used instead of scanning the SCSI bus
+ */
+bool scsi_disk_registry_is_ready(void);
+
+/**
+ * Finds a registered disk by its SCSI address
+ *
+ * @return disk with a reference taken (release it with put_device(&sdp->sdev_gendev)) or NULL if not found
+ */
+struct scsi_device *scsi_disk_registry_find(unsigned int host_no, unsigned int channel, unsigned int id, u64 lun);
+
+/**
+ * Calls the callback with every registered disk
+ *
+ * The callback is called without any registry locks held (it may e.g. replug the device). It follows the semantics of
+ * bus_for_each_dev(): returning anything but 0 stops the iteration and the value is returned.
+ *
+ * @return 0 on success, value returned by the callback, or -E on error
+ */
+int for_each_registered_scsi_disk(on_scsi_device_cb *cb);
+
+#endif //REDPILL_SCSI_DISK_REGISTRY_H
@@ -28,6 +28,18 @@
  *      scsi_event=SCSI_EVT_DEV_PROBED_OK: subscribers with lower priority will not exec
  *      scsi_event=SCSI_EVT_DEV_PROBED_ERR: subscribers with lower priority will not exec
  *
+ * SUBSCRIPTION CLASSES
+ * There are two classes of subscribers:
+ *   - synchronous (subscribe_scsi_disk_events()): called inline from sd_probe(), before & after the original one. Only
+ *     subscribers which must change (or veto) the device before it's probed, or which must react before sd_probe()
+ *     returns, should use that as their latency is added to every disk probe.
+ *   - asynchronous (subscribe_scsi_disk_events_async()): only get SCSI_EVT_DEV_PROBED_* events, delivered from a
+ *     workqueue after sd_probe() already returned. The return value of the callback doesn't matter.
+ *
+ * DISK REGISTRY
+ * Independently of subscribers, every disk probed successfully is added to the scsi_disk_registry (and removed from it
+ * when sd_remove() is called), so that others can find disks without walking the bus.
+ *
  * SUPPORTED DEVICES
  * Currently only SCSI disks are supported. This isn't a technical limitation but rather a practical one - we don't want
  * to trigger notifications for all-all SCSI devices (which include hosts, buses, etc). If needed a new set of functions
@@ -48,34 +60,100 @@
 #include "../notifier_base.h" //notifier_*()
 #include "scsi_notifier_list.h"
 #include "scsi_toolbox.h"
+#include "scsi_disk_registry.h" //scsi_disk_registry_*()
 #include "../intercept_driver_register.h" //watching for sd driver loading
+#include "../hook_stats.h" //hook_stats_span_begin(), hook_stats_exclude()
+#include "../housekeeping.h" //alloc_housekeeping_wq()
+#include "../rp_trace.h" //rp_trace()
+#include <linux/workqueue.h> //queue_work()
 #include <scsi/scsi_device.h> //to_scsi_device()
 
 #define NOTIFIER_NAME "SCSI device"
 
+/*********************************************** Asynchronous delivery ************************************************/
+#define SCSI_ASYNC_EVT_WQ_NAME "scsi_evt"
+#define SCSI_ASYNC_EVT_MAX_ACTIVE 4 //how many devices' events can be processed in parallel
+
+struct scsi_async_evt {
+    scsi_event evt;
+    struct scsi_device *sdp; //holds a reference to sdev_gendev
+    struct work_struct work;
+};
+
+static struct workqueue_struct *async_evt_wq = NULL;
+
+static void deliver_async_event(struct work_struct *work)
+{
+    struct scsi_async_evt *aevt = container_of(work, struct scsi_async_evt, work);
+
+    blocking_notifier_call_chain(&rp_scsi_async_notify_list, aevt->evt, aevt->sdp);
+    put_device(&aevt->sdp->sdev_gendev);
+    kfree(aevt);
+}
+
+static void destroy_async_evt_wq(void)
+{
+    if (!async_evt_wq)
+        return;
+
+    destroy_workqueue(async_evt_wq); //drains all pending events first
+    async_evt_wq = NULL;
+}
+
+/**
+ * Schedules delivery of a post-probe event to asynchronous subscribers
+ *
+ * If the event cannot be queued it's delivered synchronously - subscribers rely on seeing every device.
+ */
+static void queue_async_event(scsi_event evt, struct scsi_device *sdp)
+{
+    if (!ACCESS_ONCE(rp_scsi_async_notify_list.head))
+        return; //nobody is listening - don't bother
+
+    struct scsi_async_evt *aevt = NULL;
+    if (likely(async_evt_wq))
+        aevt = kmalloc(sizeof(struct scsi_async_evt), GFP_KERNEL);
+
+    if (unlikely(!aevt)) {
+        pr_loc_wrn("Cannot queue async SCSI event %d - delivering it synchronously", evt);
+        blocking_notifier_call_chain(&rp_scsi_async_notify_list, evt, sdp);
+        return;
+    }
+
+    aevt->evt = evt;
+    aevt->sdp = sdp;
+    get_device(&sdp->sdev_gendev);
+    INIT_WORK(&aevt->work, deliver_async_event);
+    queue_work(async_evt_wq, &aevt->work);
+}
+
 /*********************************** Interacting with an active/loaded SCSI driver ************************************/
 static driver_watcher_instance *driver_watcher = NULL;
 static int (*org_sd_probe) (struct device *dev) = NULL; //set during register
+static int (*org_sd_remove) (struct device *dev) = NULL; //set during register
 
 /**
  * Main notification routine hooking sd_probe()
  */
-static int sd_probe_shim(struct device *dev)
+static int __sd_probe_shim(struct device *dev, struct hook_stats_span *hs)
 {
     pr_loc_dbg("Probing SCSI device using %s", __FUNCTION__);
     if (!is_scsi_leaf(dev)) {
         pr_loc_dbg("%s: new SCSI device connected - not a leaf, ignoring", __FUNCTION__);
-        return org_sd_probe(dev);
+        return hook_stats_exclude(hs, org_sd_probe(dev));
     }
 
     struct scsi_device *sdp = to_scsi_device(dev);
     if (!is_scsi_disk(sdp)) {
         pr_loc_dbg("%s: new SCSI device connected - not a disk, ignoring", __FUNCTION__);
-        return org_sd_probe(dev);
+        return hook_stats_exclude(hs, org_sd_probe(dev));
     }
 
+    scsi_forget_capacity(sdp); //the same address may have been used by a device which is gone (or it's a reprobe)
+
     pr_loc_dbg("Triggering SCSI_EVT_DEV_PROBING notifications");
     int out = notifier_to_errno(blocking_notifier_call_chain(&rp_scsi_notify_list, SCSI_EVT_DEV_PROBING, sdp));
+    rp_trace(scsi_probe, dev_name(dev), SCSI_EVT_DEV_PROBING, out);
     if (unlikely(out == NOTIFY_STOP)) {
         pr_loc_dbg("After SCSI_EVT_DEV_PROBING a callee stopped chain with non-error condition. Faking probe-ok.");
         return 0;
@@ -85,15 +163,56 @@ static int sd_probe_shim(struct device *dev)
     }
 
     pr_loc_dbg("Calling original sd_probe()");
-    out = org_sd_probe(dev);
+    out = hook_stats_exclude(hs, org_sd_probe(dev));
     scsi_event evt = (out == 0) ? SCSI_EVT_DEV_PROBED_OK : SCSI_EVT_DEV_PROBED_ERR;
 
+    if (likely(out == 0))
+        scsi_disk_registry_add(sdp); //failure only means the disk is not findable w/o a bus walk
+
     pr_loc_dbg("Triggering SCSI_EVT_DEV_PROBED notifications - sd_probe() exit=%d", out);
+    rp_trace(scsi_probe, dev_name(dev), evt, out);
     blocking_notifier_call_chain(&rp_scsi_notify_list, evt, sdp);
+    queue_async_event(evt, sdp);
+
+    return out;
+}
+
+/**
+ * Instrumented entrypoint for __sd_probe_shim(); the original sd_probe() isn't accounted to it
+ */
+static int sd_probe_shim(struct device *dev)
+{
+    struct hook_stats_span hs;
+    hook_stats_span_begin(&hs);
+    int out = __sd_probe_shim(dev, &hs);
+    hook_stats_span_end(HOOK_STATS_SD_PROBE, &hs);
 
     return out;
 }
 
+/**
+ * Keeps the disk registry up to date when sd_remove() is called
+ */
+static int sd_remove_shim(struct device *dev)
+{
+    //sd_remove() is called only for devices which were bound by sd_probe() - these are always disks
+    scsi_disk_registry_remove(to_scsi_device(dev));
+    scsi_forget_capacity(to_scsi_device(dev));
+
+    return org_sd_remove(dev);
+}
+
+/**
+ * Adds disks which were probed before sd_probe_shim() was installed to the registry
+ */
+static int seed_disk_registry(struct device *dev, void *drv)
+{
+    if (dev->driver == drv && is_scsi_leaf(dev) && is_scsi_disk(to_scsi_device(dev)))
+        scsi_disk_registry_add(to_scsi_device(dev));
+
+    return 0;
+}
+
 /**
  * Overrides sd_probe() to provide notifications via sd_probe_shim()
  *
@@ -104,6 +223,14 @@ static inline void install_sd_probe_shim(struct device_driver *drv)
     pr_loc_dbg("Overriding %pf()<%p> with %pf()<%p>", drv->probe, drv->probe, sd_probe_shim, sd_probe_shim);
     org_sd_probe = drv->probe;
     drv->probe = sd_probe_shim;
+
+    pr_loc_dbg("Overriding %pf()<%p> with %pf()<%p>", drv->remove, drv->remove, sd_remove_shim, sd_remove_shim);
+    org_sd_remove = drv->remove;
+    drv->remove = sd_remove_shim;
+
+    //Disks probed after the probe shim was installed, but before they're seeded, are de-duplicated by the registry
+    bus_for_each_dev(&scsi_bus_type, NULL, drv, seed_disk_registry);
+    scsi_disk_registry_set_ready(true);
 }
 
 /**
@@ -124,6 +251,13 @@ static inline void uninstall_sd_probe_shim(struct device_driver *drv)
     pr_loc_dbg("Restoring %pf()<%p> to %pf()<%p>", drv->probe, drv->probe, org_sd_probe, org_sd_probe);
     drv->probe = org_sd_probe;
     org_sd_probe = NULL;
+
+    pr_loc_dbg("Restoring %pf()<%p> to %pf()<%p>", drv->remove, drv->remove, org_sd_remove, org_sd_remove);
+    drv->remove = org_sd_remove;
+    org_sd_remove = NULL;
+
+    scsi_disk_registry_set_ready(false); //it will not be updated anymore
+    scsi_forget_all_capacities(); //removals will not be seen anymore either
 }
 
 /**
@@ -142,8 +276,6 @@ static driver_watch_notify_result sd_load_watcher(struct device_driver *drv, dri
 }
 
 /******************************************** Public API of the notifier **********************************************/
-extern struct bus_type scsi_bus_type;
-
 int subscribe_scsi_disk_events(struct notifier_block *nb)
 {
     notifier_sub(nb);
@@ -156,6 +288,19 @@ int unsubscribe_scsi_disk_events(struct notifier_block *nb)
     return blocking_notifier_chain_unregister(&rp_scsi_notify_list, nb);
 }
 
+int subscribe_scsi_disk_events_async(struct notifier_block *nb)
+{
+    notifier_sub(nb);
+    return blocking_notifier_chain_register(&rp_scsi_async_notify_list, nb);
+}
+
+int unsubscribe_scsi_disk_events_async(struct notifier_block *nb)
+{
+    notifier_unsub(nb);
+    //this waits for the callback to finish if it's currently running (the chain is protected by rwsem)
+    return blocking_notifier_chain_unregister(&rp_scsi_async_notify_list, nb);
+}
+
 // We need an additional flag as depending on which method of sd_probe override (watcher vs. existing driver find &
 // switch)
 static bool notifier_registered = false;
@@ -168,9 +313,15 @@ int register_scsi_notifier(void)
         return -EEXIST;
     }
 
+    //Async subscribers will still get events (synchronously) if this fails
+    async_evt_wq = alloc_housekeeping_wq(SCSI_ASYNC_EVT_WQ_NAME, SCSI_ASYNC_EVT_MAX_ACTIVE);
+    if (unlikely(!async_evt_wq))
+        pr_loc_wrn("Failed to create async events workqueue - async subscribers will be called synchronously");
+
     struct device_driver *drv = find_scsi_driver();
 
     if(unlikely(drv < 0)) { //some error occurred while looking for the driver
+        destroy_async_evt_wq();
         return PTR_ERR(drv); //find_scsi_driver() should already log what went wrong
     } else if(drv) { //the driver is already loaded - driver watcher cannot help us
         pr_loc_wrn(
@@ -183,6 +334,7 @@ int register_scsi_notifier(void)
         driver_watcher = watch_scsi_driver_register(sd_load_watcher, DWATCH_STATE_COMING);
         if (unlikely(IS_ERR(driver_watcher))) {
             pr_loc_err("Failed to register driver watcher for driver %s", SCSI_DRV_NAME);
+            destroy_async_evt_wq();
             return PTR_ERR(driver_watcher);
         }
     }
@@ -229,6 +381,9 @@ int unregister_scsi_notifier(void)
         }
     }
 
+    //No new events can be queued once sd_probe() is restored; this waits for the ones already queued
+    destroy_async_evt_wq();
+
     notifier_registered = false;
     if (unlikely(is_error)) {
         return out;
@@ -23,6 +23,19 @@ typedef enum {
 int subscribe_scsi_disk_events(struct notifier_block *nb);
 int unsubscribe_scsi_disk_events(struct notifier_block *nb);
 
+/**
+ * Subscribes to post-probe events (SCSI_EVT_DEV_PROBED_*) delivered asynchronously, outside of sd_probe()
+ *
+ * Use this for observers which don't need to modify the device before it's probed, so that their latency (e.g. sending
+ * commands to the disk) isn't added to every probe. The callback signature is the same as for
+ * subscribe_scsi_disk_events() but the return value is ignored (the probe already finished). The callbacks are called
+ * from a workqueue in a process context; events for different devices may be delivered concurrently. The device is
+ * guaranteed to not be freed while the callback runs, but it may have been removed in the meantime.
+ * Once unsubscribe_scsi_disk_events_async() returns the callback is guaranteed to not be running.
+ */
+int subscribe_scsi_disk_events_async(struct notifier_block *nb);
+int unsubscribe_scsi_disk_events_async(struct notifier_block *nb);
+
 int register_scsi_notifier(void);
 int unregister_scsi_notifier(void);
 
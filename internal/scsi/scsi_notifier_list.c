@@ -2,3 +2,4 @@
 #include <linux/notifier.h>
 
 BLOCKING_NOTIFIER_HEAD(rp_scsi_notify_list);
+BLOCKING_NOTIFIER_HEAD(rp_scsi_async_notify_list);
@@ -23,5 +23,6 @@
 #define REDPILL_SCSI_NOTIFIER_LIST_H
 
 extern struct blocking_notifier_head rp_scsi_notify_list;
+extern struct blocking_notifier_head rp_scsi_async_notify_list;
 
 #endif //REDPILL_SCSI_NOTIFIER_LIST_H
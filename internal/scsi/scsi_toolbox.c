@@ -2,16 +2,31 @@
 #include "scsiparam.h" //SCSI_*
 #include "../../common.h"
 #include "../../internal/call_protected.h" //scsi_scan_host_selected()
+#include "scsi_disk_registry.h" //for_each_registered_scsi_disk()
 #include <linux/dma-direction.h> //DMA_FROM_DEVICE
 #include <linux/unaligned/be_byteshift.h> //get_unaligned_be32()
 #include <linux/delay.h> //msleep
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_add(), hash_for_each_possible()
+#include <linux/hash.h> //hash_ptr()
+#include <linux/spinlock.h> //DEFINE_SPINLOCK, spin_*()
+#include <linux/ata.h> //ATA_CMD_ID_ATA, ATA_SECT_SIZE
 #include <scsi/scsi.h> //cmd consts (e.g. SERVICE_ACTION_IN), SCAN_WILD_CARD, and TYPE_DISK
 #include <scsi/scsi_eh.h> //struct scsi_sense_hdr, scsi_sense_valid()
 #include <scsi/scsi_host.h> //struct Scsi_Host, SYNO_PORT_TYPE_SATA
 #include <scsi/scsi_transport.h> //struct scsi_transport_template
-#include <scsi/scsi_device.h> //struct scsi_device, scsi_execute_req(), scsi_is_sdev_device()
+#include <scsi/scsi_device.h> //struct scsi_device, scsi_execute_req(), scsi_is_sdev_device(), scsi_get_vpd_page()
+#include <linux/genhd.h> //get_capacity()
+#include <linux/rcupdate.h> //rcu_read_lock(), rcu_dereference()
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION()
+#include <linux/blkdev.h> //struct request_queue
+#include <linux/kobject.h> //get_ktype()
+#include <../drivers/scsi/sd.h> //struct scsi_disk
+
+#define SCSI_VPD_UNIT_SERIAL 0x80 //Unit Serial Number VPD page
+#define SCSI_VPD_HDR_LEN 4
+#define SCSI_VPD_SERIAL_MAX 64 //SPC doesn't limit it, but ATA serials (translated by libata) are 20 characters
+#define SCSI_ATTR_BUF_SIZE 16
 
-extern struct bus_type scsi_bus_type; //SCSI bus type for driver scanning
 
 /**
  * Issues SCSI "READ CAPACITY (16)" command
@@ -54,7 +69,10 @@ static int scsi_read_cap10(struct scsi_device *sdp, unsigned char *buffer, struc
     return scsi_execute_req(sdp, cmd, DMA_FROM_DEVICE, buffer, 8, sshdr, SCSI_CMD_TIMEOUT, SCSI_CMD_MAX_RETRIES, NULL);
 }
 
-long long opportunistic_read_capacity(struct scsi_device *sdp)
+/**
+ * Does the actual work of opportunistic_read_capacity(), sending commands to the drive every time
+ */
+static long long read_capacity_uncached(struct scsi_device *sdp)
 {
     //some drives work only with the 16 version but older ones can only accept the older variant
     //to prevent false-positive "command failed" we need to try both
@@ -124,6 +142,205 @@ long long opportunistic_read_capacity(struct scsi_device *sdp)
     return size_mb;
 }
 
+/******************************************** Capacity cache **********************************************************/
+//Capacity of the same device is checked multiple times in a row (e.g. by every boot shim during the same probe), and
+// every check means synchronous commands sent to a device which may be slow to respond. Successful reads are cached
+// per scsi_device. Since the cache is keyed by a pointer it's only safe to use when we know about every device removal
+// (i.e. when the disk registry is maintained by the SCSI notifier). Entries are forgotten when the device is probed
+// again, removed or replugged, and ignored when the device reports a media change.
+#define CAPACITY_CACHE_HASH_BITS 5
+
+struct capacity_entry {
+    const struct scsi_device *sdp;
+    long long capacity_mib;
+    struct hlist_node node;
+};
+
+static DEFINE_HASHTABLE(capacity_cache, CAPACITY_CACHE_HASH_BITS);
+static DEFINE_SPINLOCK(capacity_cache_lock);
+
+/**
+ * Detaches an entry for a given device from the cache; must be called with capacity_cache_lock held
+ *
+ * @return entry (to be freed by the caller) or NULL
+ */
+static struct capacity_entry *unlink_capacity(const struct scsi_device *sdp)
+{
+    struct capacity_entry *entry;
+    hash_for_each_possible(capacity_cache, entry, node, hash_ptr((void *)sdp, CAPACITY_CACHE_HASH_BITS)) {
+        if (entry->sdp == sdp) {
+            hash_del(&entry->node);
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+void scsi_forget_capacity(const struct scsi_device *sdp)
+{
+    spin_lock(&capacity_cache_lock);
+    struct capacity_entry *entry = unlink_capacity(sdp);
+    spin_unlock(&capacity_cache_lock);
+
+    kfree(entry);
+}
+
+void scsi_forget_all_capacities(void)
+{
+    int bkt;
+    struct hlist_node *tmp;
+    struct capacity_entry *entry;
+    HLIST_HEAD(removed);
+
+    spin_lock(&capacity_cache_lock);
+    hash_for_each_safe(capacity_cache, bkt, tmp, entry, node) {
+        hash_del(&entry->node);
+        hlist_add_head(&entry->node, &removed);
+    }
+    spin_unlock(&capacity_cache_lock);
+
+    hlist_for_each_entry_safe(entry, tmp, &removed, node) {
+        kfree(entry);
+    }
+}
+
+long long scsi_known_capacity(struct scsi_device *sdp)
+{
+    //sd sets the drvdata in its probe and the capacity when it revalidates the disk (which may happen asynchronously)
+    if (!sdp->sdev_gendev.driver || strcmp(sdp->sdev_gendev.driver->name, SCSI_DRV_NAME) != 0)
+        return -ENODATA;
+
+    struct scsi_disk *sdkp = dev_get_drvdata(&sdp->sdev_gendev);
+    if (!sdkp || !sdkp->disk || unlikely(sdp->changed))
+        return -ENODATA;
+
+    sector_t sectors = get_capacity(sdkp->disk); //always in 512-byte units, regardless of the logical block size
+    if (sectors == 0)
+        return -ENODATA;
+
+    return (long long)(sectors >> (20 - 9));
+}
+
+long long opportunistic_read_capacity(struct scsi_device *sdp)
+{
+    long long known_mib = scsi_known_capacity(sdp);
+    if (known_mib >= 0)
+        return known_mib;
+
+    if (unlikely(!scsi_disk_registry_is_ready()))
+        return read_capacity_uncached(sdp);
+
+    long long capacity_mib = -ENOENT;
+    spin_lock(&capacity_cache_lock);
+    if (unlikely(sdp->changed)) { //media change - whatever we know is stale
+        kfree(unlink_capacity(sdp));
+    } else {
+        struct capacity_entry *entry;
+        hash_for_each_possible(capacity_cache, entry, node, hash_ptr(sdp, CAPACITY_CACHE_HASH_BITS)) {
+            if (entry->sdp == sdp) {
+                capacity_mib = entry->capacity_mib;
+                break;
+            }
+        }
+    }
+    spin_unlock(&capacity_cache_lock);
+
+    if (capacity_mib >= 0)
+        return capacity_mib;
+
+    capacity_mib = read_capacity_uncached(sdp);
+    if (capacity_mib < 0)
+        return capacity_mib; //errors aren't cached - the device may just be spinning up
+
+    struct capacity_entry *entry = kmalloc(sizeof(struct capacity_entry), GFP_KERNEL);
+    if (unlikely(!entry))
+        return capacity_mib; //not caching is not an error
+
+    entry->sdp = sdp;
+    entry->capacity_mib = capacity_mib;
+    spin_lock(&capacity_cache_lock);
+    struct capacity_entry *old = unlink_capacity(sdp); //somebody could've read it in parallel
+    hash_add(capacity_cache, &entry->node, hash_ptr(sdp, CAPACITY_CACHE_HASH_BITS));
+    spin_unlock(&capacity_cache_lock);
+    kfree(old);
+
+    return capacity_mib;
+}
+
+/**
+ * Copies serial from a VPD 0x80 page to a NUL-terminated buffer, stripping padding
+ */
+static int copy_unit_serial(const unsigned char *vpd, size_t vpd_len, char *serial, size_t size)
+{
+    if (vpd_len < SCSI_VPD_HDR_LEN)
+        return -EIO;
+
+    size_t len = min_t(size_t, vpd[3], vpd_len - SCSI_VPD_HDR_LEN);
+    const unsigned char *begin = vpd + SCSI_VPD_HDR_LEN;
+    while (len > 0 && begin[0] == ' ') { //serials are usually right-aligned with spaces
+        ++begin;
+        --len;
+    }
+    while (len > 0 && (begin[len - 1] == ' ' || begin[len - 1] == '\0'))
+        --len;
+
+    if (len >= size)
+        return -E2BIG;
+
+    memcpy(serial, begin, len);
+    serial[len] = '\0';
+    return 0;
+}
+
+int scsi_get_unit_serial(struct scsi_device *sdp, char *serial, size_t size, bool allow_io)
+{
+    int out = -ENODATA;
+
+//The SCSI layer caches VPD pages since v3.15; v4.18 changed it to struct scsi_vpd
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0) && LINUX_VERSION_CODE < KERNEL_VERSION(4,18,0)
+    rcu_read_lock();
+    const unsigned char *cached = rcu_dereference(sdp->vpd_pg80);
+    if (cached)
+        out = copy_unit_serial(cached, sdp->vpd_pg80_len, serial, size);
+    rcu_read_unlock();
+
+    if (out != -ENODATA)
+        return out;
+#endif
+
+    if (!allow_io)
+        return out;
+
+    unsigned char *vpd;
+    kmalloc_or_exit_int(vpd, SCSI_VPD_HDR_LEN + SCSI_VPD_SERIAL_MAX); //it's DMAed to so it must not be on stack
+    out = scsi_get_vpd_page(sdp, SCSI_VPD_UNIT_SERIAL, vpd, SCSI_VPD_HDR_LEN + SCSI_VPD_SERIAL_MAX);
+    if (out == 0)
+        out = copy_unit_serial(vpd, SCSI_VPD_HDR_LEN + SCSI_VPD_SERIAL_MAX, serial, size);
+    else if (out > 0)
+        out = -EIO;
+
+    kfree(vpd);
+    return out;
+}
+
+int scsi_ata_identify(struct scsi_device *sdp, u16 *id)
+{
+    unsigned char cmd[16];
+    memset(cmd, 0, 16);
+    cmd[0] = ATA_16;
+    cmd[1] = SCSI_ATA16_PROTO_PIO_IN;
+    cmd[2] = SCSI_ATA16_TDIR_BLK_SECT;
+    cmd[6] = 1; //sector count
+    cmd[14] = ATA_CMD_ID_ATA;
+
+    //No retries: a device which doesn't understand ATA_16 will not change its mind, and a real ATA one never fails it
+    struct scsi_sense_hdr sshdr;
+    int out = scsi_execute_req(sdp, cmd, DMA_FROM_DEVICE, id, ATA_SECT_SIZE, &sshdr, SCSI_CMD_TIMEOUT, 1, NULL);
+
+    return (out == 0) ? 0 : -EIO;
+}
+
 bool is_scsi_disk(struct scsi_device *sdp)
 {
     return (likely(sdp) && (sdp)->type == TYPE_DISK);
@@ -146,6 +363,48 @@ bool is_sata_disk(struct device *dev)
     return true;
 }
 
+int scsi_store_queue_attr(struct scsi_device *sdp, const char *name, unsigned int value)
+{
+    struct request_queue *q = sdp->request_queue;
+    struct kobj_type *ktype = get_ktype(&q->kobj);
+    if (unlikely(!ktype || !ktype->sysfs_ops || !ktype->sysfs_ops->store || !ktype->default_attrs))
+        return -ENOENT;
+
+    for (struct attribute **attr = ktype->default_attrs; *attr; ++attr) {
+        if (strcmp((*attr)->name, name) != 0)
+            continue;
+
+        char buf[SCSI_ATTR_BUF_SIZE];
+        int len = snprintf(buf, sizeof(buf), "%u", value);
+        ssize_t out = ktype->sysfs_ops->store(&q->kobj, *attr, buf, len);
+        return out < 0 ? out : 0;
+    }
+
+    return -ENOENT;
+}
+
+int scsi_store_host_attr(struct scsi_device *sdp, const char *name, unsigned int value)
+{
+    struct device_attribute **attrs = sdp->host->hostt->sdev_attrs;
+    if (!attrs)
+        return -ENOENT;
+
+    for (; *attrs; ++attrs) {
+        if (strcmp((*attrs)->attr.name, name) != 0)
+            continue;
+
+        if (unlikely(!(*attrs)->store))
+            return -EPERM;
+
+        char buf[SCSI_ATTR_BUF_SIZE];
+        int len = snprintf(buf, sizeof(buf), "%u", value);
+        ssize_t out = (*attrs)->store(&sdp->sdev_gendev, *attrs, buf, len);
+        return out < 0 ? out : 0;
+    }
+
+    return -ENOENT;
+}
+
 int scsi_force_replug(scsi_device *sdp)
 {
     if (unlikely(!is_scsi_leaf(&sdp->sdev_gendev))) {
@@ -155,8 +414,39 @@ int scsi_force_replug(scsi_device *sdp)
 
     struct Scsi_Host *host = sdp->host;
     pr_loc_dbg("Removing device from host%d", host->host_no);
+    scsi_forget_capacity(sdp);
     scsi_remove_device(sdp); //this will do locking for remove
 
+    return scsi_rescan_host(host);
+}
+
+int scsi_reprobe_device(scsi_device *sdp)
+{
+    if (unlikely(!is_scsi_leaf(&sdp->sdev_gendev))) {
+        pr_loc_bug("%s expected SCSI leaf - got something else", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    //A device which isn't running (e.g. it's being deleted or its host is being removed) cannot be probed again
+    if (sdp->sdev_state != SDEV_RUNNING) {
+        pr_loc_dbg("Device %u:%u:%u:%llu is not running (state=%d) - falling back to replug", sdp->host->host_no,
+                   sdp->channel, sdp->id, (u64)sdp->lun, sdp->sdev_state);
+        return scsi_force_replug(sdp);
+    }
+
+    pr_loc_dbg("Reprobing device %u:%u:%u:%llu", sdp->host->host_no, sdp->channel, sdp->id, (u64)sdp->lun);
+    scsi_forget_capacity(sdp);
+    int out = scsi_device_reprobe(sdp); //unbinds sd (if bound) and binds it again
+    if (unlikely(out != 0)) {
+        pr_loc_wrn("Failed to reprobe device (error=%d) - falling back to replug", out);
+        return scsi_force_replug(sdp);
+    }
+
+    return 0;
+}
+
+int scsi_rescan_host(struct Scsi_Host *host)
+{
     //See drivers/scsi/scsi_sysfs.c:scsi_scan() for details
     if (unlikely(host->transportt->user_scan)) {
         pr_loc_dbg("Triggering template-based rescan of host%d", host->host_no);
@@ -242,5 +532,9 @@ int for_each_scsi_leaf(on_scsi_device_cb *cb)
 
 int for_each_scsi_disk(on_scsi_device_cb *cb)
 {
+    //the registry contains only disks so there's no need to walk (and filter) everything on the bus
+    if (likely(scsi_disk_registry_is_ready()))
+        return for_each_registered_scsi_disk(cb);
+
     return for_each_scsi_x(cb, for_each_scsi_disk_filter);
 }
\ No newline at end of file
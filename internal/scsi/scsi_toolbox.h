@@ -5,12 +5,18 @@
 
 typedef struct device device;
 typedef struct scsi_device scsi_device;
+struct Scsi_Host;
 typedef int (on_scsi_device_cb)(struct scsi_device *sdp);
 
+extern struct bus_type scsi_bus_type; //SCSI bus type for driver scanning (exported but declared in a private header)
+//Domain of sd's async probe parts (incl. the revalidation which reads disk characteristics); exported the same way
+extern struct async_domain scsi_sd_probe_domain;
+
 #define SCSI_DRV_NAME "sd" //useful for triggering watchers
 //To use this one import intercept_driver_register.h header (it's not imported here to avoid pollution)
+//The sd driver binds to devices on the SCSI bus so the bus notifier mode is used - it doesn't touch driver_register()
 #define watch_scsi_driver_register(callback, event_mask) \
-    watch_driver_register(SCSI_DRV_NAME, (callback), (event_mask))
+    watch_driver_bus(SCSI_DRV_NAME, &scsi_bus_type, (callback), (event_mask))
 
 #define IS_SCSI_DRIVER_ERROR(state) (unlikely((state) < 0))
 typedef enum {
@@ -37,11 +43,58 @@ typedef enum {
  * Thus this function should be seen as a way to quickly estimate (as it reports full mebibytes rounded down) the
  * capacity without causing side effects.
  *
+ * No commands are sent when the capacity is already known to the SCSI layer (see scsi_known_capacity()). Otherwise
+ * successful results are cached per device (when the SCSI notifier is active - see scsi_forget_capacity()), so calling
+ * this multiple times for the same device is cheap.
+ *
  * @param sdp
  * @return capacity in full mebibytes, or -E on error
  */
 long long opportunistic_read_capacity(struct scsi_device *sdp);
 
+/**
+ * Gets capacity of a disk which was already probed & revalidated by the sd driver, without sending any commands
+ *
+ * @return capacity in full mebibytes, or -ENODATA if the disk isn't bound to sd or its capacity isn't known yet
+ */
+long long scsi_known_capacity(struct scsi_device *sdp);
+
+/**
+ * Gets unit serial number of a device (VPD page 0x80), stripped of padding
+ *
+ * The copy cached by the SCSI layer is used if available (kernels >=v3.15 read it during the scan).
+ *
+ * @param sdp
+ * @param serial buffer to save the NUL-terminated serial to
+ * @param size size of the buffer
+ * @param allow_io whether the page can be requested from the device if it's not cached
+ * @return 0 on success, -ENODATA if it's not cached and allow_io is false, -E2BIG if it doesn't fit, or other -E
+ */
+int scsi_get_unit_serial(struct scsi_device *sdp, char *serial, size_t size, bool allow_io);
+
+/**
+ * Drops cached result of opportunistic_read_capacity() for a device; call it when the device goes away or is reprobed
+ */
+void scsi_forget_capacity(const struct scsi_device *sdp);
+
+/**
+ * Drops all cached results of opportunistic_read_capacity(); used when removals can no longer be tracked
+ */
+void scsi_forget_all_capacities(void);
+
+/**
+ * Issues ATA IDENTIFY DEVICE to a disk using SCSI "ATA PASS-THROUGH (16)" command
+ *
+ * This is the same path libata takes for HDIO_DRIVE_CMD ioctl(). Thus, a device which answers this command will also
+ * answer ATA ioctl()s coming from the userspace. Devices which don't speak ATA (e.g. VirtIO, VMware PVSCSI, many USB
+ * bridges) will simply reject it.
+ *
+ * @param sdp
+ * @param id buffer for ATA_ID_WORDS words of IDENTIFY data; it's DMAed to so it must be kmalloc-ed (not on stack)
+ * @return 0 on success, -EIO if the device rejected the command, or other -E on error
+ */
+int scsi_ata_identify(struct scsi_device *sdp, u16 *id);
+
 /**
  * Checks if a SCSI device is a SCSI-complain disk (e.g. SATA, SAS, iSCSI etc)
  *
@@ -56,6 +109,24 @@ bool is_scsi_disk(struct scsi_device *sdp);
  */
 bool is_sata_disk(struct device *dev);
 
+/**
+ * Sets a queue attribute of a device like writing to /sys/block/<disk>/queue/<name> would
+ *
+ * The change goes through the same sysfs handler the userspace would use, so it's validated & locked by the kernel.
+ *
+ * @return 0 on success, -ENOENT if there's no such attribute, or -E returned by the attribute
+ */
+int scsi_store_queue_attr(struct scsi_device *sdp, const char *name, unsigned int value);
+
+/**
+ * Sets a device attribute provided by the SCSI host driver, like writing to /sys/bus/scsi/devices/<h:c:t:l>/<name>
+ *
+ * Only attributes defined by the host template are considered (e.g. "max_sectors" of usb-storage), not generic ones.
+ *
+ * @return 0 on success, -ENOENT if the host driver has no such attribute, or -E returned by the attribute
+ */
+int scsi_store_host_attr(struct scsi_device *sdp, const char *name, unsigned int value);
+
 /**
  * Triggers a re-probe of SCSI leaf device by forcefully "unplugging" and "replugging" the device
  *
@@ -66,6 +137,29 @@ bool is_sata_disk(struct device *dev);
  */
 int scsi_force_replug(scsi_device *sdp);
 
+/**
+ * Triggers a re-probe of SCSI leaf device by the sd driver alone, without removing the device or scanning its host
+ *
+ * The existing scsi_device is kept (so no INQUIRY is sent again and no siblings are scanned) and only sd_remove() +
+ * sd_probe() are run. This is enough when only the decisions made by sd_probe() need to be redone (e.g. the boot disk
+ * type). If the device cannot be reprobed (e.g. it's being removed) it falls back to scsi_force_replug().
+ *
+ * WARNING: the same warning as for scsi_force_replug() applies - the disk disappears from the system for a moment!
+ *
+ * @return 0 on success, -E on error
+ */
+int scsi_reprobe_device(scsi_device *sdp);
+
+/**
+ * Scans all channels/targets/LUNs of a host, adding devices which aren't known (e.g. removed by scsi_remove_device())
+ *
+ * This is the second half of scsi_force_replug(). It's useful when many devices of the same host need to be replugged:
+ * all of them can be removed first, and then the host is scanned just once.
+ *
+ * @return 0 on success, -E on error
+ */
+int scsi_rescan_host(struct Scsi_Host *host);
+
 /**
  * Locates & returns SCSI driver structure if loaded
  *
@@ -93,6 +187,9 @@ int for_each_scsi_leaf(on_scsi_device_cb *cb);
 /**
  * Traverses list of all SCSI devices and calls the callback with every SCSCI-complaint disk found
  *
+ * When the SCSI notifier is active this uses its registry of disks bound to sd (see scsi_disk_registry.h) instead of
+ * walking the whole bus. In that case disks which sd refused to bind to are not included.
+ *
  * @return 0 on success, -E on failure. -ENXIO is reserved to always mean that the driver is not loaded
  */
 int for_each_scsi_disk(on_scsi_device_cb *cb);
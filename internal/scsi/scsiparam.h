@@ -13,6 +13,34 @@
 #define SCSI_CAP_MAX_RETRIES 3
 #define SCSI_BUF_SIZE 512 //originally defined in drivers/scsi/sd.h as SD_BUF_SIZE
 
+//ATA PASS-THROUGH (16) fields, see SAT-3 sec. 12.2.2; values are the same as libata's ata_cmd_ioctl() uses
+#define SCSI_ATA16_PROTO_PIO_IN (4 << 1) //byte 1: protocol = PIO Data-In
+#define SCSI_ATA16_TDIR_BLK_SECT 0x0e //byte 2: t_dir=from dev, byt_blok=blocks, t_length=in sector count
+#define SCSI_ATA_CK_COND 0x20 //byte 2 of both ATA_12 & ATA_16: return ATA registers in sense data even on success
+
+//Byte offsets of ATA registers in ATA PASS-THROUGH CDBs (only the low/current bytes for ATA_16)
+#define SCSI_ATA12_FEATURE 3
+#define SCSI_ATA12_NSECT 4
+#define SCSI_ATA12_LBAL 5
+#define SCSI_ATA12_LBAM 6
+#define SCSI_ATA12_LBAH 7
+#define SCSI_ATA12_DEVICE 8
+#define SCSI_ATA12_COMMAND 9
+#define SCSI_ATA16_FEATURE 4
+#define SCSI_ATA16_NSECT 6
+#define SCSI_ATA16_LBAL 8
+#define SCSI_ATA16_LBAM 10
+#define SCSI_ATA16_LBAH 12
+#define SCSI_ATA16_DEVICE 13
+#define SCSI_ATA16_COMMAND 14
+
+//Descriptor-format sense with "ATA Status Return" descriptor, see SAT-3 sec. 12.2.2.6; the layout libata uses
+#define SCSI_SENSE_DESC_FORMAT 0x72
+#define SCSI_ASCQ_ATA_PT_INFO 0x1d //ASC=0x00 ASCQ=0x1d: "ATA pass through information available"
+#define SCSI_ATA_RET_DESC 0x09
+#define SCSI_ATA_RET_DESC_LEN 0x0c
+#define SCSI_ATA_RET_SENSE_LEN (8 + 2 + SCSI_ATA_RET_DESC_LEN) //sense header + descriptor header + descriptor
+
 //Old kernels used ambiguous constant: https://github.com/torvalds/linux/commit/eb846d9f147455e4e5e1863bfb5e31974bb69b7c
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
 #define SCSI_SERVICE_ACTION_IN_16 SERVICE_ACTION_IN
@@ -21,7 +21,7 @@ int initialize_stealth(void *config2)
 
 #if STEALTH_MODE > STEALTH_MODE_OFF
     //These are STEALTH_MODE_BASIC ones
-    if ((error = register_stealth_sanitize_cmdline(config->cmdline_blacklist)) != 0)
+    if ((error = register_stealth_sanitize_cmdline(config->cmdline_blacklist, config->cmdline_blacklist_num)) != 0)
         return error;
 #endif
 
@@ -7,22 +7,33 @@
  * boot params.
  *
  * HOW IT WORKS?
- * The module overrides cmdline_proc_show() from fs/proc/cmdline.c with a jump to our implementation. The implementation
+ * When cmdline_proc_fops from fs/proc/cmdline.c can be found (it's a data symbol, so it's only visible in kallsyms
+ * with CONFIG_KALLSYMS_ALL) its .open pointer is swapped to our open, which does single_open() with our show. This is
+ * a single pointer write in .rodata (the same way smart_shim replaces sd_fops->ioctl), so no code is patched and
+ * reads don't go through any trampoline. Files which are already opened keep the original show. Files opened by us
+ * keep our show in their seq_file even after the pointer is restored, so their f_op is replaced with a copy owned by
+ * the module - the VFS pins the module for as long as any of them is open. The shared .release is never touched.
+ * Otherwise, the module overrides cmdline_proc_show() with a jump to our implementation. Either way the implementation
  * here serves a filtrated version of the cmdline.
  *
- * WHY OVERRIDE A STATIC METHOD?
+ * WHY NOT THE PROC ENTRY?
  * This module has actually been rewritten to hard-override cmdline_proc_show() instead of "gently" finding the dentry
  * for /proc/cmdline, and then without modifying the dentry replacing the read operation in file_operations struct.
  * While this method is much cleaner and less invasive it has two problems:
  *  - Requires "struct proc_dir_entry" (which is internal and thus not available in toolkit builds)
  *  - Doesn't work if the module is loaded as ioscheduler (as funny enough this code will execute BEFORE /proc/cmdline
  *    is created)
- * This change has been made in commit "Rewrite cmdline sanitize to replace cmdline_proc_show".
+ * This change has been made in commit "Rewrite cmdline sanitize to replace cmdline_proc_show". Swapping the pointer in
+ * cmdline_proc_fops has neither of these problems: the struct is found by its symbol (no proc internals are needed)
+ * and it exists in the kernel image before /proc/cmdline is registered.
  *
  * FILTRATION
  * The second part of the code deals with the actual filtration. List of blacklisted entries is passed during
  * registration (to allow flexibility). Usually it will be gathered form pre-generated config. Then a filtrated copy of
- * cmdline is created once (as this is a quite expensive string-ridden operation).
+ * cmdline is created once, along with its length, so that every read of /proc/cmdline (which DSM scripts do a lot) is
+ * a single seq_write(). Blacklist entries are full option keys ("key=" for options with values, "key" for switches)
+ * and tokens are matched against them with a hash lookup of their key, so "earlyprintk" blacklists both
+ * "earlyprintk" and "earlyprintk=serial", but "syno_" would never match anything.
  * The only sort-of way to find the original implementation is to access the kmesg buffer where the original cmdline is
  * baked into early on boot. Technically we can replace that too but this will get veeery messy and I doubt anyone will
  * try dig through kmesg messages with a regex for cmdline (especially that with a small dmesg buffer it will roll over)
@@ -32,34 +43,72 @@
 #include "../../common.h"
 #include "../../config/cmdline_delegate.h" //get_kernel_cmdline() & CMDLINE_MAX
 #include "../override/override_symbol.h" //override_symbol() & restore_symbol()
-#include <linux/seq_file.h> //seq_file, seq_printf()
+#include "../call_protected.h" //lookup_protected_symbol()
+#include "../helper/memory_helper.h" //WITH_MEM_WRITE_WINDOW()
+#include <linux/fs.h> //struct file_operations
+#include <linux/seq_file.h> //seq_file, seq_write()
+#include <linux/module.h> //try_module_get(), module_put()
+#include <linux/spinlock.h> //DEFINE_SPINLOCK()
 
 /**
- * Pre-generated filtered cmdline (by default it's an empty string in case it's somehow printed before filtration)
+ * Pre-generated filtered cmdline, including the trailing new line (it's not NULL-terminated!)
  * See filtrate_cmdline() for details
  */
 static char *filtrated_cmdline = NULL;
+static size_t filtrated_cmdline_len = 0;
 
-/**
- * Check if a given cmdline token is on the blacklist
- */
-static bool
-is_token_blacklisted(const char *param_pointer, cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS]) {
-    for (int i = 0; i < MAX_BLACKLISTED_CMDLINE_TOKENS; i++) {
-        if (!cmdline_blacklist[i])
-            return false;
+//Open-addressed index of blacklisted keys by their hash; it's only used while filtrating the cmdline
+#define BLACKLIST_INDEX_BITS 5
+#define BLACKLIST_INDEX_SIZE (1 << BLACKLIST_INDEX_BITS)
+struct blacklist_index {
+    const struct cmdline_token *tokens; //lengths & hashes are precomputed by the config
+    u8 slots[BLACKLIST_INDEX_SIZE]; //token index + 1 (0 = empty)
+};
+
+static void build_blacklist_index(struct blacklist_index *index, const struct cmdline_token *cmdline_blacklist,
+                                  unsigned int blacklist_num)
+{
+    BUILD_BUG_ON(MAX_BLACKLISTED_CMDLINE_TOKENS >= BLACKLIST_INDEX_SIZE / 2); //keep the index sparse
 
-        if (strncmp(param_pointer, (char *)cmdline_blacklist[i], strlen((char *)cmdline_blacklist[i])) == 0)
+    memset(index, 0, sizeof(*index));
+    index->tokens = cmdline_blacklist;
+    for (unsigned int i = 0; i < blacklist_num; i++) {
+        u32 slot = cmdline_blacklist[i].hash & (BLACKLIST_INDEX_SIZE - 1);
+        while (index->slots[slot] != 0)
+            slot = (slot + 1) & (BLACKLIST_INDEX_SIZE - 1);
+        index->slots[slot] = i + 1;
+    }
+}
+
+static bool is_key_blacklisted(const struct blacklist_index *index, const char *key, size_t len)
+{
+    u32 hash = cmdline_token_hash(key, len);
+    for (u32 slot = hash & (BLACKLIST_INDEX_SIZE - 1); index->slots[slot] != 0;
+         slot = (slot + 1) & (BLACKLIST_INDEX_SIZE - 1)) {
+        const struct cmdline_token *token = &index->tokens[index->slots[slot] - 1];
+        if (token->hash == hash && token->len == len && memcmp(token->key, key, len) == 0)
             return true;
     }
 
     return false;
 }
 
+/**
+ * Check if a given cmdline token is on the blacklist, i.e. its "key=" or "key" is
+ */
+static bool is_token_blacklisted(const struct blacklist_index *index, const char *token, size_t token_len)
+{
+    const char *eq = memchr(token, '=', token_len);
+    if (!eq)
+        return is_key_blacklisted(index, token, token_len);
+
+    return is_key_blacklisted(index, token, eq - token + 1) || is_key_blacklisted(index, token, eq - token);
+}
+
 /**
  * Filters-out all blacklisted entries from the cmdline string (fetched from /proc/cmdline)
  */
-static int filtrate_cmdline(cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS])
+static int filtrate_cmdline(const struct cmdline_token *cmdline_blacklist, unsigned int blacklist_num)
 {
     char *raw_cmdline;
     kmalloc_or_exit_int(raw_cmdline, strlen_to_size(CMDLINE_MAX));
@@ -71,35 +120,42 @@ static int filtrate_cmdline(cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMD
         return (int) cmdline_len;
     }
 
-    filtrated_cmdline = kmalloc(strlen_to_size(cmdline_len), GFP_KERNEL);
-    if (unlikely(!filtrated_cmdline)) {
+    struct blacklist_index *index = kmalloc(sizeof(struct blacklist_index), GFP_KERNEL);
+    filtrated_cmdline = kmalloc(strlen_to_size(cmdline_len), GFP_KERNEL); //+1 is used for the new line
+    if (unlikely(!filtrated_cmdline || !index)) {
         kfree(raw_cmdline);
+        kfree(index);
+        kfree(filtrated_cmdline);
         kalloc_error_int(filtrated_cmdline, strlen_to_size(cmdline_len));
     }
+    build_blacklist_index(index, cmdline_blacklist, blacklist_num);
 
-    char *single_param_chunk; //Pointer to the beginning of the cmdline token
+    const char *cursor = raw_cmdline;
     char *filtrated_ptr = &filtrated_cmdline[0]; //Pointer to the current position in filtered
+    while (*cursor != '\0') {
+        cursor += strspn(cursor, CMDLINE_SEP); //Skip empty
+        size_t curr_param_len = strcspn(cursor, CMDLINE_SEP);
+        if (curr_param_len == 0)
+            break;
 
-    size_t curr_param_len;
-    while ((single_param_chunk = strsep(&raw_cmdline, CMDLINE_SEP)) != NULL) {
-        if (single_param_chunk[0] == '\0') //Skip empty
-            continue;
-
-        if (is_token_blacklisted(single_param_chunk, cmdline_blacklist)) {
-            pr_loc_dbg("Cmdline param \"%s\" blacklisted - skipping", single_param_chunk);
-            continue;
+        if (is_token_blacklisted(index, cursor, curr_param_len)) {
+            pr_loc_dbg("Cmdline param \"%.*s\" blacklisted - skipping", (int)curr_param_len, cursor);
+        } else {
+            if (filtrated_ptr != filtrated_cmdline)
+                *(filtrated_ptr++) = ' ';
+            memcpy(filtrated_ptr, cursor, curr_param_len);
+            filtrated_ptr += curr_param_len;
         }
 
-        curr_param_len = strlen(single_param_chunk);
-        memcpy(filtrated_ptr, single_param_chunk, curr_param_len);
-        filtrated_ptr += curr_param_len;
-        *(filtrated_ptr++) = ' ';
+        cursor += curr_param_len;
     }
 
-    *(filtrated_ptr-1) = '\0'; //Terminate whole param string (removing the trailing space)
+    *(filtrated_ptr++) = '\n';
+    filtrated_cmdline_len = filtrated_ptr - filtrated_cmdline;
+    kfree(index);
     kfree(raw_cmdline);
 
-    pr_loc_dbg("Sanitized cmdline to: %s", filtrated_cmdline);
+    pr_loc_dbg("Sanitized cmdline to: %.*s", (int)filtrated_cmdline_len - 1, filtrated_cmdline);
 
     return 0;
 }
@@ -109,14 +165,121 @@ static int filtrate_cmdline(cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMD
  */
 static int cmdline_proc_show_filtered(struct seq_file *m, void *v)
 {
-    seq_printf(m, "%s\n", filtrated_cmdline);
+    seq_write(m, filtrated_cmdline, filtrated_cmdline_len);
+    return 0;
+}
+
+static struct file_operations *cmdline_fops = NULL; //fs/proc/cmdline.c:cmdline_proc_fops (while .open is swapped)
+static int (*cmdline_proc_open_org)(struct inode *inode, struct file *file) = NULL;
+
+//Module-owned copy of f_op of files opened by us (see get_filtered_fops())
+static struct file_operations cmdline_filtered_fops;
+static const struct file_operations *cmdline_filtered_fops_src = NULL;
+static DEFINE_SPINLOCK(cmdline_filtered_fops_lock);
+
+/**
+ * Gets a copy of fops a file was opened with, owned by this module
+ *
+ * The file isn't necessarily opened with cmdline_proc_fops directly (e.g. procfs wraps them with its proc_reg_* ops
+ * which track openers), so the copy is made from the f_op of the first file opened and all its ops stay the kernel's
+ * ones. The only difference is the .owner, so that the VFS pins this module for as long as any file opened by us is
+ * open (as our show is stored in its seq_file).
+ *
+ * @return copy or NULL if the file has an f_op which cannot be copied
+ */
+static const struct file_operations *get_filtered_fops(const struct file_operations *src)
+{
+    const struct file_operations *out = NULL;
+
+    spin_lock(&cmdline_filtered_fops_lock);
+    if (!cmdline_filtered_fops_src && !src->owner) {
+        cmdline_filtered_fops = *src;
+        cmdline_filtered_fops.owner = THIS_MODULE;
+        cmdline_filtered_fops_src = src;
+    }
+    if (cmdline_filtered_fops_src == src)
+        out = &cmdline_filtered_fops;
+    spin_unlock(&cmdline_filtered_fops_lock);
+
+    return out;
+}
+
+static int cmdline_proc_open_filtered(struct inode *inode, struct file *file)
+{
+    const struct file_operations *fops = get_filtered_fops(file->f_op);
+    if (unlikely(!fops)) {
+        pr_loc_bug("Cannot copy f_op<%p> of /proc/cmdline - serving the original", file->f_op);
+        return cmdline_proc_open_org(inode, file);
+    }
+
+    //The module is going away (and the pointer is about to be restored) - nothing can be served from it anymore
+    //Otherwise this is the reference of the new f_op, dropped by fops_put() in __fput()
+    if (unlikely(!try_module_get(THIS_MODULE)))
+        return cmdline_proc_open_org(inode, file);
+
+    int out = single_open(file, cmdline_proc_show_filtered, NULL);
+    if (unlikely(out != 0)) {
+        module_put(THIS_MODULE);
+        return out;
+    }
+
+    //The original f_op has no owner (checked above), so there's no reference to drop (i.e. no replace_fops() needed)
+    file->f_op = fops;
+
     return 0;
 }
 
 static override_symbol_inst *ov_cmdline_proc_show = NULL;
-int register_stealth_sanitize_cmdline(cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS])
+
+/**
+ * Swaps cmdline_proc_fops.open to serve the filtrated cmdline
+ *
+ * @return 0 on success, -ENOENT if cmdline_proc_fops cannot be found (i.e. override should be used), -E on error
+ */
+static int swap_cmdline_fops(void)
+{
+    struct file_operations *fops = (void *)lookup_protected_symbol("cmdline_proc_fops"); //remove "const" forcefully
+    if (!fops) {
+        pr_loc_dbg("cmdline_proc_fops is not available - falling back to overriding cmdline_proc_show");
+        return -ENOENT;
+    }
+
+    if (unlikely(!fops->open)) {
+        pr_loc_bug("cmdline_proc_fops<%p> has no open()", fops);
+        return -EINVAL;
+    }
+
+    pr_loc_dbg("Rerouting cmdline_proc_fops.open<%p>=%pF to %pF", &fops->open, fops->open, cmdline_proc_open_filtered);
+    cmdline_proc_open_org = fops->open;
+    WITH_MEM_WRITE_WINDOW(
+        fops->open = cmdline_proc_open_filtered;
+    );
+    cmdline_fops = fops;
+
+    return 0;
+}
+
+/**
+ * Restores the original cmdline_proc_fops.open
+ *
+ * This is only reached when the module is unloaded, i.e. when no file opened by us is left (each one pins the module
+ * through its f_op). Files opened by the original open never run any of our code.
+ */
+static void restore_cmdline_fops(void)
+{
+    pr_loc_dbg("Restoring cmdline_proc_fops.open<%p>=%pF to %pF", &cmdline_fops->open, cmdline_fops->open,
+               cmdline_proc_open_org);
+    WITH_MEM_WRITE_WINDOW(
+        cmdline_fops->open = cmdline_proc_open_org;
+    );
+
+    cmdline_fops = NULL;
+    cmdline_proc_open_org = NULL;
+}
+
+int register_stealth_sanitize_cmdline(const struct cmdline_token *cmdline_blacklist, unsigned int blacklist_num)
 {
-    if (unlikely(ov_cmdline_proc_show)) {
+    if (unlikely(ov_cmdline_proc_show || cmdline_fops)) {
         pr_loc_bug("Attempted to %s while already registered", __FUNCTION__);
         return 0; //Technically it succeeded
     }
@@ -124,8 +287,16 @@ int register_stealth_sanitize_cmdline(cmdline_token *cmdline_blacklist[MAX_BLACK
     int out;
     //This has to be done once (we're assuming cmdline doesn't change without reboot). In case this submodule is
     // re-registered the filtrated_cmdline is left as-is and reused
-    if (!filtrated_cmdline && (out = filtrate_cmdline(cmdline_blacklist)) != 0)
+    if (!filtrated_cmdline && (out = filtrate_cmdline(cmdline_blacklist, blacklist_num)) != 0)
+        return out;
+
+    out = swap_cmdline_fops();
+    if (out == 0) {
+        pr_loc_inf("/proc/cmdline sanitized (fops)");
+        return 0;
+    } else if (out != -ENOENT) {
         return out;
+    }
 
     ov_cmdline_proc_show = override_symbol("cmdline_proc_show", cmdline_proc_show_filtered);
     if (unlikely(IS_ERR(ov_cmdline_proc_show))) {
@@ -142,16 +313,23 @@ int register_stealth_sanitize_cmdline(cmdline_token *cmdline_blacklist[MAX_BLACK
 
 int unregister_stealth_sanitize_cmdline(void)
 {
-    if (unlikely(!ov_cmdline_proc_show)) {
+    if (unlikely(!ov_cmdline_proc_show && !cmdline_fops)) {
         pr_loc_bug("Attempted to %s while it's not registered", __FUNCTION__);
         return 0; //Technically it succeeded
     }
 
-    int out = restore_symbol(ov_cmdline_proc_show);
+    int out = 0;
+    if (cmdline_fops) {
+        restore_cmdline_fops();
+    } else {
+        out = restore_symbol(ov_cmdline_proc_show);
+        ov_cmdline_proc_show = NULL;
+    }
     //We deliberately fall through here without checking as we have to free stuff at this point no matter what
 
     kfree(filtrated_cmdline);
     filtrated_cmdline = NULL;
+    filtrated_cmdline_len = 0;
 
     if (likely(out == 0))
         pr_loc_inf("Original /proc/cmdline restored");
@@ -1,17 +1,18 @@
 #ifndef REDPILL_SANITIZE_CMDLINE_H
 #define REDPILL_SANITIZE_CMDLINE_H
 
-#include "../../config/cmdline_delegate.h" //MAX_BLACKLISTED_CMDLINE_TOKENS
+#include "../../config/cmdline_delegate.h" //struct cmdline_token
 
 /**
  * Register submodule sanitizing /proc/cmdline
  *
  * After registration /proc/cmdline will be non-destructively cleared from entries listed in cmdline_blacklist param.
+ * The blacklist is only used during registration (it's not copied nor referenced afterwards).
  * It can be reversed using unregister_stealth_sanitize_cmdline()
  *
  * @return 0 on success, -E on error
  */
-int register_stealth_sanitize_cmdline(cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS]);
+int register_stealth_sanitize_cmdline(const struct cmdline_token *cmdline_blacklist, unsigned int blacklist_num);
 
 /**
  * Reverses what register_stealth_sanitize_cmdline() did
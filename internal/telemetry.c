@@ -0,0 +1,308 @@
+/**
+ * Generic netlink telemetry - see header file for the protocol
+ *
+ * The family went through three registration APIs within the kernels we support: before v3.13 multicast groups were
+ * registered separately and addressed by their global id, v3.13 moved them into the family (addressed by index) and
+ * v4.10 moved the ops there as well. Everything version-specific is kept in the "Family" section.
+ */
+#include "telemetry.h"
+
+#ifdef TELEMETRY_ENABLED
+#include "../common.h"
+#include "hook_stats.h" //hook_stats_get(), hook_stats_name()
+#include "boot_trace.h" //boot_trace_get_samples()
+#include "uart/virtual_uart.h" //for_each_vuart_stats()
+#include "helper/tunables.h" //register_rp_tunable()
+#include "housekeeping.h" //housekeeping_wq()
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION()
+#include <linux/moduleparam.h> //module_param_named()
+#include <linux/workqueue.h> //DECLARE_DELAYED_WORK, queue_delayed_work()
+#include <linux/jiffies.h> //msecs_to_jiffies()
+#include <linux/ktime.h> //ktime_get()
+#include <linux/netlink.h> //netlink_has_listeners()
+#include <net/genetlink.h> //genl_*(), genlmsg_*()
+#include <net/net_namespace.h> //init_net
+
+#define TLM_PUSH_DEFAULT_MS 5000
+#define TLM_PUSH_MIN_MS 500
+#define TLM_PUSH_MAX_MS 3600000
+#define TLM_BOOT_STEPS_MAX 64 //the same as max boot trace entries
+#define TLM_GET_MSG_SIZE (4 * NLMSG_GOODSIZE) //boot steps carry names - a full trace doesn't fit the default size
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0)
+#define tlm_put_u64(skb, attr, value) nla_put_u64_64bit(skb, attr, value, RP_TLM_PAD_ATTR)
+#else
+#define tlm_put_u64(skb, attr, value) nla_put_u64(skb, attr, value)
+#endif
+
+//The permission is 0 so that these are not exposed in sysfs
+static unsigned int telemetry_ms = TLM_PUSH_DEFAULT_MS;
+module_param_named(telemetry_ms, telemetry_ms, uint, 0000);
+
+static u32 update_seq = 0; //only used by the push worker
+static struct boot_trace_sample *boot_samples = NULL; //too big for the stack; only used with genl_mutex held
+static bool registered = false;
+
+static void push_telemetry(struct work_struct *work);
+static DECLARE_DELAYED_WORK(push_work, push_telemetry);
+
+/******************************************************* Family *******************************************************/
+static int tlm_get_doit(struct sk_buff *skb, struct genl_info *info);
+
+static struct genl_ops tlm_ops[] = {
+    {
+        .cmd = RP_TLM_CMD_GET,
+        .flags = GENL_ADMIN_PERM, //boot steps & cycles say a lot about the box
+        .doit = tlm_get_doit,
+    },
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
+static struct genl_multicast_group tlm_mcgrps[] = {
+    { .name = RP_TLM_MCGRP_NAME },
+};
+#else
+static struct genl_multicast_group tlm_mcgrp = {
+    .name = RP_TLM_MCGRP_NAME,
+};
+#endif
+
+static struct genl_family tlm_family = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+    .id = GENL_ID_GENERATE,
+#endif
+    .name = RP_TLM_FAMILY_NAME,
+    .version = RP_TLM_FAMILY_VERSION,
+    .maxattr = RP_TLM_A_MAX,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+    .module = THIS_MODULE,
+    .ops = tlm_ops,
+    .n_ops = ARRAY_SIZE(tlm_ops),
+    .mcgrps = tlm_mcgrps,
+    .n_mcgrps = ARRAY_SIZE(tlm_mcgrps),
+#endif
+};
+
+static int register_tlm_family(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+    return genl_register_family(&tlm_family);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
+    return genl_register_family_with_ops_groups(&tlm_family, tlm_ops, tlm_mcgrps);
+#else
+    int out = genl_register_family_with_ops(&tlm_family, tlm_ops, ARRAY_SIZE(tlm_ops));
+    if (out != 0)
+        return out;
+
+    if ((out = genl_register_mc_group(&tlm_family, &tlm_mcgrp)) != 0)
+        genl_unregister_family(&tlm_family);
+
+    return out;
+#endif
+}
+
+static bool tlm_has_listeners(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
+    return netlink_has_listeners(init_net.genl_sock, tlm_family.mcgrp_offset);
+#else
+    return netlink_has_listeners(init_net.genl_sock, tlm_mcgrp.id);
+#endif
+}
+
+static int tlm_multicast(struct sk_buff *msg)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
+    return genlmsg_multicast(&tlm_family, msg, 0, 0, GFP_KERNEL);
+#else
+    return genlmsg_multicast(msg, 0, tlm_mcgrp.id, GFP_KERNEL);
+#endif
+}
+
+/****************************************************** Messages ******************************************************/
+static int put_hooks(struct sk_buff *msg, bool with_names)
+{
+    u64 hits, cycles;
+
+    for (int id = 0; id < HOOK_STATS_MAX; ++id) {
+        hook_stats_get(id, &hits, &cycles);
+
+        struct nlattr *nest = nla_nest_start(msg, RP_TLM_A_HOOK);
+        if (!nest ||
+            nla_put_u32(msg, RP_TLM_HOOK_A_ID, id) ||
+            (with_names && nla_put_string(msg, RP_TLM_HOOK_A_NAME, hook_stats_name(id))) ||
+            tlm_put_u64(msg, RP_TLM_HOOK_A_HITS, hits) ||
+            tlm_put_u64(msg, RP_TLM_HOOK_A_CYCLES, cycles)) {
+            if (nest)
+                nla_nest_cancel(msg, nest);
+            return -EMSGSIZE;
+        }
+        nla_nest_end(msg, nest);
+    }
+
+    return 0;
+}
+
+static int put_vuart(int line, unsigned int fifo_depth, const struct vuart_stats *st, void *data)
+{
+    struct sk_buff *msg = data;
+
+    struct nlattr *nest = nla_nest_start(msg, RP_TLM_A_VUART);
+    if (!nest ||
+        nla_put_u32(msg, RP_TLM_VUART_A_LINE, line) ||
+        nla_put_u32(msg, RP_TLM_VUART_A_FIFO_DEPTH, fifo_depth) ||
+        tlm_put_u64(msg, RP_TLM_VUART_A_TX_BYTES, st->tx_bytes) ||
+        tlm_put_u64(msg, RP_TLM_VUART_A_TX_DELIVERED, st->tx_delivered) ||
+        tlm_put_u64(msg, RP_TLM_VUART_A_TX_DISCARDED, st->tx_discarded) ||
+        tlm_put_u64(msg, RP_TLM_VUART_A_TX_FLUSH_THRESHOLD, st->tx_flushes[VUART_FLUSH_THRESHOLD]) ||
+        tlm_put_u64(msg, RP_TLM_VUART_A_TX_FLUSH_IDLE, st->tx_flushes[VUART_FLUSH_IDLE]) ||
+        tlm_put_u64(msg, RP_TLM_VUART_A_TX_FLUSH_FULL, st->tx_flushes[VUART_FLUSH_FULL]) ||
+        tlm_put_u64(msg, RP_TLM_VUART_A_TX_OVERRUNS, st->tx_overruns) ||
+        tlm_put_u64(msg, RP_TLM_VUART_A_RX_BYTES, st->rx_bytes) ||
+        tlm_put_u64(msg, RP_TLM_VUART_A_RX_REFUSED, st->rx_refused) ||
+        tlm_put_u64(msg, RP_TLM_VUART_A_RX_OVERRUNS, st->rx_overruns) ||
+        tlm_put_u64(msg, RP_TLM_VUART_A_VIRQS, st->virq_delivered)) {
+        if (nest)
+            nla_nest_cancel(msg, nest);
+        return -EMSGSIZE;
+    }
+    nla_nest_end(msg, nest);
+
+    return 0;
+}
+
+static int put_boot_steps(struct sk_buff *msg)
+{
+    unsigned int num = boot_trace_get_samples(boot_samples, TLM_BOOT_STEPS_MAX);
+
+    for (unsigned int i = 0; i < num; ++i) {
+        const struct boot_trace_sample *step = &boot_samples[i];
+
+        struct nlattr *nest = nla_nest_start(msg, RP_TLM_A_BOOT_STEP);
+        if (!nest ||
+            nla_put(msg, RP_TLM_BOOT_A_NAME, step->name_len, step->name) ||
+            tlm_put_u64(msg, RP_TLM_BOOT_A_START_US, step->start_us) ||
+            (step->took_us >= 0 && tlm_put_u64(msg, RP_TLM_BOOT_A_TOOK_US, step->took_us)) ||
+            nla_put_u32(msg, RP_TLM_BOOT_A_RESULT, (u32)step->result) ||
+            tlm_put_u64(msg, RP_TLM_BOOT_A_TLB_CYCLES, step->cost[BOOT_TRACE_TLB_FLUSH]) ||
+            tlm_put_u64(msg, RP_TLM_BOOT_A_KALLSYMS_CYCLES, step->cost[BOOT_TRACE_KALLSYMS])) {
+            if (nest)
+                nla_nest_cancel(msg, nest);
+            return -EMSGSIZE;
+        }
+        nla_nest_end(msg, nest);
+    }
+
+    return 0;
+}
+
+/**
+ * Builds a complete message for a given command
+ *
+ * Running out of space isn't an error: the message is sent with whatever fit and RP_TLM_A_TRUNCATED set.
+ *
+ * @return message or ERR_PTR() on error
+ */
+static struct sk_buff *build_tlm_msg(u8 cmd, u32 portid, u32 seq)
+{
+    bool full = cmd == RP_TLM_CMD_GET;
+    struct sk_buff *msg = genlmsg_new(full ? TLM_GET_MSG_SIZE : NLMSG_GOODSIZE, GFP_KERNEL);
+    if (unlikely(!msg)) {
+        pr_loc_crt("kernel memory alloc failure - tried to allocate telemetry message");
+        return ERR_PTR(-ENOMEM);
+    }
+
+    void *hdr = genlmsg_put(msg, portid, seq, &tlm_family, 0, cmd);
+    if (unlikely(!hdr)) {
+        nlmsg_free(msg);
+        return ERR_PTR(-EMSGSIZE);
+    }
+
+    if (tlm_put_u64(msg, RP_TLM_A_TIMESTAMP_NS, ktime_to_ns(ktime_get())) ||
+        (!full && nla_put_u32(msg, RP_TLM_A_SEQ, update_seq++)) ||
+        put_hooks(msg, full) ||
+        for_each_vuart_stats(put_vuart, msg) ||
+        (full && put_boot_steps(msg)))
+        nla_put_flag(msg, RP_TLM_A_TRUNCATED); //if even that didn't fit the collector will see missing attributes
+
+    genlmsg_end(msg, hdr);
+    return msg;
+}
+
+static int tlm_get_doit(struct sk_buff *skb, struct genl_info *info)
+{
+    struct sk_buff *msg = build_tlm_msg(RP_TLM_CMD_GET, info->snd_portid, info->snd_seq);
+    if (IS_ERR(msg))
+        return PTR_ERR(msg);
+
+    return genlmsg_reply(msg, info);
+}
+
+/******************************************************** Push ********************************************************/
+static void push_telemetry(struct work_struct *work)
+{
+    if (tlm_has_listeners()) {
+        struct sk_buff *msg = build_tlm_msg(RP_TLM_CMD_UPDATE, 0, 0);
+        if (!IS_ERR(msg))
+            tlm_multicast(msg); //consumes the msg; fails with -ESRCH if the last listener has just left
+    }
+
+    queue_delayed_work(housekeeping_wq(system_long_wq), &push_work, msecs_to_jiffies(ACCESS_ONCE(telemetry_ms)));
+}
+
+static void apply_push_interval(const struct rp_tunable *tun)
+{
+    mod_delayed_work(housekeeping_wq(system_long_wq), &push_work, msecs_to_jiffies(telemetry_ms));
+}
+
+static struct rp_tunable push_tunable = {
+    .name = "telemetry_ms",
+    .value = &telemetry_ms,
+    .min = TLM_PUSH_MIN_MS,
+    .max = TLM_PUSH_MAX_MS,
+    .apply = apply_push_interval,
+};
+
+/****************************************************** Public API ****************************************************/
+int register_telemetry(void)
+{
+    if (unlikely(registered)) {
+        pr_loc_bug("Telemetry is already registered");
+        return -EALREADY;
+    }
+
+    kmalloc_or_exit_int(boot_samples, sizeof(struct boot_trace_sample) * TLM_BOOT_STEPS_MAX);
+
+    int out = register_tlm_family();
+    if (out != 0) { //telemetry isn't critical for the module to work
+        pr_loc_wrn("Failed to register generic netlink family %s - telemetry will not be available, error=%d",
+                   RP_TLM_FAMILY_NAME, out);
+        kfree(boot_samples);
+        boot_samples = NULL;
+        return 0;
+    }
+
+    registered = true;
+    register_rp_tunable(&push_tunable); //clamps telemetry_ms to a sane range
+    queue_delayed_work(housekeeping_wq(system_long_wq), &push_work, msecs_to_jiffies(telemetry_ms));
+    pr_loc_inf("Telemetry available over generic netlink as %s (updates every %ums)", RP_TLM_FAMILY_NAME,
+               telemetry_ms);
+
+    return 0;
+}
+
+int unregister_telemetry(void)
+{
+    if (!registered)
+        return 0; //it's not an error as the family may have failed to register
+
+    unregister_rp_tunable(&push_tunable); //before cancelling, as applying a new interval reschedules the work
+    cancel_delayed_work_sync(&push_work); //handles the worker rearming itself
+    int out = genl_unregister_family(&tlm_family); //waits for GET requests in progress (they run under genl_mutex)
+    registered = false;
+    kfree(boot_samples);
+    boot_samples = NULL;
+
+    return out;
+}
+#endif //TELEMETRY_ENABLED
@@ -0,0 +1,108 @@
+/**
+ * Binary telemetry published over generic netlink
+ *
+ * Counters collected for debugfs (hook stats, vUART line stats, boot trace) are also available to collectors as
+ * netlink attributes, so that there's no text formatting in the kernel and no scraping of the log in userspace. The
+ * family (RP_TLM_FAMILY_NAME, resolved with the standard genl controller) has two ways of getting the data:
+ *   - RP_TLM_CMD_GET request (CAP_NET_ADMIN) is answered with a full snapshot: counters, names & all boot steps
+ *   - subscribers of RP_TLM_MCGRP_NAME multicast group get RP_TLM_CMD_UPDATE with counters (no names, no boot steps)
+ *     every "telemetry_ms" milliseconds (module param & tunable, default TLM_PUSH_DEFAULT_MS); nothing is built when
+ *     there are no subscribers
+ * Updates carry a sequence number (RP_TLM_A_SEQ) to let collectors detect dropped messages. All counters are
+ * monotonic since load (or the last reset through debugfs), u64 and sent in host byte order like all netlink ints.
+ *
+ * Same as debugfs, the family alone is a dead giveaway of the module - it only exists in the least stealthy modes.
+ *
+ * Enums below are the ABI: values can only be appended.
+ */
+#ifndef REDPILL_TELEMETRY_H
+#define REDPILL_TELEMETRY_H
+
+#define RP_TLM_FAMILY_NAME "rp_telemetry"
+#define RP_TLM_FAMILY_VERSION 1
+#define RP_TLM_MCGRP_NAME "metrics"
+
+enum rp_tlm_cmd {
+    RP_TLM_CMD_UNSPEC,
+    RP_TLM_CMD_GET, //request w/o attributes; replied with the same command
+    RP_TLM_CMD_UPDATE, //multicast only
+    __RP_TLM_CMD_MAX
+};
+
+//Every nested attributes set uses 1 for padding of u64 values (required by newer kernels)
+#define RP_TLM_PAD_ATTR 1
+
+enum rp_tlm_attr {
+    RP_TLM_A_UNSPEC,
+    RP_TLM_A_PAD = RP_TLM_PAD_ATTR,
+    RP_TLM_A_TIMESTAMP_NS, //u64, CLOCK_MONOTONIC
+    RP_TLM_A_SEQ, //u32, updates only
+    RP_TLM_A_HOOK, //nested RP_TLM_HOOK_A_*, one per hook
+    RP_TLM_A_VUART, //nested RP_TLM_VUART_A_*, one per added vUART
+    RP_TLM_A_BOOT_STEP, //nested RP_TLM_BOOT_A_*, one per step in the order they started
+    RP_TLM_A_TRUNCATED, //flag: not everything fit in the message
+    __RP_TLM_A_MAX
+};
+#define RP_TLM_A_MAX (__RP_TLM_A_MAX - 1)
+
+enum rp_tlm_hook_attr {
+    RP_TLM_HOOK_A_UNSPEC,
+    RP_TLM_HOOK_A_PAD = RP_TLM_PAD_ATTR,
+    RP_TLM_HOOK_A_ID, //u32, hook_stats_id (e.g. sd_ioctl hits are SMART queries)
+    RP_TLM_HOOK_A_NAME, //string, RP_TLM_CMD_GET only
+    RP_TLM_HOOK_A_HITS, //u64
+    RP_TLM_HOOK_A_CYCLES, //u64
+    __RP_TLM_HOOK_A_MAX
+};
+
+enum rp_tlm_vuart_attr {
+    RP_TLM_VUART_A_UNSPEC,
+    RP_TLM_VUART_A_PAD = RP_TLM_PAD_ATTR,
+    RP_TLM_VUART_A_LINE, //u32, ttyS<n>
+    RP_TLM_VUART_A_FIFO_DEPTH, //u32
+    RP_TLM_VUART_A_TX_BYTES, //u64 (this & all below)
+    RP_TLM_VUART_A_TX_DELIVERED,
+    RP_TLM_VUART_A_TX_DISCARDED,
+    RP_TLM_VUART_A_TX_FLUSH_THRESHOLD,
+    RP_TLM_VUART_A_TX_FLUSH_IDLE,
+    RP_TLM_VUART_A_TX_FLUSH_FULL,
+    RP_TLM_VUART_A_TX_OVERRUNS,
+    RP_TLM_VUART_A_RX_BYTES,
+    RP_TLM_VUART_A_RX_REFUSED,
+    RP_TLM_VUART_A_RX_OVERRUNS,
+    RP_TLM_VUART_A_VIRQS,
+    __RP_TLM_VUART_A_MAX
+};
+
+enum rp_tlm_boot_attr {
+    RP_TLM_BOOT_A_UNSPEC,
+    RP_TLM_BOOT_A_PAD = RP_TLM_PAD_ATTR,
+    RP_TLM_BOOT_A_NAME, //string (not terminated)
+    RP_TLM_BOOT_A_START_US, //u64, since module init
+    RP_TLM_BOOT_A_TOOK_US, //u64; missing while the step is still running (or if it never finished)
+    RP_TLM_BOOT_A_RESULT, //u32, (int) result of the step; 0 is success
+    RP_TLM_BOOT_A_TLB_CYCLES, //u64
+    RP_TLM_BOOT_A_KALLSYMS_CYCLES, //u64
+    __RP_TLM_BOOT_A_MAX
+};
+
+#ifdef __KERNEL__
+#include "helper/debugfs_helper.h" //RP_DEBUGFS_ENABLED
+
+#ifdef RP_DEBUGFS_ENABLED
+#define TELEMETRY_ENABLED
+
+/**
+ * Registers the generic netlink family & starts pushing updates to subscribers
+ *
+ * @return 0 on success, -E on error
+ */
+int register_telemetry(void);
+int unregister_telemetry(void);
+#else //RP_DEBUGFS_ENABLED
+static inline int register_telemetry(void) { return 0; }
+static inline int unregister_telemetry(void) { return 0; }
+#endif //RP_DEBUGFS_ENABLED
+#endif //__KERNEL__
+
+#endif //REDPILL_TELEMETRY_H
@@ -90,6 +90,7 @@
 #include <linux/timer.h> //timer_pending()
 #include <linux/interrupt.h> //disable_irq()/enable_irq()
 #include <linux/irqdesc.h> //irq_has_action
+#include <linux/delay.h> //msleep()
 
 #define pause_irq_save(irq) ({bool __state = irq_has_action(irq); if (__state) { disable_irq(irq); } __state; })
 #define resume_irq_saved(irq, saved) if (saved) { enable_irq(irq); }
@@ -381,25 +382,86 @@ static inline void restart_port(struct uart_8250_port *up)
 
 
 /*************************************************** Swapping logic ***************************************************/
+#define TX_DRAIN_TIMEOUT_MS 100 //a full 16550 FIFO takes ~17ms at 9600 baud; anything slower is probably stuck
+#define TX_DRAIN_POLL_MS 1
+
+/**
+ * Hardware lane configuration of a port; everything which is exchanged between two ports during swap
+ */
+struct uart_lane_cfg {
+    unsigned long iobase;
+    unsigned int irq;
+    unsigned int uartclk;
+    upf_t flags;
+    struct timer_list timer; //if one port was timer based and another wasn't this ensures they aren't broken
+};
+
 /**
- * Swaps two UART data lines with proper locking
+ * Takes a snapshot of the lane configuration of a port
+ *
+ * Both configurations are captured before any of them is changed, so that the swap itself is just a publication of
+ * already prepared values done under both port locks at once (and cannot be observed half-done).
+ */
+static void read_uart_lane(struct uart_8250_port *up, struct uart_lane_cfg *cfg)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&up->port.lock, flags);
+    cfg->iobase = up->port.iobase;
+    cfg->irq = up->port.irq;
+    cfg->uartclk = up->port.uartclk; //Just to be complete we should move flags & clock
+    cfg->flags = up->port.flags;     // (they're probably the same anyway)
+    cfg->timer = up->timer;
+    spin_unlock_irqrestore(&up->port.lock, flags);
+}
+
+/**
+ * Publishes previously prepared lane configurations to both ports at once
  *
  * This function assumes ports are already stopped.
  */
-static inline void swap_uart_lanes(struct uart_8250_port *a, struct uart_8250_port *b)
+static inline void publish_uart_lanes(struct uart_8250_port *a, const struct uart_lane_cfg *a_cfg,
+                                      struct uart_8250_port *b, const struct uart_lane_cfg *b_cfg)
 {
     unsigned long flags_a, flags_b;
     spin_lock_irqsave(&a->port.lock, flags_a);
     spin_lock_irqsave(&b->port.lock, flags_b);
 
-    swap(a->port.iobase, b->port.iobase);
-    swap(a->port.irq, b->port.irq);
-    swap(a->port.uartclk, b->port.uartclk); //Just to be complete we should move flags & clock
-    swap(a->port.flags, b->port.flags);     // (they're probably the same anyway)
-    swap(a->timer, b->timer); //if one port was timer based and another wasn't this ensures they aren't broken
+    a->port.iobase = a_cfg->iobase;
+    a->port.irq = a_cfg->irq;
+    a->port.uartclk = a_cfg->uartclk;
+    a->port.flags = a_cfg->flags;
+    a->timer = a_cfg->timer;
+
+    b->port.iobase = b_cfg->iobase;
+    b->port.irq = b_cfg->irq;
+    b->port.uartclk = b_cfg->uartclk;
+    b->port.flags = b_cfg->flags;
+    b->timer = b_cfg->timer;
+
+    spin_unlock_irqrestore(&b->port.lock, flags_b);
+    spin_unlock_irqrestore(&a->port.lock, flags_a);
+}
+
+/**
+ * Waits (sleeping) for the transmitter of an active port to send everything which was already written to it
+ *
+ * Console writes return as soon as the last character lands in the TX FIFO. Shutting down the port right away would
+ * cut off up to a FIFO worth of the last messages on the old port.
+ */
+static void drain_port_tx(struct uart_8250_port *up)
+{
+    struct uart_port *port = &up->port;
+    unsigned int waited_ms = 0;
+
+    while (!port->ops->tx_empty(port)) {
+        if (waited_ms >= TX_DRAIN_TIMEOUT_MS) {
+            pr_loc_wrn("ttyS%d transmitter didn't drain in %ums - some output may be lost", port->line, waited_ms);
+            return;
+        }
 
-    spin_unlock_irqrestore(&a->port.lock, flags_b); //flags_a were a property of B
-    spin_unlock_irqrestore(&b->port.lock, flags_a);
+        msleep(TX_DRAIN_POLL_MS);
+        waited_ms += TX_DRAIN_POLL_MS;
+    }
 }
 
 int uart_swap_hw_output(unsigned int from, unsigned int to)
@@ -412,23 +474,24 @@ int uart_swap_hw_output(unsigned int from, unsigned int to)
     struct uart_8250_port *port_a = get_8250_port(from);
     struct uart_8250_port *port_b = get_8250_port(to);
 
-    if (unlikely(!port_a)) {
+    if (unlikely(IS_ERR(port_a))) {
         pr_loc_err("Failed to locate ttyS%d port", from);
         return PTR_ERR(port_a);
     }
-    if (unlikely(!port_b)) {
+    if (unlikely(IS_ERR(port_b))) {
         pr_loc_err("Failed to locate ttyS%d port", to);
         return PTR_ERR(port_b);
     }
 
-
-    pr_loc_dbg("Disabling preempt & locking console");
+    pr_loc_dbg("Locking console");
     pr_loc_inf("======= OUTPUT ON THIS PORT WILL STOP AND CONTINUE ON ANOTHER ONE (swapping ttyS%d & ttyS%d) =======",
                from, to); //That will be the last message user sees before swap on the "old" port
 
     pr_loc_dbg("### LAST MESSAGE BEFORE SWAP ON \"OLD\" PORT ttyS%d<=>ttyS%d", from, to);
-    preempt_disable(); //we cannot be rescheduled here due to timing constraint and possibly IRQ interactions
-    console_lock(); //We don't want stray messages landing somewhere randomly when we swap, + the ports will be down
+    //While the console is locked printk() doesn't block and doesn't call console drivers - messages only land in the
+    // log buffer and are flushed (to the swapped ports) by console_unlock(). That's why nothing here can run with
+    // preemption disabled: console_lock(), port startup/shutdown & draining all may sleep.
+    console_lock();
     //this will be the first message after port unlocks after swapping
     pr_loc_dbg("### FIRST MESSAGE AFTER SWAP ON \"NEW\" PORT ttyS%d<=>ttyS%d", from, to);
 
@@ -437,7 +500,12 @@ int uart_swap_hw_output(unsigned int from, unsigned int to)
     // of the hardware we may have a problem with restarting the previously inactive port. If WE did shut it down there
     // is no issue as we know the hardware is initialized. But if it wasn't and we try to just start it up without
     // reinit we can either crash the driver or leave the port in inactive state.
-    pr_loc_dbg("Disabling ports");
+    pr_loc_dbg("Draining & disabling ports");
+    if (is_port_active(port_a))
+        drain_port_tx(port_a);
+    if (is_port_active(port_b))
+        drain_port_tx(port_b);
+
     int port_a_was_running = try_shutdown_port(port_a);
     int port_b_was_running = try_shutdown_port(port_b);
     if (unlikely(port_a_was_running != port_b_was_running))
@@ -445,7 +513,11 @@ int uart_swap_hw_output(unsigned int from, unsigned int to)
                    "reactivate inactive one but this may fail.", port_a->port.line, port_a_was_running ? "" : "in",
                    port_b->port.line, port_b_was_running ? "" : "in");
 
-    swap_uart_lanes(port_a, port_b);
+    //Snapshots are taken only now as a timer of an active port is still queued until the port is shut down
+    struct uart_lane_cfg cfg_a, cfg_b;
+    read_uart_lane(port_a, &cfg_a);
+    read_uart_lane(port_b, &cfg_b);
+    publish_uart_lanes(port_a, &cfg_b, port_b, &cfg_a);
     //This code IS CORRECT - make sure to read comment next to port_a_was_running/port_b_was_running vars initialization
     //We swapped the data paths but we need to restore the state as the userland expects it.
     pr_loc_dbg("Restarting ports");
@@ -454,8 +526,7 @@ int uart_swap_hw_output(unsigned int from, unsigned int to)
     if (port_b_was_running)
         restart_port(port_b);
 
-    console_unlock();
-    preempt_enable();
+    console_unlock(); //flushes everything printed in the meantime to the new port
 
     pr_loc_inf("======= OUTPUT ON THIS PORT CONTINUES FROM A DIFFERENT ONE (swapped ttyS%d & ttyS%d) =======", from,
                to);
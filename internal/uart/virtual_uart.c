@@ -26,9 +26,12 @@
  * LIMITATIONS
  * -----------
  *  - For obvious reasons (as we are not working with a real hw) the DMA portion of the chip is not emulated
- *  - On most system the maximum number of UARTs emulated is 4 (driver's limitation, see CONFIG_SERIAL_8250_NR_UARTS)
- *  - FIFOs, true to the original 16550A, are limited to 16 bytes each. In theory, if needed, they can be enlarge up to
- *    even 256 bytes each with chip model change (as 8250 driver actually tests how big a FIFO is on setup)
+ *  - Legacy ISA lines (ttyS0-3) are replaced in place. Lines above them can be added with vuart_add_dynamic_device(),
+ *    but the driver assigns their numbers and their total is limited by CONFIG_SERIAL_8250_NR_UARTS (and the
+ *    8250.nr_uarts param) - on many systems it's just 4, i.e. no dynamic lines at all
+ *  - FIFOs, true to the original 16550A, are 16 bytes each by default. They can be enlarged up to 128 bytes
+ *    (vuart_set_fifo_depth()); with 64+ bytes the chip emulates 16750 64-byte FIFO detection so that the 8250 driver
+ *    sees a bigger FIFO as well (the driver has no register-only way to detect anything bigger)
  *  - FIFO mode is always enabled. There are some not-fully-accurate pieces which don't handle non-FIFO operation. There
  *    is (at least to our knowledge) no reason to use it adn kernel always asks for FIFO to save CPU anyway.
  *
@@ -46,7 +49,18 @@
  *    pretty catastrophic as you will be flooded with messages about IIR being read as long as the port stays open in 
  *    the userland. This consciously does not use kernel's dynamic debug facilities are some (e.g. 918+) kernels are
  *    compiled without it.
- *  - To change name of the vIRQ thread define VUART_THREAD_FMT which gets a real port IRQ # and ttyS# as its params.
+ *  - By default the TX side bypasses register-level emulation for bulk data: start_tx of the captured port is replaced
+ *    and the whole circular buffer is moved into the TX FIFO under a single lock (see vuart_bulk_start_tx()). The same
+ *    is done for kernel console messages if the console is on a vUART line (see vuart_bulk_console_write()). Define
+ *    VUART_DISABLE_BULK_TX to force the driver to write every byte through THR like with a real chip.
+ *  - vIRQs are delivered from a tasklet scheduled as soon as IIR signals an interrupt. Define VUART_USE_VIRQ_THREAD to
+ *    use a kernel thread per port instead (which costs a context switch per emulated interrupt).
+ *  - To change name of the vIRQ thread (VUART_USE_VIRQ_THREAD) define VUART_THREAD_FMT which gets a real port IRQ #
+ *    and ttyS# as its params.
+ *  - To record every register access into a binary trace buffer (cheap enough to not change timing like the
+ *    VUART_DEBUG_LOG does) define VUART_TRACE (DBG_VUART_TRACE in the Makefile) - see debug/debug_vuart_trace.h
+ *  - Per-line counters of bytes, TX flushes by reason, overruns and vIRQs are available in <debugfs>/redpill/vuart_stats
+ *    whenever the stealth mode allows debugfs (see register_vuart_stats())
  *  - UART_BUG_SWAPPED (defined in uart_defs.h) is used to detect swapped ports and make sure numbers used here are real
  *    ttyS* values and not swapped bs (as 8250 matches ports by iobase and not line#)
  *
@@ -61,18 +75,31 @@
 //Keep in mind you may need to set the debug in vuart_virtual_irq separatedly (or in common.h)
 //#define VUART_DEBUG_LOG
 //#define VUART_USE_TIMER_FALLBACK
+//#define VUART_USE_VIRQ_THREAD
+//#define VUART_DISABLE_BULK_TX
+//#define VUART_TRACE
 
 #include "virtual_uart.h"
 #include "vuart_internal.h"
 #include "../../common.h" //can set VUART_DEBUG_LOG and others
 #include "../../debug/debug_vuart.h" //it will provide normal or nooped versions of macros; CHECKS VUART_DEBUG_LOG
+#include "../../debug/debug_vuart_trace.h" //vuart_trace_*(); CHECKS VUART_TRACE
 #include "../../config/uart_defs.h" //COM defs & struct uart_port
 #include "../../internal/intercept_driver_register.h" //is_driver_registered, watch_driver_register, unwatch_driver_register
 #include "vuart_virtual_irq.h" //vIRQ handling & shimming; CHECKS VUART_USE_TIMER_FALLBACK
+#include "../hook_stats.h" //hook_stats_measure()
+#include "../rp_trace.h" //rp_trace()
 #include <linux/serial_8250.h> //serial8250_unregister_port, uart_8250_port
 #include <linux/serial_reg.h> //UART_* consts
 #include <linux/spinlock.h> //locking devices (vdev->lock)
 #include <linux/kfifo.h> //kfifo_*
+#include <linux/log2.h> //is_power_of_2()
+#include <linux/console.h> //struct console, for_each_console(), console_lock()
+#include <linux/ioport.h> //request_region(), release_region()
+#ifdef VUART_STATS_ENABLED
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+#endif
 
 /************************************************* Static definitions *************************************************/
 /*
@@ -83,12 +110,23 @@
 #define UART_IIR_FIFEN_B6 0x40
 #define UART_IIR_FIFEN_B7 0x80
 #define UART_DRIVER_NAME "serial8250" //see drivers/tty/serial/8250/8250_core.c in "serial8250_isa_driver"
+#define VUART_CONSOLE_NAME "ttyS" //see drivers/tty/serial/8250/8250_core.c in "serial8250_console"
+#define VUART_ISA_LINES 4 //COM1-4
+
+//Dynamic lines are registered as new ports: the driver matches ports by iobase, so every one needs a unique one which
+// isn't used by anything else (it's never really accessed as all I/O goes through serial_remote_read/write)
+#define VUART_DYN_IOBASE_FIRST 0x800
+#define VUART_DYN_IOBASE_LAST 0xff8
+#define VUART_DYN_IOBASE_SIZE 8 //what 8250 claims for a 16550A
+//The IRQ of dynamic lines is never raised (vIRQs are delivered per port) - it just prevents the driver from polling
+#define VUART_DYN_IRQ STD_COM4_IRQ
+#define VUART_DYN_LINES (UART_NR > VUART_ISA_LINES ? UART_NR - VUART_ISA_LINES : 0)
 
 /**
  * Static definition of all possible UARTs in the system supported by 8250 driver
  * These definitions are exactly the same as in arch/x86/include/asm/serial.h
  */
-static struct serial8250_16550A_vdev ttySs[] = {
+static struct serial8250_16550A_vdev ttySs[VUART_ISA_LINES] = {
 //we're crying too... the issue is normally operate on port lines (=ttyS#) but during port registration ports the driver
 // performs matching based on its internal iobase mapping, so we can ask for the port to be line=0 but if the driver
 // finds a port with iobase specified under line=1 it will just register is as line=1 instead of line=0. This causes all
@@ -113,22 +151,39 @@ static struct serial8250_16550A_vdev ttySs[] = {
     [3]	= { .line = 3, .iobase = STD_COM4_IOBASE, .irq = STD_COM4_IRQ, .baud = STD_COMX_BAUD }, //COM4 aka ttyS3
 };
 
-//Internal type for callbacks; see vuart_set_tx_callback() for details
+//Internal type for callbacks; see vuart_set_tx_callback() and vuart_set_tx_span_callback() for details
 struct flush_callback {
-    vuart_callback_t *fn;
+    vuart_callback_t *fn; //copying callback (uses buffer)
+    vuart_span_callback_t *span_fn; //zero-copy callback (used when fn is NULL)
     void *buffer;
     int threshold;
 };
-//Storage for all TX callbacks, see vuart_set_tx_callback()
-static struct flush_callback *flush_cbs[SERIAL8250_LAST_ISA_LINE] = { NULL };
+
+//Dynamic lines (see vuart_add_dynamic_device()) are taken from a pool which is never freed (like ttySs), as the driver
+// keeps the vdev ptr in the port after it's unregistered. Their line numbers are only known after registration.
+static struct serial8250_16550A_vdev dyn_ttySs[VUART_DYN_LINES];
+static struct serial8250_16550A_vdev *dyn_lines[UART_NR] = { NULL }; //line => dyn_ttySs entry; only lines >= ISA ones
 static volatile bool kernel_driver_ready = false; //Whether the 8250 UART driver is ready
 
 /**************************************** Internal helper function-like macros ****************************************/
-//Get vDEV from line/ttyS number (created for consistency)
-#define get_line_vdev(line) (&ttySs[(line)])
+//Get vDEV from line/ttyS number; NULL for lines above ISA ones which weren't added with vuart_add_dynamic_device()
+#define get_line_vdev(line) ((line) < VUART_ISA_LINES ? &ttySs[(line)] : dyn_lines[(line)])
+
+//Get vDEV of a port the driver calls us with; dynamic lines carry the vdev as the line isn't known during registration
+#define get_port_vdev(port) \
+    ((port)->private_data ? (struct serial8250_16550A_vdev *)(port)->private_data : get_line_vdev((port)->line))
+
+//Index of all vdevs (ISA & dynamic pool), i.e. 0 to VUART_ISA_LINES + VUART_DYN_LINES
+#define get_slot_vdev(slot) ((slot) < VUART_ISA_LINES ? &ttySs[(slot)] : &dyn_ttySs[(slot) - VUART_ISA_LINES])
+
+#define validate_line_vdev(vdev, line) \
+    if (unlikely(!(vdev))) { \
+        pr_loc_err("%s failed - ttyS%d is not a vUART (see vuart_add_dynamic_device())", __FUNCTION__, line); \
+        return -ENODEV; \
+    }
 
 //8250 driver doesn't give access to the real uart_port upon adding but does it on first read/write
-#define capture_uart_port(vdev, port) if (unlikely(!(vdev)->up)) (vdev)->up = port;
+#define capture_uart_port(vdev, port) if (unlikely(!(vdev)->up)) { (vdev)->up = port; install_bulk_tx(vdev); }
 
 //Some functions should warn use out of courtesy that we're running in a stupid environment
 #if defined(UART_BUG_SWAPPED) && defined(DBG_DISABLE_UART_SWAP_FIX)
@@ -144,6 +199,9 @@ static volatile bool kernel_driver_ready = false; //Whether the 8250 UART driver
 
 #define for_each_vdev() for (int line=0; line < ARRAY_SIZE(ttySs); ++line)
 
+#define is_valid_fifo_depth(depth) \
+    ((depth) >= VUART_FIFO_LEN && (depth) <= VUART_FIFO_LEN_MAX && is_power_of_2(depth))
+
 //Before v3.13 the kfifo_put() accepted a pointer, since then it accepts a value
 //ffs... https://github.com/torvalds/linux/commit/498d319bb512992ef0784c278fa03679f2f5649d
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
@@ -195,7 +253,8 @@ static void update_interrupts_state(struct serial8250_16550A_vdev *vdev)
     //If any interrupts are triggered (or not) we need to set IPEND accordingly
     if (new_iir_int_state) {
         new_iir_int_state &= ~UART_IIR_NO_INT; //since there were some interrupts we clear IPEND (=interrupts pending)
-        vuart_virq_wake_up(vdev);
+        if (!vuart_virq_coalesce(vdev, new_iir_int_state))
+            vuart_virq_wake_up(vdev);
     } else {
         new_iir_int_state |= UART_IIR_NO_INT; //since there were no interrupts we set IPEND (=no interrupts pending)
     }
@@ -204,6 +263,8 @@ static void update_interrupts_state(struct serial8250_16550A_vdev *vdev)
     vdev->iir = new_iir_int_state;
     if (likely(vdev->fcr & UART_FCR_ENABLE_FIFO))
         vdev->iir |= UART_IIR_FIFOEN;
+    if (vdev->fifo64)
+        vdev->iir |= UART_IIR_64BYTE_FIFO; //16750 reports 64 byte FIFO mode in bit 5
 
     dump_iir(vdev);
     uart_prdbg("Finished IIR state");
@@ -230,6 +291,7 @@ static void reset_device(struct serial8250_16550A_vdev *vdev)
     vdev->ier = 0x00; //no interrupts enabled
     vdev->iir = UART_IIR_NO_INT; //no pending interrupts, FIFO not active
     vdev->fcr = 0x00; //FIFO disabled (which invalidates other FIFO properties in FCR), DMA disabled
+    vdev->fifo64 = false; //16750: 64 byte mode is disabled on reset
     vdev->lcr = 0x00; //non-DLAB mode, errors cleared, 1 STOP bit, 5 bit words (not that it matters for virtual port)
     vdev->mcr = UART_MCR_OUT2; //autoflow disabled, loop mode disabled, OUT2 enabled as global interrupt
     vdev->lsr = UART_LSR_TEMT | UART_LSR_THRE; //transmitter empty & idle, all errors cleared, break not requested
@@ -264,12 +326,12 @@ static int alloc_fifos(struct serial8250_16550A_vdev *vdev)
     kzalloc_or_exit_int(vdev->rx_fifo, sizeof(struct kfifo));
     kzalloc_or_exit_int(vdev->tx_fifo, sizeof(struct kfifo));
 
-    if (unlikely(kfifo_alloc(vdev->rx_fifo, VUART_FIFO_LEN, GFP_KERNEL) != 0)) {
+    if (unlikely(kfifo_alloc(vdev->rx_fifo, vdev->fifo_depth, GFP_KERNEL) != 0)) {
         pr_loc_crt("kfifo_alloc for RX FIFO elements @ %d failed", vdev->line);
         return -EFAULT;
     }
 
-    if (unlikely(kfifo_alloc(vdev->tx_fifo, VUART_FIFO_LEN, GFP_KERNEL) != 0)) {
+    if (unlikely(kfifo_alloc(vdev->tx_fifo, vdev->fifo_depth, GFP_KERNEL) != 0)) {
         pr_loc_crt("kfifo_alloc for TX FIFO elements @ %d failed", vdev->line);
         return -EFAULT;
     }
@@ -294,6 +356,60 @@ static int free_fifos(struct serial8250_16550A_vdev *vdev)
     return 0;
 }
 
+/**
+ * Gets direct view of the data in a byte FIFO as (up to) two contiguous spans, without removing it from the FIFO
+ *
+ * kfifo doesn't offer such API on older kernels (kfifo_out_linear() is very recent) but the layout of the ring is
+ * stable since the kfifo rewrite in v2.6.33: data is at (out & mask) and wraps around at the size of the FIFO.
+ *
+ * @return number of bytes available in both spans
+ */
+static unsigned int get_fifo_spans(struct kfifo *fifo, vuart_span *spans)
+{
+    unsigned int len = kfifo_len(fifo);
+    unsigned int off = fifo->kfifo.out & fifo->kfifo.mask;
+    unsigned int first = min(len, kfifo_size(fifo) - off);
+
+    spans[0].data = (const char *)fifo->kfifo.data + off;
+    spans[0].len = first;
+    spans[1].data = (const char *)fifo->kfifo.data;
+    spans[1].len = len - first;
+
+    return len;
+}
+
+//Consumes bytes from the FIFO without copying them (counterpart of get_fifo_spans())
+#define kfifo_skip_bytes(fifo, count) ((fifo)->kfifo.out += (count))
+
+/**
+ * Adjusts the TX FIFO fill at which the FIFO is flushed as FULL, based on why it was just flushed
+ *
+ * Every non-IDLE flush means the transmitter is still sending, so the flush point is doubled (up to the FIFO depth). An
+ * IDLE flush means the transmission ended - the next one will start at VUART_FIFO_LEN again. This way short packets are
+ * delivered exactly as with 16550A while long streams end up with fewer, bigger callbacks.
+ */
+static void adapt_tx_flush_point(struct serial8250_16550A_vdev *vdev, vuart_flush_reason reason)
+{
+    if (reason == VUART_FLUSH_IDLE)
+        vdev->tx_boost = 0;
+    else if ((VUART_FIFO_LEN << vdev->tx_boost) < vdev->fifo_depth)
+        ++vdev->tx_boost;
+
+    vdev->tx_flush_at = min_t(unsigned int, VUART_FIFO_LEN << vdev->tx_boost, vdev->fifo_depth);
+}
+
+/**
+ * Gets the effective TX threshold of the callback (which is scaled at the same rate as the flush point)
+ */
+static inline unsigned int get_tx_threshold(struct serial8250_16550A_vdev *vdev)
+{
+    struct flush_callback *cb = vdev->tx_cb;
+    if (!cb || cb->threshold > (int)vdev->fifo_depth) //THRESHOLD flush cannot happen with such a threshold
+        return VUART_THRESHOLD_MAX;
+
+    return min_t(unsigned int, (unsigned int)cb->threshold << vdev->tx_boost, vdev->tx_flush_at);
+}
+
 /**
  * Deposits the TX queue contents into callbacks set using vuart_set_tx_callback() and clears the FIFO itself
  * If no callbacks were defined it will simply clear.
@@ -303,16 +419,32 @@ static int free_fifos(struct serial8250_16550A_vdev *vdev)
 static void flush_tx_fifo(struct serial8250_16550A_vdev *vdev, vuart_flush_reason reason)
 {
     uart_prdbg("Flushing TX FIFO now! reason=%d", reason);
-
-    if (likely(flush_cbs[vdev->line])) {
-        unsigned int flushed_bytes = 0;
-        flushed_bytes = kfifo_out(vdev->tx_fifo, flush_cbs[vdev->line]->buffer, VUART_FIFO_LEN);
-        flush_cbs[vdev->line]->fn(vdev->line, flush_cbs[vdev->line]->buffer, flushed_bytes, reason);
+    vuart_stat_add(vdev, tx_flushes[reason], 1);
+    rp_trace(vuart_flush, vdev->line, kfifo_len(vdev->tx_fifo), reason);
+
+    struct flush_callback *cb = vdev->tx_cb;
+    if (likely(cb) && cb->span_fn) {
+        vuart_span spans[2];
+        unsigned int flushed_bytes = get_fifo_spans(vdev->tx_fifo, spans);
+        cb->span_fn(vdev->line, spans, flushed_bytes, reason);
+        kfifo_skip_bytes(vdev->tx_fifo, flushed_bytes);
+        vuart_stat_add(vdev, tx_delivered, flushed_bytes);
+    } else if (likely(cb)) {
+        //Copying callbacks have buffers of VUART_FIFO_LEN - a deeper FIFO is delivered in pieces, the last one with the
+        // real reason (as it is with 16550A when the transmitter sends more than 16 bytes)
+        do {
+            unsigned int flushed_bytes = kfifo_out(vdev->tx_fifo, cb->buffer, VUART_FIFO_LEN);
+            cb->fn(vdev->line, cb->buffer, flushed_bytes, kfifo_is_empty(vdev->tx_fifo) ? reason : VUART_FLUSH_FULL);
+            vuart_stat_add(vdev, tx_delivered, flushed_bytes);
+        } while (!kfifo_is_empty(vdev->tx_fifo));
     } else {
         uart_prdbg("No callback for TX FIFO @ %d - discarding", vdev->line);
+        vuart_stat_add(vdev, tx_discarded, kfifo_len(vdev->tx_fifo));
         kfifo_reset(vdev->tx_fifo);
     }
 
+    adapt_tx_flush_point(vdev, reason);
+
     vdev->lsr |= UART_LSR_TEMT | UART_LSR_THRE; //nothing should be in the buffer
 }
 
@@ -326,12 +458,16 @@ static void flush_tx_fifo(struct serial8250_16550A_vdev *vdev, vuart_flush_reaso
  *
  * @return character which was read
  */
+static void refill_rx_fifo(struct serial8250_16550A_vdev *vdev);
 static unsigned char transfer_char_fifo_rhr(struct serial8250_16550A_vdev *vdev)
 {
     //Before this function is called UART_LSR_DR should be verified - it wasn't or it was wrong if this exploded
     if(unlikely(kfifo_get(vdev->rx_fifo, &vdev->rhr) == 0))
         pr_loc_bug("Attempted to %s with empty FIFO - that shouldn't happen if the DR flag was checked", __FUNCTION__);
 
+    if (kfifo_is_empty(vdev->rx_fifo))
+        refill_rx_fifo(vdev); //the driver will keep reading as long as DR is set, so it sees the stream as one burst
+
     if (kfifo_is_empty(vdev->rx_fifo))
         vdev->lsr &= ~UART_LSR_DR;
 
@@ -344,6 +480,37 @@ static unsigned char transfer_char_fifo_rhr(struct serial8250_16550A_vdev *vdev)
     return vdev->rhr;
 }
 
+/**
+ * Moves as much data as possible from the RX staging ring (if any) into the chip RX FIFO
+ *
+ * This function does NOT recalculate IIRs (see update_interrupts_state()) and assumes you have vdev lock.
+ */
+static void refill_rx_fifo(struct serial8250_16550A_vdev *vdev)
+{
+    if (likely(!vdev->rx_ring) || kfifo_is_empty(vdev->rx_ring) || unlikely(vdev->mcr & UART_MCR_LOOP))
+        return;
+
+    char buf[VUART_FIFO_LEN_MAX];
+    unsigned int moved = kfifo_out(vdev->rx_ring, buf, min_t(unsigned int, kfifo_avail(vdev->rx_fifo), sizeof(buf)));
+    if (likely(moved)) {
+        kfifo_in(vdev->rx_fifo, buf, moved);
+        vdev->lsr |= UART_LSR_DR;
+    }
+    uart_prdbg("Refilled ttyS%d RX FIFO with %u bytes from stream (%u left)", vdev->line, moved,
+               kfifo_len(vdev->rx_ring));
+
+    if (!vdev->rx_ring_cb)
+        return;
+
+    if (vdev->rx_ring_refused && kfifo_avail(vdev->rx_ring) >= kfifo_size(vdev->rx_ring) / 2) {
+        vdev->rx_ring_refused = false;
+        vdev->rx_ring_cb(vdev->line, kfifo_avail(vdev->rx_ring), VUART_RX_WRITABLE);
+    }
+
+    if (kfifo_is_empty(vdev->rx_ring))
+        vdev->rx_ring_cb(vdev->line, kfifo_avail(vdev->rx_ring), VUART_RX_DRAINED);
+}
+
 /**
  * An alternative to transfer_char_fifo_rhr() when FIFOs aren't used for transfers (e.g. in MSR TEST/LOOP mode)
  *
@@ -360,8 +527,10 @@ static void handle_receive_char(struct serial8250_16550A_vdev *vdev, unsigned ch
         vdev->lsr |= UART_LSR_OE; //set overrun flag as FIFO detected that
 
         //During TEST/LOOP mode many overflows are caused on purpose - we don't want to hear about them really
-        if (unlikely(!(vdev->mcr & UART_MCR_LOOP)))
+        if (unlikely(!(vdev->mcr & UART_MCR_LOOP))) {
             pr_loc_wrn("RX FIFO overflow detected @ ttyS%d", vdev->line);
+            vuart_stat_add(vdev, rx_overruns, 1);
+        }
     } else {
         vdev->lsr &= ~UART_LSR_OE; //no overrun condition - clear OE flag just in case
     }
@@ -375,7 +544,7 @@ static void handle_receive_char(struct serial8250_16550A_vdev *vdev, unsigned ch
  * This function does NOT recalculate IIRs (see update_interrupts_state()) and assumes you have vdev lock.
  *
  * CAUTION: order of these "ifs" for flushes here is crucial: we make a guarantee to the reason parameter that if both
- *  VUART_FLUSH_THRESHOLD and VUART_FLUSH_FULL are true (i.e. callback was set with threshold == VUART_FIFO_LEN) we
+ *  VUART_FLUSH_THRESHOLD and VUART_FLUSH_FULL are true (i.e. callback was set with threshold == tx_flush_at) we
  *  will prioritize threshold trigger (as a user-specified event takes precedence over internal event of FIFO full)
  * If the threshold specified by the callback setter was met flush the FIFO
  */
@@ -389,22 +558,24 @@ static void handle_transmit_char(struct serial8250_16550A_vdev *vdev, unsigned c
     uart_prdbg("%s got new char ascii=%c hex=%02x on ttyS%d (FIFO#=%d)", __FUNCTION__, value, value, vdev->line,
                fifo_len);
 
-    //FIFO is full - try to flush it; if we got here it means the threshold is for sure >VUART_FIFO_LEN as this is
+    //FIFO is full - try to flush it; if we got here it means the threshold is for sure >tx_flush_at as this is
     // checked after we put data into the FIFO (to make sure we trigger THRESHOLD event and not FULL)
     //The reason why we check this at the beginning of new char and not after adding to FIFO is that if the transmitting
     // party sends exactly VUART_FIFO_LEN bytes and then ends the transmission we don't want to flush with FULL but with
     // IDLE to give a better sense of what's going on to the caller. FULL implies "we got too much data, there may be
     // more coming" while IDLE implies that the unit of transmission ended.
-    if (unlikely(fifo_len == VUART_FIFO_LEN))
+    if (unlikely(fifo_len >= vdev->tx_flush_at))
         flush_tx_fifo(vdev, VUART_FLUSH_FULL);
 
     //Put value in FIFO, it will indicate with return of 0 if it was full before attempted put (overrun/overflow)
     //This, if we are correct, cannot happen if the flush_tx_fifo() is functioning correctly as we try to flush above
     int fifo_add = kfifo_put_val(vdev->tx_fifo, value);
     fifo_len += fifo_add; //we can call kfifo_ API for this but why if we have both pieces of info anyway? ;)
+    vuart_stat_add(vdev, tx_bytes, fifo_add);
     if (unlikely(fifo_add == 0)) {
         vdev->lsr |= UART_LSR_OE; //set overrun flag as FIFO detected that
         pr_loc_wrn("TX FIFO overflow detected");
+        vuart_stat_add(vdev, tx_overruns, 1);
     } else {
         vdev->lsr &= ~UART_LSR_OE; //no overrun condition - clear OE flag just in case
     }
@@ -416,10 +587,206 @@ static void handle_transmit_char(struct serial8250_16550A_vdev *vdev, unsigned c
     if (fifo_len >= VUART_FIFO_LEN / 2)
         vdev->lsr &= ~UART_LSR_THRE;
 
-    if (likely(flush_cbs[vdev->line]) && fifo_len >= flush_cbs[vdev->line]->threshold)
+    if (fifo_len >= get_tx_threshold(vdev))
         flush_tx_fifo(vdev, VUART_FLUSH_THRESHOLD);
 }
 
+/************************************************** Bulk transmit path ************************************************/
+#ifndef VUART_DISABLE_BULK_TX
+/**
+ * Moves data directly into the TX FIFO, flushing it as many times as needed
+ *
+ * This does exactly what a series of handle_transmit_char() calls would do in terms of flushes (the same reasons are
+ * reported at the same points), but instead of being called by the driver for every character it takes contiguous
+ * chunks of the data. It doesn't flush at the end (the caller decides when the transmission ends). This function does
+ * NOT recalculate IIRs and assumes you have vdev lock.
+ */
+static void bulk_transmit_bytes(struct serial8250_16550A_vdev *vdev, const char *data, unsigned int len)
+{
+    while (len > 0) {
+        if (unlikely(kfifo_len(vdev->tx_fifo) >= vdev->tx_flush_at)) //more data is coming - as in handle_transmit_char()
+            flush_tx_fifo(vdev, VUART_FLUSH_FULL);
+
+        //Don't go past the flush point or the threshold, so that they trigger at the same spots as for single chars
+        unsigned int fifo_len = kfifo_len(vdev->tx_fifo);
+        unsigned int limit = min_t(unsigned int, vdev->tx_flush_at, get_tx_threshold(vdev));
+        unsigned int chunk = min_t(unsigned int, limit > fifo_len ? limit - fifo_len : 1, len);
+
+        chunk = kfifo_in(vdev->tx_fifo, data, chunk);
+        vuart_stat_add(vdev, tx_bytes, chunk);
+        vdev->thr = data[chunk - 1]; //THR always holds the last char written
+        vdev->lsr &= ~(UART_LSR_TEMT | UART_LSR_THRE);
+        data += chunk;
+        len -= chunk;
+
+        if (kfifo_len(vdev->tx_fifo) >= get_tx_threshold(vdev))
+            flush_tx_fifo(vdev, VUART_FLUSH_THRESHOLD);
+    }
+}
+
+/**
+ * Moves data from the circular buffer directly into the TX FIFO, see bulk_transmit_bytes()
+ */
+static void bulk_transmit_circ(struct serial8250_16550A_vdev *vdev, struct circ_buf *xmit)
+{
+    while (!uart_circ_empty(xmit)) {
+        unsigned int chunk = CIRC_CNT_TO_END(xmit->head, xmit->tail, UART_XMIT_SIZE);
+        bulk_transmit_bytes(vdev, &xmit->buf[xmit->tail], chunk);
+        xmit->tail = (xmit->tail + chunk) & (UART_XMIT_SIZE - 1);
+        vdev->up->icount.tx += chunk;
+    }
+
+    //The whole buffer was consumed - this is what kernel signals by disabling THRI after the last char written
+    if (!kfifo_is_empty(vdev->tx_fifo))
+        flush_tx_fifo(vdev, VUART_FLUSH_IDLE);
+}
+
+/**
+ * Replacement for serial8250 start_tx() for vUART ports
+ *
+ * The 8250 driver sends data by enabling THRI and then writing up to FIFO-size bytes into THR on each THRE interrupt,
+ * one serial_out() call (=lock, emulate, recompute IIR, unlock) per character. There's no physical line here so we can
+ * simply take everything from the circular buffer at once. Special cases (XON/XOFF, loopback, DLAB) are left to the
+ * original implementation to keep the chip semantics intact.
+ *
+ * This is called by the serial core with port->lock held.
+ */
+static void vuart_bulk_start_tx(struct uart_port *port)
+{
+    struct serial8250_16550A_vdev *vdev = get_port_vdev(port);
+    struct circ_buf *xmit = &port->state->xmit;
+
+    if (unlikely(port->x_char || uart_tx_stopped(port) || (vdev->mcr & UART_MCR_LOOP) || (vdev->lcr & UART_LCR_DLAB))) {
+        vdev->org_ops->start_tx(port);
+        return;
+    }
+
+    lock_vuart(vdev);
+    bulk_transmit_circ(vdev, xmit);
+    update_interrupts_state(vdev);
+    unlock_vuart(vdev);
+
+    uart_write_wakeup(port); //the buffer is empty now so the writer can continue
+}
+
+/**
+ * Replacement for serial8250 console write() for vUART ports
+ *
+ * The 8250 console writes every character separately: it polls LSR waiting for THRE (which for a vUART means going
+ * through register emulation on every poll) and then writes THR. Here the whole message (with the same "\n" => "\r\n"
+ * translation uart_console_write() does) is appended into the TX FIFO under a single lock and flushed as IDLE, exactly
+ * as the transmitter would go idle after the 8250 console finishes waiting for an empty transmitter.
+ *
+ * It's called with the console lock held, so it cannot race with (un)installing itself.
+ */
+static void vuart_bulk_console_write(struct console *co, const char *s, unsigned int count)
+{
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(co->index);
+
+    //Until the driver touches the port we have nothing to update IIRs for; loopback & DLAB change the chip semantics
+    if (unlikely(!vdev->up || (vdev->mcr & UART_MCR_LOOP) || (vdev->lcr & UART_LCR_DLAB))) {
+        vdev->org_con_write(co, s, count);
+        return;
+    }
+
+    lock_vuart(vdev);
+    while (count > 0) {
+        const char *nl = memchr(s, '\n', count);
+        unsigned int chunk = nl ? nl - s : count;
+        bulk_transmit_bytes(vdev, s, chunk);
+        if (nl) {
+            bulk_transmit_bytes(vdev, "\r\n", 2);
+            ++chunk;
+        }
+
+        s += chunk;
+        count -= chunk;
+    }
+
+    if (!kfifo_is_empty(vdev->tx_fifo))
+        flush_tx_fifo(vdev, VUART_FLUSH_IDLE);
+    update_interrupts_state(vdev);
+    unlock_vuart(vdev);
+}
+
+/**
+ * Redirects the kernel console attached to the vUART line (if any) to vuart_bulk_console_write()
+ *
+ * The 8250 driver has a single console for all its ports, bound to one line - it's only redirected if that's our line.
+ */
+static void install_bulk_console(struct serial8250_16550A_vdev *vdev)
+{
+    struct console *con;
+
+    console_lock();
+    for_each_console(con) {
+        if (strcmp(con->name, VUART_CONSOLE_NAME) != 0 || con->index != vdev->line ||
+            con->write == vuart_bulk_console_write)
+            continue;
+
+        vdev->con = con;
+        vdev->org_con_write = con->write;
+        con->write = vuart_bulk_console_write;
+        uart_prdbg("Installed bulk console on ttyS%d", vdev->line);
+        break;
+    }
+    console_unlock();
+}
+
+/**
+ * Reverses install_bulk_console()
+ */
+static void uninstall_bulk_console(struct serial8250_16550A_vdev *vdev)
+{
+    if (!vdev->con)
+        return;
+
+    console_lock(); //no console write can be in progress once we have it
+    vdev->con->write = vdev->org_con_write;
+    vdev->con = NULL;
+    vdev->org_con_write = NULL;
+    console_unlock();
+    uart_prdbg("Uninstalled bulk console on ttyS%d", vdev->line);
+}
+
+/**
+ * Replaces ops of the captured port with a private copy using vuart_bulk_start_tx()
+ *
+ * The original ops are shared by all 8250 ports so they cannot be modified in place.
+ */
+static void install_bulk_tx(struct serial8250_16550A_vdev *vdev)
+{
+    if (unlikely(vdev->org_ops))
+        return;
+
+    vdev->org_ops = vdev->up->ops;
+    vdev->bulk_ops = *vdev->org_ops;
+    vdev->bulk_ops.start_tx = vuart_bulk_start_tx;
+    vdev->up->ops = &vdev->bulk_ops;
+    uart_prdbg("Installed bulk TX on ttyS%d", vdev->line);
+}
+
+/**
+ * Reverses install_bulk_tx()
+ */
+static void uninstall_bulk_tx(struct serial8250_16550A_vdev *vdev)
+{
+    if (!vdev->org_ops)
+        return;
+
+    if (likely(vdev->up))
+        vdev->up->ops = vdev->org_ops;
+    vdev->org_ops = NULL;
+    uart_prdbg("Uninstalled bulk TX on ttyS%d", vdev->line);
+}
+#else
+#define install_bulk_tx(vdev) //noop
+#define uninstall_bulk_tx(vdev) //noop
+#define install_bulk_console(vdev) //noop
+#define uninstall_bulk_console(vdev) //noop
+#endif //VUART_DISABLE_BULK_TX
+
+/********************************************** 8250 driver entrypoints ***********************************************/
 /**
  * The main READ routing passed to the 8250 driver. It should be as fast as possible and MUST be multithread-safe
  *
@@ -429,13 +796,75 @@ static void handle_transmit_char(struct serial8250_16550A_vdev *vdev, unsigned c
  * @param offset This is really the register value. It's named "offset" in accordance with Linux nomenclature which
  *               makes sense for physical chips (as this is a memory offset from chip's memory base)
  */
-static unsigned int serial_remote_read(struct uart_port *port, int offset)
+/**
+ * Attempts to read a register without taking the vdev lock
+ *
+ * The 8250 driver polls LSR (and MSR with flow control) in tight loops, e.g. when waiting for THRE during console
+ * output. Reads of registers which don't change the chip state can be served from a consistent snapshot (guarded by
+ * reg_seq) instead of contending with FIFO operations. Any read which needs to change something (RHR, LSR with OE set,
+ * MSR in loop mode masking...) or the first read capturing the port fails here and goes through the locked path.
+ *
+ * @return true if the value was read into *out, false if the locked path must be used
+ */
+static bool try_lockless_read(struct serial8250_16550A_vdev *vdev, struct uart_port *port, int offset,
+                              unsigned int *out)
+{
+    if (unlikely(ACCESS_ONCE(vdev->up) != port))
+        return false;
+
+    unsigned int seq, val;
+    do {
+        seq = read_seqcount_begin(&vdev->reg_seq);
+        switch (offset) {
+            case UART_LSR:
+                val = vdev->lsr;
+                if (val & UART_LSR_OE) //must be cleared on read
+                    return false;
+                break;
+            case UART_MSR:
+                if (unlikely(vdev->mcr & UART_MCR_LOOP)) //MSR is derived from MCR then
+                    return false;
+                val = vdev->msr;
+                break;
+            case UART_IIR:
+                val = vdev->iir;
+                break;
+            case UART_IER:
+                val = (vdev->lcr & UART_LCR_DLAB) ? vdev->dlm : vdev->ier;
+                break;
+            case UART_LCR:
+                val = vdev->lcr;
+                break;
+            case UART_MCR:
+                val = vdev->mcr;
+                break;
+            case UART_SCR:
+                val = vdev->scr;
+                break;
+            default: //RX (RHR has side effects & DLL is rare) and unknown registers
+                return false;
+        }
+    } while (read_seqcount_retry(&vdev->reg_seq, seq));
+
+    uart_prdbg("Lockless read of reg %d on ttyS%d: %02x", offset, vdev->line, val);
+    *out = val;
+    return true;
+}
+
+static unsigned int __serial_remote_read(struct uart_port *port, int offset)
 {
-    uart_prdbg("Serial READ for line=%d/%d", port->line, ttySs[port->line].line);
+    struct serial8250_16550A_vdev *vdev = get_port_vdev(port);
+    uart_prdbg("Serial READ for line=%d/%d", port->line, vdev->line);
+
+    unsigned int lockless_out;
+    if (likely(try_lockless_read(vdev, port, offset, &lockless_out))) {
+        vuart_trace_lockless(vdev, offset, lockless_out);
+        return lockless_out;
+    }
 
-    struct serial8250_16550A_vdev *vdev = get_line_vdev(port->line);
     lock_vuart(vdev);
     capture_uart_port(vdev, port);
+    vuart_trace_begin(vdev, trace);
     unsigned int out;
 	switch (offset) {
         case UART_RX:
@@ -514,6 +943,7 @@ static unsigned int serial_remote_read(struct uart_port *port, int offset)
 	}
 
 	update_interrupts_state(vdev);
+	vuart_trace_end(vdev, trace, VUART_TRACE_READ, offset, out);
 	unlock_vuart(vdev);
 
     return out;
@@ -528,13 +958,14 @@ static unsigned int serial_remote_read(struct uart_port *port, int offset)
  * @param offset This is really the register value. It's named "offset" in accordance with Linux nomenclature which
  *               makes sense for physical chips (as this is a memory offset from chip's memory base)
  */
-static void serial_remote_write(struct uart_port *port, int offset, int value)
+static void __serial_remote_write(struct uart_port *port, int offset, int value)
 {
-    //uart_prdbg("Serial WRITE for line=%d/%d", port->line, ttySs[port->line].line);
+    struct serial8250_16550A_vdev *vdev = get_port_vdev(port);
+    //uart_prdbg("Serial WRITE for line=%d/%d", port->line, vdev->line);
 
-    struct serial8250_16550A_vdev *vdev = get_line_vdev(port->line);
     lock_vuart(vdev);
     capture_uart_port(vdev, port);
+    vuart_trace_begin(vdev, trace);
 
     switch (offset) {
         case UART_TX:
@@ -580,6 +1011,11 @@ static void serial_remote_write(struct uart_port *port, int offset, int value)
             if (!(vdev->fcr & UART_FCR_ENABLE_FIFO) && !(value & UART_FCR_ENABLE_FIFO))
                 value &= UART_FCR_ENABLE_FIFO;
 
+            //16750 with >=64 byte FIFO: bit 5 (64 byte mode) can only be changed while DLAB=1. This is what the
+            // 8250 driver uses to detect the chip (see autoconfig_16550a()). Real 16550A ignores this bit.
+            if ((vdev->lcr & UART_LCR_DLAB) && vdev->fifo_depth >= 64)
+                vdev->fifo64 = (value & UART_FCR7_64BYTE) != 0;
+
             vdev->fcr = value;
             reg_write_dump(vdev, fcr, "FCR");
 
@@ -626,9 +1062,59 @@ static void serial_remote_write(struct uart_port *port, int offset, int value)
 	}
 
     update_interrupts_state(vdev);
+    vuart_trace_end(vdev, trace, VUART_TRACE_WRITE, offset, value);
     unlock_vuart(vdev);
 }
 
+/**
+ * Instrumented entrypoints for __serial_remote_read() & __serial_remote_write()
+ */
+static unsigned int serial_remote_read(struct uart_port *port, int offset)
+{
+    return hook_stats_measure(HOOK_STATS_VUART_READ, __serial_remote_read(port, offset));
+}
+
+static void serial_remote_write(struct uart_port *port, int offset, int value)
+{
+    hook_stats_measure_void(HOOK_STATS_VUART_WRITE, __serial_remote_write(port, offset, value));
+}
+
+#ifdef RP_SELFTEST
+//The port is only known once the 8250 driver used it (see capture_uart_port()), which it does while registering it
+static int get_selftest_port(int line, struct uart_port **port)
+{
+    validate_line(line);
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    validate_line_vdev(vdev, line);
+    if (unlikely(!vdev->up))
+        return -EAGAIN;
+
+    *port = vdev->up;
+    return 0;
+}
+
+int vuart_selftest_read(int line, int offset, unsigned int *val)
+{
+    struct uart_port *port;
+    int out = get_selftest_port(line, &port);
+    if (out == 0)
+        *val = serial_remote_read(port, offset);
+
+    return out;
+}
+
+int vuart_selftest_write(int line, int offset, int value)
+{
+    struct uart_port *port;
+    int out = get_selftest_port(line, &port);
+    if (out == 0)
+        serial_remote_write(port, offset, value);
+
+    return out;
+}
+#endif //RP_SELFTEST
+
 
 /************************************************** vUART Glue Layer **************************************************/
 static driver_watcher_instance *driver_watcher = NULL;
@@ -649,11 +1135,19 @@ static int initialize_ttyS(struct serial8250_16550A_vdev *vdev)
     }
 
     reset_device(vdev); //Puts device in a known RESET state as defined by the real chip docs
+    if (!vdev->fifo_depth)
+        vdev->fifo_depth = VUART_FIFO_LEN;
+    vdev->tx_flush_at = VUART_FIFO_LEN;
+    vdev->tx_boost = 0;
+#ifdef VUART_STATS_ENABLED
+    memset(&vdev->stats, 0, sizeof(vdev->stats));
+#endif
     if ((out = alloc_fifos(vdev) != 0))
         return out;
 
     kmalloc_or_exit_int(vdev->lock, sizeof(spinlock_t));
     spin_lock_init(vdev->lock);
+    seqcount_init(&vdev->reg_seq);
 
     //virq_* stuff is allocated/freed by enable_/disable_interrupts()
 
@@ -787,35 +1281,13 @@ static int try_leave_serial8250_driver(void)
 }
 
 /**
- * Asks the Linux 8250 driver to UPDATE properties of a given serial device which matches line & iobase
+ * Registers vdev as a port in the 8250 driver
  *
- * The reason why this function is called update_ rather than add_ is that we're NOT adding anything new to the driver.
- * Rather we're registering a port which is already there (as vUART only deals with COM1-4, i.e. legacy IBM/PC ports)
- * and matches our spec.
+ * @return line # assigned by the driver on success, -E on error
  */
-static int update_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
+static int register_vdev_port(struct serial8250_16550A_vdev *vdev)
 {
     int out;
-    pr_loc_dbg("Registering ttyS%d (io=0x%x) in the driver", vdev->line, vdev->iobase);
-
-    if (unlikely(vdev->registered)) {
-        pr_loc_bug("Port ttyS%d (io=0x%x) is already registered in the driver", vdev->line, vdev->iobase);
-        return -EEXIST;
-    }
-
-    int driver_ready_tristate = try_wait_for_serial8250_driver();
-    if (driver_ready_tristate == 0) {
-        pr_loc_wrn("The %s driver is not ready - vUART port ttyS%d (io=0x%x) will be activated later", UART_DRIVER_NAME,
-                   vdev->line, vdev->iobase);
-        return 0;
-    }
-
-    if (driver_ready_tristate < 0) {
-        pr_loc_err("%s failed due to underlining driver error", __FUNCTION__);
-        return driver_ready_tristate;
-    }
-
-
     struct uart_8250_port *up;
     kzalloc_or_exit_int(up, sizeof(struct uart_8250_port));
     struct uart_port *port = &up->port;
@@ -836,6 +1308,7 @@ static int update_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
     port->regshift = 0;
     port->serial_in = serial_remote_read;
     port->serial_out = serial_remote_write;
+    port->private_data = vdev->dynamic ? vdev : NULL; //copied into the real port, see get_port_vdev()
     port->type = PORT_16550A;
     up->cur_iotype = 0xFF;
 
@@ -845,17 +1318,51 @@ static int update_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
 
     //This is the most explosion-prone section so logs are useful
     uart_prdbg("Calling serial8250_register_8250_port to register port");
-    if ((out = serial8250_register_8250_port(up)) < 0) { //it returns port # on success or -E on error
+    out = serial8250_register_8250_port(up); //it returns port # on success or -E on error
+    kfree(up);
+
+    return out;
+}
+
+/**
+ * Asks the Linux 8250 driver to UPDATE properties of a given serial device which matches line & iobase
+ *
+ * The reason why this function is called update_ rather than add_ is that we're NOT adding anything new to the driver.
+ * Rather we're registering a port which is already there (as vUART only deals with COM1-4, i.e. legacy IBM/PC ports)
+ * and matches our spec.
+ */
+static int update_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
+{
+    int out;
+    pr_loc_dbg("Registering ttyS%d (io=0x%x) in the driver", vdev->line, vdev->iobase);
+
+    if (unlikely(vdev->registered)) {
+        pr_loc_bug("Port ttyS%d (io=0x%x) is already registered in the driver", vdev->line, vdev->iobase);
+        return -EEXIST;
+    }
+
+    int driver_ready_tristate = try_wait_for_serial8250_driver();
+    if (driver_ready_tristate == 0) {
+        pr_loc_wrn("The %s driver is not ready - vUART port ttyS%d (io=0x%x) will be activated later", UART_DRIVER_NAME,
+                   vdev->line, vdev->iobase);
+        return 0;
+    }
+
+    if (driver_ready_tristate < 0) {
+        pr_loc_err("%s failed due to underlining driver error", __FUNCTION__);
+        return driver_ready_tristate;
+    }
+
+
+    if ((out = register_vdev_port(vdev)) < 0) {
         pr_loc_err("Failed to register ttyS%d - driver failure (error=%d)", vdev->line, out);
-        goto out_free;
+        return out;
     }
     pr_loc_dbg("ttyS%d registered with driver (line=%d)", vdev->line, out);
-    out = 0; //serial8250_register_8250_port return serial port line # or -E code
     vdev->registered = true;
+    install_bulk_console(vdev); //the console (if it's on this line) is registered with the port at the latest
 
-    out_free:
-    kfree(up);
-    return out;
+    return 0;
 }
 
 /**
@@ -877,6 +1384,10 @@ static int restore_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
         return 0; //not an error as technically the port is NOT in the driver
     }
 
+    //Re-registration keeps the ops of the port (they're set once by the driver) so our private copy must go first
+    uninstall_bulk_tx(vdev);
+    vdev->up = NULL; //the port will be captured again if it's ever re-registered as vUART
+
     struct uart_8250_port *up;
     kzalloc_or_exit_int(up, sizeof(struct uart_8250_port));
     struct uart_port *port = &up->port;
@@ -908,38 +1419,129 @@ static int restore_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
     return out;
 }
 
-int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int threshold)
+/**
+ * Finds an iobase for a dynamic line which doesn't collide with anything (see VUART_DYN_IOBASE_FIRST)
+ *
+ * @return iobase or 0 if none is free
+ */
+static u16 find_dyn_iobase(void)
+{
+    for (unsigned int iobase = VUART_DYN_IOBASE_FIRST; iobase <= VUART_DYN_IOBASE_LAST;
+         iobase += VUART_DYN_IOBASE_SIZE) {
+        bool taken = false;
+        for (int i = 0; i < VUART_DYN_LINES; ++i) {
+            if (dyn_ttySs[i].initialized && dyn_ttySs[i].iobase == iobase) {
+                taken = true;
+                break;
+            }
+        }
+
+        //The driver claims the region when the port is configured - it has to be free for that
+        if (taken || !request_region(iobase, VUART_DYN_IOBASE_SIZE, UART_DRIVER_NAME))
+            continue;
+
+        release_region(iobase, VUART_DYN_IOBASE_SIZE);
+        return iobase;
+    }
+
+    return 0;
+}
+
+/**
+ * Registers a dynamic line vdev as a NEW port in the 8250 driver; unlike ISA ones it's not delayed until the driver
+ * loads as the caller needs to know the line # right away
+ */
+static int register_serial8250_dyn_port(struct serial8250_16550A_vdev *vdev)
+{
+    int out;
+    if ((out = probe_driver()) != 1) {
+        pr_loc_err("Cannot register dynamic vUART - the %s driver is not ready", UART_DRIVER_NAME);
+        return out < 0 ? out : -ENODEV;
+    }
+
+    if ((out = register_vdev_port(vdev)) < 0) {
+        pr_loc_err("Failed to register dynamic vUART (io=0x%x) - driver failure (error=%d)", vdev->iobase, out);
+        return out;
+    }
+
+    //The driver falls back to any unused slot when it runs out of never used ones, which could be an absent ISA port
+    if (unlikely(out < VUART_ISA_LINES)) {
+        pr_loc_err("Driver registered dynamic vUART (io=0x%x) as ISA line ttyS%d - no free lines left", vdev->iobase,
+                   out);
+        serial8250_unregister_port(out);
+        return -ENOSPC;
+    }
+
+    vdev->line = out;
+    vdev->registered = true;
+    dyn_lines[vdev->line] = vdev;
+    pr_loc_dbg("Dynamic vUART (io=0x%x) registered with driver as ttyS%d", vdev->iobase, vdev->line);
+    install_bulk_console(vdev); //console= could've been set for that line before the port existed
+
+    return 0;
+}
+
+/**
+ * Removes a dynamic line port from the 8250 driver; the line is free to be reused by the driver afterwards
+ */
+static int unregister_serial8250_dyn_port(struct serial8250_16550A_vdev *vdev)
+{
+    if (unlikely(!vdev->registered))
+        return 0;
+
+    uninstall_bulk_tx(vdev);
+    vdev->up = NULL;
+
+    pr_loc_dbg("Unregistering dynamic vUART ttyS%d (io=0x%x) from the driver", vdev->line, vdev->iobase);
+    serial8250_unregister_port(vdev->line);
+    vdev->registered = false;
+
+    return 0;
+}
+
+/**
+ * Sets either copying or zero-copy TX callback (see vuart_set_tx_callback() and vuart_set_tx_span_callback())
+ */
+static int set_tx_callback(int line, vuart_callback_t *cb, vuart_span_callback_t *span_cb, char *buffer,
+                           int threshold)
 {
-    validate_isa_line(line);
+    validate_line(line);
 
     struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
-    if (!cb) {
+    validate_line_vdev(vdev, line);
+    if (!cb && !span_cb) {
         pr_loc_dbg("Removing TX callback for ttyS%d (line=%d)", line, vdev->line);
-        if (unlikely(!flush_cbs[line])) {
+        if (unlikely(!vdev->tx_cb)) {
             pr_loc_dbg("Nothing to do - no TX callback set");
             return 0;
         }
 
-        //We don't really need to lock for that
-        kfree(flush_cbs[line]);
-        flush_cbs[line] = NULL;
+        //The flush runs under the lock, so the callback cannot be freed from under it (the lock may not exist when
+        // the device is not added yet, but then nothing is flushed either)
+        lock_vuart_oppr(vdev);
+        struct flush_callback *old_cb = vdev->tx_cb;
+        vdev->tx_cb = NULL;
+        unlock_vuart_oppr(vdev);
+        kfree(old_cb);
 
         pr_loc_dbg("Removed TX callback for ttyS%d (line=%d)", line, vdev->line);
         return 0;
     }
 
     pr_loc_dbg("Setting TX callback for for ttyS%d (line=%d)", line, vdev->line);
-    line = vdev->line; //this looks to make no sense BUT it does when serials are swapped
-    if (likely(!flush_cbs[line])) { //if there was already a cb there we don't need to reserve memory
-        kmalloc_or_exit_int(flush_cbs[line], sizeof(struct flush_callback));
-    }
+    struct flush_callback *new_cb = NULL;
+    if (likely(!vdev->tx_cb)) //if there was already a cb there we don't need to reserve memory
+        kmalloc_or_exit_int(new_cb, sizeof(struct flush_callback));
 
     //This can technically be called during serial port operation so we need to get a lock before we change these or
     // we risk sending a buffer to a wrong function. That lock may not exist when device is not added yet.
     lock_vuart_oppr(vdev);
-    flush_cbs[line]->fn = cb;
-    flush_cbs[line]->buffer = buffer;
-    flush_cbs[line]->threshold = threshold;
+    if (new_cb)
+        vdev->tx_cb = new_cb;
+    vdev->tx_cb->fn = cb;
+    vdev->tx_cb->span_fn = span_cb;
+    vdev->tx_cb->buffer = buffer;
+    vdev->tx_cb->threshold = threshold;
     unlock_vuart_oppr(vdev);
 
     pr_loc_dbg("Added TX callback for ttyS%d (line=%d)", line, vdev->line);
@@ -947,16 +1549,28 @@ int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int thre
     return 0;
 }
 
+int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int threshold)
+{
+    return set_tx_callback(line, cb, NULL, buffer, threshold);
+}
+
+int vuart_set_tx_span_callback(int line, vuart_span_callback_t *cb, int threshold)
+{
+    return set_tx_callback(line, NULL, cb, NULL, threshold);
+}
+
 int vuart_inject_rx(int line, const char *buffer, int length)
 {
-    validate_isa_line(line);
-    
-    if (unlikely(length > VUART_FIFO_LEN)) {
-        pr_loc_bug("Attempted to inject buffer of %d bytes - it's larger than FIFO size (%d bytes)", length, VUART_FIFO_LEN);
+    validate_line(line);
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    validate_line_vdev(vdev, line);
+    if (unlikely(length > vdev->fifo_depth)) {
+        pr_loc_bug("Attempted to inject buffer of %d bytes - it's larger than FIFO size (%d bytes)", length,
+                   vdev->fifo_depth);
         return -E2BIG;
     }
-    
-    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+
     if (unlikely(!vdev->initialized)) {
         pr_loc_bug("Cannot inject data into non-initialized or non-registered device");
         return -ENXIO;
@@ -967,26 +1581,162 @@ int vuart_inject_rx(int line, const char *buffer, int length)
         return 0;
     }
 
+    //Registers are changed here, so lockless readers must see it as a write section (see try_lockless_read())
+    lock_vuart(vdev);
+
     //No space to put data - not an error per-sen as this can be re-run again
-    if ((vdev->lsr & UART_LSR_DR) && unlikely(kfifo_is_full(vdev->rx_fifo) || unlikely(vdev->mcr & UART_MCR_LOOP)))
+    if ((vdev->lsr & UART_LSR_DR) && unlikely(kfifo_is_full(vdev->rx_fifo) || unlikely(vdev->mcr & UART_MCR_LOOP))) {
+        vuart_stat_add(vdev, rx_refused, length);
+        unlock_vuart(vdev);
         return 0;
-    
-    
-    int put_bytes = kfifo_in(vdev->rx_fifo, buffer, VUART_FIFO_LEN);
+    }
+
+    int put_bytes = kfifo_in(vdev->rx_fifo, buffer, length);
+    vuart_stat_add(vdev, rx_bytes, put_bytes);
+    vuart_stat_add(vdev, rx_refused, length - put_bytes);
     if (likely(put_bytes > 0))
         vdev->lsr |= UART_LSR_DR;
 
     uart_prdbg("Injected %d bytes into ttyS%d RX", put_bytes, line);
     update_interrupts_state(vdev);
+    unlock_vuart(vdev);
 
     return put_bytes;
 }
 
+int vuart_set_rx_stream(int line, unsigned int size, vuart_rx_callback_t *cb)
+{
+    validate_line(line);
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    validate_line_vdev(vdev, line);
+    if (unlikely(size && (size < VUART_FIFO_LEN || !is_power_of_2(size)))) {
+        pr_loc_err("Invalid RX stream size %u - it must be a power of 2 of at least %d", size, VUART_FIFO_LEN);
+        return -EINVAL;
+    }
+
+    struct kfifo *new_ring = NULL;
+    if (size) {
+        kzalloc_or_exit_int(new_ring, sizeof(struct kfifo));
+        if (unlikely(kfifo_alloc(new_ring, size, GFP_KERNEL) != 0)) {
+            pr_loc_crt("kfifo_alloc for RX stream @ %d failed", line);
+            kfree(new_ring);
+            return -ENOMEM;
+        }
+    }
+
+    lock_vuart_oppr(vdev);
+    struct kfifo *old_ring = vdev->rx_ring;
+    vdev->rx_ring = new_ring;
+    vdev->rx_ring_cb = cb;
+    vdev->rx_ring_refused = false;
+    unlock_vuart_oppr(vdev);
+
+    if (old_ring) {
+        if (unlikely(!kfifo_is_empty(old_ring)))
+            pr_loc_wrn("Discarding %u bytes of ttyS%d RX stream", kfifo_len(old_ring), line);
+        kfifo_free(old_ring);
+        kfree(old_ring);
+    }
+
+    pr_loc_dbg("RX stream for ttyS%d set to %u bytes", line, size);
+    return 0;
+}
+
+int vuart_stream_rx(int line, const char *buffer, unsigned int length)
+{
+    validate_line(line);
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    validate_line_vdev(vdev, line);
+    if (unlikely(!vdev->initialized)) {
+        pr_loc_bug("Cannot stream data into non-initialized or non-registered device");
+        return -ENXIO;
+    }
+
+    if (unlikely(!vdev->registered)) {
+        pr_loc_wrn("Cannot stream data into unregistered device"); //...as it will be removed by the driver on reg
+        return 0;
+    }
+
+    lock_vuart(vdev);
+    if (unlikely(!vdev->rx_ring)) {
+        unlock_vuart(vdev);
+        pr_loc_bug("Cannot stream data into ttyS%d - no RX stream set (see vuart_set_rx_stream())", line);
+        return -ENOBUFS;
+    }
+
+    unsigned int accepted = kfifo_in(vdev->rx_ring, buffer, length);
+    if (accepted < length)
+        vdev->rx_ring_refused = true;
+    vuart_stat_add(vdev, rx_bytes, accepted);
+    vuart_stat_add(vdev, rx_refused, length - accepted);
+
+    //If the kernel isn't reading yet we need to give it the first batch; otherwise it will take it as the FIFO drains
+    if (kfifo_is_empty(vdev->rx_fifo))
+        refill_rx_fifo(vdev);
+
+    uart_prdbg("Streamed %u/%u bytes into ttyS%d RX", accepted, length, line);
+    update_interrupts_state(vdev);
+    unlock_vuart(vdev);
+
+    return accepted;
+}
+
+int vuart_set_fifo_depth(int line, unsigned int depth)
+{
+    validate_line(line);
+
+    if (unlikely(!is_valid_fifo_depth(depth))) {
+        pr_loc_err("Invalid FIFO depth %u - it must be a power of 2 between %d and %d", depth, VUART_FIFO_LEN,
+                   VUART_FIFO_LEN_MAX);
+        return -EINVAL;
+    }
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    validate_line_vdev(vdev, line);
+    if (unlikely(vdev->initialized)) {
+        pr_loc_bug("Cannot change FIFO depth of ttyS%d - it's already added", line);
+        return -EBUSY;
+    }
+
+    vdev->fifo_depth = depth;
+    pr_loc_dbg("FIFO depth of ttyS%d set to %u", line, depth);
+
+    return 0;
+}
+
+int vuart_set_irq_coalescing(int line, unsigned int max_latency_us, unsigned int min_bytes)
+{
+    validate_line(line);
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    validate_line_vdev(vdev, line);
+    unsigned int depth = vdev->fifo_depth ? vdev->fifo_depth : VUART_FIFO_LEN;
+    if (unlikely(max_latency_us > VUART_COALESCE_MAX_USECS ||
+                 (max_latency_us && (min_bytes == 0 || min_bytes > depth)))) {
+        pr_loc_err("Invalid vIRQ coalescing params for ttyS%d: max_latency=%uus (max %d) min_bytes=%u (max %u)", line,
+                   max_latency_us, VUART_COALESCE_MAX_USECS, min_bytes, depth);
+        return -EINVAL;
+    }
+
+    int out = vuart_virq_set_coalescing(vdev, max_latency_us, min_bytes);
+    if (out == 0)
+        pr_loc_dbg("vIRQ coalescing for ttyS%d set to max_latency=%uus min_bytes=%u", line, max_latency_us,
+                   min_bytes);
+
+    return out;
+}
+
 int vuart_add_device(int line)
 {
     pr_loc_dbg("Adding vUART ttyS%d", line);
 
-    validate_isa_line(line);
+    validate_line(line);
+    if (unlikely(line >= VUART_ISA_LINES)) {
+        pr_loc_err("Cannot replace ttyS%d - only ISA lines can be, use vuart_add_dynamic_device() for others", line);
+        return -EINVAL;
+    }
     warn_bug_swapped(line);
 
     int out;
@@ -1017,16 +1767,195 @@ int vuart_remove_device(int line)
 {
     pr_loc_dbg("Removing vUART ttyS%d", line);
 
-    validate_isa_line(line);
+    validate_line(line);
     warn_bug_swapped(line);
 
     int out;
     struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    validate_line_vdev(vdev, line);
+    uninstall_bulk_console(vdev); //it uses FIFOs which are freed below
     if ((out = vuart_disable_interrupts(vdev)) != 0 || (out = deinitialize_ttyS(vdev)) != 0 ||
-        (out = restore_serial8250_isa_port(vdev)) != 0 || (out = vuart_set_tx_callback(line, NULL, NULL, 0)) != 0)
+        (out = (vdev->dynamic ? unregister_serial8250_dyn_port(vdev) : restore_serial8250_isa_port(vdev))) != 0 ||
+        (out = vuart_set_tx_callback(line, NULL, NULL, 0)) != 0 || (out = vuart_set_rx_stream(line, 0, NULL)) != 0)
         return out;
 
+    if (vdev->dynamic) {
+        dyn_lines[line] = NULL; //the pool entry itself stays, see dyn_ttySs
+        pr_loc_inf("Removed dynamic vUART at ttyS%d", line);
+        return 0;
+    }
+
     pr_loc_inf("Removed vUART & restored original UART at ttyS%d", line);
 
     return 0;
-}
\ No newline at end of file
+}
+
+int vuart_add_dynamic_device(unsigned int fifo_depth)
+{
+    pr_loc_dbg("Adding dynamic vUART");
+
+    if (!fifo_depth)
+        fifo_depth = VUART_FIFO_LEN;
+    if (unlikely(!is_valid_fifo_depth(fifo_depth))) {
+        pr_loc_err("Invalid FIFO depth %u - it must be a power of 2 between %d and %d", fifo_depth, VUART_FIFO_LEN,
+                   VUART_FIFO_LEN_MAX);
+        return -EINVAL;
+    }
+
+    struct serial8250_16550A_vdev *vdev = NULL;
+    for (int i = 0; i < VUART_DYN_LINES; ++i) {
+        if (!dyn_ttySs[i].initialized && !dyn_ttySs[i].registered) {
+            vdev = &dyn_ttySs[i];
+            break;
+        }
+    }
+
+    if (unlikely(!vdev)) {
+        pr_loc_err("Cannot add dynamic vUART - all %d lines above ISA ones are taken (CONFIG_SERIAL_8250_NR_UARTS=%d)",
+                   VUART_DYN_LINES, UART_NR);
+        return -ENOSPC;
+    }
+
+    //Whatever the entry was before (it's reused), it must look like a fresh ttySs one
+    memset(vdev, 0, sizeof(*vdev));
+    vdev->dynamic = true;
+    vdev->irq = VUART_DYN_IRQ;
+    vdev->baud = STD_COMX_BAUD;
+    vdev->fifo_depth = fifo_depth;
+    if (unlikely(!(vdev->iobase = find_dyn_iobase()))) {
+        pr_loc_err("Cannot add dynamic vUART - no free iobase found between 0x%x and 0x%x", VUART_DYN_IOBASE_FIRST,
+                   VUART_DYN_IOBASE_LAST);
+        return -EBUSY;
+    }
+
+    int out;
+    if ((out = initialize_ttyS(vdev)) != 0)
+        return out;
+
+    if ((out = register_serial8250_dyn_port(vdev)) != 0)
+        goto error_deinit;
+
+    if ((out = vuart_enable_interrupts(vdev)) != 0)
+        goto error_unregister;
+
+    pr_loc_inf("Added dynamic vUART at ttyS%d (io=0x%x)", vdev->line, vdev->iobase);
+    return vdev->line;
+
+    error_unregister:
+    uninstall_bulk_console(vdev);
+    unregister_serial8250_dyn_port(vdev);
+    dyn_lines[vdev->line] = NULL;
+
+    error_deinit:
+    deinitialize_ttyS(vdev);
+
+    return out;
+}
+
+/*************************************************** Line statistics *************************************************/
+#ifdef VUART_STATS_ENABLED
+#define VUART_STATS_FILE "vuart_stats"
+
+static struct dentry *stats_file = NULL;
+
+static int vuart_stats_show(struct seq_file *m, void *v)
+{
+    seq_printf(m, "%-6s %5s %12s %12s %12s %10s %10s %10s %7s %12s %10s %7s %10s\n", "line", "depth", "tx_bytes",
+               "tx_delivered", "tx_discarded", "fl_thresh", "fl_idle", "fl_full", "tx_oe", "rx_bytes", "rx_refused",
+               "rx_oe", "virqs");
+
+    for (int slot = 0; slot < VUART_ISA_LINES + VUART_DYN_LINES; ++slot) {
+        struct serial8250_16550A_vdev *vdev = get_slot_vdev(slot);
+        if (!vdev->initialized)
+            continue;
+
+        //Counters are read without the lock - they're never freed and a slightly stale value is fine here
+        struct vuart_stats *st = &vdev->stats;
+        seq_printf(m, "ttyS%-2d %5u %12llu %12llu %12llu %10llu %10llu %10llu %7llu %12llu %10llu %7llu %10llu\n",
+                   vdev->line, vdev->fifo_depth, ACCESS_ONCE(st->tx_bytes), ACCESS_ONCE(st->tx_delivered),
+                   ACCESS_ONCE(st->tx_discarded), ACCESS_ONCE(st->tx_flushes[VUART_FLUSH_THRESHOLD]),
+                   ACCESS_ONCE(st->tx_flushes[VUART_FLUSH_IDLE]), ACCESS_ONCE(st->tx_flushes[VUART_FLUSH_FULL]),
+                   ACCESS_ONCE(st->tx_overruns), ACCESS_ONCE(st->rx_bytes), ACCESS_ONCE(st->rx_refused),
+                   ACCESS_ONCE(st->rx_overruns), ACCESS_ONCE(st->virq_delivered));
+    }
+
+    return 0;
+}
+
+int for_each_vuart_stats(vuart_stats_cb *cb, void *data)
+{
+    struct vuart_stats st;
+
+    for (int slot = 0; slot < VUART_ISA_LINES + VUART_DYN_LINES; ++slot) {
+        struct serial8250_16550A_vdev *vdev = get_slot_vdev(slot);
+        if (!vdev->initialized)
+            continue;
+
+        //Same rules as for the debugfs file - a slightly torn copy is fine
+        memcpy(&st, &vdev->stats, sizeof(st));
+        int out = cb(vdev->line, vdev->fifo_depth, &st, data);
+        if (out != 0)
+            return out;
+    }
+
+    return 0;
+}
+
+static int vuart_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, vuart_stats_show, NULL);
+}
+
+static ssize_t vuart_stats_reset(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
+{
+    for (int slot = 0; slot < VUART_ISA_LINES + VUART_DYN_LINES; ++slot)
+        memset(&get_slot_vdev(slot)->stats, 0, sizeof(struct vuart_stats));
+
+    pr_loc_dbg("vUART stats reset");
+    return len;
+}
+
+static const struct file_operations vuart_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = vuart_stats_open,
+    .read = seq_read,
+    .write = vuart_stats_reset,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int register_vuart_stats(void)
+{
+    if (unlikely(stats_file)) {
+        pr_loc_bug("vUART stats are already registered");
+        return -EALREADY;
+    }
+
+    struct dentry *dir = get_rp_debugfs_dir();
+    if (!dir)
+        return 0; //debugfs not available - it's not critical for the module to work
+
+    stats_file = debugfs_create_file(VUART_STATS_FILE, 0600, dir, NULL, &vuart_stats_fops);
+    if (IS_ERR_OR_NULL(stats_file)) {
+        pr_loc_wrn("Failed to create debugfs file for vUART stats - they will not be available");
+        stats_file = NULL;
+        put_rp_debugfs_dir();
+        return 0;
+    }
+
+    pr_loc_inf("vUART stats available in debugfs at %s", VUART_STATS_FILE);
+    return 0;
+}
+
+int unregister_vuart_stats(void)
+{
+    if (!stats_file)
+        return 0; //it's not an error as debugfs may not be available
+
+    debugfs_remove(stats_file);
+    stats_file = NULL;
+    put_rp_debugfs_dir();
+
+    return 0;
+}
+#endif //VUART_STATS_ENABLED
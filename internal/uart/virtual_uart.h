@@ -2,6 +2,12 @@
 #define REDPILL_VIRTUAL_UART_H
 
 #include <linux/types.h> //bool
+#include "../helper/debugfs_helper.h" //RP_DEBUGFS_ENABLED
+
+//Line stats are exposed via debugfs - there's no point in gathering them if it's not available
+#ifdef RP_DEBUGFS_ENABLED
+#define VUART_STATS_ENABLED
+#endif
 
 /**
  * Length of the RX/TX FIFO in bytes
@@ -9,6 +15,11 @@
  */
 #define VUART_FIFO_LEN 16
 
+/**
+ * Maximum depth of the FIFO which can be set using vuart_set_fifo_depth()
+ */
+#define VUART_FIFO_LEN_MAX 128
+
 /**
  * Defines maximum threshold possible; in practice this means you will never get any THRESHOLD events but only ID:E and
  * FULL ones.
@@ -44,6 +55,52 @@ typedef enum {
  */
 typedef void (vuart_callback_t)(int line, const char *buffer, unsigned int len, vuart_flush_reason reason);
 
+/**
+ * A single contiguous piece of data in the TX FIFO, see vuart_span_callback_t
+ */
+typedef struct vuart_span {
+    const char *data;
+    unsigned int len;
+} vuart_span;
+
+/**
+ * Represents a zero-copy callback signature
+ *
+ * Instead of getting a copy of the data in your own buffer you get a direct view of the FIFO. Since the FIFO is a ring
+ * the data may wrap around - in such case it's split into two spans (spans[1].len is 0 otherwise). The data should be
+ * read in order: spans[0] first, then spans[1]. The spans are only valid until the callback returns - after that all
+ * data is considered consumed.
+ *
+ * @param line UART# where the data arrived; you can ignore it if you registered only one UART
+ * @param spans Two spans making up the data, see above
+ * @param len Total number of bytes available (i.e. spans[0].len + spans[1].len)
+ * @param reason Denotes why the vUART decided to flush the buffer to the callback
+ */
+typedef void (vuart_span_callback_t)(int line, const vuart_span spans[2], unsigned int len, vuart_flush_reason reason);
+
+/**
+ * Reasons why the RX stream callback is called, see vuart_set_rx_stream()
+ */
+typedef enum {
+    //Caller was previously refused (part of) the data and now the staging ring has at least half of its size free
+    VUART_RX_WRITABLE,
+
+    //Everything that was streamed has been moved to the chip FIFO (i.e. the kernel is picking up the last bytes)
+    VUART_RX_DRAINED,
+} vuart_rx_event;
+
+/**
+ * Represents an RX stream callback signature
+ *
+ * It is called with the port locked from an atomic context (usually the 8250 interrupt handler): you must NOT call
+ * vuart_* functions from it - schedule a work/wake up your thread to stream more data instead.
+ *
+ * @param line UART# the stream belongs to
+ * @param space Number of bytes which can be streamed right now without being refused
+ * @param event See vuart_rx_event
+ */
+typedef void (vuart_rx_callback_t)(int line, unsigned int space, vuart_rx_event event);
+
 /**
  * Adds a virtual UART device
  *
@@ -51,6 +108,8 @@ typedef void (vuart_callback_t)(int line, const char *buffer, unsigned int len,
  * data will leave through the real one. However, by itself the data will not be delivered anywhere until you call
  * vuart_set_tx_callback(), which you can do before or after calling vuart_add_device().
  *
+ * Only legacy ISA lines (ttyS0-3) can be replaced - see vuart_add_dynamic_device() for adding more lines.
+ *
  * @param line UART number to replace, e.g. 0 for ttyS0. On systems with inverted UARTs you should use the real one, so
  *             even if ttyS0 points to 2nd physical port this method will ALWAYS use the one corresponding to ttyS*
  *
@@ -58,6 +117,24 @@ typedef void (vuart_callback_t)(int line, const char *buffer, unsigned int len,
  */
 int vuart_add_device(int line);
 
+/**
+ * Adds a virtual UART device on a NEW line, above the ISA ones
+ *
+ * Unlike vuart_add_device() this doesn't replace anything: a new port is registered with the 8250 driver, which
+ * assigns it the first free line. Every such line has its own FIFOs, lock and vIRQ context, so separate channels
+ * (e.g. PMU, console and agent) don't have to be multiplexed over the few ISA ports. The number of lines available is
+ * limited by CONFIG_SERIAL_8250_NR_UARTS and the 8250.nr_uarts param.
+ *
+ * Since the line isn't known before the device is added the FIFO depth is passed here (vuart_set_fifo_depth() cannot
+ * be used), and all other vuart_* functions can only be called for the line after it's added. The 8250 driver must
+ * be loaded already. The line is removed with vuart_remove_device() as usual.
+ *
+ * @param fifo_depth See vuart_set_fifo_depth(); 0 means the default of VUART_FIFO_LEN
+ *
+ * @return line # (i.e. ttyS#) on success or -E on error
+ */
+int vuart_add_dynamic_device(unsigned int fifo_depth);
+
 /**
  * Removes a virtual UART device
  *
@@ -73,6 +150,50 @@ int vuart_add_device(int line);
  */
 int vuart_remove_device(int line);
 
+/**
+ * Changes depth of both FIFOs of the port
+ *
+ * By default the port is a 16550A with 16 byte FIFOs. A virtual device has no baud rate so small FIFOs do nothing but
+ * multiply the number of callbacks. With depth of 64 or more the chip reports itself as a 16750 (so that the 8250
+ * driver uses 64 byte bursts). Regardless of the depth the TX side flushes on FULL every VUART_FIFO_LEN bytes at first
+ * and only grows that point (up to the depth) under sustained load, so that latency of short transmissions doesn't
+ * change. It's reset back on every IDLE flush.
+ * Copying callbacks (vuart_set_tx_callback()) are still called with at most VUART_FIFO_LEN bytes at a time.
+ *
+ * This must be called before vuart_add_device().
+ *
+ * @param line UART number, see vuart_add_device()
+ * @param depth Power of 2 between VUART_FIFO_LEN and VUART_FIFO_LEN_MAX
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_set_fifo_depth(int line, unsigned int depth);
+
+/**
+ * Maximum latency which can be set using vuart_set_irq_coalescing()
+ */
+#define VUART_COALESCE_MAX_USECS 100000
+
+/**
+ * Enables or disables coalescing of RX (data-ready) interrupts, similar to NIC interrupt moderation
+ *
+ * Normally every vuart_inject_rx() results in an interrupt being delivered to the 8250 driver. With coalescing enabled
+ * the interrupt is held until either min_bytes are waiting to be read or max_latency_us passed since it was raised,
+ * whichever comes first. Bulk data (e.g. console dumps injected in small pieces) is then picked up by a few handler
+ * invocations instead of hundreds. Other interrupts (THR empty, line status) are never delayed.
+ *
+ * This can be called before or after vuart_add_device(). It's not supported with VUART_USE_TIMER_FALLBACK (as the
+ * driver polls the port anyway).
+ *
+ * @param line UART number, see vuart_add_device()
+ * @param max_latency_us Time to hold the interrupt for, up to VUART_COALESCE_MAX_USECS; 0 disables coalescing
+ * @param min_bytes Number of bytes waiting in the RX FIFO which deliver the interrupt immediately; must be between 1
+ *                  and the FIFO depth (if max_latency_us is not 0)
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_set_irq_coalescing(int line, unsigned int max_latency_us, unsigned int min_bytes);
+
 /**
  * Injects data into RX stream of the port
  *
@@ -85,12 +206,42 @@ int vuart_remove_device(int line);
  * @param line UART number to replace, e.g. 0 for ttyS0. On systems with inverted UARTs you should use the real one, so
  *             even if ttyS0 points to 2nd physical port this method will ALWAYS use the one corresponding to ttyS*
  * @param buffer Pointer to a buffer where we will read from. There's no assumption as to what the buffer contains.
- * @param length Length to read from the buffer up to VUART_FIFO_LEN
+ * @param length Length to read from the buffer up to the FIFO depth (VUART_FIFO_LEN unless changed)
  *
  * @return 0 on success or -E on error
  */
 int vuart_inject_rx(int line, const char *buffer, int length);
 
+/**
+ * Sets up (or removes) a staging ring for streaming RX data bigger than the chip FIFO, see vuart_stream_rx()
+ *
+ * The ring sits behind the emulated RX FIFO and refills it every time the 8250 driver drains the FIFO. This can be
+ * called before or after vuart_add_device(); the ring is removed with the device. Changing the ring discards any data
+ * still waiting in the old one.
+ *
+ * @param line UART number, see vuart_add_device()
+ * @param size Size of the ring in bytes, a power of 2 of at least VUART_FIFO_LEN; 0 removes the ring
+ * @param cb Optional callback for backpressure release & completion signals, see vuart_rx_callback_t
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_set_rx_stream(int line, unsigned int size, vuart_rx_callback_t *cb);
+
+/**
+ * Streams data into RX of the port (see vuart_inject_rx() for what RX means here)
+ *
+ * Unlike vuart_inject_rx() the data is not limited by the FIFO depth: it's queued in the staging ring set with
+ * vuart_set_rx_stream() and delivered to the kernel as fast as it reads it. Data is never dropped - if the ring is full
+ * only a part (or nothing) is accepted and the callback will be called with VUART_RX_WRITABLE once there's space again.
+ *
+ * @param line UART number, see vuart_add_device()
+ * @param buffer Data to stream
+ * @param length Number of bytes in the buffer
+ *
+ * @return number of bytes accepted (which may be less than length or even 0) or -E on error
+ */
+int vuart_stream_rx(int line, const char *buffer, unsigned int length);
+
 /**
  * Set a function which will be called upon data transmission by the port opener
  *
@@ -123,4 +274,86 @@ int vuart_inject_rx(int line, const char *buffer, int length);
  */
 int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int threshold);
 
+/**
+ * Set a zero-copy function which will be called upon data transmission by the port opener
+ *
+ * This works exactly like vuart_set_tx_callback() (and replaces any callback set by it) but no intermediate buffer is
+ * used - see vuart_span_callback_t for details.
+ *
+ * @param line UART number, see vuart_set_tx_callback()
+ * @param cb Function to be called; call it with a NULL ptr to remove callback
+ * @param threshold See vuart_set_tx_callback()
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_set_tx_span_callback(int line, vuart_span_callback_t *cb, int threshold);
+
+#ifdef VUART_STATS_ENABLED
+#define VUART_FLUSH_REASONS (VUART_FLUSH_FULL + 1)
+
+/**
+ * Per-line counters, see register_vuart_stats()
+ *
+ * They're updated with vdev lock held (except virq_delivered which is only updated from the vIRQ context of the line)
+ * and read without it - they're only meant to be an approximation for tuning.
+ */
+struct vuart_stats {
+    u64 tx_bytes; //bytes written by the kernel into the TX FIFO
+    u64 tx_delivered; //bytes passed to TX callbacks
+    u64 tx_discarded; //bytes flushed with no TX callback set
+    u64 tx_flushes[VUART_FLUSH_REASONS];
+    u64 tx_overruns;
+    u64 rx_bytes; //bytes accepted into RX FIFO or RX stream
+    u64 rx_refused; //bytes which vuart_inject_rx()/vuart_stream_rx() couldn't take
+    u64 rx_overruns;
+    u64 virq_delivered;
+};
+
+/**
+ * Called by for_each_vuart_stats() for every added vUART
+ *
+ * @param stats copy of the counters
+ * @return 0 to continue, anything else to stop (it will be returned by for_each_vuart_stats())
+ */
+typedef int (vuart_stats_cb)(int line, unsigned int fifo_depth, const struct vuart_stats *stats, void *data);
+
+/**
+ * Walks line counters without any formatting (e.g. for telemetry)
+ *
+ * @return 0 when all lines were walked, or whatever the callback stopped with
+ */
+int for_each_vuart_stats(vuart_stats_cb *cb, void *data);
+
+/**
+ * Creates debugfs entry exposing per-line vUART statistics
+ *
+ * Reading the file prints, for every added vUART, bytes which went in & out of both FIFOs, TX flushes by reason,
+ * overruns and vIRQs delivered. Counters are zeroed when a vUART is added; writing anything to the file resets them for
+ * all lines.
+ *
+ * @return 0 on success, -E on error
+ */
+int register_vuart_stats(void);
+int unregister_vuart_stats(void);
+#else //VUART_STATS_ENABLED
+static inline int register_vuart_stats(void) { return 0; }
+static inline int unregister_vuart_stats(void) { return 0; }
+#endif //VUART_STATS_ENABLED
+
+#ifdef RP_SELFTEST
+/**
+ * Reads a register of an added vUART exactly like the 8250 driver does (used by selftest/redpill_selftest.c only)
+ *
+ * @param offset UART_* register
+ *
+ * @return 0 on success, -ENODEV if the line isn't a vUART, -EAGAIN if the 8250 driver didn't touch the port yet
+ */
+int vuart_selftest_read(int line, int offset, unsigned int *val);
+
+/**
+ * Writes a register of an added vUART exactly like the 8250 driver does; see vuart_selftest_read()
+ */
+int vuart_selftest_write(int line, int offset, int value);
+#endif //RP_SELFTEST
+
 #endif //REDPILL_VIRTUAL_UART_H
@@ -0,0 +1,446 @@
+/**
+ * Userspace bridge for vUART lines - see header file for the overview
+ *
+ * INTERNALS
+ * ---------
+ * TX (apps -> process): a zero-copy TX callback copies spans of the chip FIFO straight into the shared TX ring. It's
+ * called under the vdev lock so it's the only producer; the process (or read()) is the only consumer.
+ * RX (process -> apps): the process (or write()) is the only producer of the shared RX ring. The ring is pumped by a
+ * work item into the vUART RX stream (vuart_stream_rx()). When the stream refuses data the work stops and is scheduled
+ * again by the stream VUART_RX_WRITABLE callback (which cannot call vuart_* itself as it runs under the vdev lock).
+ * All heads & tails live in the shared page, so the process can write anything there. They're only ever used through
+ * the *_used()/*_free() helpers which treat a distance larger than the ring as a corruption (i.e. as nothing to read
+ * or no space to write), so that no copy can reach past a ring.
+ *
+ * LIFETIME
+ * The bridge (and its shm) is refcounted: the registration, the opened file and every VMA mapping the shm hold a
+ * reference. Unregistering removes the device & vUART callbacks right away, but the memory is only freed when the last
+ * reference is gone - a process may keep the shm mapped long after it closed the device.
+ */
+#include "vuart_bridge.h"
+
+#ifdef VUART_BRIDGE_ENABLED
+#include "virtual_uart.h"
+#include "../../common.h"
+#include "../../config/uart_defs.h" //SERIAL8250_LAST_ISA_LINE
+#include "../housekeeping.h" //housekeeping_wq()
+#include <linux/miscdevice.h> //misc_register(), misc_deregister()
+#include <linux/fs.h> //struct file_operations
+#include <linux/poll.h> //poll_wait(), POLL*
+#include <linux/mm.h> //remap_vmalloc_range()
+#include <linux/vmalloc.h> //vmalloc_user(), vfree()
+#include <linux/workqueue.h> //RX pump (queue_work())
+#include <linux/wait.h> //blocking read/write & poll
+#include <linux/mutex.h> //serializing readers/writers
+#include <linux/uaccess.h> //copy_to_user(), copy_from_user()
+#include <linux/kref.h> //struct kref, kref_get(), kref_put()
+
+#ifndef VUART_BRIDGE_NAME_FMT
+#define VUART_BRIDGE_NAME_FMT "vuart%d"
+#endif
+
+#define RING_MASK (VUART_BRIDGE_RING_SIZE - 1)
+#define SHM_TX_OFFSET PAGE_SIZE
+#define SHM_RX_OFFSET (SHM_TX_OFFSET + VUART_BRIDGE_RING_SIZE)
+#define SHM_SIZE (SHM_RX_OFFSET + VUART_BRIDGE_RING_SIZE)
+
+struct vuart_bridge {
+    int line;
+    char name[16];
+    struct miscdevice misc;
+    atomic_t opened;
+    struct kref ref;
+    bool dead; //unregistered; the line may already belong to someone else
+
+    struct vuart_bridge_shm *shm; //whole mmap-able area, starting with the header page
+    char *tx_ring;
+    char *rx_ring;
+
+    wait_queue_head_t wq; //woken up when TX data arrives or RX space is freed
+    struct mutex read_lock;
+    struct mutex write_lock;
+    struct work_struct rx_work;
+};
+
+static struct vuart_bridge *bridges[SERIAL8250_LAST_ISA_LINE+1] = { NULL };
+
+/******************************************************* Rings *******************************************************/
+/**
+ * Returns number of bytes between tail & head, or 0 if they're further apart than a ring (i.e. they're garbage)
+ */
+static inline u32 ring_used(u32 head, u32 tail)
+{
+    u32 used = head - tail;
+    return used > VUART_BRIDGE_RING_SIZE ? 0 : used;
+}
+
+static inline u32 tx_used(struct vuart_bridge *b)
+{
+    //Tail may be garbage when the process writes it directly - never trust it to be more than a ring away
+    return ring_used(ACCESS_ONCE(b->shm->tx_head), ACCESS_ONCE(b->shm->tx_tail));
+}
+
+static inline u32 rx_free(struct vuart_bridge *b)
+{
+    //Head may be garbage when the process writes it directly - never trust it to be more than a ring away
+    u32 used = ACCESS_ONCE(b->shm->rx_head) - ACCESS_ONCE(b->shm->rx_tail);
+    return used >= VUART_BRIDGE_RING_SIZE ? 0 : VUART_BRIDGE_RING_SIZE - used;
+}
+
+static void ring_copy_in(char *ring, u32 pos, const char *src, unsigned int len)
+{
+    unsigned int off = pos & RING_MASK;
+    unsigned int first = min_t(unsigned int, len, VUART_BRIDGE_RING_SIZE - off);
+
+    memcpy(ring + off, src, first);
+    memcpy(ring, src + first, len - first);
+}
+
+/**
+ * Called by vUART when apps sent something to the port (with the vdev lock held)
+ */
+static void bridge_tx(int line, const vuart_span spans[2], unsigned int len, vuart_flush_reason reason)
+{
+    struct vuart_bridge *b = bridges[line];
+    if (unlikely(!b))
+        return;
+
+    struct vuart_bridge_shm *shm = b->shm;
+    u32 head = ACCESS_ONCE(shm->tx_head);
+    u32 used = head - ACCESS_ONCE(shm->tx_tail);
+    u32 free = used > VUART_BRIDGE_RING_SIZE ? 0 : VUART_BRIDGE_RING_SIZE - used; //garbage tail => no space
+    smp_mb(); //don't overwrite anything until we know the consumer is done with it
+
+    for (int i = 0; i < 2; i++) {
+        unsigned int n = min_t(unsigned int, spans[i].len, free);
+        ring_copy_in(b->tx_ring, head, spans[i].data, n);
+        head += n;
+        free -= n;
+        shm->tx_dropped += spans[i].len - n;
+    }
+
+    smp_wmb(); //data must be visible before the head moves
+    ACCESS_ONCE(shm->tx_head) = head;
+    wake_up_interruptible(&b->wq);
+}
+
+/**
+ * Moves data from the shared RX ring into the vUART RX stream as long as the stream takes it
+ */
+static void bridge_rx_pump(struct work_struct *work)
+{
+    struct vuart_bridge *b = container_of(work, struct vuart_bridge, rx_work);
+    struct vuart_bridge_shm *shm = b->shm;
+    if (unlikely(ACCESS_ONCE(b->dead)))
+        return;
+
+    u32 tail = ACCESS_ONCE(shm->rx_tail);
+    u32 avail = ring_used(ACCESS_ONCE(shm->rx_head), tail);
+    smp_rmb(); //data must be read after the head
+
+    while (avail) {
+        unsigned int off = tail & RING_MASK;
+        unsigned int chunk = min_t(unsigned int, avail, VUART_BRIDGE_RING_SIZE - off);
+        int accepted = vuart_stream_rx(b->line, b->rx_ring + off, chunk);
+        if (accepted <= 0) {
+            if (unlikely(accepted < 0))
+                pr_loc_dbg("Failed to stream %u bytes into ttyS%d - error=%d", chunk, b->line, accepted);
+            break;
+        }
+
+        tail += accepted;
+        avail -= accepted;
+        if (accepted < chunk) //stream is full - VUART_RX_WRITABLE will reschedule us
+            break;
+    }
+
+    smp_mb(); //the producer may reuse the space only after we're done reading it
+    ACCESS_ONCE(shm->rx_tail) = tail;
+    wake_up_interruptible(&b->wq);
+}
+
+/**
+ * Called by vUART when the RX stream can take more data (with the vdev lock held)
+ */
+static void bridge_rx_event(int line, unsigned int space, vuart_rx_event event)
+{
+    struct vuart_bridge *b = bridges[line];
+    if (likely(b) && event == VUART_RX_WRITABLE)
+        queue_work(housekeeping_wq(system_wq), &b->rx_work);
+}
+
+/************************************************** File operations **************************************************/
+static void bridge_free(struct kref *ref)
+{
+    struct vuart_bridge *b = container_of(ref, struct vuart_bridge, ref);
+
+    cancel_work_sync(&b->rx_work); //a write() or KICK might have queued it after the bridge was unregistered
+    vfree(b->shm);
+    kfree(b);
+}
+
+static inline void bridge_put(struct vuart_bridge *b)
+{
+    kref_put(&b->ref, bridge_free);
+}
+
+//misc_open() calls us with misc_mtx held, so misc_deregister() cannot complete while we're taking the reference
+static int bridge_open(struct inode *inode, struct file *file)
+{
+    struct vuart_bridge *b = container_of(file->private_data, struct vuart_bridge, misc);
+    if (atomic_cmpxchg(&b->opened, 0, 1) != 0)
+        return -EBUSY;
+
+    kref_get(&b->ref);
+    file->private_data = b;
+    return nonseekable_open(inode, file);
+}
+
+static int bridge_release(struct inode *inode, struct file *file)
+{
+    struct vuart_bridge *b = file->private_data;
+    atomic_set(&b->opened, 0);
+    bridge_put(b); //mappings of the shm hold their own references
+
+    return 0;
+}
+
+static ssize_t bridge_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct vuart_bridge *b = file->private_data;
+    if (!count)
+        return 0;
+
+    if (!tx_used(b)) {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if (wait_event_interruptible(b->wq, tx_used(b)))
+            return -ERESTARTSYS;
+    }
+
+    if (mutex_lock_interruptible(&b->read_lock))
+        return -ERESTARTSYS;
+
+    struct vuart_bridge_shm *shm = b->shm;
+    u32 tail = ACCESS_ONCE(shm->tx_tail);
+    unsigned int len = min_t(size_t, count, ring_used(ACCESS_ONCE(shm->tx_head), tail)); //never more than a ring
+    smp_rmb(); //data must be read after the head
+
+    unsigned int off = tail & RING_MASK;
+    unsigned int first = min_t(unsigned int, len, VUART_BRIDGE_RING_SIZE - off);
+    ssize_t out = len;
+    if (copy_to_user(buf, b->tx_ring + off, first) || copy_to_user(buf + first, b->tx_ring, len - first)) {
+        out = -EFAULT;
+    } else {
+        smp_mb();
+        ACCESS_ONCE(shm->tx_tail) = tail + len;
+    }
+
+    mutex_unlock(&b->read_lock);
+    return out;
+}
+
+static ssize_t bridge_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct vuart_bridge *b = file->private_data;
+    if (!count)
+        return 0;
+
+    if (unlikely(ACCESS_ONCE(b->dead)))
+        return -ENODEV;
+
+    if (!rx_free(b)) {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if (wait_event_interruptible(b->wq, rx_free(b)))
+            return -ERESTARTSYS;
+    }
+
+    if (mutex_lock_interruptible(&b->write_lock))
+        return -ERESTARTSYS;
+
+    struct vuart_bridge_shm *shm = b->shm;
+    u32 head = ACCESS_ONCE(shm->rx_head);
+    u32 used = head - ACCESS_ONCE(shm->rx_tail);
+    unsigned int len = min_t(size_t, count, used >= VUART_BRIDGE_RING_SIZE ? 0 : VUART_BRIDGE_RING_SIZE - used);
+    smp_mb(); //don't overwrite anything until we know the consumer is done with it
+
+    unsigned int off = head & RING_MASK;
+    unsigned int first = min_t(unsigned int, len, VUART_BRIDGE_RING_SIZE - off);
+    ssize_t out = len;
+    if (copy_from_user(b->rx_ring + off, buf, first) || copy_from_user(b->rx_ring, buf + first, len - first)) {
+        out = -EFAULT;
+    } else {
+        smp_wmb(); //data must be visible before the head moves
+        ACCESS_ONCE(shm->rx_head) = head + len;
+        queue_work(housekeeping_wq(system_wq), &b->rx_work);
+    }
+
+    mutex_unlock(&b->write_lock);
+    return out;
+}
+
+static unsigned int bridge_poll(struct file *file, poll_table *wait)
+{
+    struct vuart_bridge *b = file->private_data;
+    unsigned int mask = 0;
+
+    poll_wait(file, &b->wq, wait);
+    if (tx_used(b))
+        mask |= POLLIN | POLLRDNORM;
+    if (rx_free(b))
+        mask |= POLLOUT | POLLWRNORM;
+
+    return mask;
+}
+
+static void bridge_vm_open(struct vm_area_struct *vma)
+{
+    kref_get(&((struct vuart_bridge *)vma->vm_private_data)->ref);
+}
+
+static void bridge_vm_close(struct vm_area_struct *vma)
+{
+    bridge_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct bridge_vm_ops = {
+    .open = bridge_vm_open, //called for copies (fork, split), not for the original mapping
+    .close = bridge_vm_close,
+};
+
+static int bridge_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct vuart_bridge *b = file->private_data;
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > SHM_SIZE)
+        return -EINVAL;
+
+    int out = remap_vmalloc_range(vma, b->shm, 0);
+    if (out != 0)
+        return out;
+
+    vma->vm_private_data = b;
+    vma->vm_ops = &bridge_vm_ops;
+    bridge_vm_open(vma);
+    return 0;
+}
+
+static long bridge_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct vuart_bridge *b = file->private_data;
+
+    switch (cmd) {
+        case VUART_BRIDGE_IOC_KICK:
+            if (unlikely(ACCESS_ONCE(b->dead)))
+                return -ENODEV;
+            queue_work(housekeeping_wq(system_wq), &b->rx_work);
+            return 0;
+        default:
+            return -ENOTTY;
+    }
+}
+
+static const struct file_operations bridge_fops = {
+    .owner = THIS_MODULE,
+    .open = bridge_open,
+    .release = bridge_release,
+    .read = bridge_read,
+    .write = bridge_write,
+    .poll = bridge_poll,
+    .mmap = bridge_mmap,
+    .unlocked_ioctl = bridge_ioctl,
+    .llseek = no_llseek,
+};
+
+/****************************************************** Public API ****************************************************/
+int vuart_bridge_register(int line)
+{
+    if (unlikely(line < 0 || line > SERIAL8250_LAST_ISA_LINE)) {
+        pr_loc_bug("Cannot register vUART bridge for ttyS%d - kernel supports only %d", line, SERIAL8250_LAST_ISA_LINE);
+        return -EINVAL;
+    }
+
+    if (unlikely(bridges[line])) {
+        pr_loc_bug("vUART bridge for ttyS%d is already registered", line);
+        return -EBUSY;
+    }
+
+    int out;
+    struct vuart_bridge *b;
+    kzalloc_or_exit_int(b, sizeof(struct vuart_bridge));
+
+    b->shm = vmalloc_user(SHM_SIZE); //vmalloc_user() zeroes the memory
+    if (unlikely(!b->shm)) {
+        pr_loc_crt("vmalloc_user failed for vUART bridge shm (%lu bytes)", SHM_SIZE);
+        out = -ENOMEM;
+        goto error_free;
+    }
+
+    b->line = line;
+    b->shm->ring_size = VUART_BRIDGE_RING_SIZE;
+    b->shm->tx_offset = SHM_TX_OFFSET;
+    b->shm->rx_offset = SHM_RX_OFFSET;
+    b->tx_ring = (char *)b->shm + SHM_TX_OFFSET;
+    b->rx_ring = (char *)b->shm + SHM_RX_OFFSET;
+    atomic_set(&b->opened, 0);
+    kref_init(&b->ref); //owned by the registration
+    init_waitqueue_head(&b->wq);
+    mutex_init(&b->read_lock);
+    mutex_init(&b->write_lock);
+    INIT_WORK(&b->rx_work, bridge_rx_pump);
+    bridges[line] = b; //callbacks below may fire immediately
+
+    if ((out = vuart_set_rx_stream(line, VUART_BRIDGE_RING_SIZE, bridge_rx_event)) != 0)
+        goto error_unpublish;
+
+    if ((out = vuart_set_tx_span_callback(line, bridge_tx, VUART_FIFO_LEN)) != 0)
+        goto error_rx_stream;
+
+    snprintf(b->name, sizeof(b->name), VUART_BRIDGE_NAME_FMT, line);
+    b->misc.minor = MISC_DYNAMIC_MINOR;
+    b->misc.name = b->name;
+    b->misc.fops = &bridge_fops;
+    if ((out = misc_register(&b->misc)) != 0) {
+        pr_loc_err("Failed to register /dev/%s - error=%d", b->name, out);
+        goto error_tx_cb;
+    }
+
+    pr_loc_inf("vUART bridge for ttyS%d registered as /dev/%s", line, b->name);
+    return 0;
+
+    error_tx_cb:
+    vuart_set_tx_span_callback(line, NULL, 0);
+    error_rx_stream:
+    vuart_set_rx_stream(line, 0, NULL);
+    error_unpublish:
+    cancel_work_sync(&b->rx_work);
+    bridges[line] = NULL;
+    vfree(b->shm);
+    error_free:
+    kfree(b);
+    return out;
+}
+
+int vuart_bridge_unregister(int line)
+{
+    if (unlikely(line < 0 || line > SERIAL8250_LAST_ISA_LINE || !bridges[line])) {
+        pr_loc_bug("vUART bridge for ttyS%d is not registered", line);
+        return -ENOENT;
+    }
+
+    struct vuart_bridge *b = bridges[line];
+    misc_deregister(&b->misc); //no open() can be in progress once it returns
+    ACCESS_ONCE(b->dead) = true; //an opened file may still write() or KICK - these must not reach the line anymore
+    vuart_set_tx_span_callback(line, NULL, 0);
+    vuart_set_rx_stream(line, 0, NULL);
+    cancel_work_sync(&b->rx_work);
+    bridges[line] = NULL;
+
+    pr_loc_inf("vUART bridge for ttyS%d unregistered%s", line,
+               atomic_read(&b->opened) ? " - memory will be freed once the process lets go of it" : "");
+    bridge_put(b);
+    return 0;
+}
+#endif //VUART_BRIDGE_ENABLED
@@ -0,0 +1,81 @@
+/**
+ * Userspace bridge for virtual UART lines
+ *
+ * It exposes a vUART line as a misc char device (/dev/vuart<line> by default, see VUART_BRIDGE_NAME_FMT) so that e.g. a
+ * PMU emulator can live in the userland. Whatever apps send to the ttyS* can be read from the device and whatever is
+ * written to the device arrives in the ttyS* as if it came from the wire.
+ *
+ * The device supports plain read()/write()/poll() but also mmap() of a shared memory area containing two rings (see
+ * struct vuart_bridge_shm) so that the data can be moved without a syscall per byte: the process reads TX data straight
+ * from the ring and moves the tail, and writes RX data straight into the ring, moves the head and calls the
+ * VUART_BRIDGE_IOC_KICK ioctl once per batch. poll() works the same way in both modes.
+ *
+ * Only one process can have the device opened at a time. TX data which doesn't fit in the ring (i.e. the process is not
+ * reading fast enough) is dropped and counted in tx_dropped - a real wire would lose it too.
+ *
+ * The device node is visible to everybody - it's only available in the least stealthy modes.
+ */
+#ifndef REDPILL_VUART_BRIDGE_H
+#define REDPILL_VUART_BRIDGE_H
+
+#include "../stealth.h" //STEALTH_MODE
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/**
+ * Size of each of the rings (TX & RX) in the shared memory; must be a power of 2 and a multiple of PAGE_SIZE
+ */
+#define VUART_BRIDGE_RING_SIZE 4096
+
+/**
+ * Layout of the first page of memory mapped from the device
+ *
+ * Heads & tails are free-running counters (they're never reset or wrapped - use "& (ring_size-1)" to get the offset).
+ * The ring is empty when head == tail. TX data starts at tx_offset and RX data at rx_offset (from the start of the map).
+ */
+struct vuart_bridge_shm {
+    __u32 tx_head; //written by the kernel when apps send something to the port
+    __u32 tx_tail; //written by the process after it consumed TX data
+    __u32 rx_head; //written by the process after it put new RX data
+    __u32 rx_tail; //written by the kernel after it moved RX data to the port
+    __u32 ring_size;
+    __u32 tx_offset;
+    __u32 rx_offset;
+    __u32 tx_dropped; //number of TX bytes dropped as the ring was full
+} __attribute__((packed));
+
+#define VUART_BRIDGE_IOC_MAGIC 'V'
+
+//Tells the kernel that new RX data was placed in the shared ring
+#define VUART_BRIDGE_IOC_KICK _IO(VUART_BRIDGE_IOC_MAGIC, 1)
+
+#if STEALTH_MODE < STEALTH_MODE_NORMAL
+#define VUART_BRIDGE_ENABLED
+
+/**
+ * Exposes a vUART line through a char device
+ *
+ * This takes over TX callback & RX stream of the line (see vuart_set_tx_span_callback() and vuart_set_rx_stream()).
+ * It can be called before or after vuart_add_device().
+ *
+ * @param line UART number, see vuart_add_device()
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_bridge_register(int line);
+
+/**
+ * Removes the char device created by vuart_bridge_register() and releases TX callback & RX stream of the line
+ *
+ * It succeeds even if the device is still opened or its memory is mapped; the process then gets -ENODEV from writes
+ * and the memory is freed once it closes & unmaps it.
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_bridge_unregister(int line);
+#else
+#define vuart_bridge_register(line) (-EOPNOTSUPP)
+#define vuart_bridge_unregister(line) (-EOPNOTSUPP)
+#endif //STEALTH_MODE < STEALTH_MODE_NORMAL
+
+#endif //REDPILL_VUART_BRIDGE_H
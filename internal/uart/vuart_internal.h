@@ -2,27 +2,52 @@
 #define REDPILL_VUART_INTERNAL_H
 
 #include <linux/spinlock.h>
+#include <linux/seqlock.h> //seqcount_t
+#include <linux/serial_core.h> //struct uart_ops
+#include <linux/console.h> //struct console
+#include "virtual_uart.h" //vuart_rx_callback_t
 #ifndef VUART_USE_TIMER_FALLBACK
+#ifdef VUART_USE_VIRQ_THREAD
 #include <linux/wait.h>
+#else
+#include <linux/interrupt.h> //struct tasklet_struct
+#endif
+#include <linux/hrtimer.h> //struct hrtimer
 #endif
 
 
 //Lock/unlock vdev for registries operations
-#define lock_vuart(vdev) spin_lock_irqsave((vdev)->lock, (vdev)->lock_flags);
-#define unlock_vuart(vdev) spin_unlock_irqrestore((vdev)->lock, (vdev)->lock_flags);
+//Every locked section is also a write section of reg_seq, so that registers without read side effects can be read
+// without the lock (see try_lockless_read())
+#define lock_vuart(vdev) do { \
+        spin_lock_irqsave((vdev)->lock, (vdev)->lock_flags); \
+        write_seqcount_begin(&(vdev)->reg_seq); \
+    } while(0)
+#define unlock_vuart(vdev) do { \
+        write_seqcount_end(&(vdev)->reg_seq); \
+        spin_unlock_irqrestore((vdev)->lock, (vdev)->lock_flags); \
+    } while(0)
 
 //In some circumstances operations may be performed on the chip before or after the chip is initialized. If it is
 // initialized we need a lock first; otherwise we do not. This is a shortcut for this opportunistic/conditional locking.
 #define lock_vuart_oppr(vdev) if ((vdev)->initialized) { lock_vuart(vdev); }
 #define unlock_vuart_oppr(vdev) if ((vdev)->initialized) { unlock_vuart(vdev); }
 
-#define validate_isa_line(line) \
-    if (unlikely((line) > SERIAL8250_LAST_ISA_LINE)) { \
+#ifdef VUART_STATS_ENABLED
+#define vuart_stat_add(vdev, field, val) do { (vdev)->stats.field += (val); } while(0)
+#else //VUART_STATS_ENABLED
+#define vuart_stat_add(vdev, field, val) do { } while(0)
+#endif //VUART_STATS_ENABLED
+
+#define validate_line(line) \
+    if (unlikely((line) < 0 || (line) > SERIAL8250_LAST_ISA_LINE)) { \
         pr_loc_bug("%s failed - requested line %d but kernel supports only %d", __FUNCTION__, line, \
                    SERIAL8250_LAST_ISA_LINE); \
         return -EINVAL; \
     }
 
+struct flush_callback;
+
 /**
  * An emulated 16550A chips internal state
  *
@@ -34,6 +59,7 @@ struct serial8250_16550A_vdev {
     u16			iobase;
     u8			irq;
     unsigned int         baud;
+    bool dynamic:1; //line above ISA ones, assigned by the driver (see vuart_add_dynamic_device())
 
     //The 8250 driver port structure - it will be populated as soon as 8250 gives us the real pointer
     struct uart_port *up;
@@ -41,6 +67,18 @@ struct serial8250_16550A_vdev {
     //Chip emulated FIFOs
     struct kfifo *tx_fifo; //character to be sent (aka what we've got from the OS)
     struct kfifo *rx_fifo; //characters received (aka what we want the OS to get from us)
+    unsigned int fifo_depth; //size of each FIFO; VUART_FIFO_LEN (16550A) unless changed with vuart_set_fifo_depth()
+    unsigned int tx_flush_at; //current (adaptive) TX FIFO fill which triggers FULL flush, see adapt_tx_flush_point()
+    u8 tx_boost; //how many times in a row the tx_flush_at was doubled under sustained load
+    bool fifo64:1; //16750 64-byte FIFO mode is enabled (FCR bit 5 written with DLAB=1)
+
+    //RX streaming: a staging ring behind the rx_fifo, see vuart_set_rx_stream()
+    struct kfifo *rx_ring;
+    vuart_rx_callback_t *rx_ring_cb;
+    bool rx_ring_refused:1; //some data was refused since the last VUART_RX_WRITABLE
+
+    //TX callback, see vuart_set_tx_callback() and vuart_set_tx_span_callback()
+    struct flush_callback *tx_cb;
 
     //Chip registries (they're considered volatile but there's a spinlock protecting them)
     u8 rhr; //Receiver Holding Register (characters received)
@@ -62,11 +100,37 @@ struct serial8250_16550A_vdev {
     bool registered:1; //whether the vdev is actually registered with 8250 subsystem
     spinlock_t *lock;
     unsigned long lock_flags;
+    seqcount_t reg_seq; //bumped around every locked section, see lock_vuart()
+
+#ifdef VUART_STATS_ENABLED
+    struct vuart_stats stats;
+#endif
+
+#ifndef VUART_DISABLE_BULK_TX
+    //Bulk TX path: a per-port copy of 8250 ops with start_tx replaced, installed when the port is captured
+    const struct uart_ops *org_ops;
+    struct uart_ops bulk_ops;
+
+    //Bulk console path: kernel console redirected to vuart_bulk_console_write() if it's on this line
+    struct console *con;
+    void (*org_con_write)(struct console *co, const char *s, unsigned int count);
+#endif
 
 #ifndef VUART_USE_TIMER_FALLBACK
+#ifdef VUART_USE_VIRQ_THREAD
     //We emulate (i.e. self-trigger) interrupts on threads
     struct task_struct *virq_thread; //where fake interrupt code is executed
     wait_queue_head_t *virq_queue; //wait queue used to put thread to sleep
+#else
+    //We emulate (i.e. self-trigger) interrupts from a tasklet scheduled when IIR signals an interrupt
+    struct tasklet_struct virq_tasklet;
+    bool virq_enabled;
+#endif
+
+    //RX interrupt coalescing (see vuart_set_irq_coalescing()); disabled when coalesce_usecs is 0
+    unsigned int coalesce_usecs; //max time a data-ready interrupt can be held for
+    unsigned int coalesce_bytes; //number of bytes waiting which triggers the interrupt immediately
+    struct hrtimer coalesce_timer;
 #endif
 };
 
@@ -0,0 +1,280 @@
+/**
+ * virtio-console backend for vUART lines - see header file for the overview
+ *
+ * INTERNALS
+ * ---------
+ * The port is used through its char device (opened in-kernel), as virtio_console doesn't export anything else. This
+ * also means there's no hard dependency on the driver: without it the bind simply fails as there's no port to open.
+ * TX (apps -> host): a zero-copy TX callback copies spans of the chip FIFO into the TX ring. It's called under the vdev
+ * lock so it's the only producer; a work item is the only consumer and writes the ring to the port in batches (the
+ * write may sleep, e.g. when the virtqueue is full, so it cannot be done from the callback).
+ * RX (host -> apps): a kthread blocks reading the port and streams what it got into the vUART RX stream
+ * (vuart_stream_rx()). When the stream refuses data the thread waits for the stream VUART_RX_WRITABLE callback.
+ */
+#include "vuart_virtio.h"
+#include "virtual_uart.h"
+#include "../../common.h"
+#include "../../config/uart_defs.h" //SERIAL8250_LAST_ISA_LINE
+#include "../housekeeping.h" //housekeeping_wq(), housekeeping_affine_task()
+#include <linux/fs.h> //filp_open(), filp_close(), kernel_read(), kernel_write()
+#include <linux/kfifo.h> //TX ring
+#include <linux/workqueue.h> //TX pump
+#include <linux/kthread.h> //RX thread
+#include <linux/wait.h> //RX backpressure
+#include <linux/sched.h> //send_sig(), signal_pending(), wake_up_process()
+#include <linux/delay.h> //msleep_interruptible()
+
+#ifndef VUART_VIRTIO_THREAD_FMT
+#define VUART_VIRTIO_THREAD_FMT "vuart_virtio/%d"
+#endif
+
+//When the host side isn't connected reads return EOF right away - this is how often we check if it came back
+#define VUART_VIRTIO_RECONNECT_MS 500
+
+struct vuart_virtio {
+    int line;
+    struct file *port;
+
+    struct kfifo tx_ring;
+    char tx_batch[VUART_VIRTIO_BATCH_SIZE]; //only used by tx_work
+    struct work_struct tx_work;
+    unsigned long tx_dropped; //only modified by the TX callback
+
+    struct task_struct *rx_thread;
+    char rx_batch[VUART_VIRTIO_BATCH_SIZE]; //only used by rx_thread
+    wait_queue_head_t rx_wq;
+    bool rx_writable; //set by VUART_RX_WRITABLE, cleared by the thread before every vuart_stream_rx()
+};
+
+static struct vuart_virtio *bindings[SERIAL8250_LAST_ISA_LINE+1] = { NULL };
+
+static ssize_t port_read(struct vuart_virtio *v, char *buf, size_t len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+    loff_t pos = 0;
+    return kernel_read(v->port, buf, len, &pos);
+#else
+    return kernel_read(v->port, 0, buf, len);
+#endif
+}
+
+static ssize_t port_write(struct vuart_virtio *v, const char *buf, size_t len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+    loff_t pos = 0;
+    return kernel_write(v->port, buf, len, &pos);
+#else
+    return kernel_write(v->port, buf, len, 0);
+#endif
+}
+
+/********************************************************* TX *********************************************************/
+/**
+ * Called by vUART when apps sent something to the port (with the vdev lock held)
+ */
+static void virtio_tx(int line, const vuart_span spans[2], unsigned int len, vuart_flush_reason reason)
+{
+    struct vuart_virtio *v = bindings[line];
+    if (unlikely(!v))
+        return;
+
+    for (int i = 0; i < 2; i++) {
+        unsigned int put = kfifo_in(&v->tx_ring, spans[i].data, spans[i].len);
+        v->tx_dropped += spans[i].len - put;
+    }
+
+    queue_work(housekeeping_wq(system_wq), &v->tx_work);
+}
+
+/**
+ * Writes everything from the TX ring to the port
+ */
+static void virtio_tx_pump(struct work_struct *work)
+{
+    struct vuart_virtio *v = container_of(work, struct vuart_virtio, tx_work);
+    unsigned int len;
+
+    while ((len = kfifo_out(&v->tx_ring, v->tx_batch, VUART_VIRTIO_BATCH_SIZE)) > 0) {
+        for (unsigned int off = 0; off < len; ) {
+            ssize_t written = port_write(v, v->tx_batch + off, len - off);
+            if (unlikely(written <= 0)) { //e.g. the host side isn't connected - the data is lost as on a real wire
+                pr_loc_dbg("Failed to write %u bytes of ttyS%d to virtio port - error=%zd", len - off, v->line,
+                           written);
+                break;
+            }
+
+            off += written;
+        }
+    }
+}
+
+/********************************************************* RX *********************************************************/
+/**
+ * Called by vUART when the RX stream can take more data (with the vdev lock held)
+ */
+static void virtio_rx_event(int line, unsigned int space, vuart_rx_event event)
+{
+    struct vuart_virtio *v = bindings[line];
+    if (unlikely(!v) || event != VUART_RX_WRITABLE)
+        return;
+
+    ACCESS_ONCE(v->rx_writable) = true;
+    wake_up_interruptible(&v->rx_wq);
+}
+
+/**
+ * Streams a batch read from the port into the vUART, waiting for the stream to take all of it
+ *
+ * @return 0 on success, -E on error (incl. -EINTR when the thread is being stopped)
+ */
+static int virtio_rx_deliver(struct vuart_virtio *v, unsigned int len)
+{
+    for (unsigned int off = 0; off < len; ) {
+        ACCESS_ONCE(v->rx_writable) = false; //before streaming so that a VUART_RX_WRITABLE in between isn't lost
+        int accepted = vuart_stream_rx(v->line, v->rx_batch + off, len - off);
+        if (unlikely(accepted < 0))
+            return accepted;
+
+        off += accepted;
+        if (off < len && wait_event_interruptible(v->rx_wq, ACCESS_ONCE(v->rx_writable) || kthread_should_stop()))
+            return -EINTR;
+        if (unlikely(kthread_should_stop()))
+            return -EINTR;
+    }
+
+    return 0;
+}
+
+static int virtio_rx_thread(void *data)
+{
+    struct vuart_virtio *v = data;
+    allow_signal(SIGKILL); //the only way to interrupt a blocking read of the port, see vuart_virtio_unbind()
+
+    while (likely(!kthread_should_stop())) {
+        ssize_t len = port_read(v, v->rx_batch, VUART_VIRTIO_BATCH_SIZE);
+        if (unlikely(signal_pending(current)))
+            break;
+
+        if (len == 0) { //host side not connected
+            msleep_interruptible(VUART_VIRTIO_RECONNECT_MS);
+            continue;
+        }
+
+        if (unlikely(len < 0)) {
+            pr_loc_err("Failed to read virtio port of ttyS%d - error=%zd", v->line, len);
+            break;
+        }
+
+        int out = virtio_rx_deliver(v, len);
+        if (unlikely(out != 0)) {
+            if (out != -EINTR)
+                pr_loc_err("Failed to stream %zd bytes into ttyS%d - error=%d", len, v->line, out);
+            break;
+        }
+    }
+
+    //kthread_stop() must find us alive; a pending signal makes schedule() return right away, so this may spin shortly
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+    }
+
+    return 0;
+}
+
+/****************************************************** Public API ****************************************************/
+int vuart_virtio_bind(int line, const char *port_path)
+{
+    if (unlikely(line < 0 || line > SERIAL8250_LAST_ISA_LINE)) {
+        pr_loc_bug("Cannot bind ttyS%d to virtio port - kernel supports only %d", line, SERIAL8250_LAST_ISA_LINE);
+        return -EINVAL;
+    }
+
+    if (unlikely(bindings[line])) {
+        pr_loc_bug("ttyS%d is already bound to a virtio port", line);
+        return -EBUSY;
+    }
+
+    int out;
+    struct vuart_virtio *v;
+    kzalloc_or_exit_int(v, sizeof(struct vuart_virtio));
+
+    v->line = line;
+    v->port = filp_open(port_path, O_RDWR, 0);
+    if (IS_ERR(v->port)) {
+        out = PTR_ERR(v->port);
+        pr_loc_err("Failed to open virtio port %s for ttyS%d - error=%d", port_path, line, out);
+        goto error_free;
+    }
+
+    if (unlikely(kfifo_alloc(&v->tx_ring, VUART_VIRTIO_RING_SIZE, GFP_KERNEL) != 0)) {
+        pr_loc_crt("kfifo_alloc for virtio TX ring @ %d failed", line);
+        out = -ENOMEM;
+        goto error_close;
+    }
+
+    INIT_WORK(&v->tx_work, virtio_tx_pump);
+    init_waitqueue_head(&v->rx_wq);
+    bindings[line] = v; //callbacks below may fire immediately
+
+    if ((out = vuart_set_rx_stream(line, VUART_VIRTIO_RING_SIZE, virtio_rx_event)) != 0)
+        goto error_unpublish;
+
+    if ((out = vuart_set_tx_span_callback(line, virtio_tx, VUART_FIFO_LEN)) != 0)
+        goto error_rx_stream;
+
+    v->rx_thread = kthread_create(virtio_rx_thread, v, VUART_VIRTIO_THREAD_FMT, line);
+    if (IS_ERR(v->rx_thread)) {
+        out = PTR_ERR(v->rx_thread);
+        pr_loc_err("Failed to start virtio RX thread for ttyS%d - error=%d", line, out);
+        goto error_tx_cb;
+    }
+    housekeeping_affine_task(v->rx_thread);
+    wake_up_process(v->rx_thread);
+
+    pr_loc_inf("ttyS%d bound to virtio port %s", line, port_path);
+    return 0;
+
+    error_tx_cb:
+    vuart_set_tx_span_callback(line, NULL, 0);
+    error_rx_stream:
+    vuart_set_rx_stream(line, 0, NULL);
+    error_unpublish:
+    cancel_work_sync(&v->tx_work);
+    bindings[line] = NULL;
+    kfifo_free(&v->tx_ring);
+    error_close:
+    filp_close(v->port, NULL);
+    error_free:
+    kfree(v);
+    return out;
+}
+
+int vuart_virtio_unbind(int line)
+{
+    if (unlikely(line < 0 || line > SERIAL8250_LAST_ISA_LINE || !bindings[line])) {
+        pr_loc_bug("ttyS%d is not bound to a virtio port", line);
+        return -ENOENT;
+    }
+
+    struct vuart_virtio *v = bindings[line];
+    send_sig(SIGKILL, v->rx_thread, 1); //breaks the blocking read; kthread_stop() alone wouldn't
+    kthread_stop(v->rx_thread); //before the RX stream goes, so that the thread doesn't report it as an error
+
+    vuart_set_tx_span_callback(line, NULL, 0);
+    vuart_set_rx_stream(line, 0, NULL);
+    cancel_work_sync(&v->tx_work); //no new schedules can happen without the TX callback
+    bindings[line] = NULL;
+
+    if (v->tx_dropped)
+        pr_loc_wrn("%lu bytes sent to ttyS%d were dropped as the virtio port wasn't keeping up", v->tx_dropped, line);
+
+    kfifo_free(&v->tx_ring);
+    filp_close(v->port, NULL);
+    kfree(v);
+
+    pr_loc_inf("ttyS%d unbound from virtio port", line);
+    return 0;
+}
@@ -0,0 +1,50 @@
+/**
+ * virtio-console backend for virtual UART lines
+ *
+ * When running under a hypervisor (KVM/QEMU, Proxmox...) whatever talks to a vUART line from the host side (e.g. a
+ * host-side PMU emulator or a console logger) would normally have to go through an emulated 16550A on the host too,
+ * i.e. many register accesses (=VM exits) for every byte. This binds a vUART line to a virtio-console port instead:
+ * whatever apps send to the ttyS* is written to the port in batches (one virtqueue buffer per batch) and whatever the
+ * host sends through the port arrives in the ttyS* as if it came from the wire.
+ *
+ * On QEMU the port is created with e.g. "-device virtio-serial -device virtserialport,name=rp.pmu" and shows up in the
+ * guest as /dev/vportNpM (or /dev/virtio-ports/rp.pmu with udev). The port is opened exclusively by the binding.
+ *
+ * TX data which doesn't fit in the ring (i.e. the host is not reading fast enough) is dropped - a real wire would lose
+ * it too. RX data is never dropped: reading from the port stops while the line cannot take more.
+ */
+#ifndef REDPILL_VUART_VIRTIO_H
+#define REDPILL_VUART_VIRTIO_H
+
+/**
+ * Size of the TX ring (between the vUART FIFO and the port); must be a power of 2
+ */
+#define VUART_VIRTIO_RING_SIZE 4096
+
+/**
+ * Max size of a single write to/read from the port (i.e. of a virtqueue buffer)
+ */
+#define VUART_VIRTIO_BATCH_SIZE 1024
+
+/**
+ * Binds a vUART line to a virtio-console port
+ *
+ * This takes over TX callback & RX stream of the line (see vuart_set_tx_span_callback() and vuart_set_rx_stream()),
+ * exactly like vuart_bridge_register() does. It can be called before or after vuart_add_device() (or after
+ * vuart_add_dynamic_device()).
+ *
+ * @param line UART number, see vuart_add_device()
+ * @param port_path Path to the port device, e.g. /dev/vport0p1
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_virtio_bind(int line, const char *port_path);
+
+/**
+ * Reverses vuart_virtio_bind(): closes the port and releases TX callback & RX stream of the line
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_virtio_unbind(int line);
+
+#endif //REDPILL_VUART_VIRTIO_H
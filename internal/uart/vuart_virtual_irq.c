@@ -4,10 +4,169 @@
 #include "vuart_internal.h"
 #include "../../common.h"
 #include "../../debug/debug_vuart.h"
+#include "../rp_trace.h" //rp_trace()
 #include <linux/serial_reg.h> //UART_* consts
+#include <linux/serial_8250.h> //serial8250_handle_irq
+#include <linux/hrtimer.h> //coalescing timer
+#include <linux/kfifo.h> //kfifo_len()
+
+/**
+ * Calls the 8250 interrupt handler for the port if the vdev signals any pending interrupts
+ */
+static inline void deliver_virq(struct serial8250_16550A_vdev *vdev)
+{
+    if (unlikely(!vdev->up)) {
+        pr_loc_bug("Cannot call serial8250 interrupt handler - port not captured (yet?)");
+        return;
+    }
+
+    uart_prdbg("Calling serial8250 interrupt handler");
+    vuart_stat_add(vdev, virq_delivered, 1);
+    rp_trace(vuart_virq, vdev->line, vdev->irq, vdev->iir);
+    serial8250_handle_irq(vdev->up, vdev->iir);
+}
+
+/*********************************************** Interrupt coalescing ************************************************/
+/**
+ * Fires when the max latency of a coalesced RX interrupt passed
+ */
+static enum hrtimer_restart virq_coalesce_timer(struct hrtimer *timer)
+{
+    struct serial8250_16550A_vdev *vdev = container_of(timer, struct serial8250_16550A_vdev, coalesce_timer);
+
+    //Interrupt may have been serviced in the meantime (e.g. the FIFO reached min bytes)
+    if (!(vdev->iir & UART_IIR_NO_INT)) {
+        uart_prdbg("Coalescing timer expired on ttyS%d - delivering vIRQ", vdev->line);
+        vuart_virq_wake_up(vdev);
+    }
+
+    return HRTIMER_NORESTART;
+}
+
+static inline void init_virq_coalescing(struct serial8250_16550A_vdev *vdev)
+{
+    hrtimer_init(&vdev->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    vdev->coalesce_timer.function = virq_coalesce_timer;
+}
+
+bool vuart_virq_coalesce(struct serial8250_16550A_vdev *vdev, u8 iir)
+{
+    //Only data-ready is worth delaying: THR empty stalls the transmitter until delivered & errors must be reported ASAP
+    if (likely(!vdev->coalesce_usecs) || unlikely(!vuart_virq_active(vdev)) || (iir & UART_IIR_ID) != UART_IIR_RDI)
+        return false;
+
+    //RHR holds one char when DR is set - the rest is still in the FIFO
+    if (kfifo_len(vdev->rx_fifo) + 1 >= vdev->coalesce_bytes) {
+        hrtimer_try_to_cancel(&vdev->coalesce_timer); //even if it fires now it will only try to deliver the same vIRQ
+        return false;
+    }
+
+    if (!hrtimer_active(&vdev->coalesce_timer))
+        hrtimer_start(&vdev->coalesce_timer, ns_to_ktime((u64)vdev->coalesce_usecs * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
+
+    return true;
+}
+
+int vuart_virq_set_coalescing(struct serial8250_16550A_vdev *vdev, unsigned int max_latency_us,
+                              unsigned int min_bytes)
+{
+    lock_vuart_oppr(vdev);
+    vdev->coalesce_usecs = max_latency_us;
+    vdev->coalesce_bytes = min_bytes;
+    unlock_vuart_oppr(vdev);
+
+    //Disabling coalescing doesn't cancel the timer: an RX interrupt held at this moment will still be delivered by it
+    return 0;
+}
+
+#ifndef VUART_USE_VIRQ_THREAD
+/******************************************* Tasklet-based vIRQ (default) *********************************************/
+#include <linux/interrupt.h> //tasklet_*
+
+/**
+ * Tasklet simulating the IRQ call (normally done via hardware interrupt triggering CPU to invoke Linux IRQ subsystem)
+ *
+ * It's scheduled by vuart_virq_wake_up() whenever IIR changes to signal a pending interrupt, and runs in the softirq
+ * context right after (usually on the same CPU, when the vdev lock is released). The 8250 handler expects to be called
+ * from an atomic context anyway, so this is as close to a real IRQ as we can get without a context switch per
+ * interrupt and without a kernel thread per port. See virq_thread() (VUART_USE_VIRQ_THREAD) for the old way.
+ */
+static void virq_tasklet(unsigned long data)
+{
+    struct serial8250_16550A_vdev *vdev = (struct serial8250_16550A_vdev *)data;
+
+    //Interrupts could've been acknowledged (e.g. by a poll from the driver) before we got here
+    if (unlikely(!vdev->virq_enabled) || (vdev->iir & UART_IIR_NO_INT))
+        return;
+
+    deliver_virq(vdev);
+}
+
+int vuart_enable_interrupts(struct serial8250_16550A_vdev *vdev)
+{
+    int out = 0;
+    pr_loc_dbg("Enabling vIRQ for ttyS%d", vdev->line);
+    lock_vuart(vdev);
+
+    if (unlikely(!vdev->initialized)) {
+        pr_loc_bug("ttyS%d is not initialized as vUART", vdev->line);
+        out = -ENODEV;
+        goto out_unlock;
+    }
+
+    if (unlikely(vuart_virq_active(vdev))) {
+        pr_loc_bug("Interrupts are already enabled & scheduled for ttyS%d", vdev->line);
+        out = -EBUSY;
+        goto out_unlock;
+    }
+
+    tasklet_init(&vdev->virq_tasklet, virq_tasklet, (unsigned long)vdev);
+    init_virq_coalescing(vdev);
+    vdev->virq_enabled = true;
+    pr_loc_dbg("vIRQ fully enabled for for ttyS%d", vdev->line);
+
+    out_unlock:
+    unlock_vuart(vdev);
+
+    return out;
+}
+
+int vuart_disable_interrupts(struct serial8250_16550A_vdev *vdev)
+{
+    int out = 0;
+    pr_loc_dbg("Disabling vIRQ for ttyS%d", vdev->line);
+    lock_vuart(vdev);
+
+    if (unlikely(!vdev->initialized)) {
+        pr_loc_bug("ttyS%d is not initialized as vUART", vdev->line);
+        unlock_vuart(vdev);
+        return -ENODEV;
+    }
+
+    if (unlikely(!vuart_virq_active(vdev))) {
+        pr_loc_bug("Interrupts are not enabled/scheduled for ttyS%d", vdev->line);
+        unlock_vuart(vdev);
+        return -EBUSY;
+    }
+
+    //No new schedules can happen after that (they're done under the lock), but one may be pending or running
+    vdev->virq_enabled = false;
+    unlock_vuart(vdev);
+
+    hrtimer_cancel(&vdev->coalesce_timer); //the timer schedules the tasklet, so it must go first
+    tasklet_kill(&vdev->virq_tasklet); //this can wait so it cannot be done under the spinlock
+    pr_loc_dbg("vIRQ disabled for ttyS%d", vdev->line);
+
+    return out;
+}
+
+#else //VUART_USE_VIRQ_THREAD
+/******************************************* Thread-based vIRQ (legacy) ***********************************************/
 #include <linux/kthread.h> //running vIRQ thread
+#include <linux/sched.h> //wake_up_process()
+#include "../housekeeping.h" //housekeeping_affine_task()
 #include <linux/wait.h> //wait queue handling (init_waitqueue_head etc.)
-#include <linux/serial_8250.h> //serial8250_handle_irq
 
 //Default name of the thread for vIRQ
 #ifndef VUART_THREAD_FMT
@@ -43,13 +202,7 @@ static int virq_thread(void *data)
         if (unlikely(kthread_should_stop()))
             break;
 
-        if (unlikely(!vdev->up)) {
-            pr_loc_bug("Cannot call serial8250 interrupt handler - port not captured (yet?)");
-            continue;
-        }
-
-        uart_prdbg("Calling serial8250 interrupt handler");
-        serial8250_handle_irq(vdev->up, vdev->iir);
+        deliver_virq(vdev);
     }
     uart_prdbg("%s stopped for ttyS%d pid=%d exit=%d", __FUNCTION__, vdev->line, current->pid, out);
 
@@ -86,18 +239,21 @@ int vuart_enable_interrupts(struct serial8250_16550A_vdev *vdev)
     }
 
     init_waitqueue_head(vdev->virq_queue);
+    init_virq_coalescing(vdev);
     unlock_vuart(vdev); //we can safely unlock after reserving memory but before starting thread (so we're not atomic)
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-extra-args"
     //VUART_THREAD_FMT can resolve to anonymized version without line or even IRQ#
-    vdev->virq_thread = kthread_run(virq_thread, vdev, VUART_THREAD_FMT, vdev->irq, vdev->line);
+    vdev->virq_thread = kthread_create(virq_thread, vdev, VUART_THREAD_FMT, vdev->irq, vdev->line);
 #pragma GCC diagnostic pop
     if (IS_ERR(vdev->virq_thread)) {
         out = PTR_ERR(vdev->virq_thread);
         pr_loc_bug("Failed to start vIRQ thread");
         goto error_free;
     }
+    housekeeping_affine_task(vdev->virq_thread);
+    wake_up_process(vdev->virq_thread);
     pr_loc_dbg("vIRQ fully enabled for for ttyS%d", vdev->line);
 
     return 0;
@@ -142,6 +298,7 @@ int vuart_disable_interrupts(struct serial8250_16550A_vdev *vdev)
 
     kfree(vdev->virq_thread);
     vdev->virq_thread = NULL;
+    hrtimer_cancel(&vdev->coalesce_timer); //no new starts possible as vIRQ is now inactive; callback takes no locks
     pr_loc_dbg("vIRQ disabled for ttyS%d", vdev->line);
 
     out_unlock:
@@ -149,4 +306,6 @@ int vuart_disable_interrupts(struct serial8250_16550A_vdev *vdev)
 
     return 0;
 }
-#endif
\ No newline at end of file
+#endif //VUART_USE_VIRQ_THREAD
+
+#endif //VUART_USE_TIMER_FALLBACK
@@ -6,15 +6,36 @@
 #define vuart_virq_wake_up(dummy) //noop
 #define vuart_enable_interrupts(dummy) (0)
 #define vuart_disable_interrupts(dummy) (0)
+#define vuart_virq_coalesce(dummy, dummy_iir) (false)
+#define vuart_virq_set_coalescing(dummy, dummy_us, dummy_bytes) (-EOPNOTSUPP)
 
 #else //VUART_USE_TIMER_FALLBACK
 #include "vuart_internal.h"
 
 #define vuart_virq_supported() 1
+#ifdef VUART_USE_VIRQ_THREAD
 #define vuart_virq_active(vdev) (!!(vdev)->virq_thread)
 #define vuart_virq_wake_up(vdev) if (vuart_virq_active(vdev)) { wake_up_interruptible(vdev->virq_queue); }
+#else //VUART_USE_VIRQ_THREAD
+#define vuart_virq_active(vdev) ((vdev)->virq_enabled)
+#define vuart_virq_wake_up(vdev) if (vuart_virq_active(vdev)) { tasklet_schedule(&(vdev)->virq_tasklet); }
+#endif //VUART_USE_VIRQ_THREAD
 int vuart_enable_interrupts(struct serial8250_16550A_vdev *vdev);
 int vuart_disable_interrupts(struct serial8250_16550A_vdev *vdev);
+
+/**
+ * Decides whether delivery of a pending interrupt should be delayed (coalesced)
+ *
+ * Must be called with vdev lock held. When it returns true the caller should NOT wake up the vIRQ - it will be
+ * delivered by the coalescing timer or as soon as enough data is waiting in the RX FIFO.
+ */
+bool vuart_virq_coalesce(struct serial8250_16550A_vdev *vdev, u8 iir);
+
+/**
+ * Sets coalescing parameters for the vdev; see vuart_set_irq_coalescing() for details
+ */
+int vuart_virq_set_coalescing(struct serial8250_16550A_vdev *vdev, unsigned int max_latency_us,
+                              unsigned int min_bytes);
 #endif //VUART_USE_TIMER_FALLBACK
 
 #endif //REDPILL_VUART_VIRTUAL_IRQ_H
\ No newline at end of file
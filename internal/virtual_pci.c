@@ -18,8 +18,9 @@
  *  - you should (but you don't HAVE to) set "master bus" (.command |= PCI_COMMAND_MASTER) for every function 0 device
  *    instance
  *  - every device MUST have a valid VID/DEV. None of the fields can be 0x0000 or 0xFFFF (they have special meanings)
- *  - this module does NOT have any support for capabilities (CAPs) as they're variable length and we don't want to
- *    force every device struct to take 256K of memory (todo if needed?)
+ *  - capabilities (CAPs) cannot be put in the descriptor. Instead, a device can be added with struct vpci_dev_caps,
+ *    which builds a chain of the standard ones (PM, MSI, PCIe) in the device-specific area (see "CAPABILITIES"
+ *    below)
  *  - there are three types of headers: PCI device, PCI-PCI bridge, PCI-CardBus bridge. Only the first one was tested.
  *    The second one allows for more levels of the tree and should work if configured properly (see struct
  *    pci_pci_bridge_descriptor) but it wasn't needed yet. The third one is practically a bitrot now.
@@ -45,6 +46,9 @@
  *       - use U24_CLASS_TO_U8_PROGIF(PCI_CLASS_SERIAL_USB) for pci_dev_descriptor.prog_if [0x03]
  *  - "pci_dev_conf_default_normal_dev" provides a sane-default device where you need to only set: vid, dev, class,
  *    and subclass.
+ *  - the descriptor is only a template: every device gets its own copy of the config space when it's added, and the
+ *    kernel can write to the copy (e.g. to enable the device or to size its BARs). Only bits which are writable on a
+ *    real device are changed, and the rest of each write is ignored (see "WRITING TO CONFIG SPACE" below).
  *
  *
  * DEBUGGING DEVICES
@@ -146,11 +150,56 @@
  *   obj->integer.value = 1;
  *   return obj;
  *
+ * WRITING TO CONFIG SPACE
+ * -----------------------
+ * Every device has a shadow copy of the config space (initialized from the descriptor) and a mask of writable bits
+ * built from the header type when the device is added:
+ *  - command register: all the defined PCI_COMMAND_* bits
+ *  - cache line size, latency timer, interrupt line, and (for bridges) bus numbers, windows & bridge control
+ *  - BARs & expansion ROM: the descriptor doesn't contain sizes, so the size of a region is implied by the alignment
+ *    of its address in the descriptor (i.e. the lowest set address bit, e.g. 0xfebf0000 means a 64K region). The
+ *    kernel sizes a BAR by writing all 1s and reading it back, and gets exactly that size. An empty (0) BAR isn't
+ *    implemented and always reads as 0, which is how the kernel sees an unused BAR.
+ *  - everything else (IDs, class, header type, status, capabilities, device-specific area) is read-only
+ * Status is read-only, not RW1C: emulated devices never report errors, so there is nothing to clear.
+ * Accesses don't need locking as the PCI core serializes all config reads & writes with pci_lock.
+ *
+ * CAPABILITIES
+ * ------------
+ * When a device is added with struct vpci_dev_caps the capabilities are placed one after another starting at
+ * VPCI_CAPS_START, in the order PM => MSI => PCIe. Then cap_ptr and PCI_STATUS_CAP_LIST are set. Only the bits the
+ * kernel needs to drive a capability are writable: the power state, MSI enable/address/data, and device & link
+ * control.
+ * A device with the PCIe capability has a 4K config space. The kernel detects it by reading at 0x100. There are no
+ * extended capabilities, so the whole extended area reads as 0s. Any other device has a 256 bytes config space, and
+ * accesses beyond it are rejected.
+ * MSI-X isn't supported: its table lives in a memory BAR, and there's no memory behind the virtual BARs.
+ *
  * x86 BUS SCANNING BUG (>=v4.1)
  * -----------------------------
  * Since v4.1 adding a new bus under a different domain will cause devices on the bus to not be fully populated. See the
  * comment in "vpci_add_single_device()" here for details & a simple fix.
  *
+ * DRIVERS BINDING
+ * ---------------
+ * Virtual devices exist only to make the PCI topology look as expected - there's nothing behind their BARs. Without
+ * any precautions real drivers (e.g. ahci for a 88SE9235 or igb for an I211) bind to them during scanning and when
+ * they're loaded later, fail to map registers or time out, and log errors (sometimes with retries). To avoid that:
+ *  - since v3.16 every device on the virtual domain gets an empty driver_override as soon as the PCI core adds it and
+ *    before any driver is matched. No driver's name is empty, so nothing ever probes it (and it stays unbound, which
+ *    is indistinguishable from a device without a driver).
+ *  - older kernels have no driver_override, so a stub driver (VPCI_STUB_DRV_NAME) claims all devices on the virtual
+ *    domain instead. It gets a device only after drivers registered before it had their chance, so builtin drivers
+ *    still probe (and fail) once during scanning - but modules loaded later, as well as rebinding, find it taken.
+ *
+ * RUNTIME CHANGES
+ * ---------------
+ * Devices can be added to & removed from an existing bus at any time. Only the affected slot is scanned when a device
+ * is added (the rest of the bus isn't re-read) and only the affected device is detached when it's removed. Buses are
+ * never removed on their own, even when empty, as they cannot be re-created (see below) - but devices can be re-added
+ * on them. The same rules as for the initial population apply to multifunction devices: fn=0 has to be added last and
+ * thus it can only be removed when it's the last function left.
+ *
  * KNOWN BUGS
  * ----------
  * Under Linux v3.10 once bus is added it cannot be fully removed (or we didn't find the correct way). When you do the
@@ -171,13 +220,30 @@
 #include "virtual_pci.h"
 #include "../common.h"
 #include "../config/vpci_types.h" //MAX_VPCI_BUSES
+#include "hook_stats.h" //hook_stats_measure()
+#include "rp_trace.h" //rp_trace()
+#include "helper/debug_keys.h" //pr_loc_dbg_on()
 #include <linux/pci.h>
 #include <linux/pci_regs.h> //PCI device header constants
 #include <linux/pci_ids.h> //Constants for vendors, classes, and other
 #include <linux/list.h> //list_for_each
 #include <linux/device.h> //device_del
+#include <linux/notifier.h> //struct notifier_block, NOTIFY_*
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION()
 
-#define PCIBUS_VIRTUAL_DOMAIN 0x0001 //normal PC buses are (always?) on domain 0, this is just a next one
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+//Since v3.15 scanning & removal must be serialized with other rescans (e.g. through sysfs) by the caller
+#define vpci_lock_rescan_remove() pci_lock_rescan_remove()
+#define vpci_unlock_rescan_remove() pci_unlock_rescan_remove()
+#else
+#define vpci_lock_rescan_remove() do { } while (0)
+#define vpci_unlock_rescan_remove() do { } while (0)
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+#define VPCI_DRIVER_OVERRIDE //see "DRIVERS BINDING" in the header
+#else
+#define VPCI_STUB_DRV_NAME "pci-vstub"
+#endif
 #define PCI_DEVICE_NOT_FOUND_VID_DID 0xFFFFFFFF //A special case to detect non-existing devices (per PCI spec)
 
 /* As per PCI spec
@@ -240,7 +306,10 @@ struct virtual_device {
     unsigned char dev_no;
     unsigned char fn_no;
     struct pci_bus* bus;
-    void *descriptor;
+    const void *descriptor;
+    unsigned int cfg_size; //PCI_CFG_SPACE_SIZE or PCI_CFG_SPACE_EXP_SIZE for PCIe devices
+    u8 config[PCI_CFG_SPACE_EXP_SIZE]; //shadow config space; the descriptor is only used to initialize it
+    u8 wmask[PCI_CFG_SPACE_EXP_SIZE]; //bits of config[] which can be written to
 };
 static unsigned int free_bus_idx = 0; //Used to find next free bus and for indexing other arrays
 static struct pci_bus *buses[MAX_VPCI_BUSES] = { NULL }; //All virtual buses
@@ -252,14 +321,35 @@ static struct virtual_device *devices[MAX_VPCI_DEVS] = { NULL }; //All virtual d
 #define for_each_bus_idx() for (int i = 0, last_bus_idx = free_bus_idx-1; i <= last_bus_idx; i++)
 #define for_each_dev_idx() for (int i = 0, last_dev_idx = free_dev_idx-1; i <= last_dev_idx; i++)
 
+//Direct-mapped index used by config space reads. The PCI core and drivers read the config space hundreds of times per
+// device, so instead of searching devices[] every time the bus# is mapped to bus index and [bus index][devfn] to the
+// device. The bus index is reserved before the bus is scanned for the first time, as the scan reads the config.
+#define VBUS_LOOKUP_NONE 0 //vbus_lookup[] contains bus index + 1 so that the zero-initialized table is empty
+static u8 vbus_lookup[256] = { VBUS_LOOKUP_NONE }; //bus# => bus index + 1
+static struct virtual_device *vdev_lookup[MAX_VPCI_BUSES][256] = { { NULL } }; //[bus index][devfn] => device
+
+/**
+ * Finds a device for a given B/D/F
+ *
+ * @return device or NULL if no such device exists
+ */
+static __always_inline struct virtual_device *lookup_vdev(unsigned char bus_no, unsigned int devfn)
+{
+    u8 bus_entry = vbus_lookup[bus_no];
+    if (bus_entry == VBUS_LOOKUP_NONE)
+        return NULL;
+
+    return vdev_lookup[bus_entry - 1][devfn & 0xFF];
+}
+
 /**
  * Prints pci_dev_descriptor or pci_pci_bridge_descriptor
  */
-void print_pci_descriptor(void *test_dev)
+void print_pci_descriptor(const void *test_dev)
 {
     pr_loc_dbg("Printing PCI descriptor @ %p", test_dev);
     pr_loc_dbg_raw("\n31***********0***ADDR*******************\n");
-    u8 *ptr = (u8 *)test_dev;
+    const u8 *ptr = test_dev;
     DBG_ALLOW_UNUSED(*ptr);
 
     for (int row = 3; row < 64; row += 4) {
@@ -284,55 +374,72 @@ void print_pci_descriptor(void *test_dev)
  * @param val Pointer to save read bytes
  * @return PCIBIOS_*
  */
-static int pci_read_cfg(struct pci_bus *bus, unsigned int devfn, int where, int size, u32 *val)
+static int __pci_read_cfg(struct pci_bus *bus, unsigned int devfn, int where, int size, u32 *val)
 {
     //devfn is a combination of device number on bus and function number (Bus/Device/Function addressing)
     //Each device which exists MUST implement function 0. So every 8th value of devfn we have a new device.
-    unsigned char vdev_no = PCI_SLOT(devfn);
-    unsigned char vdev_fn = PCI_FUNC(devfn);
 
-    void *pci_descriptor = NULL;
+    //We cannot use device->bus->number during scan as the bus may just being created - the index is keyed by bus#
+    struct virtual_device *device = lookup_vdev(bus->number, devfn);
 
-    //Very noisy!
-    //pr_loc_dbg("Read SYN wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size, size * 8,
-    //           bus->number, vdev_no, vdev_fn);
-    for_each_dev_idx() {
-        //Very noisy!
-        //pr_loc_dbg("Checking vDEV @ bus=%02x dev=%02x fn=%02x", *devices[i]->bus_no, devices[i]->dev_no,
-        //           devices[i]->fn_no);
-
-        //We cannot use devices[i]->bus->number during scan as the bus may just being created and no ->bus is available
-        if(*devices[i]->bus_no == bus->number && devices[i]->dev_no == vdev_no && devices[i]->fn_no == vdev_fn) {
-            //Very noisy!
-            //pr_loc_dbg("Found matching vDEV @ bus=%02x dev=%02x fn=%02x => vidx=%d mf=%d", bus->number, vdev_no,
-            //           vdev_fn, i,
-            //           IS_PCI_HEADER_MULTI(((struct pci_dev_descriptor *) devices[i]->descriptor)->header_type) ? 1:0);
-            pci_descriptor = devices[i]->descriptor;
-            break;
-        }
-    };
-
-    if (!pci_descriptor) { //This is not a hack - this is per PCI spec to return special "not found pid/vid"
+    if (!device) { //This is not a hack - this is per PCI spec to return special "not found pid/vid"
         if (where == PCI_VENDOR_ID || where == PCI_DEVICE_ID)
             *val = PCI_DEVICE_NOT_FOUND_VID_DID;
 
-        //Very noisy!
-        //pr_loc_dbg("Read NAK wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size, size * 8, bus->number,
-        //           vdev_no, vdev_fn);
+        pr_loc_dbg_on(PCI, "Read NAK wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size,
+                      size * 8, bus->number, PCI_SLOT(devfn), PCI_FUNC(devfn)); //very noisy, see debug_keys.h
         return PCIBIOS_DEVICE_NOT_FOUND;
     }
 
-    //Very noisy!
-    //pr_loc_dbg("Read ACK wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size, size * 8, bus->number,
-    //           vdev_no, vdev_fn);
-    memcpy(val, (u8 *)pci_descriptor + where, size);
+    pr_loc_dbg_on(PCI, "Read ACK wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size, size * 8,
+                  bus->number, PCI_SLOT(devfn), PCI_FUNC(devfn));
+    if (unlikely(where < 0 || where + size > device->cfg_size))
+        return PCIBIOS_BAD_REGISTER_NUMBER;
+
+    *val = 0;
+    memcpy(val, device->config + where, size);
 
     return PCIBIOS_SUCCESSFUL;
 }
 
+/**
+ * Instrumented entrypoint for __pci_read_cfg()
+ */
+static int pci_read_cfg(struct pci_bus *bus, unsigned int devfn, int where, int size, u32 *val)
+{
+    int out = hook_stats_measure(HOOK_STATS_VPCI_READ_CFG, __pci_read_cfg(bus, devfn, where, size, val));
+    rp_trace(vpci_cfg, bus->number, devfn, where, size, out == PCIBIOS_SUCCESSFUL ? *val : 0, false, out);
+    return out;
+}
+
+/**
+ * Writes to the shadow config space of a device, changing only bits which are writable (see build_config_wmask())
+ *
+ * @param bus The bus (may be under first scan so only its number may be present in virtual_device)
+ * @param devfn Device AND its function; it's a 0-256 number allowing for 32 devices with 8 functions each
+ * @param where Offset in the device structure to write
+ * @param size How many BYTES (not bits) to write
+ * @param val Value to write
+ * @return PCIBIOS_*
+ */
 static int pci_write_cfg(struct pci_bus *bus, unsigned int devfn, int where, int size, u32 val)
 {
-    return PCIBIOS_SET_FAILED;
+    struct virtual_device *device = lookup_vdev(bus->number, devfn);
+    if (!device)
+        return PCIBIOS_DEVICE_NOT_FOUND;
+
+    if (unlikely(where < 0 || where + size > device->cfg_size))
+        return PCIBIOS_BAD_REGISTER_NUMBER;
+
+    pr_loc_dbg_on(PCI, "Write wh=0x%d sz=%d B / %d val=%08x for vDEV @ bus=%02x dev=%02x fn=%02x", where, size,
+                  size * 8, val, bus->number, PCI_SLOT(devfn), PCI_FUNC(devfn));
+    rp_trace(vpci_cfg, bus->number, devfn, where, size, val, true, PCIBIOS_SUCCESSFUL);
+    for (int i = 0; i < size; ++i, val >>= 8) {
+        u8 mask = device->wmask[where + i];
+        device->config[where + i] = (device->config[where + i] & ~mask) | (val & mask);
+    }
+
+    return PCIBIOS_SUCCESSFUL;
 }
 
 //Definition of callbacks the PCI subsystem uses to query the root bus
@@ -388,19 +495,293 @@ static inline int validate_bdf(unsigned char bus_no, unsigned char dev_no, unsig
     }
 
     //If the device has the same B/D/F address it is a duplicate
-    for_each_dev_idx() {
-        if (
-                likely(*devices[i]->bus_no == bus_no) &&
-                unlikely(devices[i]->dev_no == dev_no && devices[i]->fn_no == fn_no)
-                ) {
-            pr_loc_err("Device bus=%02x dev=%02x fn=%02x already exists in vidx=%d", bus_no, dev_no, fn_no, i);
-            return -EEXIST;
+    if (unlikely(lookup_vdev(bus_no, PCI_DEVFN(dev_no, fn_no)))) {
+        pr_loc_err("Device bus=%02x dev=%02x fn=%02x already exists", bus_no, dev_no, fn_no);
+        return -EEXIST;
+    }
+
+    return 0;
+}
+
+static inline void set_config_wmask(struct virtual_device *device, int where, int size, u32 mask)
+{
+    for (int i = 0; i < size; ++i, mask >>= 8)
+        device->wmask[where + i] = mask & 0xFF;
+}
+
+/**
+ * Determines writable bits of a BAR (or an expansion ROM address) with the size implied by the address alignment
+ *
+ * @param bar Value of the register in the descriptor
+ * @param addr_mask Bits containing the address (i.e. PCI_BASE_ADDRESS_*_MASK or PCI_ROM_ADDRESS_MASK)
+ * @return mask of writable bits; 0 if the BAR is not implemented
+ */
+static inline u32 get_bar_wmask(u32 bar, u32 addr_mask)
+{
+    u32 addr = bar & addr_mask;
+    if (!addr)
+        return 0;
+
+    return addr_mask & ~((addr & -addr) - 1); //lowest set bit of the address is the region size
+}
+
+/**
+ * Sets write masks of BARs; a 64-bit memory BAR makes the next BAR its (fully writable) upper half
+ */
+static void set_bars_wmask(struct virtual_device *device, int bars_count)
+{
+    for (int bar = 0; bar < bars_count; ++bar) {
+        int where = PCI_BASE_ADDRESS_0 + bar * 4;
+        u32 val = *(u32 *)(device->config + where);
+
+        if (val & PCI_BASE_ADDRESS_SPACE_IO) {
+            set_config_wmask(device, where, 4, get_bar_wmask(val, (u32)PCI_BASE_ADDRESS_IO_MASK));
+            continue;
         }
-    };
 
+        u32 mask = get_bar_wmask(val, (u32)PCI_BASE_ADDRESS_MEM_MASK);
+        set_config_wmask(device, where, 4, mask);
+        if (mask && (val & PCI_BASE_ADDRESS_MEM_TYPE_MASK) == PCI_BASE_ADDRESS_MEM_TYPE_64 && bar + 1 < bars_count)
+            set_config_wmask(device, PCI_BASE_ADDRESS_0 + (++bar) * 4, 4, 0xFFFFFFFF);
+    }
+}
+
+static inline void set_rom_wmask(struct virtual_device *device, int where)
+{
+    u32 mask = get_bar_wmask(*(u32 *)(device->config + where), (u32)PCI_ROM_ADDRESS_MASK);
+    set_config_wmask(device, where, 4, mask ? (mask | PCI_ROM_ADDRESS_ENABLE) : 0);
+}
+
+/**
+ * Initializes shadow config space of a device from its descriptor along with the mask of writable bits
+ *
+ * See "WRITING TO CONFIG SPACE" in the file header for details.
+ */
+static void init_vdev_config(struct virtual_device *device, const void *descriptor)
+{
+    //Both descriptor types cover the whole standard header (and nothing more) - the rest of the space reads as 0s
+    memset(device->config, 0, sizeof(device->config));
+    memcpy(device->config, descriptor, sizeof(struct pci_dev_descriptor));
+    memset(device->wmask, 0, sizeof(device->wmask));
+    device->cfg_size = PCI_CFG_SPACE_SIZE;
+
+    set_config_wmask(device, PCI_COMMAND, 2,
+                     PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER | PCI_COMMAND_SPECIAL |
+                     PCI_COMMAND_INVALIDATE | PCI_COMMAND_VGA_PALETTE | PCI_COMMAND_PARITY | PCI_COMMAND_WAIT |
+                     PCI_COMMAND_SERR | PCI_COMMAND_FAST_BACK | PCI_COMMAND_INTX_DISABLE);
+    set_config_wmask(device, PCI_CACHE_LINE_SIZE, 1, 0xFF);
+    set_config_wmask(device, PCI_LATENCY_TIMER, 1, 0xFF);
+    set_config_wmask(device, PCI_INTERRUPT_LINE, 1, 0xFF);
+
+    if ((device->config[PCI_HEADER_TYPE] & 0x7F) != PCI_HEADER_TYPE_BRIDGE) {
+        set_bars_wmask(device, 6);
+        set_rom_wmask(device, PCI_ROM_ADDRESS);
+        return;
+    }
+
+    set_bars_wmask(device, 2);
+    set_config_wmask(device, PCI_PRIMARY_BUS, 4, 0xFFFFFFFF); //primary, secondary, subordinate & sec. latency timer
+    set_config_wmask(device, PCI_IO_BASE, 1, PCI_IO_RANGE_MASK & 0xFF);
+    set_config_wmask(device, PCI_IO_LIMIT, 1, PCI_IO_RANGE_MASK & 0xFF);
+    set_config_wmask(device, PCI_MEMORY_BASE, 2, PCI_MEMORY_RANGE_MASK & 0xFFFF);
+    set_config_wmask(device, PCI_MEMORY_LIMIT, 2, PCI_MEMORY_RANGE_MASK & 0xFFFF);
+    set_config_wmask(device, PCI_PREF_MEMORY_BASE, 2, PCI_PREF_RANGE_MASK & 0xFFFF);
+    set_config_wmask(device, PCI_PREF_MEMORY_LIMIT, 2, PCI_PREF_RANGE_MASK & 0xFFFF);
+    if ((device->config[PCI_PREF_MEMORY_BASE] & PCI_PREF_RANGE_TYPE_MASK) == PCI_PREF_RANGE_TYPE_64) {
+        set_config_wmask(device, PCI_PREF_BASE_UPPER32, 4, 0xFFFFFFFF);
+        set_config_wmask(device, PCI_PREF_LIMIT_UPPER32, 4, 0xFFFFFFFF);
+    }
+    if ((device->config[PCI_IO_BASE] & PCI_IO_RANGE_TYPE_MASK) == PCI_IO_RANGE_TYPE_32) {
+        set_config_wmask(device, PCI_IO_BASE_UPPER16, 2, 0xFFFF);
+        set_config_wmask(device, PCI_IO_LIMIT_UPPER16, 2, 0xFFFF);
+    }
+    set_rom_wmask(device, PCI_ROM_ADDRESS1);
+    set_config_wmask(device, PCI_BRIDGE_CONTROL, 2, 0x0FFF); //bits 12-15 are reserved
+}
+
+#define VPCI_CAPS_START 0x40 //first byte after the standard header
+#define VPCI_CAP_PM_SIZEOF PCI_PM_SIZEOF
+#define VPCI_CAP_MSI_SIZEOF 16 //64-bit variant w/o per-vector masking (14 bytes) rounded up to a dword
+#define VPCI_CAP_EXP_SIZEOF 0x3c //v2 capability including slot & root registers, which aren't used by endpoints
+
+static inline void set_config_u16(struct virtual_device *device, int where, u16 val)
+{
+    *(u16 *)(device->config + where) = cpu_to_le16(val);
+}
+
+static inline void set_config_u32(struct virtual_device *device, int where, u32 val)
+{
+    *(u32 *)(device->config + where) = cpu_to_le32(val);
+}
+
+/**
+ * Appends a capability header to the chain
+ *
+ * @param pos Offset of the new capability
+ * @param prev_next Offset of "next" pointer of the previous capability (or PCI_CAPABILITY_LIST for the first one)
+ * @return offset of "next" pointer of the new capability
+ */
+static inline int add_cap_header(struct virtual_device *device, int pos, int prev_next, u8 cap_id)
+{
+    device->config[prev_next] = pos;
+    device->config[pos + PCI_CAP_LIST_ID] = cap_id;
+    device->config[pos + PCI_CAP_LIST_NEXT] = 0x00;
+
+    return pos + PCI_CAP_LIST_NEXT;
+}
+
+static void build_pm_cap(struct virtual_device *device, int pos)
+{
+    //PM v1.2 with D0 & D3hot only; the device keeps its state when going to D3hot (i.e. no reset is needed after)
+    set_config_u16(device, pos + PCI_PM_PMC, 0x0003);
+    set_config_u16(device, pos + PCI_PM_CTRL, PCI_PM_CTRL_NO_SOFT_RESET); //state bits = 0 => D0
+    set_config_wmask(device, pos + PCI_PM_CTRL, 2, PCI_PM_CTRL_STATE_MASK);
+}
+
+static void build_msi_cap(struct virtual_device *device, int pos, u8 vectors_log2)
+{
+    set_config_u16(device, pos + PCI_MSI_FLAGS, PCI_MSI_FLAGS_64BIT | ((vectors_log2 << 1) & PCI_MSI_FLAGS_QMASK));
+    set_config_wmask(device, pos + PCI_MSI_FLAGS, 2, PCI_MSI_FLAGS_ENABLE | PCI_MSI_FLAGS_QSIZE);
+    set_config_wmask(device, pos + PCI_MSI_ADDRESS_LO, 4, 0xFFFFFFFC); //the address must be dword-aligned
+    set_config_wmask(device, pos + PCI_MSI_ADDRESS_HI, 4, 0xFFFFFFFF);
+    set_config_wmask(device, pos + PCI_MSI_DATA_64, 2, 0xFFFF);
+}
+
+static void build_exp_cap(struct virtual_device *device, int pos, const struct vpci_dev_caps *caps)
+{
+    u16 link = caps->link_speed | (caps->link_width << PCI_EXP_LNKSTA_NLW_SHIFT);
+
+    set_config_u16(device, pos + PCI_EXP_FLAGS, 0x0002 | ((caps->pcie_type << 4) & PCI_EXP_FLAGS_TYPE)); //v2
+    set_config_u32(device, pos + PCI_EXP_DEVCAP, 0x00000000); //128B payload, no phantom fns, no FLR
+    set_config_wmask(device, pos + PCI_EXP_DEVCTL, 2, 0x7FFF); //bit 15 is FLR/bridge retry which aren't supported
+    set_config_u32(device, pos + PCI_EXP_LNKCAP, link); //no ASPM, port #0
+    set_config_wmask(device, pos + PCI_EXP_LNKCTL, 2,
+                     PCI_EXP_LNKCTL_ASPMC | PCI_EXP_LNKCTL_RCB | PCI_EXP_LNKCTL_CCC | PCI_EXP_LNKCTL_ES |
+                     PCI_EXP_LNKCTL_CLKREQ_EN | PCI_EXP_LNKCTL_HAWD);
+    set_config_u16(device, pos + PCI_EXP_LNKSTA, link); //link is always trained at its max speed & width
+    set_config_u32(device, pos + PCI_EXP_LNKCAP2, ((1 << caps->link_speed) - 1) << 1); //all speeds up to the max
+    set_config_u16(device, pos + PCI_EXP_LNKCTL2, caps->link_speed); //target speed
+}
+
+/**
+ * Builds a chain of capabilities in the device-specific area of the config space
+ *
+ * See "CAPABILITIES" in the file header for details.
+ */
+static int build_vdev_caps(struct virtual_device *device, const struct vpci_dev_caps *caps)
+{
+    if (unlikely(caps->pcie && (!caps->link_speed || caps->link_width < 1 || caps->link_width > 32))) {
+        pr_loc_bug("Invalid PCIe link speed=%u width=%u", caps->link_speed, caps->link_width);
+        return -EINVAL;
+    }
+
+    int pos = VPCI_CAPS_START;
+    int prev_next = PCI_CAPABILITY_LIST;
+    device->config[PCI_CAPABILITY_LIST] = 0x00;
+
+    if (caps->pm) {
+        prev_next = add_cap_header(device, pos, prev_next, PCI_CAP_ID_PM);
+        build_pm_cap(device, pos);
+        pos += VPCI_CAP_PM_SIZEOF;
+    }
+
+    if (caps->msi) {
+        prev_next = add_cap_header(device, pos, prev_next, PCI_CAP_ID_MSI);
+        build_msi_cap(device, pos, caps->msi_vectors_log2);
+        pos += VPCI_CAP_MSI_SIZEOF;
+    }
+
+    if (caps->pcie) {
+        prev_next = add_cap_header(device, pos, prev_next, PCI_CAP_ID_EXP);
+        build_exp_cap(device, pos, caps);
+        pos += VPCI_CAP_EXP_SIZEOF;
+        device->cfg_size = PCI_CFG_SPACE_EXP_SIZE;
+    }
+
+    if (device->config[PCI_CAPABILITY_LIST])
+        device->config[PCI_STATUS] |= PCI_STATUS_CAP_LIST; //it's in the low byte of the status
+
+    pr_loc_dbg("Built vPCI caps pm=%d msi=%d pcie=%d using %d bytes", caps->pm ? 1 : 0, caps->msi ? 1 : 0,
+               caps->pcie ? 1 : 0, pos - VPCI_CAPS_START);
     return 0;
 }
 
+static __always_inline bool is_vpci_dev(struct pci_dev *pci_dev)
+{
+    return pci_domain_nr(pci_dev->bus) == PCIBUS_VIRTUAL_DOMAIN;
+}
+
+#ifdef VPCI_DRIVER_OVERRIDE
+/**
+ * Prevents drivers from matching virtual devices (see "DRIVERS BINDING" in the header)
+ *
+ * BUS_NOTIFY_ADD_DEVICE is delivered from device_add(), which for PCI devices happens before they're allowed to match
+ * any driver (that's only done by pci_bus_add_device() later on).
+ */
+static int on_pci_device_added(struct notifier_block *self, unsigned long action, void *data)
+{
+    struct pci_dev *pci_dev = to_pci_dev((struct device *)data);
+    if (action != BUS_NOTIFY_ADD_DEVICE || !is_vpci_dev(pci_dev) || pci_dev->driver_override)
+        return NOTIFY_DONE;
+
+    pci_dev->driver_override = kstrdup("", GFP_KERNEL); //freed by the PCI core along with the device
+    if (unlikely(!pci_dev->driver_override)) {
+        pr_loc_wrn("Failed to set driver override of vDEV dev=%02x fn=%02x - drivers may try to probe it",
+                   PCI_SLOT(pci_dev->devfn), PCI_FUNC(pci_dev->devfn));
+        return NOTIFY_DONE;
+    }
+
+    return NOTIFY_OK;
+}
+
+static struct notifier_block pci_bus_nb = {
+    .notifier_call = on_pci_device_added,
+};
+
+static inline int register_vpci_binding(void) { return bus_register_notifier(&pci_bus_type, &pci_bus_nb); }
+static inline void unregister_vpci_binding(void) { bus_unregister_notifier(&pci_bus_type, &pci_bus_nb); }
+#else //VPCI_DRIVER_OVERRIDE
+static int vpci_stub_probe(struct pci_dev *pci_dev, const struct pci_device_id *id)
+{
+    return is_vpci_dev(pci_dev) ? 0 : -ENODEV; //-ENODEV is silent & lets other drivers try
+}
+
+static const struct pci_device_id vpci_stub_ids[] = {
+    { PCI_DEVICE(PCI_ANY_ID, PCI_ANY_ID) }, //devices are vetted by domain in the probe
+    { }
+};
+
+static struct pci_driver vpci_stub_driver = {
+    .name = VPCI_STUB_DRV_NAME,
+    .id_table = vpci_stub_ids,
+    .probe = vpci_stub_probe,
+};
+
+static inline int register_vpci_binding(void) { return pci_register_driver(&vpci_stub_driver); }
+static inline void unregister_vpci_binding(void) { pci_unregister_driver(&vpci_stub_driver); }
+#endif //VPCI_DRIVER_OVERRIDE
+
+static bool binding_registered = false;
+
+/**
+ * Makes sure real drivers will not bind to virtual devices; it must be called before any device is scanned
+ *
+ * A failure isn't fatal: devices will work as before, i.e. with drivers failing to probe them.
+ */
+static void ensure_vpci_binding(void)
+{
+    if (binding_registered)
+        return;
+
+    int out = register_vpci_binding();
+    if (unlikely(out != 0)) {
+        pr_loc_wrn("Failed to register vPCI drivers binding - real drivers may try to probe vDEVs - error=%d", out);
+        return;
+    }
+
+    binding_registered = true;
+}
+
 static inline struct pci_bus *get_vbus_by_number(unsigned char bus_no)
 {
     for_each_bus_idx() { //Determine whether we need to rescan existing bus after adding a device OR scan a new root bus
@@ -415,7 +796,8 @@ static inline struct pci_bus *get_vbus_by_number(unsigned char bus_no)
 }
 
 const __must_check struct virtual_device *
-vpci_add_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, void *descriptor)
+vpci_add_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, const void *descriptor,
+                bool multifunction, const struct vpci_dev_caps *caps)
 {
     pr_loc_dbg("Attempting to add vPCI device [printed below] @ bus=%02x dev=%02x fn=%02x", bus_no, dev_no, fn_no);
     print_pci_descriptor(descriptor);
@@ -425,6 +807,7 @@ vpci_add_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
         return ERR_PTR(error);
 
     struct pci_bus *bus = get_vbus_by_number(bus_no);
+    ensure_vpci_binding();
 
     //At this point we know the device can be added either to a new or existing bus so we have to populate their struct
     struct virtual_device *device;
@@ -433,13 +816,26 @@ vpci_add_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
     device->dev_no = dev_no;
     device->fn_no = fn_no;
     device->descriptor = descriptor;
+    init_vdev_config(device, descriptor);
+    if (multifunction) //in the copy, so that the same descriptor can be shared with single function devices
+        device->config[PCI_HEADER_TYPE] = PCI_HEADER_TO_MULTI(device->config[PCI_HEADER_TYPE]);
+    if (caps && (error = build_vdev_caps(device, caps)) != 0) {
+        kfree(device);
+        return ERR_PTR(error);
+    }
 
     if (bus) { //We have an existing bus to use
         device->bus_no = &bus->number;
         devices[free_dev_idx++] = device;
+        vdev_lookup[vbus_lookup[bus_no] - 1][PCI_DEVFN(dev_no, fn_no)] = device;
 
-        //We cannot use "pci_scan_single_device" here in case there are mf devices
-        pci_rescan_bus(bus); //this cannot fail - it simply return max device num
+        //We cannot use "pci_scan_single_device" here in case there are mf devices, but the slot is enough: it scans
+        // all functions of fn=0 (skipping existing ones). Virtual devices have no resources to assign, so unlike
+        // pci_rescan_bus() nothing else is needed besides adding the new devices (which also skips the existing ones).
+        vpci_lock_rescan_remove();
+        pci_scan_slot(bus, PCI_DEVFN(dev_no, 0));
+        pci_bus_add_devices(bus);
+        vpci_unlock_rescan_remove();
 
         pr_loc_err("Added device with existing bus @ bus=%02x dev=%02x fn=%02x", *device->bus_no, device->dev_no,
                    device->fn_no);
@@ -458,10 +854,14 @@ vpci_add_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
     unsigned char tmp_bus_no = bus_no; //It will be valid for the time of initial scan
     device->bus_no = &tmp_bus_no;
     devices[free_dev_idx++] = device;
+    vbus_lookup[bus_no] = free_bus_idx + 1; //the scan below will read the config so the index must be there already
+    vdev_lookup[free_bus_idx][PCI_DEVFN(dev_no, fn_no)] = device;
 
     bus = pci_scan_bus(*device->bus_no, &pci_shim_ops, &x86_sysdata);
     if (!bus) {
         pr_loc_err("pci_scan_bus failed - cannot add new bus");
+        vdev_lookup[free_bus_idx][PCI_DEVFN(dev_no, fn_no)] = NULL;
+        vbus_lookup[bus_no] = VBUS_LOOKUP_NONE;
         devices[free_dev_idx--] = NULL; //Reverse adding & ensure idx is still free
         kfree(device); //Free memory for the device itself
         return ERR_PTR(-EIO);
@@ -494,7 +894,8 @@ vpci_add_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
 }
 
 const struct virtual_device *
-vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, struct pci_dev_descriptor *descriptor)
+vpci_add_single_device_with_caps(unsigned char bus_no, unsigned char dev_no,
+                                 const struct pci_dev_descriptor *descriptor, const struct vpci_dev_caps *caps)
 {
     if (unlikely(IS_PCI_HEADER_MULTI(descriptor->header_type))) {
         pr_loc_bug("Attempted to use %s() to add multifunction device."
@@ -502,20 +903,31 @@ vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, struct pci_de
         return ERR_PTR(-EINVAL);
     }
 
-    return vpci_add_device(bus_no, dev_no, 0x00, descriptor);
+    return vpci_add_device(bus_no, dev_no, 0x00, descriptor, false, caps);
 }
 
 const struct virtual_device *
-vpci_add_multifunction_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                              struct pci_dev_descriptor *descriptor)
+vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, const struct pci_dev_descriptor *descriptor)
 {
-    descriptor->header_type = PCI_HEADER_TO_MULTI(descriptor->header_type);
+    return vpci_add_single_device_with_caps(bus_no, dev_no, descriptor, NULL);
+}
 
-    return vpci_add_device(bus_no, dev_no, fn_no, descriptor);
+const struct virtual_device *
+vpci_add_multifunction_device_with_caps(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
+                                        const struct pci_dev_descriptor *descriptor, const struct vpci_dev_caps *caps)
+{
+    return vpci_add_device(bus_no, dev_no, fn_no, descriptor, true, caps);
+}
+
+const struct virtual_device *
+vpci_add_multifunction_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
+                              const struct pci_dev_descriptor *descriptor)
+{
+    return vpci_add_multifunction_device_with_caps(bus_no, dev_no, fn_no, descriptor, NULL);
 }
 
 const struct virtual_device *
-vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pci_bridge_descriptor *descriptor)
+vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, const struct pci_pci_bridge_descriptor *descriptor)
 {
     if (unlikely(IS_PCI_HEADER_MULTI(descriptor->header_type))) {
         pr_loc_bug("Attempted to use %s() to add multifunction device."
@@ -523,16 +935,62 @@ vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pc
         return ERR_PTR(-EINVAL);
     }
 
-    return vpci_add_device(bus_no, dev_no, 0x00, descriptor);
+    return vpci_add_device(bus_no, dev_no, 0x00, descriptor, false, NULL);
 }
 
 const struct virtual_device *
 vpci_add_multifunction_bridge(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                              struct pci_pci_bridge_descriptor *descriptor)
+                              const struct pci_pci_bridge_descriptor *descriptor)
+{
+    return vpci_add_device(bus_no, dev_no, fn_no, descriptor, true, NULL);
+}
+
+int vpci_remove_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no)
 {
-    descriptor->header_type = PCI_HEADER_TO_MULTI(descriptor->header_type);
+    if (unlikely(!DEV_NO_VALID(dev_no) || !FN_NO_VALID(fn_no))) {
+        pr_loc_err("%02x:%02x is not a valid PCI device & function number", dev_no, fn_no);
+        return -EINVAL;
+    }
+
+    unsigned int devfn = PCI_DEVFN(dev_no, fn_no);
+    struct virtual_device *device = lookup_vdev(bus_no, devfn);
+    if (!device) {
+        pr_loc_err("There's no vPCI device @ bus=%02x dev=%02x fn=%02x", bus_no, dev_no, fn_no);
+        return -ENOENT;
+    }
+
+    //Kernel will not re-scan other functions if fn=0 is re-added (see vpci_add_multifunction_device())
+    for (unsigned char fn = 1; fn_no == 0 && fn <= 7; fn++) {
+        if (lookup_vdev(bus_no, PCI_DEVFN(dev_no, fn))) {
+            pr_loc_err("Cannot remove vPCI device @ bus=%02x dev=%02x fn=00 - remove fn=%02x first", bus_no, dev_no,
+                       fn);
+            return -EBUSY;
+        }
+    }
 
-    return vpci_add_device(bus_no, dev_no, fn_no, descriptor);
+    //The device may be gone from the PCI core already (e.g. removed through sysfs) - it's still ours to free
+    struct pci_bus *bus = get_vbus_by_number(bus_no);
+    vpci_lock_rescan_remove();
+    struct pci_dev *pci_dev = bus ? pci_get_slot(bus, devfn) : NULL;
+    if (pci_dev) {
+        pci_stop_and_remove_bus_device(pci_dev); //this may still access the config space so it must go first
+        pci_dev_put(pci_dev);
+    }
+    vpci_unlock_rescan_remove();
+
+    vdev_lookup[vbus_lookup[bus_no] - 1][devfn] = NULL;
+    for_each_dev_idx() {
+        if (devices[i] == device) { //move the last one into the hole to keep devices[] continuous
+            devices[i] = devices[last_dev_idx];
+            devices[last_dev_idx] = NULL;
+            break;
+        }
+    }
+    free_dev_idx--;
+    kfree(device);
+
+    pr_loc_inf("Removed device @ bus=%02x dev=%02x fn=%02x", bus_no, dev_no, fn_no);
+    return 0;
 }
 
 int vpci_remove_all_devices_and_buses(void)
@@ -556,6 +1014,8 @@ int vpci_remove_all_devices_and_buses(void)
         devices[i] = NULL;
     };
     free_dev_idx = 0;
+    memset(vdev_lookup, 0, sizeof(vdev_lookup));
+    memset(vbus_lookup, VBUS_LOOKUP_NONE, sizeof(vbus_lookup));
 
     for_each_bus_idx() {
         pr_loc_dbg("Removing child PCI vBUS @ bidx %d", i);
@@ -565,6 +1025,11 @@ int vpci_remove_all_devices_and_buses(void)
     }
     free_bus_idx = 0;
 
+    if (binding_registered) {
+        unregister_vpci_binding();
+        binding_registered = false;
+    }
+
     pr_loc_inf("All vPCI devices and buses removed");
 
     return -EIO; //This is hardcoded to return an error as there's a known bug (see "KNOWN BUGS" in the file header)
@@ -10,6 +10,8 @@
  *
  *  For more information see header comment in the corresponding .c file.
  */
+#define PCIBUS_VIRTUAL_DOMAIN 0x0001 //normal PC buses are (always?) on domain 0, this is just a next one
+
 #define U24_CLASS_TO_U8_CLASS(x) (((x) >> 16) & 0xFF)
 #define U24_CLASS_TO_U8_SUBCLASS(x) (((x) >> 8) & 0xFF)
 #define U24_CLASS_TO_U8_PROGIF(x) ((x) & 0xFF)
@@ -128,7 +130,23 @@ struct pci_pci_bridge_descriptor {
     u16 bridge_ctrl;
 } __packed;
 
-//This is currently not implemented
+/**
+ * Standard capabilities which can be built into the config space of a device (see vpci_add_*_with_caps())
+ *
+ * Capabilities are chained in the order: PM => MSI => PCIe. The PCIe capability also gives the device a 4K (extended)
+ * config space. MSI-X is not supported as its tables need memory behind a BAR.
+ */
+struct vpci_dev_caps {
+    bool pm:1;           //PCI Power Management with D0 & D3hot
+    bool msi:1;          //MSI with 64-bit addresses
+    bool pcie:1;         //PCI Express (v2) capability
+    u8 msi_vectors_log2; //number of MSI vectors the device can request as a power of 2 (0-5)
+    u8 pcie_type;        //see PCI_EXP_TYPE_* (e.g. PCI_EXP_TYPE_ENDPOINT)
+    u8 link_speed;       //see PCI_EXP_LNKCAP_SLS_*; the link is always trained at this speed
+    u8 link_width;       //number of lanes (1-32); the link is always trained at this width
+};
+
+//This is currently not implemented (see struct vpci_dev_caps for supported capabilities)
 struct pci_dev_capability {
     u8 cap_id; //see PCI_CAP_ID_*, set to 0x00 to denote null-capability
     u8 cap_next; //offset where next capability exists, set to 0x00 to denote null-capability
@@ -140,7 +158,9 @@ struct pci_dev_capability {
  *
  * If you don't want to create the descriptor from scratch you can use "const struct pci_dev_conf_default_normal_dev"
  * while setting some missing params (see .c file header for details).
- * Note: you CAN reuse the same descriptor under multiple BDFs (bus_no/dev_no/fn_no)
+ * Note: you CAN reuse the same descriptor under multiple BDFs (bus_no/dev_no/fn_no). It's only read while adding (every
+ * device gets its own copy of the config space, which is what config writes change), so it can be shared read-only,
+ * including between single function & multifunction devices.
  *
  * @param bus_no (0x00 - 0xFF)
  * @param dev_no (0x00 - 0x20)
@@ -148,13 +168,20 @@ struct pci_dev_capability {
  * @return virtual_device ptr or error pointer (ERR_PTR(-E))
  */
 const struct virtual_device *
-vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, struct pci_dev_descriptor *descriptor);
+vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, const struct pci_dev_descriptor *descriptor);
+
+/**
+ * Adds a single new device with capabilities (see struct vpci_dev_caps); see vpci_add_single_device() for details
+ */
+const struct virtual_device *
+vpci_add_single_device_with_caps(unsigned char bus_no, unsigned char dev_no,
+                                 const struct pci_dev_descriptor *descriptor, const struct vpci_dev_caps *caps);
 
 /**
  * See vpci_add_single_device() for details
  */
 const struct virtual_device *
-vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pci_bridge_descriptor *descriptor);
+vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, const struct pci_pci_bridge_descriptor *descriptor);
 
 
 /*
@@ -175,14 +202,31 @@ vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pc
  */
 const struct virtual_device *
 vpci_add_multifunction_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                              struct pci_dev_descriptor *descriptor);
+                              const struct pci_dev_descriptor *descriptor);
+
+/**
+ * Adds a new multifunction device with capabilities (see struct vpci_dev_caps); see vpci_add_multifunction_device()
+ */
+const struct virtual_device *
+vpci_add_multifunction_device_with_caps(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
+                                        const struct pci_dev_descriptor *descriptor, const struct vpci_dev_caps *caps);
 
 /**
  * See vpci_add_multifunction_device() for details
  */
 const struct virtual_device *
 vpci_add_multifunction_bridge(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                              struct pci_pci_bridge_descriptor *descriptor);
+                              const struct pci_pci_bridge_descriptor *descriptor);
+
+/**
+ * Removes a single device added previously; the bus stays even if it becomes empty
+ *
+ * Only the device itself is detached from the PCI core - the rest of the bus isn't touched. A multifunction device
+ * with fn_no=0 can only be removed after all its other functions (as they cannot be re-scanned if fn=0 is re-added).
+ *
+ * @return 0 on success, -ENOENT if there's no such device, -EBUSY if fn_no=0 has other functions, or other -E
+ */
+int vpci_remove_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no);
 
 /**
  * Removes all previously added devices and buses
@@ -4,8 +4,20 @@
 #include "common.h" //commonly used headers in this module
 #include "internal/intercept_execve.h" //Handling of execve() replacement
 #include "internal/scsi/scsi_notifier.h" //the missing pub/sub handler for SCSI driver
-#include "internal/ioscheduler_fixer.h" //reset_elevator() to correct elevator= boot cmdline
+#include "internal/intercept_driver_register.h" //unregister_driver_watchers()
+#include "internal/event_bus.h" //module & USB events for all shims
+#include "internal/ioscheduler_fixer.h" //reset_elevator() to correct elevator= boot cmdline, per-disk elevators
 #include "config/cmdline_delegate.h" //Parsing of kernel cmdline
+#include "internal/helper/memory_helper.h" //begin_mem_patch_session(), commit_mem_patch_session()
+#include "internal/hook_stats.h" //per-hook instrumentation in debugfs
+#include "internal/boot_trace.h" //timing trace of the init
+#include "internal/telemetry.h" //register_telemetry()
+#include "internal/uart/virtual_uart.h" //register_vuart_stats()
+#include "debug/debug_vuart_trace.h" //register_vuart_trace()
+#include "internal/helper/debug_keys.h" //register_debug_keys()
+#include "internal/helper/tunables.h" //register_tunables()
+#include "internal/housekeeping.h" //register_housekeeping(), alloc_housekeeping_wq()
+#include "internal/call_protected.h" //resolve_protected_symbols()
 #include "shim/boot_device_shim.h" //Registering & deciding between boot device shims
 #include "shim/bios_shim.h" //Shimming various mfgBIOS functions to make them happy
 #include "shim/block_fw_update_shim.h" //Prevent firmware update from running
@@ -15,6 +27,10 @@
 #include "shim/storage/sata_port_shim.h" //Handles VirtIO & SAS storage devices/disks peculiarities
 #include "shim/uart_fixer.h" //Various fixes for UART weirdness
 #include "shim/pmu_shim.h" //Emulates the platform management unit
+#include "shim/netif_mac_shim.h" //Assigns MACs from cmdline to NICs when they appear
+#include <linux/workqueue.h> //queue_work()
+#include <linux/atomic.h> //atomic_t, atomic_dec_and_test()
+#include <linux/bitops.h> //BIT(), hweight_long()
 
 //Handle versioning stuff
 #ifndef RP_VERSION_POSTFIX
@@ -38,38 +54,202 @@ void noinline __noreturn rp_crash(void) {
     panic("Fatal exception");
 }
 
+/********************************************** Deferred initialization ***********************************************/
+/*
+ * Steps which nothing critical needs during the module load (and which don't patch kernel code, so that they cannot
+ * race with each other or with the code overrides) are registered asynchronously after init_() finishes everything
+ * which is critical (config, consoles, boot device, code overrides, executables blocking & stealth). They form a small
+ * dependency graph: every step lists the steps which must be registered before it, and it runs as soon as all of them
+ * are done. Steps without dependencies on each other run in parallel. A failed step doesn't fail the module load (it's
+ * too late for that) but it's logged and all steps depending on it are skipped.
+ * Anything which must be in place before init_() returns (executables blocking, fw update blocking, the boot shim, the
+ * uart fixer...) is NOT a candidate for this graph - it stays in the synchronous chain in init_().
+ */
+#define INIT_WQ_MAX_ACTIVE 4
+
+struct deferred_init_step {
+    const char *name;
+    int (*register_fn)(void);
+    int (*unregister_fn)(void);
+    unsigned long deps; //bitmask of DEFERRED_INIT_* steps which must be registered before this one
+
+    atomic_t pending_deps;
+    int result; //-EINPROGRESS until the step is finished
+    struct work_struct work;
+};
+
+static int register_pci_shim_deferred(void) { return register_pci_shim(current_config.hw_config); }
+static int register_pmu_shim_deferred(void) { return register_pmu_shim(current_config.hw_config); }
+
+enum deferred_init_step_id {
+    DEFERRED_INIT_VUART_STATS,
+    DEFERRED_INIT_VUART_TRACE,
+#ifndef DBG_DISABLE_UNLOADABLE
+    DEFERRED_INIT_PCI,
+#endif
+    DEFERRED_INIT_PMU,
+    DEFERRED_INIT_TELEMETRY,
+};
+#define DEFERRED_INIT_STEP(id, reg, unreg, deps_mask) [id] = { #id, reg, unreg, deps_mask }
+
+//A step may only depend on steps defined before it; everything registered in init_() is always available here
+static struct deferred_init_step deferred_init_steps[] = {
+    DEFERRED_INIT_STEP(DEFERRED_INIT_VUART_STATS, register_vuart_stats, unregister_vuart_stats, 0),
+    DEFERRED_INIT_STEP(DEFERRED_INIT_VUART_TRACE, register_vuart_trace, unregister_vuart_trace, 0),
+#ifndef DBG_DISABLE_UNLOADABLE
+    DEFERRED_INIT_STEP(DEFERRED_INIT_PCI, register_pci_shim_deferred, unregister_pci_shim, 0),
+#endif
+    //Used as early as mfgBIOS loads (=late); its vUART must be added after stats & trace to be accounted from the start
+    DEFERRED_INIT_STEP(DEFERRED_INIT_PMU, register_pmu_shim_deferred, unregister_pmu_shim,
+                       BIT(DEFERRED_INIT_VUART_STATS) | BIT(DEFERRED_INIT_VUART_TRACE)),
+    //After all stats it publishes (hook stats & boot trace are registered synchronously)
+    DEFERRED_INIT_STEP(DEFERRED_INIT_TELEMETRY, register_telemetry, unregister_telemetry,
+                       BIT(DEFERRED_INIT_VUART_STATS)),
+};
+
+static struct workqueue_struct *init_wq = NULL;
+
+static void queue_deferred_init_step(struct deferred_init_step *step)
+{
+    if (likely(init_wq))
+        queue_work(init_wq, &step->work);
+    else
+        step->work.func(&step->work); //no workqueue - run in the caller context
+}
+
+static void run_deferred_init_step(struct work_struct *work)
+{
+    struct deferred_init_step *step = container_of(work, struct deferred_init_step, work);
+
+    int out = 0;
+    for (int i = 0; i < ARRAY_SIZE(deferred_init_steps); i++) {
+        if ((step->deps & BIT(i)) && deferred_init_steps[i].result != 0) {
+            pr_loc_err("Skipping %s as %s failed", step->name, deferred_init_steps[i].name);
+            out = -ECANCELED;
+            break;
+        }
+    }
+
+    if (out == 0) {
+        boot_trace_begin(step->name);
+        out = step->register_fn();
+        boot_trace_end(step->name, out);
+
+        if (out != 0)
+            pr_loc_crt("Deferred %s failed - error=%d", step->name, out);
+    }
+
+    step->result = out;
+    smp_wmb(); //dependents must see the result before they run
+
+    for (int i = 0; i < ARRAY_SIZE(deferred_init_steps); i++) {
+        if ((deferred_init_steps[i].deps & BIT(step - deferred_init_steps)) &&
+            atomic_dec_and_test(&deferred_init_steps[i].pending_deps))
+            queue_deferred_init_step(&deferred_init_steps[i]);
+    }
+}
+
+static void start_deferred_init(void)
+{
+    init_wq = alloc_housekeeping_wq("deferred_init", INIT_WQ_MAX_ACTIVE);
+    if (unlikely(!init_wq))
+        pr_loc_wrn("Failed to allocate workqueue - deferred steps will run synchronously");
+
+    for (int i = 0; i < ARRAY_SIZE(deferred_init_steps); i++) {
+        struct deferred_init_step *step = &deferred_init_steps[i];
+        BUG_ON(step->deps & ~(BIT(i) - 1)); //a step may only depend on steps before it (i.e. it's a DAG)
+
+        step->result = -EINPROGRESS;
+        atomic_set(&step->pending_deps, hweight_long(step->deps));
+        INIT_WORK(&step->work, run_deferred_init_step);
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(deferred_init_steps); i++) {
+        if (deferred_init_steps[i].deps == 0)
+            queue_deferred_init_step(&deferred_init_steps[i]);
+    }
+}
+
+#if STEALTH_MODE < STEALTH_MODE_FULL
+/**
+ * Waits for all deferred steps and unregisters the ones which were registered (in the reverse order, i.e. dependents
+ * first)
+ */
+static void stop_deferred_init(void)
+{
+    if (init_wq) {
+        destroy_workqueue(init_wq); //drains the queue, including steps queued by other steps
+        init_wq = NULL;
+    }
+
+    for (int i = ARRAY_SIZE(deferred_init_steps) - 1; i >= 0; i--) {
+        if (deferred_init_steps[i].result != 0)
+            continue;
+
+        pr_loc_dbg("Calling deferred cleanup handler %pF", deferred_init_steps[i].unregister_fn);
+        int out = deferred_init_steps[i].unregister_fn();
+        if (out != 0)
+            pr_loc_wrn("Cleanup handler %pF failed with code=%d", deferred_init_steps[i].unregister_fn, out);
+        deferred_init_steps[i].result = -ENODEV;
+    }
+}
+#endif
+
 static int __init init_(void)
 {
     int out = 0;
 
     pr_loc_dbg("================================================================================================");
     pr_loc_inf("RedPill %s loading...", RP_VERSION_STR);
+    boot_trace_begin(__func__); //The first entry is the start of the trace timeline
+
+    //This isn't fatal by itself: missing symbols are reported upfront here but only the code using them will fail
+    boot_trace_step(resolve_protected_symbols());
 
     if (
-            (out = extract_config_from_cmdline(&current_config)) != 0 //This MUST be the first entry
-         || (out = populate_runtime_config(&current_config)) != 0 //This MUST be second
-         || (out = register_uart_fixer(current_config.hw_config)) != 0 //Fix consoles ASAP
-         || (out = register_scsi_notifier()) != 0 //Load SCSI notifier so that boot shim (& others) can use it
-         || (out = register_sata_port_shim()) //This should be bfr boot shim as it can fix some things need by boot
-         || (out = register_boot_shim(&current_config.boot_media)) //Make sure we're quick with this one
-         || (out = register_execve_interceptor()) != 0 //Register this reasonably high as other modules can use it blindly
-         || (out = register_bios_shim(current_config.hw_config)) != 0
-         || (out = register_disable_executables_shim()) != 0
-         || (out = register_fw_update_shim()) != 0
-#ifndef DBG_DISABLE_UNLOADABLE
-         || (out = register_pci_shim(current_config.hw_config)) != 0 //it's a core hw but it's not checked early
-#endif
-         || (out = register_disk_smart_shim()) != 0 //provide fake SMART to userspace
-         || (out = register_pmu_shim(current_config.hw_config)) != 0 //this is used as early as mfgBIOS loads (=late)
-         || (out = initialize_stealth(&current_config)) != 0 //Should be after any shims to let shims have real stuff
-         || (out = reset_elevator()) != 0 //Cosmetic, can be the last one
+            (out = boot_trace_step(extract_config_from_cmdline(&current_config))) != 0 //This MUST be the first entry
+         || (out = boot_trace_step(populate_runtime_config(&current_config))) != 0 //This MUST be second
+         || (out = boot_trace_step(register_debug_keys())) != 0 //Before anything which may use them
+         || (out = boot_trace_step(register_tunables())) != 0
+         || (out = boot_trace_step(register_housekeeping())) != 0 //Before anything starting threads or works
+         || (out = boot_trace_step(register_hook_stats())) != 0 //This should be before any hooks are installed
+         || (out = boot_trace_step(register_boot_trace())) != 0
+         //vUART stats & trace and telemetry are deferred, see deferred_init_steps[]
+         //All overrides below will share protection changes & TLB flushes
+         || (out = boot_trace_step(begin_mem_patch_session())) != 0
+         || (out = boot_trace_step(register_uart_fixer(current_config.hw_config))) != 0 //Fix consoles ASAP
+         //Load SCSI notifier & event bus so that boot shim (& others) can use them
+         || (out = boot_trace_step(register_scsi_notifier())) != 0
+         || (out = boot_trace_step(register_event_bus())) != 0
+         //This should be bfr boot shim as it can fix some things need by boot
+         || (out = boot_trace_step(register_sata_port_shim(&current_config.ssd_cache)))
+         || (out = boot_trace_step(register_boot_shim(&current_config.boot_media))) //Make sure we're quick here
+         || (out = boot_trace_step(register_netif_mac_shim(&current_config))) != 0 //Before NIC drivers load
+         //Register this reasonably high as other modules can use it blindly
+         || (out = boot_trace_step(register_execve_interceptor())) != 0
+         || (out = boot_trace_step(register_bios_shim(current_config.hw_config))) != 0
+         || (out = boot_trace_step(register_disk_smart_shim())) != 0 //provide fake SMART to userspace
+         || (out = boot_trace_step(register_ioscheduler_policy())) != 0 //per-disk elevators, needs SCSI notifier
+         //These MUST be in place before init_() returns - nothing blocked may get a chance to run in between
+         || (out = boot_trace_step(register_disable_executables_shim())) != 0
+         || (out = boot_trace_step(register_fw_update_shim())) != 0
+         //PCI & PMU are deferred as well
+         //Should be after sync shims (deferred ones don't use it) to let shims have real stuff
+         || (out = boot_trace_step(initialize_stealth(&current_config))) != 0
+         || (out = boot_trace_step(reset_elevator())) != 0 //Cosmetic, can be the last one
+         || (out = boot_trace_step(commit_mem_patch_session())) != 0 //This MUST be after all shims
        )
         goto error_out;
 
+    start_deferred_init(); //After the patch session is committed - deferred steps don't patch anything anyway
+    boot_trace_end(__func__, 0);
+    boot_trace_dump(); //Deferred steps may still be running - see debugfs for the complete trace
     pr_loc_inf("RedPill %s loaded successfully (stealth=%d)", RP_VERSION_STR, STEALTH_MODE);
     return 0;
 
     error_out:
+        if (mem_patch_session_active())
+            commit_mem_patch_session(); //never leave anything unprotected
         pr_loc_crt("RedPill %s cannot be loaded, initializer error=%d", RP_VERSION_STR, out);
 #ifdef KP_ON_LOAD_ERROR
         rp_crash();
@@ -84,21 +264,28 @@ static void __exit cleanup_(void)
 {
     pr_loc_inf("RedPill %s unloading...", RP_VERSION_STR);
 
+    stop_deferred_init(); //These have to go first as they were registered last
+
     int (*cleanup_handlers[])(void ) = {
         uninitialize_stealth,
-        unregister_pmu_shim,
-        unregister_disk_smart_shim,
-#ifndef DBG_DISABLE_UNLOADABLE
-        unregister_pci_shim,
-#endif
         unregister_fw_update_shim,
         unregister_disable_executables_shim,
+        unregister_ioscheduler_policy,
+        unregister_disk_smart_shim,
         unregister_bios_shim,
         unregister_execve_interceptor,
+        unregister_netif_mac_shim,
         unregister_boot_shim,
         unregister_sata_port_shim,
+        unregister_event_bus,
         unregister_scsi_notifier,
-        unregister_uart_fixer
+        unregister_driver_watchers, //after all users of bus watchers
+        unregister_uart_fixer,
+        unregister_boot_trace,
+        unregister_hook_stats,
+        unregister_housekeeping,
+        unregister_tunables,
+        unregister_debug_keys
     };
 
     int out;
@@ -0,0 +1,659 @@
+/**
+ * In-kernel self-test of the shims' core machinery (built as a separate redpill_selftest.ko with "make selftest")
+ *
+ * The module runs all suites when loaded, prints a PASS/FAIL line per suite to the kernel log and refuses to load
+ * (-EINVAL) if any of them failed, so that it can be used in scripts ("insmod redpill_selftest.ko && echo OK"). It
+ * registers real vPCI devices & a vUART, so it should be loaded on a system without redpill.ko (e.g. a dev VM).
+ * Suites (all of them run by default, "suites" param is a bitmask of SELFTEST_* below):
+ *   override  rp_selftest_target(), a dummy function exported by this module, is overridden with a detour and called
+ *             from kthreads pinned to every online CPU at once. The shim calls the original with
+ *             call_overridden_symbol(). Every call must go through both (the result tells) and no call may be lost.
+ *   vuart     a vUART is added on "line" (default ttyS1) and its registers are driven with random sequences through
+ *             the same entrypoints the 8250 driver uses (serial_remote_read/write). Values which a 16550A keeps as
+ *             written (LCR, MCR, SCR, DLL/DLM, the IER bits we support) are checked against a model after every step,
+ *             as well as interrupt (IIR) consistency and loopback of THR into RHR & MCR into MSR.
+ *   vpci      stubs of every platform in config/platforms.h are created with the PCI shim, one platform at a time,
+ *             and their config space is read through the PCI core (i.e. pci_read_cfg()): IDs must match the stub type,
+ *             the multifunction bit must match the stub, narrow reads must agree with dword ones and empty slots must
+ *             not respond.
+ *   ata       ata_calc_sector_checksum() against known vectors and random sectors.
+ */
+#include "../common.h"
+#include "../internal/override/override_symbol.h" //override_symbol_detour(), call_overridden_symbol()
+#include "../internal/uart/virtual_uart.h" //vuart_add_device(), vuart_selftest_read(), vuart_selftest_write()
+#include "../internal/virtual_pci.h" //PCIBUS_VIRTUAL_DOMAIN
+#include "../internal/scsi/ata_format.h" //ata_calc_sector_checksum()
+#include "../shim/pci_shim.h" //register_pci_shim(), unregister_pci_shim()
+#include "../config/platforms.h" //supported_platforms
+#include <linux/moduleparam.h> //module_param_named()
+#include <linux/kthread.h> //kthread_create(), kthread_bind(), kthread_stop()
+#include <linux/completion.h> //struct completion, init_completion(), wait_for_completion()
+#include <linux/atomic.h> //atomic_t
+#include <linux/percpu.h> //DEFINE_PER_CPU, this_cpu_inc()
+#include <linux/cpumask.h> //for_each_online_cpu()
+#include <linux/random.h> //get_random_int()
+#include <linux/serial_reg.h> //UART_*
+#include <linux/pci.h> //pci_find_bus(), pci_bus_read_config_*()
+#include <linux/ata.h> //ATA_SECT_SIZE
+
+#define SELFTEST_OVERRIDE BIT(0)
+#define SELFTEST_VUART BIT(1)
+#define SELFTEST_VPCI BIT(2)
+#define SELFTEST_ATA BIT(3)
+
+#define SELFTEST_TARGET_NAME "rp_selftest_target"
+#define SELFTEST_MAX_THREADS 64
+#define SELFTEST_VUART_STEPS 100000
+#define SELFTEST_ATA_ROUNDS 1000
+
+static unsigned int suites = SELFTEST_OVERRIDE | SELFTEST_VUART | SELFTEST_VPCI | SELFTEST_ATA;
+module_param_named(suites, suites, uint, 0000);
+MODULE_PARM_DESC(suites, "Bitmask of suites to run (1=override, 2=vuart, 4=vpci, 8=ata)");
+
+static unsigned int iterations = 1000000;
+module_param_named(iterations, iterations, uint, 0000);
+MODULE_PARM_DESC(iterations, "Number of calls per CPU in the override suite");
+
+static int line = 1;
+module_param_named(line, line, int, 0000);
+MODULE_PARM_DESC(line, "ttyS# to replace with vUART in the vuart suite");
+
+static unsigned int seed = 0;
+module_param_named(seed, seed, uint, 0000);
+MODULE_PARM_DESC(seed, "Seed of random sequences (0 = random; the one used is printed so it can be replayed)");
+
+#define st_fail(fmt, ...) pr_loc_err("FAIL: " fmt, ##__VA_ARGS__)
+
+/**
+ * Xorshift32 - random sequences must be replayable from the seed on every kernel version (prandom_* state API isn't)
+ */
+static u32 st_rand(u32 *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void st_rand_bytes(u32 *state, u8 *buff, unsigned int len)
+{
+    for (unsigned int i = 0; i < len; i++)
+        buff[i] = st_rand(state);
+}
+
+/*************************************************** Override suite ***************************************************/
+static struct override_symbol_inst *target_ovs = NULL;
+static DEFINE_PER_CPU(unsigned long, target_hits);
+static DEFINE_PER_CPU(unsigned long, shim_hits);
+
+struct call_thread {
+    struct task_struct *task;
+    unsigned long bad_results;
+};
+
+static struct call_thread threads[SELFTEST_MAX_THREADS];
+static atomic_t threads_ready;
+static atomic_t threads_running;
+static bool threads_go;
+static DECLARE_COMPLETION(threads_done);
+
+/**
+ * The dummy function being overridden; see rp_bench_target() in bench/redpill_bench.c for why it looks like that
+ *
+ * It's aligned so that the trampoline can be swapped atomically.
+ */
+noinline __aligned(16) int rp_selftest_target(int val)
+{
+    asm volatile(".rept 16\n\tnop\n\t.endr");
+    this_cpu_inc(target_hits);
+    return val + 1;
+}
+EXPORT_SYMBOL(rp_selftest_target);
+
+static int (*volatile call_target)(int) = rp_selftest_target; //volatile so that calls cannot be inlined or elided
+
+static int rp_selftest_shim(int val)
+{
+    int out;
+    this_cpu_inc(shim_hits);
+    call_overridden_symbol(out, target_ovs, val);
+    return out + 1; //so that the caller can tell both the shim & the original were called
+}
+
+static unsigned long sum_hits(unsigned long __percpu *hits)
+{
+    unsigned long sum = 0;
+    int cpu;
+    for_each_possible_cpu(cpu)
+        sum += *per_cpu_ptr(hits, cpu);
+
+    return sum;
+}
+
+static int call_thread_fn(void *data)
+{
+    struct call_thread *thread = data;
+
+    //All threads start at once so that they really contend with each other
+    atomic_inc(&threads_ready);
+    while (!ACCESS_ONCE(threads_go))
+        cond_resched();
+
+    for (unsigned int i = 0; i < iterations; ++i) {
+        int val = (int)(i & 0xffff);
+        if (unlikely(call_target(val) != val + 2))
+            ++thread->bad_results;
+    }
+
+    if (atomic_dec_and_test(&threads_running))
+        complete(&threads_done);
+
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+    }
+
+    return 0;
+}
+
+/**
+ * Calls the overridden target from threads bound to every online CPU
+ *
+ * @return number of threads started or -E on error
+ */
+static int run_call_threads(void)
+{
+    unsigned int num = min_t(unsigned int, num_online_cpus(), SELFTEST_MAX_THREADS);
+    unsigned int started = 0;
+    int cpu, out = 0;
+
+    memset(threads, 0, sizeof(threads));
+    atomic_set(&threads_ready, 0);
+    atomic_set(&threads_running, num);
+    ACCESS_ONCE(threads_go) = false;
+    init_completion(&threads_done); //reinit_completion() doesn't exist before v3.13
+
+    for_each_online_cpu(cpu) {
+        if (started == num)
+            break;
+
+        struct call_thread *thread = &threads[started];
+        thread->task = kthread_create(call_thread_fn, thread, "rp_selftest/%d", cpu);
+        if (IS_ERR(thread->task)) {
+            out = PTR_ERR(thread->task);
+            pr_loc_err("Failed to start self-test thread on CPU%d - error=%d", cpu, out);
+            thread->task = NULL;
+            break;
+        }
+
+        kthread_bind(thread->task, cpu);
+        wake_up_process(thread->task);
+        ++started;
+    }
+
+    if (out == 0) {
+        while (atomic_read(&threads_ready) < num)
+            schedule();
+
+        ACCESS_ONCE(threads_go) = true;
+        wait_for_completion(&threads_done);
+    } else {
+        ACCESS_ONCE(threads_go) = true; //let the ones already started finish; nobody will wait for the completion
+    }
+
+    for (unsigned int i = 0; i < started; ++i)
+        kthread_stop(threads[i].task);
+
+    return out == 0 ? started : out;
+}
+
+static int selftest_override(void)
+{
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        *per_cpu_ptr(&target_hits, cpu) = 0;
+        *per_cpu_ptr(&shim_hits, cpu) = 0;
+    }
+
+    target_ovs = override_symbol_detour(SELFTEST_TARGET_NAME, rp_selftest_shim);
+    if (IS_ERR(target_ovs)) {
+        int out = PTR_ERR(target_ovs);
+        st_fail("cannot override %s() - error=%d", SELFTEST_TARGET_NAME, out);
+        target_ovs = NULL;
+        return out;
+    }
+
+    if (!__get_detour_ptr(target_ovs)) { //classic overrides are single-threaded by design (see override_symbol.c)
+        st_fail("%s() couldn't use detour", SELFTEST_TARGET_NAME);
+        restore_symbol(target_ovs);
+        target_ovs = NULL;
+        return -EINVAL;
+    }
+
+    int num = run_call_threads();
+    restore_symbol(target_ovs);
+    target_ovs = NULL;
+    if (num < 0)
+        return num;
+
+    int out = 0;
+    unsigned long bad = 0;
+    for (int i = 0; i < num; ++i)
+        bad += threads[i].bad_results;
+    if (bad) {
+        st_fail("%lu calls didn't go through the shim & the original", bad);
+        out = -EINVAL;
+    }
+
+    unsigned long expected = (unsigned long)num * iterations;
+    if (sum_hits(&shim_hits) != expected || sum_hits(&target_hits) != expected) {
+        st_fail("lost calls: expected=%lu shim=%lu original=%lu", expected, sum_hits(&shim_hits),
+                sum_hits(&target_hits));
+        out = -EINVAL;
+    }
+
+    if (call_target(1) != 2) { //restored - the original alone
+        st_fail("%s() doesn't behave like the original after restoring", SELFTEST_TARGET_NAME);
+        out = -EINVAL;
+    }
+
+    pr_loc_inf("override: %lu calls from %d CPUs", expected, num);
+    return out;
+}
+
+/***************************************************** vUART suite ****************************************************/
+/**
+ * Registers whose value a 16550A keeps exactly as written
+ */
+struct uart_model {
+    u8 lcr;
+    u8 mcr;
+    u8 scr;
+    u8 dll;
+    u8 dlm;
+    u8 ier;
+};
+
+static int vuart_reg(int offset)
+{
+    unsigned int val = 0;
+    int out = vuart_selftest_read(line, offset, &val);
+    return out == 0 ? (int)val : out;
+}
+
+static int vuart_set(int offset, int value)
+{
+    return vuart_selftest_write(line, offset, value);
+}
+
+/**
+ * Checks what the vUART reports against the model
+ *
+ * @return 0 if it matches, -EINVAL otherwise
+ */
+static int check_uart_model(const struct uart_model *m, unsigned int step)
+{
+#define check_reg(name, offset, expected) do {                                                          \
+        int _val = vuart_reg(offset);                                                                   \
+        if (_val != (expected)) {                                                                       \
+            st_fail("step %u: %s=%02x, expected %02x", step, name, _val, expected);                     \
+            return -EINVAL;                                                                             \
+        }                                                                                               \
+    } while(0)
+
+    check_reg("LCR", UART_LCR, m->lcr);
+    check_reg("MCR", UART_MCR, m->mcr);
+    check_reg("SCR", UART_SCR, m->scr);
+    if (m->lcr & UART_LCR_DLAB) {
+        check_reg("DLL", UART_DLL, m->dll);
+        check_reg("DLM", UART_DLM, m->dlm);
+        return 0;
+    }
+
+    check_reg("IER", UART_IER, m->ier);
+
+    int iir = vuart_reg(UART_IIR);
+    if (!m->ier && !(iir & UART_IIR_NO_INT)) {
+        st_fail("step %u: IIR=%02x reports an interrupt with all of them disabled", step, iir);
+        return -EINVAL;
+    }
+
+    if (m->mcr & UART_MCR_LOOP) { //MSR reflects MCR in loopback (see Table 3-13 in the TI doc)
+        int msr = vuart_reg(UART_MSR);
+        if (!!(msr & UART_MSR_CTS) != !!(m->mcr & UART_MCR_RTS) ||
+            !!(msr & UART_MSR_DSR) != !!(m->mcr & UART_MCR_DTR) ||
+            !!(msr & UART_MSR_RI) != !!(m->mcr & UART_MCR_OUT1) ||
+            !!(msr & UART_MSR_DCD) != !!(m->mcr & UART_MCR_OUT2)) {
+            st_fail("step %u: MSR=%02x doesn't reflect MCR=%02x in loopback", step, msr, m->mcr);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+#undef check_reg
+}
+
+/**
+ * Sends a byte in loopback mode - it must come back through RHR
+ */
+static int check_uart_loopback(struct uart_model *m, u8 val, unsigned int step)
+{
+    m->lcr &= ~UART_LCR_DLAB;
+    m->mcr |= UART_MCR_LOOP;
+    vuart_set(UART_LCR, m->lcr);
+    vuart_set(UART_MCR, m->mcr);
+    vuart_set(UART_FCR, UART_FCR_ENABLE_FIFO | UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
+    vuart_set(UART_TX, val);
+
+    int lsr = vuart_reg(UART_LSR);
+    int rx = vuart_reg(UART_RX);
+    if (!(lsr & UART_LSR_DR) || rx != val) {
+        st_fail("step %u: loopback of %02x gave LSR=%02x RHR=%02x", step, val, lsr, rx);
+        return -EINVAL;
+    }
+
+    if ((lsr = vuart_reg(UART_LSR)) & UART_LSR_DR) {
+        st_fail("step %u: LSR=%02x still reports data after RHR was read", step, lsr);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int run_uart_fuzz(u32 *rnd)
+{
+    struct uart_model m = { 0 };
+    int out;
+
+    //The 8250 driver left the registers in some state while registering the port - start from a known one
+    vuart_set(UART_LCR, UART_LCR_DLAB);
+    vuart_set(UART_DLL, 0);
+    vuart_set(UART_DLM, 0);
+    vuart_set(UART_LCR, 0);
+    vuart_set(UART_IER, 0);
+    vuart_set(UART_MCR, 0);
+    vuart_set(UART_SCR, 0);
+    if ((out = check_uart_model(&m, 0)) != 0)
+        return out;
+
+    for (unsigned int step = 1; step <= SELFTEST_VUART_STEPS; ++step) {
+        u32 rnd_val = st_rand(rnd);
+        u8 val = rnd_val >> 8;
+
+        switch (rnd_val % 8) {
+            case 0:
+                vuart_set(UART_LCR, val);
+                m.lcr = val;
+                break;
+            case 1:
+                vuart_set(UART_MCR, val);
+                m.mcr = val;
+                break;
+            case 2:
+                vuart_set(UART_SCR, val);
+                m.scr = val;
+                break;
+            case 3: //DLL or THR
+                if (m.lcr & UART_LCR_DLAB)
+                    m.dll = val;
+                vuart_set(UART_TX, val);
+                break;
+            case 4: //DLM or IER
+                if (m.lcr & UART_LCR_DLAB)
+                    m.dlm = val;
+                else
+                    m.ier = val & 0x0f; //no DMA & sleep modes
+                vuart_set(UART_IER, val);
+                break;
+            case 5:
+                vuart_set(UART_FCR, val);
+                break;
+            case 6: //reads with side effects (RHR, LSR, IIR)
+                vuart_reg(UART_RX);
+                vuart_reg(UART_LSR);
+                vuart_reg(UART_IIR);
+                break;
+            case 7:
+                out = check_uart_loopback(&m, val, step);
+                break;
+        }
+
+        if (out != 0 || (out = check_uart_model(&m, step)) != 0)
+            return out;
+    }
+
+    return 0;
+}
+
+static int selftest_vuart(u32 *rnd)
+{
+    int out = vuart_add_device(line);
+    if (out != 0) {
+        st_fail("cannot add vUART on ttyS%d - error=%d", line, out);
+        return out;
+    }
+
+    if ((out = vuart_reg(UART_SCR)) < 0) {
+        st_fail("cannot access registers of ttyS%d - error=%d", line, out);
+    } else {
+        out = run_uart_fuzz(rnd);
+        if (out == 0)
+            pr_loc_inf("vuart: %u steps on ttyS%d", SELFTEST_VUART_STEPS, line);
+    }
+
+    //Leave it as the 8250 driver expects it (8N1, no interrupts, no loopback) before giving it back
+    vuart_set(UART_LCR, UART_LCR_WLEN8);
+    vuart_set(UART_IER, 0);
+    vuart_set(UART_MCR, 0);
+    vuart_remove_device(line);
+
+    return out;
+}
+
+/***************************************************** vPCI suite *****************************************************/
+static const struct {
+    u16 vendor;
+    u16 device;
+} stub_ids[] = {
+    [VPD_MARVELL_88SE9235] = { 0x1b4b, 0x9235 },
+    [VPD_MARVELL_88SE9215] = { 0x1b4b, 0x9215 },
+    [VPD_INTEL_I211] = { 0x8086, 0x1539 },
+    [VPD_INTEL_CPU_AHCI_CTRL] = { 0x8086, 0x5ae3 },
+    [VPD_INTEL_CPU_PCIE_PA] = { 0x8086, 0x5ad8 },
+    [VPD_INTEL_CPU_PCIE_PB] = { 0x8086, 0x5ad6 },
+    [VPD_INTEL_CPU_USB_XHCI] = { 0x8086, 0x5aa8 },
+    [VPD_INTEL_CPU_I2C] = { 0x8086, 0x5aac },
+    [VPD_INTEL_CPU_HSUART] = { 0x8086, 0x5abc },
+    [VPD_INTEL_CPU_SPI] = { 0x8086, 0x5ac6 },
+    [VPD_INTEL_CPU_SMBUS] = { 0x8086, 0x5ad4 },
+};
+
+static bool is_stub_slot(const struct hw_config *hw, u8 bus, u8 dev)
+{
+    for (int i = 0; i < MAX_VPCI_DEVS && hw->pci_stubs[i].type != __VPD_TERMINATOR__; i++) {
+        if (hw->pci_stubs[i].bus == bus && hw->pci_stubs[i].dev == dev)
+            return true;
+    }
+
+    return false;
+}
+
+static int __init check_pci_stub(const struct hw_config *hw, const struct vpci_device_stub *stub)
+{
+    struct pci_bus *bus = pci_find_bus(PCIBUS_VIRTUAL_DOMAIN, stub->bus);
+    if (!bus) {
+        st_fail("%s: bus %02x doesn't exist", hw->name, stub->bus);
+        return -ENODEV;
+    }
+
+    unsigned int devfn = PCI_DEVFN(stub->dev, stub->fn);
+    u32 id;
+    int out = pci_bus_read_config_dword(bus, devfn, PCI_VENDOR_ID, &id);
+    if (out != PCIBIOS_SUCCESSFUL || (id & 0xffff) != stub_ids[stub->type].vendor ||
+        (id >> 16) != stub_ids[stub->type].device) {
+        st_fail("%s: %02x:%02x.%x has ID %08x (result=%d), expected %04x:%04x", hw->name, stub->bus, stub->dev,
+                stub->fn, id, out, stub_ids[stub->type].vendor, stub_ids[stub->type].device);
+        return -EINVAL;
+    }
+
+    u8 hdr;
+    pci_bus_read_config_byte(bus, devfn, PCI_HEADER_TYPE, &hdr);
+    if (!!(hdr & 0x80) != stub->multifunction) {
+        st_fail("%s: %02x:%02x.%x has header type %02x, multifunction=%d", hw->name, stub->bus, stub->dev,
+                stub->fn, hdr, stub->multifunction);
+        return -EINVAL;
+    }
+
+    //Narrow reads must return the same bytes as the dword ones (the whole standard header)
+    for (int where = 0; where < 64; where += 4) {
+        u32 dword;
+        u16 words[2];
+        u8 bytes[4];
+        pci_bus_read_config_dword(bus, devfn, where, &dword);
+        for (int i = 0; i < 2; i++)
+            pci_bus_read_config_word(bus, devfn, where + i * 2, &words[i]);
+        for (int i = 0; i < 4; i++)
+            pci_bus_read_config_byte(bus, devfn, where + i, &bytes[i]);
+
+        if (words[0] != (dword & 0xffff) || words[1] != (dword >> 16) ||
+            bytes[0] != (dword & 0xff) || bytes[1] != ((dword >> 8) & 0xff) ||
+            bytes[2] != ((dword >> 16) & 0xff) || bytes[3] != (dword >> 24)) {
+            st_fail("%s: %02x:%02x.%x reads at 0x%02x disagree: %08x vs %04x%04x vs %02x%02x%02x%02x", hw->name,
+                    stub->bus, stub->dev, stub->fn, where, dword, words[1], words[0], bytes[3], bytes[2], bytes[1],
+                    bytes[0]);
+            return -EINVAL;
+        }
+    }
+
+    //Any slot on the same bus which isn't a stub mustn't respond
+    for (u8 dev = 0; dev < 32; dev++) {
+        if (is_stub_slot(hw, stub->bus, dev))
+            continue;
+
+        if (pci_bus_read_config_dword(bus, PCI_DEVFN(dev, 0), PCI_VENDOR_ID, &id) == PCIBIOS_SUCCESSFUL) {
+            st_fail("%s: empty slot %02x:%02x.0 responded with %08x", hw->name, stub->bus, dev, id);
+            return -EINVAL;
+        }
+        break; //one is enough
+    }
+
+    return 0;
+}
+
+static int __init selftest_vpci(void)
+{
+    int out = 0;
+    unsigned int checked = 0;
+
+    //They're checked one platform at a time as stubs of all of them don't fit MAX_VPCI_DEVS. Their BDFs don't overlap,
+    // so the known re-adding bug of vpci_remove_all_devices_and_buses() isn't hit.
+    for (int p = 0; p < ARRAY_SIZE(supported_platforms) && out == 0; p++) {
+        const struct hw_config *hw = &supported_platforms[p];
+        if ((out = register_pci_shim(hw)) != 0) {
+            st_fail("%s: cannot create stubs - error=%d", hw->name, out);
+        } else {
+            for (int i = 0; i < MAX_VPCI_DEVS && hw->pci_stubs[i].type != __VPD_TERMINATOR__ && out == 0; i++) {
+                out = check_pci_stub(hw, &hw->pci_stubs[i]);
+                ++checked;
+            }
+        }
+
+        unregister_pci_shim(); //it always returns -EIO (see there)
+    }
+
+    if (out == 0)
+        pr_loc_inf("vpci: %u stubs of %zu platforms", checked, ARRAY_SIZE(supported_platforms));
+
+    return out;
+}
+
+/****************************************************** ATA suite *****************************************************/
+static u8 sum_bytes(const u8 *buff, unsigned int len)
+{
+    u8 sum = 0;
+    for (unsigned int i = 0; i < len; i++)
+        sum += buff[i];
+
+    return sum;
+}
+
+static int selftest_ata(u32 *rnd)
+{
+    static u8 sector[ATA_SECT_SIZE];
+
+    //Known vectors: an empty sector & a single byte
+    memset(sector, 0, sizeof(sector));
+    ata_calc_sector_checksum(sector);
+    if (sector[ATA_SECT_SIZE - 1] != 0x00) {
+        st_fail("checksum of an empty sector is %02x", sector[ATA_SECT_SIZE - 1]);
+        return -EINVAL;
+    }
+
+    memset(sector, 0, sizeof(sector));
+    sector[0] = 0x01;
+    ata_calc_sector_checksum(sector);
+    if (sector[ATA_SECT_SIZE - 1] != 0xff) {
+        st_fail("checksum of 01 00.. is %02x, expected ff", sector[ATA_SECT_SIZE - 1]);
+        return -EINVAL;
+    }
+
+    //Random sectors: the sum of all bytes (including the checksum) must be 0 - the checksum byte is zeroed before, as
+    // every caller does (it's added to the sum)
+    for (unsigned int round = 0; round < SELFTEST_ATA_ROUNDS; round++) {
+        st_rand_bytes(rnd, sector, sizeof(sector));
+        sector[ATA_SECT_SIZE - 1] = 0;
+        ata_calc_sector_checksum(sector);
+        if (sum_bytes(sector, ATA_SECT_SIZE) != 0) {
+            st_fail("round %u: sector checksum %02x doesn't zero the sum", round, sector[ATA_SECT_SIZE - 1]);
+            return -EINVAL;
+        }
+    }
+
+    pr_loc_inf("ata: %u random sectors", SELFTEST_ATA_ROUNDS);
+    return 0;
+}
+
+/******************************************************** Runner ******************************************************/
+static int __init init_(void)
+{
+    unsigned int failed = 0, run = 0;
+
+    if (!seed)
+        seed = get_random_int() ?: 1; //xorshift never leaves 0
+    u32 rnd = seed;
+    pr_loc_inf("Running self-test suites %#x (seed=%u)", suites, seed);
+
+#define run_suite(bit, name, call) do {                                                                 \
+        if (suites & (bit)) {                                                                           \
+            int _out = (call);                                                                          \
+            ++run;                                                                                      \
+            if (_out != 0) ++failed;                                                                    \
+            pr_loc_inf("%-8s %s", name, _out == 0 ? "PASS" : "FAIL");                                   \
+        }                                                                                               \
+    } while(0)
+
+    run_suite(SELFTEST_OVERRIDE, "override", selftest_override());
+    run_suite(SELFTEST_VUART, "vuart", selftest_vuart(&rnd));
+    run_suite(SELFTEST_VPCI, "vpci", selftest_vpci());
+    run_suite(SELFTEST_ATA, "ata", selftest_ata(&rnd));
+#undef run_suite
+
+    if (failed) {
+        pr_loc_err("Self-test: %u of %u suites FAILED (seed=%u)", failed, run, seed);
+        return -EINVAL;
+    }
+
+    pr_loc_inf("Self-test: all %u suites passed - you can unload the module now", run);
+    return 0;
+}
+module_init(init_);
+
+static void __exit cleanup_(void)
+{
+}
+module_exit(cleanup_);
+
+MODULE_AUTHOR("TTG");
+MODULE_LICENSE("GPL");
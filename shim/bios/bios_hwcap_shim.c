@@ -1,5 +1,11 @@
 /**
  * Overrides GetHwCapability to provide additional capabilities for older platforms (e.g. 3615xs)
+ *
+ * Capabilities are resolved into a bitmap, so that the (frequent) queries are just a bit test. The ones derived from
+ * the platform config are resolved when the shim is registered. The ones proxied to the original GetHwCapability are
+ * resolved on their first query: the shim is registered before the mfgBIOS init runs, so the original may not know the
+ * answer yet. Every capability costs at most one call of the original (which means text patching, see
+ * call_overridden_symbol()); a capability is queried again only if the original failed to answer.
  */
 #include "bios_hwcap_shim.h"
 #include "../../common.h"
@@ -7,12 +13,20 @@
 #include "../../internal/override/override_symbol.h" //overriding GetHWCapability
 #include "../../config/platform_types.h" //hw_config, platform_has_hwmon_*
 #include <linux/synobios.h> //CAPABILITY_*, CAPABILITY
+#include <linux/bitmap.h> //DECLARE_BITMAP, bitmap_zero()
+#include <linux/bitops.h> //test_bit(), set_bit(), clear_bit()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_*()
 
 #define SHIM_NAME "mfgBIOS HW Capability"
+#define HWCAP_IDS_MAX 64 //all ids we know of are way below that
 
 static const struct hw_config *hw_config = NULL;
 static override_symbol_inst *GetHwCapability_ovs = NULL;
 
+static DECLARE_BITMAP(hwcap_resolved, HWCAP_IDS_MAX); //set after a given id is resolved in hwcap_support
+static DECLARE_BITMAP(hwcap_support, HWCAP_IDS_MAX);
+static DEFINE_MUTEX(hwcap_proxy_lock); //serializes calls of the original, which temporarily un-patch it
+
 static void dbg_compare_cap_value(SYNO_HW_CAPABILITY id, int computed_support)
 {
 #ifdef DBG_HWCAP
@@ -26,6 +40,63 @@ static void dbg_compare_cap_value(SYNO_HW_CAPABILITY id, int computed_support)
 #endif
 }
 
+/**
+ * Saves capability in the bitmap; the support bit must be visible before the resolved one (see GetHwCapability_shim())
+ */
+static void set_hwcap(SYNO_HW_CAPABILITY id, bool support)
+{
+    if (support)
+        set_bit(id, hwcap_support);
+    else
+        clear_bit(id, hwcap_support);
+
+    smp_wmb();
+    set_bit(id, hwcap_resolved);
+}
+
+/**
+ * Resolves capabilities which can be derived from the platform config
+ */
+static void resolve_computed_hwcaps(void)
+{
+    BUILD_BUG_ON(CAPABILITY_THERMAL >= HWCAP_IDS_MAX || CAPABILITY_CPU_TEMP >= HWCAP_IDS_MAX ||
+                 CAPABILITY_FAN_RPM_RPT >= HWCAP_IDS_MAX);
+
+    set_hwcap(CAPABILITY_THERMAL, platform_has_hwmon_thermal(hw_config));
+    set_hwcap(CAPABILITY_CPU_TEMP, hw_config->has_cpu_temp);
+    set_hwcap(CAPABILITY_FAN_RPM_RPT, platform_has_hwmon_fan_rpm(hw_config));
+}
+
+/**
+ * Resolves a capability which we don't know by asking the original GetHwCapability
+ *
+ * @return 0 on success, -E on error (the capability stays unresolved then)
+ */
+static int resolve_proxied_hwcap(CAPABILITY *cap)
+{
+    if (unlikely(!GetHwCapability_ovs)) {
+        pr_loc_bug("%s() was called with proxy need when no OVS was available", __FUNCTION__);
+        return -EIO;
+    }
+
+    mutex_lock(&hwcap_proxy_lock);
+    if (test_bit(cap->id, hwcap_resolved)) { //someone else resolved it in the meantime
+        cap->support = test_bit(cap->id, hwcap_support) ? 1 : 0;
+        mutex_unlock(&hwcap_proxy_lock);
+        return 0;
+    }
+
+    int org_fout = -1;
+    int ovs_fout = call_overridden_symbol(org_fout, GetHwCapability_ovs, cap);
+    pr_loc_dbg("proxying GetHwCapability(id=%d)->support => real=%d [org_fout=%d, ovs_fout=%d]", cap->id,
+               cap->support, org_fout, ovs_fout);
+    if (likely(ovs_fout == 0 && org_fout == 0))
+        set_hwcap(cap->id, cap->support);
+    mutex_unlock(&hwcap_proxy_lock);
+
+    return ovs_fout != 0 ? ovs_fout : org_fout;
+}
+
 static int GetHwCapability_shim(CAPABILITY *cap)
 {
     if (unlikely(!cap)) {
@@ -33,40 +104,24 @@ static int GetHwCapability_shim(CAPABILITY *cap)
         return -EINVAL;
     }
 
-    switch (cap->id) {
-        case CAPABILITY_THERMAL:
-            cap->support = platform_has_hwmon_thermal(hw_config) ? 1 : 0;
-            dbg_compare_cap_value(cap->id, cap->support);
-            return 0;
-
-        case CAPABILITY_CPU_TEMP:
-            cap->support = hw_config->has_cpu_temp;
-            dbg_compare_cap_value(cap->id, cap->support);
-            return 0;
-
-        case CAPABILITY_FAN_RPM_RPT:
-            cap->support = platform_has_hwmon_fan_rpm(hw_config) ? 1 : 0;
-            dbg_compare_cap_value(cap->id, cap->support);
-            return 0;
+    if (likely(cap->id >= 0 && cap->id < HWCAP_IDS_MAX) && likely(test_bit(cap->id, hwcap_resolved))) {
+        smp_rmb(); //pairs with smp_wmb() in set_hwcap()
+        cap->support = test_bit(cap->id, hwcap_support) ? 1 : 0;
+        dbg_compare_cap_value(cap->id, cap->support); //noop unless DBG_HWCAP
+        return 0;
+    }
 
+    switch (cap->id) {
         case CAPABILITY_DISK_LED_CTRL:
         case CAPABILITY_AUTO_POWERON:
         case CAPABILITY_S_LED_BREATH:
         case CAPABILITY_MICROP_PWM:
         case CAPABILITY_CARDREADER:
-        case CAPABILITY_LCM: {
-            if (unlikely(!GetHwCapability_ovs)) {
-                pr_loc_bug("%s() was called with proxy need when no OVS was available", __FUNCTION__);
-                return -EIO;
-            }
-
-            int org_fout = -1;
-            int ovs_fout = call_overridden_symbol(org_fout, GetHwCapability_ovs, cap);
-            pr_loc_dbg("proxying GetHwCapability(id=%d)->support => real=%d [org_fout=%d, ovs_fout=%d]", cap->id,
-                       cap->support, org_fout, ovs_fout);
-
-            return org_fout;
-        }
+        case CAPABILITY_LCM:
+            BUILD_BUG_ON(CAPABILITY_DISK_LED_CTRL >= HWCAP_IDS_MAX || CAPABILITY_AUTO_POWERON >= HWCAP_IDS_MAX ||
+                         CAPABILITY_S_LED_BREATH >= HWCAP_IDS_MAX || CAPABILITY_MICROP_PWM >= HWCAP_IDS_MAX ||
+                         CAPABILITY_CARDREADER >= HWCAP_IDS_MAX || CAPABILITY_LCM >= HWCAP_IDS_MAX);
+            return resolve_proxied_hwcap(cap);
 
         default:
             pr_loc_err("unknown GetHwCapability(id=%d) => out=-EINVAL", cap->id);
@@ -82,6 +137,8 @@ int register_bios_hwcap_shim(const struct hw_config *hw)
         shim_reg_already();
 
     hw_config = hw;
+    bitmap_zero(hwcap_resolved, HWCAP_IDS_MAX);
+    resolve_computed_hwcaps(); //before the override, so that no query can miss them
     override_symbol_or_exit_int(GetHwCapability_ovs, "GetHwCapability", GetHwCapability_shim);
 
     shim_reg_ok();
@@ -101,6 +158,7 @@ int unregister_bios_hwcap_shim(void)
         return out;
     }
     GetHwCapability_ovs = NULL;
+    bitmap_zero(hwcap_resolved, HWCAP_IDS_MAX);
 
     shim_ureg_ok();
     return 0;
@@ -111,6 +169,7 @@ int reset_bios_hwcap_shim(void)
     shim_reset_in();
     put_overridden_symbol(GetHwCapability_ovs);
     GetHwCapability_ovs = NULL;
+    bitmap_zero(hwcap_resolved, HWCAP_IDS_MAX); //a new mfgBIOS may answer differently
 
     shim_reset_ok();
     return 0;
@@ -2,21 +2,42 @@
  * Responds to all HWMON ("hardware monitor") calls coming to the mfgBIOS
  *
  * This submodule emulates both legitimate HWMON calls as well as "legacy" hardware monitoring calls get_fan_status()
+ * Thermal, voltage & fan readings come from real sensors when they're mapped (see hwmon_sensors.h) and are emulated
+ * otherwise.
+ *
+ * The same readings are also exposed via a standard hwmon class device (/sys/class/hwmon/hwmonN with name of
+ * HWMON_CLASS_NAME), so that monitoring agents can read them using the usual temp*_, in*_ & fan*_ input/label
+ * attributes instead of going through mfgBIOS. PSU status & current sensors have no values to expose, as their mfgBIOS
+ * calls aren't implemented. The device is not registered in STEALTH_MODE_NORMAL or above.
  */
 #include "bios_hwmon_shim.h"
 #include "../shim_base.h" //shim_reg_in(), shim_reg_ok(), shim_reset_in(), shim_reset_ok()
 #include "bios_shims_collection.h" //_shim_bios_module_entry()
 #include "../../common.h"
 #include "../../internal/helper/math_helper.h" //prandom_int_range_stable
+#include "../../internal/helper/debug_keys.h" //pr_loc_dbg_on()
 #include "mfgbios_types.h" //HWMON_*
 #include "../../config/platform_types.h" //HWMON_*_ID
+#include "hwmon_sensors.h" //start_hwmon_sensors(), stop_hwmon_sensors(), get_hwmon_sensor(), get_cpu_temps()
+#include "fan_control.h" //start_fan_control(), stop_fan_control()
+#include <linux/cpumask.h> //num_online_cpus()
 
 #define SHIM_NAME "mfgBIOS HW Monitor"
-#ifdef DBG_HWMON
-#define hwmon_pr_loc_dbg(...) pr_loc_dbg(__VA_ARGS__)
+
+//Readings are exposed via hwmon class only when it's available and we don't have to hide (it's visible in sysfs)
+#if IS_ENABLED(CONFIG_HWMON) && STEALTH_MODE < STEALTH_MODE_NORMAL
+#define HWMON_CLASS_EXPORT 1
+#include <linux/hwmon.h> //hwmon_device_register*(), hwmon_device_unregister()
+#include <linux/hwmon-sysfs.h> //SENSOR_DEVICE_ATTR_2
+#include <linux/device.h> //DEVICE_ATTR
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION()
+#ifndef HWMON_CLASS_NAME
+#define HWMON_CLASS_NAME "synobios" //must be a valid hwmon name (no "-", spaces etc.)
+#endif
 #else
-#define hwmon_pr_loc_dbg(...) //noop
+#define HWMON_CLASS_EXPORT 0
 #endif
+#define hwmon_pr_loc_dbg(...) pr_loc_dbg_on(HWMON, __VA_ARGS__) //see internal/helper/debug_keys.h
 
 /************************************* Standards for generating fake sensor readings **********************************/
 //Standard deviations for ongoing sensor readings
@@ -113,26 +134,144 @@ static const __used char *hwmon_current_id_map[] = {
 
 /************************************************ Various small tools *************************************************/
 static const struct hw_config_hwmon *hwmon_cfg = NULL;
-#define guard_hwmon_cfg() \
-    if (unlikely(!hwmon_cfg)) { \
-        pr_loc_bug("Called %s without hwmon_cfg context being populated", __FUNCTION__); \
+
+/**
+ * All the state needed by hwmon calls, allocated at once when the shim is registered
+ *
+ * Every sensor family has a prebuilt reading template with the type & sensor names and the number of sensors, so that
+ * calls only need to copy it and fill in the values. Last values (used for temporally stable fake readings) follow the
+ * structure, sized from the platform config.
+ */
+struct hwmon_state_arena {
+    SYNO_HWMON_SENSOR_TYPE thermal_tpl;
+    SYNO_HWMON_SENSOR_TYPE voltage_tpl;
+    SYNO_HWMON_SENSOR_TYPE fan_rpm_tpl;
+    SYNO_HWMON_SENSOR_TYPE hdd_bp_tpl;
+    int *thermals; //all point into values[]
+    int *voltages;
+    int *fans_rpm;
+    int values[];
+};
+static struct hwmon_state_arena *hwmon_arena = NULL;
+
+#define guard_hwmon_arena() \
+    if (unlikely(!hwmon_arena)) { \
+        pr_loc_bug("Called %s without hwmon state being allocated", __FUNCTION__); \
         return -EIO; \
     }
 
-#define guarded_strscpy(dest, src, count)                     \
-    if (unlikely(strscpy(dest, src, count) == -E2BIG)) {      \
-        pr_loc_err("Failed to copy %lu bytes string", count); \
-        return -EFAULT;                                       \
+//Number of sensors configured in one of the hw_config_hwmon arrays (they end on the first NULL_ID which is always 0)
+#define count_hwmon_ids(ids) ({                                                                \
+        unsigned int __num = 0;                                                                \
+        while (__num < ARRAY_SIZE(ids) && (ids)[__num] != 0)                                   \
+            ++__num;                                                                           \
+        __num;                                                                                 \
+    })
+
+//Fills reading template with the type & names of sensors configured in one of the hw_config_hwmon arrays
+#define build_hwmon_tpl(tpl, type, ids, names) ({                                              \
+        int __out = strscpy((tpl)->type_name, type, sizeof((tpl)->type_name));                 \
+        (tpl)->sensor_num = count_hwmon_ids(ids);                                              \
+        for (int __i = 0; __out >= 0 && __i < (tpl)->sensor_num; ++__i)                        \
+            __out = strscpy((tpl)->sensor[__i].sensor_name, (names)[(ids)[__i]],               \
+                            sizeof((tpl)->sensor[__i].sensor_name));                           \
+        __out < 0 ? __out : 0;                                                                 \
+    })
+
+/**
+ * Allocates & prebuilds hwmon state for the current platform (noop if it's already allocated)
+ *
+ * @return 0 on success, -E on error
+ */
+static int alloc_hwmon_arena(const struct hw_config_hwmon *hwc)
+{
+    if (hwmon_arena)
+        return 0; //the mfgBIOS may be shimmed multiple times
+
+    unsigned int thermals_num = count_hwmon_ids(hwc->sys_thermal);
+    unsigned int voltages_num = count_hwmon_ids(hwc->sys_voltage);
+    unsigned int fans_num = count_hwmon_ids(hwc->sys_fan_speed_rpm);
+    size_t size = sizeof(struct hwmon_state_arena) + sizeof(int) * (thermals_num + voltages_num + fans_num);
+
+    struct hwmon_state_arena *arena;
+    kzalloc_or_exit_int(arena, size);
+    arena->thermals = arena->values;
+    arena->voltages = arena->thermals + thermals_num;
+    arena->fans_rpm = arena->voltages + voltages_num;
+
+    int out;
+    if ((out = build_hwmon_tpl(&arena->thermal_tpl, HWMON_SYS_THERMAL_NAME, hwc->sys_thermal,
+                               hwmon_sys_thermal_zone_id_map)) != 0 ||
+        (out = build_hwmon_tpl(&arena->voltage_tpl, HWMON_SYS_VOLTAGE_NAME, hwc->sys_voltage,
+                               hwmon_sys_vsens_id_map)) != 0 ||
+        (out = build_hwmon_tpl(&arena->fan_rpm_tpl, HWMON_SYS_FAN_RPM_NAME, hwc->sys_fan_speed_rpm,
+                               hwmon_sys_fan_id_map)) != 0 ||
+        (out = build_hwmon_tpl(&arena->hdd_bp_tpl, HWMON_HDD_BP_STATUS_NAME, hwc->hdd_backplane,
+                               hwmon_hdd_bp_id_map)) != 0) {
+        pr_loc_err("Failed to build hwmon reading templates - error=%d", out);
+        kfree(arena);
+        return out;
+    }
+
+    hwmon_arena = arena;
+    pr_loc_dbg("Allocated %zu bytes of hwmon state", size);
+    return 0;
+}
+
+/**
+ * Takes a reading of a single sensor: the real one if it's mapped & available, a temporally stable fake one otherwise
+ *
+ * The reading is also saved in the hwmon state, so that mfgBIOS calls & the hwmon class device see the same values.
+ *
+ * @param kind type of the sensor
+ * @param idx position of the sensor in the platform definition (must be below sensor_num of its template)
+ *
+ * @return reading in mfgBIOS units (°C for temperatures, mV for voltages, RPM for fans)
+ */
+static int read_hwmon_sensor(enum hwmon_sensor_kind kind, unsigned int idx)
+{
+    int *val;
+    switch (kind) {
+        case HWMON_SENSOR_THERMAL:
+            val = &hwmon_arena->thermals[idx];
+            if (get_hwmon_sensor(kind, idx, val) != 0)
+                *val = prandom_int_range_stable(val, TEMP_DEV, FAKE_SURFACE_TEMP_MIN, FAKE_SURFACE_TEMP_MAX);
+            break;
+        case HWMON_SENSOR_VOLTAGE:
+            val = &hwmon_arena->voltages[idx];
+            if (get_hwmon_sensor(kind, idx, val) != 0)
+                *val = prandom_int_range_stable(val, VOLT_DEV, fake_volt_min(hwmon_cfg->sys_voltage[idx]),
+                                                fake_volt_max(hwmon_cfg->sys_voltage[idx]));
+            break;
+        case HWMON_SENSOR_FAN:
+            val = &hwmon_arena->fans_rpm[idx];
+            if (get_hwmon_sensor(kind, idx, val) != 0)
+                *val = prandom_int_range_stable(val, FAN_SPEED_DEV, FAKE_RPM_MIN, FAKE_RPM_MAX);
+            break;
+        default:
+            pr_loc_bug("Unknown hwmon sensor kind %d", kind);
+            return 0;
     }
 
+    return *val;
+}
+
 /******************************************* mfgBIOS LKM replacement functions ****************************************/
 /**
  * Provides fan status
- * 
- * Currently the fan is always assumed to be running
+ *
+ * When the fan has a real RPM sensor (see hwmon_sensors.h) the fan is reported as stopped when it doesn't spin.
+ * Otherwise the fan is always assumed to be running.
  */
 static int bios_get_fan_state(int no, enum MfgCompatFanStatus *status)
 {
+    int rpm;
+    if (no >= 0 && get_hwmon_sensor(HWMON_SENSOR_FAN, no, &rpm) == 0) {
+        *status = rpm > 0 ? MFGC_FAN_RUNNING : MFGC_FAN_STOPPED;
+        hwmon_pr_loc_dbg("mfgBIOS: GET_FAN_STATE(%d) => %d (%d RPM)", no, *status, rpm);
+        return 0;
+    }
+
     hwmon_pr_loc_dbg("mfgBIOS: GET_FAN_STATE(%d) => MFGC_FAN_RUNNING", no);
     *status = MFGC_FAN_RUNNING;
     return 0;
@@ -142,14 +281,22 @@ static int cur_cpu_temp = 0;
 /**
  * Returns CPU temperature across all cores
  *
- * Currently it always returns a fake value. However, it should only do so if running under hypervisor. In bare-metal
- * scenario we can simply proxy to syno_cpu_temperature() [or not override that part at all].
+ * On bare metal it reads the real temperature of every online core (see get_cpu_temps()), otherwise it returns the
+ * same fake value for all of them.
  */
 static int bios_get_cpu_temp(SYNOCPUTEMP *temp)
 {
+    int num = get_cpu_temps(temp->cpu_temp, MAX_CPU);
+    if (num > 0) {
+        temp->cpu_num = num;
+        hwmon_pr_loc_dbg("mfgBIOS: GET_CPU_TEMP(surf=%d, cpuNum=%d) => %d°C (CPU0)", temp->blSurface, temp->cpu_num,
+                         temp->cpu_temp[0]);
+        return 0;
+    }
+
     int fake_temp = prandom_int_range_stable(&cur_cpu_temp, TEMP_DEV, FAKE_CPU_TEMP_MIN, FAKE_CPU_TEMP_MAX);
-    temp->cpu_num = MAX_CPU;
-    for(int i=0; i < MAX_CPU; ++i)
+    temp->cpu_num = min_t(int, num_online_cpus(), MAX_CPU);
+    for(int i=0; i < temp->cpu_num; ++i)
         temp->cpu_temp[i] = fake_temp;
 
     hwmon_pr_loc_dbg("mfgBIOS: GET_CPU_TEMP(surf=%d, cpuNum=%d) => %d°C", temp->blSurface, temp->cpu_num, fake_temp);
@@ -157,7 +304,6 @@ static int bios_get_cpu_temp(SYNOCPUTEMP *temp)
     return 0;
 }
 
-static int *hwmon_thermals = NULL;
 /**
  * Returns various HWMON temperatures
  *
@@ -166,32 +312,21 @@ static int *hwmon_thermals = NULL;
  */
 static int bios_hwmon_get_thermal(SYNO_HWMON_SENSOR_TYPE *reading)
 {
-    guard_hwmon_cfg();
-    if (unlikely(!hwmon_thermals))
-        kzalloc_or_exit_int(hwmon_thermals, sizeof(int) * HWMON_SYS_THERMAL_ZONE_IDS);
+    guard_hwmon_arena();
 
-    guarded_strscpy(reading->type_name, HWMON_SYS_THERMAL_NAME, sizeof(reading->type_name));
+    memcpy(reading, &hwmon_arena->thermal_tpl, sizeof(SYNO_HWMON_SENSOR_TYPE)); //type & sensor names
     hwmon_pr_loc_dbg("mfgBIOS: => %s(type=%s)", __FUNCTION__, reading->type_name);
 
-    for (int i = 0; i < HWMON_SYS_THERMAL_ZONE_IDS; i++) {
-        if (hwmon_cfg->sys_thermal[i] == HWMON_SYS_TZONE_NULL_ID)
-            break;
-
-        guarded_strscpy(reading->sensor[i].sensor_name, hwmon_sys_thermal_zone_id_map[hwmon_cfg->sys_thermal[i]],
-                        sizeof(reading->sensor[i].sensor_name)); //Save the name of the sensor
-        hwmon_thermals[i] = prandom_int_range_stable(&hwmon_thermals[i], TEMP_DEV, FAKE_SURFACE_TEMP_MIN,
-                                                     FAKE_SURFACE_TEMP_MAX);
-        snprintf(reading->sensor[i].value, sizeof(reading->sensor[i].value), "%d", hwmon_thermals[i]);
-        ++reading->sensor_num;
+    for (int i = 0; i < reading->sensor_num; i++) {
+        int temp = read_hwmon_sensor(HWMON_SENSOR_THERMAL, i);
+        snprintf(reading->sensor[i].value, sizeof(reading->sensor[i].value), "%d", temp);
 
-        hwmon_pr_loc_dbg("mfgBIOS: <= %s() %s->%d °C", __FUNCTION__,
-                         hwmon_sys_thermal_zone_id_map[hwmon_cfg->sys_thermal[i]], hwmon_thermals[i]);
+        hwmon_pr_loc_dbg("mfgBIOS: <= %s() %s->%d °C", __FUNCTION__, reading->sensor[i].sensor_name, temp);
     }
 
     return 0;
 }
 
-static int *hwmon_voltages = NULL;
 /**
  * Returns various HWMON voltages
  *
@@ -200,33 +335,21 @@ static int *hwmon_voltages = NULL;
  */
 static int bios_hwmon_get_voltages(SYNO_HWMON_SENSOR_TYPE *reading)
 {
-    guard_hwmon_cfg();
-    if (unlikely(!hwmon_voltages))
-        kzalloc_or_exit_int(hwmon_voltages, sizeof(int) * HWMON_SYS_VOLTAGE_SENSOR_IDS);
+    guard_hwmon_arena();
 
-    guarded_strscpy(reading->type_name, HWMON_SYS_VOLTAGE_NAME, sizeof(reading->type_name));
+    memcpy(reading, &hwmon_arena->voltage_tpl, sizeof(SYNO_HWMON_SENSOR_TYPE)); //type & sensor names
     hwmon_pr_loc_dbg("mfgBIOS: => %s(type=%s)", __FUNCTION__, reading->type_name);
 
-    for (int i = 0; i < HWMON_SYS_VOLTAGE_SENSOR_IDS; i++) {
-        if (hwmon_cfg->sys_voltage[i] == HWMON_SYS_VSENS_NULL_ID)
-            break;
-
-        guarded_strscpy(reading->sensor[i].sensor_name, hwmon_sys_vsens_id_map[hwmon_cfg->sys_voltage[i]],
-                        sizeof(reading->sensor[i].sensor_name)); //Save the name of the sensor
-        hwmon_voltages[i] = prandom_int_range_stable(&hwmon_voltages[i], VOLT_DEV,
-                                                     fake_volt_min(hwmon_cfg->sys_voltage[i]),
-                                                     fake_volt_max(hwmon_cfg->sys_voltage[i]));
-        snprintf(reading->sensor[i].value, sizeof(reading->sensor[i].value), "%d", hwmon_voltages[i]);
-        ++reading->sensor_num;
+    for (int i = 0; i < reading->sensor_num; i++) {
+        int volt = read_hwmon_sensor(HWMON_SENSOR_VOLTAGE, i);
+        snprintf(reading->sensor[i].value, sizeof(reading->sensor[i].value), "%d", volt);
 
-        hwmon_pr_loc_dbg("mfgBIOS: <= %s() %s->%d mV", __FUNCTION__, hwmon_sys_vsens_id_map[hwmon_cfg->sys_voltage[i]],
-                         hwmon_voltages[i]);
+        hwmon_pr_loc_dbg("mfgBIOS: <= %s() %s->%d mV", __FUNCTION__, reading->sensor[i].sensor_name, volt);
     }
 
     return 0;
 }
 
-static int *hwmon_fans_rpm = NULL;
 /**
  * Returns HWMON fan speeds
  *
@@ -235,25 +358,16 @@ static int *hwmon_fans_rpm = NULL;
  */
 static int bios_hwmon_get_fans_rpm(SYNO_HWMON_SENSOR_TYPE *reading)
 {
-    guard_hwmon_cfg();
-    if (unlikely(!hwmon_fans_rpm))
-        kzalloc_or_exit_int(hwmon_fans_rpm, sizeof(int) * HWMON_SYS_FAN_RPM_IDS);
+    guard_hwmon_arena();
 
-    guarded_strscpy(reading->type_name, HWMON_SYS_FAN_RPM_NAME, sizeof(reading->type_name));
+    memcpy(reading, &hwmon_arena->fan_rpm_tpl, sizeof(SYNO_HWMON_SENSOR_TYPE)); //type & sensor names
     hwmon_pr_loc_dbg("mfgBIOS: => %s(type=%s)", __FUNCTION__, reading->type_name);
 
-    for (int i = 0; i < HWMON_SYS_FAN_RPM_IDS; i++) {
-        if (hwmon_cfg->sys_fan_speed_rpm[i] == HWMON_SYS_FAN_NULL_ID)
-            break;
-
-        guarded_strscpy(reading->sensor[i].sensor_name, hwmon_sys_fan_id_map[hwmon_cfg->sys_fan_speed_rpm[i]],
-                        sizeof(reading->sensor[i].sensor_name)); //Save the name of the sensor
-        hwmon_fans_rpm[i] = prandom_int_range_stable(&hwmon_fans_rpm[i], FAN_SPEED_DEV, FAKE_RPM_MIN, FAKE_RPM_MAX);
-        snprintf(reading->sensor[i].value, sizeof(reading->sensor[i].value), "%d", hwmon_fans_rpm[i]);
-        ++reading->sensor_num;
+    for (int i = 0; i < reading->sensor_num; i++) {
+        int rpm = read_hwmon_sensor(HWMON_SENSOR_FAN, i);
+        snprintf(reading->sensor[i].value, sizeof(reading->sensor[i].value), "%d", rpm);
 
-        hwmon_pr_loc_dbg("mfgBIOS: <= %s() %s->%d RPM", __FUNCTION__,
-                         hwmon_sys_fan_id_map[hwmon_cfg->sys_fan_speed_rpm[i]], hwmon_fans_rpm[i]);
+        hwmon_pr_loc_dbg("mfgBIOS: <= %s() %s->%d RPM", __FUNCTION__, reading->sensor[i].sensor_name, rpm);
     }
 
     return 0;
@@ -273,23 +387,15 @@ static int bios_hwmon_get_fans_rpm(SYNO_HWMON_SENSOR_TYPE *reading)
  */
 static int bios_hwmon_get_hdd_backplane(SYNO_HWMON_SENSOR_TYPE *reading)
 {
-    guard_hwmon_cfg();
+    guard_hwmon_arena();
     const int hdd_num = 1; //todo: this should be taken from SCSI layer
 
-    guarded_strscpy(reading->type_name, HWMON_HDD_BP_STATUS_NAME, sizeof(reading->type_name));
+    memcpy(reading, &hwmon_arena->hdd_bp_tpl, sizeof(SYNO_HWMON_SENSOR_TYPE)); //type & sensor names
     hwmon_pr_loc_dbg("mfgBIOS: => %s(type=%s)", __FUNCTION__, reading->type_name);
 
-    for (int i = 0; i < HWMON_SYS_HDD_BP_IDS; i++) {
-        if (hwmon_cfg->hdd_backplane[i] == HWMON_SYS_HDD_BP_NULL_ID)
-            break;
-
-        guarded_strscpy(reading->sensor[i].sensor_name, hwmon_hdd_bp_id_map[hwmon_cfg->hdd_backplane[i]],
-                        sizeof(reading->sensor[i].sensor_name)); //Save the name of the sensor
+    for (int i = 0; i < reading->sensor_num; i++) {
         snprintf(reading->sensor[i].value, sizeof(reading->sensor[i].value), "%d", hdd_num);
-        ++reading->sensor_num;
-
-        hwmon_pr_loc_dbg("mfgBIOS: <= %s() %s->%d", __FUNCTION__, hwmon_hdd_bp_id_map[hwmon_cfg->hdd_backplane[i]],
-                         hdd_num);
+        hwmon_pr_loc_dbg("mfgBIOS: <= %s() %s->%d", __FUNCTION__, reading->sensor[i].sensor_name, hdd_num);
     }
 
     return 0;
@@ -326,12 +432,192 @@ static int bios_hwmon_get_current(struct hw_config_hwmon *hwc, SYNO_HWMON_SENSOR
 }
 
 
+/********************************************** Linux hwmon class export *********************************************/
+#if HWMON_CLASS_EXPORT
+/**
+ * Maps a sensor kind to its reading template (which holds the number & names of sensors)
+ */
+static const SYNO_HWMON_SENSOR_TYPE *get_hwmon_tpl(enum hwmon_sensor_kind kind)
+{
+    switch (kind) {
+        case HWMON_SENSOR_THERMAL:
+            return &hwmon_arena->thermal_tpl;
+        case HWMON_SENSOR_VOLTAGE:
+            return &hwmon_arena->voltage_tpl;
+        case HWMON_SENSOR_FAN:
+            return &hwmon_arena->fan_rpm_tpl;
+        default:
+            return NULL;
+    }
+}
+
+static ssize_t hwmon_class_name_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%s\n", HWMON_CLASS_NAME);
+}
+
+static ssize_t hwmon_class_input_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+    int val = read_hwmon_sensor(sattr->nr, sattr->index);
+
+    //mfgBIOS units => hwmon ABI units (m°C for temperatures; mV & RPM are the same)
+    return sprintf(buf, "%d\n", sattr->nr == HWMON_SENSOR_THERMAL ? val * 1000 : val);
+}
+
+static ssize_t hwmon_class_label_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+    return sprintf(buf, "%s\n", get_hwmon_tpl(sattr->nr)->sensor[sattr->index].sensor_name);
+}
+
+static DEVICE_ATTR(name, S_IRUGO, hwmon_class_name_show, NULL);
+
+//hwmon ABI numbers temperatures & fans from 1 but voltages from 0
+#define hwmon_class_sensor_attrs(type, num, kind, idx)                                                                 \
+    static SENSOR_DEVICE_ATTR_2(type##num##_input, S_IRUGO, hwmon_class_input_show, NULL, kind, idx);                  \
+    static SENSOR_DEVICE_ATTR_2(type##num##_label, S_IRUGO, hwmon_class_label_show, NULL, kind, idx)
+#define hwmon_class_sensor_attrs_ptrs(type, num) \
+    &sensor_dev_attr_##type##num##_input.dev_attr.attr, &sensor_dev_attr_##type##num##_label.dev_attr.attr
+
+hwmon_class_sensor_attrs(temp, 1, HWMON_SENSOR_THERMAL, 0);
+hwmon_class_sensor_attrs(temp, 2, HWMON_SENSOR_THERMAL, 1);
+hwmon_class_sensor_attrs(temp, 3, HWMON_SENSOR_THERMAL, 2);
+hwmon_class_sensor_attrs(temp, 4, HWMON_SENSOR_THERMAL, 3);
+hwmon_class_sensor_attrs(temp, 5, HWMON_SENSOR_THERMAL, 4);
+hwmon_class_sensor_attrs(in, 0, HWMON_SENSOR_VOLTAGE, 0);
+hwmon_class_sensor_attrs(in, 1, HWMON_SENSOR_VOLTAGE, 1);
+hwmon_class_sensor_attrs(in, 2, HWMON_SENSOR_VOLTAGE, 2);
+hwmon_class_sensor_attrs(in, 3, HWMON_SENSOR_VOLTAGE, 3);
+hwmon_class_sensor_attrs(in, 4, HWMON_SENSOR_VOLTAGE, 4);
+hwmon_class_sensor_attrs(in, 5, HWMON_SENSOR_VOLTAGE, 5);
+hwmon_class_sensor_attrs(in, 6, HWMON_SENSOR_VOLTAGE, 6);
+hwmon_class_sensor_attrs(fan, 1, HWMON_SENSOR_FAN, 0);
+hwmon_class_sensor_attrs(fan, 2, HWMON_SENSOR_FAN, 1);
+hwmon_class_sensor_attrs(fan, 3, HWMON_SENSOR_FAN, 2);
+hwmon_class_sensor_attrs(fan, 4, HWMON_SENSOR_FAN, 3);
+
+//Attributes for all sensors a platform can have; the ones not present on the current one are hidden
+static struct attribute *hwmon_class_attrs[] = {
+    &dev_attr_name.attr,
+    hwmon_class_sensor_attrs_ptrs(temp, 1), hwmon_class_sensor_attrs_ptrs(temp, 2),
+    hwmon_class_sensor_attrs_ptrs(temp, 3), hwmon_class_sensor_attrs_ptrs(temp, 4),
+    hwmon_class_sensor_attrs_ptrs(temp, 5),
+    hwmon_class_sensor_attrs_ptrs(in, 0), hwmon_class_sensor_attrs_ptrs(in, 1), hwmon_class_sensor_attrs_ptrs(in, 2),
+    hwmon_class_sensor_attrs_ptrs(in, 3), hwmon_class_sensor_attrs_ptrs(in, 4), hwmon_class_sensor_attrs_ptrs(in, 5),
+    hwmon_class_sensor_attrs_ptrs(in, 6),
+    hwmon_class_sensor_attrs_ptrs(fan, 1), hwmon_class_sensor_attrs_ptrs(fan, 2),
+    hwmon_class_sensor_attrs_ptrs(fan, 3), hwmon_class_sensor_attrs_ptrs(fan, 4),
+    NULL
+};
+
+static umode_t hwmon_class_attr_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+    if (attr == &dev_attr_name.attr)
+        return attr->mode;
+
+    struct device_attribute *dattr = container_of(attr, struct device_attribute, attr);
+    struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(dattr);
+
+    return sattr->index < get_hwmon_tpl(sattr->nr)->sensor_num ? attr->mode : 0;
+}
+
+static const struct attribute_group hwmon_class_group = {
+    .attrs = hwmon_class_attrs,
+    .is_visible = hwmon_class_attr_visible,
+};
+
+static struct device *hwmon_class_dev = NULL;
+
+/**
+ * Registers hwmon class device exposing the same readings as mfgBIOS calls get (noop if it's already registered)
+ *
+ * The device must be registered after the hwmon state is allocated and unregistered before it's freed, as reads of its
+ * attributes go straight to the state.
+ *
+ * @return 0 on success, -E on error
+ */
+static int register_hwmon_class_dev(void)
+{
+    BUILD_BUG_ON(HWMON_SYS_THERMAL_ZONE_IDS != 5); //attributes above are defined for every possible sensor
+    BUILD_BUG_ON(HWMON_SYS_VOLTAGE_SENSOR_IDS != 7);
+    BUILD_BUG_ON(HWMON_SYS_FAN_RPM_IDS != 4);
+
+    if (hwmon_class_dev)
+        return 0;
+
+    struct device *dev;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
+    static const struct attribute_group *groups[] = { &hwmon_class_group, NULL };
+    dev = hwmon_device_register_with_groups(NULL, HWMON_CLASS_NAME, NULL, groups);
+    if (IS_ERR(dev)) {
+        pr_loc_err("Failed to register hwmon class device - error=%ld", PTR_ERR(dev));
+        return PTR_ERR(dev);
+    }
+#else
+    dev = hwmon_device_register(NULL);
+    if (IS_ERR(dev)) {
+        pr_loc_err("Failed to register hwmon class device - error=%ld", PTR_ERR(dev));
+        return PTR_ERR(dev);
+    }
+
+    int out = sysfs_create_group(&dev->kobj, &hwmon_class_group);
+    if (out != 0) {
+        pr_loc_err("Failed to create hwmon class device attributes - error=%d", out);
+        hwmon_device_unregister(dev);
+        return out;
+    }
+#endif
+
+    hwmon_class_dev = dev;
+    pr_loc_dbg("Registered hwmon class device %s", dev_name(dev));
+    return 0;
+}
+
+/**
+ * Reverses register_hwmon_class_dev(); once it returns no reads of the attributes are in progress
+ */
+static void unregister_hwmon_class_dev(void)
+{
+    if (!hwmon_class_dev)
+        return;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+    sysfs_remove_group(&hwmon_class_dev->kobj, &hwmon_class_group);
+#endif
+    hwmon_device_unregister(hwmon_class_dev);
+    hwmon_class_dev = NULL;
+}
+#else //HWMON_CLASS_EXPORT
+static inline int register_hwmon_class_dev(void) { return 0; }
+static inline void unregister_hwmon_class_dev(void) { }
+#endif //HWMON_CLASS_EXPORT
+
 /************************************************ mfgBIOS shim interface **********************************************/
 int shim_bios_module_hwmon_entries(const struct hw_config *hw)
 {
     shim_reg_in();
     hwmon_cfg = &hw->hwmon;
 
+    //Without the state none of the HWMON calls can be emulated; the original mfgBIOS ones are better than crashing
+    int out = alloc_hwmon_arena(hwmon_cfg);
+    if (unlikely(out != 0)) {
+        hwmon_cfg = NULL;
+        return out;
+    }
+
+    //Misconfigured sources aren't fatal - all sensors will simply be emulated
+    if (start_hwmon_sensors(hwmon_cfg) != 0)
+        pr_loc_err("Failed to start real sensors - readings will be emulated");
+
+    //Fans are left to their own (chip) control then
+    if (start_fan_control() != 0)
+        pr_loc_err("Failed to start fan control");
+
+    //...and neither is missing hwmon class device - it only serves external collectors
+    if (register_hwmon_class_dev() != 0)
+        pr_loc_wrn("Readings will not be available via hwmon class");
+
     _shim_bios_module_entry(VTK_GET_FAN_STATE, bios_get_fan_state);
 
     if (hw->has_cpu_temp)
@@ -363,11 +649,13 @@ int reset_bios_module_hwmon_shim(void)
 {
     shim_reset_in();
 
+    unregister_hwmon_class_dev(); //before the state goes away
+    stop_fan_control(); //before sensors as it uses their readings
+    stop_hwmon_sensors();
     hwmon_cfg = NULL;
     cur_cpu_temp = 0;
-    try_kfree(hwmon_thermals);
-    try_kfree(hwmon_voltages);
-    try_kfree(hwmon_fans_rpm);
+    kfree(hwmon_arena);
+    hwmon_arena = NULL;
 
     shim_reset_ok();
     return 0;
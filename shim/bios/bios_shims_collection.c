@@ -1,14 +1,21 @@
 #include "bios_shims_collection.h"
 #include "../../config/platform_types.h"
-#include "rtc_proxy.h"
+#include "../../config/platform_profile.h" //platform_emulate_rtc(), platform_fix_disk_led_ctrl(), RP_PLATFORM_NO_*
+#include "rtc_proxy.h" //not built with RP_PLATFORM_NO_RTC_PROXY
 #include "bios_hwmon_shim.h"
+#include "led_backend.h"
 #include "../../common.h"
 #include "../../internal/helper/symbol_helper.h" //kernel_has_symbol()
 #include "../../internal/override/override_symbol.h" //shimming leds stuff
+#include "../../internal/hook_stats.h" //hook_stats_hit()
+#include "../../internal/rp_trace.h" //rp_trace()
+#include <linux/jhash.h> //jhash2()
 
 
 #define DECLARE_NULL_ZERO_INT(for_what)                         \
     static __used int bios_##for_what##_null_zero_int(void) {   \
+        hook_stats_hit(HOOK_STATS_MFGBIOS_VTABLE);              \
+        rp_trace(mfgbios_call, #for_what, 0, 0);                \
         pr_loc_dbg("mfgBIOS: nullify zero-int for " #for_what); \
         return 0;                                               \
     }
@@ -17,6 +24,8 @@
 /********************************************* mfgBIOS LKM static shims ***********************************************/
 static unsigned long org_shimmed_entries[VTK_SIZE] = { '\0' }; //original entries which were shimmed by custom entries
 static unsigned long cust_shimmed_entries[VTK_SIZE] = { '\0' }; //custom entries which were set as shims
+static unsigned long *shimmed_vtable = NULL; //vtable which went through a full pass (NULL = full pass needed)
+static u32 shimmed_vtable_hash = 0; //hash of the vtable as we left it after the last pass
 
 static int shim_get_gpio_pin_usable(int *pin)
 {
@@ -30,6 +39,77 @@ static int bios_get_buz_clr(unsigned char *state)
     return 0;
 }
 
+/****************************************** LEDs driven by the real backend *******************************************/
+//Converts MfgCompatGenericLedState (which values are accidentally the same as ours, but better not rely on that)
+static enum led_backend_state generic_led_state(enum MfgCompatGenericLedState state)
+{
+    switch (state) {
+        case MFGC_LED_LIT:
+            return LED_BACKEND_ON;
+        case MFGC_LED_BLINK:
+            return LED_BACKEND_BLINK;
+        default:
+            return LED_BACKEND_OFF;
+    }
+}
+
+//Disk LEDs have colors we cannot reproduce with a single LED so we only care if it's off, lit or blinking
+static enum led_backend_state disk_led_state(SYNO_DISK_LED state)
+{
+    switch (state) {
+        case DISK_LED_OFF:
+            return LED_BACKEND_OFF;
+        case DISK_LED_ORANGE_BLINK:
+        case DISK_LED_GREEN_BLINK:
+            return LED_BACKEND_BLINK;
+        default:
+            return LED_BACKEND_ON;
+    }
+}
+
+#define DECLARE_GENERIC_LED_SHIM(for_what, led_id)                                                             \
+    static __used int bios_##for_what##_led(enum MfgCompatGenericLedState state) {                              \
+        hook_stats_hit(HOOK_STATS_MFGBIOS_VTABLE);                                                              \
+        rp_trace(mfgbios_call, #for_what, state, 0);                                                            \
+        led_backend_set(led_id, generic_led_state(state));                                                      \
+        return 0;                                                                                               \
+    }
+//Uses the real LED for an entry if it was mapped (otherwise nullifies it as before)
+#define SHIM_TO_GENERIC_LED(for_what, led_id) do {                                                              \
+        if (led_backend_has(led_id))                                                                            \
+            _shim_bios_module_entry(for_what, bios_##for_what##_led);                                           \
+        else                                                                                                    \
+            SHIM_TO_NULL_ZERO_INT(for_what)                                                                     \
+    } while(0)
+
+DECLARE_GENERIC_LED_SHIM(VTK_SET_PWR_LED, LED_BACKEND_POWER);
+DECLARE_GENERIC_LED_SHIM(VTK_SET_ALR_LED, LED_BACKEND_ALARM);
+DECLARE_GENERIC_LED_SHIM(VTK_SET_PHY_LED, LED_BACKEND_PHY);
+DECLARE_GENERIC_LED_SHIM(VTK_SET_HDD_ACT_LED, LED_BACKEND_HDD_ACT);
+
+static void set_disk_led(int hdd_no, SYNO_DISK_LED state)
+{
+    hook_stats_hit(HOOK_STATS_MFGBIOS_VTABLE);
+    rp_trace(mfgbios_call, "VTK_SET_DISK_LED", hdd_no, state);
+    if (hdd_no < 0 || hdd_no >= LED_BACKEND_MAX_DISKS ||
+        led_backend_set(LED_BACKEND_DISK0 + hdd_no, disk_led_state(state)) != 0)
+        pr_loc_dbg("mfgBIOS: disk %d LED is not mapped", hdd_no);
+}
+
+#ifdef CONFIG_SYNO_PORT_MAPPING_V2
+static int bios_set_disk_led(struct MfgCompatHddLedStatus *status)
+{
+    set_disk_led(status->hdd_no, status->state);
+    return 0;
+}
+#else
+static int bios_set_disk_led(int hdd_no, SYNO_DISK_LED state)
+{
+    set_disk_led(hdd_no, state);
+    return 0;
+}
+#endif
+
 /***************************************** Debug shims for unknown bios functions **************************************/
 DECLARE_NULL_ZERO_INT(VTK_SET_FAN_STATE);
 DECLARE_NULL_ZERO_INT(VTK_SET_DISK_LED);
@@ -101,10 +181,46 @@ static void print_debug_symbols(const unsigned long *vtable_end)
     pr_loc_dbg("Finished printing memory at %p", byte_ptr);
 }
 
+/**
+ * Hashes all vtable slots we can possibly shim
+ */
+static __always_inline u32 hash_vtable(const unsigned long *vt_start)
+{
+    return jhash2((const u32 *)vt_start, VTK_SIZE * sizeof(unsigned long) / sizeof(u32), 0);
+}
+
+/**
+ * Re-applies shims only to the slots which were rewritten (by the mfgBIOS) since the last pass
+ *
+ * Which slots are shimmed depends only on the platform, so after the first full pass cust_shimmed_entries contains all
+ * of them and there's no need to go through all sub-shims (which e.g. reinitialize the RTC proxy) again.
+ *
+ * @return number of slots re-shimmed
+ */
+static unsigned int reshim_changed_entries(void)
+{
+    unsigned int changed = 0;
+    for (int i = 0; i < VTK_SIZE; i++) {
+        if (!cust_shimmed_entries[i] || vtable_start[i] == cust_shimmed_entries[i])
+            continue;
+
+        pr_loc_dbg("mfgBIOS vtable [%d] was rewritten to %ps<%p> - restoring shim %ps<%p>", i,
+                   (void *) vtable_start[i], (void *) vtable_start[i], (void *) cust_shimmed_entries[i],
+                   (void *) cust_shimmed_entries[i]);
+        org_shimmed_entries[i] = vtable_start[i];
+        vtable_start[i] = cust_shimmed_entries[i];
+        ++changed;
+    }
+
+    return changed;
+}
+
 /**
  * Applies shims to the vtable used by the bios
  *
- * These calls may execute multiple times as the mfgBIOS is loading.
+ * These calls may execute multiple times as the mfgBIOS is loading. Only the first call for a given vtable does a full
+ * pass. Subsequent ones are skipped if the vtable didn't change since the last one (based on its hash), or only
+ * re-patch slots which were rewritten otherwise.
  *
  * @return true when shimming succeeded, false otherwise
  */
@@ -117,23 +233,41 @@ bool shim_bios_module(const struct hw_config *hw, struct module *mod, unsigned l
 
     vtable_start = vt_start;
 
+    if (likely(shimmed_vtable == vt_start)) {
+        if (hash_vtable(vt_start) == shimmed_vtable_hash) {
+            pr_loc_dbg("mfgBIOS vtable didn't change since the last pass - nothing to shim");
+            return true;
+        }
+
+        pr_loc_dbg("Re-shimmed %u mfgBIOS vtable entries", reshim_changed_entries());
+        shimmed_vtable_hash = hash_vtable(vt_start);
+        return true;
+    }
+
     print_debug_symbols(vt_end);
+    if (start_led_backend(hw) != 0)
+        pr_loc_err("Failed to start real LEDs backend - LEDs will be nullified");
+
     SHIM_TO_NULL_ZERO_INT(VTK_SET_FAN_STATE);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_DISK_LED);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_PWR_LED);
+    if (led_backend_has_disks())
+        _shim_bios_module_entry(VTK_SET_DISK_LED, bios_set_disk_led);
+    else
+        SHIM_TO_NULL_ZERO_INT(VTK_SET_DISK_LED);
+    SHIM_TO_GENERIC_LED(VTK_SET_PWR_LED, LED_BACKEND_POWER);
     SHIM_TO_NULL_ZERO_INT(VTK_SET_GPIO_PIN);
     _shim_bios_module_entry(VTK_GET_GPIO_PIN, shim_get_gpio_pin_usable);
     SHIM_TO_NULL_ZERO_INT(VTK_SET_GPIO_PIN_BLINK);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_ALR_LED);
+    SHIM_TO_GENERIC_LED(VTK_SET_ALR_LED, LED_BACKEND_ALARM);
     _shim_bios_module_entry(VTK_GET_BUZ_CLR, bios_get_buz_clr);
     SHIM_TO_NULL_ZERO_INT(VTK_SET_BUZ_CLR);
     SHIM_TO_NULL_ZERO_INT(VTK_SET_CPU_FAN_STATUS);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_PHY_LED);
-    SHIM_TO_NULL_ZERO_INT(VTK_SET_HDD_ACT_LED);
+    SHIM_TO_GENERIC_LED(VTK_SET_PHY_LED, LED_BACKEND_PHY);
+    SHIM_TO_GENERIC_LED(VTK_SET_HDD_ACT_LED, LED_BACKEND_HDD_ACT);
     SHIM_TO_NULL_ZERO_INT(VTK_GET_MICROP_ID);
     SHIM_TO_NULL_ZERO_INT(VTK_SET_MICROP_ID);
 
-    if (hw->emulate_rtc) {
+#ifndef RP_PLATFORM_NO_RTC_PROXY
+    if (platform_emulate_rtc(hw)) {
         pr_loc_dbg("Platform requires RTC proxy - enabling");
         register_rtc_proxy_shim();
         _shim_bios_module_entry(VTK_RTC_GET_TIME, rtc_proxy_get_time);
@@ -145,10 +279,13 @@ bool shim_bios_module(const struct hw_config *hw, struct module *mod, unsigned l
     } else {
         pr_loc_dbg("Native RTC supported - not enabling proxy (emulate_rtc=%d)", hw->emulate_rtc ? 1:0);
     }
+#endif
 
     shim_bios_module_hwmon_entries(hw); //Shim all hardware environment stuff (temps, fans, etc.)
 
     print_debug_symbols(vt_end);
+    shimmed_vtable = vt_start;
+    shimmed_vtable_hash = hash_vtable(vt_start);
 
     return true;
 }
@@ -175,8 +312,13 @@ void reset_bios_shims(void)
 {
     memset(org_shimmed_entries, 0, sizeof(org_shimmed_entries));
     memset(cust_shimmed_entries, 0, sizeof(cust_shimmed_entries));
+    shimmed_vtable = NULL;
+    shimmed_vtable_hash = 0;
+#ifndef RP_PLATFORM_NO_RTC_PROXY
     unregister_rtc_proxy_shim();
+#endif
     reset_bios_module_hwmon_shim();
+    stop_led_backend();
 }
 
 /******************************** Kernel-level shims related to mfgBIOS functionality *********************************/
@@ -213,7 +355,7 @@ int shim_disk_leds_ctrl(const struct hw_config *hw)
 {
     //we're checking this here to remove knowledge of "struct hw_config" from bios_shim letting others know it's NOT
     //the place to do BIOS shimming decisions
-    if (!hw->fix_disk_led_ctrl)
+    if (!platform_fix_disk_led_ctrl(hw))
         return 0;
 
     pr_loc_dbg("Shimming disk led control API");
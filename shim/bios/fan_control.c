@@ -0,0 +1,347 @@
+#include "fan_control.h"
+#include "hwmon_sensors.h" //get_hwmon_sensor(), get_cpu_temps()
+#include "../../common.h"
+#include "../../config/platform_types.h" //HWMON_SYS_THERMAL_ZONE_IDS, HWMON_SYS_FAN_RPM_IDS
+#include "../../internal/helper/tunables.h" //register_rp_tunable()
+#include "../../internal/housekeeping.h" //housekeeping_wq()
+#include <linux/moduleparam.h> //module_param_named()
+#include <linux/workqueue.h> //DECLARE_DELAYED_WORK, queue_delayed_work(), mod_delayed_work()
+#include <linux/fs.h> //filp_open(), filp_close(), kernel_read(), kernel_write()
+#include <linux/jiffies.h> //msecs_to_jiffies()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_*()
+#include <linux/threads.h> //NR_CPUS
+
+#define FAN_CTL_DEFAULT_MS 2000
+#define FAN_CTL_MIN_MS 500
+#define FAN_CTL_MAX_MS 60000 //fans shouldn't lag behind temperature changes for longer than that
+#define FAN_CTL_MAX_PWMS HWMON_SYS_FAN_RPM_IDS
+#define FAN_CTL_PWM_SEP ","
+#define FAN_CTL_VALUE_MAX_LEN 24 //longest long with a sign & new line is 21 characters
+#define FAN_CTL_HYSTERESIS 3 //°C
+#define FAN_CTL_FAILSAFE_DUTY 100 //%
+#define FAN_CTL_PWM_MAX 255 //hwmon ABI: pwmN is 0-255
+#define FAN_CTL_PWM_MANUAL 1 //hwmon ABI: pwmN_enable=1 is manual control
+#define FAN_CTL_DUTY_UNSET -1
+
+//Temperature curve: the duty cycle of the highest level whose temperature (°C) was reached
+static const struct fan_ctl_level {
+    int temp;
+    unsigned int duty; //%
+} fan_ctl_levels[] = {
+    { INT_MIN,  30 },
+    {      40,  40 },
+    {      45,  55 },
+    {      50,  70 },
+    {      55,  85 },
+    {      60, 100 },
+};
+
+//The permission is 0 so that these are not exposed in sysfs
+static char *fan_pwm = NULL;
+module_param_named(fan_pwm, fan_pwm, charp, 0000);
+static unsigned int fan_ctl_ms = FAN_CTL_DEFAULT_MS;
+module_param_named(fan_ctl_ms, fan_ctl_ms, uint, 0000);
+
+struct fan_pwm_output {
+    char *path; //pwmN
+    char *enable_path; //pwmN_enable
+    char *freq_path; //pwmN_freq
+    long orig_enable; //mode to restore on stop; <0 if it couldn't be read
+    bool failing; //used to log failures only once
+};
+
+static struct fan_pwm_output outputs[FAN_CTL_MAX_PWMS];
+static unsigned int outputs_num = 0;
+
+//Requested by the OS; kept across restarts of the loop (e.g. when the mfgBIOS is shimmed again)
+static int req_duty = FAN_CTL_DUTY_UNSET;
+static unsigned int req_freq = 0;
+
+//State of the loop, only used by the worker
+static unsigned int cur_level = 0;
+static int cur_duty = FAN_CTL_DUTY_UNSET;
+static unsigned int cur_freq = 0;
+static int cpu_temps[NR_CPUS];
+
+static DEFINE_MUTEX(running_lock); //protects running vs. requests rescheduling the worker
+static bool running = false;
+
+static void run_fan_control(struct work_struct *work);
+static DECLARE_DELAYED_WORK(ctl_work, run_fan_control);
+
+/**
+ * Reads integer from a sysfs attribute
+ */
+static int read_pwm_attr(const char *path, long *value)
+{
+    char buf[FAN_CTL_VALUE_MAX_LEN];
+    struct file *file = filp_open(path, O_RDONLY, 0);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+    int len = kernel_read(file, 0, buf, sizeof(buf) - 1);
+    filp_close(file, NULL);
+    if (len < 0)
+        return len;
+
+    buf[len] = '\0';
+    return kstrtol(buf, 10, value); //accepts the trailing new line
+}
+
+/**
+ * Writes integer to a sysfs attribute
+ */
+static int write_pwm_attr(const char *path, long value)
+{
+    char buf[FAN_CTL_VALUE_MAX_LEN];
+    int len = snprintf(buf, sizeof(buf), "%ld\n", value);
+    struct file *file = filp_open(path, O_WRONLY, 0);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+    int out = kernel_write(file, buf, len, 0);
+    filp_close(file, NULL);
+
+    return out < 0 ? out : 0;
+}
+
+/**
+ * @return the hottest real temperature in °C, or INT_MIN if there's none
+ */
+static int get_max_temp(void)
+{
+    int hottest = INT_MIN, temp;
+
+    for (int i = 0; i < HWMON_SYS_THERMAL_ZONE_IDS; ++i) {
+        if (get_hwmon_sensor(HWMON_SENSOR_THERMAL, i, &temp) == 0)
+            hottest = max(hottest, temp);
+    }
+
+    int num = get_cpu_temps(cpu_temps, ARRAY_SIZE(cpu_temps));
+    for (int i = 0; i < num; ++i)
+        hottest = max(hottest, cpu_temps[i]);
+
+    return hottest;
+}
+
+/**
+ * Moves cur_level along the curve (see file header for the hysteresis rules)
+ */
+static void update_level(int temp)
+{
+    while (cur_level + 1 < ARRAY_SIZE(fan_ctl_levels) && temp >= fan_ctl_levels[cur_level + 1].temp)
+        ++cur_level;
+
+    while (cur_level > 0 && temp < fan_ctl_levels[cur_level].temp - FAN_CTL_HYSTERESIS)
+        --cur_level;
+}
+
+/**
+ * @return duty cycle (in %) the fans should run at now
+ */
+static int compute_duty(void)
+{
+    int requested = ACCESS_ONCE(req_duty);
+    int temp = get_max_temp();
+
+    if (temp == INT_MIN)
+        return requested != FAN_CTL_DUTY_UNSET ? requested : FAN_CTL_FAILSAFE_DUTY;
+
+    update_level(temp);
+    return max_t(int, requested, fan_ctl_levels[cur_level].duty);
+}
+
+static void apply_freq(unsigned int hz)
+{
+    for (int i = 0; i < outputs_num; ++i) {
+        int out = write_pwm_attr(outputs[i].freq_path, hz);
+        if (out != 0) //many chips don't support changing the frequency - it's not an error
+            pr_loc_dbg("Failed to set %uHz on %s - error=%d", hz, outputs[i].freq_path, out);
+    }
+}
+
+static void apply_duty(int duty)
+{
+    for (int i = 0; i < outputs_num; ++i) {
+        struct fan_pwm_output *pwm = &outputs[i];
+        int out = write_pwm_attr(pwm->path, duty * FAN_CTL_PWM_MAX / 100);
+        if (unlikely(out != 0)) {
+            if (!pwm->failing)
+                pr_loc_wrn("Failed to set %d%% duty cycle on %s - error=%d", duty, pwm->path, out);
+            pwm->failing = true;
+            cur_duty = FAN_CTL_DUTY_UNSET; //retry on the next run
+            continue;
+        }
+
+        pwm->failing = false;
+    }
+}
+
+static void run_fan_control(struct work_struct *work)
+{
+    unsigned int freq = ACCESS_ONCE(req_freq);
+    if (freq && freq != cur_freq) {
+        apply_freq(freq);
+        cur_freq = freq;
+    }
+
+    int duty = compute_duty();
+    if (duty != cur_duty) {
+        pr_loc_dbg("Setting fans to %d%% duty cycle (level=%u)", duty, cur_level);
+        cur_duty = duty;
+        apply_duty(duty);
+    }
+
+    if (likely(ACCESS_ONCE(running)))
+        queue_delayed_work(housekeeping_wq(system_long_wq), &ctl_work, msecs_to_jiffies(ACCESS_ONCE(fan_ctl_ms)));
+}
+
+static int kick_fan_control(void);
+static void apply_ctl_interval(const struct rp_tunable *tun)
+{
+    kick_fan_control(); //the worker picks up the new interval when it rearms itself
+}
+
+static struct rp_tunable ctl_tunable = {
+    .name = "fan_ctl_ms",
+    .value = &fan_ctl_ms,
+    .min = FAN_CTL_MIN_MS,
+    .max = FAN_CTL_MAX_MS,
+    .apply = apply_ctl_interval,
+};
+
+/**
+ * Parses a single pwmN path and takes manual control over it
+ */
+static int add_pwm_output(const char *path)
+{
+    if (outputs_num >= FAN_CTL_MAX_PWMS) {
+        pr_loc_err("Too many PWM outputs - only %d are supported", FAN_CTL_MAX_PWMS);
+        return -E2BIG;
+    }
+
+    struct fan_pwm_output *pwm = &outputs[outputs_num];
+    pwm->path = kstrdup(path, GFP_KERNEL);
+    pwm->enable_path = kasprintf(GFP_KERNEL, "%s_enable", path);
+    pwm->freq_path = kasprintf(GFP_KERNEL, "%s_freq", path);
+    ++outputs_num; //stop_fan_control() will free what was allocated
+    if (unlikely(!pwm->path || !pwm->enable_path || !pwm->freq_path)) {
+        pr_loc_crt("kernel memory alloc failure - tried to allocate attribute paths for %s", path);
+        return -ENOMEM;
+    }
+
+    if (read_pwm_attr(pwm->enable_path, &pwm->orig_enable) != 0)
+        pwm->orig_enable = -1; //some drivers don't have pwmN_enable at all
+
+    int out = write_pwm_attr(pwm->enable_path, FAN_CTL_PWM_MANUAL);
+    if (out != 0 && pwm->orig_enable >= 0) { //without pwmN_enable the output is (hopefully) always manual
+        pr_loc_err("Failed to switch %s to manual control - error=%d", path, out);
+        return out;
+    }
+
+    pr_loc_dbg("Fans will be controlled via %s (original mode=%ld)", path, pwm->orig_enable);
+    return 0;
+}
+
+int start_fan_control(void)
+{
+    if (running)
+        return 0; //the mfgBIOS may be shimmed multiple times
+
+    if (!fan_pwm || fan_pwm[0] == '\0') {
+        pr_loc_dbg("No PWM outputs configured - fans will not be controlled");
+        return 0;
+    }
+
+    char *pwm_copy = kstrdup(fan_pwm, GFP_KERNEL);
+    if (unlikely(!pwm_copy))
+        kalloc_error_int(pwm_copy, strsize(fan_pwm));
+
+    int out = 0;
+    char *cursor = pwm_copy, *entry;
+    while ((entry = strsep(&cursor, FAN_CTL_PWM_SEP)) != NULL) {
+        if (entry[0] != '\0' && (out = add_pwm_output(entry)) != 0)
+            break;
+    }
+    kfree(pwm_copy);
+
+    if (out != 0) {
+        stop_fan_control();
+        return out;
+    }
+
+    if (fan_ctl_ms < FAN_CTL_MIN_MS) {
+        pr_loc_wrn("Fan control interval of %ums is too short - using %ums", fan_ctl_ms, FAN_CTL_MIN_MS);
+        fan_ctl_ms = FAN_CTL_MIN_MS;
+    }
+
+    cur_level = 0;
+    cur_duty = FAN_CTL_DUTY_UNSET;
+    cur_freq = 0;
+
+    mutex_lock(&running_lock);
+    running = true;
+    queue_delayed_work(housekeeping_wq(system_long_wq), &ctl_work, 0);
+    mutex_unlock(&running_lock);
+    register_rp_tunable(&ctl_tunable); //not fatal - the interval just cannot be changed without a reload
+    pr_loc_inf("Controlling %u fan output(s) every %ums", outputs_num, fan_ctl_ms);
+
+    return 0;
+}
+
+void stop_fan_control(void)
+{
+    unregister_rp_tunable(&ctl_tunable); //before taking running_lock, as applying a new interval takes it too
+    mutex_lock(&running_lock);
+    bool was_running = running;
+    running = false;
+    mutex_unlock(&running_lock);
+
+    if (was_running)
+        cancel_delayed_work_sync(&ctl_work); //handles the worker rearming itself
+
+    for (int i = 0; i < outputs_num; ++i) {
+        struct fan_pwm_output *pwm = &outputs[i];
+
+        //Chip's own control is the safest thing to leave the fans with; without it they're left at full speed
+        if (pwm->enable_path && pwm->orig_enable >= 0 && pwm->orig_enable != FAN_CTL_PWM_MANUAL)
+            write_pwm_attr(pwm->enable_path, pwm->orig_enable);
+        else if (pwm->path)
+            write_pwm_attr(pwm->path, FAN_CTL_PWM_MAX);
+
+        kfree(pwm->path);
+        kfree(pwm->enable_path);
+        kfree(pwm->freq_path);
+        memset(pwm, 0, sizeof(struct fan_pwm_output));
+    }
+    outputs_num = 0;
+}
+
+/**
+ * Reschedules the worker right away to apply a new request
+ */
+static int kick_fan_control(void)
+{
+    int out = 0;
+
+    mutex_lock(&running_lock);
+    if (running)
+        mod_delayed_work(housekeeping_wq(system_long_wq), &ctl_work, 0);
+    else
+        out = -ENODEV;
+    mutex_unlock(&running_lock);
+
+    return out;
+}
+
+int fan_control_set_duty(unsigned int duty_pct)
+{
+    ACCESS_ONCE(req_duty) = min_t(unsigned int, duty_pct, 100);
+    return kick_fan_control();
+}
+
+int fan_control_set_freq(unsigned int hz)
+{
+    ACCESS_ONCE(req_freq) = hz;
+    return kick_fan_control();
+}
@@ -0,0 +1,61 @@
+/**
+ * Closed-loop fan control driving real PWM fan headers
+ *
+ * On bare metal the fans can be mapped to PWM outputs exposed by the kernel hwmon subsystem using "fan_pwm" module
+ * parameter. It's a list of hwmon pwmN attributes separated with ",", e.g.:
+ *   fan_pwm=/sys/class/hwmon/hwmon2/pwm1,/sys/class/hwmon/hwmon2/pwm2
+ * All of them are driven with the same duty cycle. Once started the engine switches every output to manual mode
+ * (pwmN_enable=1) and restores the original mode when stopped, so that the chip's own control takes over again.
+ *
+ * The duty cycle is the higher of:
+ *   - the one requested by the OS through the PMU (see fan_control_set_duty()), which is what DSM fan modes translate
+ *     to on platforms with a PMU
+ *   - the one from a fixed temperature curve (fan_ctl_levels in the implementation) applied to the hottest cached
+ *     real temperature (see get_hwmon_sensor() & get_cpu_temps()); levels go up as soon as the temperature reaches
+ *     them but go down only once it drops FAN_CTL_HYSTERESIS °C below, so that fans don't hunt around a threshold
+ * Fake readings never drive the fans. If there's neither a requested duty cycle nor a real temperature the fans run at
+ * full speed, as the safe choice.
+ *
+ * The loop runs every "fan_ctl_ms" milliseconds (default FAN_CTL_DEFAULT_MS) and writes to the outputs only when the
+ * duty cycle changes. Requests made through the PMU are applied right away. While running, the interval can be
+ * changed with "fan_ctl_ms" tunable (see internal/helper/tunables.h).
+ */
+#ifndef REDPILL_FAN_CONTROL_H
+#define REDPILL_FAN_CONTROL_H
+
+/**
+ * Parses outputs configured by the user and starts the control loop (noop if no outputs were configured)
+ *
+ * @return 0 on success, -E on error
+ */
+int start_fan_control(void);
+
+/**
+ * Stops the control loop & gives the outputs back to their original mode; it's safe to call it when it wasn't started
+ */
+void stop_fan_control(void);
+
+/**
+ * Sets the duty cycle requested by the OS, used as the minimum for the control loop
+ *
+ * The value is remembered even if the loop isn't running (it will be used once it starts). It must be called from a
+ * context which can sleep.
+ *
+ * @param duty_pct duty cycle in percent (values above 100 are clamped)
+ *
+ * @return 0 on success, -ENODEV if the loop isn't running
+ */
+int fan_control_set_duty(unsigned int duty_pct);
+
+/**
+ * Sets PWM frequency requested by the OS (applied only to outputs which have a pwmN_freq attribute)
+ *
+ * Same rules as for fan_control_set_duty() apply.
+ *
+ * @param hz frequency in Hz
+ *
+ * @return 0 on success, -ENODEV if the loop isn't running
+ */
+int fan_control_set_freq(unsigned int hz);
+
+#endif //REDPILL_FAN_CONTROL_H
@@ -0,0 +1,324 @@
+#include "hwmon_sensors.h"
+#include "../../common.h"
+#include "../../config/platform_types.h" //struct hw_config_hwmon, HWMON_SYS_*_IDS
+#include "../../internal/helper/tunables.h" //register_rp_tunable()
+#include "../../internal/housekeeping.h" //housekeeping_wq()
+#include <linux/moduleparam.h> //module_param_named()
+#include <linux/workqueue.h> //DECLARE_DELAYED_WORK, queue_delayed_work()
+#include <linux/fs.h> //filp_open(), filp_close(), kernel_read()
+#include <linux/jiffies.h> //msecs_to_jiffies()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_*()
+#include <linux/smp.h> //on_each_cpu_mask()
+#include <linux/cpumask.h> //cpu_online_mask, for_each_online_cpu()
+#include <asm/msr.h> //rdmsr_safe()
+#include <asm/msr-index.h> //MSR_IA32_*THERM_STATUS, MSR_IA32_TEMPERATURE_TARGET
+#include <asm/cpufeature.h> //boot_cpu_has(), X86_FEATURE_DTHERM
+
+#define HWMON_POLL_DEFAULT_MS 2000
+#define HWMON_POLL_MIN_MS 100
+#define HWMON_POLL_MAX_MS 600000
+#define HWMON_SRC_SEP ","
+#define HWMON_VALUE_MAX_LEN 24 //longest long with a sign & new line is 21 characters
+
+//The permission is 0 so that these are not exposed in sysfs
+static char *hwmon_src = NULL;
+module_param_named(hwmon_src, hwmon_src, charp, 0000);
+static unsigned int hwmon_poll_ms = HWMON_POLL_DEFAULT_MS;
+module_param_named(hwmon_poll_ms, hwmon_poll_ms, uint, 0000);
+static bool hwmon_cpu_msr = false;
+module_param_named(hwmon_cpu_msr, hwmon_cpu_msr, bool, 0000);
+
+struct hwmon_sensor {
+    char *path; //NULL if there's no source for the sensor
+    int value; //last successful reading, already in the mfgBIOS units
+    bool valid; //whether value was ever read (not a bitfield as it's accessed with ACCESS_ONCE)
+    bool failing; //used to log failures only once
+};
+
+struct hwmon_sensor_kind_desc {
+    const char *name;
+    unsigned int max;
+    int divisor; //hwmon ABI units => mfgBIOS units
+};
+
+static const struct hwmon_sensor_kind_desc kind_descs[HWMON_SENSOR_KINDS] = {
+    [HWMON_SENSOR_THERMAL] = { "thermal", HWMON_SYS_THERMAL_ZONE_IDS, 1000 },
+    [HWMON_SENSOR_VOLTAGE] = { "voltage", HWMON_SYS_VOLTAGE_SENSOR_IDS, 1 },
+    [HWMON_SENSOR_FAN] = { "fan", HWMON_SYS_FAN_RPM_IDS, 1 },
+};
+
+static struct hwmon_sensor thermal_sensors[HWMON_SYS_THERMAL_ZONE_IDS];
+static struct hwmon_sensor voltage_sensors[HWMON_SYS_VOLTAGE_SENSOR_IDS];
+static struct hwmon_sensor fan_sensors[HWMON_SYS_FAN_RPM_IDS];
+static struct hwmon_sensor *sensors[HWMON_SENSOR_KINDS] = {
+    [HWMON_SENSOR_THERMAL] = thermal_sensors,
+    [HWMON_SENSOR_VOLTAGE] = voltage_sensors,
+    [HWMON_SENSOR_FAN] = fan_sensors,
+};
+static bool polling = false;
+
+static void poll_hwmon_sensors(struct work_struct *work);
+static DECLARE_DELAYED_WORK(poll_work, poll_hwmon_sensors);
+
+/**
+ * Reads integer from a sysfs attribute
+ *
+ * The file is opened for every read as sysfs attributes are generated on the first read after open.
+ */
+static int read_sensor_attr(const char *path, long *value)
+{
+    char buf[HWMON_VALUE_MAX_LEN];
+    struct file *file = filp_open(path, O_RDONLY, 0);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+    int len = kernel_read(file, 0, buf, sizeof(buf) - 1);
+    filp_close(file, NULL);
+    if (len < 0)
+        return len;
+
+    buf[len] = '\0';
+    return kstrtol(buf, 10, value); //accepts the trailing new line
+}
+
+static void poll_hwmon_sensors(struct work_struct *work)
+{
+    long raw;
+    int out;
+
+    for (int kind = 0; kind < HWMON_SENSOR_KINDS; ++kind) {
+        for (int i = 0; i < kind_descs[kind].max; ++i) {
+            struct hwmon_sensor *sensor = &sensors[kind][i];
+            if (!sensor->path)
+                continue;
+
+            out = read_sensor_attr(sensor->path, &raw);
+            if (unlikely(out != 0)) {
+                if (!sensor->failing)
+                    pr_loc_wrn("Failed to read %s%d sensor from %s - error=%d", kind_descs[kind].name, i,
+                               sensor->path, out);
+                sensor->failing = true;
+                continue; //the last reading (if any) is kept
+            }
+
+            ACCESS_ONCE(sensor->value) = (int)(raw / kind_descs[kind].divisor);
+            smp_wmb(); //value must be visible before valid
+            ACCESS_ONCE(sensor->valid) = true;
+            sensor->failing = false;
+        }
+    }
+
+    queue_delayed_work(housekeeping_wq(system_long_wq), &poll_work, msecs_to_jiffies(ACCESS_ONCE(hwmon_poll_ms)));
+}
+
+/**
+ * Applies a new interval right away instead of after the currently scheduled (possibly much longer) one
+ */
+static void apply_poll_interval(const struct rp_tunable *tun)
+{
+    mod_delayed_work(housekeeping_wq(system_long_wq), &poll_work, msecs_to_jiffies(hwmon_poll_ms));
+}
+
+static struct rp_tunable poll_tunable = {
+    .name = "hwmon_poll_ms",
+    .value = &hwmon_poll_ms,
+    .min = HWMON_POLL_MIN_MS,
+    .max = HWMON_POLL_MAX_MS,
+    .apply = apply_poll_interval,
+};
+
+/**
+ * @return id of the sensor at a given position in the platform definition (0, i.e. NULL_ID, if there's none)
+ */
+static int get_cfg_sensor_id(const struct hw_config_hwmon *hwc, enum hwmon_sensor_kind kind, unsigned int idx)
+{
+    switch (kind) {
+        case HWMON_SENSOR_THERMAL:
+            return hwc->sys_thermal[idx];
+        case HWMON_SENSOR_VOLTAGE:
+            return hwc->sys_voltage[idx];
+        case HWMON_SENSOR_FAN:
+            return hwc->sys_fan_speed_rpm[idx];
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Parses a single "<kind><n>=<path>" source
+ */
+static int parse_hwmon_src(const struct hw_config_hwmon *hwc, char *entry)
+{
+    char *path = strchr(entry, '=');
+    if (!path || path[1] == '\0') {
+        pr_loc_err("Sensor source \"%s\" has no path", entry);
+        return -EINVAL;
+    }
+    *path++ = '\0';
+
+    for (int kind = 0; kind < HWMON_SENSOR_KINDS; ++kind) {
+        size_t name_len = strlen(kind_descs[kind].name);
+        unsigned int idx;
+        if (strncmp(entry, kind_descs[kind].name, name_len) != 0 || kstrtouint(entry + name_len, 10, &idx) != 0)
+            continue;
+
+        if (idx >= kind_descs[kind].max || get_cfg_sensor_id(hwc, kind, idx) == 0) { //0 is NULL_ID of every kind
+            pr_loc_err("Platform has no %s sensor #%u", kind_descs[kind].name, idx);
+            return -ENOENT;
+        }
+
+        sensors[kind][idx].path = kstrdup(path, GFP_KERNEL);
+        if (unlikely(!sensors[kind][idx].path))
+            kalloc_error_int(sensors[kind][idx].path, strsize(path));
+
+        pr_loc_dbg("Sensor %s%u will be read from %s", kind_descs[kind].name, idx, path);
+        return 0;
+    }
+
+    pr_loc_err("Unknown sensor \"%s\" (expected thermal<n>, voltage<n> or fan<n>)", entry);
+    return -EINVAL;
+}
+
+int start_hwmon_sensors(const struct hw_config_hwmon *hwc)
+{
+    if (polling)
+        return 0; //the mfgBIOS may be shimmed multiple times
+
+    if (!hwmon_src || hwmon_src[0] == '\0') {
+        pr_loc_dbg("No real sensor sources configured - all readings will be emulated");
+        return 0;
+    }
+
+    char *src_copy = kstrdup(hwmon_src, GFP_KERNEL);
+    if (unlikely(!src_copy))
+        kalloc_error_int(src_copy, strsize(hwmon_src));
+
+    int out = 0;
+    char *cursor = src_copy, *entry;
+    while ((entry = strsep(&cursor, HWMON_SRC_SEP)) != NULL) {
+        if (entry[0] != '\0' && (out = parse_hwmon_src(hwc, entry)) != 0)
+            break;
+    }
+    kfree(src_copy);
+
+    if (out != 0) {
+        stop_hwmon_sensors();
+        return out;
+    }
+
+    if (hwmon_poll_ms < HWMON_POLL_MIN_MS) {
+        pr_loc_wrn("Sensors poll interval of %ums is too short - using %ums", hwmon_poll_ms, HWMON_POLL_MIN_MS);
+        hwmon_poll_ms = HWMON_POLL_MIN_MS;
+    }
+
+    polling = true;
+    //First reading ASAP; until then the shim uses fake values
+    queue_delayed_work(housekeeping_wq(system_long_wq), &poll_work, 0);
+    register_rp_tunable(&poll_tunable); //not fatal - the interval just cannot be changed without a reload
+    pr_loc_inf("Polling real sensors every %ums", hwmon_poll_ms);
+
+    return 0;
+}
+
+void stop_hwmon_sensors(void)
+{
+    if (polling) {
+        unregister_rp_tunable(&poll_tunable); //before cancelling, as applying a new interval reschedules the work
+        cancel_delayed_work_sync(&poll_work);
+        polling = false;
+    }
+
+    for (int kind = 0; kind < HWMON_SENSOR_KINDS; ++kind) {
+        for (int i = 0; i < kind_descs[kind].max; ++i) {
+            kfree(sensors[kind][i].path);
+            memset(&sensors[kind][i], 0, sizeof(struct hwmon_sensor));
+        }
+    }
+}
+
+int get_hwmon_sensor(enum hwmon_sensor_kind kind, unsigned int idx, int *value)
+{
+    if (unlikely(kind >= HWMON_SENSOR_KINDS || idx >= kind_descs[kind].max))
+        return -ENODATA;
+
+    if (!ACCESS_ONCE(sensors[kind][idx].valid))
+        return -ENODATA;
+
+    smp_rmb(); //pairs with smp_wmb() in poll_hwmon_sensors()
+    *value = ACCESS_ONCE(sensors[kind][idx].value);
+    return 0;
+}
+
+/*************************************************** CPU temperatures *************************************************/
+#define CPU_TEMP_TTL_MS 1000
+#define CPU_TJMAX_DEFAULT 100 //°C; used when IA32_TEMPERATURE_TARGET cannot be read
+#define THERM_STATUS_VALID BIT(31)
+#define THERM_STATUS_READOUT(low) (((low) >> 16) & 0x7f) //°C below TjMax
+#define TEMP_TARGET_TJMAX(low) (((low) >> 16) & 0xff)
+
+static DEFINE_MUTEX(cpu_temps_lock); //refreshes must not overlap as they share cpu_temps_raw
+static int cpu_temps_raw[NR_CPUS]; //indexed by CPU id, INT_MIN if a CPU has no valid reading
+static int cpu_temps[NR_CPUS]; //compacted in the order of online CPUs
+static unsigned int cpu_temps_num = 0;
+static unsigned long cpu_temps_expire = 0; //jiffies
+
+/**
+ * Reads temperature of the current CPU; called on every CPU at once by on_each_cpu_mask()
+ */
+static void read_local_cpu_temp(void *data)
+{
+    u32 low, high;
+    int tjmax = CPU_TJMAX_DEFAULT;
+    int *temp = &cpu_temps_raw[smp_processor_id()];
+
+    if (rdmsr_safe(MSR_IA32_TEMPERATURE_TARGET, &low, &high) == 0 && TEMP_TARGET_TJMAX(low))
+        tjmax = TEMP_TARGET_TJMAX(low);
+
+    if (rdmsr_safe(MSR_IA32_THERM_STATUS, &low, &high) == 0 && (low & THERM_STATUS_VALID)) {
+        *temp = tjmax - THERM_STATUS_READOUT(low);
+        return;
+    }
+
+    if (boot_cpu_has(X86_FEATURE_PTS) && rdmsr_safe(MSR_IA32_PACKAGE_THERM_STATUS, &low, &high) == 0) {
+        *temp = tjmax - THERM_STATUS_READOUT(low); //package status has no valid bit
+        return;
+    }
+
+    *temp = INT_MIN;
+}
+
+/**
+ * Reads all online CPUs with one cross-CPU call; must be called with cpu_temps_lock held
+ */
+static void refresh_cpu_temps(void)
+{
+    int cpu;
+    unsigned int num = 0;
+
+    get_online_cpus(); //online mask must not change between the call and the compaction below
+    on_each_cpu_mask(cpu_online_mask, read_local_cpu_temp, NULL, true);
+    for_each_online_cpu(cpu) {
+        if (cpu_temps_raw[cpu] != INT_MIN)
+            cpu_temps[num++] = cpu_temps_raw[cpu];
+    }
+    put_online_cpus();
+
+    cpu_temps_num = num;
+    cpu_temps_expire = jiffies + msecs_to_jiffies(CPU_TEMP_TTL_MS);
+}
+
+int get_cpu_temps(int *temps, unsigned int max)
+{
+    if (!hwmon_cpu_msr || !boot_cpu_has(X86_FEATURE_DTHERM))
+        return -ENODATA;
+
+    mutex_lock(&cpu_temps_lock);
+    if (!cpu_temps_num || time_after(jiffies, cpu_temps_expire))
+        refresh_cpu_temps();
+
+    unsigned int num = min(cpu_temps_num, max);
+    memcpy(temps, cpu_temps, sizeof(int) * num);
+    mutex_unlock(&cpu_temps_lock);
+
+    return num ? num : -ENODATA;
+}
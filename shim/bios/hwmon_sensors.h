@@ -0,0 +1,68 @@
+/**
+ * Backend providing real sensor readings for the mfgBIOS HWMON shim
+ *
+ * On bare metal the platform sensors (see struct hw_config_hwmon) can be mapped to sysfs attributes exposed by the
+ * kernel hwmon & thermal subsystems using "hwmon_src" module parameter. It's a list of "<kind><n>=<path>" separated
+ * with ",", where <kind> is one of "thermal", "voltage" or "fan" and <n> is a 0-based position of the sensor in the
+ * platform definition, e.g.:
+ *   hwmon_src=thermal0=/sys/class/thermal/thermal_zone0/temp,fan0=/sys/class/hwmon/hwmon1/fan1_input
+ * Values are expected in the standard hwmon ABI units (m°C for temperatures, mV for voltages, RPM for fans).
+ *
+ * Sensors are read by a worker every "hwmon_poll_ms" milliseconds (default HWMON_POLL_DEFAULT_MS) into a cache, and
+ * mfgBIOS calls are served from that cache only. This way scemd & co. polling never waits on slow I2C/SMBus reads.
+ * Sensors without a source (or which were never read successfully) are reported as not available, so that the shim
+ * can fall back to fake readings. While polling, the interval can be changed with "hwmon_poll_ms" tunable (see
+ * internal/helper/tunables.h).
+ *
+ * CPU temperatures can be read from the digital thermal sensors of every core when "hwmon_cpu_msr" module parameter is
+ * set. All online CPUs are read with a single cross-CPU call (IA32_THERM_STATUS, falling back to
+ * IA32_PACKAGE_THERM_STATUS if the core reading isn't valid) and the result is cached for CPU_TEMP_TTL_MS, so that
+ * tight polling from the UI doesn't IPI every core on every request. This is only possible on bare metal Intel CPUs
+ * (hypervisors usually don't expose these MSRs).
+ */
+#ifndef REDPILL_HWMON_SENSORS_H
+#define REDPILL_HWMON_SENSORS_H
+
+struct hw_config_hwmon;
+
+enum hwmon_sensor_kind {
+    HWMON_SENSOR_THERMAL = 0,
+    HWMON_SENSOR_VOLTAGE,
+    HWMON_SENSOR_FAN,
+    HWMON_SENSOR_KINDS
+};
+
+/**
+ * Parses sources configured by the user and starts polling them (noop if no sources were configured)
+ *
+ * @return 0 on success, -E on error
+ */
+int start_hwmon_sensors(const struct hw_config_hwmon *hwc);
+
+/**
+ * Stops polling & forgets all sources; it's safe to call it when sensors weren't started
+ */
+void stop_hwmon_sensors(void);
+
+/**
+ * Gets the most recent cached reading of a sensor (converted to °C for temperatures)
+ *
+ * @param kind type of the sensor
+ * @param idx position of the sensor in the platform definition
+ * @param value pointer to save the reading to
+ *
+ * @return 0 on success, -ENODATA if there's no real reading for this sensor
+ */
+int get_hwmon_sensor(enum hwmon_sensor_kind kind, unsigned int idx, int *value);
+
+/**
+ * Gets cached per-CPU temperatures (in °C), refreshing them if they're older than CPU_TEMP_TTL_MS
+ *
+ * @param temps array to save temperatures to, in the order of online CPUs
+ * @param max size of the array
+ *
+ * @return number of CPUs saved (i.e. online CPUs, up to max), -ENODATA if real CPU temperatures aren't available
+ */
+int get_cpu_temps(int *temps, unsigned int max);
+
+#endif //REDPILL_HWMON_SENSORS_H
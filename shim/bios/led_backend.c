@@ -0,0 +1,273 @@
+#include "led_backend.h"
+#include "../../common.h"
+#include "../../config/platform_types.h" //struct hw_config
+#include "../../internal/housekeeping.h" //housekeeping_wq()
+#include <linux/gpio.h> //gpio_request_one(), gpio_set_value_cansleep(), gpio_free()
+#include <linux/leds.h> //led_trigger_register_simple(), led_trigger_event(), led_trigger_blink()
+#include <linux/workqueue.h> //DECLARE_DELAYED_WORK, queue_delayed_work()
+#include <linux/jiffies.h> //msecs_to_jiffies()
+#include <linux/spinlock.h> //DEFINE_SPINLOCK, spin_lock_irqsave()
+
+#define LED_UPDATE_MS 50 //max rate of LED writes
+#define LED_BLINK_MS 500 //half-period of emulated blinking
+#define LED_MAP_SEP ","
+#define LED_TARGET_GPIO "gpio:"
+#define LED_TARGET_GPIO_LOW ":low"
+#define LED_TARGET_TRIGGER "trigger:"
+#define LED_DISK_PREFIX "disk"
+
+enum led_target_type {
+    LED_TARGET_NONE = 0,
+    LED_TARGET_GPIO_LINE,
+    LED_TARGET_LED_TRIGGER,
+};
+
+struct led_target {
+    enum led_target_type type;
+    unsigned int gpio;
+    bool active_low;
+    struct led_trigger *trigger;
+    u8 desired; //enum led_backend_state set by the mfgBIOS (accessed with ACCESS_ONCE)
+    u8 applied; //enum led_backend_state last written to the LED (worker only)
+};
+
+static const char *led_names[LED_BACKEND_DISK0] = {
+    [LED_BACKEND_POWER] = "power",
+    [LED_BACKEND_ALARM] = "alarm",
+    [LED_BACKEND_PHY] = "phy",
+    [LED_BACKEND_HDD_ACT] = "hdd_act",
+};
+
+static struct led_target leds[LED_BACKEND_IDS];
+static char *led_map_copy = NULL; //trigger names point into it, so it lives as long as the backend runs
+static bool running = false;
+static bool disks_mapped = false;
+static bool blink_phase = false;
+static DEFINE_SPINLOCK(running_lock); //protects running vs. scheduling the worker
+
+static void update_leds(struct work_struct *work);
+static DECLARE_DELAYED_WORK(update_work, update_leds);
+
+/**
+ * Applies desired states of all LEDs which changed since the last run (and toggles blinking GPIO ones)
+ */
+static void update_leds(struct work_struct *work)
+{
+    bool blinking = false;
+    blink_phase = !blink_phase;
+
+    for (int i = 0; i < LED_BACKEND_IDS; ++i) {
+        struct led_target *led = &leds[i];
+        u8 state = ACCESS_ONCE(led->desired);
+
+        switch (led->type) {
+            case LED_TARGET_NONE:
+                continue;
+
+            case LED_TARGET_GPIO_LINE:
+                if (state == LED_BACKEND_BLINK) {
+                    blinking = true;
+                    gpio_set_value_cansleep(led->gpio, blink_phase ^ led->active_low);
+                } else if (state != led->applied) {
+                    gpio_set_value_cansleep(led->gpio, (state == LED_BACKEND_ON) ^ led->active_low);
+                }
+                break;
+
+            case LED_TARGET_LED_TRIGGER:
+                if (state == led->applied)
+                    break;
+
+                if (state == LED_BACKEND_BLINK) {
+                    unsigned long delay_on = LED_BLINK_MS, delay_off = LED_BLINK_MS;
+                    led_trigger_blink(led->trigger, &delay_on, &delay_off);
+                } else {
+                    led_trigger_event(led->trigger, state == LED_BACKEND_ON ? LED_FULL : LED_OFF);
+                }
+                break;
+        }
+
+        led->applied = state;
+    }
+
+    //blinking GPIOs keep the worker running; any changes made in the meantime will be picked up by the next toggle
+    if (blinking) {
+        unsigned long flags;
+        spin_lock_irqsave(&running_lock, flags);
+        if (running)
+            queue_delayed_work(housekeeping_wq(system_wq), &update_work, msecs_to_jiffies(LED_BLINK_MS));
+        spin_unlock_irqrestore(&running_lock, flags);
+    }
+}
+
+/**
+ * @return id of the LED with a given name or -ENOENT if there's no such LED
+ */
+static int find_led_id(const char *name)
+{
+    for (int i = 0; i < LED_BACKEND_DISK0; ++i) {
+        if (strcmp(led_names[i], name) == 0)
+            return i;
+    }
+
+    unsigned int disk;
+    if (strncmp(name, LED_DISK_PREFIX, strlen_static(LED_DISK_PREFIX)) == 0 &&
+        kstrtouint(name + strlen_static(LED_DISK_PREFIX), 10, &disk) == 0 && disk < LED_BACKEND_MAX_DISKS)
+        return LED_BACKEND_DISK0 + disk;
+
+    return -ENOENT;
+}
+
+/**
+ * Parses a single "<led>=<target>" entry and claims the target
+ */
+static int parse_led_entry(char *entry)
+{
+    char *target = strchr(entry, '=');
+    if (!target) {
+        pr_loc_err("LED \"%s\" has no target", entry);
+        return -EINVAL;
+    }
+    *target++ = '\0';
+
+    int id = find_led_id(entry);
+    if (id < 0) {
+        pr_loc_err("Unknown LED \"%s\" (expected power, alarm, phy, hdd_act or disk<n> up to %d)", entry,
+                   LED_BACKEND_MAX_DISKS - 1);
+        return id;
+    }
+
+    struct led_target *led = &leds[id];
+    if (led->type != LED_TARGET_NONE) {
+        pr_loc_err("LED \"%s\" is mapped more than once", entry);
+        return -EINVAL;
+    }
+
+    if (strncmp(target, LED_TARGET_GPIO, strlen_static(LED_TARGET_GPIO)) == 0) {
+        char *gpio = target + strlen_static(LED_TARGET_GPIO);
+        size_t gpio_len = strlen(gpio);
+        if (gpio_len > strlen_static(LED_TARGET_GPIO_LOW) &&
+            strcmp(gpio + gpio_len - strlen_static(LED_TARGET_GPIO_LOW), LED_TARGET_GPIO_LOW) == 0) {
+            led->active_low = true;
+            gpio[gpio_len - strlen_static(LED_TARGET_GPIO_LOW)] = '\0';
+        }
+
+        if (kstrtouint(gpio, 10, &led->gpio) != 0 || !gpio_is_valid(led->gpio)) {
+            pr_loc_err("LED \"%s\" GPIO \"%s\" is invalid", entry, gpio);
+            return -EINVAL;
+        }
+
+        int out = gpio_request_one(led->gpio, led->active_low ? GPIOF_OUT_INIT_HIGH : GPIOF_OUT_INIT_LOW, "led");
+        if (out != 0) {
+            pr_loc_err("Failed to claim GPIO %u for LED \"%s\" - error=%d", led->gpio, entry, out);
+            return out;
+        }
+
+        led->type = LED_TARGET_GPIO_LINE;
+        pr_loc_dbg("LED \"%s\" mapped to GPIO %u%s", entry, led->gpio, led->active_low ? " (active low)" : "");
+    } else if (strncmp(target, LED_TARGET_TRIGGER, strlen_static(LED_TARGET_TRIGGER)) == 0 &&
+               target[strlen_static(LED_TARGET_TRIGGER)] != '\0') {
+        const char *name = target + strlen_static(LED_TARGET_TRIGGER);
+        led_trigger_register_simple(name, &led->trigger);
+        if (!led->trigger) {
+            pr_loc_err("Failed to register LED trigger \"%s\" for LED \"%s\"", name, entry);
+            return -ENOMEM;
+        }
+
+        led->type = LED_TARGET_LED_TRIGGER;
+        pr_loc_dbg("LED \"%s\" mapped to LED trigger \"%s\"", entry, name);
+    } else {
+        pr_loc_err("LED \"%s\" target \"%s\" is invalid (expected gpio:<n>[:low] or trigger:<name>)", entry, target);
+        return -EINVAL;
+    }
+
+    led->desired = led->applied = LED_BACKEND_OFF;
+    if (id >= LED_BACKEND_DISK0)
+        disks_mapped = true;
+
+    return 0;
+}
+
+int start_led_backend(const struct hw_config *hw)
+{
+    if (running)
+        return 0; //the mfgBIOS may be shimmed multiple times
+
+    if (!hw->led_map || hw->led_map[0] == '\0') {
+        pr_loc_dbg("Platform has no LEDs mapping - all LEDs will be nullified");
+        return 0;
+    }
+
+    led_map_copy = kstrdup(hw->led_map, GFP_KERNEL);
+    if (unlikely(!led_map_copy))
+        kalloc_error_int(led_map_copy, strsize(hw->led_map));
+
+    int out = 0;
+    char *cursor = led_map_copy, *entry;
+    while ((entry = strsep(&cursor, LED_MAP_SEP)) != NULL) {
+        if (entry[0] != '\0' && (out = parse_led_entry(entry)) != 0)
+            break;
+    }
+
+    if (out != 0) {
+        stop_led_backend();
+        return out;
+    }
+
+    running = true;
+    pr_loc_inf("Real LEDs backend started");
+
+    return 0;
+}
+
+void stop_led_backend(void)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&running_lock, flags);
+    running = false;
+    spin_unlock_irqrestore(&running_lock, flags);
+    cancel_delayed_work_sync(&update_work);
+
+    for (int i = 0; i < LED_BACKEND_IDS; ++i) {
+        struct led_target *led = &leds[i];
+        if (led->type == LED_TARGET_GPIO_LINE)
+            gpio_free(led->gpio);
+        else if (led->type == LED_TARGET_LED_TRIGGER)
+            led_trigger_unregister_simple(led->trigger);
+    }
+
+    memset(leds, 0, sizeof(leds));
+    disks_mapped = false;
+    kfree(led_map_copy);
+    led_map_copy = NULL;
+}
+
+bool led_backend_has(enum led_backend_id id)
+{
+    return id < LED_BACKEND_IDS && leds[id].type != LED_TARGET_NONE;
+}
+
+bool led_backend_has_disks(void)
+{
+    return disks_mapped;
+}
+
+int led_backend_set(enum led_backend_id id, enum led_backend_state state)
+{
+    if (unlikely(!led_backend_has(id)))
+        return -ENODEV;
+
+    //activity LEDs are set over and over with the same state - there's nothing to do (and no reason to reschedule)
+    if (ACCESS_ONCE(leds[id].desired) == state)
+        return 0;
+
+    ACCESS_ONCE(leds[id].desired) = state;
+
+    unsigned long flags;
+    spin_lock_irqsave(&running_lock, flags);
+    if (likely(running))
+        //noop if it's already pending
+        queue_delayed_work(housekeeping_wq(system_wq), &update_work, msecs_to_jiffies(LED_UPDATE_MS));
+    spin_unlock_irqrestore(&running_lock, flags);
+
+    return 0;
+}
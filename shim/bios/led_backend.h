@@ -0,0 +1,74 @@
+/**
+ * Backend driving real LEDs for the mfgBIOS LED vtable entries
+ *
+ * On bare metal the LEDs controlled by the mfgBIOS can be mapped to GPIO lines or to Linux "leds" class devices using
+ * the "leds" field of struct hw_config (see led_map and config/platform_desc.h). It's a list of "<led>=<target>"
+ * separated with ",", where <led> is one of "power", "alarm", "phy", "hdd_act" or "disk<n>" (<n> as numbered by the
+ * mfgBIOS), and the <target> is:
+ *   gpio:<n>[:low]     GPIO line number <n>, optionally active-low
+ *   trigger:<name>     LED trigger registered under <name>; any "leds" class device can be attached to it with
+ *                      "echo <name> > /sys/class/leds/<device>/trigger"
+ * e.g.: leds=power=gpio:12,disk1=trigger:disk1,disk2=trigger:disk2
+ * LEDs which aren't mapped keep being nullified by the shim.
+ *
+ * The mfgBIOS (especially for the HDD activity) can update LEDs at a very high rate. Calls only record the desired
+ * state and the LEDs are updated by a worker at most every LED_UPDATE_MS (with all changes made in the meantime
+ * coalesced into one write), so that a busy array doesn't make LED writes (which for e.g. GPIO expanders on I2C are
+ * slow and may sleep) a hot path. Blinking of GPIO LEDs is emulated by the same worker.
+ */
+#ifndef REDPILL_LED_BACKEND_H
+#define REDPILL_LED_BACKEND_H
+
+#include <linux/types.h> //bool
+
+struct hw_config;
+
+#define LED_BACKEND_MAX_DISKS 16
+
+enum led_backend_id {
+    LED_BACKEND_POWER = 0,
+    LED_BACKEND_ALARM,
+    LED_BACKEND_PHY,
+    LED_BACKEND_HDD_ACT,
+    LED_BACKEND_DISK0,
+    LED_BACKEND_IDS = LED_BACKEND_DISK0 + LED_BACKEND_MAX_DISKS
+};
+
+enum led_backend_state {
+    LED_BACKEND_OFF = 0,
+    LED_BACKEND_ON,
+    LED_BACKEND_BLINK,
+};
+
+/**
+ * Parses LEDs mapping of the platform and claims their GPIOs/triggers (noop if the platform has no mapping)
+ *
+ * @return 0 on success, -E on error
+ */
+int start_led_backend(const struct hw_config *hw);
+
+/**
+ * Releases all LEDs (leaving them in their current state); it's safe to call it when the backend wasn't started
+ */
+void stop_led_backend(void);
+
+/**
+ * @return whether a given LED is mapped to a real one
+ */
+bool led_backend_has(enum led_backend_id id);
+
+/**
+ * @return whether any of the disk LEDs is mapped to a real one
+ */
+bool led_backend_has_disks(void);
+
+/**
+ * Requests a change of the LED state; the change is applied asynchronously (see file header)
+ *
+ * It may be called from any context.
+ *
+ * @return 0 on success, -ENODEV if the LED isn't mapped
+ */
+int led_backend_set(enum led_backend_id id, enum led_backend_state state);
+
+#endif //REDPILL_LED_BACKEND_H
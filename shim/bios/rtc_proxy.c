@@ -10,8 +10,17 @@
  * MC146818 interface. Thus, this module assumes that mfgBIOS calls can be proxied to MC146818 interface (which will
  * work on any ACPI-complaint system and any sane hypervisor).
  *
- * As some of the functions are rarely used (and often even completely broken on many systems), like RTC wakeup they're
- * not really implemented but instead mocked to look "just good enough".
+ * Auto power-on (i.e. RTC wakeup) schedule set by the mfgBIOS is translated to the next wake time, which is programmed
+ * as an alarm of the RTC class device (usually rtc-cmos, which also handles ACPI day/month alarms). The wake time is
+ * only computed when the schedule changes, and it's re-armed after it passes while the system is running.
+ *
+ * RTC CACHE
+ * Every CMOS read is a port I/O round trip (very slow under a hypervisor) done with interrupts disabled, and mfgBIOS
+ * asks for the time quite often. When "rtc_sync_s" module parameter is set the RTC is read only once per that many
+ * seconds: each read records the offset between the RTC and the kernel wall clock, and the time is derived from
+ * ktime_get_real() + offset until the next resync. Setting the time resyncs the offset without reading the CMOS. The
+ * offset is kept in whole seconds, which is the RTC resolution anyway. The period can be changed at runtime with
+ * "rtc_sync_s" tunable (see internal/helper/tunables.h).
  *
  * References:
  *  - https://www.kernel.org/doc/html/latest/admin-guide/rtc.html
@@ -20,8 +29,16 @@
 #include "../../common.h"
 #include "rtc_proxy.h"
 #include "../shim_base.h" //shim_*()
+#include "../../internal/helper/tunables.h" //register_rp_tunable()
+#include "../../internal/housekeeping.h" //housekeeping_wq()
 #include <linux/mc146818rtc.h>
 #include <linux/bcd.h>
+#include <linux/rtc.h> //struct rtc_time, rtc_tm_to_time(), rtc_time_to_tm()
+#include <linux/ktime.h> //ktime_get_real()
+#include <linux/jiffies.h> //time_before(), jiffies
+#include <linux/moduleparam.h> //module_param_named()
+#include <linux/workqueue.h> //DECLARE_DELAYED_WORK, queue_delayed_work()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_*()
 
 #define SHIM_NAME "RTC proxy"
 
@@ -34,6 +51,14 @@ static const unsigned char months_to_days[] = {31, 28, 31, 30, 31, 30, 31, 31, 3
 
 static struct MfgCompatAutoPwrOn *auto_power_on_mock = NULL;
 
+#define RTC_SYNC_MAX_S 86400 //the RTC drifts from the wall clock (e.g. NTP), so it must be looked at once in a while
+//How often (in seconds) the RTC offset is resynced from the CMOS; 0 disables the cache. Not exposed in sysfs.
+static unsigned int rtc_sync_s = 0;
+module_param_named(rtc_sync_s, rtc_sync_s, uint, 0000);
+static DEFINE_SPINLOCK(rtc_cache_lock); //protects the two below
+static long rtc_offset_s = 0; //RTC time minus wall clock
+static unsigned long rtc_offset_expire = 0; //jiffies; 0 = never synced
+
 inline static void debug_print_mfg_time(struct MfgCompatTime *mfgTime)
 {
     pr_loc_dbg("MfgCompatTime raw data: sec=%u min=%u hr=%u wkd=%u day=%u mth=%u yr=%u", mfgTime->second,
@@ -119,6 +144,82 @@ static void write_rtc_num(unsigned char yy, unsigned char mm, unsigned char dd,
     spin_unlock_irqrestore(&rtc_lock, flags);
 }
 
+/********************************************** RTC cache (see file header) *******************************************/
+static __always_inline long get_wall_seconds(void)
+{
+    return (long)div_s64(ktime_to_ns(ktime_get_real()), NSEC_PER_SEC);
+}
+
+static void mfg_time_to_rtc_tm(const struct MfgCompatTime *mfgTime, struct rtc_time *tm)
+{
+    //Both count years since 1900 and use 0-based months
+    memset(tm, 0, sizeof(struct rtc_time));
+    tm->tm_year = mfgTime->year;
+    tm->tm_mon = mfgTime->month;
+    tm->tm_mday = mfgTime->day;
+    tm->tm_hour = mfgTime->hours;
+    tm->tm_min = mfgTime->minute;
+    tm->tm_sec = mfgTime->second;
+}
+
+/**
+ * Records offset between the given RTC time and the wall clock
+ */
+static void sync_rtc_offset(const struct MfgCompatTime *mfgTime)
+{
+    unsigned int sync_s = ACCESS_ONCE(rtc_sync_s); //it can be changed at runtime
+    if (!sync_s)
+        return;
+
+    struct rtc_time tm;
+    unsigned long rtc_secs;
+    mfg_time_to_rtc_tm(mfgTime, &tm);
+    rtc_tm_to_time(&tm, &rtc_secs);
+
+    spin_lock(&rtc_cache_lock);
+    rtc_offset_s = (long)rtc_secs - get_wall_seconds();
+    rtc_offset_expire = jiffies + sync_s * HZ;
+    if (unlikely(!rtc_offset_expire))
+        rtc_offset_expire = 1; //0 is reserved for "never synced"
+    spin_unlock(&rtc_cache_lock);
+
+    pr_loc_dbg("RTC offset synced to %lds (next resync in %us)", rtc_offset_s, sync_s);
+}
+
+/**
+ * Derives the RTC time from the wall clock if the offset is fresh enough
+ *
+ * @return true if mfgTime was filled, false if the RTC needs to be read
+ */
+static bool get_cached_rtc_time(struct MfgCompatTime *mfgTime)
+{
+    long offset;
+
+    if (!ACCESS_ONCE(rtc_sync_s))
+        return false;
+
+    spin_lock(&rtc_cache_lock);
+    bool fresh = rtc_offset_expire && time_before(jiffies, rtc_offset_expire);
+    offset = rtc_offset_s;
+    spin_unlock(&rtc_cache_lock);
+
+    if (!fresh)
+        return false;
+
+    struct rtc_time tm;
+    rtc_time_to_tm((unsigned long)(get_wall_seconds() + offset), &tm);
+    mfgTime->year = tm.tm_year;
+    mfgTime->month = tm.tm_mon;
+    mfgTime->day = tm.tm_mday;
+    mfgTime->wkday = tm.tm_wday;
+    mfgTime->hours = tm.tm_hour;
+    mfgTime->minute = tm.tm_min;
+    mfgTime->second = tm.tm_sec;
+
+    return true;
+}
+
+/************************************************ mfgBIOS RTC interface ***********************************************/
 int rtc_proxy_get_time(struct MfgCompatTime *mfgTime)
 {
     if (mfgTime == NULL) {
@@ -128,6 +229,13 @@ int rtc_proxy_get_time(struct MfgCompatTime *mfgTime)
 
     debug_print_mfg_time(mfgTime);
 
+    if (get_cached_rtc_time(mfgTime)) {
+        pr_loc_dbg("Time derived from cached RTC offset is %4d-%02d-%02d %2d:%02d:%02d (UTC)",
+                   mfg_year_to_full(mfgTime->year), mfg_month_to_normal(mfgTime->month), mfgTime->day,
+                   mfgTime->hours, mfgTime->minute, mfgTime->second);
+        return 0;
+    }
+
     unsigned char rtc_year; //mfgTime uses offset from 1900 while RTC uses 2-digit format (see below)
     unsigned char rtc_month; //mfgTime uses 0-11 while RTC uses 1-12
     read_rtc_num(&rtc_year, &rtc_month, &mfgTime->day, &mfgTime->wkday, &mfgTime->hours, &mfgTime->minute,
@@ -145,6 +253,7 @@ int rtc_proxy_get_time(struct MfgCompatTime *mfgTime)
     pr_loc_inf("Time got from RTC is %4d-%02d-%02d %2d:%02d:%02d (UTC)", mfg_year_to_full(mfgTime->year),
                mfg_month_to_normal(mfgTime->month), mfgTime->day, mfgTime->hours, mfgTime->minute, mfgTime->second);
     debug_print_mfg_time(mfgTime);
+    sync_rtc_offset(mfgTime);
 
     return 0;
 }
@@ -192,6 +301,7 @@ int rtc_proxy_set_time(struct MfgCompatTime *mfgTime)
     unsigned char rtc_month = mfg_month_to_normal(mfgTime->month); //mfgTime uses 0-11 while RTC uses 1-12
     
     write_rtc_num(rtc_year, rtc_month, mfgTime->day, mfgTime->wkday, mfgTime->hours, mfgTime->minute, mfgTime->second);
+    sync_rtc_offset(mfgTime); //no need to read back what we just wrote
 
     pr_loc_inf("RTC time set to %4d-%02d-%02d %2d:%02d:%02d (UTC)", mfg_year_to_full(mfgTime->year),
                mfg_month_to_normal(mfgTime->month), mfgTime->day, mfgTime->hours, mfgTime->minute, mfgTime->second);
@@ -199,6 +309,117 @@ int rtc_proxy_set_time(struct MfgCompatTime *mfgTime)
     return 0;
 }
 
+/************************************************ Auto power-on schedule *********************************************/
+#ifdef CONFIG_RTC_HCTOSYS_DEVICE
+#define WAKE_RTC_DEVICE CONFIG_RTC_HCTOSYS_DEVICE
+#else
+#define WAKE_RTC_DEVICE "rtc0"
+#endif
+#define WAKE_REARM_DELAY_S 60 //after the wake time passes (i.e. we were running anyway) the next one is armed this late
+#define RTC_SECS_PER_DAY 86400
+
+static DEFINE_MUTEX(auto_power_on_lock); //protects the schedule & the alarm programming
+static void rearm_auto_power_on(struct work_struct *work);
+static DECLARE_DELAYED_WORK(auto_power_on_rearm_work, rearm_auto_power_on);
+
+/**
+ * Finds the earliest event from the schedule after a given time
+ *
+ * @param now current RTC time in seconds since epoch
+ *
+ * @return wake time in seconds since epoch, or 0 if the schedule has no valid events
+ */
+static unsigned long find_next_wake(const struct MfgCompatAutoPwrOn *sched, unsigned long now)
+{
+    unsigned long next = 0;
+    unsigned long midnight = now - (now % RTC_SECS_PER_DAY);
+    int events_num = min_t(int, sched->num, ARRAY_SIZE(sched->events));
+
+    for (int i = 0; i < events_num; ++i) {
+        const struct MfgCompatRtcEvent *event = &sched->events[i];
+        unsigned int hours = bcd2bin(event->hours);
+        unsigned int minutes = bcd2bin(event->minutes);
+        if (unlikely(hours > 23 || minutes > 59 || !(event->weekdays & 0x7f))) {
+            pr_loc_wrn("Ignoring invalid auto power-on event #%d (hours=%02x minutes=%02x weekdays=%02x)", i,
+                       event->hours, event->minutes, event->weekdays);
+            continue;
+        }
+
+        //The event may still happen today, or any day within a week (incl. the same weekday next week)
+        for (int day = 0; day <= 7; ++day) {
+            unsigned long candidate = midnight + day * RTC_SECS_PER_DAY + hours * 3600 + minutes * 60;
+            unsigned int wday = (candidate / RTC_SECS_PER_DAY + 4) % 7; //1970-01-01 was a Thursday; 0 = Sunday
+            if (candidate <= now || !(event->weekdays & BIT(wday)))
+                continue;
+
+            if (!next || candidate < next)
+                next = candidate;
+            break;
+        }
+    }
+
+    return next;
+}
+
+/**
+ * Programs the RTC alarm from the current schedule (or disables it) & schedules re-arming after the wake time passes
+ *
+ * Must be called with auto_power_on_lock held.
+ */
+static int program_auto_power_on(void)
+{
+    char rtc_name[] = WAKE_RTC_DEVICE; //rtc_class_open() takes a non-const name on older kernels
+    struct rtc_wkalrm alarm = { .enabled = 0 };
+    unsigned long now, next = 0;
+    int out;
+
+    cancel_delayed_work(&auto_power_on_rearm_work);
+
+    struct rtc_device *rtc = rtc_class_open(rtc_name);
+    if (unlikely(!rtc)) {
+        pr_loc_err("RTC device %s is not available - auto power-on cannot be scheduled", rtc_name);
+        return -ENODEV;
+    }
+
+    if ((out = rtc_read_time(rtc, &alarm.time)) != 0) {
+        pr_loc_err("Failed to read time from %s - error=%d", rtc_name, out);
+        goto out_close;
+    }
+    rtc_tm_to_time(&alarm.time, &now);
+
+    if (auto_power_on_mock->enabled)
+        next = find_next_wake(auto_power_on_mock, now);
+
+    if (!next) {
+        pr_loc_dbg("No auto power-on event scheduled - disabling the RTC alarm");
+        out = rtc_alarm_irq_enable(rtc, 0);
+        goto out_close;
+    }
+
+    rtc_time_to_tm(next, &alarm.time);
+    alarm.enabled = 1;
+    if ((out = rtc_set_alarm(rtc, &alarm)) != 0) {
+        pr_loc_err("Failed to set %s alarm - error=%d", rtc_name, out);
+        goto out_close;
+    }
+
+    pr_loc_inf("Auto power-on scheduled at %4d-%02d-%02d %2d:%02d (RTC time)", alarm.time.tm_year + 1900,
+               alarm.time.tm_mon + 1, alarm.time.tm_mday, alarm.time.tm_hour, alarm.time.tm_min);
+    queue_delayed_work(housekeeping_wq(system_wq), &auto_power_on_rearm_work, (next - now + WAKE_REARM_DELAY_S) * HZ);
+
+    out_close:
+    rtc_class_close(rtc);
+    return out;
+}
+
+static void rearm_auto_power_on(struct work_struct *work)
+{
+    mutex_lock(&auto_power_on_lock);
+    if (likely(auto_power_on_mock))
+        program_auto_power_on();
+    mutex_unlock(&auto_power_on_lock);
+}
+
 int rtc_proxy_init_auto_power_on(void)
 {
     pr_loc_dbg("RTC power-on \"enabled\" via %s", __FUNCTION__);
@@ -213,10 +434,16 @@ int rtc_proxy_get_auto_power_on(struct MfgCompatAutoPwrOn *mfgPwrOn)
         return -EINVAL;
     }
 
-    pr_loc_dbg("Mocking auto-power GET on RTC");
-    memcpy(mfgPwrOn, auto_power_on_mock, sizeof(struct MfgCompatAutoPwrOn));
+    pr_loc_dbg("Returning auto-power schedule from RTC proxy");
+    int out = 0;
+    mutex_lock(&auto_power_on_lock);
+    if (likely(auto_power_on_mock))
+        memcpy(mfgPwrOn, auto_power_on_mock, sizeof(struct MfgCompatAutoPwrOn));
+    else
+        out = -EINVAL; //unregistered in the meantime
+    mutex_unlock(&auto_power_on_lock);
 
-    return 0;
+    return out;
 }
 
 int rtc_proxy_set_auto_power_on(struct MfgCompatAutoPwrOn *mfgPwrOn)
@@ -226,19 +453,59 @@ int rtc_proxy_set_auto_power_on(struct MfgCompatAutoPwrOn *mfgPwrOn)
         return -EINVAL;
     }
 
-    pr_loc_dbg("Mocking auto-power SET on RTC");
-    memcpy(auto_power_on_mock, mfgPwrOn, sizeof(struct MfgCompatAutoPwrOn));
+    if (unlikely(!auto_power_on_mock)) {
+        pr_loc_bug("Auto power-on mock is not initialized - did you forget to call register?");
+        return -EINVAL;
+    }
+
+    pr_loc_dbg("Setting auto-power schedule on RTC");
+    int out = -EINVAL; //unregistered in the meantime
+    mutex_lock(&auto_power_on_lock);
+    if (likely(auto_power_on_mock)) {
+        memcpy(auto_power_on_mock, mfgPwrOn, sizeof(struct MfgCompatAutoPwrOn));
+        out = program_auto_power_on(); //the next wake is computed only here, when the schedule changes
+    }
+    mutex_unlock(&auto_power_on_lock);
 
-    return 0;
+    return out;
 }
 
 int rtc_proxy_uinit_auto_power_on(void)
 {
     pr_loc_dbg("RTC power-on \"disabled\" via %s", __FUNCTION__);
 
-    return 0;
+    if (unlikely(!auto_power_on_mock))
+        return 0;
+
+    int out = 0;
+    mutex_lock(&auto_power_on_lock);
+    if (likely(auto_power_on_mock)) {
+        auto_power_on_mock->enabled = false;
+        out = program_auto_power_on();
+    }
+    mutex_unlock(&auto_power_on_lock);
+
+    return out;
 }
 
+/**
+ * Drops the cached offset so that the new sync period is used from the very next read
+ */
+static void apply_rtc_sync(const struct rp_tunable *tun)
+{
+    spin_lock(&rtc_cache_lock);
+    rtc_offset_expire = 0;
+    spin_unlock(&rtc_cache_lock);
+}
+
+static struct rp_tunable rtc_sync_tunable = {
+    .name = "rtc_sync_s",
+    .value = &rtc_sync_s,
+    .min = 0,
+    .max = RTC_SYNC_MAX_S,
+    .apply = apply_rtc_sync,
+};
+
 int unregister_rtc_proxy_shim(void)
 {
     shim_ureg_in();
@@ -249,8 +516,15 @@ int unregister_rtc_proxy_shim(void)
         return 0;
     }
 
-    kfree(auto_power_on_mock);
+    unregister_rp_tunable(&rtc_sync_tunable);
+    //Once the mock is gone nothing can queue the rearm again, so it must be cancelled after it's NULLed under the lock
+    mutex_lock(&auto_power_on_lock);
+    struct MfgCompatAutoPwrOn *mock = auto_power_on_mock;
     auto_power_on_mock = NULL;
+    mutex_unlock(&auto_power_on_lock);
+    cancel_delayed_work_sync(&auto_power_on_rearm_work); //the alarm itself stays armed as the schedule is still valid
+    kfree(mock);
+    rtc_offset_expire = 0; //the RTC will be read again on the next registration
     shim_ureg_ok();
     return 0;
 }
@@ -265,6 +539,7 @@ int register_rtc_proxy_shim(void)
     }
 
     kzalloc_or_exit_int(auto_power_on_mock, sizeof(struct MfgCompatAutoPwrOn));
+    register_rp_tunable(&rtc_sync_tunable); //not fatal - the cache just cannot be tuned without a reload
     shim_reg_ok();
     return 0;
 }
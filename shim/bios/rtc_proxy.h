@@ -16,8 +16,9 @@ int rtc_proxy_set_time(struct MfgCompatTime *mfgTime);
 /**
  * Enables auto-power on functionality (shims VTK_RTC_INT_APWR).
  *
- * This is not REALLY implemented and only shimmed. Many motherboards don't handle it well or only support it from
- * certain ACPI PSTATEs. It is even more unsupported by hypervisors. If you REALLY need it create a bug report or a PR.
+ * The schedule is programmed as a wake alarm of the RTC class device when it's set (see rtc_proxy_set_auto_power_on()).
+ * Many motherboards don't handle RTC wakeup well or only support it from certain ACPI S-states. It is even more
+ * unsupported by hypervisors.
  */
 int rtc_proxy_init_auto_power_on(void);
 
@@ -28,6 +29,8 @@ int rtc_proxy_get_auto_power_on(struct MfgCompatAutoPwrOn *mfgPwrOn);
 
 /**
  * Sets time for auto-power on (shims VTK_RTC_SET_APWR). **See note for rtc_proxy_init_auto_power_on()**
+ *
+ * The next wake time is computed from the schedule & programmed into the RTC alarm right away.
  */
 int rtc_proxy_set_auto_power_on(struct MfgCompatAutoPwrOn *mfgPwrOn);
 
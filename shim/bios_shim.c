@@ -55,7 +55,9 @@
 #include "../internal/helper/symbol_helper.h" //kernel_has_symbol()
 #include "bios/bios_shims_collection.h" //shim_bios_module(), unshim_bios_module(), shim_bios_disk_leds_ctrl()
 #include "bios/bios_hwcap_shim.h" //register_bios_hwcap_shim(), unregister_bios_hwcap_shim(), reset_bios_hwcap_shim()
-#include <linux/notifier.h> //module notification
+#include "bios/bios_hwmon_shim.h" //reset_bios_module_hwmon_shim()
+#include "../internal/event_bus.h" //subscribe_rp_events(), unsubscribe_rp_events()
+#include <linux/notifier.h> //NOTIFY_*
 #include <linux/module.h> //struct module
 
 static bool bios_shimmed = false;
@@ -70,30 +72,29 @@ static inline int disable_symbols_capture(void);
 /**
  * Unified way to determine if a given module is a bios module (as this is not a simple == check)
  */
+#define BIOS_MODULE_SUFFIX "_synobios"
 static inline bool is_bios_module(const char *name)
 {
     char *separator_pos = strrchr(name, '_'); //bios will be named e.g. bromolow_synobios - find's the last _
 
     //Check if it's synobios or sth else really
-    return (separator_pos && strcmp(separator_pos, "_synobios") == 0);
+    return (separator_pos && strcmp(separator_pos, BIOS_MODULE_SUFFIX) == 0);
 }
 
 /**
- * Handles notifications regarding modules loading. It will only perform actions on modules matching is_bios_module()
+ * Handles notifications regarding modules loading. The event bus only delivers them for modules matching
+ * is_bios_module().
  *
  * This is constantly loaded to provide useful error information in case the bios module goes away (it shouldn't). In
  * non-dev builds it can probably just go away.
  *
  * @return NOTIFY_* const
  */
-static int bios_module_notifier_handler(struct notifier_block * self, unsigned long state, void * data)
+static int bios_module_notifier_handler(const rp_event_sub *sub, rp_event_kind kind, void *data)
 {
     struct module *mod = data;
 
-    if (!is_bios_module(mod->name))
-        return NOTIFY_OK;
-
-    if (state == MODULE_STATE_GOING) {
+    if (kind == RP_EVT_MODULE_GOING) {
         //So this is actually not a problem with RP but rather with the bios module - it cannot be unloaded at will.
         //As soon as you try it will cause a circular error with page faults and the kernel will demand a reboot
         //We're not unregistering notifier in case one day this is fixed by the bios module ¯\_(ツ)_/¯
@@ -121,12 +122,11 @@ static int bios_module_notifier_handler(struct notifier_block * self, unsigned l
         return NOTIFY_OK;
     }
 
-    if (state == MODULE_STATE_LIVE) {
+    if (kind == RP_EVT_MODULE_LIVE) {
         bios_shimmed = true;
         pr_loc_inf("%s BIOS *fully* shimmed", mod->name);
-    } else { //MODULE_STATE_COMING or MODULE_STATE_UNFORMED [but most likely actually MODULE_STATE_COMING]
-        if (likely(state == MODULE_STATE_COMING))
-            register_bios_hwcap_shim(hw_config);
+    } else { //RP_EVT_MODULE_COMING
+        register_bios_hwcap_shim(hw_config);
 
         pr_loc_inf("%s BIOS *early* shimmed", mod->name);
     }
@@ -134,9 +134,13 @@ static int bios_module_notifier_handler(struct notifier_block * self, unsigned l
     return NOTIFY_OK;
 }
 
-static struct notifier_block bios_notifier_block = {
-    .notifier_call = bios_module_notifier_handler
+static rp_event_sub bios_module_sub = {
+    .fn = bios_module_notifier_handler,
+    .kinds = RP_EVT_MODULE_ALL,
+    .module_suffix = BIOS_MODULE_SUFFIX,
+    .usb_class = RP_EVT_ANY_USB_CLASS,
 };
+
 /**
  * Registers module notifier to modify vtable as soon as module finishes loading
  *
@@ -160,9 +164,9 @@ static int register_bios_module_notifier(void)
         return -EDEADLOCK;
     }
 
-    int out = register_module_notifier(&bios_notifier_block);
+    int out = subscribe_rp_events(&bios_module_sub);
     if(unlikely(out != 0)) {
-        pr_loc_err("Failed to register module notifier"); //Currently it's impossible to happen... currently
+        pr_loc_err("Failed to subscribe to module events - error=%d", out);
         return out;
     }
 
@@ -184,9 +188,9 @@ static int unregister_bios_module_notifier(void)
         return -ENOMEDIUM;
     }
 
-    int out = unregister_module_notifier(&bios_notifier_block);
+    int out = unsubscribe_rp_events(&bios_module_sub);
     if(unlikely(out != 0)) {
-        pr_loc_err("Failed to unregister module notifier");
+        pr_loc_err("Failed to unsubscribe from module events - error=%d", out);
         return out;
     }
 
@@ -262,6 +266,8 @@ int unregister_bios_shim(void)
     if (likely(bios_shimmed)) {
         if (!unshim_bios_module(vtable_start, vtable_end))
             return -EINVAL;
+    } else {
+        reset_bios_module_hwmon_shim(); //it may be only early-shimmed, with sensors polling already running
     }
 
     out = unregister_bios_module_notifier();
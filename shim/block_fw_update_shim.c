@@ -80,7 +80,7 @@ int unregister_fw_update_shim(void)
 {
     shim_ureg_in();
 
-    //Do not remove execve registration here - it will be cleared in one sweep during unregister of interceptor
+    remove_blocked_execve_filename(FW_UPDATE_PATH); //may already be gone if the interceptor was unregistered first
     unpatch_dmi();
 
     shim_ureg_ok();
@@ -1,7 +1,7 @@
 #include "boot_shim_base.h"
 #include "../../common.h"
 #include "../../config/runtime_config.h" //struct boot_media
-#include "../../internal/scsi/scsi_toolbox.h" //is_sata_disk(), opportunistic_read_capacity()
+#include "../../internal/scsi/scsi_toolbox.h" //is_sata_disk(), opportunistic_read_capacity(), scsi_get_unit_serial()
 #include <scsi/scsi_device.h> //struct scsi_device
 #include <linux/usb.h> //struct usb_device
 
@@ -23,37 +23,153 @@ void *get_shimmed_boot_dev(void)
     return mapped_shim_data;
 }
 
-bool scsi_is_boot_dev_target(const struct boot_media *boot_dev_config, struct scsi_device *sdp)
+int find_usb_boot_candidate(const struct boot_media *boot_dev_config, struct usb_device *usb_device)
+{
+    u16 vid = le16_to_cpu(usb_device->descriptor.idVendor);
+    u16 pid = le16_to_cpu(usb_device->descriptor.idProduct);
+
+    for (unsigned int i = 0; i < boot_dev_config->candidates_num; ++i) {
+        const struct boot_media_candidate *cand = &boot_dev_config->candidates[i];
+        if (cand->type != BOOT_MEDIA_USB)
+            continue;
+
+        //Empty VID or PID matches any device (as it always did with "vid="/"pid=")
+        if (cand->vid != VID_PID_EMPTY && cand->pid != VID_PID_EMPTY && (cand->vid != vid || cand->pid != pid))
+            continue;
+
+        if (cand->serial[0] != '\0' && (!usb_device->serial || strcmp(usb_device->serial, cand->serial) != 0))
+            continue;
+
+        pr_loc_dbg("USB device <vid=%04x, pid=%04x, serial=%s> matches boot device candidate #%u", vid, pid,
+                   usb_device->serial ? usb_device->serial : "", i + 1);
+        return i;
+    }
+
+    return -ENOENT;
+}
+
+/**
+ * Lazily-evaluated properties of a disk checked against SATA candidates
+ *
+ * Everything is first taken from what the SCSI layer already knows; commands are only sent to the disk when a
+ * candidate cannot be decided without them. On a system with many disks most of them are excluded by the capacity
+ * known to sd (or by a cached serial) and never receive any commands from us.
+ */
+struct sata_dev_props {
+    struct scsi_device *sdp;
+    long long capacity_mib; //-ENODATA if not checked yet, other -E if it couldn't be read with I/O
+    bool capacity_io_tried;
+    int serial_err; //-ENODATA if not checked yet (or not cached), 0 if serial is valid, other -E on error
+    bool serial_io_tried;
+    char serial[BOOT_SERIAL_MAX_LENGTH + 1];
+};
+
+static long long sata_dev_capacity(struct sata_dev_props *props, bool allow_io)
+{
+    if (props->capacity_mib == -ENODATA)
+        props->capacity_mib = scsi_known_capacity(props->sdp);
+
+    if (props->capacity_mib == -ENODATA && allow_io && !props->capacity_io_tried) {
+        props->capacity_io_tried = true;
+        props->capacity_mib = opportunistic_read_capacity(props->sdp);
+        if (unlikely(props->capacity_mib < 0))
+            pr_loc_dbg("Failed to estimate drive capacity (error=%lld)", props->capacity_mib);
+    }
+
+    return props->capacity_mib;
+}
+
+static int sata_dev_serial(struct sata_dev_props *props, bool allow_io)
+{
+    if (props->serial_err != -ENODATA || (allow_io && props->serial_io_tried))
+        return props->serial_err;
+
+    props->serial_io_tried |= allow_io;
+    props->serial_err = scsi_get_unit_serial(props->sdp, props->serial, sizeof(props->serial), allow_io);
+    if (unlikely(props->serial_err != 0 && props->serial_err != -ENODATA))
+        pr_loc_dbg("Failed to read device serial (error=%d)", props->serial_err);
+
+    return props->serial_err;
+}
+
+/**
+ * Checks if a disk matches a single SATA candidate
+ *
+ * Cheap checks (no I/O) are done for all criteria first, so that a candidate excluded by e.g. the serial cached by the
+ * SCSI layer doesn't cost a READ CAPACITY.
+ */
+static bool sata_dev_matches(struct sata_dev_props *props, const struct boot_media_candidate *cand)
+{
+    long long capacity_mib = sata_dev_capacity(props, false);
+    if (capacity_mib >= 0 && capacity_mib > cand->dom_size_mib)
+        return false;
+
+    if (cand->serial[0] != '\0' && sata_dev_serial(props, false) == 0 && strcmp(props->serial, cand->serial) != 0)
+        return false;
+
+    //Nothing excluded it without I/O - now only what's still unknown is read
+    capacity_mib = sata_dev_capacity(props, true);
+    if (capacity_mib < 0 || capacity_mib > cand->dom_size_mib)
+        return false;
+
+    if (cand->serial[0] != '\0' && (sata_dev_serial(props, true) != 0 || strcmp(props->serial, cand->serial) != 0))
+        return false;
+
+    return true;
+}
+
+bool scsi_is_boot_dev_target(const struct boot_media *boot_dev_config, enum boot_media_type type,
+                             struct scsi_device *sdp)
 {
     if (!is_sata_disk(&sdp->sdev_gendev)) {
         pr_loc_dbg("%s: it's not a SATA disk, ignoring", __FUNCTION__);
         return false;
     }
 
+    //Checked first as there's no point in sending commands to every disk appearing after the boot device was found
+    if (get_shimmed_boot_dev()) {
+        pr_loc_dbg("%s: boot device was already shimmed, ignoring", __FUNCTION__);
+        return false;
+    }
+
     pr_loc_dbg("Checking if SATA disk is a shim target - id=%u channel=%u vendor=\"%s\" model=\"%s\"", sdp->id,
                sdp->channel, sdp->vendor, sdp->model);
 
-    long long capacity_mib = opportunistic_read_capacity(sdp);
-    if (unlikely(capacity_mib < 0)) {
-        pr_loc_dbg("Failed to estimate drive capacity (error=%lld) - it WILL NOT be shimmed", capacity_mib);
-        return false;
+    struct sata_dev_props props = {
+        .sdp = sdp,
+        .capacity_mib = -ENODATA,
+        .capacity_io_tried = false,
+        .serial_err = -ENODATA,
+        .serial_io_tried = false,
+        .serial = { '\0' },
+    };
+
+    int winner = -ENOENT;
+    for (unsigned int i = 0; i < boot_dev_config->candidates_num; ++i) {
+        const struct boot_media_candidate *cand = &boot_dev_config->candidates[i];
+        if (cand->type != BOOT_MEDIA_SATA_DOM && cand->type != BOOT_MEDIA_SATA_DISK)
+            continue;
+
+        if (sata_dev_matches(&props, cand)) {
+            winner = i;
+            break;
+        }
     }
 
-    if (capacity_mib > boot_dev_config->dom_size_mib) {
-        pr_loc_dbg("Device has capacity of ~%llu MiB - it WILL NOT be shimmed (>%lu)", capacity_mib,
-                   boot_dev_config->dom_size_mib);
+    if (winner < 0) {
+        pr_loc_dbg("Device (~%lld MiB, serial=\"%s\") doesn't match any candidate - it WILL NOT be shimmed",
+                   props.capacity_mib, props.serial);
         return false;
     }
 
-    if (unlikely(get_shimmed_boot_dev())) {
-        pr_loc_wrn("Boot device was already shimmed but a new matching device (~%llu MiB <= %lu) appeared again - "
-                   "this may produce unpredictable outcomes! Ignoring - check your hardware", capacity_mib,
-                   boot_dev_config->dom_size_mib);
+    if (boot_dev_config->candidates[winner].type != type) {
+        pr_loc_dbg("Device matches candidate #%d of type %d - it WILL NOT be shimmed as type %d", winner + 1,
+                   boot_dev_config->candidates[winner].type, type);
         return false;
     }
 
-    pr_loc_dbg("Device has capacity of ~%llu MiB - it is a shimmable target (<=%lu)", capacity_mib,
-               boot_dev_config->dom_size_mib);
+    pr_loc_dbg("Device has capacity of ~%llu MiB - it is a shimmable target (candidate #%d, <=%lu)",
+               props.capacity_mib, winner + 1, boot_dev_config->candidates[winner].dom_size_mib);
 
     return true;
 }
@@ -2,6 +2,7 @@
 #define REDPILL_BOOT_SHIM_BASE_H
 
 #include <linux/types.h> //bool
+#include "../../config/runtime_config.h" //enum boot_media_type
 
 struct boot_media;
 struct usb_device;
@@ -44,14 +45,31 @@ void set_shimmed_boot_dev(void *private_data);
 void *get_shimmed_boot_dev(void);
 
 /**
- * Checks if a given SCSI disk can become a boot device
+ * Finds the first (i.e. highest priority) USB boot device candidate matching a given device
  *
+ * @param boot_dev_config Configuration with the list of candidates
+ * @param usb_device Device to check (only VID, PID and serial are checked; the caller should check the class)
+ *
+ * @return index of the candidate in boot_dev_config->candidates, or -ENOENT if the device doesn't match any
+ */
+int find_usb_boot_candidate(const struct boot_media *boot_dev_config, struct usb_device *usb_device);
+
+/**
+ * Checks if a given SCSI disk can become a boot device of a given type
+ *
+ * The disk is matched against all SATA candidates (DOM & disk) in their order of priority and the first one which
+ * matches decides. This means that e.g. a small disk matching a SATA DOM candidate listed first will never be taken by
+ * the fake SATA disk shim, even if it also matches one of its candidates.
+ * Criteria are checked using what the SCSI layer already knows about the disk first (capacity of disks bound to sd,
+ * cached unit serial), and commands are only sent to the disk when they're needed to decide.
  * To fully understand the rules and intricacies of how it is used in context you should read the file comment for the
  * native SATA DOM shim in shim/boot_dev/sata_boot_shim.c
  *
- * @param boot_dev_config User-controllable configuration with a threshold for considering an SCSI disk a boot device
+ * @param boot_dev_config User-controllable configuration with the list of candidates
+ * @param type Type of the boot device the caller shims (BOOT_MEDIA_SATA_DOM or BOOT_MEDIA_SATA_DISK)
  * @param sdp SCSI device which ideally should be an SCSI disk (as passing any other ones doesn't make sense)
  */
-bool scsi_is_boot_dev_target(const struct boot_media *boot_dev_config, struct scsi_device *sdp);
+bool scsi_is_boot_dev_target(const struct boot_media *boot_dev_config, enum boot_media_type type,
+                             struct scsi_device *sdp);
 
 #endif //REDPILL_BOOT_SHIM_BASE_H
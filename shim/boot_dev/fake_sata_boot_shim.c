@@ -16,9 +16,16 @@
  * long, and have to be reverted as soon as the disk type is determined by the "sd.c" driver. This is because other
  * processes actually need to read & probe the drive as a SATA one (as you cannot communicate with a SATA device like
  * you do with a USB stick).
- * In a birds-eye view the descriptors are modified just before the sd_probe() is called and removed when ida_pre_get()
- * is called by the sd_probe(). The ida_pre_get() is nearly guaranteed [even if the sd.c code changes] to be called
- * very early in the process as the ID allocation needs to be done for anything else to use structures created within.
+ * In a birds-eye view the descriptors are modified just before the sd_probe() is called (SCSI_EVT_DEV_PROBING) and
+ * removed as soon as it returns (SCSI_EVT_DEV_PROBED_*). The disk type is determined within sd_probe(), while I/O to
+ * the disk doesn't care about the USB descriptors (they're only consulted for the type), so the drive is still
+ * communicated with as a SATA one.
+ *
+ * The port type lives in the host template, which is shared by all hosts of a given driver. Because of that any other
+ * device starting its probe while a device is camouflaged waits until the camouflage is removed, so that it isn't
+ * misdetected as a USB one. The wait only blocks that other probe (it's a sleeping wait) - nothing here runs with
+ * preemption or IRQs disabled, and no kernel code is patched. The wait is bounded (CAMOUFLAGE_WAIT_MS) so that a probe
+ * which never finishes cannot hang all later ones; a probe which timed out isn't camouflaged.
  *
  *
  * HERE BE DRAGONS
@@ -33,54 +40,28 @@
  *  - drivers/scsi/sd.c in syno kernel GPL sources (look at sd_probe() and syno_disk_type_get())
  */
 #include "fake_sata_boot_shim.h"
-#include "boot_shim_base.h" //set_shimmed_boot_dev(), get_shimmed_boot_dev(), scsi_is_shim_target(), usb_shim_as_boot_dev()
+#include "boot_shim_base.h" //set_shimmed_boot_dev(), get_shimmed_boot_dev(), scsi_is_boot_dev_target()
 #include "../shim_base.h" //shim_*
 #include "../../common.h"
-#include "../../internal/scsi/scsi_toolbox.h" //scsi_force_replug()
+#include "../../internal/scsi/scsi_toolbox.h" //scsi_reprobe_device()
 #include "../../internal/scsi/scsi_notifier.h" //waiting for the drive to appear
-#include "../../internal/call_protected.h" //ida_pre_get()
-#include "../../internal/override/override_symbol.h" //overriding ida_pre_get()
 #include <scsi/scsi_device.h> //struct scsi_device
 #include <scsi/scsi_host.h> //struct Scsi_Host, SYNO_PORT_TYPE_*
 #include <linux/usb.h> //struct usb_device
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock()
+#include <linux/wait.h> //DECLARE_WAIT_QUEUE_HEAD, wait_event_timeout(), wake_up_all()
+#include <linux/jiffies.h> //msecs_to_jiffies()
 #include <../drivers/usb/storage/usb.h> //struct us_data
 
 #define SHIM_NAME "fake SATA boot device"
+#define CAMOUFLAGE_WAIT_MS 30000 //max time a probe waits for a camouflaged device to finish its own
 
 static const struct boot_media *boot_dev_config = NULL; //passed to scsi_is_shim_target() & usb_shim_as_boot_dev()
 static struct scsi_device *camouflaged_sdp = NULL; //set when ANY device is under camouflage
 static struct usb_device *fake_usbd = NULL; //ptr to our fake usb device scaffolding
 static int org_port_type = 0; //original port type of the device which registered
-static override_symbol_inst *ida_pre_get_ovs = NULL; //trap override
-static unsigned long irq_flags = 0; //saved flags when IRQs are disabled (to prevent rescheduling)
-
-//They call each other, see their own docblocks
-static int camouflage_device(struct scsi_device *sdp);
-static int uncamouflage_device(struct scsi_device *sdp);
-
-struct ida;
-/**
- * Called by the sd_probe() very early after disk type is determined. We can restore the disk to its original shape
- */
-static int ida_pre_get_trap(struct ida *ida, gfp_t gfp_mask)
-{
-    //This can happen if the kernel decides to reschedule and/or some device appears JUST between setting up the trap
-    // and disabling of rescheduling. We cannot reverse the order as setting up the trap requires flushing CPU caches
-    // which isn't really feasible in non-preempt & IRQ-disabled state... a catch-22
-    //It is also possible that it happens during uncamouflage_device - this is why we force-restore here and just call
-    // it.
-    if (unlikely(!camouflaged_sdp)) {
-        pr_loc_bug("Hit ida_pr_get() trap without sdp saved - removing trap and calling original");
-        restore_symbol(ida_pre_get_ovs);
-        return _ida_pre_get(ida, gfp_mask);
-    }
-
-    pr_loc_dbg("Hit ida_pre_get() trap! Removing camouflage...");
-    uncamouflage_device(camouflaged_sdp);
-
-    pr_loc_dbg("Calling original ida_pre_get()");
-    return _ida_pre_get(ida, gfp_mask);
-}
+static DEFINE_MUTEX(camouflage_lock); //protects camouflaged_sdp along with the state saved above
+static DECLARE_WAIT_QUEUE_HEAD(camouflage_wq); //woken up when camouflage is removed
 
 /**
  * Checks if the device passes is "camouflaged" as a USB device
@@ -93,9 +74,8 @@ static bool is_camouflaged(struct scsi_device *sdp)
 /**
  * Alters a SATA device to look like a USB boot disk
  *
- * Order of operations in camouflage/uncamouflage is VERY particular. We make sure we CANNOT fail (at least not without
- * a KP resulting from pagefault) once we disable preemption & irqs AND that no changes before preemption is disabled
- * are overriding anything external (as we can be rescheduled and we cannot leave stuff half-replaced)
+ * The camouflage lasts until uncamouflage_device() is called when the probe of the device finishes. All checks which
+ * can fail are done before anything external is changed, so that we never leave stuff half-replaced.
  *
  * @param sdp A valid SATA disk (it's assumed it passed through scsi_is_boot_dev_target() already) to disguise as USB
  *
@@ -103,13 +83,17 @@ static bool is_camouflaged(struct scsi_device *sdp)
  */
 static int camouflage_device(struct scsi_device *sdp)
 {
+    int out = 0;
+    mutex_lock(&camouflage_lock);
+
     //This is very serious - it means something went TERRIBLY wrong. The camouflage should last only through the
     // duration of probing. If we got here again before camouflaging it means there's a device floating around which
     // is a SATA device but with broken USB descriptors. This should never ever happen as it may lead to data loss and
     // crashes at best.
     if (unlikely(camouflaged_sdp)) {
         pr_loc_crt("Attempting to camouflage when another device is undergoing camouflage");
-        return -EEXIST;
+        out = -EEXIST;
+        goto out_unlock;
     }
 
     //Here's the kicker: most of the subsystems save a pointer to some driver-related data into sdp->host->hostdata.
@@ -122,34 +106,29 @@ static int camouflage_device(struct scsi_device *sdp)
     // the safeguards here the chance is minimal.
     if (unlikely(host_to_us(sdp->host)->pusb_dev)) {
         pr_loc_crt("Cannot camouflage - space on pointer not empty");
-        return -EINVAL;
+        out = -EINVAL;
+        goto out_unlock;
     }
 
     if (unlikely(get_shimmed_boot_dev())) {
         pr_loc_wrn("Refusing to camouflage. Boot device was already shimmed but a new matching device appeared again - "
                    "this may produce unpredictable outcomes! Ignoring - check your hardware");
-        return -EEXIST;
+        out = -EEXIST;
+        goto out_unlock;
     }
 
     pr_loc_dbg("Camouflaging SATA disk vendor=\"%s\" model=\"%s\" to look like a USB boot device", sdp->vendor,
                sdp->model);
 
     pr_loc_dbg("Generating fake USB descriptor");
-    kzalloc_or_exit_int(fake_usbd, sizeof(struct usb_device));
-    usb_shim_as_boot_dev(boot_dev_config, fake_usbd);
-
-    pr_loc_dbg("Setting-up ida_pre_get() trap");
-    ida_pre_get_ovs = override_symbol("ida_pre_get", ida_pre_get_trap);
-    if (unlikely(IS_ERR(ida_pre_get_ovs))) {
-        pr_loc_err("Failed to override ida_pre_get - error=%ld", PTR_ERR(ida_pre_get_ovs));
-        ida_pre_get_ovs = NULL;
-        kfree(fake_usbd);
-        return PTR_ERR(ida_pre_get_ovs);
+    fake_usbd = kzalloc(sizeof(struct usb_device), GFP_KERNEL);
+    if (unlikely(!fake_usbd)) {
+        pr_loc_crt("kernel memory alloc failure - tried to allocate %zu bytes for fake_usbd",
+                   sizeof(struct usb_device));
+        out = -ENOMEM;
+        goto out_unlock;
     }
-
-    pr_loc_dbg("Disabling rescheduling");
-    preempt_disable();
-    local_irq_save(irq_flags);
+    usb_shim_as_boot_dev(boot_dev_config, fake_usbd);
 
     pr_loc_dbg("Changing port type %d => %d", sdp->host->hostt->syno_port_type, SYNO_PORT_TYPE_USB);
     org_port_type = sdp->host->hostt->syno_port_type;
@@ -161,7 +140,9 @@ static int camouflage_device(struct scsi_device *sdp)
     camouflaged_sdp = sdp;
     set_shimmed_boot_dev(sdp);
 
-    return 0;
+    out_unlock:
+    mutex_unlock(&camouflage_lock);
+    return out;
 }
 
 /**
@@ -173,37 +154,38 @@ static int camouflage_device(struct scsi_device *sdp)
  */
 static int uncamouflage_device(struct scsi_device *sdp)
 {
-    int out = 0;
     pr_loc_dbg("Uncamouflaging SATA disk vendor=\"%s\" model=\"%s\"", sdp->vendor, sdp->model);
+    mutex_lock(&camouflage_lock);
 
-    if (unlikely(host_to_us(sdp->host)->pusb_dev != fake_usbd)) {
-                pr_loc_bug("Fake USB device in the scsi_device is not the same as our fake one - something changed it");
-        return -EINVAL;
+    if (unlikely(camouflaged_sdp != sdp)) {
+        pr_loc_bug("Attempted to uncamouflage a device which isn't camouflaged");
+        mutex_unlock(&camouflage_lock);
+        return -ENOENT;
     }
 
-    camouflaged_sdp = NULL;
-
-    pr_loc_dbg("Removing fake usb_device ptr at %p", &host_to_us(sdp->host)->pusb_dev);
-    host_to_us(sdp->host)->pusb_dev = NULL;
+    int out = 0;
+    if (unlikely(host_to_us(sdp->host)->pusb_dev != fake_usbd)) {
+        //We have no idea what touched it, so the ptr is left alone and our fake device is leaked (something may still
+        // use it). The port type & the state are restored regardless - otherwise all later probes would wait on us.
+        pr_loc_crt("Fake USB device in the scsi_device is not the same as our fake one - something changed it! "
+                   "Removing the camouflage anyway, %s may be misdetected", dev_name(&sdp->sdev_gendev));
+        out = -EINVAL;
+    } else {
+        pr_loc_dbg("Removing fake usb_device ptr at %p", &host_to_us(sdp->host)->pusb_dev);
+        host_to_us(sdp->host)->pusb_dev = NULL;
+
+        pr_loc_dbg("Cleaning fake USB descriptor");
+        kfree(fake_usbd);
+    }
+    fake_usbd = NULL;
 
     pr_loc_dbg("Restoring port type %d => %d", sdp->host->hostt->syno_port_type, org_port_type);
     sdp->host->hostt->syno_port_type = org_port_type;
     org_port_type = 0;
 
-    pr_loc_dbg("Re-enabling scheduling");
-    local_irq_restore(irq_flags);
-    preempt_enable();
-
-    if (likely(ida_pre_get_ovs)) { //scheduling race condition may have removed that already in ida_pre_get_trap()
-        pr_loc_dbg("Removing ida_pre_get() trap");
-        if ((out = restore_symbol(ida_pre_get_ovs)) != 0)
-        pr_loc_err ("Failed to restore original ida_pre_get() - error=%d", out);
-        ida_pre_get_ovs = NULL;
-    }
-
-    pr_loc_dbg("Cleaning fake USB descriptor");
-    kfree(fake_usbd);
-    fake_usbd = NULL;
+    camouflaged_sdp = NULL;
+    mutex_unlock(&camouflage_lock);
+    wake_up_all(&camouflage_wq);
 
     return out;
 }
@@ -222,11 +204,11 @@ static int uncamouflage_device(struct scsi_device *sdp)
  */
 static int on_existing_scsi_disk_device(struct scsi_device *sdp)
 {
-    if (!scsi_is_boot_dev_target(boot_dev_config, sdp))
+    if (!scsi_is_boot_dev_target(boot_dev_config, BOOT_MEDIA_SATA_DISK, sdp))
         return 0;
 
-    pr_loc_dbg("Found a shimmable SCSI device - reconnecting to trigger shimming");
-    scsi_force_replug(sdp);
+    pr_loc_dbg("Found a shimmable SCSI device - reprobing to trigger shimming");
+    scsi_reprobe_device(sdp);
 
     return 1;
 }
@@ -240,23 +222,23 @@ static int scsi_disk_probe_handler(struct notifier_block *self, unsigned long st
 
     switch (state) {
         case SCSI_EVT_DEV_PROBING:
-            if (unlikely(camouflaged_sdp)) {
-                pr_loc_bug("Got device probe when other one is camouflaged - surprise reschedule happened?");
-                uncamouflage_device(camouflaged_sdp);
+            //Another device may be probing with the port type of its host template changed (see file header)
+            if (unlikely(!wait_event_timeout(camouflage_wq, !ACCESS_ONCE(camouflaged_sdp),
+                                             msecs_to_jiffies(CAMOUFLAGE_WAIT_MS)))) {
+                pr_loc_err("Timed out waiting %dms for camouflaged device to finish probing - %s will not be "
+                           "camouflaged & may be misdetected", CAMOUFLAGE_WAIT_MS, dev_name(&sdp->sdev_gendev));
                 return NOTIFY_OK;
             }
 
-            if (scsi_is_boot_dev_target(boot_dev_config, data))
+            if (scsi_is_boot_dev_target(boot_dev_config, BOOT_MEDIA_SATA_DISK, data))
                 camouflage_device(sdp);
 
             return NOTIFY_OK;
 
         case SCSI_EVT_DEV_PROBED_OK:
         case SCSI_EVT_DEV_PROBED_ERR:
-            if (is_camouflaged(sdp)) { //camouflage is expected to be removed by the ida_pre_get() trap
-                pr_loc_bug("Probing finished but device is still camouflages - something went terribly wrong");
+            if (is_camouflaged(sdp)) //the disk type was determined by sd_probe() - it can see the real device now
                 uncamouflage_device(sdp);
-            }
 
             return NOTIFY_OK;
 
@@ -310,6 +292,10 @@ int unregister_fake_sata_boot_shim(void)
     shim_ureg_in();
 
     unsubscribe_scsi_disk_events(&scsi_disk_nb);
+    if (unlikely(ACCESS_ONCE(camouflaged_sdp))) { //it cannot be left camouflaged as nothing will remove it later
+        pr_loc_wrn("Unregistering while a device is camouflaged - removing camouflage");
+        uncamouflage_device(camouflaged_sdp);
+    }
     boot_dev_config = NULL;
 
     shim_ureg_ok();
@@ -14,10 +14,11 @@
  *   - vendor-name="SATADOM"  and model-name="D150SH"     (all other)
  *
  * HOW THIS SHIM MATCHES DEVICE TO SHIM?
- * The decision is made based on "struct boot_media" (derived from boot config) passed to the register method. The
- * only criterion used is the physical size of the disk. The *first* device which is smaller or equal to
- * boot_media->dom_size_mib will be shimmed. If a consecutive device matching this rule appears a warning will be
- * triggered.
+ * The decision is made based on SATA candidates of "struct boot_media" (derived from boot config) passed to the
+ * register method. The main criterion used is the physical size of the disk: the *first* device which is smaller or
+ * equal to dom_size_mib of a candidate (and has its serial, if the candidate specifies one) will be shimmed, provided
+ * that the highest priority candidate it matches is a SATA DOM one (see scsi_is_boot_dev_target()). If a consecutive
+ * device matching this rule appears a warning will be triggered.
  * This sounds quite unusual. We considered multiple options before going that route:
  *   - Unlike USB we cannot easily match SATA devices using any stable identifier so any VID/PID was out of the window
  *   - S/N sounds like a good candidate unless you realize hypervisors use the same one for all disks
@@ -47,7 +48,8 @@
  * HOW IT WORKS FOR EXISTING DEVICES?
  * Unfortunately, our sd_probe() replacement is still a bit of a race condition. However, this time we're racing with
  * SCSI driver loading which usually isn't a module. Because of this we need to expect some (probably all) devices to be
- * already probed. We need to do essentially what's described above (with /sys) but from kernel space.
+ * already probed. We need to do essentially what's described above (with /sys) but from kernel space - except that
+ * only the sd driver is unbound & bound again (see scsi_reprobe_device()), so that the host isn't scanned again.
  * To avoid any crashes and possible data loss we are never touching disks which aren't SATA and matching the size
  * match criterion. In other words this shim will NOT yank a data drive from the system.
  *
@@ -66,7 +68,7 @@
  *        + shim sd_probe() to sd_probe_shim()
  *            <will shim vendor/model if appropriate for every newly plugged/re-plugged device>
  *        + probe_existing_devices()
- *            <iterate through all, find if any matches, if so disconnect it (which will prompt it to trigger sd_probe)>
+ *            <iterate through all, find if any matches, if so reprobe it (which will trigger sd_probe)>
  *      ===NOT FOUND===
  *        + override scsi_register_driver() [using start_scsi_register_driver_watcher()]
  *            <it will "wait" until the driver attempts to register>
@@ -98,7 +100,7 @@
 #include "boot_shim_base.h" //set_shimmed_boot_dev(), get_shimmed_boot_dev(), scsi_is_boot_dev_target()
 #include "../shim_base.h" //shim_reg_*(), scsi_ureg_*()
 #include "../../internal/call_protected.h" //scsi_scan_host_selected()
-#include "../../internal/scsi/scsi_toolbox.h" //scsi_force_replug(), for_each_scsi_disk()
+#include "../../internal/scsi/scsi_toolbox.h" //scsi_reprobe_device(), for_each_scsi_disk()
 #include "../../internal/scsi/scsi_notifier.h" //watching for new devices to shim them as they appear
 #include <scsi/scsi_device.h> //struct scsi_device
 
@@ -151,7 +153,7 @@ static __used int on_new_scsi_disk(struct notifier_block *self, unsigned long st
     struct scsi_device *sdp = data;
 
     pr_loc_dbg("Found new SCSI disk vendor=\"%s\" model=\"%s\": checking boot shim viability", sdp->vendor, sdp->model);
-    if (!scsi_is_boot_dev_target(boot_dev_config, sdp))
+    if (!scsi_is_boot_dev_target(boot_dev_config, BOOT_MEDIA_SATA_DOM, sdp))
         return NOTIFY_OK;
 
     int err = shim_device(data);
@@ -166,8 +168,7 @@ static __used int on_new_scsi_disk(struct notifier_block *self, unsigned long st
 }
 
 /**
- * Processes existing device and if it's a SATA drive which matches shim criteria it will be unplugged & replugged to be
- * shimmed
+ * Processes existing device and if it's a SATA drive which matches shim criteria it will be reprobed to be shimmed
  *
  * @param sdp This "struct device" should already be guaranteed to be an scsi_device with type=TYPE_DISK (i.e. returning
  *            "true" from is_scsi_disk())
@@ -180,20 +181,20 @@ static int on_existing_scsi_disk(struct scsi_device *sdp)
     pr_loc_dbg("Found existing SCSI disk vendor=\"%s\" model=\"%s\": checking boot shim viability", sdp->vendor,
                sdp->model);
 
-    if (!scsi_is_boot_dev_target(boot_dev_config, sdp))
+    if (!scsi_is_boot_dev_target(boot_dev_config, BOOT_MEDIA_SATA_DOM, sdp))
         return 0;
 
     //So, now we know it's a shimmable target but we cannot just call shim_device() as this will change vendor+model on
     // already connected device, which will change these information but will not trigger syno type change. When we
-    // disconnect & reconnect the device it will reappear and go through the on_new_scsi_disk() route.
+    // reprobe the device sd_probe() runs again and it goes through the on_new_scsi_disk() route.
     pr_loc_inf("SCSI disk vendor=\"%s\" model=\"%s\" is already connected but it's a boot dev. "
-               "It will be forcefully reconnected to shim it as boot dev.", sdp->vendor, sdp->model);
+               "It will be reprobed to shim it as boot dev.", sdp->vendor, sdp->model);
 
-    int out = scsi_force_replug(sdp);
+    int out = scsi_reprobe_device(sdp);
     if (out < 0)
-        pr_loc_err("Failed to replug the SCSI device (error=%d) - it may not shim as expected", out);
+        pr_loc_err("Failed to reprobe the SCSI device (error=%d) - it may not shim as expected", out);
     else
-        pr_loc_dbg("SCSI device replug triggered successfully");
+        pr_loc_dbg("SCSI device reprobe triggered successfully");
 
     return 1;
 }
@@ -206,13 +207,7 @@ int register_native_sata_boot_shim(const struct boot_media *config)
 
     //Regardless of the method we must set the expected size (in config) as shim may be called any moment from now on
     boot_dev_config = config;
-    int out = 0;
-
-    if (unlikely(boot_dev_config->type != BOOT_MEDIA_SATA_DOM)) {
-        pr_loc_bug("%s doesn't support device type %d", __FUNCTION__, boot_dev_config->type);
-        out = -EINVAL;
-        goto fail;
-    }
+    int out;
 
     if (unlikely(shim_registered)) {
         pr_loc_bug("Native SATA boot shim is already registered");
@@ -8,10 +8,15 @@
  * installation is forced with 0xf401 ids instead.
  *
  * HOW THIS SHIM MATCHES DEVICE TO SHIM?
- * The decision is made based on "struct boot_media" (derived from boot config) passed to the register method:
+ * The decision is made based on USB candidates of "struct boot_media" (derived from boot config) passed to the register
+ * method. Every newly detected device is checked once against them (see find_usb_boot_candidate()):
  *  - if vid/pid combo is set (i.e. not VID_PID_EMPTY) it must match the newly detected device
- *  - if vid/pid is not set (i.e. VID_PID_EMPTY) the first device is used (NOT recommended unless you don't use USB)
- *  - if a second device matching any of the criteria above appears a warning is emitted and device is ignored
+ *  - if vid/pid is not set (i.e. VID_PID_EMPTY) any device matches (NOT recommended unless you don't use USB)
+ *  - if serial is set it must match iSerial of the device, which makes identical sticks distinguishable
+ *  - if a second device matching any of the candidates appears a warning is emitted and device is ignored
+ * In all cases only devices with a mass storage interface are considered (the event bus only delivers these), so that
+ * hubs, keyboards, UPSes etc. are never picked up (and in the VID_PID_EMPTY case they no longer "steal" the boot
+ * device).
  *
  * HOW IT WORKS?
  * In order to dynamically change VID & PID of a USB device we need to modify device descriptor just after the device is
@@ -26,210 +31,246 @@
  *  5. SCSI subsystem detects the device and creates a /dev/... node for it
  *
  *  This poses several problems. First this module must load before USB subsystem. Then to get the device quicker than
- *  SCSI subsystem can a notification receiver is set up. However we need to wait to do this after the usbcore actually
- *  loads. To make sure it's the case a kernel module watcher is used. That's why symbols from usbcore are loaded
- *  dynamically, as at the moment of this LKM insertion they aren't available. In case usbcore is loaded before this LKM
- *  VID+PID change may not be effective (this scenario is supported pretty much for debugging only).
+ *  SCSI subsystem can a subscription to USB devices events is set up (see internal/event_bus.h). The bus takes care of
+ *  waiting for usbcore to load before it can deliver these. In case usbcore is loaded before this LKM VID+PID change
+ *  may not be effective (this scenario is supported pretty much for debugging only).
  *  This sequence is rather time sensitive. It shouldn't fail on any modern multicore system.
  *
+ *  We're only subscribed to USB events while we're looking for the boot device. Once the device is shimmed the
+ *  subscription is removed and a devres entry attached to the device brings it back when the device goes away (removal
+ *  or driver unbind). Changes of the subscription are done from a work, as it cannot be modified from within its own
+ *  callback.
+ *
+ * TRANSFER TUNING
+ * Boot devices are often cheap USB 2.0 sticks and usb-storage limits them to 240 sectors (120KiB) per request with the
+ * default 128KiB read-ahead. DSM reads the loader partitions from it on every boot and writes the whole PAT image to it
+ * during install/upgrade, so once the SCSI disk of the shimmed device is probed it gets larger requests & read-ahead
+ * (see boot_dev_tuning). Request size is only ever raised, and capped by what the host controller supports. Sticks
+ * driven by "uas" (which usb-storage already leaves to it when the kernel has it) have no "max_sectors" host attribute
+ * as they're not limited like that - only the queue parameters are changed for them.
+ *
  * References
  *  - Synology's kernel GPL source -> drivers/scsi/sd.c, search for "IS_SYNO_USBBOOT_ID_"
  *  - https://0xax.gitbooks.io/linux-insides/content/Concepts/linux-cpu-4.html
  *  - https://lwn.net/Articles/160501/
  */
 #include "usb_boot_shim.h"
-#include "boot_shim_base.h" //set_shimmed_boot_dev(), get_shimmed_boot_dev(), usb_shim_as_boot_dev()
+#include "boot_shim_base.h" //set_shimmed_boot_dev(), usb_shim_as_boot_dev(), find_usb_boot_candidate()
 #include "../shim_base.h" //shim_*
 #include "../../common.h"
 #include "../../config/runtime_config.h" //struct boot_device & consts
-#include "../../internal/helper/symbol_helper.h" //kernel_has_symbol()
-#include "../../internal/call_protected.h" //dynamically calling usb_* functions
-#include <linux/notifier.h>
+#include "../../internal/event_bus.h" //subscribe_rp_events(), unsubscribe_rp_events()
+#include "../../internal/housekeeping.h" //housekeeping_wq()
+#include "../../internal/scsi/scsi_notifier.h" //subscribe_scsi_disk_events_async()
+#include "../../internal/scsi/scsi_toolbox.h" //scsi_store_host_attr(), scsi_store_queue_attr(), scsi_sd_probe_domain
+#include <linux/notifier.h> //NOTIFY_*
 #include <linux/usb.h>
-#include <linux/module.h> //struct module
+#include <linux/device.h> //devres_alloc(), devres_add(), devres_destroy()
+#include <linux/mutex.h> //DEFINE_MUTEX, mutex_lock()
+#include <linux/workqueue.h> //DECLARE_WORK, queue_work()
+#include <linux/async.h> //async_synchronize_full_domain()
+#include <linux/blkdev.h> //queue_max_sectors(), queue_max_hw_sectors()
+#include <scsi/scsi_device.h> //struct scsi_device
 
 #define SHIM_NAME "USB boot device"
 
-static bool module_notify_registered = false;
-static bool device_notify_registered = false;
+/**
+ * Transfer parameters of the boot device; see "TRANSFER TUNING" in the file header
+ */
+static const struct {
+    unsigned int max_sectors; //usb-storage per-command limit, in 512 byte sectors
+    unsigned int max_sectors_kb;
+    unsigned int read_ahead_kb;
+} boot_dev_tuning = {
+    .max_sectors = 1024,
+    .max_sectors_kb = 512,
+    .read_ahead_kb = 1024,
+};
+
+static bool device_sub_registered = false;
 static const struct boot_media *boot_media = NULL; //passed to usb_shim_as_boot_dev()
+static DEFINE_MUTEX(device_sub_lock); //protects device_sub_registered
+
+static void arm_device_sub(void);
+static void arm_device_sub_work(struct work_struct *work) { arm_device_sub(); }
+static DECLARE_WORK(arm_work, arm_device_sub_work);
 
 /**
- * Responds to USB devices being added/removed
+ * Called by devres when the shimmed device goes away
  */
-static int device_notifier_handler(struct notifier_block *b, unsigned long event, void *data)
+static void boot_dev_gone(struct device *dev, void *res)
+{
+    pr_loc_wrn("Previously shimmed boot device gone away");
+    reset_shimmed_boot_dev();
+    queue_work(housekeeping_wq(system_wq), &arm_work); //we want to know if it comes back
+}
+
+/**
+ * Responds to mass storage USB devices being added (we're only subscribed while the boot device isn't shimmed)
+ */
+static int device_event_handler(const rp_event_sub *sub, rp_event_kind kind, void *data)
 {
     struct usb_device *device = (struct usb_device*)data;
-    struct usb_device *prev_device = get_shimmed_boot_dev();
-
-    if (event == USB_DEVICE_ADD) {
-        //TODO: Can we even check if it matched mass storage here... (bInterfaceClass == USB_CLASS_MASS_STORAGE)
-        if (boot_media->vid == VID_PID_EMPTY || boot_media->pid == VID_PID_EMPTY) {
-            pr_loc_wrn("Your boot device VID and/or PID is not set - "
-                       "using device found <vid=%04x, pid=%04x> (prev_shimmed=%d)",
-                       device->descriptor.idVendor, device->descriptor.idProduct, prev_device ? 1:0);
-        } else if (device->descriptor.idVendor != boot_media->vid || device->descriptor.idProduct != boot_media->pid) {
-            pr_loc_dbg("Found new device <vid=%04x, pid=%04x> - "
-                       "didn't match expected <vid=%04x, pid=%04x> (prev_shimmed=%d)",
-                       device->descriptor.idVendor, device->descriptor.idProduct, boot_media->vid, boot_media->pid,
-                       prev_device ? 1:0);
-
-            return NOTIFY_OK;
-        }
-
-        //This will happen especially when VID+PID weren't set and two USB devices were detected
-        if (prev_device) {
-            pr_loc_wrn("Boot device was already shimmed but a new matching device appeared again - "
-                       "this may produce unpredictable outcomes! Ignoring - check your hardware");
-            return NOTIFY_OK;
-        }
-
-        usb_shim_as_boot_dev(boot_media, device);
-        set_shimmed_boot_dev(device);
-
-        pr_loc_inf("Device <vid=%04x, pid=%04x> shimmed to <vid=%04x, pid=%04x>", boot_media->vid, boot_media->pid,
+    int idx = find_usb_boot_candidate(boot_media, device);
+    if (idx < 0)
+        return NOTIFY_OK;
+
+    const struct boot_media_candidate *cand = &boot_media->candidates[idx];
+    if ((cand->vid == VID_PID_EMPTY || cand->pid == VID_PID_EMPTY) && cand->serial[0] == '\0') {
+        pr_loc_wrn("Your boot device VID and/or PID is not set - using mass storage device found <vid=%04x, pid=%04x>",
                    device->descriptor.idVendor, device->descriptor.idProduct);
+    }
 
+    //This will happen especially when VID+PID weren't set and two USB devices were detected before we unregistered
+    if (get_shimmed_boot_dev()) {
+        pr_loc_wrn("Boot device was already shimmed but a new matching device appeared again - "
+                   "this may produce unpredictable outcomes! Ignoring - check your hardware");
         return NOTIFY_OK;
     }
 
-
-    if (prev_device && event == USB_DEVICE_REMOVE && device == prev_device) {
-        pr_loc_wrn("Previously shimmed boot device gone away");
-        reset_shimmed_boot_dev();
+    void *gone_res = devres_alloc(boot_dev_gone, 0, GFP_KERNEL);
+    if (unlikely(!gone_res)) {
+        pr_loc_err("Failed to allocate removal watch for the boot device - it will not be shimmed");
         return NOTIFY_OK;
     }
 
+    usb_shim_as_boot_dev(boot_media, device);
+    set_shimmed_boot_dev(device);
+    devres_add(&device->dev, gone_res);
+    queue_work(housekeeping_wq(system_wq), &arm_work); //we don't need to watch other devices anymore
+
+    pr_loc_inf("Device <vid=%04x, pid=%04x> (candidate #%d) shimmed to <vid=%04x, pid=%04x>", cand->vid, cand->pid,
+               idx + 1, device->descriptor.idVendor, device->descriptor.idProduct);
+
     return NOTIFY_OK;
 }
 
-static struct notifier_block device_notifier_block = {
-    .notifier_call = device_notifier_handler,
-    .priority = INT_MIN, //We need to be first
+static rp_event_sub device_sub = {
+    .fn = device_event_handler,
+    .kinds = RP_EVT_MASK(RP_EVT_USB_DEV_ADD),
+    .usb_class = USB_CLASS_MASS_STORAGE,
+    .priority = INT_MIN,
 };
+
 /**
- * Watches for USB events
+ * Subscribes to or unsubscribes from USB devices events depending on whether we're still looking for the boot device
+ *
+ * It MUST NOT be called from within the event callbacks (see file header).
  */
-static void register_device_notifier(void)
+static void arm_device_sub(void)
 {
-    //This should never happen but there's never enough error checking.
-    //Even if the module was already loaded register_device_notifier() should not be called twice before module is
-    // unloaded and reloaded
-    if (unlikely(device_notify_registered)) {
-        pr_loc_bug("Device notify re-registration via %s w/o module unload (?!)", __FUNCTION__);
-        return;
+    mutex_lock(&device_sub_lock);
+    bool needed = boot_media && !get_shimmed_boot_dev();
+
+    if (needed && !device_sub_registered) {
+        int out = subscribe_rp_events(&device_sub);
+        if (likely(out == 0))
+            device_sub_registered = true;
+        else
+            pr_loc_err("Failed to subscribe to USB device events - boot device will not be shimmed (error=%d)", out);
+    } else if (!needed && device_sub_registered) {
+        unsubscribe_rp_events(&device_sub);
+        device_sub_registered = false;
     }
-
-    //This has to use dynamic calling to avoid being dependent on usbcore (since we need to load before usbcore)
-    _usb_register_notify(&device_notifier_block); //has no return value
-
-    device_notify_registered = true;
-    pr_loc_dbg("Registered USB device notifier");
-}
-
-static int unregister_device_notifier(void)
-{
-    if (unlikely(!device_notify_registered)) {
-        pr_loc_bug("%s called while notifier not registered", __FUNCTION__);
-        return -ENOENT;
-    }
-
-    //This has to use dynamic calling to avoid being dependent on usbcore (since we need to load before usbcore)
-    _usb_unregister_notify(&device_notifier_block); //has no return value
-    device_notify_registered = false;
-    pr_loc_dbg("Unregistered USB device notifier");
-
-    return 0;
+    mutex_unlock(&device_sub_lock);
 }
 
 /**
- * Responds to "usbcore" [and others] load
+ * Responds to "usbcore" going away (the shimmed device, if any, went away with it)
  */
-static int ubscore_notifier_handler(struct notifier_block * self, unsigned long state, void * data)
+static int usbcore_event_handler(const rp_event_sub *sub, rp_event_kind kind, void *data)
 {
-    struct module *mod = data;
-    if (strcmp(mod->name, "usbcore") != 0)
-        return NOTIFY_OK;
-
-    if (state == MODULE_STATE_GOING) {
-        //TODO: call unregister with some force flag?
-        device_notify_registered = false;
-        reset_shimmed_boot_dev();
-        pr_loc_wrn("usbcore module unloaded - this should not happen normally");
-        return NOTIFY_OK;
-    }
-
-    //This may need to be changed to MODULE_STATE_LIVE if MODULE_STATE_COMING is too early for device notification
-    if (state != MODULE_STATE_LIVE)
-        return NOTIFY_OK;
-
-    pr_loc_dbg("usbcore registered, adding device watcher");
-    register_device_notifier();
+    //TODO: call unregister with some force flag?
+    reset_shimmed_boot_dev();
+    queue_work(housekeeping_wq(system_wq), &arm_work); //the device will be looked for again once usbcore comes back
 
     return NOTIFY_OK;
 }
 
-static struct notifier_block usbcore_notifier_block = {
-        .notifier_call = ubscore_notifier_handler
-};
 /**
- * Watches for "usbcore" module load
+ * Checks if a SCSI disk is backed by the shimmed USB boot device (i.e. if the device is one of its ancestors)
  */
-static int register_usbcore_notifier(void)
+static bool is_boot_dev_disk(struct scsi_device *sdp)
 {
-    int error = 0;
+    struct usb_device *boot_dev = get_shimmed_boot_dev();
+    if (!boot_dev)
+        return false;
 
-    if (unlikely(module_notify_registered)) {
-        pr_loc_bug("%s called while notifier already registered", __FUNCTION__);
-        return 0; //technically it's not an error
+    for (struct device *parent = sdp->sdev_gendev.parent; parent; parent = parent->parent) {
+        if (parent == &boot_dev->dev)
+            return true;
     }
 
-    error = register_module_notifier(&usbcore_notifier_block);
-    if(unlikely(error != 0)) {
-        pr_loc_err("Failed to register module notifier"); //Currently it's impossible to happen... currently
-        return error;
-    }
+    return false;
+}
 
-    module_notify_registered = true;
-    pr_loc_dbg("Registered usbcore module notifier");
+static void tune_boot_dev_queue_attr(struct scsi_device *sdp, const char *name, unsigned int value)
+{
+    int out = scsi_store_queue_attr(sdp, name, value);
+    if (out != 0)
+        pr_loc_wrn("Failed to set %s of boot device %s to %u - error=%d", name, dev_name(&sdp->sdev_gendev), value,
+                   out);
+}
 
-    //check if usbcore is MAYBE already loaded and give a warning + call register_device_notifier() manually
-    // this state is FINE for debugging but IS NOT FINE for production use
-    //We're using kernel_has_symbol() to not acquire module mutex needed for module checks
-    if (kernel_has_symbol("usb_register_notify")) {
-        pr_loc_wrn("usbcore module is already loaded (did you load this module too late?) "
-                   "-> registering device notifier right away");
-        register_device_notifier();
+static void tune_boot_dev(struct scsi_device *sdp)
+{
+    struct request_queue *q = sdp->request_queue;
+
+    if (queue_max_hw_sectors(q) < boot_dev_tuning.max_sectors) {
+        int out = scsi_store_host_attr(sdp, "max_sectors", boot_dev_tuning.max_sectors);
+        if (out == -ENOENT) //e.g. uas
+            pr_loc_dbg("Host of boot device %s has no max_sectors limit", dev_name(&sdp->sdev_gendev));
+        else if (out != 0)
+            pr_loc_wrn("Failed to set max_sectors of boot device %s to %u - error=%d", dev_name(&sdp->sdev_gendev),
+                       boot_dev_tuning.max_sectors, out);
     }
 
-    return error;
+    unsigned int max_sectors_kb = min(boot_dev_tuning.max_sectors_kb, queue_max_hw_sectors(q) >> 1);
+    if (max_sectors_kb > queue_max_sectors(q) >> 1)
+        tune_boot_dev_queue_attr(sdp, "max_sectors_kb", max_sectors_kb);
+    tune_boot_dev_queue_attr(sdp, "read_ahead_kb", boot_dev_tuning.read_ahead_kb); //default is 128KiB
+
+    pr_loc_inf("Boot device %s tuned for transfers of up to %uKiB", dev_name(&sdp->sdev_gendev),
+               queue_max_sectors(q) >> 1);
 }
 
-static int unregister_usbcore_notifier(void)
+/**
+ * Tunes the boot device once its SCSI disk is probed
+ */
+static int on_scsi_disk_probed(struct notifier_block *self, unsigned long state, void *data)
 {
-    if (unlikely(!module_notify_registered)) { //unregister should be called first if so
-        pr_loc_bug("%s called while notifier not registered", __FUNCTION__);
-        return -ENOENT;
-    }
-
-    int out = unregister_module_notifier(&usbcore_notifier_block);
-    if(unlikely(out != 0)) {
-        pr_loc_err("Failed to unregister module notifier"); //Currently it's impossible to happen... currently
-        return out;
-    }
+    struct scsi_device *sdp = data;
+    if (state != SCSI_EVT_DEV_PROBED_OK || !is_boot_dev_disk(sdp))
+        return NOTIFY_DONE;
 
-    module_notify_registered = false;
-    pr_loc_dbg("Unregistered usbcore module notifier");
+    //sd's revalidation sets the queue limits anew - it has to finish first (this is async so no probe is delayed)
+    async_synchronize_full_domain(&scsi_sd_probe_domain);
+    tune_boot_dev(sdp);
 
-    return 0;
+    return NOTIFY_OK;
 }
 
+static struct notifier_block scsi_disk_probed_nb = {
+    .notifier_call = on_scsi_disk_probed,
+};
+
+static rp_event_sub usbcore_sub = {
+    .fn = usbcore_event_handler,
+    .kinds = RP_EVT_MASK(RP_EVT_MODULE_GOING),
+    .module_name = "usbcore",
+    .usb_class = RP_EVT_ANY_USB_CLASS,
+};
+
 int register_usb_boot_shim(const struct boot_media *boot_dev_config)
 {
     shim_reg_in();
 
-    if (unlikely(boot_dev_config->type != BOOT_MEDIA_USB)) {
-        pr_loc_bug("%s doesn't support device type %d", __FUNCTION__, boot_dev_config->type);
+    bool has_usb = false;
+    for (unsigned int i = 0; i < boot_dev_config->candidates_num; ++i)
+        has_usb |= boot_dev_config->candidates[i].type == BOOT_MEDIA_USB;
+
+    if (unlikely(!has_usb)) {
+        pr_loc_bug("%s called without any USB boot device candidates", __FUNCTION__);
         return -EINVAL;
     }
 
@@ -240,12 +281,20 @@ int register_usb_boot_shim(const struct boot_media *boot_dev_config)
 
     boot_media = boot_dev_config;
 
-    int out = register_usbcore_notifier(); //it will register device notifier when module loads
-    if (out != 0)
+    int out = subscribe_rp_events(&usbcore_sub);
+    if (out != 0) {
+        boot_media = NULL;
         return out;
+    }
+
+    //Not fatal - the boot device simply works with default transfer parameters
+    if ((out = subscribe_scsi_disk_events_async(&scsi_disk_probed_nb)) != 0)
+        pr_loc_wrn("Failed to subscribe to SCSI disk events - boot device will not be tuned (error=%d)", out);
+
+    arm_device_sub(); //the bus will start delivering USB events once usbcore loads
 
     shim_reg_ok();
-    return out;
+    return 0;
 }
 
 int unregister_usb_boot_shim(void)
@@ -257,14 +306,19 @@ int unregister_usb_boot_shim(void)
         return -ENOENT;
     }
 
-    int out = 0;
-    if (
-            (out = unregister_usbcore_notifier()) != 0
-         || (out = unregister_device_notifier()) != 0
-    )
+    int out = unsubscribe_rp_events(&usbcore_sub);
+    if (out != 0)
         return out;
 
+    unsubscribe_scsi_disk_events_async(&scsi_disk_probed_nb);
+
+    struct usb_device *shimmed_dev = get_shimmed_boot_dev();
+    if (shimmed_dev)
+        devres_destroy(&shimmed_dev->dev, boot_dev_gone, NULL, NULL); //it will not call us after we're gone
+
     boot_media = NULL;
+    cancel_work_sync(&arm_work);
+    arm_device_sub(); //with no boot_media it will only unsubscribe (if needed)
 
     shim_ureg_ok();
     return out;
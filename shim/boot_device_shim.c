@@ -24,8 +24,10 @@
  * There are other special ones (e.g. iSCSI) which aren't supported here. These only apply to small subset of platforms.
  *
  * HOW IT WORKS?
- * Depending on the runtime configuration this shim will either engage USB-based shim or SATA-based one. See respective
- * implementations in shim/boot_dev/.
+ * Depending on the runtime configuration this shim will engage USB-based shim and/or SATA-based ones - one for every
+ * type of boot device candidates configured (see struct boot_media). Every device is checked once, as it appears, and
+ * the first candidate it matches decides whether (and by which shim) it's shimmed. See respective implementations in
+ * shim/boot_dev/.
  *
  * References:
  *  - See drivers/scsi/sd.c in Linux sources (especially sd_probe() method)
@@ -40,38 +42,91 @@
 #include "boot_dev/fake_sata_boot_shim.h"
 #include "boot_dev/native_sata_boot_shim.h"
 
-#define BOOT_MEDIA_SHIM_NULL (-1)
+#define boot_type_bit(type) (1U << (type))
 
-static int registered_type = BOOT_MEDIA_SHIM_NULL;
-int register_boot_shim(const struct boot_media *boot_dev_config)
-{
-    shim_reg_in();
+static unsigned int registered_types = 0; //bitmask of boot_type_bit() of every registered per-type shim
 
-    if (unlikely(registered_type != BOOT_MEDIA_SHIM_NULL)) {
-        pr_loc_bug("Boot shim is already registered with type=%d", registered_type);
-        return -EEXIST;
+static int register_boot_shim_type(const struct boot_media *boot_dev_config, enum boot_media_type type)
+{
+    switch (type) {
+        case BOOT_MEDIA_USB:
+            return register_usb_boot_shim(boot_dev_config);
+        case BOOT_MEDIA_SATA_DOM:
+            return register_native_sata_boot_shim(boot_dev_config);
+        case BOOT_MEDIA_SATA_DISK:
+            return register_fake_sata_boot_shim(boot_dev_config);
+        default:
+            pr_loc_bug("Failed to %s - unknown type=%d", __FUNCTION__, type);
+            return -EINVAL;
     }
+}
 
-    int out;
-    switch (boot_dev_config->type) {
+static int unregister_boot_shim_type(enum boot_media_type type)
+{
+    switch (type) {
         case BOOT_MEDIA_USB:
-            out = register_usb_boot_shim(boot_dev_config);
-            break;
+            return unregister_usb_boot_shim();
         case BOOT_MEDIA_SATA_DOM:
-            out = register_native_sata_boot_shim(boot_dev_config);
-            break;
+            return unregister_native_sata_boot_shim();
         case BOOT_MEDIA_SATA_DISK:
-            out = register_fake_sata_boot_shim(boot_dev_config);
-            break;
-        default:
-            pr_loc_bug("Failed to %s - unknown type=%d", __FUNCTION__, boot_dev_config->type);
+            return unregister_fake_sata_boot_shim();
+        default: //that cannot happen unless register_boot_shim() is broken
+            pr_loc_bug("Failed to %s - unknown type=%d", __FUNCTION__, type);
             return -EINVAL;
     }
+}
 
-    if (out != 0)
-        return out; //individual shims should print what went wrong
+/**
+ * Unregisters all per-type shims which are registered
+ *
+ * @return 0 on success, or the first error encountered (it will still try to unregister all others)
+ */
+static int unregister_boot_shim_types(void)
+{
+    int out = 0;
+    for (int type = BOOT_MEDIA_USB; type <= BOOT_MEDIA_SATA_DISK; ++type) {
+        if (!(registered_types & boot_type_bit(type)))
+            continue;
 
-    registered_type = boot_dev_config->type;
+        int err = unregister_boot_shim_type(type); //individual shims should print what went wrong
+        if (err != 0 && out == 0)
+            out = err;
+        else if (err == 0)
+            registered_types &= ~boot_type_bit(type);
+    }
+
+    return out;
+}
+
+int register_boot_shim(const struct boot_media *boot_dev_config)
+{
+    shim_reg_in();
+
+    if (unlikely(registered_types)) {
+        pr_loc_bug("Boot shim is already registered with types=0x%x", registered_types);
+        return -EEXIST;
+    }
+
+    //Each shim type is registered once and resolves all candidates of its type (see scsi_is_boot_dev_target() for how
+    // SATA DOM & disk shims agree on which one takes a given disk)
+    for (unsigned int i = 0; i < boot_dev_config->candidates_num; ++i) {
+        enum boot_media_type type = boot_dev_config->candidates[i].type;
+        if (registered_types & boot_type_bit(type))
+            continue;
+
+        int out = register_boot_shim_type(boot_dev_config, type);
+        if (out != 0) { //individual shims should print what went wrong
+            unregister_boot_shim_types();
+            return out;
+        }
+
+        registered_types |= boot_type_bit(type);
+    }
+
+    if (unlikely(!registered_types)) {
+        pr_loc_bug("No boot device candidates to register shims for");
+        return -EINVAL;
+    }
 
     shim_reg_ok();
     return 0;
@@ -81,29 +136,15 @@ int unregister_boot_shim(void)
 {
     shim_ureg_in();
 
-    int out;
-    switch (registered_type) {
-        case BOOT_MEDIA_USB:
-            out = unregister_usb_boot_shim();
-            break;
-        case BOOT_MEDIA_SATA_DOM:
-            out = unregister_native_sata_boot_shim();
-            break;
-        case BOOT_MEDIA_SATA_DISK:
-            out = unregister_fake_sata_boot_shim();
-        case BOOT_MEDIA_SHIM_NULL:
-            pr_loc_bug("Boot shim is no registered");
-            return -ENOENT;
-        default: //that cannot happen unless register_boot_shim() is broken
-            pr_loc_bug("Failed to %s - unknown type=%d", __FUNCTION__, registered_type);
-            return -EINVAL;
+    if (unlikely(!registered_types)) {
+        pr_loc_bug("Boot shim is no registered");
+        return -ENOENT;
     }
 
+    int out = unregister_boot_shim_types();
     if (out != 0)
-        return out; //individual shims should print what went wrong
-
-    registered_type = BOOT_MEDIA_SHIM_NULL;
+        return out;
 
     shim_ureg_ok();
     return 0;
-}
\ No newline at end of file
+}
@@ -31,7 +31,14 @@ int register_disable_executables_shim(void)
 
 int unregister_disable_executables_shim(void)
 {
-    //noop - execve entries will be cleared in one sweep during unregister of interceptor (it's much faster this way)
-    //this function is kept for consistency
+    shim_ureg_in();
+
+    //entries may already be gone if the interceptor was unregistered first - this is not an error
+    remove_blocked_execve_filename(BOOTLOADER_UPDATE1_PATH);
+    remove_blocked_execve_filename(BOOTLOADER_UPDATE2_PATH);
+    remove_blocked_execve_filename(PSTORE_PATH);
+    remove_blocked_execve_filename(SAS_FW_UPDATE_PATH);
+
+    shim_ureg_ok();
     return 0;
 }
\ No newline at end of file
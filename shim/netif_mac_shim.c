@@ -0,0 +1,137 @@
+/**
+ * Assigns MAC addresses from the kernel cmdline (mac1=, mac2=, ...) to ethernet interfaces as soon as they appear
+ *
+ * WHY?
+ * DSM expects the NICs to have MACs matching the serial/model. The userspace does set them from the same cmdline
+ * values, but it does that late and by taking every interface down and up again. This resets the link (which then
+ * needs to be negotiated again, and DHCP to start over), so the network becomes usable seconds later than it could.
+ *
+ * HOW IT WORKS?
+ * A netdevice notifier sets macN on "eth<N-1>" while it's being registered, i.e. before anybody could bring it up. The
+ * MAC is changed using the driver (ndo_set_mac_address) so it's programmed into the hardware & all other notifiers
+ * see the change. When DSM later compares MACs they already match and the interface is left alone.
+ * Interfaces which already exist when the shim is registered get the same treatment (the notifier chain replays
+ * their registration); ones which are already up are skipped as most drivers cannot change the MAC of a running
+ * interface. Interfaces without a configured MAC, non-ethernet ones and ones not backed by a device (e.g. bridges
+ * or bonds) are never touched. MACs are not restored when the shim is unregistered.
+ */
+#define SHIM_NAME "NIC MAC assignment"
+
+#include "netif_mac_shim.h"
+#include "shim_base.h"
+#include "../common.h"
+#include "../config/runtime_config.h" //struct runtime_config, mac_address
+#include <linux/netdevice.h> //register_netdevice_notifier(), dev_set_mac_address(), netif_running()
+#include <linux/if_arp.h> //ARPHRD_ETHER
+#include <linux/if_ether.h> //ETH_ALEN
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION()
+
+#define ETH_IFACE_FMT "eth%u%n"
+
+static const struct runtime_config *config = NULL;
+
+/**
+ * Gets the configured MAC for an interface based on its name
+ *
+ * @return MAC or NULL if the interface doesn't have one configured
+ */
+static const u8 *get_netif_mac(const struct net_device *dev)
+{
+    unsigned int idx;
+    int len = 0;
+    if (sscanf(dev->name, ETH_IFACE_FMT, &idx, &len) != 1 || dev->name[len] != '\0' || idx >= config->macs_num)
+        return NULL;
+
+    return config->macs[idx];
+}
+
+static void assign_netif_mac(struct net_device *dev)
+{
+    if (dev->type != ARPHRD_ETHER || dev->addr_len != ETH_ALEN || !dev->dev.parent)
+        return;
+
+    const u8 *mac = get_netif_mac(dev);
+    if (!mac || ether_addr_equal(dev->dev_addr, mac))
+        return;
+
+    if (netif_running(dev)) {
+        pr_loc_wrn("Interface %s is already up - leaving its MAC %pM for the userspace to change", dev->name,
+                   dev->dev_addr);
+        return;
+    }
+
+    struct sockaddr addr = { .sa_family = dev->type };
+    memcpy(addr.sa_data, mac, ETH_ALEN);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+    int out = dev_set_mac_address(dev, &addr, NULL);
+#else
+    int out = dev_set_mac_address(dev, &addr);
+#endif
+    if (out != 0) {
+        pr_loc_wrn("Failed to set MAC of %s to %pM - error=%d", dev->name, mac, out);
+        return;
+    }
+
+    pr_loc_inf("Interface %s assigned MAC %pM", dev->name, mac);
+}
+
+static int on_netdev_event(struct notifier_block *self, unsigned long event, void *data)
+{
+    if (event != NETDEV_REGISTER)
+        return NOTIFY_DONE;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+    assign_netif_mac(netdev_notifier_info_to_dev(data));
+#else
+    assign_netif_mac(data);
+#endif
+
+    return NOTIFY_OK;
+}
+
+static struct notifier_block netdev_nb = {
+    .notifier_call = on_netdev_event,
+};
+
+int register_netif_mac_shim(const struct runtime_config *runtime_config)
+{
+    shim_reg_in();
+
+    if (unlikely(config))
+        shim_reg_already();
+
+    if (runtime_config->macs_num == 0) {
+        pr_loc_dbg("No MACs configured - nothing to assign");
+        shim_reg_ok();
+        return 0;
+    }
+
+    config = runtime_config;
+    int out = register_netdevice_notifier(&netdev_nb); //calls us for interfaces which already exist
+    if (out != 0) {
+        pr_loc_err("Failed to register netdevice notifier - error=%d", out);
+        config = NULL;
+        return out;
+    }
+
+    shim_reg_ok();
+    return 0;
+}
+
+int unregister_netif_mac_shim(void)
+{
+    shim_ureg_in();
+
+    if (!config)
+        return 0; //not registered when there are no MACs to assign
+
+    int out = unregister_netdevice_notifier(&netdev_nb);
+    if (out != 0) {
+        pr_loc_err("Failed to unregister netdevice notifier - error=%d", out);
+        return out;
+    }
+
+    config = NULL;
+    shim_ureg_ok();
+    return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef REDPILL_NETIF_MAC_SHIM_H
+#define REDPILL_NETIF_MAC_SHIM_H
+
+struct runtime_config;
+int register_netif_mac_shim(const struct runtime_config *config);
+int unregister_netif_mac_shim(void);
+
+#endif //REDPILL_NETIF_MAC_SHIM_H
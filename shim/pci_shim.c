@@ -6,185 +6,431 @@
 #include "../config/vpci_types.h" //MAX_VPCI_DEVS, pci_shim_device_type
 #include "../config/platform_types.h" //hw_config
 #include "../internal/virtual_pci.h"
+#include "../internal/helper/debugfs_helper.h" //RP_DEBUGFS_ENABLED, get_rp_debugfs_dir()
 #include <linux/pci_ids.h>
+#include <linux/pci_regs.h> //PCI_EXP_*
+#include <linux/debugfs.h> //debugfs_create_file(), debugfs_remove()
+#include <linux/seq_file.h> //seq_printf(), single_open()
+#include <linux/uaccess.h> //copy_from_user()
+#include <linux/mutex.h> //DEFINE_MUTEX
 
-unsigned int free_dev_idx = 0;
-static void *devices[MAX_VPCI_DEVS] = { NULL };
+//Caps of a PCIe endpoint the way it's shown by real controllers: PM, single-vector MSI, and the link
+#define pcie_endpoint_caps(speed, width) { \
+        .pm = true, .msi = true, .pcie = true, .msi_vectors_log2 = 0, .pcie_type = PCI_EXP_TYPE_ENDPOINT, \
+        .link_speed = (speed), .link_width = (width) }
 
-static struct pci_dev_descriptor *allocate_vpci_dev_dsc(void) {
-    if (free_dev_idx >= MAX_VPCI_DEVS) {
-        /*index has to be at max MAX_VPCI_DEVS-1*/
-        pr_loc_bug("No more device indexes are available (max devs: %d)", MAX_VPCI_DEVS);
-        return ERR_PTR(-ENOMEM);
-    }
-
-    struct pci_dev_descriptor *dev_dsc;
-    kmalloc_or_exit_ptr(dev_dsc, sizeof(struct pci_dev_descriptor));
-    memcpy(dev_dsc, &pci_dev_conf_default_normal_dev, sizeof(struct pci_dev_descriptor));
-    devices[free_dev_idx++] = dev_dsc;
+static const struct vpci_dev_caps pcie_gen2_x2_caps = pcie_endpoint_caps(PCI_EXP_LNKCAP_SLS_5_0GB, 2);
+static const struct vpci_dev_caps pcie_gen2_x1_caps = pcie_endpoint_caps(PCI_EXP_LNKCAP_SLS_5_0GB, 1);
+static const struct vpci_dev_caps pcie_gen1_x1_caps = pcie_endpoint_caps(PCI_EXP_LNKCAP_SLS_2_5GB, 1);
 
-    return dev_dsc;
-}
-#define allocate_vpci_dev_dsc_var() \
-    struct pci_dev_descriptor *dev_dsc = allocate_vpci_dev_dsc(); \
-    if (IS_ERR(dev_dsc)) return PTR_ERR(dev_dsc);
-    
-static int
-add_vdev(struct pci_dev_descriptor *dev_dsc, unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                    bool is_mf)
-{
-    const struct virtual_device *vpci_vdev;
-
-    if (is_mf) {
-        vpci_vdev = vpci_add_multifunction_device(bus_no, dev_no, fn_no, dev_dsc);
-    } else if(unlikely(fn_no != 0x00)) {
-        //Making such config will either cause the device to not show up at all or only fn_no=0 one will show u
-        pr_loc_bug("%s called with non-MF device but non-zero fn_no", __FUNCTION__);
-        return -EINVAL;
-    } else {
-        vpci_vdev = vpci_add_single_device(bus_no, dev_no, dev_dsc);
-    }
-
-    return IS_ERR(vpci_vdev) ? PTR_ERR(vpci_vdev) : 0;
-}
+/**
+ * Fills a descriptor (initialized from pci_dev_conf_default_normal_dev) with identity of a given device type
+ */
+typedef void (*vpci_dsc_builder)(struct pci_dev_descriptor *dev_dsc);
 
 /**
- * Adds a fake Marvell controller
+ * Fake Marvell controller
  *
- * These errors in kernlog are normal (as we don't emulate the behavior of the controller as it's not needed):
+ * The behavior of the controller isn't emulated as it's not needed, so ahci cannot drive it. It's kept away from the
+ * device (see "DRIVERS BINDING" in internal/virtual_pci.c), but on kernels older than v3.16 it still probes it once
+ * during scanning, which causes these (harmless) errors in kernlog:
  *   pci 0001:0a:00.0: Can't map mv9235 registers
  *   ahci: probe of 0001:0a:00.0 failed with error -22
- *
- * @return 0 on success or -E
  */
-static inline int
-vdev_add_generic_marvell_ahci(u16 dev, unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static inline void build_generic_marvell_ahci(struct pci_dev_descriptor *dev_dsc, u16 dev)
 {
-    allocate_vpci_dev_dsc_var();
     dev_dsc->vid = PCI_VENDOR_ID_MARVELL_EXT;
     dev_dsc->dev = dev;
     dev_dsc->rev_id = 0x11; //All Marvells so far use revision 11
     dev_dsc->class = U24_CLASS_TO_U8_CLASS(PCI_CLASS_STORAGE_SATA_AHCI);
     dev_dsc->subclass = U24_CLASS_TO_U8_SUBCLASS(PCI_CLASS_STORAGE_SATA_AHCI);
     dev_dsc->prog_if = U24_CLASS_TO_U8_PROGIF(PCI_CLASS_STORAGE_SATA_AHCI);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
 }
 
-static int vdev_add_MARVELL_88SE9235(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static void build_MARVELL_88SE9235(struct pci_dev_descriptor *dev_dsc)
 {
-    return vdev_add_generic_marvell_ahci(0x9235, bus_no, dev_no, fn_no, is_mf);
+    build_generic_marvell_ahci(dev_dsc, 0x9235);
 }
 
-static int vdev_add_MARVELL_88SE9215(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static void build_MARVELL_88SE9215(struct pci_dev_descriptor *dev_dsc)
 {
-    return vdev_add_generic_marvell_ahci(0x9215, bus_no, dev_no, fn_no, is_mf);
+    build_generic_marvell_ahci(dev_dsc, 0x9215);
 }
 
-static int vdev_add_INTEL_I211(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static void build_INTEL_I211(struct pci_dev_descriptor *dev_dsc)
 {
-    allocate_vpci_dev_dsc_var();
     dev_dsc->vid = PCI_VENDOR_ID_INTEL;
     dev_dsc->dev = 0x1539;
     dev_dsc->rev_id = 0x03; //Not confirmed
     dev_dsc->class = U16_CLASS_TO_U8_CLASS(PCI_CLASS_NETWORK_ETHERNET);
     dev_dsc->subclass = U16_CLASS_TO_U8_SUBCLASS(PCI_CLASS_NETWORK_ETHERNET);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
 }
 
-static int vdev_add_INTEL_CPU_AHCI_CTRL(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static void build_INTEL_CPU_AHCI_CTRL(struct pci_dev_descriptor *dev_dsc)
 {
-    allocate_vpci_dev_dsc_var();
     dev_dsc->vid = PCI_VENDOR_ID_INTEL;
     dev_dsc->dev = 0x5ae3;
     dev_dsc->class = U24_CLASS_TO_U8_CLASS(PCI_CLASS_STORAGE_SATA_AHCI);
     dev_dsc->subclass = U24_CLASS_TO_U8_SUBCLASS(PCI_CLASS_STORAGE_SATA_AHCI);
     dev_dsc->prog_if = U24_CLASS_TO_U8_PROGIF(PCI_CLASS_STORAGE_SATA_AHCI);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
 }
 
 //This technically should be a bridge but we don't have the info to recreate full tree
-static inline int
-vdev_add_generic_intel_pcie(u16 dev, unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf) {
-    allocate_vpci_dev_dsc_var();
+static inline void build_generic_intel_pcie(struct pci_dev_descriptor *dev_dsc, u16 dev)
+{
     dev_dsc->vid = PCI_VENDOR_ID_INTEL;
     dev_dsc->dev = dev;
     dev_dsc->class = U16_CLASS_TO_U8_CLASS(PCI_CLASS_BRIDGE_PCI);
     dev_dsc->subclass = U16_CLASS_TO_U8_SUBCLASS(PCI_CLASS_BRIDGE_PCI);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
 }
 
-static int vdev_add_INTEL_CPU_PCIE_PA(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static void build_INTEL_CPU_PCIE_PA(struct pci_dev_descriptor *dev_dsc)
 {
-    return vdev_add_generic_intel_pcie(0x5ad8, bus_no, dev_no, fn_no, is_mf);
+    build_generic_intel_pcie(dev_dsc, 0x5ad8);
 }
 
-static int vdev_add_INTEL_CPU_PCIE_PB(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static void build_INTEL_CPU_PCIE_PB(struct pci_dev_descriptor *dev_dsc)
 {
-    return vdev_add_generic_intel_pcie(0x5ad6, bus_no, dev_no, fn_no, is_mf);
+    build_generic_intel_pcie(dev_dsc, 0x5ad6);
 }
 
-static int vdev_add_INTEL_CPU_USB_XHCI(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static void build_INTEL_CPU_USB_XHCI(struct pci_dev_descriptor *dev_dsc)
 {
-    allocate_vpci_dev_dsc_var();
     dev_dsc->vid = PCI_VENDOR_ID_INTEL;
     dev_dsc->dev = 0x5aa8;
     dev_dsc->class = U24_CLASS_TO_U8_CLASS(PCI_CLASS_SERIAL_USB_XHCI);
     dev_dsc->subclass = U24_CLASS_TO_U8_SUBCLASS(PCI_CLASS_SERIAL_USB_XHCI);
     dev_dsc->prog_if = U24_CLASS_TO_U8_PROGIF(PCI_CLASS_SERIAL_USB_XHCI);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
 }
 
-static inline int
-vdev_add_generic_intel_io(u16 dev, unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static inline void build_generic_intel_io(struct pci_dev_descriptor *dev_dsc, u16 dev)
 {
-    allocate_vpci_dev_dsc_var();
     dev_dsc->vid = PCI_VENDOR_ID_INTEL;
     dev_dsc->dev = dev;
     dev_dsc->class = U16_CLASS_TO_U8_CLASS(PCI_CLASS_SP_OTHER);
     dev_dsc->subclass = U16_CLASS_TO_U8_SUBCLASS(PCI_CLASS_SP_OTHER);
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
 }
 
-static int vdev_add_INTEL_CPU_I2C(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static void build_INTEL_CPU_I2C(struct pci_dev_descriptor *dev_dsc)
 {
-    return vdev_add_generic_intel_io(0x5aac, bus_no, dev_no, fn_no, is_mf);
+    build_generic_intel_io(dev_dsc, 0x5aac);
 }
 
-static int vdev_add_INTEL_CPU_HSUART(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static void build_INTEL_CPU_HSUART(struct pci_dev_descriptor *dev_dsc)
 {
-    return vdev_add_generic_intel_io(0x5abc, bus_no, dev_no, fn_no, is_mf);
+    build_generic_intel_io(dev_dsc, 0x5abc);
 }
 
-static int vdev_add_INTEL_CPU_SPI(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static void build_INTEL_CPU_SPI(struct pci_dev_descriptor *dev_dsc)
 {
-    return vdev_add_generic_intel_io(0x5ac6, bus_no, dev_no, fn_no, is_mf);
+    build_generic_intel_io(dev_dsc, 0x5ac6);
 }
 
-static int vdev_add_INTEL_CPU_SMBUS(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf)
+static void build_INTEL_CPU_SMBUS(struct pci_dev_descriptor *dev_dsc)
 {
-    allocate_vpci_dev_dsc_var();
     dev_dsc->vid = PCI_VENDOR_ID_INTEL;
     dev_dsc->dev = 0x5ad4;
     dev_dsc->class = U16_CLASS_TO_U8_CLASS(PCI_CLASS_SERIAL_SMBUS);
     dev_dsc->subclass = U16_CLASS_TO_U8_SUBCLASS(PCI_CLASS_SERIAL_SMBUS);
+}
+
+/**
+ * Template registry: every device type is built at most once and its descriptor is shared read-only by all stubs of
+ * that type (e.g. 4x 88SE9235 on DS3615xs). The vPCI layer only reads it while adding a device - each device gets its
+ * own copy of the config space (which is where e.g. BAR sizing writes go), and the MF bit is set in that copy too.
+ */
+struct vpci_dev_template {
+    const char *name;
+    vpci_dsc_builder build;
+    const struct vpci_dev_caps *caps; //NULL if the device has no capabilities
+};
+
+#define VPD_TEMPLATE(type, builder, dev_caps) [type] = { .name = #type, .build = (builder), .caps = (dev_caps) }
+static const struct vpci_dev_template dev_templates[] = {
+        VPD_TEMPLATE(VPD_MARVELL_88SE9235, build_MARVELL_88SE9235, &pcie_gen2_x2_caps),
+        VPD_TEMPLATE(VPD_MARVELL_88SE9215, build_MARVELL_88SE9215, &pcie_gen2_x1_caps),
+        VPD_TEMPLATE(VPD_INTEL_I211, build_INTEL_I211, &pcie_gen1_x1_caps), //PCIe 2.1 x1 @ 2.5GT/s
+        VPD_TEMPLATE(VPD_INTEL_CPU_AHCI_CTRL, build_INTEL_CPU_AHCI_CTRL, NULL),
+        VPD_TEMPLATE(VPD_INTEL_CPU_PCIE_PA, build_INTEL_CPU_PCIE_PA, NULL),
+        VPD_TEMPLATE(VPD_INTEL_CPU_PCIE_PB, build_INTEL_CPU_PCIE_PB, NULL),
+        VPD_TEMPLATE(VPD_INTEL_CPU_USB_XHCI, build_INTEL_CPU_USB_XHCI, NULL),
+        VPD_TEMPLATE(VPD_INTEL_CPU_I2C, build_INTEL_CPU_I2C, NULL),
+        VPD_TEMPLATE(VPD_INTEL_CPU_HSUART, build_INTEL_CPU_HSUART, NULL),
+        VPD_TEMPLATE(VPD_INTEL_CPU_SPI, build_INTEL_CPU_SPI, NULL),
+        VPD_TEMPLATE(VPD_INTEL_CPU_SMBUS, build_INTEL_CPU_SMBUS, NULL),
+};
+#undef VPD_TEMPLATE
+
+static struct pci_dev_descriptor *template_dscs[ARRAY_SIZE(dev_templates)] = { NULL }; //built on the first use
+
+static struct vpci_device_stub stubs[MAX_VPCI_DEVS]; //all stubs currently added
+static unsigned int stubs_num = 0;
+
+static __always_inline bool is_valid_type(enum pci_shim_device_type type)
+{
+    return type > __VPD_TERMINATOR__ && type < ARRAY_SIZE(dev_templates) && dev_templates[type].build;
+}
+
+/**
+ * Gets a shared descriptor for a given device type, building it if it's the first use
+ *
+ * @return descriptor or ERR_PTR(-E)
+ */
+static const struct pci_dev_descriptor *get_template_dsc(enum pci_shim_device_type type)
+{
+    if (template_dscs[type])
+        return template_dscs[type];
+
+    struct pci_dev_descriptor *dev_dsc;
+    kmalloc_or_exit_ptr(dev_dsc, sizeof(struct pci_dev_descriptor));
+    memcpy(dev_dsc, &pci_dev_conf_default_normal_dev, sizeof(struct pci_dev_descriptor));
+    dev_templates[type].build(dev_dsc);
+    template_dscs[type] = dev_dsc;
+
+    pr_loc_dbg("Built vPCI template for %s", dev_templates[type].name);
+    return dev_dsc;
+}
+
+static void free_template_dscs(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(template_dscs); i++) {
+        kfree(template_dscs[i]);
+        template_dscs[i] = NULL;
+    }
+}
+
+/**
+ * Creates a single stub device & records it
+ *
+ * @return 0 on success or -E
+ */
+static int add_stub(const struct vpci_device_stub *stub)
+{
+    if (unlikely(!is_valid_type(stub->type))) {
+        pr_loc_bug("Invalid vPCI device type %d", stub->type);
+        return -EINVAL;
+    }
+
+    if (unlikely(stubs_num >= MAX_VPCI_DEVS)) {
+        pr_loc_bug("No more device indexes are available (max devs: %d)", MAX_VPCI_DEVS);
+        return -ENOMEM;
+    }
+
+    if (unlikely(!stub->multifunction && stub->fn != 0x00)) {
+        //Making such config will either cause the device to not show up at all or only fn_no=0 one will show up
+        pr_loc_bug("Non-MF device %s with non-zero fn_no", dev_templates[stub->type].name);
+        return -EINVAL;
+    }
+
+    const struct pci_dev_descriptor *dev_dsc = get_template_dsc(stub->type);
+    if (IS_ERR(dev_dsc))
+        return PTR_ERR(dev_dsc);
+
+    pr_loc_dbg("Adding %s with B:D:F=%02x:%02x:%02x mf=%d", dev_templates[stub->type].name, stub->bus, stub->dev,
+               stub->fn, stub->multifunction ? 1 : 0);
+
+    const struct vpci_dev_caps *caps = dev_templates[stub->type].caps;
+    const struct virtual_device *vpci_vdev = stub->multifunction ?
+        vpci_add_multifunction_device_with_caps(stub->bus, stub->dev, stub->fn, dev_dsc, caps) :
+        vpci_add_single_device_with_caps(stub->bus, stub->dev, dev_dsc, caps);
+
+    if (IS_ERR(vpci_vdev)) {
+        pr_loc_err("Failed to create vPCI device B:D:F=%02x:%02x:%02x - error=%ld", stub->bus, stub->dev, stub->fn,
+                   PTR_ERR(vpci_vdev));
+        return PTR_ERR(vpci_vdev);
+    }
+
+    stubs[stubs_num++] = *stub;
+    return 0;
+}
+
+/**
+ * Removes a stub device created with add_stub(); its template stays for other/future stubs of the same type
+ *
+ * @return 0 on success or -E
+ */
+static int remove_stub(u8 bus, u8 dev, u8 fn)
+{
+    for (unsigned int i = 0; i < stubs_num; i++) {
+        if (stubs[i].bus != bus || stubs[i].dev != dev || stubs[i].fn != fn)
+            continue;
+
+        int out = vpci_remove_device(bus, dev, fn);
+        if (out != 0)
+            return out;
 
-    return add_vdev(dev_dsc, bus_no, dev_no, fn_no, is_mf);
-}
-
-static int (*dev_type_handler_map[])(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, bool is_mf) = {
-        [VPD_MARVELL_88SE9235] = vdev_add_MARVELL_88SE9235,
-        [VPD_MARVELL_88SE9215] = vdev_add_MARVELL_88SE9215,
-        [VPD_INTEL_I211] = vdev_add_INTEL_I211,
-        [VPD_INTEL_CPU_AHCI_CTRL] = vdev_add_INTEL_CPU_AHCI_CTRL,
-        [VPD_INTEL_CPU_PCIE_PA] = vdev_add_INTEL_CPU_PCIE_PA,
-        [VPD_INTEL_CPU_PCIE_PB] = vdev_add_INTEL_CPU_PCIE_PB,
-        [VPD_INTEL_CPU_USB_XHCI] = vdev_add_INTEL_CPU_USB_XHCI,
-        [VPD_INTEL_CPU_I2C] = vdev_add_INTEL_CPU_I2C,
-        [VPD_INTEL_CPU_HSUART] = vdev_add_INTEL_CPU_HSUART,
-        [VPD_INTEL_CPU_SPI] = vdev_add_INTEL_CPU_SPI,
-        [VPD_INTEL_CPU_SMBUS] = vdev_add_INTEL_CPU_SMBUS,
+        stubs[i] = stubs[--stubs_num]; //move the last one into the hole
+        return 0;
+    }
+
+    pr_loc_err("There's no vPCI stub @ B:D:F=%02x:%02x:%02x", bus, dev, fn);
+    return -ENOENT;
+}
+
+#ifdef RP_DEBUGFS_ENABLED
+/**
+ * Control interface for stub devices in debugfs (<debugfs>/redpill/vpci_stubs)
+ *
+ * Reading lists the current stubs. Writing "+<type> <bus>:<dev>.<fn> [mf]" (e.g. "+VPD_INTEL_I211 02:00.0") adds one
+ * and "-<bus>:<dev>.<fn>" removes one; numbers are hex like everywhere in PCI. Only the affected slot of the virtual
+ * bus is scanned/detached - see "RUNTIME CHANGES" in internal/virtual_pci.c for the rules.
+ */
+#define STUBS_CTRL_FILE "vpci_stubs"
+#define STUBS_CTRL_MAX_CMD 64
+#define STUBS_CTRL_MF "mf"
+static DEFINE_MUTEX(stubs_lock); //serializes changes from the file; register/unregister run before/after it exists
+static struct dentry *stubs_ctrl_file = NULL;
+
+static int stubs_ctrl_show(struct seq_file *m, void *v)
+{
+    mutex_lock(&stubs_lock);
+    for (unsigned int i = 0; i < stubs_num; i++) {
+        seq_printf(m, "%02x:%02x.%x %s%s\n", stubs[i].bus, stubs[i].dev, stubs[i].fn,
+                   dev_templates[stubs[i].type].name, stubs[i].multifunction ? " " STUBS_CTRL_MF : "");
+    }
+    mutex_unlock(&stubs_lock);
+
+    return 0;
+}
+
+static int stubs_ctrl_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stubs_ctrl_show, NULL);
+}
+
+/**
+ * Parses "<bus>:<dev>.<fn>"
+ *
+ * @return 0 on success, -EINVAL on error
+ */
+static int parse_bdf(const char *str, struct vpci_device_stub *stub)
+{
+    unsigned int bus, dev, fn;
+    int end = 0;
+
+    if (!str || sscanf(str, "%x:%x.%x%n", &bus, &dev, &fn, &end) != 3 || str[end] != '\0' || bus > 0xFF ||
+        dev > 0x1F || fn > 0x07) {
+        pr_loc_err("Invalid %s address \"%s\" - expected <bus>:<dev>.<fn>", STUBS_CTRL_FILE, str ? str : "");
+        return -EINVAL;
+    }
+
+    stub->bus = bus;
+    stub->dev = dev;
+    stub->fn = fn;
+    return 0;
+}
+
+/**
+ * Parses "<type> <bus>:<dev>.<fn> [mf]" and adds such stub
+ */
+static int add_stub_from_cmd(char *cmd)
+{
+    struct vpci_device_stub stub = { .type = __VPD_TERMINATOR__ };
+    char *cursor = cmd;
+    char *type = strsep(&cursor, " ");
+    char *bdf = strsep(&cursor, " ");
+
+    for (int i = __VPD_TERMINATOR__ + 1; i < ARRAY_SIZE(dev_templates); i++) {
+        if (is_valid_type(i) && strcmp(dev_templates[i].name, type) == 0) {
+            stub.type = i;
+            break;
+        }
+    }
+
+    if (stub.type == __VPD_TERMINATOR__) {
+        pr_loc_err("Unknown %s device type \"%s\"", STUBS_CTRL_FILE, type);
+        return -EINVAL;
+    }
+
+    if (parse_bdf(bdf, &stub) != 0)
+        return -EINVAL;
+
+    if (cursor && strcmp(cursor, STUBS_CTRL_MF) == 0) {
+        stub.multifunction = true;
+    } else if (cursor) {
+        pr_loc_err("Invalid %s flag \"%s\" - expected \"%s\" or nothing", STUBS_CTRL_FILE, cursor, STUBS_CTRL_MF);
+        return -EINVAL;
+    }
+
+    return add_stub(&stub);
+}
+
+static int remove_stub_from_cmd(char *cmd)
+{
+    struct vpci_device_stub stub;
+    if (parse_bdf(cmd, &stub) != 0)
+        return -EINVAL;
+
+    return remove_stub(stub.bus, stub.dev, stub.fn);
+}
+
+static ssize_t stubs_ctrl_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
+{
+    char cmd[STUBS_CTRL_MAX_CMD];
+    if (unlikely(len < 2 || len >= sizeof(cmd)))
+        return -EINVAL;
+
+    if (copy_from_user(cmd, buf, len))
+        return -EFAULT;
+    cmd[len] = '\0';
+    strim(cmd);
+
+    int out;
+    mutex_lock(&stubs_lock);
+    switch (cmd[0]) {
+        case '+':
+            out = add_stub_from_cmd(&cmd[1]);
+            break;
+        case '-':
+            out = remove_stub_from_cmd(&cmd[1]);
+            break;
+        default:
+            pr_loc_err("Invalid %s command \"%s\" - expected +<type> <bus>:<dev>.<fn> [%s] or -<bus>:<dev>.<fn>",
+                       STUBS_CTRL_FILE, cmd, STUBS_CTRL_MF);
+            out = -EINVAL;
+    }
+    mutex_unlock(&stubs_lock);
+
+    return out == 0 ? len : out;
+}
+
+static const struct file_operations stubs_ctrl_fops = {
+    .owner = THIS_MODULE,
+    .open = stubs_ctrl_open,
+    .read = seq_read,
+    .write = stubs_ctrl_write,
+    .llseek = seq_lseek,
+    .release = single_release,
 };
 
+static void register_stubs_ctrl(void)
+{
+    struct dentry *dir = get_rp_debugfs_dir();
+    if (!dir)
+        return;
+
+    stubs_ctrl_file = debugfs_create_file(STUBS_CTRL_FILE, 0600, dir, NULL, &stubs_ctrl_fops);
+    if (IS_ERR_OR_NULL(stubs_ctrl_file)) {
+        pr_loc_wrn("Failed to create debugfs file %s - runtime control will not be available", STUBS_CTRL_FILE);
+        stubs_ctrl_file = NULL;
+        put_rp_debugfs_dir();
+    }
+}
+
+static void unregister_stubs_ctrl(void)
+{
+    if (!stubs_ctrl_file)
+        return;
+
+    debugfs_remove(stubs_ctrl_file);
+    stubs_ctrl_file = NULL;
+    put_rp_debugfs_dir();
+}
+#else
+static inline void register_stubs_ctrl(void) { }
+static inline void unregister_stubs_ctrl(void) { }
+#endif //RP_DEBUGFS_ENABLED
+
 int register_pci_shim(const struct hw_config *hw)
 {
     shim_reg_in();
@@ -195,22 +441,14 @@ int register_pci_shim(const struct hw_config *hw)
         if (hw->pci_stubs[i].type == __VPD_TERMINATOR__)
             break;
 
-        pr_loc_dbg("Calling %ps with B:D:F=%02x:%02x:%02x mf=%d", dev_type_handler_map[hw->pci_stubs[i].type],
-                   hw->pci_stubs[i].bus, hw->pci_stubs[i].dev, hw->pci_stubs[i].fn,
-                   hw->pci_stubs[i].multifunction ? 1 : 0);
-
-        out = dev_type_handler_map[hw->pci_stubs[i].type](hw->pci_stubs[i].bus, hw->pci_stubs[i].dev,
-                                                          hw->pci_stubs[i].fn, hw->pci_stubs[i].multifunction);
-
-        if (out != 0) {
-            pr_loc_err("Failed to create vPCI device B:D:F=%02x:%02x:%02x - error=%d", hw->pci_stubs[i].bus,
-                       hw->pci_stubs[i].dev, hw->pci_stubs[i].fn, out);
+        if ((out = add_stub(&hw->pci_stubs[i])) != 0)
             return out;
-        }
 
         pr_loc_dbg("vPCI device %d created successfully", i+1);
     }
 
+    register_stubs_ctrl();
+
     shim_reg_ok();
     return 0;
 }
@@ -218,12 +456,10 @@ int register_pci_shim(const struct hw_config *hw)
 int unregister_pci_shim(void)
 {
     shim_ureg_in();
+    unregister_stubs_ctrl();
     vpci_remove_all_devices_and_buses();
-
-    for (int i = 0; i < free_dev_idx; i++) {
-        pr_loc_dbg("Free PCI dev %d @ %p", i, devices[i]);
-        kfree(devices[i]);
-    }
+    stubs_num = 0;
+    free_template_dscs(); //only after all devices are gone
 
     shim_ureg_ok();
     return -EIO; //vpci_remove_all_devices_and_buses has a bug - this is a canary to not forget
@@ -0,0 +1,222 @@
+#include "pmu_parser.h"
+#ifdef __KERNEL__
+#include "../common.h"
+#include <linux/ctype.h> //isdigit()
+#else
+#include <ctype.h> //isdigit()
+#endif
+
+typedef struct pmu_trie_node pmu_trie_node;
+
+/**
+ * A single level of the commands prefix trie is an array of these, indexed by the command byte (see single_byte_idx())
+ *
+ * A node can terminate a command (cmd), be a prefix of longer commands (next), or both.
+ */
+struct pmu_trie_node {
+    const pmu_command *cmd;
+    const pmu_trie_node *next;
+};
+
+//@todo when we get the physical PMU emulator we can move this to a separate library so that shim contacts an internal
+// routing routine for commands which aren't shimmed here. Then we will add all PMU=>kernel commands as well. Currently
+// we only define kernel=>PMU ones as these are the ones we need to listen for.
+//Commands are matched using a prefix trie built at compile time from the definitions below. Every level of the trie is
+// a static array indexed by the byte of the command, with the first level being single byte commands. Multibyte
+// commands are added by defining a chain of levels (see DEFINE_CMD_PREFIX()), with the last one defining the command.
+#define PMU_CMD__MIN_CODE 0x30
+#define PMU_CMD__MAX_CODE 0x75
+#define PMU_TRIE_LEVEL_LEN (single_byte_idx(PMU_CMD__MAX_CODE)+1)
+#define single_byte_idx(id) ((id)-PMU_CMD__MIN_CODE)
+#define is_cmd_code(id) (likely((id) >= PMU_CMD__MIN_CODE) && likely((id) <= PMU_CMD__MAX_CODE))
+#define PMU_CMD_DEF(cnm, len, data, act) \
+    (&(const pmu_command){ .name = #cnm, .length = (len), .has_data = (data), .action = (act) })
+#define DEFINE_SINGLE_BYTE_CMD(cnm, act) \
+    [single_byte_idx(PMU_CMD_ ## cnm)] = { .cmd = PMU_CMD_DEF(cnm, 1, false, act) }
+#define DEFINE_SINGLE_BYTE_DATA_CMD(cnm, act) \
+    [single_byte_idx(PMU_CMD_ ## cnm)] = { .cmd = PMU_CMD_DEF(cnm, 1, true, act) }
+#define DEFINE_MULTI_BYTE_CMD(last_byte, cnm, act) \
+    [single_byte_idx(last_byte)] = { .cmd = PMU_CMD_DEF(cnm, strlen_static(PMU_CMD_ ## cnm), false, act) }
+#define DEFINE_CMD_PREFIX(byte, level) [single_byte_idx(byte)] = { .next = (level) }
+
+static const pmu_trie_node multi_byte_cmds_SW[PMU_TRIE_LEVEL_LEN] = {
+    DEFINE_MULTI_BYTE_CMD('1', OUT_SW1, PMU_ACT_NOOP),
+};
+
+static const pmu_trie_node multi_byte_cmds_S[PMU_TRIE_LEVEL_LEN] = {
+    DEFINE_CMD_PREFIX('W', multi_byte_cmds_SW),
+};
+
+static const pmu_trie_node pmu_cmds_trie[PMU_TRIE_LEVEL_LEN] = {
+    DEFINE_SINGLE_BYTE_CMD(OUT_HW_POWER_OFF, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_BUZ_SHORT, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_BUZ_LONG, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_PWR_LED_ON, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_PWR_LED_BLINK, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_PWR_LED_OFF, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_OFF, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_ON_GREEN, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_PULSE_GREEN, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_ON_ORANGE, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_PULSE_ORANGE, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_PULSE, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_USB_LED_ON, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_USB_LED_PULSE, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_USB_LED_OFF, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_HW_RESET, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_10G_LED_ON, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_10G_LED_OFF, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_LED_TOG_PWR_STAT, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_SWITCH_UP_VER, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_MIR_LED_OFF, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_GET_UNIQ, PMU_ACT_REPLY_UNIQ),
+    DEFINE_CMD_PREFIX('S', multi_byte_cmds_S),
+    DEFINE_SINGLE_BYTE_DATA_CMD(OUT_PWM_CYCLE, PMU_ACT_SET_PWM_CYCLE),
+    DEFINE_SINGLE_BYTE_DATA_CMD(OUT_PWM_HZ, PMU_ACT_SET_PWM_HZ),
+    DEFINE_SINGLE_BYTE_CMD(OUT_WOL_ON, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_SCHED_UP_OFF, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_SCHED_UP_ON, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_FAN_HEALTH_OFF, PMU_ACT_NOOP),
+    DEFINE_SINGLE_BYTE_CMD(OUT_FAN_HEALTH_ON, PMU_ACT_NOOP),
+};
+
+#define is_crlf(ptr, len) ((len) == 2 && (ptr)[0] == 0x0d && (ptr)[1] == 0x0a)
+
+/**
+ * The signature is walked down the commands trie as far as it goes, and the longest command found on the way wins. The
+ * remaining bytes are treated as data if the command accepts it (or if they're just CRLF, which some clients append).
+ */
+pmu_match_status noinline
+pmu_match_command(const pmu_command **cmd, const char *signature, const unsigned int sig_len, bool complete)
+{
+    if (unlikely(sig_len == 0)) {
+        if (!complete)
+            return PMU_CMD_AMBIGUOUS; //we have just the head so far
+
+        pr_loc_dbg("Invalid zero-length command (stray head without command signature) - discarding");
+        return PMU_CMD_NOT_FOUND;
+    }
+
+    const pmu_trie_node *level = pmu_cmds_trie;
+    const pmu_command *found = NULL;
+    unsigned int consumed = 0;
+    while (level && consumed < sig_len && is_cmd_code(signature[consumed])) {
+        const pmu_trie_node *node = &level[single_byte_idx(signature[consumed])];
+        if (!node->cmd && !node->next)
+            break;
+
+        ++consumed;
+        if (node->cmd)
+            found = node->cmd;
+        level = node->next;
+    }
+
+    //we ran out of bytes while still at a prefix of a longer command
+    if (!complete && consumed == sig_len && level)
+        return PMU_CMD_AMBIGUOUS;
+
+    if (!found)
+        return PMU_CMD_NOT_FOUND;
+
+    if (found->has_data) {
+        if (!complete)
+            return PMU_CMD_AMBIGUOUS; //there's no way to know when the data ends other than the next head or IDLE
+    } else if (found->length != sig_len && !is_crlf(&signature[found->length], sig_len - found->length)) {
+        return PMU_CMD_NOT_FOUND;
+    }
+
+    *cmd = found;
+    return PMU_CMD_FOUND;
+}
+
+int pmu_parse_numeric_arg(const char *data, u8 data_len, unsigned int *value)
+{
+    char buf[PMU_CMD_BUFFER_LEN + 1];
+
+    if (data_len == 1 && !isdigit((unsigned char)data[0])) {
+        *value = (u8)data[0];
+        return 0;
+    }
+
+    if (unlikely(data_len > PMU_CMD_BUFFER_LEN))
+        return -E2BIG;
+
+    memcpy(buf, data, data_len);
+    buf[data_len] = '\0';
+    return kstrtouint(buf, 10, value);
+}
+
+/**
+ * Matches the collected command and passes it to the dispatch callback
+ *
+ * @return result of the matching; nothing is dispatched for PMU_CMD_AMBIGUOUS
+ */
+static pmu_match_status route_command(struct pmu_parser *parser, bool complete)
+{
+    const pmu_command *cmd = NULL;
+
+    pmu_match_status out = pmu_match_command(&cmd, parser->buffer, parser->len, complete);
+    if (out != PMU_CMD_AMBIGUOUS)
+        parser->dispatch(parser->ctx, out == PMU_CMD_FOUND ? cmd : NULL, parser->buffer, parser->len);
+
+    return out;
+}
+
+void pmu_parser_init(struct pmu_parser *parser, pmu_dispatch_fn dispatch, void *ctx)
+{
+    parser->state = PMU_PARSE_WAIT_HEAD;
+    parser->len = 0;
+    parser->dispatch = dispatch;
+    parser->ctx = ctx;
+}
+
+static void pmu_parse_byte(struct pmu_parser *parser, char byte)
+{
+    if (byte == PMU_CMD_HEAD) { //got the beginning of a new command - the previously collected data is complete
+        if (parser->state == PMU_PARSE_CMD)
+            route_command(parser, true);
+
+        parser->state = PMU_PARSE_CMD;
+        parser->len = 0;
+        return;
+    }
+
+    switch (parser->state) {
+        case PMU_PARSE_WAIT_HEAD:
+            if (byte != 0x0d && byte != 0x0a) //we don't expect data before head (except CRLF after a command)
+                pr_loc_wrn("Found garbage data from PMU before cmd head (\"%c\" / 0x%02x) - ignoring", byte, byte);
+            return;
+
+        case PMU_PARSE_CMD:
+            if (unlikely(parser->len == PMU_CMD_BUFFER_LEN)) {
+                pr_loc_wrn("PMU command is longer than %d bytes - dispatching what we got & skipping the rest",
+                           PMU_CMD_BUFFER_LEN);
+                route_command(parser, true);
+                parser->state = PMU_PARSE_SKIP;
+                return;
+            }
+
+            parser->buffer[parser->len++] = byte;
+            return;
+
+        case PMU_PARSE_SKIP:
+            return;
+    }
+}
+
+void pmu_parser_feed(struct pmu_parser *parser, const char *data, unsigned int len)
+{
+    for (unsigned int i = 0; i < len; ++i)
+        pmu_parse_byte(parser, data[i]);
+}
+
+void pmu_parser_flush(struct pmu_parser *parser, bool end_of_packet)
+{
+    if (parser->state != PMU_PARSE_CMD)
+        return;
+
+    //Some versions of the mfgBIOS attach head AND THEN in a separate packet send the actual commands (sic!), so a
+    // lonely head is never considered complete
+    if (route_command(parser, end_of_packet && parser->len > 0) != PMU_CMD_AMBIGUOUS)
+        parser->state = PMU_PARSE_WAIT_HEAD;
+}
@@ -0,0 +1,161 @@
+/**
+ * Streaming parser of the PMU protocol (commands sent by the kernel to the PMU over its UART)
+ *
+ * It doesn't depend on any kernel state and is also built in the userspace (see compat/host/host_kernel.h and the
+ * "host-lib" Makefile target), so it can be fuzzed on a dev host. The PMU emulator (pmu_shim.c) feeds it with bytes
+ * received from the vUART and executes commands it reports.
+ */
+#ifndef REDPILL_PMU_PARSER_H
+#define REDPILL_PMU_PARSER_H
+
+#ifdef __KERNEL__
+#include <linux/types.h> //u8, bool
+#else
+#include "../compat/host/host_kernel.h"
+#endif
+
+#define PMU_CMD_HEAD 0x2d //every PMU packet is delimited by containing 0x2d (ASCII "-"/dash) as its first character
+#define PMU_CMD_BUFFER_LEN 16 //max length of a single command (with its data) collected; same as VUART_FIFO_LEN
+
+#define PMU_CMD_OUT_HW_POWER_OFF 0x31 //"1"
+#define PMU_CMD_OUT_BUZ_SHORT 0x32 //"2"
+#define PMU_CMD_OUT_BUZ_LONG 0x33 //"3"
+#define PMU_CMD_OUT_PWR_LED_ON 0x34 //"4"
+#define PMU_CMD_OUT_PWR_LED_BLINK 0x35 //"5"
+#define PMU_CMD_OUT_PWR_LED_OFF 0x36 //"6"
+#define PMU_CMD_OUT_STATUS_LED_OFF 0x37 //"7"
+#define PMU_CMD_OUT_STATUS_LED_ON_GREEN 0x38 //"8"
+#define PMU_CMD_OUT_STATUS_LED_PULSE_GREEN 0x39 //"9"
+#define PMU_CMD_OUT_STATUS_LED_ON_ORANGE 0x3A //":"
+#define PMU_CMD_OUT_STATUS_LED_PULSE_ORANGE 0x3B //";"
+//0x3C unknown (possibly not used)
+#define PMU_CMD_OUT_STATUS_LED_PULSE 0x3d //"="
+//0x3E-3F unknown (possibly not used)
+#define PMU_CMD_OUT_USB_LED_ON 0x40 //"@"
+#define PMU_CMD_OUT_USB_LED_PULSE 0x41 //"A"
+#define PMU_CMD_OUT_USB_LED_OFF 0x42 //"B"
+#define PMU_CMD_OUT_HW_RESET 0x43 //"C"
+//0x43-4A unknown
+#define PMU_CMD_OUT_10G_LED_ON 0x4a //"J"
+#define PMU_CMD_OUT_10G_LED_OFF 0x4b //"K"
+//0x4C unknown
+#define PMU_CMD_OUT_LED_TOG_PWR_STAT 0x4d //"M", allows for using one led for status and power and toggle between them
+//0x4E unknown
+#define PMU_CMD_OUT_SWITCH_UP_VER 0x4f //"O"
+#define PMU_CMD_OUT_MIR_LED_OFF 0x50 //"P"
+//0x51-55 unknown (except 52)
+#define PMU_CMD_OUT_GET_UNIQ 0x52 //"R"
+#define PMU_CMD_OUT_PWM_CYCLE 0x56 //"V"
+#define PMU_CMD_OUT_PWM_HZ 0x57 //"W"
+//0x58-59 unknown
+//0x60-71 inputs (except 6C), see pmu_raise_event()
+#define PMU_CMD_IN__MIN_CODE 0x60
+#define PMU_CMD_IN__MAX_CODE 0x71
+#define PMU_CMD_OUT_WOL_ON 0x6c //"l"
+#define PMU_CMD_OUT_SCHED_UP_OFF 0x72 //"r"
+#define PMU_CMD_OUT_SCHED_UP_ON 0x73 //"s"
+#define PMU_CMD_OUT_FAN_HEALTH_OFF 0x74 //"t"
+#define PMU_CMD_OUT_FAN_HEALTH_ON 0x75 //"u"
+
+//Multibyte commands (defined as strings)
+#define PMU_CMD_OUT_SW1 "SW1" //exact meaning unknown
+
+/**
+ * What the PMU emulator should do with a command; the parser only routes commands, the emulator maps these to handlers
+ */
+typedef enum {
+    PMU_ACT_NOOP, //just print the command received
+    PMU_ACT_REPLY_UNIQ,
+    PMU_ACT_SET_PWM_CYCLE,
+    PMU_ACT_SET_PWM_HZ,
+    PMU_ACT__COUNT,
+} pmu_cmd_action;
+
+/**
+ * A single PMU command and its routing
+ */
+typedef struct pmu_command {
+    const char *name;
+    u8 length; //commands are realistically 1-3 chars only
+    bool has_data; //command is followed by arguments of unknown length (complete only with next head/IDLE)
+    pmu_cmd_action action;
+} pmu_command;
+
+/**
+ * Result for matching of command signature against known list
+ */
+typedef enum {
+    PMU_CMD_AMBIGUOUS = -1,
+    PMU_CMD_NOT_FOUND =  0,
+    PMU_CMD_FOUND     =  1,
+} pmu_match_status;
+
+/**
+ * State of the streaming parser, see pmu_parser_feed()
+ */
+typedef enum {
+    PMU_PARSE_WAIT_HEAD, //nothing collected; anything other than PMU_CMD_HEAD is garbage
+    PMU_PARSE_CMD, //got head, collecting bytes of a command into buffer
+    PMU_PARSE_SKIP, //command was too long and was already dispatched; skipping its remains until the next head
+} pmu_parse_state;
+
+/**
+ * Called for every complete command collected by the parser
+ *
+ * @param cmd matched command or NULL if the signature doesn't match any known command
+ * @param signature bytes of the command (without head) including its data; valid only during the call
+ */
+typedef void (*pmu_dispatch_fn)(void *ctx, const pmu_command *cmd, const char *signature, unsigned int len);
+
+struct pmu_parser {
+    pmu_parse_state state;
+    unsigned int len; //number of bytes in buffer
+    char buffer[PMU_CMD_BUFFER_LEN]; //bytes of the currently collected command (without head)
+    pmu_dispatch_fn dispatch;
+    void *ctx;
+};
+
+/**
+ * (Re)initializes the parser to the state of waiting for a head
+ */
+void pmu_parser_init(struct pmu_parser *parser, pmu_dispatch_fn dispatch, void *ctx);
+
+/**
+ * Feeds bytes received from the PMU UART into the streaming parser
+ *
+ * Commands followed by a new head are dispatched right away as complete. Commands which don't fit into the buffer are
+ * dispatched as complete when the buffer fills up, with the rest of their data skipped. It never sleeps nor allocates.
+ */
+void pmu_parser_feed(struct pmu_parser *parser, const char *data, unsigned int len);
+
+/**
+ * Tries to dispatch the command collected so far after all bytes of a given transmission were fed
+ *
+ * @param end_of_packet Indicates whether this command was called because the UART transmitter assumed
+ *                      end-of-transmission/IDLE. If this parameter is true the collected command is assumed to be
+ *                      complete. Otherwise it's dispatched only if it's unambiguous (i.e. more bytes cannot change its
+ *                      meaning, see pmu_match_command()) and kept for the next transmission if it's not.
+ */
+void pmu_parser_flush(struct pmu_parser *parser, bool end_of_packet);
+
+/**
+ * Matches command against a list of known ones based on the signature specified
+ *
+ * @param cmd pointer to a pointer where address of command structure can be saved if found
+ * @param complete whether the signature is known to be complete; if it's not and more bytes may still change the
+ *                 outcome (i.e. it's a prefix of a longer command or the command accepts data) PMU_CMD_AMBIGUOUS is
+ *                 returned, so that the caller waits for more data
+ */
+pmu_match_status pmu_match_command(const pmu_command **cmd, const char *signature, unsigned int sig_len,
+                                   bool complete);
+
+/**
+ * Parses numeric argument of a command (e.g. PWM duty cycle)
+ *
+ * The argument is sent as ASCII decimal digits (e.g. "-V50"); a single non-digit byte is taken as a raw value.
+ *
+ * @return 0 on success, -E on error
+ */
+int pmu_parse_numeric_arg(const char *data, u8 data_len, unsigned int *value);
+
+#endif //REDPILL_PMU_PARSER_H
@@ -1,138 +1,138 @@
 #define SHIM_NAME "PMU emulator"
 
 #include "pmu_shim.h"
+#include "pmu_parser.h"
 #include "shim_base.h"
 #include "../common.h"
 #include "../internal/uart/virtual_uart.h"
+#include "bios/fan_control.h" //fan_control_set_duty(), fan_control_set_freq()
+#include "../internal/housekeeping.h" //alloc_housekeeping_wq()
 #include <linux/kfifo.h> //kfifo_*
+#include <linux/workqueue.h> //queue_work()
 
 #define PMU_TTYS_LINE 1 //so far this is hardcoded by syno, so we doubt it will ever change
-#define WORK_BUFFER_LEN VUART_FIFO_LEN
 #define to_hex_buf_len(len) ((len)*3+1) //2 chars for each hex + space + NULL terminator
-#define HEX_BUFFER_LEN to_hex_buf_len(VUART_FIFO_LEN)
+#define HEX_BUFFER_LEN to_hex_buf_len(VUART_FIFO_LEN_MAX) //we print whole vUART flushes
+#define PMU_CMD_QUEUE_LEN 16 //max number of commands waiting for execution (must be a power of 2)
 
-//PMU packets are at minimum 2 bytes long (PMU_CMD_HEAD + 1-3 bytes command + optional data). If this is set to a high
-// value (e.g. VUART_FIFO_LEN) in practice commands will only be delivered when the client indicates end-of-transmission)
-// which may not be bad...
+//PMU packets are at minimum 2 bytes long (PMU_CMD_HEAD + 1-3 bytes command + optional data). This is used as the vUART
+// threshold so that unambiguous commands are dispatched as soon as they arrive. If this is set to a high value (e.g.
+// VUART_FIFO_LEN) in practice commands will only be delivered when the client indicates end-of-transmission.
 #define PMU_MIN_PACKET 2
-#define PMU_CMD_HEAD 0x2d //every PMU packet is delimited by containing 0x2d (ASCII "-"/dash) as its first character
 
-typedef struct command_definition command_definition;
+/**
+ * Default/noop shim for a PMU command. It simply prints the command received.
+ */
+static void cmd_shim_noop(const pmu_command *t, const char *data, u8 data_len)
+{
+    pr_loc_dbg("vPMU received %s using %d bytes - NOOP", t->name, data_len);
+}
+
+static const struct hw_config *pmu_hw = NULL;
 
 /**
- * A single PMU command and its routing
+ * Sends a single packet from the (emulated) PMU to the kernel
+ *
+ * Packets have the same format as commands received (PMU_CMD_HEAD + code + optional payload). It MUST NOT be called
+ * from the vUART flush path (i.e. the parser) as it takes the vUART lock.
+ *
+ * @return 0 on success, -E on error
  */
-struct command_definition {
-    void (*fn) (const command_definition *t, const char *data, u8 data_len);
-    const u8 length; //commands are realistically 1-3 chars only
-    const char *name;
-} __packed;
+static int pmu_send(u8 code, const char *payload, unsigned int len)
+{
+    char packet[VUART_FIFO_LEN];
+    if (unlikely(len + 2 > sizeof(packet))) {
+        pr_loc_bug("PMU packet with %u bytes of payload doesn't fit in the FIFO", len);
+        return -E2BIG;
+    }
+
+    packet[0] = PMU_CMD_HEAD;
+    packet[1] = code;
+    memcpy(&packet[2], payload, len);
+
+    int out = vuart_inject_rx(PMU_TTYS_LINE, packet, len + 2);
+    if (unlikely(out < 0)) {
+        pr_loc_err("Failed to send PMU packet 0x%02x - error=%d", code, out);
+        return out;
+    } else if (unlikely(out != len + 2)) { //kernel didn't read the previous data yet; better nothing than a partial one
+        pr_loc_wrn("vUART RX FIFO is full - PMU packet 0x%02x was truncated to %d of %u bytes", code, out, len + 2);
+        return -EBUSY;
+    }
+
+    return 0;
+}
 
 /**
- * Result for matching of command signature against known list
+ * Replies to the "unique" query with the name of the platform
+ *
+ * The reply echoes the command code followed by the value, as for all PMU responses.
  */
-typedef enum {
-    PMU_CMD_AMBIGUOUS = -1,
-    PMU_CMD_NOT_FOUND =  0,
-    PMU_CMD_FOUND     =  1,
-} pmu_match_status;
+static void cmd_reply_uniq(const pmu_command *t, const char *data, u8 data_len)
+{
+    pr_loc_dbg("vPMU received %s - replying with \"%s\"", t->name, pmu_hw->name);
+    pmu_send(PMU_CMD_OUT_GET_UNIQ, pmu_hw->name, strlen(pmu_hw->name));
+}
 
 /**
- * Default/noop shim for a PMU command. It simply prints the command received.
+ * Sets fans duty cycle (in %) - the value is used as the minimum by the fan control loop (see fan_control.h)
  */
-static void cmd_shim_noop(const command_definition *t, const char *data, u8 data_len)
+static void cmd_set_pwm_cycle(const pmu_command *t, const char *data, u8 data_len)
 {
-    pr_loc_dbg("vPMU received %s using %d bytes - NOOP", t->name, data_len);
+    unsigned int duty;
+    if (pmu_parse_numeric_arg(data, data_len, &duty) != 0) {
+        pr_loc_wrn("vPMU received %s with invalid duty cycle \"%.*s\"", t->name, data_len, data);
+        return;
+    }
+
+    pr_loc_dbg("vPMU received %s - setting fans to %u%%", t->name, duty);
+    if (fan_control_set_duty(duty) != 0)
+        pr_loc_dbg("Fan control is not running - duty cycle will be applied once it starts");
 }
 
-//@todo when we get the physical PMU emulator we can move this to a separate library so that shim contacts an internal
-// routing routine for commands which aren't shimmed here. Then we will add all PMU=>kernel commands as well. Currently
-// we only define kernel=>PMU ones as these are the ones we need to listen for.
-#define PMU_CMD__MIN_CODE 0x30
-#define PMU_CMD__MAX_CODE 0x75
-#define single_byte_idx(id) ((id)-PMU_CMD__MIN_CODE)
-#define get_single_byte_cmd(id) single_byte_cmds[single_byte_idx(id)] //call it ONLY after has_single_byte_cmd!!!
-#define has_single_byte_cmd(id) \
-    (likely((id) >= PMU_CMD__MIN_CODE) && likely((id) <= PMU_CMD__MAX_CODE) && get_single_byte_cmd(id).length != 0)
-#define DEFINE_SINGLE_BYTE_CMD(cnm, fp) [single_byte_idx(PMU_CMD_ ## cnm)] = { .name = #cnm, .length = 1, .fn = fp }
-
-#define PMU_CMD_OUT_HW_POWER_OFF 0x31 //"1"
-#define PMU_CMD_OUT_BUZ_SHORT 0x32 //"2"
-#define PMU_CMD_OUT_BUZ_LONG 0x33 //"3"
-#define PMU_CMD_OUT_PWR_LED_ON 0x34 //"4"
-#define PMU_CMD_OUT_PWR_LED_BLINK 0x35 //"5"
-#define PMU_CMD_OUT_PWR_LED_OFF 0x36 //"6"
-#define PMU_CMD_OUT_STATUS_LED_OFF 0x37 //"7"
-#define PMU_CMD_OUT_STATUS_LED_ON_GREEN 0x38 //"8"
-#define PMU_CMD_OUT_STATUS_LED_PULSE_GREEN 0x39 //"9"
-#define PMU_CMD_OUT_STATUS_LED_ON_ORANGE 0x3A //":"
-#define PMU_CMD_OUT_STATUS_LED_PULSE_ORANGE 0x3B //";"
-//0x3C unknown (possibly not used)
-#define PMU_CMD_OUT_STATUS_LED_PULSE 0x3d //"="
-//0x3E-3F unknown (possibly not used)
-#define PMU_CMD_OUT_USB_LED_ON 0x40 //"@"
-#define PMU_CMD_OUT_USB_LED_PULSE 0x41 //"A"
-#define PMU_CMD_OUT_USB_LED_OFF 0x42 //"B"
-#define PMU_CMD_OUT_HW_RESET 0x43 //"C"
-//0x43-4A unknown
-#define PMU_CMD_OUT_10G_LED_ON 0x4a //"J"
-#define PMU_CMD_OUT_10G_LED_OFF 0x4b //"K"
-//0x4C unknown
-#define PMU_CMD_OUT_LED_TOG_PWR_STAT 0x4d //"M", allows for using one led for status and power and toggle between them
-//0x4E unknown
-#define PMU_CMD_OUT_SWITCH_UP_VER 0x4f //"O"
-#define PMU_CMD_OUT_MIR_LED_OFF 0x50 //"P"
-//0x51-55 unknown (except 52)
-#define PMU_CMD_OUT_GET_UNIQ 0x52 //"P"
-#define PMU_CMD_OUT_PWM_CYCLE 0x56 //"V"
-#define PMU_CMD_OUT_PWM_HZ 0x57 //"W"
-//0x58-59 unknown
-//0x60-71 inputs (except 6C)
-#define PMU_CMD_OUT_WOL_ON 0x6c //"l"
-#define PMU_CMD_OUT_SCHED_UP_OFF 0x72 //"r"
-#define PMU_CMD_OUT_SCHED_UP_ON 0x73 //"s"
-#define PMU_CMD_OUT_FAN_HEALTH_OFF 0x74 //"t"
-#define PMU_CMD_OUT_FAN_HEALTH_ON 0x75 //"u"
-
-static const command_definition single_byte_cmds[single_byte_idx(PMU_CMD__MAX_CODE)+1] = {
-    DEFINE_SINGLE_BYTE_CMD(OUT_HW_POWER_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_BUZ_SHORT, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_BUZ_LONG, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWR_LED_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWR_LED_BLINK, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWR_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_ON_GREEN, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_PULSE_GREEN, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_ON_ORANGE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_PULSE_ORANGE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_PULSE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_USB_LED_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_USB_LED_PULSE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_USB_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_HW_RESET, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_10G_LED_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_10G_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_LED_TOG_PWR_STAT, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_SWITCH_UP_VER, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_MIR_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_GET_UNIQ, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWM_CYCLE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWM_HZ, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_WOL_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_SCHED_UP_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_SCHED_UP_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_FAN_HEALTH_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_FAN_HEALTH_ON, cmd_shim_noop),
-};
+/**
+ * Sets fans PWM frequency (in Hz)
+ */
+static void cmd_set_pwm_hz(const pmu_command *t, const char *data, u8 data_len)
+{
+    unsigned int hz;
+    if (pmu_parse_numeric_arg(data, data_len, &hz) != 0 || hz == 0) {
+        pr_loc_wrn("vPMU received %s with invalid frequency \"%.*s\"", t->name, data_len, data);
+        return;
+    }
 
+    pr_loc_dbg("vPMU received %s - setting fans PWM to %uHz", t->name, hz);
+    if (fan_control_set_freq(hz) != 0)
+        pr_loc_dbg("Fan control is not running - PWM frequency will be applied once it starts");
+}
 
-static char *uart_buffer = NULL; //keeps data streamed directly by the vUART... todo: vUART should manage this buffer
-static char *work_buffer = NULL; //collecting & operatint on the data received from vUART
-static char *work_buffer_curr = NULL; //pointer to the current free space in work_buffer
+//Handlers of commands matched by the parser, executed by the worker (see pmu_cmd_worker())
+static void (*const cmd_handlers[PMU_ACT__COUNT])(const pmu_command *t, const char *data, u8 data_len) = {
+    [PMU_ACT_NOOP] = cmd_shim_noop,
+    [PMU_ACT_REPLY_UNIQ] = cmd_reply_uniq,
+    [PMU_ACT_SET_PWM_CYCLE] = cmd_set_pwm_cycle,
+    [PMU_ACT_SET_PWM_HZ] = cmd_set_pwm_hz,
+};
+
+static struct pmu_parser parser;
 static char *hex_print_buffer = NULL; //helper buffer to print char arrays in hex
 
-#define work_buffer_fill() ((unsigned int)(work_buffer_curr - work_buffer))
+/**
+ * A command matched by the parser waiting to be executed by the worker
+ */
+struct pmu_queued_cmd {
+    const pmu_command *cmd;
+    u8 len;
+    char data[PMU_CMD_BUFFER_LEN];
+};
+
+//Commands are parsed in the vUART flush path which holds the vUART lock with IRQs disabled, so their handlers (which
+// may sleep, e.g. GPIO, I2C or a power off) are executed in order from a workqueue instead. The order comes from the
+// kfifo drained by a single work item (which never runs concurrently with itself). The parser is the only producer and
+// the worker is the only consumer, so the kfifo doesn't need any additional locking.
+static DEFINE_KFIFO(cmd_queue, struct pmu_queued_cmd, PMU_CMD_QUEUE_LEN);
+static struct workqueue_struct *cmd_wq = NULL;
+static void pmu_cmd_worker(struct work_struct *work);
+static DECLARE_WORK(cmd_work, pmu_cmd_worker);
 
 /**
  * Free all buffers used by this submodule
@@ -141,18 +141,9 @@ static char *hex_print_buffer = NULL; //helper buffer to print char arrays in he
  */
 static void free_buffers(void)
 {
-    if (likely(uart_buffer))
-        kfree(uart_buffer);
-
-    if (likely(work_buffer))
-        kfree(work_buffer);
-
     if (likely(hex_print_buffer))
         kfree(hex_print_buffer);
 
-    uart_buffer = NULL;
-    work_buffer = NULL;
-    work_buffer_curr = NULL;
     hex_print_buffer = NULL;
 }
 
@@ -161,12 +152,8 @@ static void free_buffers(void)
  */
 static int alloc_buffers(void)
 {
-    kmalloc_or_exit_int(uart_buffer, VUART_FIFO_LEN);
-    kmalloc_or_exit_int(work_buffer, WORK_BUFFER_LEN);
     kmalloc_or_exit_int(hex_print_buffer, HEX_BUFFER_LEN);
 
-    work_buffer_curr = work_buffer;
-
     return 0;
 }
 
@@ -198,145 +185,82 @@ static __used const char *get_hex_print(const char *buffer, int len)
 }
 
 /**
- * Matches command against a list of known ones based on the signature specified
+ * Queues callback of a command matched by the parser for execution (see pmu_dispatch_fn)
  *
- * @param cmd pointer to a pointer where address of command structure can be saved if found
+ * This is called with the vUART lock held and IRQs disabled - it MUST NOT sleep.
  */
-static pmu_match_status noinline
-match_command(const command_definition **cmd, const char *signature, const unsigned int sig_len)
+static void queue_command(void *ctx, const pmu_command *cmd, const char *signature, unsigned int len)
 {
-    if (unlikely(sig_len == 0)) {
-        pr_loc_dbg("Invalid zero-length command (stray head without command signature) - discarding");
-        return PMU_CMD_NOT_FOUND;
+    if (!cmd) {
+        pr_loc_wrn("Unknown %d byte PMU command with signature hex=\"%s\" ascii=\"%.*s\"", len,
+                   get_hex_print(signature, len), len, signature);
+        return;
     }
 
-    if (likely(sig_len == 1) //regular 1 byte
-        || (sig_len == 3 && signature[1] == 0x0d && signature[2] == 0x0a) //1 byte with CRLF (sic!)
-       ) {
-        if (!has_single_byte_cmd(signature[0]))
-            return PMU_CMD_NOT_FOUND;
-
-        *cmd = &get_single_byte_cmd(signature[0]);
-        return PMU_CMD_FOUND;
+    struct pmu_queued_cmd entry = { .cmd = cmd, .len = len };
+    memcpy(entry.data, signature, len);
+    if (unlikely(kfifo_in(&cmd_queue, &entry, 1) == 0)) {
+        pr_loc_err("PMU command queue is full - dropping cmd %s", cmd->name);
+        return;
     }
 
-    return PMU_CMD_NOT_FOUND; //@todo Currently we don't handle multibyte commands; it has to be a full iteration
+    queue_work(cmd_wq, &cmd_work);
 }
 
 /**
- * Finds command based on its signature and execute its callback if found
+ * Executes handlers of all queued commands (in the order they were received)
  */
-static void route_command(const char *buffer, const unsigned int len)
+static void pmu_cmd_worker(struct work_struct *work)
 {
-    const command_definition *cmd = NULL;
+    struct pmu_queued_cmd entry;
 
-    if (match_command(&cmd, buffer, len) != PMU_CMD_FOUND) {
-        pr_loc_wrn("Unknown %d byte PMU command with signature hex=\"%s\" ascii=\"%.*s\"", len,
-                   get_hex_print(buffer, len), len, buffer);
-        return;
+    while (kfifo_out(&cmd_queue, &entry, 1) == 1) {
+        pr_loc_dbg("Executing cmd %s handler %pF", entry.cmd->name, cmd_handlers[entry.cmd->action]);
+        cmd_handlers[entry.cmd->action](entry.cmd, entry.data, entry.len);
     }
-
-    pr_loc_dbg("Executing cmd %s handler %pF", cmd->name, cmd->fn);
-    cmd->fn(cmd, buffer, len);
 }
 
 /**
- * Scans work buffer (copied from vUART buffer) to find commands
- *
- * @param end_of_packet Indicates whether this command was called because the vUART transmitter assumed
- *                      end-of-transmission/IDLE, or flushed due to its buffer being full. If this parameter is true the
- *                      data in the work buffer is assumed to be a complete representation of the state. This becomes
- *                      important if we cannot with 100% confidence say, after reaching the end of the buffer, if it
- *                      will be a multibyte command (but we possibly didn't get all the bytes YET) or this is single or
- *                      multibyte command which we don't know.
+ * Callback passed to vUART. It will be called any time some data is available.
  *
- * This function makes an assumption that when it's called that the buffer represents the whole state of the command
- * If this becomes to take too long we can move it to a separate thread, but this will require a lock.
+ * The data is parsed straight from the vUART FIFO (see vuart_span_callback_t) - the parser keeps its state across
+ * calls, so nothing needs to be copied (besides the bytes of the current command) and nothing is ever dropped.
  */
-static noinline void process_work_buffer(bool end_of_packet)
+static noinline void pmu_rx_callback(int line, const vuart_span spans[2], unsigned int len, vuart_flush_reason reason)
 {
-    if (unlikely(work_buffer == work_buffer_curr)) {
-        //this can happen if kernel sends no data but we get IDLE... shouldn't logically happen
-        pr_loc_wrn("%s called on empty buffer?!", __FUNCTION__);
-        return;
-    }
-
-    int cmd_len = -1; //number of bytes in the command (excluding header)
-    for(char *curr = work_buffer; curr < work_buffer_curr; ++curr) {
-        if (*curr == PMU_CMD_HEAD) { //got the beginning of a new command
-            //we've found a new command in the buffer - lets check if the previously collected data matches anything
-            if (cmd_len != -1) { //we only want to call it if this isn't the first byte after last cmd (or 1st in buf)
-                route_command(curr-cmd_len, cmd_len);
-                cmd_len = 0; //we've got the head so 0 and not -1
-            } else {
-                ++cmd_len; //We've read the buffer containing head, we then expect to get something which is non-head
-            }
-        } else {
-            if (cmd_len == -1) { //we don't expect data before head
-                pr_loc_wrn("Found garbage data in PMU buffer before cmd head (\"%c\" / 0x%02x) - ignoring", *curr,
-                           *curr);
-                continue;
-            }
-
-            ++cmd_len; //collecting another byte for the currently processed command
-        }
-    }
+    for (int i = 0; i < 2 && len > 0; ++i) {
+        unsigned int chunk = min_t(unsigned int, spans[i].len, len);
+        pr_loc_dbg("Got %d bytes from PMU: reason=%d hex={%s} ascii=\"%.*s\"", chunk, reason,
+                   get_hex_print(spans[i].data, chunk), chunk, spans[i].data);
 
-    //We've finished processing the buffer. Now we need to decide what to do with that last piece of data
-    unsigned int processed = work_buffer_fill();
-    if (cmd_len != -1) { //if it's -1 it means we didn't find any heading so we're just discarding all data
-        if (end_of_packet) {
-            route_command(work_buffer_curr-cmd_len, cmd_len);
-        } else { //if the packed didn't end we need to keep that piece of buffer for the next run
-            processed -= cmd_len + 1; //we also keep head
-        }
+        pmu_parser_feed(&parser, spans[i].data, chunk);
+        len -= chunk;
     }
 
-    unsigned int left = work_buffer_fill() - processed;
-    if (likely(left != 0)) {
-        memmove(work_buffer, work_buffer+processed, left);
-    }
-    work_buffer_curr = work_buffer + left;
-
-//    pr_loc_dbg("Left buffer %p curr=%p with %d bytes in it (ascii=\"%.*s\" hex={%s})", work_buffer, work_buffer_curr, left, left, work_buffer,
-//               get_hex_print(work_buffer, left));
+    //Commands are variable length and have no end delimiter nor length specified, with prefixes of short commands
+    // conflicting with longer commands (sic!). For example, you have "SW1" command which when sent will look like
+    // "-SW1" (0x2d 0x53 0x57 0x31) and we CANNOT distinguish "-S" from incomplete "-SW1".
+    //This is why the state is checked on every flush (we get one every PMU_MIN_PACKET bytes): everything which is
+    // unambiguous (followed by another head, or such that no more bytes can change its meaning) is dispatched right
+    // away, and the rest is kept until more data arrives or the IDLE happens - if we got "-S" with IDLE it means it was
+    // "-S" and not the beginning of "-SW1".
+    pmu_parser_flush(&parser, reason == VUART_FLUSH_IDLE);
 }
 
-/**
- * Callback passed to vUART. It will be called any time some data is available.
- */
-static noinline void pmu_rx_callback(int line, const char *buffer, unsigned int len, vuart_flush_reason reason)
+int pmu_raise_event(u8 code)
 {
-    pr_loc_dbg("Got %d bytes from PMU: reason=%d hex={%s} ascii=\"%.*s\"", len, reason, get_hex_print(buffer, len), len, buffer);
+    if (unlikely(code < PMU_CMD_IN__MIN_CODE || code > PMU_CMD_IN__MAX_CODE || code == PMU_CMD_OUT_WOL_ON)) {
+        pr_loc_bug("0x%02x is not a valid PMU event", code);
+        return -EINVAL;
+    }
 
-    int buffer_space = WORK_BUFFER_LEN - work_buffer_fill();
-    if (unlikely(work_buffer_curr + len > work_buffer + WORK_BUFFER_LEN)) { //todo just remove as much as needed from the buffer to fit more data
-        pr_loc_err("Work buffer is full! Only %d of %d bytes will be copied from receiver", len, buffer_space);
-        len = buffer_space;
+    if (unlikely(!pmu_hw)) {
+        pr_loc_wrn("Cannot raise PMU event 0x%02x - PMU is not emulated", code);
+        return -ENODEV;
     }
 
-    memcpy(work_buffer_curr, buffer, len);
-    work_buffer_curr += len;
-//    pr_loc_dbg("Copied data to work buffer, now with %d bytes in it (cur=%p)",
-//               (unsigned int)(work_buffer_curr - work_buffer), work_buffer_curr);
-
-    //We only want to analyze the buffer when we are sure we have the full command to process. This is because commands
-    // are variable length and have no end delimiter not length specified with prefixes of short commands conflicting
-    // with longer commands (sic!)
-    //For example, you have "SW1" command which when sent will look like "-SW1" (0x2d 0x53 0x57 0x31). We can capture
-    // this when VUART_FLUSH_IDLE happens. We can also easily capture this when multiple commands are sent at once
-    // (unlikely but possible) since it will be something like "-SW1-3". However, we CANNOT distinguish "-S" from
-    // incomplete "-SW1". So we need to rely on IDLE - if we got "-S" with IDLE it means it was "-S" and not the
-    // beginning of "-SW1".
-    //We also forcefully flush on full buffer even if no IDLE was specified, as it's technically possible for the
-    // software to send a long sequence of commands at once totaling more than our buffer (extremely unlikely).
-    //Additionally, we only process IDLE-signalled buffers when they have at least a single byte of data as some
-    // versions of the mfgBIOS attach head AND THEN in a separate packet send the actual commands (sic!)
-    if (reason == VUART_FLUSH_IDLE && work_buffer_fill() > 1)
-        process_work_buffer(true);
-    //our buffer is full [we must process] or vUART buffer was full [we should process]
-    else if (buffer_space <= len || reason == VUART_FLUSH_FULL)
-        process_work_buffer(false);
+    pr_loc_dbg("Raising PMU event 0x%02x (\"%c\")", code, code);
+    return pmu_send(code, NULL, 0);
 }
 
 int register_pmu_shim(const struct hw_config *hw)
@@ -352,18 +276,33 @@ int register_pmu_shim(const struct hw_config *hw)
     if ((out = alloc_buffers()) != 0)
         goto error_out;
 
-    //We don't set the threshold as some commands are variable length but the "packets" are properly split
-    if ((out = vuart_set_tx_callback(PMU_TTYS_LINE, pmu_rx_callback, uart_buffer, VUART_THRESHOLD_MAX))) {
+    BUILD_BUG_ON(PMU_CMD_BUFFER_LEN != VUART_FIFO_LEN); //commands are dispatched when the buffer fills up
+    pmu_parser_init(&parser, queue_command, NULL);
+    kfifo_reset(&cmd_queue);
+    cmd_wq = alloc_housekeeping_wq("pmu_cmd", 1);
+    if (unlikely(!cmd_wq)) {
+        pr_loc_err("Failed to create PMU commands workqueue");
+        out = -ENOMEM;
+        goto error_out;
+    }
+
+    //Commands are variable length but unambiguous ones can be dispatched without waiting for the end of a "packet"
+    if ((out = vuart_set_tx_span_callback(PMU_TTYS_LINE, pmu_rx_callback, PMU_MIN_PACKET))) {
         pr_loc_err("Failed to register RX callback");
         goto error_out;
     }
 
+    pmu_hw = hw;
     shim_reg_ok();
     return 0;
 
     error_out:
-    free_buffers();
     vuart_remove_device(PMU_TTYS_LINE); //this also removes callback (if set)
+    if (cmd_wq) {
+        destroy_workqueue(cmd_wq);
+        cmd_wq = NULL;
+    }
+    free_buffers();
     return out;
 }
 
@@ -372,7 +311,7 @@ int unregister_pmu_shim(void)
     shim_ureg_in();
 
     int out = 0;
-    if (unlikely(!uart_buffer)) {
+    if (unlikely(!hex_print_buffer)) {
         pr_loc_bug("Attempted to %s while it's not registered", __FUNCTION__);
         return 0; //Technically it succeeded
     }
@@ -380,7 +319,11 @@ int unregister_pmu_shim(void)
     if ((out = vuart_remove_device(PMU_TTYS_LINE)) != 0)
         pr_loc_err("Failed to remove vUART for line=%d", PMU_TTYS_LINE);
 
+    //vUART is gone so nothing will be queued anymore - this executes what's left & waits for running handlers
+    destroy_workqueue(cmd_wq);
+    cmd_wq = NULL;
     free_buffers();
+    pmu_hw = NULL;
 
     shim_ureg_ok();
     return out;
@@ -1,8 +1,21 @@
 #ifndef REDPILL_PMU_SHIM_H
 #define REDPILL_PMU_SHIM_H
 
+#include <linux/types.h> //u8
+
 typedef struct hw_config hw_config_;
 int register_pmu_shim(const struct hw_config *hw);
 int unregister_pmu_shim(void);
 
+/**
+ * Raises an event as if it happened on the (emulated) PMU, e.g. a power button press or a fan failure
+ *
+ * Events are sent to the kernel as PMU input packets. It may be called from any context, including atomic ones.
+ *
+ * @param code PMU input code (0x60-0x71, except 0x6C which is a command)
+ *
+ * @return 0 on success, -E on error
+ */
+int pmu_raise_event(u8 code);
+
 #endif //REDPILL_PMU_SHIM_H
@@ -1,8 +1,14 @@
 #ifndef REDPILL_SHIM_BASE_H
 #define REDPILL_SHIM_BASE_H
 
-#define shim_reg_in() pr_loc_dbg("Registering %s shim", SHIM_NAME);
-#define shim_reg_ok() pr_loc_inf("Successfully registered %s shim", SHIM_NAME);
+#include "../internal/boot_trace.h" //boot_trace_begin(), boot_trace_end()
+
+//Registration is traced; shim_reg_ok() closes the entry opened by shim_reg_in() (failed registrations stay open)
+#define shim_reg_in() do { pr_loc_dbg("Registering %s shim", SHIM_NAME); boot_trace_begin(SHIM_NAME); } while(0);
+#define shim_reg_ok() do {                                     \
+    boot_trace_end(SHIM_NAME, 0);                              \
+    pr_loc_inf("Successfully registered %s shim", SHIM_NAME);  \
+} while(0);
 #define shim_reg_already() do {                                                  \
     pr_loc_bug("Called %s while %s() shim is already", __FUNCTION__, SHIM_NAME); \
     return -EALREADY;                                                            \
@@ -24,6 +24,19 @@
  * While the ports can be enumerated and changed all at once, it's safer to do it per-drive basis as drivers allow for
  * ports to be dynamically reconfigured and thus the type may change. This is also why we make no effort of
  * restoring port types after this shim is unregistered.
+ * Disks which were already connected when the shim was registered must be replugged for the change to apply. This is
+ * done asynchronously (see "Replug queue") so that the module init doesn't wait for a dozen rescans.
+ *
+ * SSD CACHE
+ * DSM only allows SATA disks which it sees as SSDs to be used for SSD cache. Fast disks on other ports (e.g. SAS SSDs
+ * or VirtIO disks backed by NVMe on the host, which report themselves as rotational) are thus not eligible, even if
+ * they are moved to a SATA port. Disks selected by the SSD cache policy (see struct ssd_cache_policy) are moved to a SATA
+ * port and marked as non-rotational before sd probes them; the SMART shim then also reports them as SSDs in their
+ * (emulated) IDENTIFY data. Keep in mind that, like the port fix above, the port type is per-HBA driver: it's stored
+ * in the host template shared by all hosts of a driver, so selecting even a single disk (e.g. by its serial) moves
+ * every disk of that driver to a SATA port. Only the non-rotational flag is applied to the selected disks alone.
+ * NVMe namespaces aren't SCSI devices on these kernels (the nvme driver has its own block devices) so they cannot be
+ * selected here.
  *
  * References
  *   - drivers/scsi/sd.c in Linux sources
@@ -31,13 +44,200 @@
 #include "sata_port_shim.h"
 #include "../shim_base.h"
 #include "../../common.h"
-#include "../../internal/scsi/scsi_toolbox.h" //scsi_force_replug()
+#include "../../internal/scsi/scsi_toolbox.h" //scsi_force_replug(), scsi_rescan_host(), scsi_get_unit_serial()
+#include "../../config/runtime_config.h" //struct ssd_cache_policy
 #include "../../internal/scsi/scsi_notifier.h"
+#include "../../internal/housekeeping.h" //alloc_housekeeping_wq()
+#include <linux/list.h> //struct list_head, list_*
+#include <linux/slab.h> //kmalloc(), kfree()
+#include <linux/workqueue.h> //queue_work()
+#include <linux/blkdev.h> //queue_flag_set_unlocked(), QUEUE_FLAG_NONROT
+#include <asm/unaligned.h> //get_unaligned_be16()
 #include <scsi/scsi_device.h> //struct scsi_device
-#include <scsi/scsi_host.h> //struct Scsi_Host, SYNO_PORT_TYPE_*
+#include <scsi/scsi_host.h> //struct Scsi_Host, SYNO_PORT_TYPE_*, scsi_host_get()
 
 #define SHIM_NAME "SATA port emulator"
 #define VIRTIO_HOST_ID "Virtio SCSI HBA"
+#define VPD_BDC_PAGE 0xb1 //Block Device Characteristics
+#define VPD_BDC_LEN 64
+#define VPD_BDC_NONROT 0x0001 //"medium rotation rate" of non-rotating media
+#define SSD_SERIAL_BUF_SIZE 64
+
+static const struct ssd_cache_policy *ssd_cache = NULL;
+
+/**************************************************** Replug queue ****************************************************/
+//Replugging an existing disk means removing it and rescanning its host. Doing that synchronously for every disk during
+// the init serializes all rescans on the boot path. Instead, disks found during the initial enumeration are grouped by
+// host: every host gets a single work item which removes all its fixable disks and rescans the host just once. Hosts
+// are processed in parallel (up to SATA_REPLUG_MAX_ACTIVE at a time) and nothing waits for them but the unregister.
+//If anything needed for the queue cannot be allocated the disk is simply replugged synchronously like it used to be.
+#define SATA_REPLUG_WQ_NAME "scsi_replug"
+#define SATA_REPLUG_MAX_ACTIVE 4
+
+struct replug_dev {
+    struct scsi_device *sdp; //holds a reference to sdev_gendev
+    struct list_head node;
+};
+
+struct replug_batch {
+    struct Scsi_Host *host; //holds a reference taken with scsi_host_get()
+    struct list_head sdevs; //list of replug_dev
+    struct list_head node; //in replug_pending until queued
+    struct work_struct work;
+};
+
+static struct workqueue_struct *replug_wq = NULL;
+static LIST_HEAD(replug_pending); //only touched from register_sata_port_shim() context
+
+static void replug_batch_work(struct work_struct *work)
+{
+    struct replug_batch *batch = container_of(work, struct replug_batch, work);
+    struct replug_dev *rdev, *tmp;
+
+    list_for_each_entry_safe(rdev, tmp, &batch->sdevs, node) {
+        pr_loc_dbg("Removing device %s from host%d", dev_name(&rdev->sdp->sdev_gendev), batch->host->host_no);
+        scsi_remove_device(rdev->sdp); //it's a noop if it was already removed in the meantime
+        put_device(&rdev->sdp->sdev_gendev);
+        list_del(&rdev->node);
+        kfree(rdev);
+    }
+
+    //After that all removed devices will land in on_new_scsi_disk_device()
+    int out = scsi_rescan_host(batch->host);
+    if (unlikely(out != 0))
+        pr_loc_err("Failed to rescan host%d after replug - error=%d", batch->host->host_no, out);
+
+    scsi_host_put(batch->host);
+    kfree(batch);
+}
+
+/**
+ * Gets a pending batch for a given host, creating one if needed
+ *
+ * @return batch or ERR_PTR(-E) on error
+ */
+static struct replug_batch *get_replug_batch(struct Scsi_Host *host)
+{
+    struct replug_batch *batch;
+    list_for_each_entry(batch, &replug_pending, node) {
+        if (batch->host == host)
+            return batch;
+    }
+
+    kmalloc_or_exit_ptr(batch, sizeof(struct replug_batch));
+    if (unlikely(!scsi_host_get(host))) {
+        kfree(batch);
+        return ERR_PTR(-ENODEV);
+    }
+
+    batch->host = host;
+    INIT_LIST_HEAD(&batch->sdevs);
+    INIT_WORK(&batch->work, replug_batch_work);
+    list_add_tail(&batch->node, &replug_pending);
+
+    return batch;
+}
+
+/**
+ * Adds a disk to be replugged once queue_pending_replugs() is called
+ *
+ * @return 0 on success, -E on error (the disk is NOT queued then)
+ */
+static int defer_replug(struct scsi_device *sdp)
+{
+    if (unlikely(!replug_wq))
+        return -ENODEV;
+
+    struct replug_batch *batch = get_replug_batch(sdp->host);
+    if (unlikely(IS_ERR(batch)))
+        return PTR_ERR(batch);
+
+    struct replug_dev *rdev;
+    kmalloc_or_exit_int(rdev, sizeof(struct replug_dev));
+    get_device(&sdp->sdev_gendev);
+    rdev->sdp = sdp;
+    list_add_tail(&rdev->node, &batch->sdevs);
+
+    return 0;
+}
+
+/**
+ * Sends all batches collected by defer_replug() to the workqueue
+ */
+static void queue_pending_replugs(void)
+{
+    struct replug_batch *batch, *tmp;
+    list_for_each_entry_safe(batch, tmp, &replug_pending, node) {
+        list_del(&batch->node);
+        pr_loc_dbg("Queuing async replug of host%d disks", batch->host->host_no);
+        queue_work(replug_wq, &batch->work); //a batch with no disks (alloc failure) will only rescan the host
+    }
+}
+
+/******************************************************* SSD cache ****************************************************/
+/**
+ * Checks if a device reports non-rotational media (this sends a command to the device)
+ */
+static bool reports_nonrot(struct scsi_device *sdp)
+{
+    unsigned char *buf = kmalloc(VPD_BDC_LEN, GFP_KERNEL); //it's DMAed to
+    if (unlikely(!buf)) {
+        pr_loc_crt("kernel memory alloc failure - tried to allocate %d bytes for VPD page", VPD_BDC_LEN);
+        return false;
+    }
+
+    bool nonrot = scsi_get_vpd_page(sdp, VPD_BDC_PAGE, buf, VPD_BDC_LEN) == 0 &&
+                  get_unaligned_be16(&buf[4]) == VPD_BDC_NONROT;
+    kfree(buf);
+
+    return nonrot;
+}
+
+static bool matches_ssd_cache_selector(struct scsi_device *sdp, const struct ssd_cache_selector *sel)
+{
+    size_t len;
+    char serial[SSD_SERIAL_BUF_SIZE];
+
+    switch (sel->type) {
+        case SSD_CACHE_SEL_NONROT:
+            return reports_nonrot(sdp);
+        case SSD_CACHE_SEL_HOST:
+            return sdp->host->hostt->proc_name && strcmp(sdp->host->hostt->proc_name, sel->value) == 0;
+        case SSD_CACHE_SEL_MODEL:
+            //model is not NUL-terminated (it's a pointer into INQUIRY data)
+            len = strlen(sel->value);
+            return sdp->model && len <= 16 && strncmp(sdp->model, sel->value, len) == 0;
+        case SSD_CACHE_SEL_SERIAL:
+            return scsi_get_unit_serial(sdp, serial, sizeof(serial), true) == 0 && strcmp(serial, sel->value) == 0;
+    }
+
+    return false;
+}
+
+/**
+ * Checks if a device is selected by the SSD cache policy
+ */
+static bool is_ssd_cache_selected(struct scsi_device *sdp)
+{
+    if (!ssd_cache)
+        return false;
+
+    for (unsigned int i = 0; i < ssd_cache->selectors_num; ++i) {
+        if (matches_ssd_cache_selector(sdp, &ssd_cache->selectors[i]))
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Marks device as non-rotational; sd only ever sets the flag (never clears it), so it survives the probe
+ */
+static void mark_nonrot(struct scsi_device *sdp)
+{
+    queue_flag_set_unlocked(QUEUE_FLAG_NONROT, sdp->request_queue);
+    queue_flag_clear_unlocked(QUEUE_FLAG_ADD_RANDOM, sdp->request_queue); //what sd does for SSDs too
+}
 
 /**
  * Checks if we should fix a given device or ignore it
@@ -58,6 +258,14 @@ static bool is_fixable(struct scsi_device *sdp)
  */
 static int on_new_scsi_disk_device(struct scsi_device *sdp)
 {
+    if (is_ssd_cache_selected(sdp)) {
+        pr_loc_dbg("Found new disk vendor=\"%s\" model=\"%s\" selected for SSD cache - marking as SSD", sdp->vendor,
+                   sdp->model);
+        mark_nonrot(sdp);
+        sdp->host->hostt->syno_port_type = SYNO_PORT_TYPE_SATA; //shared by all hosts of the driver (see SSD CACHE)
+        return 0;
+    }
+
     if (!is_fixable(sdp))
         return 0;
 
@@ -80,7 +288,15 @@ static int on_new_scsi_disk_device(struct scsi_device *sdp)
  */
 static int on_existing_scsi_disk_device(struct scsi_device *sdp)
 {
-    if (!is_fixable(sdp))
+    bool ssd_cache_selected = is_ssd_cache_selected(sdp);
+    if (ssd_cache_selected && sdp->host->hostt->syno_port_type == SYNO_PORT_TYPE_SATA) {
+        pr_loc_dbg("Found initialized disk vendor=\"%s\" model=\"%s\" selected for SSD cache - marking as SSD",
+                   sdp->vendor, sdp->model);
+        mark_nonrot(sdp); //it's already on a SATA port - nobody looked at the flag yet as the userspace isn't up
+        return 0;
+    }
+
+    if (!ssd_cache_selected && !is_fixable(sdp))
         return 0;
 
     pr_loc_dbg(
@@ -89,7 +305,8 @@ static int on_existing_scsi_disk_device(struct scsi_device *sdp)
             sdp->host->hostt->syno_port_type);
 
     //After that it will land in on_new_scsi_disk_device()
-    scsi_force_replug(sdp);
+    if (defer_replug(sdp) != 0)
+        scsi_force_replug(sdp);
 
     return 0;
 }
@@ -111,11 +328,12 @@ static struct notifier_block scsi_disk_nb = {
     .priority = INT_MIN, //we want to be FIRST so that we other things can get the correct drive type
 };
 
-int register_sata_port_shim(void)
+int register_sata_port_shim(const struct ssd_cache_policy *ssd_cache_policy)
 {
     shim_reg_in();
 
     int out;
+    ssd_cache = ssd_cache_policy->selectors_num ? ssd_cache_policy : NULL;
 
     pr_loc_dbg("Registering for new devices notifications");
     out = subscribe_scsi_disk_events(&scsi_disk_nb);
@@ -124,8 +342,13 @@ int register_sata_port_shim(void)
         return out;
     }
 
+    replug_wq = alloc_housekeeping_wq(SATA_REPLUG_WQ_NAME, SATA_REPLUG_MAX_ACTIVE);
+    if (unlikely(!replug_wq))
+        pr_loc_wrn("Failed to create replug workqueue - existing disks will be replugged synchronously");
+
     pr_loc_dbg("Iterating over existing devices");
     out = for_each_scsi_disk(on_existing_scsi_disk_device);
+    queue_pending_replugs(); //even if enumeration failed midway, whatever was found should be fixed
     if (unlikely(out != 0 && out != -ENXIO)) {
         pr_loc_err("Failed to enumerate current SCSI disks - error=%d", out);
         return out;
@@ -139,7 +362,13 @@ int unregister_sata_port_shim(void)
 {
     shim_ureg_in();
 
+    if (replug_wq) {
+        destroy_workqueue(replug_wq); //waits for all replugs which are still in progress
+        replug_wq = NULL;
+    }
+
     unsubscribe_scsi_disk_events(&scsi_disk_nb);
+    ssd_cache = NULL;
 
     shim_ureg_ok();
     return 0; //noop
@@ -1,7 +1,12 @@
 #ifndef REDPILL_SATA_PORT_SHIM_H
 #define REDPILL_SATA_PORT_SHIM_H
 
-int register_sata_port_shim(void);
+struct ssd_cache_policy;
+
+/**
+ * @param ssd_cache_policy disks to present as SATA SSDs; it must stay valid while the shim is registered
+ */
+int register_sata_port_shim(const struct ssd_cache_policy *ssd_cache_policy);
 int unregister_sata_port_shim(void);
 
 #endif //REDPILL_SATA_PORT_SHIM_H
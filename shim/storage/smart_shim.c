@@ -48,10 +48,12 @@
  *
  *
  * LIMITATIONS
- *   - Values are always static and the same for all drives
- *   - Power-on hours & other counters (e.g. start-stop count) are static
- *     - Ideally values should be calculated as hours from some date to ensure they increase
- *     - Start-stop counter (and others) can be derived from power-on hours using linear regression
+ *   - Values are static and the same for all drives (but IDENTIFY is per-disk, see "Per-disk identities"), except
+ *     for a few counters derived from the real disk (see "Live counters"):
+ *     - Power-On Hours grow with the time the module is loaded
+ *     - Power Cycle Count grows with every reprobe of the disk
+ *     - Total LBAs Written/Read are taken from the block layer I/O stats of the disk
+ *   - Other counters (e.g. start-stop count) are static
  *
  *
  * SEQUENCE OF ACTIONS FOR IOCTL REPLACEMENT
@@ -67,9 +69,16 @@
  *      - sd_ioctl() trampoline is removed
  *      - after installation it triggers sd_ioctl_smart_shim() to handle that IOCTL which canary captured
  *   4. sd_ioctl_smart_shim() is triggered for every ioctl to a /dev/sdX device coming from the userspace
+ *      - disks which were found to handle SMART natively when probed (see "Native SMART slots") are forwarded to the
+ *        original sd_ioctl() right away, without looking at the ioctl at all
  *      - it filters commands which are SMART-related (or at least what smartmontools uses as nobody uses anything else)
  *      - all non-SMART commands are forwarded as-is
  *      - SMART commands are forwarded to the drive if the drive supports SMART, if not a sensible values are faked
+ *      - SG_IO ATA PASS-THROUGH (12/16) commands sent to disks which don't speak ATA at all are answered with the same
+ *        fake responses right away, instead of letting them time out in the device (see "SG_IO/SAT handling")
+ *      - when a drive keeps failing a given kind of SMART command (SMART_PASSTHROUGH_MAX_FAILS times in a row by
+ *        default, "smart_pt_fails" tunable at runtime) it's no longer forwarded to it and is faked right away (see
+ *        "Passthrough verdicts")
  *
  * References
  *  - https://www.micron.com/-/media/client/global/documents/products/technical-note/solid-state-storage/tnfd10_p400e_smart_firmware_0142.pdf
@@ -81,29 +90,43 @@
 #include "../shim_base.h"
 #include "../../common.h"
 #include "../../internal/intercept_driver_register.h" //waiting for "sd" driver to load
-#include "../../internal/helper/memory_helper.h" //set_mem_addr_ro(), set_mem_addr_rw()
+#include "../../internal/helper/memory_helper.h" //WITH_MEM_WRITE_WINDOW()
+#include "../../internal/hook_stats.h" //hook_stats_span_begin(), hook_stats_exclude()
+#include "../../internal/rp_trace.h" //rp_trace()
+#include "../../internal/helper/debug_keys.h" //pr_loc_dbg_on()
+#include "../../internal/helper/tunables.h" //register_rp_tunable()
 #include "../../internal/helper/symbol_helper.h" //kernel_has_symbol()
 #include "../../internal/scsi/hdparam.h" //a ton of ATA constants
-#include "../../internal/scsi/scsi_toolbox.h" //checking for "sd" driver load state
+#include "../../internal/scsi/scsiparam.h" //SCSI_ATA* (SAT CDBs & sense)
+#include "../../internal/scsi/ata_format.h" //ata_calc_sector_checksum(), ata_calc_integrity_word(), set_ata_string()
+#include "../../internal/scsi/scsi_toolbox.h" //"sd" driver state, opportunistic_read_capacity(), scsi_ata_identify()
+#include "../../internal/scsi/scsi_notifier.h" //subscribe_scsi_disk_events()
 #include "../../internal/override/override_symbol.h" //installing sd_ioctl_canary()
 #include <linux/fs.h> //struct block_device
 #include <linux/genhd.h> //struct gendisk
 #include <linux/blkdev.h> //struct block_device_operations
 #include <linux/spinlock.h> //spinlock_t, spin_*
+#include <linux/slab.h> //kmem_cache_*
 #include <linux/ata.h> //ATA_*
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_add_rcu(), hash_for_each_possible_rcu()
+#include <linux/rcupdate.h> //rcu_read_lock(), kfree_rcu()
+#include <linux/atomic.h> //atomic_t, atomic_*()
+#include <linux/hash.h> //hash_ptr()
+#include <linux/async.h> //async_synchronize_full_domain()
+#include <linux/math64.h> //div64_u64()
+#include <scsi/scsi_device.h> //struct scsi_device, scsi_get_vpd_page()
+#include <scsi/scsi.h> //ATA_12, ATA_16, SAM_STAT_*, DRIVER_SENSE, sense keys
+#include <scsi/sg.h> //SG_IO, struct sg_io_hdr
 
 #define SHIM_NAME "SMART emulator"
 
-#ifdef DBG_SMART_PRINT_ALL_IOCTL
+//Printing of all ioctl() calls (hooked or not) can be switched on at runtime, see internal/helper/debug_keys.h
 #define pr_loc_dbg_ioctl(cmd_hex, subcmd_name, bdev) \
-    pr_loc_dbg("Handling ioctl(0x%x)->%s for /dev/%s", cmd_hex, subcmd_name, (bdev)->bd_disk->disk_name);
+    pr_loc_dbg_on(SMART_IOCTL, "Handling ioctl(0x%x)->%s for /dev/%s", cmd_hex, subcmd_name, \
+                  (bdev)->bd_disk->disk_name);
 #define pr_loc_dbg_ioctl_unk(cmd_hex, subcmd_hex, bdev) \
-    pr_loc_dbg("Handling ioctl(cmd=0x%x ; sub=%0x%x) for /dev/%s - not hooked (noop)", \
-               cmd_hex, subcmd_hex, (bdev)->bd_disk->disk_name);
-#else
-#define pr_loc_dbg_ioctl(cmd_hex, subcmd_name, bdev) //noop
-#define pr_loc_dbg_ioctl_unk(cmd_hex, subcmd_hex, bdev) //noop
-#endif
+    pr_loc_dbg_on(SMART_IOCTL, "Handling ioctl(cmd=0x%x ; sub=%0x%x) for /dev/%s - not hooked (noop)", \
+                  cmd_hex, subcmd_hex, (bdev)->bd_disk->disk_name);
 
 //address of original and unmodified sd_ioctl(); populated by the canary and after the canary trampoline is removed
 static int (*sd_ioctl_org) (struct block_device *, fmode_t, unsigned, unsigned long) = NULL;
@@ -156,6 +179,9 @@ static const int fake_smart[][ATA_SMART_RECORD_LEN] = {
     { 197, 0x32,  0x00,  0x80, 0x80,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00,   0x00 }, /* Current_Pending_Sector */
     { 198, 0x30,  0x00,  0x64, 0xfe,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00,   0x00 }, /* Offline_Uncorrectable */
     { 199, 0x32,  0x00,  0xC8, 0xC8,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00,   0x00 }, /* UDMA_CRC_Error_Count */
+    //200-240: very vendor-specific / esoteric
+    { 241, 0x32,  0x00,  0x64, 0x64,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00,   0x00 }, /* Total_LBAs_Written */
+    { 242, 0x32,  0x00,  0x64, 0x64,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00,   0x00 }, /* Total_LBAs_Read */
     //rest of the attributes are esoteric or invalid for SSDs
 };
 
@@ -168,153 +194,829 @@ static const int fake_smart[][ATA_SMART_RECORD_LEN] = {
 
 
 /********************************************* ATA/IOCTL helper functions *********************************************/
+//Single-sector buffers (the only ones used in practice) come from a dedicated cache: SMART polling of many disks would
+// otherwise keep taking & returning 516 byte chunks to kmalloc-1024. Larger ones (and all of them if the cache couldn't
+// be created) fall back to kmalloc. The name is deliberately generic as it's visible in /proc/slabinfo.
+#define ATA_BUF_CACHE_NAME "ata_ioctl_buf"
+#define ATA_BUF_CACHE_SECTORS 1
+static struct kmem_cache *ata_buf_cache = NULL;
+
+static void create_ata_buf_cache(void)
+{
+    ata_buf_cache = kmem_cache_create(ATA_BUF_CACHE_NAME, ata_ioctl_buf_size(ATA_BUF_CACHE_SECTORS), 0,
+                                      SLAB_HWCACHE_ALIGN, NULL);
+    if (unlikely(!ata_buf_cache))
+        pr_loc_wrn("Failed to create ATA buffers cache - kmalloc will be used");
+}
+
 /**
- * Calculates a standard per-sector ATA checksum
- * 
- * ATA/ATAPI-6 standard contains the same checksum references in many places. It's always saved in the last byte of a
- * sector (index 511). It is described e.g. in "Table 5: SMART Attribute Entry Format". It's defined as "Two's 
- * complement checksum of preceding 511B[ytes]". Wikipedia has a great article about that as well.
- * 
- * @param buff A single-sector sized buffer to compute & save checksum to
+ * Destroys buffers cache; must only be called when no ioctl() can be routed to the shim anymore
  */
-static void ata_calc_sector_checksum(u8 *buff)
+static void destroy_ata_buf_cache(void)
 {
-    for (int i = 0; i < (ATA_SECT_SIZE-1); i++) {
-        buff[(ATA_SECT_SIZE-1)] += buff[i];
+    if (!ata_buf_cache)
+        return;
+
+    kmem_cache_destroy(ata_buf_cache);
+    ata_buf_cache = NULL;
+}
+
+static __always_inline bool is_ata_buf_cached(u8 sectors)
+{
+    return likely(ata_buf_cache) && sectors <= ATA_BUF_CACHE_SECTORS;
+}
+
+/**
+ * Releases buffer obtained from get_ioctl_buffer_*()
+ *
+ * @param sectors the same number of sectors the buffer was obtained with
+ */
+static __always_inline void put_ioctl_buffer(unsigned char *buffer, u8 sectors)
+{
+    if (is_ata_buf_cached(sectors))
+        kmem_cache_free(ata_buf_cache, buffer);
+    else
+        kfree(buffer);
+}
+
+/**
+ * Duplicates a user-supplied ioctl() buffer into kernel space to safely read data from it
+ *
+ * This pointer returned here is... peculiar. First 4 bytes are a header (as defined by UAPI "struct hd_drive_cmd_hdr"
+ * in hdreg.h). Remaining 512 bytes are 16 bits words.
+ *
+ * @param sectors How many sectors to copy
+ * @param src User buffer to copy from
+ *
+ * @return Pointer to a new kernel-space buffer or ERR_PTR; you need to free/put-it-back using put_ioctl_buffer
+ */
+static unsigned char* get_ioctl_buffer_kcopy(u8 sectors, const __user void *src)
+{
+    unsigned char *kbuf;
+
+    if (is_ata_buf_cached(sectors)) {
+        if (unlikely(!(kbuf = kmem_cache_alloc(ata_buf_cache, GFP_KERNEL))))
+            kalloc_error_ptr(kbuf, ata_ioctl_buf_size(sectors));
+    } else {
+        kmalloc_or_exit_ptr(kbuf, ata_ioctl_buf_size(sectors));
     }
-    
-    buff[(ATA_SECT_SIZE-1)] = 256 - buff[(ATA_SECT_SIZE-1)];
+
+    if(unlikely(copy_from_user(kbuf, src, ata_ioctl_buf_size(sectors)) != 0)) {
+        pr_loc_err("Failed to copy ATA user buffer from ptr=%p to kspace=%p", src, kbuf);
+        put_ioctl_buffer(kbuf, sectors);
+        return ERR_PTR(-EFAULT);
+    }
+
+    return kbuf;
 }
 
+/******************************************** Precomputed responses cache *********************************************/
+//Every fake response is static (see LIMITATIONS), while Storage Manager & smartd poll every disk all the time. Instead
+// of generating these on every ioctl() they're built once when the shim is registered (build_smart_rsp_cache()) and
+// only read afterwards, so that every emulated ioctl() is just header validation + a single copy_to_user().
+#define SMART_RSP_ATA_ID_SIZE (HDIO_DRIVE_CMD_HDR_OFFSET + sizeof(struct rp_hd_driveid))
+#define SMART_RSP_VALUES_SIZE ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS)
+#define SMART_RSP_THRESHOLDS_SIZE ata_ioctl_buf_size(ATA_SMART_READ_THRESHOLDS_SECTORS)
+#define SMART_RSP_LOG_SIZE ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS)
+
+static u8 rsp_ata_id[SMART_RSP_ATA_ID_SIZE] __read_mostly;
+static u8 rsp_smart_values[SMART_RSP_VALUES_SIZE] __read_mostly;
+static u8 rsp_smart_thresholds[SMART_RSP_THRESHOLDS_SIZE] __read_mostly;
+static u8 rsp_smart_log_summary[SMART_RSP_LOG_SIZE] __read_mostly; //also the log directory, see get_win_smart_log()
+static u8 rsp_smart_log_comprehensive[SMART_RSP_LOG_SIZE] __read_mostly;
+static u8 rsp_smart_log_self_test[SMART_RSP_LOG_SIZE] __read_mostly;
+
+//WIN_SMART test execution returns just a header
+static const u8 rsp_smart_exec_test[HDIO_DRIVE_CMD_HDR_OFFSET] = {
+    [HDIO_DRIVE_CMD_RET_STATUS] = 0x00,
+    [HDIO_DRIVE_CMD_RET_ERROR] = 0x00,
+    [HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_WIN_SMART_EXEC_TEST,
+};
+
+#define ATA_ID_MAX_QUEUE_DEPTH 32
+#define ATA_ID_DSM_MAX_BLOCKS 8 //512-byte blocks of LBA ranges per DATA SET MANAGEMENT command (what most SSDs report)
+
+/**
+ * Capabilities of the real block device advertised in its emulated IDENTIFY
+ */
+struct ata_id_caps {
+    bool nonrot; //non-rotating media (i.e. an SSD)
+    bool trim; //the device supports discards
+    unsigned int queue_depth; //>1 enables NCQ (capped at ATA_ID_MAX_QUEUE_DEPTH)
+};
+
 /**
- * Calculates a standard per-worded structure ATA checksum
+ * Builds a completely fake ATA IDENTIFY response (for non-ATA disks, e.g. VirtIO SCSI)
  *
- * In principal it's almost the same thing as ata_calc_sector_checksum() but with some constant added to be 16 bits.
- * See "8.16.64 Word 255: Integrity word". Checksum is always saved in word 255.
+ * @param kbuf Zeroed buffer of SMART_RSP_ATA_ID_SIZE
+ * @param serial Serial number, up to 20 chars
+ * @param fw_rev Firmware revision, up to 8 chars
+ * @param model Model name, up to 40 chars
+ * @param sectors Capacity in 512 byte sectors or 0 if unknown
+ * @param caps Capabilities to advertise or NULL for a plain rotating disk without NCQ & TRIM
+ */
+static void build_ata_id(u8 *kbuf, const char *serial, const char *fw_rev, const char *model, u64 sectors,
+                         const struct ata_id_caps *caps)
+{
+    struct rp_hd_driveid *did = (void *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET); //did=drive ID
+
+    //First write response header
+    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
+    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
+    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_CMD_ID_ATA_SECTORS;
+
+    did->config = 0x0000; //15th bit = ATA device, rest is reserved/obsolete
+    set_ata_string(did->serial_no, serial, 20);
+    set_ata_string(did->fw_rev, fw_rev, 8);
+    set_ata_string(did->model, model, 40);
+    did->reserved50 = (1 << 14); //"shall be set to one"
+    did->major_rev_num = 0xffff;
+    did->minor_rev_num = 0xffff;
+    did->command_set_1 = (1 << 3 | 1 << 0); //PM, SMART supported
+    did->command_set_2 = (1 << 14); //"shall be set to one"
+    did->cfsse = (1 << 14 | 1 << 1 | 1 << 0); //14: "shall be set to one" ; smart self-test supported ; smart error-log
+    did->cfs_enable_1 = (1 << 3 | 1 << 0); //PM, SMART
+    did->cfs_enable_2 = (1 << 14); //"shall be set to one"
+    did->csf_default = (1 << 14 | 1 << 1 | 1 << 0); //"shall be one" ; SMART self-test, SMART error-test
+    did->hw_config = (1 << 14 | 1 << 0); //both "shall be one"
+    if (sectors) {
+        //See "8.16.41 Words (61:60)" & "8.16.53 Words (103:100)": 28-bit field saturates, 48-bit holds the real value
+        did->lba_capacity = min_t(u64, sectors, 0x0fffffff);
+        did->lba_capacity_2 = sectors;
+        did->command_set_2 |= (1 << 10); //48-bit Address feature set supported
+        did->cfs_enable_2 |= (1 << 10); //...and enabled
+    } else {
+        did->lba_capacity = 0xffffffff; //capacity unknown - hope nobody looks too close
+    }
+
+    if (caps) {
+        //See "Word 217": 0 = rate not reported, 1 = non-rotating media (that's what DSM checks to find SSDs)
+        if (caps->nonrot)
+            did->words206_254[ATA_ID_ROT_SPEED - 206] = 0x0001;
+
+        //See "Word 169" & "Word 105": TRIM supported & how many blocks of ranges a single command can carry
+        if (caps->trim) {
+            did->words161_175[ATA_ID_DATA_SET_MGMT - 161] = (1 << 0);
+            did->words104_125[105 - 104] = ATA_ID_DSM_MAX_BLOCKS;
+        }
+
+        //See "Word 75" & "Word 76": max queue depth - 1 & NCQ supported (along with SATA Gen1-3 speeds)
+        if (caps->queue_depth > 1) {
+            did->queue_depth = min_t(unsigned int, caps->queue_depth, ATA_ID_MAX_QUEUE_DEPTH) - 1;
+            did->words76_79[ATA_ID_SATA_CAPABILITY - 76] = (1 << 8 | 1 << 3 | 1 << 2 | 1 << 1);
+        }
+    }
+
+    ata_calc_integrity_word((void *)did);
+}
+
+/**
+ * Builds fake SMART snapshot values response
  *
- * @param word_buff A 255-word (each 16 bits) sized buffer to compute & save checksum to
+ * This is the data which you see in a usual tabular format as a result of "smartctl -A" command. The data is formated
+ * from the "fake_smart" constant array present on the top of this file.
+ */
+static void build_ata_smart_values(u8 *kbuf)
+{
+    int i, j;
+    u8 *smart_values = (u8 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
+
+    //First write response header
+    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
+    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
+    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_SMART_READ_VALUES_SECTORS;
+
+    //See "Vendor-Specific Data Bytes 0–361" and "Table 5: SMART Attribute Entry Format" in micron.com
+    // document for specification of these numbers and calculations
+    //For full structure see "Table 59 − Device SMART data structure" in ATA/ATAPI-6 PDF
+    smart_values[0] = SMART_SNAP_VERSION;
+
+    //copy ALL attribute bytes as we were asked for everything (including thresholds)
+    for (i = 0; i < ARRAY_SIZE(fake_smart); i++) {
+        for (j = 0; j < 11; j++) {
+            smart_values[2 + (ATA_SMART_RECORD_LEN * i) + j] = fake_smart[i][j];
+        }
+    }
+
+    //specify that we never ran any SMART tests and we're not running any
+    smart_values[362] = 0x82; //Sec. 8.55.5.8.1, Table 60 in ATA/ATAPI-6 PDF (self test ran on boot & succeeded)
+    smart_values[363] = 0x00; //Sec. 8.55.5.8.2, Table 61 in ATA/ATAPI-6 PDF
+    smart_values[364] = 0x45; //LSB of "Total time to complete Offline data collection" (seconds)
+    smart_values[365] = 0x00; //MSB of "Total time to complete Offline data collection" (seconds)
+    smart_values[367] = (1 << 3 | 1 << 4); //bitfield, see sec. 8.55.5.8.4 in ATA/ATAPI-6 PDF
+    smart_values[368] = (1 << 0 | 1 << 1); //bitfield, see sec. 8.55.5.8.5 in ATA/ATAPI-6 PDF
+    smart_values[369] = 0x01; //vendor-specific, rel. to sec. 8.55.5.8.5 in ATA/ATAPI-6 PDF
+    smart_values[370] = 0x01; //bitfield, current only 1st bit used for error logging (Table 59)
+    smart_values[372] = 0x05; //short self-test polling time (minutes), see Table 59
+    smart_values[373] = 0x4B; //long self-test polling time (minutes), see Table 59
+
+    ata_calc_sector_checksum(smart_values);
+}
+
+/**
+ * Builds a subset of fake SMART snapshot values, containing only thresholds
  */
-static void ata_calc_integrity_word(u16 *word_buff)
+static void build_ata_smart_thresholds(u8 *kbuf)
 {
-    u8 *byte_buff = (u8 *)word_buff;
+    int i;
+    u8 *smart_thresholds = (u8 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
+
+    //First write response header
+    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
+    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
+    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_SMART_READ_THRESHOLDS_SECTORS;
+
+    //See "Vendor-Specific Data Bytes 0–361" and "Table 5: SMART Attribute Entry Format" in micron.com
+    // document for specification of these numbers and calculations
+    //For full structure see "Table 59 − Device SMART data structure" in ATA/ATAPI-6 PDF
+    smart_thresholds[0] = SMART_SNAP_VERSION;
 
-    for (int i = 0; i < (ATA_SECT_SIZE-2); i++) {
-        byte_buff[(ATA_SECT_SIZE-2)] += byte_buff[i];
+    //copy a subset of attribute bytes as we were asked for thresholds only
+    for (i = 0; i < ARRAY_SIZE(fake_smart); i++) {
+        smart_thresholds[2 + (ATA_SMART_RECORD_LEN * i) + 0] = fake_smart[i][0]; //entry id
+        smart_thresholds[2 + (ATA_SMART_RECORD_LEN * i) + 1] = fake_smart[i][11]; //threshold value
     }
 
-    byte_buff[(ATA_SECT_SIZE-2)] = 256 - byte_buff[(ATA_SECT_SIZE-2)];
-    byte_buff[(ATA_SECT_SIZE-1)] = 0xa5;
+    ata_calc_sector_checksum(smart_thresholds);
 }
 
 /**
- * ATA/ATAPI uses "strings" which are LE arranged 8 bit characters into 16 bit words padded with spaces to full length
+ * Builds a stored SMART log response for WIN_SMART interface
  *
- * Example of 10 character ATA field:
- *  =normal=> "TEST12"
- *  =ATA====> "ETTS21    "
+ * See "8.55.6 SMART READ LOG" in ATA/ATAPI-6 specs. There are multiple types of logs. This function implements all
+ * non-vendor ones.
  *
- * @param dst buffer to copy the string to
- * @param src standard NULL-byte terminated text
- * @param length ATA field length; must be even
+ * @param kbuf Zeroed buffer of SMART_RSP_LOG_SIZE
+ * @param log_addr See "Table 62 − Log address definition" in ATAPI/6 docs; only 0x01, 0x02, and 0x06 are accepted (log
+ *                 directory, 0x00, is the same as the summary log)
  */
-static void set_ata_string(u8 *dst, const char *src, u8 length)
+static void build_win_smart_log(u8 *kbuf, u8 log_addr)
 {
-    if (unlikely(length % 2 != 0)) {
-        pr_loc_bug("Length must be even but got %d", length);
-        --length;
+    u8 *smart_log = (u8 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
+
+    //First write response header
+    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
+    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
+    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_WIN_SMART_READ_LOG_SECTORS;
+
+    switch (log_addr) {
+        //0x00 (log directory) used to fall through to the summary log when generated per-ioctl - it's served from the
+        // summary one now (see populate_win_smart_log())
+
+        case 0x01: //summary SMART error log (see sect. 8.55.6.8.2 Summary error log sector)
+            smart_log[0] = WIN_SMART_SUM_LOG_VERSION;
+            smart_log[1] = 0x00; //no error entries = index is 0
+            smart_log[452] = 0x00; //no errors = count byte 1 is zero
+            smart_log[453] = 0x00; //no errors = count byte 2 is zero
+            ata_calc_sector_checksum(smart_log);
+            break;
+
+        case 0x02: //comprehensive SMART error log
+            smart_log[0] = WIN_SMART_COMP_LOG_VERSION;
+            smart_log[1] = 0x00; //no error entries = index is 0
+            smart_log[452] = 0x00; //no errors = count byte 1 is zero
+            smart_log[453] = 0x00; //no errors = count byte 2 is zero
+            ata_calc_sector_checksum(smart_log);
+            break;
+
+        case 0x06: //SMART self-test log
+            smart_log[0] = WIN_SMART_TEST_LOG_VERSION;
+            smart_log[1] = 0x00; //revision (2nd byte, also defined by 8.55.6.8.4.1)
+            smart_log[508] = 0x00; //no errors
+            ata_calc_sector_checksum(smart_log);
+            break;
+
+        default:
+            pr_loc_bug("Cannot build WIN_SMART log for log_addr=%d", log_addr);
+            break;
+    }
+}
+
+/**
+ * Builds all static responses; called once when the shim is registered
+ */
+static void build_smart_rsp_cache(void)
+{
+    build_ata_id(rsp_ata_id, "VH1132", "1.13.2", "Virtual HDD", 0, NULL);
+    build_ata_smart_values(rsp_smart_values);
+    build_ata_smart_thresholds(rsp_smart_thresholds);
+    build_win_smart_log(rsp_smart_log_summary, 0x01);
+    build_win_smart_log(rsp_smart_log_comprehensive, 0x02);
+    build_win_smart_log(rsp_smart_log_self_test, 0x06);
+    pr_loc_dbg("Fake SMART responses built");
+}
+
+/************************************************ Per-disk identities *************************************************/
+//Disks which need a completely fake IDENTIFY would all look the same (same serial, no capacity) with just the generic
+// response. DSM sees them as duplicates and keeps re-probing them. Every SCSI disk gets a record with its own IDENTIFY
+// built after it's probed (see on_scsi_disk_probed()), so that it's still just a copy when the ioctl comes.
+//Records are keyed by scsi_device ptr and never looked at after the device is gone - a stale one is replaced if the
+// address is reused by a new device, and all are freed when the shim is unregistered.
+#define DISK_EMU_HASH_BITS 5
+#define VPD_UNIT_SERIAL 0x80 //VPD page with the unit serial number
+#define VPD_BUF_LEN 64 //header + 20 chars of serial is all we need
+
+//Passthrough verdicts: kinds of commands for which we remember whether the drive can answer them itself
+typedef enum {
+    SMART_PT_IDENTIFY, //HDIO_DRIVE_CMD ; ATA_CMD_ID_ATA
+    SMART_PT_CMD, //HDIO_DRIVE_CMD ; ATA_CMD_SMART
+    SMART_PT_TASK, //HDIO_DRIVE_TASK ; WIN_CMD_SMART
+    SMART_PT_MAX,
+    SMART_PT_NONE = -1, //not a command we emulate - always passed through
+} smart_pt_kind;
+
+//After that many consecutive failures of passthrough the drive is considered to not support a given kind of commands,
+// and they're emulated without calling the drive. Define as 0 to always try the drive first (e.g. for flaky HBAs).
+#ifndef SMART_PASSTHROUGH_MAX_FAILS
+#define SMART_PASSTHROUGH_MAX_FAILS 3
+#endif
+#define SMART_PASSTHROUGH_FAILS_LIMIT 255
+static unsigned int smart_pt_max_fails = SMART_PASSTHROUGH_MAX_FAILS;
+
+//Raising the limit gives drives which were given up on another chance; lowering it applies to the next command
+static struct rp_tunable pt_fails_tunable = {
+    .name = "smart_pt_fails",
+    .value = &smart_pt_max_fails,
+    .min = 0,
+    .max = SMART_PASSTHROUGH_FAILS_LIMIT,
+};
+
+//What the disk answers to ATA IDENTIFY sent via SAT when probed
+typedef enum {
+    DISK_ATA_NONE, //not an ATA device (or behind something which doesn't translate ATA PASS-THROUGH)
+    DISK_ATA_NO_SMART, //ATA device w/o SMART or with SMART disabled
+    DISK_ATA_SMART, //ATA device with working SMART - it doesn't need anything from us
+} disk_ata_support;
+
+struct smart_disk_emu {
+    const struct scsi_device *sdp;
+    disk_ata_support ata_support;
+    u8 ata_id[SMART_RSP_ATA_ID_SIZE];
+    atomic_t pt_fails[SMART_PT_MAX]; //consecutive passthrough failures per smart_pt_kind
+    unsigned int reprobes; //number of times the record was replaced (i.e. "power cycles")
+    spinlock_t stats_lock; //protects all stats_* fields
+    unsigned long stats_expire; //jiffies after which the stats below must be re-read
+    u64 stats_sectors_read;
+    u64 stats_sectors_written;
+    struct hlist_node node;
+    struct rcu_head rcu;
+};
+
+static DEFINE_HASHTABLE(disk_emus, DISK_EMU_HASH_BITS);
+static DEFINE_SPINLOCK(disk_emus_lock); //protects writers only, readers use RCU
+
+//Native SMART slots: the shim sits on the shared sd_fops so it sees every ioctl to every disk (BLKGETSIZE64, SG_IO,
+// etc.). Disks which answered ATA IDENTIFY with SMART enabled don't need anything from us, and their ioctl()s should go
+// straight to sd_ioctl_org(). Every disk (slot = hash of its scsi_device ptr) is counted as needing emulation as soon as
+// it's being probed (synchronously, see on_scsi_disk_probing()) and it's uncounted only once the disk is found to be
+// native (asynchronously, see create_disk_emu()). This way there's no window in which a disk which isn't checked yet
+// skips the shim. Disks which are gone are never uncounted: a colliding or stale slot only means the slower path is
+// taken, which is still correct. Disks which were never seen by the notifier don't need emulation by definition (they
+// were not probed by sd).
+#define DISK_EMU_NEEDED_BITS 8
+static atomic_t disk_emu_needed[1 << DISK_EMU_NEEDED_BITS] __read_mostly;
+
+static __always_inline unsigned long disk_emu_slot(const void *sdp)
+{
+    return hash_ptr((void *)sdp, DISK_EMU_NEEDED_BITS);
+}
+
+/**
+ * Checks if ioctl()s of a given block device must go through the shim; this is the hot path for all sd ioctl()s
+ */
+static __always_inline bool disk_needs_smart_emu(struct block_device *bdev)
+{
+    //sd.c registers the gendisk with the scsi_device as parent, see find_disk_emu_rcu()
+    return atomic_read(&disk_emu_needed[disk_emu_slot(disk_to_dev(bdev->bd_disk)->parent)]) != 0;
+}
+
+static __always_inline void count_disk_emu_needed(const struct scsi_device *sdp)
+{
+    atomic_inc(&disk_emu_needed[disk_emu_slot(sdp)]);
+}
+
+static __always_inline void uncount_disk_emu_needed(const struct scsi_device *sdp)
+{
+    atomic_dec(&disk_emu_needed[disk_emu_slot(sdp)]);
+}
+
+/**
+ * Forces all disks to go through the shim, used when we cannot see the disks to check them
+ */
+static void count_all_disks_emu_needed(void)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(disk_emu_needed); ++i)
+        atomic_inc(&disk_emu_needed[i]);
+}
+
+/**
+ * Asks the disk for ATA IDENTIFY to see if it will handle SMART ioctl()s on its own
+ */
+static disk_ata_support probe_disk_ata(struct scsi_device *sdp)
+{
+    u16 *id = kmalloc(ATA_ID_WORDS * sizeof(u16), GFP_KERNEL);
+    if (unlikely(!id))
+        return DISK_ATA_NO_SMART; //not knowing is the same as needing emulation, but we cannot say it's not ATA
+
+    disk_ata_support support;
+    if (scsi_ata_identify(sdp, id) != 0)
+        support = DISK_ATA_NONE;
+    else if (ata_is_smart_supported(id) && ata_is_smart_enabled(id))
+        support = DISK_ATA_SMART;
+    else
+        support = DISK_ATA_NO_SMART;
+    kfree(id);
+
+    return support;
+}
+
+/**
+ * Copies a SCSI INQUIRY fixed-length field (space padded & not NULL-terminated) into a C-string w/o trailing spaces
+ */
+static void copy_inquiry_str(char *dst, const char *src, size_t len)
+{
+    if (unlikely(!src))
+        len = 0;
+
+    memcpy(dst, src, len);
+    while (len > 0 && (dst[len - 1] == ' ' || dst[len - 1] == '\0'))
+        --len;
+    dst[len] = '\0';
+}
+
+/**
+ * Reads unit serial number from VPD; if it's not available a serial unique to the SCSI address is generated
+ */
+static void read_disk_serial(struct scsi_device *sdp, char *serial, size_t len)
+{
+    u8 *vpd;
+    if (likely((vpd = kzalloc(VPD_BUF_LEN, GFP_KERNEL))) &&
+        scsi_get_vpd_page(sdp, VPD_UNIT_SERIAL, vpd, VPD_BUF_LEN) == 0) {
+        const char *vpd_serial = skip_spaces((char *)vpd + 4); //serials are often right-aligned
+        copy_inquiry_str(serial, vpd_serial, min_t(size_t, strnlen(vpd_serial, min_t(size_t, vpd[3], VPD_BUF_LEN - 4)),
+                                                   len - 1));
+    } else {
+        serial[0] = '\0';
     }
+    kfree(vpd);
+
+    if (!serial[0])
+        snprintf(serial, len, "VH%02X%02X%02X%02X", sdp->host->host_no, sdp->channel, sdp->id, (u8)sdp->lun);
+}
 
-    memset(dst, 0x20, length); //fields in ATA/ATAPI are space-padded and not terminated by \0
-    for (u8 i = 0; i < length; i += 2)
-    {
-        if (src[i] == '\0')
+/**
+ * Creates (or replaces) emulation record for a disk
+ *
+ * The disk must already be counted with count_disk_emu_needed(); it's uncounted here if it turns out to be native.
+ */
+static int create_disk_emu(struct scsi_device *sdp)
+{
+    //this must be done before anything else, as any failure below leaves the disk with a need for (generic) emulation
+    disk_ata_support support = probe_disk_ata(sdp);
+    if (support == DISK_ATA_SMART)
+        uncount_disk_emu_needed(sdp);
+
+    struct smart_disk_emu *emu;
+    kzalloc_or_exit_int(emu, sizeof(struct smart_disk_emu));
+    emu->sdp = sdp;
+    emu->ata_support = support;
+    spin_lock_init(&emu->stats_lock);
+    emu->stats_expire = jiffies; //read on the first use
+
+    char serial[21], fw_rev[9], vendor[9], model_only[17], model[41];
+    read_disk_serial(sdp, serial, sizeof(serial));
+    copy_inquiry_str(fw_rev, sdp->rev, 4);
+    copy_inquiry_str(vendor, sdp->vendor, 8);
+    copy_inquiry_str(model_only, sdp->model, 16);
+    snprintf(model, sizeof(model), "%s%s%s", vendor, vendor[0] ? " " : "", model_only[0] ? model_only : "Virtual HDD");
+
+    long long capacity_mib = opportunistic_read_capacity(sdp);
+    u64 sectors = (capacity_mib > 0) ? ((u64)capacity_mib << (20 - 9)) : 0;
+    //the probe is finished (see on_scsi_disk_probed()), so the queue reflects what sd found out about the disk
+    struct ata_id_caps caps = {
+        .nonrot = blk_queue_nonrot(sdp->request_queue),
+        .trim = blk_queue_discard(sdp->request_queue),
+        .queue_depth = sdp->queue_depth,
+    };
+    build_ata_id(emu->ata_id, serial, fw_rev[0] ? fw_rev : "1.13.2", model, sectors, &caps);
+
+    struct smart_disk_emu *old = NULL, *cur;
+    spin_lock(&disk_emus_lock);
+    hash_for_each_possible(disk_emus, cur, node, hash_ptr(sdp, DISK_EMU_HASH_BITS)) {
+        if (cur->sdp == sdp) {
+            old = cur;
+            hash_del_rcu(&old->node);
+            emu->reprobes = old->reprobes + 1;
             break;
+        }
+    }
+    hash_add_rcu(disk_emus, &emu->node, hash_ptr(sdp, DISK_EMU_HASH_BITS));
+    spin_unlock(&disk_emus_lock);
+
+    if (old)
+        kfree_rcu(old, rcu);
+
+    pr_loc_dbg("Created SMART emulation record for %s: model=\"%s\" serial=\"%s\" fw=\"%s\" capacity=%lldMiB ata=%d "
+               "nonrot=%d trim=%d qd=%u", dev_name(&sdp->sdev_gendev), model, serial, fw_rev, capacity_mib, support,
+               caps.nonrot, caps.trim, caps.queue_depth);
+    return 0;
+}
 
-        dst[i + 1] = src[i];
-        dst[i] = src[i + 1];
+/**
+ * Frees all records; only called after notifications are unsubscribed
+ */
+static void free_disk_emus(void)
+{
+    int bkt;
+    struct hlist_node *tmp;
+    struct smart_disk_emu *emu;
+
+    spin_lock(&disk_emus_lock);
+    hash_for_each_safe(disk_emus, bkt, tmp, emu, node) {
+        hash_del_rcu(&emu->node);
+        kfree_rcu(emu, rcu);
     }
+    spin_unlock(&disk_emus_lock);
+
+    rcu_barrier(); //all records (including replaced ones) must be freed before the module code is gone
 }
 
 /**
- * Duplicates a user-supplied ioctl() buffer into kernel space to safely read data from it
+ * Finds emulation record of a block device; must be called under rcu_read_lock()
  *
- * This pointer returned here is... peculiar. First 4 bytes are a header (as defined by UAPI "struct hd_drive_cmd_hdr"
- * in hdreg.h). Remaining 512 bytes are 16 bits words.
+ * @return record or NULL if the disk doesn't have one
+ */
+static struct smart_disk_emu *find_disk_emu_rcu(struct block_device *bdev)
+{
+    //sd.c registers the gendisk with the scsi_device as parent - that's the only public link between the two
+    struct device *parent = (bdev && bdev->bd_disk) ? disk_to_dev(bdev->bd_disk)->parent : NULL;
+    if (unlikely(!parent || !scsi_is_sdev_device(parent)))
+        return NULL;
+
+    struct scsi_device *sdp = to_scsi_device(parent);
+    struct smart_disk_emu *emu;
+    hash_for_each_possible_rcu(disk_emus, emu, node, hash_ptr(sdp, DISK_EMU_HASH_BITS)) {
+        if (emu->sdp == sdp)
+            return emu;
+    }
+
+    return NULL;
+}
+
+/**
+ * Gets the IDENTIFY response for a given block device (copying it as it's RCU-protected)
  *
- * @param sectors How many sectors to copy
- * @param src User buffer to copy from
+ * @return true if the disk has a dedicated record, false if the generic response should be used
+ */
+static bool get_disk_ata_id(struct block_device *bdev, u8 *dst)
+{
+    rcu_read_lock();
+    struct smart_disk_emu *emu = find_disk_emu_rcu(bdev);
+    if (likely(emu))
+        memcpy(dst, emu->ata_id, SMART_RSP_ATA_ID_SIZE);
+    rcu_read_unlock();
+
+    return !!emu;
+}
+
+/*************************************************** Live counters ****************************************************/
+//A few attributes are expected to move: tools (and DSM) flag disks with power-on hours not increasing, and the
+// written/read totals are what's used to estimate wear. These are patched on top of the static snapshot (see
+// build_ata_smart_values()) for every disk with a record. Sector counts come from the same per-disk stats which are
+// exposed in /sys/block/sdX/stat; reading them means summing per-CPU counters, so they're cached for
+// SMART_STATS_CACHE_MS as Storage Manager & smartd poll every disk frequently.
+#define SMART_STATS_CACHE_MS 1000
+#define SMART_ATTR_POWER_ON_HOURS 9
+#define SMART_ATTR_POWER_CYCLES 12
+#define SMART_ATTR_LBAS_WRITTEN 241
+#define SMART_ATTR_LBAS_READ 242
+#define SMART_ATTR_RAW_OFFSET 5 //first byte of 48-bit LE raw value in ATA_SMART_RECORD_LEN record
+#define SMART_ATTR_RAW_LEN 6
+
+static u64 shim_loaded_jiffies __read_mostly; //start of "power on" time
+
+/**
+ * Adds a value to the raw counter of a given attribute in a SMART VALUES sector (if the attribute exists)
+ */
+static void add_smart_attr_raw(u8 *smart_values, u8 attr_id, u64 val)
+{
+    for (int i = 0; i < ARRAY_SIZE(fake_smart); i++) {
+        u8 *raw = smart_values + 2 + (ATA_SMART_RECORD_LEN * i) + SMART_ATTR_RAW_OFFSET;
+        if (smart_values[2 + (ATA_SMART_RECORD_LEN * i)] != attr_id)
+            continue;
+
+        u64 cur = 0;
+        for (int j = 0; j < SMART_ATTR_RAW_LEN; j++)
+            cur |= (u64)raw[j] << (8 * j);
+
+        cur += val;
+        for (int j = 0; j < SMART_ATTR_RAW_LEN; j++)
+            raw[j] = (u8)(cur >> (8 * j));
+
+        return;
+    }
+}
+
+/**
+ * Refreshes cached I/O stats of a disk if they expired; must be called under rcu_read_lock()
+ */
+static void refresh_disk_stats_rcu(struct smart_disk_emu *emu, struct block_device *bdev)
+{
+    if (time_before(jiffies, ACCESS_ONCE(emu->stats_expire)))
+        return;
+
+    spin_lock(&emu->stats_lock);
+    if (time_after_eq(jiffies, emu->stats_expire)) { //someone else could've just done it
+        struct hd_struct *part = &bdev->bd_disk->part0;
+        emu->stats_sectors_read = part_stat_read(part, sectors[READ]);
+        emu->stats_sectors_written = part_stat_read(part, sectors[WRITE]);
+        emu->stats_expire = jiffies + msecs_to_jiffies(SMART_STATS_CACHE_MS);
+    }
+    spin_unlock(&emu->stats_lock);
+}
+
+/**
+ * Gets the SMART VALUES response for a given block device with its live counters applied
+ *
+ * @param dst buffer of SMART_RSP_VALUES_SIZE
+ *
+ * @return true if the disk has a dedicated record, false if the generic response should be used
+ */
+static bool get_disk_smart_values(struct block_device *bdev, u8 *dst)
+{
+    u64 sectors_read, sectors_written;
+    unsigned int reprobes;
+
+    rcu_read_lock();
+    struct smart_disk_emu *emu = find_disk_emu_rcu(bdev);
+    if (unlikely(!emu)) {
+        rcu_read_unlock();
+        return false;
+    }
+
+    refresh_disk_stats_rcu(emu, bdev);
+    spin_lock(&emu->stats_lock);
+    sectors_read = emu->stats_sectors_read;
+    sectors_written = emu->stats_sectors_written;
+    spin_unlock(&emu->stats_lock);
+    reprobes = emu->reprobes;
+    rcu_read_unlock();
+
+    memcpy(dst, rsp_smart_values, SMART_RSP_VALUES_SIZE);
+    u8 *smart_values = dst + HDIO_DRIVE_CMD_HDR_OFFSET;
+    add_smart_attr_raw(smart_values, SMART_ATTR_POWER_ON_HOURS,
+                       div64_u64(get_jiffies_64() - shim_loaded_jiffies, (u64)HZ * 3600));
+    add_smart_attr_raw(smart_values, SMART_ATTR_POWER_CYCLES, reprobes);
+    add_smart_attr_raw(smart_values, SMART_ATTR_LBAS_WRITTEN, sectors_written); //sd stats are in 512b sectors
+    add_smart_attr_raw(smart_values, SMART_ATTR_LBAS_READ, sectors_read);
+    ata_calc_sector_checksum(smart_values);
+
+    return true;
+}
+
+/**
+ * Checks if the disk was found to not understand ATA PASS-THROUGH commands when probed
+ *
+ * @return true only if it's known for sure; disks w/o a record are assumed to speak ATA
+ */
+static bool disk_lacks_ata(struct block_device *bdev)
+{
+    rcu_read_lock();
+    struct smart_disk_emu *emu = find_disk_emu_rcu(bdev);
+    bool lacks = emu && emu->ata_support == DISK_ATA_NONE;
+    rcu_read_unlock();
+
+    return lacks;
+}
+
+/**
+ * Checks whether the drive was found to be unable to answer a kind of commands by itself
+ */
+static bool is_passthrough_dead(struct block_device *bdev, smart_pt_kind kind)
+{
+    unsigned int max_fails = ACCESS_ONCE(smart_pt_max_fails);
+    if (!max_fails || kind == SMART_PT_NONE)
+        return false;
+
+    rcu_read_lock();
+    struct smart_disk_emu *emu = find_disk_emu_rcu(bdev);
+    bool dead = emu && (unsigned int)atomic_read(&emu->pt_fails[kind]) >= max_fails;
+    rcu_read_unlock();
+
+    return dead;
+}
+
+/**
+ * Remembers the result of passing a command to the drive, see is_passthrough_dead()
+ */
+static void record_passthrough_result(struct block_device *bdev, smart_pt_kind kind, int ioctl_out)
+{
+    unsigned int max_fails = ACCESS_ONCE(smart_pt_max_fails);
+    if (!max_fails || kind == SMART_PT_NONE)
+        return;
+
+    rcu_read_lock();
+    struct smart_disk_emu *emu = find_disk_emu_rcu(bdev);
+    if (likely(emu)) {
+        if (ioctl_out == 0)
+            atomic_set(&emu->pt_fails[kind], 0);
+        else if ((unsigned int)atomic_inc_return(&emu->pt_fails[kind]) == max_fails)
+            pr_loc_dbg("/dev/%s failed SMART passthrough (kind=%d) %u times - it will be emulated from now on",
+                       bdev->bd_disk->disk_name, kind, max_fails);
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * Calls the original sd_ioctl() unless it's known the drive will fail it
  *
- * @return Pointer to a new kernel-space buffer or ERR_PTR; you need to free/put-it-back using put_ioctl_buffer
+ * @return result of sd_ioctl() or -EIO when it was skipped
  */
-static unsigned char* get_ioctl_buffer_kcopy(u8 sectors, const __user void *src)
+static int passthrough_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, void __user *buff_ptr,
+                             smart_pt_kind kind, struct hook_stats_span *hs)
 {
-    unsigned char *kbuf;
+    if (is_passthrough_dead(bdev, kind))
+        return -EIO; //that's what the drive would answer anyway, just much slower
 
-    kmalloc_or_exit_ptr(kbuf, ata_ioctl_buf_size(sectors));
-    if(unlikely(copy_from_user(kbuf, src, ata_ioctl_buf_size(sectors)) != 0)) {
-        pr_loc_err("Failed to copy ATA user buffer from ptr=%p to kspace=%p", src, kbuf);
-        kfree(kbuf);
-        return ERR_PTR(-EFAULT);
-    }
+    int ioctl_out = hook_stats_exclude(hs, sd_ioctl_org(bdev, mode, cmd, (unsigned long)buff_ptr));
+    record_passthrough_result(bdev, kind, ioctl_out);
 
-    return kbuf;
+    return ioctl_out;
+}
+
+static int on_existing_scsi_disk(struct scsi_device *sdp)
+{
+    count_disk_emu_needed(sdp);
+    return create_disk_emu(sdp);
 }
 
 /**
- * Releases buffer obtained from get_ioctl_buffer_*()
+ * Marks a disk as needing emulation before anybody can send ioctl()s to it; it's cheap so it's done synchronously
  */
-static __always_inline void put_ioctl_buffer(unsigned char *buffer)
+static int on_scsi_disk_probing(struct notifier_block *self, unsigned long state, void *data)
 {
-    kfree(buffer);
+    if (state != SCSI_EVT_DEV_PROBING)
+        return NOTIFY_DONE;
+
+    count_disk_emu_needed(data);
+    return NOTIFY_OK;
 }
 
-/*************************************** ATAPI/WIN command interface handling *****************************************/
-static int populate_ata_id(const u8 *req_header, void __user *buff_ptr)
+/**
+ * Checks the disk & builds its record; this sends commands to the disk, so it's called asynchronously after the probe
+ */
+static int on_scsi_disk_probed(struct notifier_block *self, unsigned long state, void *data)
 {
-    pr_loc_dbg("Generating completely fake ATA IDENTITY");
-
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, HDIO_DRIVE_CMD_HDR_OFFSET + sizeof(struct rp_hd_driveid));
-    struct rp_hd_driveid *did = (void *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET); //did=drive ID
+    if (state != SCSI_EVT_DEV_PROBED_OK)
+        return NOTIFY_DONE;
 
-    //First write response header
-    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_CMD_ID_ATA_SECTORS;
+    //sd_probe() only schedules the revalidation which finds out rotation, discard support etc. (used by the IDENTIFY)
+    async_synchronize_full_domain(&scsi_sd_probe_domain);
+    create_disk_emu(data); //failure isn't fatal, the generic IDENTIFY will be used
+    return NOTIFY_OK;
+}
 
-    did->config = 0x0000; //15th bit = ATA device, rest is reserved/obsolete
-    set_ata_string(did->serial_no, "VH1132", 20);
-    set_ata_string(did->fw_rev, "1.13.2", 8);
-    set_ata_string(did->model, "Virtual HDD", 40);
-    did->reserved50 = (1 << 14); //"shall be set to one"
-    did->major_rev_num = 0xffff;
-    did->minor_rev_num = 0xffff;
-    did->command_set_1 = (1 << 3 | 1 << 0); //PM, SMART supported
-    did->command_set_2 = (1 << 14); //"shall be set to one"
-    did->cfsse = (1 << 14 | 1 << 1 | 1 << 0); //14: "shall be set to one" ; smart self-test supported ; smart error-log
-    did->cfs_enable_1 = (1 << 3 | 1 << 0); //PM, SMART
-    did->cfs_enable_2 = (1 << 14); //"shall be set to one"
-    did->csf_default = (1 << 14 | 1 << 1 | 1 << 0); //"shall be one" ; SMART self-test, SMART error-test
-    did->hw_config = (1 << 14 | 1 << 0); //both "shall be one"
-    did->lba_capacity = 0xffffffff; //maybe we can get away with not reading capacity?
+static struct notifier_block scsi_disk_probing_nb = {
+    .notifier_call = on_scsi_disk_probing,
+};
 
-    ata_calc_integrity_word((void *)did);
+static struct notifier_block scsi_disk_probed_nb = {
+    .notifier_call = on_scsi_disk_probed,
+};
 
-    if (unlikely(copy_to_user(buff_ptr, kbuf, HDIO_DRIVE_CMD_HDR_OFFSET + sizeof(struct rp_hd_driveid)) != 0)) {
-        pr_loc_err("Failed to copy fake ATA IDENTIFY packet to user ptr=%p", (void *)buff_ptr);
-        kfree(kbuf);
+/**
+ * Copies a precomputed response into user ioctl() buffer
+ */
+static __always_inline int copy_smart_rsp(void __user *buff_ptr, const u8 *rsp, size_t size, const char *name)
+{
+    if (unlikely(copy_to_user(buff_ptr, rsp, size) != 0)) {
+        pr_loc_err("Failed to copy %s packet to user ptr=%p", name, buff_ptr);
         return -EFAULT;
     }
 
-    kfree(kbuf);
     return 0;
 }
 
+/*************************************** ATAPI/WIN command interface handling *****************************************/
+static int populate_ata_id(struct block_device *bdev, const u8 *req_header, void __user *buff_ptr)
+{
+    u8 disk_ata_id[SMART_RSP_ATA_ID_SIZE];
+    if (likely(get_disk_ata_id(bdev, disk_ata_id))) {
+        pr_loc_dbg("Providing fake ATA IDENTITY for /dev/%s", bdev->bd_disk->disk_name);
+        return copy_smart_rsp(buff_ptr, disk_ata_id, SMART_RSP_ATA_ID_SIZE, "fake ATA IDENTIFY");
+    }
+
+    pr_loc_dbg("Providing completely fake ATA IDENTITY");
+    return copy_smart_rsp(buff_ptr, rsp_ata_id, SMART_RSP_ATA_ID_SIZE, "fake ATA IDENTIFY");
+}
+
 /**
  * Handles on-the-fly modification of data related to ATA IDENTIFY DEVICE command
  *
  * See "8.16 IDENTIFY DEVICE" section in the ATA/ATAPI-6 manual.
  *
+ * @param bdev device the ioctl() was called for
  * @param org_ioctl_exec_result exit code of the original ioctl() call which reached the drive (done by
  *                              handle_hdio_drive_cmd_ioctl()). This command shouldn't normally fail for any drive.
  * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
@@ -323,14 +1025,15 @@ static int populate_ata_id(const u8 *req_header, void __user *buff_ptr)
  * @return definitive exit code for the ioctl(); in practice 0 when succedded [regardless of the modifications made] or
  *         the same error code as org_ioctl_exec_result passed
  */
-static int handle_ata_cmd_identify(int org_ioctl_exec_result, const u8 *req_header, void __user *buff_ptr)
+static int handle_ata_cmd_identify(struct block_device *bdev, int org_ioctl_exec_result, const u8 *req_header,
+                                   void __user *buff_ptr)
 {
     //ATA IDENTIFY should not fail - it may mean a problem with a disk or the "disk" is a adapter (e.g. IDE>SATA) with
     // no disk connected, or if executed against a USB flash drive... or it's an VirtIO SCSI disk read as ATA
     if (unlikely(org_ioctl_exec_result != 0)) {
         pr_loc_dbg("sd_ioctl(HDIO_DRIVE_CMD ; ATA_CMD_ID_ATA) failed with error=%d, attempting to emulate something",
                    org_ioctl_exec_result);
-        return populate_ata_id(req_header, buff_ptr);
+        return populate_ata_id(bdev, req_header, buff_ptr);
     }
 
     //sanity check if requested ATA IDENTIFY sector count is really what we're planning to copy
@@ -350,7 +1053,8 @@ static int handle_ata_cmd_identify(int org_ioctl_exec_result, const u8 *req_head
     u16 *ata_identity = (u16 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
     if (ata_is_smart_supported(ata_identity) && ata_is_smart_enabled(ata_identity)) {
         pr_loc_dbg("ATA_CMD_ID_ATA confirmed SMART support - noop");
-        put_ioctl_buffer(kbuf); //we no longer need the buffer as we're not touching it, we've only read it
+        //we no longer need the buffer as we're not touching it, we've only read it
+        put_ioctl_buffer(kbuf, ATA_CMD_ID_ATA_SECTORS);
         return 0; //SMART supported, pass identity as-is
     }
 
@@ -363,29 +1067,30 @@ static int handle_ata_cmd_identify(int org_ioctl_exec_result, const u8 *req_head
 
     if (unlikely(copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_CMD_ID_ATA_SECTORS)) != 0)) {
         pr_loc_err("Failed to copy ATA IDENTIFY packet to user ptr=%p", (void *)buff_ptr);
-        put_ioctl_buffer(kbuf);
+        put_ioctl_buffer(kbuf, ATA_CMD_ID_ATA_SECTORS);
         return -EFAULT;
     }
 
-    put_ioctl_buffer(kbuf);
+    put_ioctl_buffer(kbuf, ATA_CMD_ID_ATA_SECTORS);
     return 0;
 }
 
 /**
  * Populates user ioctl() buffer with fake SMART snapshot values
  *
- * This function is responsible for the generation of data which you see in a usual tabular format as a result of
- * "smartctl -A" command. The data is formated from the "fake_smart" constant array present on the top of this file.
+ * This is the data which you see in a usual tabular format as a result of "smartctl -A" command. It's precomputed by
+ * build_ata_smart_values(), with live counters of the disk applied on top (see get_disk_smart_values()).
  *
+ * @param bdev block device the ioctl() was sent to
  * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
  * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
  *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * @return 0 on success, -EIO on unexpected call, or -EFAULT when data fails to copy to user buffer
  */
-static int populate_ata_smart_values(const u8 *req_header, void __user *buff_ptr)
+static int populate_ata_smart_values(struct block_device *bdev, const u8 *req_header, void __user *buff_ptr)
 {
-    pr_loc_dbg("Generating fake SMART values");
+    u8 rsp[SMART_RSP_VALUES_SIZE];
+    pr_loc_dbg("Providing fake SMART values");
 
     //sanity check if requested SMART READ VALUES sector count is really what we're planning to copy
     if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_SMART_READ_VALUES_SECTORS) {
@@ -395,50 +1100,8 @@ static int populate_ata_smart_values(const u8 *req_header, void __user *buff_ptr
         return -EIO;
     }
 
-    int i, j;
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS));
-    u8 *smart_values = (u8 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
-
-    //First write response header
-    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_SMART_READ_VALUES_SECTORS;
-
-    //See "Vendor-Specific Data Bytes 0–361" and "Table 5: SMART Attribute Entry Format" in micron.com
-    // document for specification of these numbers and calculations
-    //For full structure see "Table 59 − Device SMART data structure" in ATA/ATAPI-6 PDF
-    smart_values[0] = SMART_SNAP_VERSION;
-
-    //copy ALL attribute bytes as we were asked for everything (including thresholds)
-    for (i = 0; i < ARRAY_SIZE(fake_smart); i++) {
-        for (j = 0; j < 11; j++) {
-            smart_values[2 + (ATA_SMART_RECORD_LEN * i) + j] = fake_smart[i][j];
-        }
-    }
-
-    //specify that we never ran any SMART tests and we're not running any
-    smart_values[362] = 0x82; //Sec. 8.55.5.8.1, Table 60 in ATA/ATAPI-6 PDF (self test ran on boot & succeeded)
-    smart_values[363] = 0x00; //Sec. 8.55.5.8.2, Table 61 in ATA/ATAPI-6 PDF
-    smart_values[364] = 0x45; //LSB of "Total time to complete Offline data collection" (seconds)
-    smart_values[365] = 0x00; //MSB of "Total time to complete Offline data collection" (seconds)
-    smart_values[367] = (1 << 3 | 1 << 4); //bitfield, see sec. 8.55.5.8.4 in ATA/ATAPI-6 PDF
-    smart_values[368] = (1 << 0 | 1 << 1); //bitfield, see sec. 8.55.5.8.5 in ATA/ATAPI-6 PDF
-    smart_values[369] = 0x01; //vendor-specific, rel. to sec. 8.55.5.8.5 in ATA/ATAPI-6 PDF
-    smart_values[370] = 0x01; //bitfield, current only 1st bit used for error logging (Table 59)
-    smart_values[372] = 0x05; //short self-test polling time (minutes), see Table 59
-    smart_values[373] = 0x4B; //long self-test polling time (minutes), see Table 59
-
-    ata_calc_sector_checksum(smart_values);
-
-    if (copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS)) != 0) {
-        pr_loc_err("Failed to copy SMART VALUES packet to user ptr=%p", buff_ptr);
-        kfree(kbuf);
-        return -EFAULT;
-    }
-
-    kfree(kbuf);
-    return 0;
+    return copy_smart_rsp(buff_ptr, get_disk_smart_values(bdev, rsp) ? rsp : rsp_smart_values, SMART_RSP_VALUES_SIZE,
+                          "SMART VALUES");
 }
 
 /**
@@ -447,12 +1110,11 @@ static int populate_ata_smart_values(const u8 *req_header, void __user *buff_ptr
  * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
  * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
  *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * @return 0 on success, -EIO on unexpected call, or -EFAULT when data fails to copy to user buffer
  */
 static int populate_ata_smart_thresholds(const u8 *req_header, void __user *buff_ptr)
 {
-    pr_loc_dbg("Generating fake SMART thresholds");
+    pr_loc_dbg("Providing fake SMART thresholds");
 
     //sanity check if requested SMART READ THRESHOLDS sector count is really what we're planning to copy
     if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_SMART_READ_THRESHOLDS_SECTORS) {
@@ -462,37 +1124,35 @@ static int populate_ata_smart_thresholds(const u8 *req_header, void __user *buff
         return -EIO;
     }
 
-    int i;
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, ata_ioctl_buf_size(ATA_SMART_READ_THRESHOLDS_SECTORS));
-    u8 *smart_thresholds = (u8 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
-
-    //First write response header
-    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_SMART_READ_THRESHOLDS_SECTORS;
+    return copy_smart_rsp(buff_ptr, rsp_smart_thresholds, SMART_RSP_THRESHOLDS_SIZE, "SMART THRESHOLDS");
+}
 
-    //See "Vendor-Specific Data Bytes 0–361" and "Table 5: SMART Attribute Entry Format" in micron.com
-    // document for specification of these numbers and calculations
-    //For full structure see "Table 59 − Device SMART data structure" in ATA/ATAPI-6 PDF
-    smart_thresholds[0] = SMART_SNAP_VERSION;
+/**
+ * Selects precomputed response (with HDIO_DRIVE_CMD header) for a given SMART log address
+ *
+ * @return response of SMART_RSP_LOG_SIZE bytes or NULL if the log is not emulated
+ */
+static const u8 *get_win_smart_log(u8 log_addr)
+{
+    //See "Table 62 − Log address definition" in ATAPI/6 docs
+    switch (log_addr) {
+        //Log directory. While the spec says it's optional supporting it means fewer calls to other ones. We're
+        // indicating that we DO support multi-sector logging to avoid further log-read logic complexity. If the support
+        // is indicated as absent all reads to logs at index 0 must return "command aborted" response.
+        //It has always been answered with the summary log sector (its version byte is overwritten by it)
+        case 0x00:
+        case 0x01: //summary SMART error log (see sect. 8.55.6.8.2 Summary error log sector)
+            return rsp_smart_log_summary;
 
-    //copy a subset of attribute bytes as we were asked for thresholds only
-    for (i = 0; i < ARRAY_SIZE(fake_smart); i++) {
-        smart_thresholds[2 + (ATA_SMART_RECORD_LEN * i) + 0] = fake_smart[i][0]; //entry id
-        smart_thresholds[2 + (ATA_SMART_RECORD_LEN * i) + 1] = fake_smart[i][11]; //threshold value
-    }
+        case 0x02: //comprehensive SMART error log
+            return rsp_smart_log_comprehensive;
 
-    ata_calc_sector_checksum(smart_thresholds);
+        case 0x06: //SMART self-test log
+            return rsp_smart_log_self_test;
 
-    if (copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_SMART_READ_THRESHOLDS_SECTORS)) != 0) {
-        pr_loc_err("Failed to copy SMART THRESHOLDS packet to user ptr=%p", buff_ptr);
-        kfree(kbuf);
-        return -EFAULT;
+        default: //other ones are reserved/vendor/etc
+            return NULL;
     }
-
-    kfree(kbuf);
-    return 0;
 }
 
 /**
@@ -506,12 +1166,11 @@ static int populate_ata_smart_thresholds(const u8 *req_header, void __user *buff
  * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
  * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
  *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * @return 0 on success, -EIO on unexpected call, or -EFAULT when data fails to copy to user buffer
  */
 static int populate_win_smart_log(const u8 *req_header, void __user *buff_ptr)
 {
-    pr_loc_dbg("Generating fake WIN_SMART log=%d entries", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
+    pr_loc_dbg("Providing fake WIN_SMART log=%d entries", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
 
     //sanity check if requested SMART READ LOG sector count is really what we're planning to copy
     if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_WIN_SMART_READ_LOG_SECTORS) {
@@ -521,62 +1180,13 @@ static int populate_win_smart_log(const u8 *req_header, void __user *buff_ptr)
         return -EIO;
     }
 
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS));
-    u8 *smart_log = (u8 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
-
-    //First write response header
-    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_WIN_SMART_READ_LOG_SECTORS;
-
-    //See "Table 62 − Log address definition" in ATAPI/6 docs
-    switch (req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]) {
-        case 0x00: //log directory. While the spec says it's optional supporting it means fewer calls to other ones
-            //we're indicating that we DO support multi-sector logging to avoid further log-read logic complexity. If
-            // the support is indicated as absent all reads to logs at index 0 must return "command aborted" response
-            smart_log[0] = WIN_SMART_DIG_LOG_VERSION;
-            //if every other byte is zero we can ignore the rest of the fields according to Table 63. We also SHOULD NOT
-            // generate a checksum for log directory (despite all others using checksums...)
-
-        case 0x01: //summary SMART error log (see sect. 8.55.6.8.2 Summary error log sector)
-            smart_log[0] = WIN_SMART_SUM_LOG_VERSION;
-            smart_log[1] = 0x00; //no error entries = index is 0
-            smart_log[452] = 0x00; //no errors = count byte 1 is zero
-            smart_log[453] = 0x00; //no errors = count byte 2 is zero
-            ata_calc_sector_checksum(smart_log);
-            break;
-
-        case 0x02: //comprehensive SMART error log
-            smart_log[0] = WIN_SMART_COMP_LOG_VERSION;
-            smart_log[1] = 0x00; //no error entries = index is 0
-            smart_log[452] = 0x00; //no errors = count byte 1 is zero
-            smart_log[453] = 0x00; //no errors = count byte 2 is zero
-            ata_calc_sector_checksum(smart_log);
-            break;
-
-        case 0x06: //SMART self-test log
-            smart_log[0] = WIN_SMART_TEST_LOG_VERSION;
-            smart_log[1] = 0x00; //revision (2nd byte, also defined by 8.55.6.8.4.1)
-            smart_log[508] = 0x00; //no errors
-            ata_calc_sector_checksum(smart_log);
-            break;
-
-        default: //other ones are reserved/vendor/etc
-            pr_loc_err("Unexpected WIN_FT_SMART_READ_LOG_SECTOR with log_addr=%d",
-                       req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
-            kfree(kbuf);
-            return -EIO;
-    }
-
-    if (copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS)) != 0) {
-        pr_loc_err("Failed to copy WIN_SMART LOG packet to user ptr=%p", buff_ptr);
-        kfree(kbuf);
-        return -EFAULT;
+    const u8 *rsp = get_win_smart_log(req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
+    if (unlikely(!rsp)) {
+        pr_loc_err("Unexpected WIN_FT_SMART_READ_LOG_SECTOR with log_addr=%d", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
+        return -EIO;
     }
 
-    kfree(kbuf);
-    return 0;
+    return copy_smart_rsp(buff_ptr, rsp, SMART_RSP_LOG_SIZE, "WIN_SMART LOG");
 }
 
 /**
@@ -585,20 +1195,11 @@ static int populate_win_smart_log(const u8 *req_header, void __user *buff_ptr)
  * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
  * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
  *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * @return 0 on success, -EIO on unexpected call, or -EFAULT when data fails to copy to user buffer
  */
 static int populate_win_smart_exec_test(const u8 *req_header, void __user *buff_ptr)
 {
-    pr_loc_dbg("Generating fake WIN_SMART offline test type=%d", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
-
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, HDIO_DRIVE_CMD_HDR_OFFSET);
-
-    //First write response header
-    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_WIN_SMART_EXEC_TEST;
+    pr_loc_dbg("Providing fake WIN_SMART offline test type=%d", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
 
     //See "Table 58 − SMART EXECUTE OFF-LINE IMMEDIATE LBA Low register values" in ATAPI/6 docs
     switch (req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]) {
@@ -613,18 +1214,10 @@ static int populate_win_smart_exec_test(const u8 *req_header, void __user *buff_
         default: //other ones are reserved/vendor/etc
             pr_loc_err("Unexpected WIN_FT_SMART_READ_LOG_SECTOR with log_addr=%d",
                        req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
-            kfree(kbuf);
             return -EIO;
     }
 
-    if (copy_to_user(buff_ptr, kbuf, HDIO_DRIVE_CMD_HDR_OFFSET) != 0) {
-        pr_loc_err("Failed to copy WIN_SMART TEST header to user ptr=%p", buff_ptr);
-        kfree(kbuf);
-        return -EFAULT;
-    }
-
-    kfree(kbuf);
-    return 0;
+    return copy_smart_rsp(buff_ptr, rsp_smart_exec_test, HDIO_DRIVE_CMD_HDR_OFFSET, "WIN_SMART TEST header");
 }
 
 /**
@@ -633,19 +1226,20 @@ static int populate_win_smart_exec_test(const u8 *req_header, void __user *buff_
  * SMART responses here assume that original ioctl() failed (since otherwise it would be no point to emulate them). If
  * you call this function on a drive with functioning SMART it will be ignored and fake smart will be generated for it.
  *
+ * @param bdev block device the ioctl() was sent to
  * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
  * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
  *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * @return 0 on success, -EIO on unexpected call, or -EFAULT when data fails to copy to user buffer
  */
-static int __always_inline handle_ata_cmd_smart(const u8 *req_header, void __user *buff_ptr)
+static int __always_inline handle_ata_cmd_smart(struct block_device *bdev, const u8 *req_header,
+                                                void __user *buff_ptr)
 {
     pr_loc_dbg("Got SMART *command* - looking for feature=0x%x", req_header[HDIO_DRIVE_CMD_HDR_FEATURE]);
 
     switch (req_header[HDIO_DRIVE_CMD_HDR_FEATURE]) {
         case ATA_SMART_READ_VALUES: //read all SMART values snapshot
-            return populate_ata_smart_values(req_header, buff_ptr);
+            return populate_ata_smart_values(bdev, req_header, buff_ptr);
 
         case ATA_SMART_READ_THRESHOLDS: //read all SMART thresholds snapshot
             return populate_ata_smart_thresholds(req_header, buff_ptr);
@@ -676,7 +1270,8 @@ static int __always_inline handle_ata_cmd_smart(const u8 *req_header, void __use
  * To fully understand this function make sure to read HDIO_DRIVE_CMD description provided by kernel developers at
  * https://www.kernel.org/doc/Documentation/ioctl/hdio.txt
  */
-static int handle_hdio_drive_cmd_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, void __user *buff_ptr)
+static int handle_hdio_drive_cmd_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd,
+                                       void __user *buff_ptr, struct hook_stats_span *hs)
 {
     //Before we execute ioctl we need to save the original header as ioctl will override it (they share buffer)
     u8 req_header[HDIO_DRIVE_CMD_HDR_OFFSET];
@@ -686,18 +1281,25 @@ static int handle_hdio_drive_cmd_ioctl(struct block_device *bdev, fmode_t mode,
         return -EIO;
     }
 
-    int ioctl_out = sd_ioctl_org(bdev, mode, cmd, (unsigned long)buff_ptr);
+    smart_pt_kind kind;
+    switch (req_header[HDIO_DRIVE_CMD_HDR_CMD]) {
+        case ATA_CMD_ID_ATA: kind = SMART_PT_IDENTIFY; break;
+        case ATA_CMD_SMART: kind = SMART_PT_CMD; break;
+        default: kind = SMART_PT_NONE; break;
+    }
+
+    int ioctl_out = passthrough_ioctl(bdev, mode, cmd, buff_ptr, kind, hs);
     switch (req_header[HDIO_DRIVE_CMD_HDR_CMD]) {
         //this command probes the disk for its overall capabilities; it may have nothing to do with SMART reading but
         // we need to modify it to indicate SMART support
         case ATA_CMD_ID_ATA:
             pr_loc_dbg_ioctl(cmd, "ATA_CMD_ID_ATA", bdev);
-            return handle_ata_cmd_identify(ioctl_out, req_header, buff_ptr);
+            return handle_ata_cmd_identify(bdev, ioctl_out, req_header, buff_ptr);
 
         //this command asks directly for the SMART data of the drive and will fail on drives with no real SMART support
         case ATA_CMD_SMART: //if the drive supports SMART it will just return the data as-is, no need to proxy
             pr_loc_dbg_ioctl(cmd, "ATA_CMD_SMART", bdev);
-            return (ioctl_out == 0) ? 0 : handle_ata_cmd_smart(req_header, buff_ptr);
+            return (ioctl_out == 0) ? 0 : handle_ata_cmd_smart(bdev, req_header, buff_ptr);
 
         //We're only interested in a subset of commands - rest are simply redirected back
         default:
@@ -771,7 +1373,8 @@ static int __always_inline handle_ata_task_smart(const u8 *req_header, void __us
  * https://www.kernel.org/doc/Documentation/ioctl/hdio.txt
  */
 static int
-handle_hdio_drive_task_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, void __user *buff_ptr)
+handle_hdio_drive_task_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, void __user *buff_ptr,
+                             struct hook_stats_span *hs)
 {
     //Before we execute ioctl we need to save the original header as ioctl will override it (they share buffer)
     u8 req_header[HDIO_DRIVE_TASK_HDR_OFFSET];
@@ -782,7 +1385,8 @@ handle_hdio_drive_task_ioctl(struct block_device *bdev, fmode_t mode, unsigned i
         return -EIO;
     }
 
-    int ioctl_out = sd_ioctl_org(bdev, mode, cmd, (unsigned long)buff_ptr);
+    smart_pt_kind kind = (req_header[HDIO_DRIVE_TASK_HDR_CMD] == WIN_CMD_SMART) ? SMART_PT_TASK : SMART_PT_NONE;
+    int ioctl_out = passthrough_ioctl(bdev, mode, cmd, buff_ptr, kind, hs);
     switch (req_header[HDIO_DRIVE_TASK_HDR_CMD]) {
         //this command asks directly for the SMART data. From our understanding it's only used for a small subset of
         // commands. The normal SMART reads/logs/etc are going through HDIO_DRIVE_CMD instead. The only thing [so far]
@@ -799,6 +1403,205 @@ handle_hdio_drive_task_ioctl(struct block_device *bdev, fmode_t mode, unsigned i
     }
 }
 
+/****************************************** SG_IO/SAT pass-through handling *******************************************/
+//Newer smartctl & DSM tools don't use HDIO_* but send ATA PASS-THROUGH (12/16) CDBs via SG_IO (see SAT-3 spec). Disks
+// which don't speak ATA (see probe_disk_ata()) would only fail them after sense-data timeouts, so for such disks these
+// CDBs are decoded and answered here from the same precomputed responses. Everything else goes to the driver as-is.
+#define SAT_SMART_LBAM 0x4f //SMART commands carry this signature in LBA mid; SMART RETURN STATUS echoes it when healthy
+#define SAT_SMART_LBAH 0xc2 //...and this one in LBA high
+#define SAT_POWER_ACTIVE 0xff //CHECK POWER MODE count: device is active or idle
+
+//ATA registers of a pass-through command, used both as input & output
+struct sat_taskfile {
+    u8 feature; //error on output
+    u8 nsect;
+    u8 lbal;
+    u8 lbam;
+    u8 lbah;
+    u8 device;
+    u8 command; //status on output
+};
+
+/**
+ * Decodes ATA_12/ATA_16 CDB into ATA registers
+ *
+ * @return true if CDB is an ATA pass-through one, false otherwise
+ */
+static bool decode_sat_cdb(const u8 *cdb, unsigned int cdb_len, struct sat_taskfile *tf)
+{
+    if (cdb[0] == ATA_16 && cdb_len >= 16) {
+        tf->feature = cdb[SCSI_ATA16_FEATURE];
+        tf->nsect = cdb[SCSI_ATA16_NSECT];
+        tf->lbal = cdb[SCSI_ATA16_LBAL];
+        tf->lbam = cdb[SCSI_ATA16_LBAM];
+        tf->lbah = cdb[SCSI_ATA16_LBAH];
+        tf->device = cdb[SCSI_ATA16_DEVICE];
+        tf->command = cdb[SCSI_ATA16_COMMAND];
+        return true;
+    }
+
+    if (cdb[0] == ATA_12 && cdb_len >= 12) {
+        tf->feature = cdb[SCSI_ATA12_FEATURE];
+        tf->nsect = cdb[SCSI_ATA12_NSECT];
+        tf->lbal = cdb[SCSI_ATA12_LBAL];
+        tf->lbam = cdb[SCSI_ATA12_LBAM];
+        tf->lbah = cdb[SCSI_ATA12_LBAH];
+        tf->device = cdb[SCSI_ATA12_DEVICE];
+        tf->command = cdb[SCSI_ATA12_COMMAND];
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Emulates an ATA command received via SAT, modifying taskfile to contain output registers
+ *
+ * @param data will be set to ATA_SECT_SIZE bytes of response data or NULL for non-data commands
+ * @param id_buf buffer for per-disk IDENTIFY or SMART VALUES response (as it has to be copied out of RCU)
+ *
+ * @return 0 on success, -EIO if the command should be aborted
+ */
+static int emulate_sat_cmd(struct block_device *bdev, struct sat_taskfile *tf, const u8 **data, u8 *id_buf)
+{
+    *data = NULL;
+
+    switch (tf->command) {
+        case ATA_CMD_ID_ATA:
+            pr_loc_dbg_ioctl(SG_IO, "ATA_CMD_ID_ATA", bdev);
+            *data = (get_disk_ata_id(bdev, id_buf) ? id_buf : rsp_ata_id) + HDIO_DRIVE_CMD_HDR_OFFSET;
+            break;
+
+        case ATA_CMD_CHK_POWER:
+            pr_loc_dbg_ioctl(SG_IO, "ATA_CMD_CHK_POWER", bdev);
+            tf->nsect = SAT_POWER_ACTIVE;
+            break;
+
+        case ATA_CMD_SMART:
+            pr_loc_dbg_ioctl(SG_IO, "ATA_CMD_SMART", bdev);
+            if (unlikely(tf->lbam != SAT_SMART_LBAM || tf->lbah != SAT_SMART_LBAH))
+                return -EIO; //real drives abort SMART w/o the signature
+
+            switch (tf->feature) {
+                case ATA_SMART_READ_VALUES:
+                    BUILD_BUG_ON(SMART_RSP_VALUES_SIZE != SMART_RSP_ATA_ID_SIZE);
+                    *data = get_disk_smart_values(bdev, id_buf) ? id_buf : rsp_smart_values;
+                    *data += HDIO_DRIVE_CMD_HDR_OFFSET;
+                    break;
+                case ATA_SMART_READ_THRESHOLDS:
+                    *data = rsp_smart_thresholds + HDIO_DRIVE_CMD_HDR_OFFSET;
+                    break;
+                case WIN_FT_SMART_READ_LOG_SECTOR:
+                    if (unlikely(!(*data = get_win_smart_log(tf->lbal))))
+                        return -EIO;
+                    *data += HDIO_DRIVE_CMD_HDR_OFFSET;
+                    break;
+                case ATA_SMART_ENABLE:
+                case WIN_FT_SMART_AUTOSAVE:
+                case WIN_FT_SMART_AUTO_OFFLINE:
+                case WIN_FT_SMART_IMMEDIATE_OFFLINE:
+                case WIN_FT_SMART_STATUS: //LBA mid/high are returned unchanged = "threshold not exceeded"
+                    break;
+                default:
+                    pr_loc_dbg("Unknown SMART SAT command w/feature=0x%02x", tf->feature);
+                    return -EIO;
+            }
+            break;
+
+        default:
+            pr_loc_dbg_ioctl_unk(SG_IO, tf->command, bdev);
+            return -EIO;
+    }
+
+    tf->feature = 0; //error register
+    tf->command = ATA_DRDY; //status register
+    return 0;
+}
+
+/**
+ * Builds descriptor-format sense with ATA Status Return descriptor (like libata's ata_gen_passthru_sense() does)
+ */
+static void build_sat_sense(u8 *sense, const struct sat_taskfile *tf, bool failed)
+{
+    memset(sense, 0, SCSI_ATA_RET_SENSE_LEN);
+    sense[0] = SCSI_SENSE_DESC_FORMAT;
+    sense[1] = failed ? ABORTED_COMMAND : RECOVERED_ERROR;
+    sense[3] = failed ? 0x00 : SCSI_ASCQ_ATA_PT_INFO;
+    sense[7] = 2 + SCSI_ATA_RET_DESC_LEN; //additional sense length
+
+    u8 *desc = sense + 8;
+    desc[0] = SCSI_ATA_RET_DESC;
+    desc[1] = SCSI_ATA_RET_DESC_LEN;
+    desc[3] = tf->feature; //error
+    desc[5] = tf->nsect;
+    desc[7] = tf->lbal;
+    desc[9] = tf->lbam;
+    desc[11] = tf->lbah;
+    desc[12] = tf->device;
+    desc[13] = tf->command; //status
+}
+
+/**
+ * Answers ATA PASS-THROUGH SG_IO requests for disks which don't speak ATA; all other SG_IO requests are proxied
+ *
+ * The response mimics what libata would return for a real drive: data-in (if any), GOOD status, and a CHECK CONDITION
+ * with ATA registers in sense data only when CK_COND was requested. Rejected commands are aborted the way a drive would
+ * abort them (ABORTED COMMAND with ERR/ABRT registers).
+ */
+static int handle_sg_io_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, void __user *arg,
+                              struct hook_stats_span *hs)
+{
+    struct sg_io_hdr hdr;
+    u8 cdb[16];
+    struct sat_taskfile tf;
+
+    //anything we cannot parse goes to the driver which will complain in a standard way
+    if (!disk_lacks_ata(bdev) || copy_from_user(&hdr, arg, sizeof(hdr)) != 0 || hdr.interface_id != 'S' ||
+        hdr.iovec_count || hdr.cmd_len < 12 || hdr.cmd_len > sizeof(cdb) ||
+        copy_from_user(cdb, hdr.cmdp, hdr.cmd_len) != 0 || !decode_sat_cdb(cdb, hdr.cmd_len, &tf))
+        return hook_stats_exclude(hs, sd_ioctl_org(bdev, mode, cmd, (unsigned long)arg));
+
+    bool ck_cond = cdb[2] & SCSI_ATA_CK_COND;
+    const u8 *data;
+    u8 id_buf[SMART_RSP_ATA_ID_SIZE];
+    bool failed = emulate_sat_cmd(bdev, &tf, &data, id_buf) != 0;
+    if (failed) {
+        tf.feature = ATA_ABORTED;
+        tf.command = ATA_DRDY | ATA_ERR;
+        data = NULL;
+    }
+
+    unsigned int xfer = 0;
+    if (data && hdr.dxfer_direction == SG_DXFER_FROM_DEV) {
+        xfer = min_t(unsigned int, hdr.dxfer_len, ATA_SECT_SIZE);
+        if (unlikely(copy_to_user(hdr.dxferp, data, xfer) != 0))
+            return -EFAULT;
+    }
+    hdr.resid = hdr.dxfer_len - xfer;
+
+    hdr.sb_len_wr = 0;
+    if (failed || ck_cond) {
+        u8 sense[SCSI_ATA_RET_SENSE_LEN];
+        build_sat_sense(sense, &tf, failed);
+        hdr.sb_len_wr = min_t(unsigned char, hdr.mx_sb_len, SCSI_ATA_RET_SENSE_LEN);
+        if (hdr.sb_len_wr && unlikely(copy_to_user(hdr.sbp, sense, hdr.sb_len_wr) != 0))
+            return -EFAULT;
+    }
+
+    hdr.status = (failed || ck_cond) ? SAM_STAT_CHECK_CONDITION : SAM_STAT_GOOD;
+    hdr.masked_status = hdr.status >> 1;
+    hdr.msg_status = 0;
+    hdr.host_status = 0;
+    hdr.driver_status = hdr.sb_len_wr ? DRIVER_SENSE : 0;
+    hdr.info = (hdr.status != SAM_STAT_GOOD) ? SG_INFO_CHECK : SG_INFO_OK;
+    hdr.duration = 0;
+
+    if (unlikely(copy_to_user(arg, &hdr, sizeof(hdr)) != 0))
+        return -EFAULT;
+
+    return 0;
+}
+
 /********************************** ioctl() handling re-routing from driver to shim ***********************************/
 //These are called from each other so we need to predeclare them
 int sd_ioctl_canary_install(void);
@@ -809,7 +1612,8 @@ int sd_ioctl_canary_uninstall(void);
  *
  * This shim is installed just before the first IOCTL from the userspace.
  */
-static int sd_ioctl_smart_shim(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg)
+static int __sd_ioctl_smart_shim(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg,
+                                 struct hook_stats_span *hs)
 {
 #ifdef DBG_SMART_PRINT_ALL_IOCTL
     pr_loc_dbg("Handling ioctl(0x%02x) for /dev/%s", cmd, bdev->bd_disk->disk_name);
@@ -822,19 +1626,40 @@ static int sd_ioctl_smart_shim(struct block_device *bdev, fmode_t mode, unsigned
 
     switch (cmd) {
         case HDIO_DRIVE_CMD: //"a special drive command" as per hdreg.h
-            return handle_hdio_drive_cmd_ioctl(bdev, mode, cmd, (void *)arg);
+            return handle_hdio_drive_cmd_ioctl(bdev, mode, cmd, (void *)arg, hs);
 
         case HDIO_DRIVE_TASK: //"execute task and special drive command" as per Documentation/ioctl/hdio.txt
-            return handle_hdio_drive_task_ioctl(bdev, mode, cmd, (void *)arg);
+            return handle_hdio_drive_task_ioctl(bdev, mode, cmd, (void *)arg, hs);
+
+        case SG_IO: //SCSI generic passthrough; only ATA PASS-THROUGH CDBs are interesting
+            return handle_sg_io_ioctl(bdev, mode, cmd, (void *)arg, hs);
 
         default: //any other ioctls are proxied as-is
 #       ifdef DBG_SMART_PRINT_ALL_IOCTL
             pr_loc_dbg("sd_ioctl(0x%02x) - not a hooked ioctl, noop", cmd);
 #       endif
-            return sd_ioctl_org(bdev, mode, cmd, arg);
+            return hook_stats_exclude(hs, sd_ioctl_org(bdev, mode, cmd, arg));
     }
 }
 
+/**
+ * Entrypoint for __sd_ioctl_smart_shim(); disks with native SMART bypass it (and the instrumentation)
+ *
+ * Calls to the original sd_ioctl() made on behalf of the emulation aren't accounted to it.
+ */
+static int sd_ioctl_smart_shim(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg)
+{
+    if (likely(sd_ioctl_org && !disk_needs_smart_emu(bdev)))
+        return sd_ioctl_org(bdev, mode, cmd, arg);
+
+    struct hook_stats_span hs;
+    hook_stats_span_begin(&hs);
+    int out = __sd_ioctl_smart_shim(bdev, mode, cmd, arg, &hs);
+    hook_stats_span_end(HOOK_STATS_SD_IOCTL, &hs);
+    rp_trace(smart_ioctl, bdev->bd_disk->disk_name, cmd, out);
+    return out;
+}
+
 /**
  * Installs a permanent shim into the sd driver ops
  *
@@ -860,8 +1685,7 @@ int sd_ioctl_smart_shim_install(void)
                sd_ioctl_smart_shim, sd_ioctl_smart_shim);
     sd_ioctl_org = sd_fops->ioctl;
 
-    WITH_MEM_UNLOCKED(
-        &sd_fops->ioctl, sizeof(void *),
+    WITH_MEM_WRITE_WINDOW(
         sd_fops->ioctl = sd_ioctl_smart_shim;
     );
 
@@ -889,8 +1713,7 @@ int sd_ioctl_smart_shim_uninstall(void)
     pr_loc_dbg("Restoring sd_fops->ioctl<%p>=%pF<%p> to %pF<%p>", &sd_fops->ioctl, sd_fops->ioctl, sd_fops->ioctl,
                sd_ioctl_org, sd_ioctl_org);
 
-    WITH_MEM_UNLOCKED(
-        &sd_fops->ioctl, sizeof(void *),
+    WITH_MEM_WRITE_WINDOW(
         sd_fops->ioctl = sd_ioctl_org;
     );
 
@@ -1031,24 +1854,46 @@ int register_disk_smart_shim(void)
 
     int out;
 
+    build_smart_rsp_cache(); //before any ioctl can be routed to us
+    shim_loaded_jiffies = get_jiffies_64();
+    create_ata_buf_cache();
+
     out = is_scsi_driver_loaded();
     if (IS_SCSI_DRIVER_ERROR(out)) {
         pr_loc_err("Failed to determine SCSI driver status - error=%d", out);
+        destroy_ata_buf_cache();
         return out;
     } else if(out == SCSI_DRV_LOADED || kernel_has_symbol("sd_ioctl")) {
         //driver is loaded, OR it's not loaded, but it's compiled-in
         pr_loc_dbg("SCSI driver exists - installing canary");
-        if ((out = sd_ioctl_canary_install()) != 0)
+        if ((out = sd_ioctl_canary_install()) != 0) {
+            destroy_ata_buf_cache();
             return out;
+        }
     } else { //driver not loaded and doesn't exist (=not compiled in)
         //normally this should call watch_scsi_driver_register() but the current implementation of driver watcher allows
         // for just a single watcher per driver (as it doesn't use standard kernel notifiers, sic!). This is however
         // unlikely case to ever occur
         pr_loc_bug("Cannot register SMART shim - the SCSI driver \"%s\" is not loaded and it doesn't exist",
                    SCSI_DRV_NAME);
+        destroy_ata_buf_cache();
         return -ENXIO;
     }
 
+    //Per-disk identities are an improvement, not a requirement - if this fails all disks get the generic one. However,
+    // without seeing the disks we cannot tell which ones are native, so all of them must go through the shim.
+    if ((out = subscribe_scsi_disk_events(&scsi_disk_probing_nb)) != 0) {
+        pr_loc_wrn("Failed to register for SCSI disks notifications - error=%d", out);
+        count_all_disks_emu_needed();
+    } else if ((out = subscribe_scsi_disk_events_async(&scsi_disk_probed_nb)) != 0) {
+        pr_loc_wrn("Failed to register for async SCSI disks notifications - error=%d", out);
+        count_all_disks_emu_needed(); //disks will be counted but never checked
+    } else if ((out = for_each_scsi_disk(on_existing_scsi_disk)) != 0 && out != -ENXIO) {
+        pr_loc_wrn("Failed to enumerate current SCSI disks - error=%d", out);
+        count_all_disks_emu_needed();
+    }
+
+    register_rp_tunable(&pt_fails_tunable); //not fatal - the limit just cannot be changed without a reload
     shim_reg_ok();
     return 0;
 }
@@ -1072,6 +1917,12 @@ int unregister_disk_smart_shim(void)
         is_error = true;
     }
 
+    unsubscribe_scsi_disk_events(&scsi_disk_probing_nb);
+    unsubscribe_scsi_disk_events_async(&scsi_disk_probed_nb); //waits for create_disk_emu() if it's running
+    unregister_rp_tunable(&pt_fails_tunable);
+    free_disk_emus();
+    destroy_ata_buf_cache();
+
     if (is_error)
         return -EIO;
 
@@ -5,6 +5,7 @@
 #include "../common.h"
 #include "../config/runtime_config.h" //STD_COM*
 #include "../config/platform_types.h" //hw_config
+#include "../config/platform_profile.h" //platform_swap_serial(), platform_reinit_ttyS0(), RP_PLATFORM_NO_UART_SWAPPER
 #include "../internal/call_protected.h" //early_serial_setup()
 #include "../internal/override/override_symbol.h" //overriding uart_match_port()
 #include <linux/serial_8250.h> //serial8250_unregister_port
@@ -16,6 +17,9 @@ static int noinline uart_swap_hw_output(unsigned int from, unsigned char to)
     return 0;
 }
 #elif defined(UART_BUG_SWAPPED)
+#ifdef RP_PLATFORM_NO_UART_SWAPPER
+#error "The kernel swaps UARTs but the platform profile excludes the UART swapper - check PLATFORM= used to build"
+#endif
 #include "../internal/uart/uart_swapper.h"
 #else
 static int noinline uart_swap_hw_output(unsigned int from, unsigned char to)
@@ -73,15 +77,15 @@ int register_uart_fixer(const hw_config_uart_fixer *hw)
 
     int out = 0;
     if (
-            (hw->swap_serial && (out = uart_swap_hw_output(1, 0)) != 0) ||
-            (hw->reinit_ttyS0 && (out = fix_muted_ttyS0()) != 0)
+            (platform_swap_serial(hw) && (out = uart_swap_hw_output(1, 0)) != 0) ||
+            (platform_reinit_ttyS0(hw) && (out = fix_muted_ttyS0()) != 0)
        ) {
         pr_loc_err("Failed to register UART fixer");
 
         return out;
     }
 
-    serial_swapped = hw->swap_serial;
+    serial_swapped = platform_swap_serial(hw);
 
     shim_reg_ok();
     return out;
@@ -0,0 +1,107 @@
+/*
+ * Fuzzer of the PMU protocol parser (shim/pmu_parser.c) & the cmdline parser (config/cmdline_parser.c)
+ *
+ * Build: make host-fuzz HOST_CC=clang HOST_CFLAGS="-O1 -g -fsanitize=fuzzer-no-link,address,undefined"
+ * Usage: host_build/fuzz_parsers -close_fd_mask=2 [corpus_dir]
+ *
+ * Every input is fed to both parsers. The PMU parser gets it in chunks (sized by the first byte) with a flush after
+ * each, the same way the vUART delivers data, with the last flush being an IDLE. The cmdline parser gets it as a
+ * NULL-terminated cmdline of up to CMDLINE_MAX bytes. Besides the sanitizers, invariants of both parsers' outputs are
+ * checked with assert().
+ * With HOST_FUZZ_CFLAGS=-DFUZZ_STANDALONE it builds without libFuzzer (e.g. with gcc) and replays files passed as
+ * arguments instead.
+ */
+#undef NDEBUG
+#include "../shim/pmu_parser.h"
+#include "../config/cmdline_parser.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned int pmu_dispatched;
+
+static void pmu_check_dispatch(void *ctx, const pmu_command *cmd, const char *signature, unsigned int len)
+{
+    assert(ctx == &pmu_dispatched);
+    assert(len <= PMU_CMD_BUFFER_LEN);
+    ++pmu_dispatched;
+
+    if (!cmd)
+        return;
+
+    assert(cmd->action < PMU_ACT__COUNT);
+    assert(cmd->length >= 1 && cmd->length <= len);
+    assert(cmd->has_data || len == cmd->length || len == cmd->length + 2); //+2 is a CRLF
+
+    if (cmd->has_data) {
+        unsigned int value;
+        pmu_parse_numeric_arg(signature + cmd->length, len - cmd->length, &value);
+    }
+}
+
+static void fuzz_pmu(const u8 *data, size_t size)
+{
+    struct pmu_parser parser;
+    pmu_parser_init(&parser, pmu_check_dispatch, &pmu_dispatched);
+
+    size_t chunk = size > 0 ? (data[0] % PMU_CMD_BUFFER_LEN) + 1 : 1;
+    for (size_t pos = 0; pos < size; pos += chunk) {
+        size_t len = size - pos < chunk ? size - pos : chunk;
+        pmu_parser_feed(&parser, (const char *)data + pos, len);
+        pmu_parser_flush(&parser, pos + len == size);
+        assert(parser.len <= PMU_CMD_BUFFER_LEN);
+    }
+}
+
+static void fuzz_cmdline(const u8 *data, size_t size)
+{
+    static struct runtime_config config;
+    char cmdline[CMDLINE_MAX + 1];
+
+    if (size > CMDLINE_MAX)
+        size = CMDLINE_MAX;
+    memcpy(cmdline, data, size);
+    cmdline[size] = '\0';
+
+    memset(&config, 0, sizeof(config));
+    parse_cmdline_tokens(&config, cmdline);
+
+    assert(memchr(config.hw, '\0', sizeof(config.hw)));
+    assert(memchr(config.sn, '\0', sizeof(config.sn)));
+    assert(config.boot_media.candidates_num <= MAX_BOOT_CANDIDATES);
+    for (unsigned int i = 0; i < config.boot_media.candidates_num; ++i)
+        assert(memchr(config.boot_media.candidates[i].serial, '\0', sizeof(config.boot_media.candidates[i].serial)));
+    assert(config.ssd_cache.selectors_num <= MAX_SSD_CACHE_SELECTORS);
+    for (unsigned int i = 0; i < config.ssd_cache.selectors_num; ++i)
+        assert(memchr(config.ssd_cache.selectors[i].value, '\0', sizeof(config.ssd_cache.selectors[i].value)));
+    assert(config.netif_num <= 9);
+    assert(config.macs_num <= MAX_NET_IFACES);
+}
+
+int LLVMFuzzerTestOneInput(const u8 *data, size_t size)
+{
+    fuzz_pmu(data, size);
+    fuzz_cmdline(data, size);
+
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        FILE *fp = fopen(argv[i], "rb");
+        if (!fp) {
+            perror(argv[i]);
+            return 1;
+        }
+
+        static u8 buf[64 * 1024];
+        size_t size = fread(buf, 1, sizeof(buf), fp);
+        fclose(fp);
+        LLVMFuzzerTestOneInput(buf, size);
+    }
+
+    return 0;
+}
+#endif
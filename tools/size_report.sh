@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+# Reports the size of every object linked into the module and of the module itself; fails if a budget is exceeded.
+# It's called by the Makefile after every build of redpill.ko, but it can be used standalone as well:
+#   ./tools/size_report.sh redpill.ko internal/foo.o shim/bar.o ...
+#
+# Budgets are in bytes and are passed via the environment/make (unset or 0 = no limit):
+#   RP_BUDGET_CORE   sections which stay in memory after the module loads (text, data, rodata, bss...)
+#   RP_BUDGET_INIT   .init.* sections, which are freed after the module init finishes
+#   RP_BUDGET_KO     size of the .ko file (this includes debug info in dev builds!)
+
+set -euo pipefail
+
+if [[ $# -lt 1 ]]; then
+  echo "Usage: $0 <module.ko> [objects...]" >&2
+  exit 2
+fi
+
+KO="$1"
+shift
+
+# Sections which aren't loaded into memory at all
+NOLOAD_RE='^\.(debug|comment|symtab|strtab|shstrtab|rela?|note\.GNU-stack|gnu\.build|GCC)'
+
+echo "Per-object sizes (largest first):"
+printf "%10s %10s %10s %10s  %s\n" "text" "data" "bss" "total" "object"
+if [[ $# -gt 0 ]]; then
+  size "$@" | tail -n +2 | sort -k4 -n -r | awk '{ printf "%10d %10d %10d %10d  %s\n", $1, $2, $3, $4, $6 }'
+fi
+
+read -r CORE INIT < <(size -A "$KO" | awk -v noload="$NOLOAD_RE" '
+  NR > 2 && $1 != "Total" && $1 !~ noload && NF >= 2 {
+    if ($1 ~ /^\.init\./) init += $2; else core += $2
+  }
+  END { printf "%d %d\n", core, init }')
+KO_SIZE=$(stat -c %s "$KO")
+
+echo
+echo "Module $KO:"
+printf "  %-28s %10d B\n" "resident (core sections)" "$CORE" "freed after init (.init.*)" "$INIT" "file" "$KO_SIZE"
+
+FAILED=0
+check_budget() { # <name> <value> <budget>
+  if [[ -n "$3" && "$3" -gt 0 && "$2" -gt "$3" ]]; then
+    echo "BUDGET EXCEEDED: $1 is $2 B with a budget of $3 B (+$(($2 - $3)) B)" >&2
+    FAILED=1
+  fi
+}
+check_budget "resident size" "$CORE" "${RP_BUDGET_CORE:-0}"
+check_budget "init size" "$INIT" "${RP_BUDGET_INIT:-0}"
+check_budget "file size" "$KO_SIZE" "${RP_BUDGET_KO:-0}"
+
+exit $FAILED
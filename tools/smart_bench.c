@@ -0,0 +1,240 @@
+/*
+ * SMART ioctl latency benchmark (exercises shim/storage/smart_shim.c as Storage Manager & smartd do)
+ *
+ * Build: gcc -O2 -static -pthread -o smart_bench smart_bench.c
+ * Usage: smart_bench [-n iterations] [-j threads_per_disk] [-x] [/dev/sda /dev/sdb ...]
+ *
+ * Every thread repeats the sequence of HDIO_DRIVE_CMD/HDIO_DRIVE_TASK ioctls smartctl sends (IDENTIFY, SMART READ
+ * VALUES, READ THRESHOLDS, READ LOG [summary, comprehensive & self-test], RETURN STATUS) on its disk, while all disks
+ * are hammered at once. Without disks given all /dev/sd? are used. With -x SMART EXECUTE OFF-LINE (short self-test) is
+ * added as well - on real drives it REALLY starts a test, so it's off by default.
+ *
+ * Results are printed per disk & command as one JSON object per line with p50/p99/max latency in ns and the number of
+ * failed calls. Disks with emulated SMART are served from the shim's prebuilt responses, while the ones with native
+ * SMART go to the drive - comparing them shows the cost of both paths of the sd_fops->ioctl hook.
+ */
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <linux/hdreg.h> //HDIO_DRIVE_CMD, HDIO_DRIVE_TASK, WIN_*, SMART_*
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SECT_SIZE 512
+#define CMD_HDR_SIZE 4
+
+#define SMART_SHORT_SELFTEST 0x01
+
+enum bench_op {
+    OP_IDENTIFY = 0,
+    OP_READ_VALUES,
+    OP_READ_THRESHOLDS,
+    OP_READ_LOG_SUMMARY,
+    OP_READ_LOG_COMPREHENSIVE,
+    OP_READ_LOG_SELF_TEST,
+    OP_STATUS,
+    OP_EXEC_TEST,
+    OP_COUNT
+};
+
+struct op_desc {
+    const char *name;
+    int task; //HDIO_DRIVE_TASK instead of HDIO_DRIVE_CMD
+    unsigned char cmd, sec_num, feature, sec_cnt;
+};
+
+static const struct op_desc ops[OP_COUNT] = {
+    [OP_IDENTIFY] = { "identify", 0, WIN_IDENTIFY, 0, 0, 1 },
+    [OP_READ_VALUES] = { "read_values", 0, WIN_SMART, 0, SMART_READ_VALUES, 1 },
+    [OP_READ_THRESHOLDS] = { "read_thresholds", 0, WIN_SMART, 1, SMART_READ_THRESHOLDS, 1 },
+    [OP_READ_LOG_SUMMARY] = { "read_log_summary", 0, WIN_SMART, 0x01, SMART_READ_LOG_SECTOR, 1 },
+    [OP_READ_LOG_COMPREHENSIVE] = { "read_log_comprehensive", 0, WIN_SMART, 0x02, SMART_READ_LOG_SECTOR, 1 },
+    [OP_READ_LOG_SELF_TEST] = { "read_log_self_test", 0, WIN_SMART, 0x06, SMART_READ_LOG_SECTOR, 1 },
+    [OP_STATUS] = { "status", 1, WIN_SMART, 0, SMART_STATUS, 0 },
+    [OP_EXEC_TEST] = { "exec_test", 0, WIN_SMART, SMART_SHORT_SELFTEST, SMART_IMMEDIATE_OFFLINE, 0 },
+};
+
+struct worker {
+    pthread_t thread;
+    const char *disk;
+    int fd;
+    uint64_t *lat[OP_COUNT]; //iterations entries each
+    unsigned int errors[OP_COUNT];
+};
+
+static unsigned int iterations = 1000;
+static int with_exec = 0;
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int run_op(int fd, const struct op_desc *op)
+{
+    unsigned char buf[CMD_HDR_SIZE + SECT_SIZE];
+    memset(buf, 0, sizeof(buf));
+
+    if (op->task) {
+        buf[0] = op->cmd;
+        buf[1] = op->feature;
+        buf[4] = SMART_LCYL_PASS;
+        buf[5] = SMART_HCYL_PASS;
+        return ioctl(fd, HDIO_DRIVE_TASK, buf);
+    }
+
+    buf[0] = op->cmd;
+    buf[1] = op->sec_num;
+    buf[2] = op->feature;
+    buf[3] = op->sec_cnt;
+    return ioctl(fd, HDIO_DRIVE_CMD, buf);
+}
+
+static void *worker_fn(void *data)
+{
+    struct worker *w = data;
+
+    pthread_barrier_wait(&start_barrier);
+    for (unsigned int i = 0; i < iterations; ++i) {
+        for (int op = 0; op < OP_COUNT; ++op) {
+            if (op == OP_EXEC_TEST && !with_exec)
+                continue;
+
+            uint64_t start = now_ns();
+            if (run_op(w->fd, &ops[op]) != 0)
+                ++w->errors[op];
+            w->lat[op][i] = now_ns() - start;
+        }
+    }
+
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_results(struct worker *workers, unsigned int num, unsigned int per_disk)
+{
+    uint64_t *all = malloc(sizeof(uint64_t) * iterations * per_disk);
+    if (!all) {
+        perror("malloc");
+        return;
+    }
+
+    for (unsigned int d = 0; d < num; d += per_disk) {
+        for (int op = 0; op < OP_COUNT; ++op) {
+            if (op == OP_EXEC_TEST && !with_exec)
+                continue;
+
+            unsigned int count = 0, errors = 0;
+            for (unsigned int t = d; t < d + per_disk; ++t) {
+                memcpy(all + count, workers[t].lat[op], sizeof(uint64_t) * iterations);
+                count += iterations;
+                errors += workers[t].errors[op];
+            }
+
+            qsort(all, count, sizeof(uint64_t), cmp_u64);
+            printf("{\"disk\":\"%s\",\"op\":\"%s\",\"calls\":%u,\"errors\":%u,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+                   "\"max_ns\":%llu}\n", workers[d].disk, ops[op].name, count, errors,
+                   (unsigned long long)all[count / 2], (unsigned long long)all[(uint64_t)count * 99 / 100],
+                   (unsigned long long)all[count - 1]);
+        }
+    }
+
+    free(all);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int per_disk = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:j:x")) != -1) {
+        switch (opt) {
+            case 'n': iterations = strtoul(optarg, NULL, 10); break;
+            case 'j': per_disk = strtoul(optarg, NULL, 10); break;
+            case 'x': with_exec = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations] [-j threads_per_disk] [-x] [disk...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (!iterations || !per_disk) {
+        fprintf(stderr, "Iterations and threads per disk must be >0\n");
+        return 1;
+    }
+
+    glob_t found = { 0 };
+    char **disks = argv + optind;
+    size_t disks_num = argc - optind;
+    if (!disks_num) {
+        if (glob("/dev/sd[a-z]", 0, NULL, &found) != 0 || !found.gl_pathc) {
+            fprintf(stderr, "No disks found\n");
+            return 1;
+        }
+        disks = found.gl_pathv;
+        disks_num = found.gl_pathc;
+    }
+
+    unsigned int num = disks_num * per_disk;
+    struct worker *workers = calloc(num, sizeof(*workers));
+    if (!workers) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < num; ++i) {
+        struct worker *w = &workers[i];
+        w->disk = disks[i / per_disk];
+        w->fd = open(w->disk, O_RDONLY | O_NONBLOCK);
+        if (w->fd < 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", w->disk, strerror(errno));
+            return 1;
+        }
+
+        for (int op = 0; op < OP_COUNT; ++op) {
+            w->lat[op] = calloc(iterations, sizeof(uint64_t));
+            if (!w->lat[op]) {
+                perror("calloc");
+                return 1;
+            }
+        }
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, num);
+    for (unsigned int i = 0; i < num; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to start thread %u\n", i);
+            return 1;
+        }
+    }
+
+    for (unsigned int i = 0; i < num; ++i)
+        pthread_join(workers[i].thread, NULL);
+
+    print_results(workers, num, per_disk);
+
+    for (unsigned int i = 0; i < num; ++i) {
+        close(workers[i].fd);
+        for (int op = 0; op < OP_COUNT; ++op)
+            free(workers[i].lat[op]);
+    }
+    free(workers);
+    globfree(&found);
+
+    return 0;
+}
@@ -0,0 +1,233 @@
+/*
+ * Userspace driver for the vUART benchmark module (bench/vuart_bench.c)
+ *
+ * Build: gcc -O2 -static -o vuart_bench vuart_bench.c
+ * Usage: vuart_bench [-d /dev/ttyS1] [-c <debugfs>/redpill/vuart_bench] [-t 1,8,16] [-p 64] [-n 10000] [-m tx|rx]
+ *
+ * TX: for every threshold from -t the TX callback is set, -n packets of -p bytes are written to the tty and the module
+ *     results are collected. RX: the module injects -n packets of -p bytes and they're read & timed here.
+ * Every run prints a single JSON object per line (module "key=value" results are merged into it).
+ */
+#define _DEFAULT_SOURCE //strsep(), cfmakeraw()
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TS_LEN 8
+#define MAX_PACKET 4096
+
+static const char *tty_path = "/dev/ttyS1";
+static const char *ctrl_path = "/sys/kernel/debug/redpill/vuart_bench";
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int ctrl_cmd(const char *cmd)
+{
+    int fd = open(ctrl_path, O_WRONLY);
+    if (fd < 0 || write(fd, cmd, strlen(cmd)) < 0) {
+        fprintf(stderr, "\"%s\" to %s failed: %s\n", cmd, ctrl_path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/* Prints module results as JSON fields (numbers unquoted) */
+static int ctrl_dump_json(void)
+{
+    char line[128];
+    FILE *f = fopen(ctrl_path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", ctrl_path, strerror(errno));
+        return -1;
+    }
+
+    int first = 1;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *val = strchr(line, '=');
+        if (!val)
+            continue;
+        *val++ = '\0';
+
+        char *end;
+        strtoull(val, &end, 10);
+        printf(*val && !*end ? "%s\"%s\":%s" : "%s\"%s\":\"%s\"", first ? "" : ",", line, val);
+        first = 0;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static int open_tty(void)
+{
+    int fd = open(tty_path, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", tty_path, strerror(errno));
+        return -1;
+    }
+
+    struct termios tio;
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tio);
+    tcflush(fd, TCIOFLUSH);
+
+    return fd;
+}
+
+static void stamp(unsigned char *packet)
+{
+    uint64_t ts = now_ns();
+    for (int i = 0; i < TS_LEN; ++i)
+        packet[i] = (unsigned char)(ts >> (8 * i));
+}
+
+static int run_tx(int fd, int threshold, unsigned int size, unsigned int packets)
+{
+    unsigned char packet[MAX_PACKET];
+    char cmd[64];
+
+    for (unsigned int i = TS_LEN; i < size; ++i)
+        packet[i] = (unsigned char)i;
+
+    snprintf(cmd, sizeof(cmd), "tx %d %u", threshold, size);
+    if (ctrl_cmd(cmd) != 0)
+        return -1;
+
+    uint64_t start = now_ns();
+    for (unsigned int p = 0; p < packets; ++p) {
+        stamp(packet);
+        for (unsigned int off = 0; off < size; ) {
+            ssize_t put = write(fd, packet + off, size - off);
+            if (put < 0) {
+                fprintf(stderr, "write() failed: %s\n", strerror(errno));
+                return -1;
+            }
+            off += put;
+        }
+    }
+    tcdrain(fd);
+    uint64_t user_ns = now_ns() - start;
+    usleep(100000); //let the last IDLE flush happen
+
+    printf("{\"mode\":\"tx\",\"user_ns\":%llu,\"user_bytes_per_s\":%llu,", (unsigned long long)user_ns,
+           user_ns ? (unsigned long long)((uint64_t)size * packets * 1000000000ULL / user_ns) : 0ULL);
+    ctrl_dump_json();
+    printf("}\n");
+    fflush(stdout);
+
+    return 0;
+}
+
+static int run_rx(int fd, unsigned int size, unsigned int packets)
+{
+    unsigned char packet[MAX_PACKET];
+    char cmd[64];
+    uint64_t lat_min = UINT64_MAX, lat_max = 0, lat_sum = 0, start = 0;
+
+    snprintf(cmd, sizeof(cmd), "rx %u %u", size, packets);
+    if (ctrl_cmd(cmd) != 0)
+        return -1;
+
+    for (unsigned int p = 0; p < packets; ++p) {
+        for (unsigned int off = 0; off < size; ) {
+            ssize_t got = read(fd, packet + off, size - off);
+            if (got <= 0) {
+                fprintf(stderr, "read() failed: %s\n", got ? strerror(errno) : "EOF");
+                return -1;
+            }
+            off += got;
+        }
+
+        uint64_t now = now_ns(), ts = 0;
+        for (int i = 0; i < TS_LEN; ++i)
+            ts |= (uint64_t)packet[i] << (8 * i);
+
+        if (!p)
+            start = ts;
+
+        uint64_t lat = now - ts;
+        lat_sum += lat;
+        lat_min = lat < lat_min ? lat : lat_min;
+        lat_max = lat > lat_max ? lat : lat_max;
+
+        if (p == packets - 1) {
+            uint64_t span = now - start;
+            printf("{\"mode\":\"rx\",\"user_ns\":%llu,\"user_bytes_per_s\":%llu,\"rx_lat_ns_min\":%llu,"
+                   "\"rx_lat_ns_avg\":%llu,\"rx_lat_ns_max\":%llu,", (unsigned long long)span,
+                   span ? (unsigned long long)((uint64_t)size * packets * 1000000000ULL / span) : 0ULL,
+                   (unsigned long long)lat_min, (unsigned long long)(lat_sum / packets),
+                   (unsigned long long)lat_max);
+        }
+    }
+
+    ctrl_dump_json();
+    printf("}\n");
+    fflush(stdout);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *thresholds = "1,8,16", *mode = "tx";
+    unsigned int size = 64, packets = 10000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:c:t:p:n:m:")) != -1) {
+        switch (opt) {
+            case 'd': tty_path = optarg; break;
+            case 'c': ctrl_path = optarg; break;
+            case 't': thresholds = optarg; break;
+            case 'p': size = strtoul(optarg, NULL, 10); break;
+            case 'n': packets = strtoul(optarg, NULL, 10); break;
+            case 'm': mode = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-d tty] [-c ctrl] [-t thr1,thr2...] [-p packet_size] [-n packets] "
+                                "[-m tx|rx]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (size < TS_LEN || size > MAX_PACKET || !packets) {
+        fprintf(stderr, "Packet size must be %d-%d and packets count >0\n", TS_LEN, MAX_PACKET);
+        return 1;
+    }
+
+    int fd = open_tty();
+    if (fd < 0)
+        return 1;
+
+    int out = 0;
+    if (strcmp(mode, "rx") == 0) {
+        out = run_rx(fd, size, packets);
+    } else {
+        char *list = strdup(thresholds), *cursor = list, *thr;
+        while (out == 0 && (thr = strsep(&cursor, ",")) != NULL) {
+            if (*thr)
+                out = run_tx(fd, atoi(thr), size, packets);
+        }
+        free(list);
+    }
+
+    close(fd);
+    return out == 0 ? 0 : 1;
+}